@@ -90,6 +90,17 @@ PYTHON_INCLUDE = /home/welling/anaconda3/include/python3.6
 #PNG_CFLAGS = ????
 #PNG_LIBS = ????
 
+#
+# If POSIX threads are available, uncomment the following lines and give
+# them values something like:
+# PTHREAD_CFLAGS = -DUSE_PTHREAD
+# PTHREAD_LIBS = -lpthread
+# Without them, the multithreaded I/O and compute paths fall back to
+# serial code.
+#
+PTHREAD_CFLAGS = -DUSE_PTHREAD
+PTHREAD_LIBS = -lpthread
+
 #
 # If libcfitsio is available,uncomment the following lines and give them values
 # something like:
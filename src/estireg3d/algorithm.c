@@ -180,6 +180,8 @@ static Optimizer* parseOptMethod(char* s, const int ndim)
     return createNelminTOptimizer(0.02,1.0,tcrit[ndim],12);
   else if (!strcasecmp(s,"praxis"))
     return createPraxisOptimizer(0.000001,0.1);
+  else if (!strcasecmp(s,"lbfgs"))
+    return createLBFGSOptimizer(0.000001,0.01);
   else if (!strcasecmp(s,"none")) return createNoneOptimizer();
   else return NULL;
 }
@@ -262,6 +264,15 @@ int algParseInfoString( Algorithm* alg, const char* string )
     else if (!strcasecmp(tok,"noxonly")) {
       alg->x_only_flag= 0;
     }
+    else if (!strcasecmp(tok,"warm")) {
+      alg->warm_flag= 1;
+    }
+    else if (!strcasecmp(tok,"nowarm")) {
+      alg->warm_flag= 0;
+    }
+    else if (!strncasecmp(tok,"levels=",7)) {
+      if ((alg->n_levels=atoi(tok+7))<1) { free(work); return 0; }
+    }
     else if (!strncasecmp(tok,"opt=",4)) {
       optString= strdup(tok+4);
     }
@@ -326,8 +337,10 @@ int algParseInfoString( Algorithm* alg, const char* string )
 
   /* The algorithm may or may not need a mutualInfo context. */
   for (i=0; i<N_MUTUAL_INFO_CONTEXTS; i++) 
-    if (alg->mutualInfoContext[i]) 
+    if (alg->mutualInfoContext[i]) {
       ent_destroyMIContext(alg->mutualInfoContext[i]);
+      alg->mutualInfoContext[i]= NULL;
+    }
   switch (alg->objective_method) {
   case OBJECTIVE_MSE: break;
   case OBJECTIVE_MI: 
@@ -369,6 +382,8 @@ int algInit( Algorithm* alg, const char* string, const char* progname_in,
   alg->rot_only_flag= 0;
   alg->trans_only_flag= 0;
   alg->x_only_flag= 0;
+  alg->n_levels= 1;
+  alg->warm_flag= 0;
 
   algParseInfoString(alg, string);
 
@@ -419,6 +434,17 @@ const char* algGetInfoString(const Algorithm* alg)
   offset += strlen(scratch);
   if (offset>=sizeof(result)-1) return result;
 
+  if (alg->warm_flag) strcpy(scratch,"warm,");
+  else strcpy(scratch,"nowarm,");
+  strncat(result,scratch,sizeof(result)-(offset+1));
+  offset += strlen(scratch);
+  if (offset>=sizeof(result)-1) return result;
+
+  sprintf(scratch,"levels=%d,",alg->n_levels);
+  strncat(result,scratch,sizeof(result)-(offset+1));
+  offset += strlen(scratch);
+  if (offset>=sizeof(result)-1) return result;
+
   sprintf(scratch,"weight=%s,",weightMethodName(alg->weight_method));
   strncat(result,scratch,sizeof(result)-(offset+1));
   offset += strlen(scratch);
@@ -674,6 +700,44 @@ void algMaybeSmoothImageComplex( Algorithm* alg, FComplex* img,
   if (alg->smooth_flag) algSmoothImageComplex(alg,img,dx,dy,dz,missing,t);
 }
 
+/* This sets the boundary over which we take SSE */
+static void chiSqrBounds(Algorithm* alg, int dx, int dy, int dz,
+			 long* xMin, long* xMax, long* yMin, long* yMax,
+			 long* zMin, long* zMax)
+{
+  if (alg->x_only_flag) {
+    *xMin= 0;
+    *xMax= dx;
+    *yMin= 0;
+    *yMax= dy;
+    *zMin= 0;
+    *zMax= dz;
+  }
+  else if (alg->inplane_flag) {
+    *xMin= 2;
+    *xMax= dx-2;
+    *yMin= 2;
+    *yMax= dy-2;
+    *zMin= 0;
+    *zMax= dz;
+  }
+  else {
+    *xMin= 2;
+    *xMax= dx-2;
+    *yMin= 2;
+    *yMax= dy-2;
+    *zMin= 2;
+    *zMax= dz-2;
+  }
+
+  if (*xMax<=*xMin)
+    Abort("%s: x dimension of %d is not enough for alignment!\n",alg->progname,dx);
+  if (*yMax<=*yMin)
+    Abort("%s: y dimension of %d is not enough for alignment!\n",alg->progname,dy);
+  if (*zMax<=*zMin)
+    Abort("%s: %d slices is not enough for alignment!\n",alg->progname,dz);
+}
+
 /* This routine calculates the current weight function based on the global
  * task info.  This value is ultimately returned by mse().
  */
@@ -687,39 +751,7 @@ double algCalcChiSqr(Algorithm* alg, FComplex* moved_image,
   register double tmp;
   register double tmp1=0.0, tmp2=0.0;
 
-  /* This sets the boundary over which we take SSE */
-  if (alg->x_only_flag) {
-    xMin= 0;
-    xMax= dx;
-    yMin= 0;
-    yMax= dy;
-    zMin= 0;
-    zMax= dz;
-  }
-  else if (alg->inplane_flag) {
-    xMin= 2;
-    xMax= dx-2;
-    yMin= 2;
-    yMax= dy-2;
-    zMin= 0;
-    zMax= dz;
-  }
-  else {
-    xMin= 2;
-    xMax= dx-2;
-    yMin= 2;
-    yMax= dy-2;
-    zMin= 2;
-    zMax= dz-2;
-  }
-
-
-  if (xMax<=xMin)
-    Abort("%s: x dimension of %d is not enough for alignment!\n",alg->progname,dx);
-  if (yMax<=yMin)
-    Abort("%s: y dimension of %d is not enough for alignment!\n",alg->progname,dy);
-  if (zMax<=zMin)
-    Abort("%s: %d slices is not enough for alignment!\n",alg->progname,dz);
+  chiSqrBounds(alg, dx, dy, dz, &xMin, &xMax, &yMin, &yMax, &zMin, &zMax);
 
 #ifdef never
   xMin= dx/4;
@@ -876,6 +908,54 @@ double algCalcChiSqr(Algorithm* alg, FComplex* moved_image,
   return sse;
 }
 
+/* This returns the same value as algCalcChiSqr(), and fills dvalue
+ * with its derivative with respect to the real part of each voxel of
+ * moved_image.  Voxels which do not contribute get zero.
+ */
+double algCalcChiSqrGrad(Algorithm* alg, FComplex* moved_image, 
+			 float* align_image, float* weight_image, int* mask,
+			 char* check, int dx, int dy, int dz, float* dvalue)
+{
+  double sse= 0.0;
+  double norm= 0.0;
+  long x, y, z;
+  long xMin, xMax, yMin, yMax, zMin, zMax;
+  long n= (long)dx*dy*dz;
+  long i;
+  int useCheck= (alg->inner_search_method==SEARCH_TRILIN);
+
+  chiSqrBounds(alg, dx, dy, dz, &xMin, &xMax, &yMin, &yMax, &zMin, &zMax);
+  if (alg->weight_method==WEIGHT_INVALID)
+    Abort("%s: internal error: invalid weight method in algCalcChiSqrGrad!\n",
+	  alg->progname);
+
+  for (i=0; i<n; i++) dvalue[i]= 0.0;
+
+  /* First pass: the sum and the normalization, with dvalue holding the
+   * weighted residual.
+   */
+  for( x = xMin; x < xMax; x++ )
+    for( y = yMin; y < yMax; y++ )
+      for( z = zMin; z < zMax; z++ ) {
+	double weight= ((alg->weight_method==WEIGHT_CONST) ? 1.0
+			: MEM(weight_image,dx,dy,dz,x,y,z));
+	double tmp;
+	if (weight==0.0) continue;
+	if (useCheck && !MEM(check,dx,dy,dz,x,y,z)) continue;
+	tmp= MEM(moved_image,dx,dy,dz,x,y,z).real
+	  - MEM(align_image,dx,dy,dz,x,y,z);
+	sse += weight*tmp*tmp;
+	norm += weight;
+	MEM(dvalue,dx,dy,dz,x,y,z)= weight*tmp;
+      }
+
+  if (norm != 0.0) {
+    sse /= norm;
+    for (i=0; i<n; i++) dvalue[i] *= 2.0/norm;
+  }
+  return sse;
+}
+
 /* This routine calculates the current weight function when mutual information
  * is used, based on the global task info.  This value is ultimately returned 
  * by mse().
@@ -950,14 +1030,16 @@ double algCalcMutualInfo(Algorithm* alg, FComplex* moved_image,
       }
     }
     sum= 0.0;
-    for (iCtx=0; iCtx<N_MUTUAL_INFO_CONTEXTS; iCtx++)
-      sum += ent_calcMaskedMutualInformationFloat(alg->mutualInfoContext[iCtx],
-						  align_image + zMin*dx*dy, 
-						  (float*)(moved_image
-							   +zMin*dx*dy),
-						  mask + zMin*dx*dy, 
-						  dx, dy, (zMax-zMin), 
-						  1, 2, 1);
+    for (iCtx=0; iCtx<N_MUTUAL_INFO_CONTEXTS; iCtx++) {
+      /* The align image and mask are fixed, so they are binned once */
+      if (!ent_getMIReferenceSet(alg->mutualInfoContext[iCtx]))
+	ent_setMIReferenceFloat(alg->mutualInfoContext[iCtx],
+				align_image + zMin*dx*dy, mask + zMin*dx*dy,
+				dx, dy, (zMax-zMin), 1, 1);
+      sum += ent_calcRefMutualInformationFloat(alg->mutualInfoContext[iCtx],
+					       (float*)(moved_image
+							+zMin*dx*dy), 2);
+    }
     return -1.0*sum/(double)N_MUTUAL_INFO_CONTEXTS;
   }
   else {
@@ -997,11 +1079,15 @@ double algCalcMutualInfo(Algorithm* alg, FComplex* moved_image,
       }
     }
     sum= 0.0;
-    for (iCtx=0; iCtx<N_MUTUAL_INFO_CONTEXTS; iCtx++) 
-      sum += ent_calcMutualInformationFloat(alg->mutualInfoContext[iCtx],
-					    align_image + zMin*dx*dy, 
-					    (float*)(moved_image+zMin*dx*dy),
-					    dx, dy, (zMax-zMin), 1, 2);
+    for (iCtx=0; iCtx<N_MUTUAL_INFO_CONTEXTS; iCtx++) {
+      if (!ent_getMIReferenceSet(alg->mutualInfoContext[iCtx]))
+	ent_setMIReferenceFloat(alg->mutualInfoContext[iCtx],
+				align_image + zMin*dx*dy, NULL,
+				dx, dy, (zMax-zMin), 1, 1);
+      sum += ent_calcRefMutualInformationFloat(alg->mutualInfoContext[iCtx],
+					       (float*)(moved_image
+							+zMin*dx*dy), 2);
+    }
     return -1.0*sum/(double)N_MUTUAL_INFO_CONTEXTS;
   }
 }
@@ -1080,12 +1166,15 @@ double algCalcJointEntropy(Algorithm* alg, FComplex* moved_image,
       }
     }
     sum= 0.0;
-    for (iCtx=0; iCtx<N_MUTUAL_INFO_CONTEXTS; iCtx++) 
-      sum += ent_calcMaskedJointEntropyFloat(alg->mutualInfoContext[iCtx],
-					     align_image + zMin*dx*dy, 
-					     (float*)(moved_image+zMin*dx*dy),
-					     mask + zMin*dx*dy, 
-					     dx, dy, (zMax-zMin), 1, 2, 1);
+    for (iCtx=0; iCtx<N_MUTUAL_INFO_CONTEXTS; iCtx++) {
+      /* The align image and mask are fixed, so they are binned once */
+      if (!ent_getMIReferenceSet(alg->mutualInfoContext[iCtx]))
+	ent_setMIReferenceFloat(alg->mutualInfoContext[iCtx],
+				align_image + zMin*dx*dy, mask + zMin*dx*dy,
+				dx, dy, (zMax-zMin), 1, 1);
+      sum += ent_calcRefJointEntropyFloat(alg->mutualInfoContext[iCtx],
+					  (float*)(moved_image+zMin*dx*dy), 2);
+    }
     return sum/(double)N_MUTUAL_INFO_CONTEXTS;
   }
   else {
@@ -1125,11 +1214,14 @@ double algCalcJointEntropy(Algorithm* alg, FComplex* moved_image,
       }
     }
     sum= 0.0;
-    for (iCtx=0; iCtx<N_MUTUAL_INFO_CONTEXTS; iCtx++) 
-      sum += ent_calcJointEntropyFloat(alg->mutualInfoContext[iCtx],
-				     align_image + zMin*dx*dy, 
-				     (float*)(moved_image+zMin*dx*dy),
-				     dx, dy, (zMax-zMin), 1, 2);
+    for (iCtx=0; iCtx<N_MUTUAL_INFO_CONTEXTS; iCtx++) {
+      if (!ent_getMIReferenceSet(alg->mutualInfoContext[iCtx]))
+	ent_setMIReferenceFloat(alg->mutualInfoContext[iCtx],
+				align_image + zMin*dx*dy, NULL,
+				dx, dy, (zMax-zMin), 1, 1);
+      sum += ent_calcRefJointEntropyFloat(alg->mutualInfoContext[iCtx],
+					  (float*)(moved_image+zMin*dx*dy), 2);
+    }
     return sum/(double)N_MUTUAL_INFO_CONTEXTS;
   }
 }
@@ -69,6 +69,7 @@ typedef enum {
   OPT_NELMIN,
   OPT_NELMIN_T,
   OPT_PRAXIS,
+  OPT_LBFGS,
   OPT_NONE,
   OPT_INVALID
 } OptMethod;
@@ -83,6 +84,8 @@ typedef struct algorithm_struct {
   int trans_only_flag;
   int rot_only_flag;
   int x_only_flag;
+  int n_levels;                      /* levels in the resolution pyramid */
+  int warm_flag;                     /* start from a neighbor's result */
   WeightMethod weight_method;
   ObjectiveMethod objective_method;
   double weight_floor;
@@ -120,6 +123,9 @@ void algPrep(); /* called once before using the package */
 double algCalcChiSqr(Algorithm* alg, FComplex* moved_image, 
 		     float* align_image, float* weight_image, int* mask,
 		     char* check, int dx, int dy, int dz);
+double algCalcChiSqrGrad(Algorithm* alg, FComplex* moved_image, 
+			 float* align_image, float* weight_image, int* mask,
+			 char* check, int dx, int dy, int dz, float* dvalue);
 double algCalcJointEntropy(Algorithm* alg, FComplex* moved_image, 
 			   float* align_image, float* weight_image, int* mask,
 			   char* check, int dx, int dy, int dz);
@@ -57,8 +57,51 @@ static char rcsid[] = "$Id: estireg3d.c,v 1.46 2007/04/19 22:32:28 welling Exp $
 /* Notes-
    -We will always take the positive value of w.  This should be OK for 
     typical fMRI displacements.
+   -With levels=n in the algorithm string, the slave keeps a pyramid of
+    reduced copies of the align, weight, and raw images.  Level 0 is the
+    full resolution data.  The search runs coarsest level first, each
+    level starting from the last one's estimate.  The search parameters
+    give shifts in full resolution voxels.  fourier_shift_rot3d() wants
+    voxels of the grid it is given, so mse() and restrt() scale them to
+    the level; linear_shift_rot3d() measures shifts against lx, ly, and
+    lz, which are the same at every level.
+   -With the warm flag, the master hands each task the result for the
+    nearest earlier image that has already come back.  The slave falls
+    back to a start from the identity if that guess leads to a much
+    worse measure, as happens when the subject jerks between images.
+    The measure also jumps when the noise or intensity changes from
+    image to image, and then the identity leads to the same answer, so
+    the fallback first searches only to WARM_PROBE_TOL voxels.  Only
+    if that beats the warm result is it refined at full tolerance.
+   -When obj=mse and both inner and outer methods are trilin, the
+    ScalarFunction also provides the gradient, by way of
+    algCalcChiSqrGrad() and linear_shift_rot3d_grad().  mseGrad()
+    chains that through the guess parameterization in
+    getDGradFromParGrad().  Gradient-based optimizers like L-BFGS use
+    it; the others ignore it.
  */
 
+/* Resolution pyramid limits.  A dimension is only halved if it is even
+ * and the result would be at least MIN_LEVEL_DIM.
+ */
+#define MAX_LEVELS 8
+#define MIN_LEVEL_DIM 8
+
+/* The optimizer tolerance used at reduced resolution levels, in voxels
+ * of that level, unless the requested tolerance is looser.
+ */
+#define LEVEL_TOL 0.1
+
+/* A warm started search is repeated from the identity if its measure
+ * exceeds that of the guess by more than this fraction of its magnitude.
+ */
+#define WARM_MSE_JUMP 0.5
+
+/* The tolerance, in full resolution voxels, of that repeated search
+ * unless the requested tolerance is looser.
+ */
+#define WARM_PROBE_TOL 0.1
+
 typedef struct regpar3d_struct {
   Quat q;
   double x;
@@ -95,6 +138,8 @@ typedef struct Task {
   /* NOTE: any new fields added to this struct should
      also be added to PackTask and UnpackTask */ 
   int t;			/* image number to work on */
+  int warm;			/* if true, start from guess */
+  RegPar3D guess;
 } Task;
 
 typedef struct Result {
@@ -105,6 +150,20 @@ typedef struct Result {
   float mean_squared_error;     /* negative means optimization failed */
 } Result;
 
+typedef struct Level {
+  int dx;
+  int dy;
+  int dz;
+  float* align_image;
+  float* weight_image;
+  int* mask;
+  char* check;
+  FComplex* raw_image;
+  FComplex* raw_prerotated;
+  FComplex* moved_image;
+  float* dvalue;         /* only allocated if the gradient is used */
+} Level;
+
 typedef  double (*ObjectiveFunctionType)(Algorithm* alg, FComplex* moved, 
 					 float* align, float* weight, int* mask, 
 					 char* check, int dx, int dy, int dz);
@@ -122,6 +181,8 @@ int weightUpToDate= 0;
 
 RegPar3D *regpar;       /* array holding the registration parameters
 			   being computed */
+char* regparDone= NULL; /* which entries of regpar are finished */
+unsigned char** inputMissing= NULL; /* missing info for Input ds */
 
 /* GLOBAL VARIABLES FOR SLAVE */
 MRI_Dataset *sInput = NULL;
@@ -129,12 +190,17 @@ FComplex* raw_image= NULL;
 FComplex* raw_prerotated= NULL;
 FComplex* moved_image= NULL;
 char* check= NULL;
+float* dvalue= NULL;
 int* mask= NULL;
 int maskUpToDate= 0;
 ScalarFunction* targetFunc= NULL;
 Quat prerotation;
 double preshift[3];
 unsigned char** missing= NULL; /* will hold missing info */
+Level levels[MAX_LEVELS]; /* levels[0] refers to the buffers above */
+int nLevels= 0;
+Level* lvl= NULL;        /* the level currently being searched */
+long nEvals= 0;          /* calls to mse() at the current level */
 #ifdef never
 FILE* tp;
 #endif
@@ -147,13 +213,18 @@ static FILE* initParFile(char* parfname, char* infname,
 			 char* alignfname, char* stdvfname,
 			 double xv, double yv, double zv);
 static void saveRegParams(FILE* ofile, RegPar3D* p, long t);
+static int findWarmStart(RegPar3D* guess, long t);
 
 /* FORWARD DECLARATIONS FOR SLAVE */
 void SlaveContext();
 void SlaveTask();
 void SlaveFinalize();
-static void estimateAlignment(RegPar3D* par);
+static void buildLevels(void);
+static void setLevel(int i);
+static void estimateAlignment(RegPar3D* par, double tol);
 static double mse(const double* guess, const int npar, void* userHook);
+static double mseGrad(const double* guess, const int npar, double* grad,
+		      void* userHook);
 static void restrt(const double* guess, const int npar, void* userHook);
 static void restrtMatched(const double* guess, const int npar, void* userHook);
 
@@ -170,7 +241,7 @@ void UnpackResult ();
  * making the optimization surface bumpier.
  */
 #define DEFAULT_SEARCH_ALGORITHM \
-   "nosmooth,noinplane,norotonly,notransonly,noxonly,opt=praxis,weight=smoothalign,qual=ssqr,inner=shear4,outer=shear4,obj=mse,wtfloor=0.0"
+   "nosmooth,noinplane,norotonly,notransonly,noxonly,nowarm,levels=1,opt=praxis,weight=smoothalign,qual=ssqr,inner=shear4,outer=shear4,obj=mse,wtfloor=0.0"
 
 static void regpar3d_copy(RegPar3D* out, RegPar3D* in)
 {
@@ -198,6 +269,14 @@ static void regpar3d_invert(RegPar3D* p)
   p->z= tInv[11];
 }
 
+static int allSlicesMissing(unsigned char** miss, long t)
+{
+  int i;
+  for (i=0; i<c.dz; i++)
+    if (!miss[t][i]) return 0;
+  return 1;
+}
+
 static int getCurrentNDim(Algorithm* alg)
 {
   if (alg->x_only_flag) {
@@ -371,6 +450,7 @@ MasterTask (int argc,
     Abort( "Input, alignment, and stdv files must be distinct.\n" );
   }
   Input = mri_open_dataset( c.input_file, MRI_READ );
+  inputMissing= get_missing(Input);
   Align = mri_open_dataset( alignfile, MRI_READ );
   alignMissing= get_missing(Align);
   if (algNeedsStdv(&(c.alg))) {
@@ -448,6 +528,9 @@ MasterTask (int argc,
   /* Allocate parameter storage */
   if (!(regpar= (RegPar3D*)malloc(c.dt*sizeof(RegPar3D))))
     Abort("%s: unable to allocate %d bytes!\n",c.dt*sizeof(RegPar3D));
+  if (!(regparDone= (char*)malloc(c.dt*sizeof(char))))
+    Abort("%s: unable to allocate %d bytes!\n",c.progname,c.dt*sizeof(char));
+  for (i=0; i<c.dt; i++) regparDone[i]= 0;
 
   /* Init parameter file */
   pf= initParFile(parfile, c.input_file, alignfile, stdvfile,
@@ -465,6 +548,7 @@ MasterTask (int argc,
 
   /* Loop through images, doing alignment */
   for( t.t = 0; t.t < c.dt; t.t++ ) {
+    t.warm= (c.alg.warm_flag && findWarmStart(&(t.guess), t.t));
     par_delegate_task();
   }
   par_finish();
@@ -503,6 +587,7 @@ MasterTask (int argc,
   free(c.align_image);
   free(c.weight_image);
   free(regpar);
+  free(regparDone);
 
   /* JENN: figure this out later */
 #ifdef JENN
@@ -543,6 +628,7 @@ void MasterResult (int task_number)
 #endif
 
   regpar[r.t] = r.reg_pars;
+  regparDone[r.t]= !allSlicesMissing(inputMissing, r.t);
 
 #ifdef never
   fprintf(stderr, "q.x = %11.5lg, q.y = %11.5lg, q.z = %11.5lg, q.w = %11.5lg, x = %11.5lg, y = %11.5lg, z = %11.5lg, mse = %11.5lg \n", regpar[r.t].q.x, regpar[r.t].q.y, regpar[r.t].q.z, regpar[r.t].q.w, regpar[r.t].x, regpar[r.t].y, regpar[r.t].z, regpar[r.t].mse);
@@ -553,6 +639,18 @@ void MasterResult (int task_number)
   saveRegParams( pf, &r.reg_pars, r.t );
 }
 
+/* Find the nearest earlier image with a finished alignment */
+static int findWarmStart(RegPar3D* guess, long t)
+{
+  long i;
+  for (i=t-1; i>=0; i--)
+    if (regparDone[i]) {
+      regpar3d_copy(guess, &(regpar[i]));
+      return 1;
+    }
+  return 0;
+}
+
 static FILE* initParFile(char* parfname, char* infname, 
 			 char* alignfname, char* stdvfname,
 			 double xv, double yv, double zv)
@@ -593,11 +691,25 @@ static void saveRegParams(FILE* ofile, RegPar3D* p_in, long t) {
 
 void SlaveFinalize()
 {
+  int i;
+
+  for (i=1; i<nLevels; i++) {
+    free(levels[i].align_image);
+    free(levels[i].weight_image);
+    if (levels[i].mask != NULL) free(levels[i].mask);
+    free(levels[i].check);
+    free(levels[i].raw_image);
+    free(levels[i].raw_prerotated);
+    free(levels[i].moved_image);
+    if (levels[i].dvalue != NULL) free(levels[i].dvalue);
+  }
+  nLevels= 0;
   if (sInput != NULL) mri_close_dataset(sInput);
   if (raw_image != NULL) free(raw_image);
   if (raw_prerotated != NULL) free(raw_prerotated);
   if (moved_image != NULL) free(moved_image);
   if (check != NULL) free(check);
+  if (dvalue != NULL) free(dvalue);
   if (mask != NULL) free(mask);
   if (targetFunc != NULL) {
     targetFunc->destroySelf(targetFunc);
@@ -610,6 +722,14 @@ void SlaveFinalize()
 #endif
 }
 
+/* The MSE gradient is only available if no prerotation is involved */
+static int gradientAvailable()
+{
+  return (c.alg.objective_method==OBJECTIVE_MSE
+	  && c.alg.inner_search_method==SEARCH_TRILIN
+	  && c.alg.outer_search_method==SEARCH_TRILIN);
+}
+
 void SlaveContext ()
 {
   ObjectiveFunctionType objectiveFunction= NULL;
@@ -645,11 +765,17 @@ void SlaveContext ()
 	    c.progname,c.dx*c.dy*c.dz*sizeof(int));
     maskUpToDate= 0; /* since weight has just been updated */
   }
+  if (gradientAvailable()) {
+    if (!(dvalue= (float*)malloc(c.dx*c.dy*c.dz*sizeof(float))))
+      Abort("%s: unable to allocate %d bytes!\n",
+	    c.progname,c.dx*c.dy*c.dz*sizeof(float));
+  }
 #ifdef never
   if (!(tp= fopen("align_data","w"))) {
     Abort("%s: unable to open align_data for writing!\n",c.progname);
   }
 #endif
+  buildLevels();
 
   /* Based on the algorithm information in the context, build the
    * ScalarFunction object that will be optimized.
@@ -661,7 +787,12 @@ void SlaveContext ()
   default: Abort("%s: internal error: unknown objective method!\n",
 		 c.progname);
   }
-  if (c.alg.inner_search_method == c.alg.outer_search_method) {
+  if (gradientAvailable()) {
+    targetFunc= buildGradientScalarFunction( mse, mseGrad, restrtMatched, 
+					     getCurrentNDim(&(c.alg)), 
+					     (void*)objectiveFunction );
+  }
+  else if (c.alg.inner_search_method == c.alg.outer_search_method) {
     targetFunc= buildSimpleScalarFunction( mse, restrtMatched, 
 					   getCurrentNDim(&(c.alg)), 
 					   (void*)objectiveFunction );
@@ -673,10 +804,74 @@ void SlaveContext ()
   }
 }
 
+static int halveDim(int n)
+{
+  if (n%2==0 && n/2>=MIN_LEVEL_DIM) return n/2;
+  else return n;
+}
+
+static void buildLevels()
+{
+  Level* l;
+  Level* prev;
+
+  levels[0].dx= c.dx;
+  levels[0].dy= c.dy;
+  levels[0].dz= c.dz;
+  levels[0].align_image= c.align_image;
+  levels[0].weight_image= c.weight_image;
+  levels[0].mask= mask;
+  levels[0].check= check;
+  levels[0].raw_image= raw_image;
+  levels[0].raw_prerotated= raw_prerotated;
+  levels[0].moved_image= moved_image;
+  levels[0].dvalue= dvalue;
+  nLevels= 1;
+
+  while (nLevels<c.alg.n_levels && nLevels<MAX_LEVELS) {
+    long n;
+    prev= &(levels[nLevels-1]);
+    l= &(levels[nLevels]);
+    l->dx= halveDim(prev->dx);
+    l->dy= halveDim(prev->dy);
+    l->dz= halveDim(prev->dz);
+    if (l->dx==prev->dx && l->dy==prev->dy && l->dz==prev->dz) break;
+    n= l->dx*l->dy*l->dz;
+    if (!(l->align_image= (float*)malloc(n*sizeof(float)))
+	|| !(l->weight_image= (float*)malloc(n*sizeof(float)))
+	|| !(l->check= (char*)malloc(n*sizeof(char)))
+	|| !(l->raw_image= (FComplex*)malloc(n*sizeof(FComplex)))
+	|| !(l->raw_prerotated= (FComplex*)malloc(n*sizeof(FComplex)))
+	|| !(l->moved_image= (FComplex*)malloc(n*sizeof(FComplex))))
+      Abort("%s: unable to allocate level %d!\n",c.progname,nLevels);
+    if (algNeedsMask(&(c.alg))) {
+      if (!(l->mask= (int*)malloc(n*sizeof(int))))
+	Abort("%s: unable to allocate %d bytes!\n",
+	      c.progname,n*sizeof(int));
+    }
+    else l->mask= NULL;
+    if (dvalue != NULL) {
+      if (!(l->dvalue= (float*)malloc(n*sizeof(float))))
+	Abort("%s: unable to allocate %d bytes!\n",
+	      c.progname,n*sizeof(float));
+    }
+    else l->dvalue= NULL;
+    shrinkImage(l->align_image, c.align_image, c.dx, c.dy, c.dz, 
+		l->dx, l->dy, l->dz);
+    boxShrinkImage(l->weight_image, prev->weight_image, 
+		   prev->dx, prev->dy, prev->dz, l->dx, l->dy, l->dz);
+    nLevels++;
+  }
+  if (c.debugLevel && nLevels<c.alg.n_levels)
+    Message("%s: only %d resolution levels are possible\n",
+	    c.progname,nLevels);
+  lvl= &(levels[0]);
+}
+
 void SlaveTask ()
 {
+  double tol= c.alg.opt->getTol(c.alg.opt);
   int i;
-  int all_slices_missing;
 
   if (c.debugLevel)
     Message("Image %ld...\n",t);
@@ -691,15 +886,30 @@ void SlaveTask ()
   r.reg_pars.x= r.reg_pars.y= r.reg_pars.z= 0.0;
 
   /* optimize if any slice is not missing */
-  all_slices_missing= 1;
-  for (i=0; i<c.dz; i++)
-    if (!missing[t.t][i]) {
-      all_slices_missing= 0;
-      break;
+  if (!allSlicesMissing(missing, t.t)) {
+    for (i=1; i<nLevels; i++)
+      shrinkImageComplex(levels[i].raw_image, raw_image, c.dx, c.dy, c.dz,
+			 levels[i].dx, levels[i].dy, levels[i].dz);
+    if (t.warm) {
+      RegPar3D cold;
+      double probeTol= WARM_PROBE_TOL/c.dx;
+      if (probeTol<tol) probeTol= tol;
+      regpar3d_copy(&cold, &(r.reg_pars));
+      regpar3d_copy(&(r.reg_pars), &(t.guess));
+      estimateAlignment( &r.reg_pars, tol );
+      if (r.reg_pars.mse > t.guess.mse + WARM_MSE_JUMP*fabs(t.guess.mse)) {
+	if (c.debugLevel)
+	  Message("Warm start from mse %lg gave %lg; trying identity\n",
+		  t.guess.mse, r.reg_pars.mse);
+	estimateAlignment( &cold, probeTol );
+	if (cold.mse < r.reg_pars.mse) {
+	  estimateAlignment( &cold, tol );
+	  if (cold.mse < r.reg_pars.mse) regpar3d_copy(&(r.reg_pars), &cold);
+	}
+      }
     }
-  if (!all_slices_missing)
-    estimateAlignment( &r.reg_pars);
-  
+    else estimateAlignment( &r.reg_pars, tol );
+  }
 }
 
 static void getParFromDGuess(RegPar3D* par, const double* guess)
@@ -828,41 +1038,142 @@ static int getDGuessFromPar( double* dguess, const RegPar3D* par )
   return getCurrentNDim(&(c.alg));
 }
 
-static void estimateAlignment( RegPar3D* par)
+/* Derivative of g/(1+|g|), the map from guess to quaternion component */
+static double dSquash(double g)
+{
+  double d= 1.0+fabs(g);
+  return 1.0/(d*d);
+}
+
+/* Given dpar, the derivatives with respect to q.x, q.y, q.z, q.w, x, y,
+ * and z (taking the components of q as independent), this fills dgrad
+ * with the derivatives with respect to the guess that produced par.
+ */
+static void getDGradFromParGrad(double* dgrad, const double* dpar,
+				const RegPar3D* par, const double* guess)
+{
+  double dq[3];
+
+  /* q.w depends on the other components, since q is a unit quaternion */
+  dq[0]= dpar[0];
+  dq[1]= dpar[1];
+  dq[2]= dpar[2];
+  if (par->q.w>0.0) {
+    dq[0] -= dpar[3]*par->q.x/par->q.w;
+    dq[1] -= dpar[3]*par->q.y/par->q.w;
+    dq[2] -= dpar[3]*par->q.z/par->q.w;
+  }
+
+  if (c.alg.x_only_flag) {
+    dgrad[0]= c.dx*dpar[4];
+  }
+  else if (c.alg.inplane_flag) {
+    if (c.alg.rot_only_flag) {
+      dgrad[0]= dq[2]*dSquash(guess[0]);
+    }
+    else if (c.alg.trans_only_flag) {
+      dgrad[0]= c.dx*dpar[4];
+      dgrad[1]= c.dy*dpar[5];
+    }
+    else {
+      dgrad[0]= dq[2]*dSquash(guess[0]);
+      dgrad[1]= c.dx*dpar[4];
+      dgrad[2]= c.dy*dpar[5];
+    }
+  }
+  else {
+    if (c.alg.rot_only_flag) {
+      dgrad[0]= dq[0]*dSquash(guess[0]);
+      dgrad[1]= dq[1]*dSquash(guess[1]);
+      dgrad[2]= dq[2]*dSquash(guess[2]);
+    }
+    else if (c.alg.trans_only_flag) {
+      dgrad[0]= c.dx*dpar[4];
+      dgrad[1]= c.dy*dpar[5];
+      dgrad[2]= c.dz*dpar[6];
+    }
+    else {
+      dgrad[0]= dq[0]*dSquash(guess[0]);
+      dgrad[1]= dq[1]*dSquash(guess[1]);
+      dgrad[2]= dq[2]*dSquash(guess[2]);
+      dgrad[3]= c.dx*dpar[4];
+      dgrad[4]= c.dy*dpar[5];
+      dgrad[5]= c.dz*dpar[6];
+    }
+  }
+}
+
+/* Make level i the one searched by mse() and restrt() */
+static void setLevel(int i)
 {
-  double dguess[MAX_DOF];
-  double mse= -1.0;
   long x,y,z;
+  int iCtx;
+
+  lvl= &(levels[i]);
 
   quat_identity(&(prerotation));
   preshift[0]= preshift[1]= preshift[2]= 0.0;
   /* Update the raw_prerotated image to be identical to the raw image,
    * since the initial pre-transformation is the identity.
    */
-  for (x=0; x<c.dx; x++)
-    for (y=0; y<c.dy; y++)
-      for (z=0; z<c.dz; z++) {
-	MEM(raw_prerotated,c.dx,c.dy,c.dz,x,y,z).real= 
-	  MEM(raw_image,c.dx,c.dy,c.dz,x,y,z).real;
-	MEM(raw_prerotated,c.dx,c.dy,c.dz,x,y,z).imag= 
-	  MEM(raw_image,c.dx,c.dy,c.dz,x,y,z).imag;
+  for (x=0; x<lvl->dx; x++)
+    for (y=0; y<lvl->dy; y++)
+      for (z=0; z<lvl->dz; z++) {
+	MEM(lvl->raw_prerotated,lvl->dx,lvl->dy,lvl->dz,x,y,z).real= 
+	  MEM(lvl->raw_image,lvl->dx,lvl->dy,lvl->dz,x,y,z).real;
+	MEM(lvl->raw_prerotated,lvl->dx,lvl->dy,lvl->dz,x,y,z).imag= 
+	  MEM(lvl->raw_image,lvl->dx,lvl->dy,lvl->dz,x,y,z).imag;
       }
 
   /* In this geometry, all the "check" data should be 1 */
-  for (x=0; x<c.dx; x++)
-    for (y=0; y<c.dy; y++)
-      for (z=0; z<c.dz; z++) {
-	MEM(check,c.dx,c.dy,c.dz,x,y,z)= 1;
+  for (x=0; x<lvl->dx; x++)
+    for (y=0; y<lvl->dy; y++)
+      for (z=0; z<lvl->dz; z++) {
+	MEM(lvl->check,lvl->dx,lvl->dy,lvl->dz,x,y,z)= 1;
       }
 
+  /* The binned reference image belongs to a single level */
+  if (nLevels>1)
+    for (iCtx=0; iCtx<N_MUTUAL_INFO_CONTEXTS; iCtx++)
+      if (c.alg.mutualInfoContext[iCtx] != NULL)
+	ent_clearMIReference(c.alg.mutualInfoContext[iCtx]);
+
+  nEvals= 0;
+}
+
+/* tol is the optimizer tolerance for the full resolution search */
+static void estimateAlignment( RegPar3D* par, double tol )
+{
+  double dguess[MAX_DOF];
+  double mse= -1.0;
+  double optTol= c.alg.opt->getTol(c.alg.opt);
+  int i;
+
   /* If a mask is necessary, compute it from the weights */
   if (!maskUpToDate) {
-    algMaybeBuildMask(&(c.alg),c.weight_image,mask,c.dx,c.dy,c.dz);
+    for (i=0; i<nLevels; i++)
+      algMaybeBuildMask(&(c.alg),levels[i].weight_image,levels[i].mask,
+			levels[i].dx,levels[i].dy,levels[i].dz);
     maskUpToDate= 1;
   }
 
+  /* Search from the coarsest level to full resolution, each level
+   * starting where the last left off.  Coarse estimates need only be
+   * good to about the size of their voxels.
+   */
   getDGuessFromPar(dguess,par);
-  (void)c.alg.opt->go(c.alg.opt, targetFunc, dguess, getCurrentNDim(&(c.alg)), &mse);
+  for (i=nLevels-1; i>=0; i--) {
+    setLevel(i);
+    if (i>0 && tol<LEVEL_TOL/lvl->dx)
+      c.alg.opt->setTol(c.alg.opt, LEVEL_TOL/lvl->dx);
+    else c.alg.opt->setTol(c.alg.opt, tol);
+    (void)c.alg.opt->go(c.alg.opt, targetFunc, dguess, 
+			getCurrentNDim(&(c.alg)), &mse);
+    if (c.debugLevel)
+      Message("Level %d (%d by %d by %d): %ld evaluations -> mse %lg\n",
+	      i, lvl->dx, lvl->dy, lvl->dz, nEvals, mse);
+  }
+  c.alg.opt->setTol(c.alg.opt, optTol);
   getParFromDGuess(par,dguess);
   par->mse= mse;
 
@@ -901,6 +1212,7 @@ static double mse( const double* guess, const int npar, void* userHook )
   RegPar3D lclPar;
   ObjectiveFunctionType objectiveFunction= (ObjectiveFunctionType)userHook;
 
+  nEvals++;
   if (reallyBig==0.0) {
       reallyBig= sqrt(SLAMCH("o"));
   }
@@ -955,42 +1267,50 @@ static double mse( const double* guess, const int npar, void* userHook )
 	    q.x,q.y,q.z,q.w,xshift,yshift,zshift);
 #endif
     
+    /* Shifts so far are in full resolution voxels */
+    if (c.alg.inner_search_method != SEARCH_TRILIN) {
+      xshift *= (double)lvl->dx/c.dx;
+      yshift *= (double)lvl->dy/c.dy;
+      zshift *= (double)lvl->dz/c.dz;
+    }
+
     /* Move the raw data into position */
     switch (c.alg.inner_search_method) {
     case SEARCH_TRILIN:
       linear_shift_rot3d( &q, xshift, yshift, zshift, 
-			  raw_prerotated, moved_image, 
-			  check, c.dx, c.dy, c.dz,
+			  lvl->raw_prerotated, lvl->moved_image, 
+			  lvl->check, lvl->dx, lvl->dy, lvl->dz,
 			  c.lx, c.ly, c.lz, 
 			  0 );
       break;
     case SEARCH_SHEAR4_FFT:
       fshrot3d_set( FR3D_SHEAR_PATTERN, FR3D_SHEAR_4 );
       fourier_shift_rot3d( &q, xshift, yshift, zshift, 
-			   raw_prerotated, moved_image, 
-			   c.dx, c.dy, c.dz,
+			   lvl->raw_prerotated, lvl->moved_image, 
+			   lvl->dx, lvl->dy, lvl->dz,
 			   c.lx, c.ly, c.lz, 1 );
       break;
     case SEARCH_SHEAR7_FFT:
       fshrot3d_set( FR3D_SHEAR_PATTERN, FR3D_SHEAR_7 );
       fourier_shift_rot3d( &q, xshift, yshift, zshift, 
-			   raw_prerotated, moved_image, 
-			   c.dx, c.dy, c.dz,
+			   lvl->raw_prerotated, lvl->moved_image, 
+			   lvl->dx, lvl->dy, lvl->dz,
 			   c.lx, c.ly, c.lz, 1 );
       break;
     case SEARCH_SHEAR13_FFT:
       fshrot3d_set( FR3D_SHEAR_PATTERN, FR3D_SHEAR_13 );
       fourier_shift_rot3d( &q, xshift, yshift, zshift, 
-			   raw_prerotated, moved_image, 
-			   c.dx, c.dy, c.dz,
+			   lvl->raw_prerotated, lvl->moved_image, 
+			   lvl->dx, lvl->dy, lvl->dz,
 			   c.lx, c.ly, c.lz, 1 );
       break;
     case SEARCH_INVALID:
       Abort("%s: internal error: bad search method in mse!\n",c.progname);
     }
     
-    chisqr= objectiveFunction(&(c.alg), moved_image, c.align_image, c.weight_image,
-			      mask, check, c.dx, c.dy, c.dz);
+    chisqr= objectiveFunction(&(c.alg), lvl->moved_image, lvl->align_image,
+			      lvl->weight_image, lvl->mask, lvl->check,
+			      lvl->dx, lvl->dy, lvl->dz);
     
     if (c.debugLevel>1) {
 
@@ -1002,11 +1322,80 @@ static double mse( const double* guess, const int npar, void* userHook )
   return( chisqr );
 }
 
+/* As mse(), but also returning the gradient.  This is only used when
+ * gradientAvailable() is true, so the prerotation is the identity and
+ * the objective is algCalcChiSqr().
+ */
+static double mseGrad( const double* guess, const int npar, double* grad,
+		       void* userHook )
+{
+  Quat q;
+  double xshift, yshift, zshift;
+  double chisqr;
+  double dpar[7];
+  static double reallyBig= 0.0;
+  RegPar3D lclPar;
+
+  nEvals++;
+  if (reallyBig==0.0) {
+      reallyBig= sqrt(SLAMCH("o"));
+  }
+
+  /* Unpack the input info */
+  getParFromDGuess(&lclPar,guess);
+  q= lclPar.q;
+  xshift= lclPar.x;
+  yshift= lclPar.y;
+  zshift= lclPar.z;
+
+  /* The same barrier as mse(), with its gradient */
+  if ((xshift>0.5*c.dx) || (xshift<-0.5*c.dx) 
+      || (yshift>0.5*c.dy) || (yshift<-0.5*c.dy) 
+      || (zshift>0.5*c.dz) || (zshift<-0.5*c.dz)
+      || (q.x>=1.0 || q.y >= 1.0 || q.z >= 1.0)
+      || (q.x<=-1.0 || q.y <= -1.0 || q.z <= -1.0)) {
+    chisqr= reallyBig*(xshift*xshift + yshift*yshift + zshift*zshift
+		     + q.x*q.x + q.y*q.y + q.z*q.z);
+    dpar[0]= 2.0*reallyBig*q.x;
+    dpar[1]= 2.0*reallyBig*q.y;
+    dpar[2]= 2.0*reallyBig*q.z;
+    dpar[3]= 0.0;
+    dpar[4]= 2.0*reallyBig*xshift;
+    dpar[5]= 2.0*reallyBig*yshift;
+    dpar[6]= 2.0*reallyBig*zshift;
+    if (c.debugLevel>1) {
+      Message("mseGrad: (%g %g %g %g %g %g) breaks cell boundary-> chisqr= %g\n",
+	      q.x, q.y, q.z, xshift, yshift, zshift, chisqr);
+    }
+  }
+  else {
+    quat_normalize(&q);
+    linear_shift_rot3d( &q, xshift, yshift, zshift, 
+			lvl->raw_prerotated, lvl->moved_image, 
+			lvl->check, lvl->dx, lvl->dy, lvl->dz,
+			c.lx, c.ly, c.lz, 0 );
+    chisqr= algCalcChiSqrGrad(&(c.alg), lvl->moved_image, lvl->align_image,
+			      lvl->weight_image, lvl->mask, lvl->check,
+			      lvl->dx, lvl->dy, lvl->dz, lvl->dvalue);
+    linear_shift_rot3d_grad( &q, xshift, yshift, zshift,
+			     lvl->raw_prerotated, lvl->dvalue,
+			     lvl->dx, lvl->dy, lvl->dz,
+			     c.lx, c.ly, c.lz, dpar );
+    if (c.debugLevel>1) {
+      Message("mseGrad: trying (%.14g %.14g %.14g %.14g %.14g %.14g) -> chisqr= %.14g\n",
+	      q.x, q.y, q.z, xshift, yshift, zshift, chisqr);
+    }
+  }
+
+  getDGradFromParGrad(grad, dpar, &lclPar, guess);
+  return( chisqr );
+}
 
 static void restrt( const double* guess, const int npar, void* userHook )
 {
   RegPar3D lclPar;
   Quat q;
+  double xshift, yshift, zshift;
 
   /* Unpack the input info */
   getParFromDGuess(&lclPar,guess);
@@ -1035,40 +1424,43 @@ static void restrt( const double* guess, const int npar, void* userHook )
 	    q.x, q.y, q.z, q.w,
 	    preshift[0],preshift[1],preshift[2]);
 
+  /* preshift is in full resolution voxels */
+  xshift= preshift[0];
+  yshift= preshift[1];
+  zshift= preshift[2];
+  if (c.alg.outer_search_method != SEARCH_TRILIN) {
+    xshift *= (double)lvl->dx/c.dx;
+    yshift *= (double)lvl->dy/c.dy;
+    zshift *= (double)lvl->dz/c.dz;
+  }
+
   switch (c.alg.outer_search_method) {
   case SEARCH_TRILIN:
-    linear_shift_rot3d( &q, preshift[0], preshift[1],
-			preshift[2],
-			raw_image, raw_prerotated, 
-			check, 
-			c.dx, c.dy, c.dz,
+    linear_shift_rot3d( &q, xshift, yshift, zshift,
+			lvl->raw_image, lvl->raw_prerotated, 
+			lvl->check, 
+			lvl->dx, lvl->dy, lvl->dz,
 			c.lx, c.ly, c.lz, 0 );
     break;
   case SEARCH_SHEAR4_FFT:
     fshrot3d_set( FR3D_SHEAR_PATTERN, FR3D_SHEAR_4 );
-    fourier_shift_rot3d( &q, 
-			 preshift[0],preshift[1],
-			 preshift[2],
-			 raw_image, raw_prerotated, 
-			 c.dx, c.dy, c.dz,
+    fourier_shift_rot3d( &q, xshift, yshift, zshift,
+			 lvl->raw_image, lvl->raw_prerotated, 
+			 lvl->dx, lvl->dy, lvl->dz,
 			 c.lx, c.ly, c.lz, 1 );
     break;
   case SEARCH_SHEAR7_FFT:
     fshrot3d_set( FR3D_SHEAR_PATTERN, FR3D_SHEAR_7 );
-    fourier_shift_rot3d( &q, 
-			 preshift[0],preshift[1],
-			 preshift[2],
-			 raw_image, raw_prerotated, 
-			 c.dx, c.dy, c.dz,
+    fourier_shift_rot3d( &q, xshift, yshift, zshift,
+			 lvl->raw_image, lvl->raw_prerotated, 
+			 lvl->dx, lvl->dy, lvl->dz,
 			 c.lx, c.ly, c.lz, 1 );
     break;
   case SEARCH_SHEAR13_FFT:
     fshrot3d_set( FR3D_SHEAR_PATTERN, FR3D_SHEAR_13 );
-    fourier_shift_rot3d( &q, 
-			 preshift[0],preshift[1],
-			 preshift[2],
-			 raw_image, raw_prerotated, 
-			 c.dx, c.dy, c.dz,
+    fourier_shift_rot3d( &q, xshift, yshift, zshift,
+			 lvl->raw_image, lvl->raw_prerotated, 
+			 lvl->dx, lvl->dy, lvl->dz,
 			 c.lx, c.ly, c.lz, 1 );
     break;
   case SEARCH_INVALID:
@@ -1079,8 +1471,8 @@ static void restrt( const double* guess, const int npar, void* userHook )
     /* call mse to print out value using newly prerotated volumes */
     (void)mse(guess,npar,userHook);
   }
-  algMaybeSmoothImageComplex( &(c.alg), raw_prerotated, c.dx, c.dy, c.dz,
-			      missing, t.t );
+  algMaybeSmoothImageComplex( &(c.alg), lvl->raw_prerotated, 
+			      lvl->dx, lvl->dy, lvl->dz, missing, t.t );
 
 }
 
@@ -1108,8 +1500,8 @@ static void restrtMatched( const double* guess, const int npar,
     /* call mse to print out value using newly prerotated volumes */
     (void)mse(guess,npar,userHook);
   }
-  algMaybeSmoothImageComplex( &(c.alg), raw_prerotated, c.dx, c.dy, c.dz,
-			      missing, t.t );
+  algMaybeSmoothImageComplex( &(c.alg), lvl->raw_prerotated, 
+			      lvl->dx, lvl->dy, lvl->dz, missing, t.t );
 }
 
 /* UTILITY FUNCTIONS */
@@ -1176,12 +1568,24 @@ void
 PackTask ()
 {
   par_pkint(t.t);
+  par_pkint(t.warm);
+  par_pkdoublearray((double*)&t.guess.q, 4);
+  par_pkdouble(t.guess.x);
+  par_pkdouble(t.guess.y);
+  par_pkdouble(t.guess.z);
+  par_pkdouble(t.guess.mse);
 }
 
 void
 UnpackTask ()
 {
   t.t= par_upkint();
+  t.warm= par_upkint();
+  par_upkdoublearray((double*)&t.guess.q, 4);
+  t.guess.x= par_upkdouble();
+  t.guess.y= par_upkdouble();
+  t.guess.z= par_upkdouble();
+  t.guess.mse= par_upkdouble();
 }
 
 void
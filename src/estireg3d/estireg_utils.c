@@ -214,3 +214,95 @@ void copyImage( float *image, float* source, int dx, int dy, int dz )
   for (i=0; i<length; i++) image[i]= source[i];
 }
 
+
+/* Reduce a complex image to dims (ldx,ldy,ldz) by keeping only the
+ * central block of its spectrum.  Each reduced dim must be no larger
+ * than the original.  The mean is preserved and the imaginary part of
+ * the result is discarded, since the inputs here are real images.
+ */
+void shrinkImageComplex( FComplex* out, FComplex* in, int dx, int dy, int dz,
+			 int ldx, int ldy, int ldz )
+{
+  FComplex* spectrum;
+  long x;
+  long y;
+  long z;
+  long xOff= dx/2 - ldx/2;
+  long yOff= dy/2 - ldy/2;
+  long zOff= dz/2 - ldz/2;
+  double scale= sqrt(((double)ldx*ldy*ldz)/((double)dx*dy*dz));
+
+  if (!(spectrum= (FComplex*)malloc(dx*dy*dz*sizeof(FComplex))))
+    Abort("shrinkImageComplex: unable to allocate %d bytes!\n",
+	  dx*dy*dz*sizeof(FComplex));
+  memcpy(spectrum, in, dx*dy*dz*sizeof(FComplex));
+  fft3d_many(spectrum, 1, dx*dy*dz, dx, dy, dz, +1, "xyz");
+  for (x=0; x<ldx; x++)
+    for (y=0; y<ldy; y++)
+      for (z=0; z<ldz; z++)
+	MEM(out,ldx,ldy,ldz,x,y,z)= 
+	  MEM(spectrum,dx,dy,dz,x+xOff,y+yOff,z+zOff);
+  fft3d_many(out, 1, ldx*ldy*ldz, ldx, ldy, ldz, -1, "xyz");
+  for (x=0; x<ldx*ldy*ldz; x++) {
+    out[x].real *= scale;
+    out[x].imag= 0.0;
+  }
+  free(spectrum);
+}
+
+/* Real version of shrinkImageComplex */
+void shrinkImage( float* out, float* in, int dx, int dy, int dz,
+		  int ldx, int ldy, int ldz )
+{
+  FComplex* cIn;
+  FComplex* cOut;
+  long i;
+
+  if (!(cIn= (FComplex*)malloc(dx*dy*dz*sizeof(FComplex))))
+    Abort("shrinkImage: unable to allocate %d bytes!\n",
+	  dx*dy*dz*sizeof(FComplex));
+  if (!(cOut= (FComplex*)malloc(ldx*ldy*ldz*sizeof(FComplex))))
+    Abort("shrinkImage: unable to allocate %d bytes!\n",
+	  ldx*ldy*ldz*sizeof(FComplex));
+  for (i=0; i<dx*dy*dz; i++) {
+    cIn[i].real= in[i];
+    cIn[i].imag= 0.0;
+  }
+  shrinkImageComplex(cOut, cIn, dx, dy, dz, ldx, ldy, ldz);
+  for (i=0; i<ldx*ldy*ldz; i++) out[i]= cOut[i].real;
+  free(cIn);
+  free(cOut);
+}
+
+/* Reduce an image by averaging blocks of voxels.  Each original dim
+ * must be a multiple of the corresponding reduced dim.  This is used
+ * for weights, where the ringing of k-space truncation would produce
+ * spurious negative values.
+ */
+void boxShrinkImage( float* out, float* in, int dx, int dy, int dz,
+		     int ldx, int ldy, int ldz )
+{
+  int fx= dx/ldx;
+  int fy= dy/ldy;
+  int fz= dz/ldz;
+  long x;
+  long y;
+  long z;
+  long i;
+  long j;
+  long k;
+
+  if (fx*ldx != dx || fy*ldy != dy || fz*ldz != dz)
+    Abort("boxShrinkImage: %dx%dx%d does not evenly divide %dx%dx%d!\n",
+	  ldx,ldy,ldz,dx,dy,dz);
+  for (x=0; x<ldx; x++)
+    for (y=0; y<ldy; y++)
+      for (z=0; z<ldz; z++) {
+	double sum= 0.0;
+	for (i=0; i<fx; i++)
+	  for (j=0; j<fy; j++)
+	    for (k=0; k<fz; k++)
+	      sum += MEM(in,dx,dy,dz,fx*x+i,fy*y+j,fz*z+k);
+	MEM(out,ldx,ldy,ldz,x,y,z)= sum/(fx*fy*fz);
+      }
+}
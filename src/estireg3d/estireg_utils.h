@@ -47,5 +47,14 @@ void invertStdvImage( float *image, int dx, int dy, int dz );
 
 void copyImage( float *image, float* source, int dx, int dy, int dz );
 
+void shrinkImageComplex( FComplex* out, FComplex* in, int dx, int dy, int dz,
+			 int ldx, int ldy, int ldz );
+
+void shrinkImage( float* out, float* in, int dx, int dy, int dz,
+		  int ldx, int ldy, int ldz );
+
+void boxShrinkImage( float* out, float* in, int dx, int dy, int dz,
+		     int ldx, int ldy, int ldz );
+
 
 
@@ -59,6 +59,11 @@
 static char rcsid[] = "$Id: estiwarp.c,v 1.10 2007/04/19 22:32:28 welling Exp $";
 
 /* Notes-
+   -When obj=mse, the ScalarFunction also provides the gradient, by way
+    of algCalcChiSqrGrad() and linwarp_warp_grad().  mseGrad() carries
+    it back through the prewarp, so it is valid whether or not the
+    inner and outer methods match.  Gradient-based optimizers like
+    L-BFGS use it; the others ignore it.
  */
 
 typedef struct warppar_struct {
@@ -127,6 +132,7 @@ FComplex* raw_image;
 FComplex* raw_prerotated;
 FComplex* moved_image;
 char* check;
+float* dvalue= NULL;
 int* mask= NULL;
 int maskUpToDate= 0;
 ScalarFunction* targetFunc= NULL;
@@ -148,6 +154,8 @@ void SlaveTask();
 void SlaveFinalize();
 static void estimateAlignment(WarpPar* par);
 static double mse(const double* guess, const int npar, void* userHook);
+static double mseGrad(const double* guess, const int npar, double* grad,
+		      void* userHook);
 static void restrt(const double* guess, const int npar, void* userHook);
 static void restrtMatched(const double* guess, const int npar, void* userHook);
 
@@ -496,6 +504,7 @@ void SlaveFinalize()
   if (raw_prerotated != NULL) free(raw_prerotated);
   if (moved_image != NULL) free(moved_image);
   if (check != NULL) free(check);
+  if (dvalue != NULL) free(dvalue);
   if (mask != NULL) free(mask);
   if (targetFunc != NULL) {
     targetFunc->destroySelf(targetFunc);
@@ -531,10 +540,12 @@ void SlaveContext ()
 	    c.progname,c.dx*c.dy*c.dz*sizeof(int));
     maskUpToDate= 0; /* since weight has just been updated */
   }
+  if (c.alg.objective_method==OBJECTIVE_MSE) {
+    if (!(dvalue= (float*)malloc(c.dx*c.dy*c.dz*sizeof(float))))
+      Abort("%s: unable to allocate %d bytes!\n",
+	    c.progname,c.dx*c.dy*c.dz*sizeof(float));
+  }
 
-  /* Based on the algorithm information in the context, build the
-   * ScalarFunction object that will be optimized.
-   */
   /* Based on the algorithm information in the context, build the
    * ScalarFunction object that will be optimized.
    */
@@ -545,7 +556,17 @@ void SlaveContext ()
   default: Abort("%s: internal error: unknown objective method!\n",
 		 c.progname);
   }
-  if (c.alg.inner_search_method == c.alg.outer_search_method) {
+  if (dvalue != NULL) {
+    if (c.alg.inner_search_method == c.alg.outer_search_method)
+      targetFunc= buildGradientScalarFunction( mse, mseGrad, restrtMatched, 
+					       getCurrentNDim(&(c.alg)), 
+					       (void*)objectiveFunction );
+    else
+      targetFunc= buildGradientScalarFunction( mse, mseGrad, restrt, 
+					       getCurrentNDim(&(c.alg)), 
+					       (void*)objectiveFunction );
+  }
+  else if (c.alg.inner_search_method == c.alg.outer_search_method) {
     targetFunc= buildSimpleScalarFunction( mse, restrtMatched, 
 					   getCurrentNDim(&(c.alg)), 
 					   (void*)objectiveFunction );
@@ -674,6 +695,27 @@ static int getDGuessFromPar( double* guess, const WarpPar* par )
   return getCurrentNDim(&(c.alg));
 }
 
+/* The reverse of getDGuessFromPar(), for derivatives */
+static void getDGradFromParGrad( double* grad, const Transform dpar )
+{
+  int i;
+  if (c.alg.x_only_flag) {
+    grad[0]= dpar[0];
+    grad[1]= dpar[3];
+  }
+  else if (c.alg.inplane_flag) {
+    grad[0]= dpar[0];
+    grad[1]= dpar[1];
+    grad[2]= dpar[3];
+    grad[3]= dpar[4];
+    grad[4]= dpar[5];
+    grad[5]= dpar[7];
+  }
+  else {
+    for (i=0; i<12; i++) grad[i]= dpar[i];
+  }
+}
+
 static void estimateAlignment( WarpPar* par)
 {
   double dguess[MAX_DOF];
@@ -811,6 +853,74 @@ static double mse( const double* guess, const int npar, void* userHook )
   return( chisqr );
 }
 
+/* As mse(), but also returning the gradient.  This is only used when
+ * the objective is algCalcChiSqr().
+ */
+static double mseGrad( const double* guess, const int npar, double* grad,
+		       void* userHook )
+{
+  WarpPar lclPar;
+  Transform tGrad;
+  Transform dpar;
+  double chisqr;
+  static double reallyBig= 0.0;
+  int i, j, k;
+
+  if (reallyBig==0.0) {
+      reallyBig= sqrt(SLAMCH("o"));
+  }
+
+  /* Unpack the input info */
+  getParFromDGuess(&lclPar,guess);
+
+  /* The same barrier as mse(), with its gradient.  The bottom row of
+   * the transform is always 0 0 0 1, so the shifts are just v[3],
+   * v[7], and v[11].
+   */
+  for (i=0; i<16; i++) dpar[i]= 0.0;
+  if ((lclPar.v[3]>0.5*c.dx) || (lclPar.v[3]<-0.5*c.dx) 
+      || (lclPar.v[7]>0.5*c.dy) || (lclPar.v[7]<-0.5*c.dy) 
+      || (lclPar.v[11]>0.5*c.dz) || (lclPar.v[11]<-0.5*c.dz)) {
+    chisqr= reallyBig*(lclPar.v[3]*lclPar.v[3] + lclPar.v[7]*lclPar.v[7]
+		       + lclPar.v[11]*lclPar.v[11]);
+    dpar[3]= 2.0*reallyBig*lclPar.v[3];
+    dpar[7]= 2.0*reallyBig*lclPar.v[7];
+    dpar[11]= 2.0*reallyBig*lclPar.v[11];
+    if (c.debugLevel) {
+      Message("mseGrad: this transform breaks cell boundary-> chisqr= %g\n",
+	      chisqr);
+      trans_dump(stderr,lclPar.v);
+    }
+  }
+  else {
+    /* Compensate for current prewarp */
+    trans_mult_right(lclPar.v, inv_prewarp_trans);
+
+    linwarp_warp( lclPar.v, raw_prerotated, moved_image,
+		  check, c.dx, c.dy, c.dz, c.lx, c.ly, c.lz, 0 );
+    chisqr= algCalcChiSqrGrad(&(c.alg), moved_image, c.align_image, 
+			      c.weight_image, mask, check, 
+			      c.dx, c.dy, c.dz, dvalue);
+    linwarp_warp_grad( lclPar.v, raw_prerotated, dvalue, 
+		       c.dx, c.dy, c.dz, c.lx, c.ly, c.lz, tGrad );
+
+    /* The warp used was v times the inverse prewarp */
+    for (i=0; i<3; i++)
+      for (j=0; j<4; j++)
+	for (k=0; k<4; k++)
+	  dpar[4*i+j] += tGrad[4*i+k]*inv_prewarp_trans[4*j+k];
+
+    if (c.debugLevel>1) {
+      Message("mseGrad: adjusted transform:\n");
+      trans_dump(stderr,lclPar.v);
+      Message("mseGrad: this trans gives chisqr= %.14g\n",chisqr);
+    }
+  }
+
+  getDGradFromParGrad(grad, dpar);
+  return( chisqr );
+}
+
 static void restrt( const double* guess, const int npar, void* userHook )
 {
   if (c.alg.outer_search_method == c.alg.inner_search_method) { 
@@ -0,0 +1,265 @@
+/************************************************************
+ *                                                          *
+ *  batchmult.c                                             *
+ *                                                          *
+ *  Permission is hereby granted to any individual or       *
+ *  institution for use, copying, or redistribution of      *
+ *  this code and associated documentation, provided        *
+ *  that such code and documentation are not sold for       *
+ *  profit and the following copyright notice is retained   *
+ *  in the code and documentation:                          *
+ *     Copyright (c) 1998 Department of Statistics,         *
+ *                        Carnegie Mellon University        *
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ ************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mri.h"
+#include "fmri.h"
+#include "misc.h"
+#include "lapack.h"
+
+/* Notes-
+ * -batch_matmult() forms out_s = left_s * right for every slice s.
+ *  One small GEMM per slice spends most of its time loading right
+ *  and starting up, so the slices are batched:
+ *  -If fast is 1, each left slice is one row and the slices taken
+ *   together are the transpose of a single matrix, as is the output.
+ *   GEMMs with transposed operands do ROW_CALL_SLICES at a time.
+ *  -If fast is small, slices are packed into panels so that the
+ *   panel's rows are (fast index, slice) pairs.  One GEMM then does
+ *   every slice in the panel, and the product is unpacked.  Panels
+ *   are sized to stay in cache, and right is reused for all of them.
+ *  -Slices BATCH_PACK_MAX_FAST or more wide are already reasonable
+ *   GEMMs and are done one at a time; packing them measured slower.
+ * -A batch may cover several foreach entries, each with its own right
+ *  matrix; the slices are then handled a run of group at a time.
+ * -The slices are divided evenly among the threads; each thread has
+ *  its own panel buffer.  Small batches are not worth threading.
+ * -BLAS may round the edge rows and columns of a GEMM differently
+ *  from the interior, so a result depends on where its GEMM call
+ *  starts and ends.  Every call therefore covers a fixed run of
+ *  call_slices() slices from the start of its right matrix's group,
+ *  and thread shares begin on those boundaries.  The answer is then
+ *  the same bits for any thread count.
+ * -Complex products use ZGEMM with the plain (not conjugate)
+ *  transpose, so they match mri_matmult's complex multiplication.
+ */
+
+#define PANEL_DOUBLES (32*1024)
+#define MIN_THREADED_FLOPS (1024*1024)
+#define ROW_CALL_SLICES 512 /* slices per GEMM call when fast is 1 */
+
+typedef struct batch_job_struct {
+  const double* left;
+  const double* right;
+  double* out;
+  long fast;
+  long summed;
+  long nright;
+  long group; /* slices sharing each right matrix */
+  int complex_flg;
+  long first;  /* first slice for this thread */
+  long nslices; /* slices for this thread */
+} BatchJob;
+
+static void gemm( int complex_flg, char* transa, char* transb,
+		  int m, int n, int k, const double* a, int lda,
+		  const double* b, int ldb, double* c, int ldc )
+{
+  double one[2]= {1.0, 0.0};
+  double zero[2]= {0.0, 0.0};
+
+  if (complex_flg)
+    ZGEMM( transa, transb, &m, &n, &k, one, (double*)a, &lda,
+	   (double*)b, &ldb, zero, c, &ldc );
+  else
+    DGEMM( transa, transb, &m, &n, &k, one, (double*)a, &lda,
+	   (double*)b, &ldb, zero, c, &ldc );
+}
+
+static long call_slices( const BatchJob* job )
+{
+  /* How many slices each GEMM call covers; panels stay in cache */
+  int elt= (job->complex_flg ? 2 : 1);
+  long n;
+  if (job->fast==1) return ROW_CALL_SLICES;
+  if (job->fast>=BATCH_PACK_MAX_FAST) return 1;
+  n= PANEL_DOUBLES/(elt*job->fast*(job->summed+job->nright));
+  if (n<1) n= 1;
+  return n;
+}
+
+static long share_start( const BatchJob* job, long nslices, int nshares,
+			 int i )
+{
+  /* fthr_share_start(), moved back to the start of a GEMM call */
+  long s= fthr_share_start(nslices, nshares, i);
+  long base= (s/job->group)*job->group;
+  long step= call_slices(job);
+  if (i==nshares) return nslices;
+  return base + ((s-base)/step)*step;
+}
+
+static void pack_panel( const BatchJob* job, const double* left,
+			long nslices, double* a )
+{
+  /* a[(i+fast*p) + fast*nslices*q] = left[i + fast*(q+summed*p)] */
+  int elt= (job->complex_flg ? 2 : 1);
+  long rowsize= elt*job->fast;
+  long rows= rowsize*nslices;
+  long p;
+  long q;
+
+  for (p=0; p<nslices; p++) {
+    const double* src= left + rowsize*job->summed*p;
+    double* dst= a + rowsize*p;
+    for (q=0; q<job->summed; q++)
+      memcpy(dst+rows*q, src+rowsize*q, rowsize*sizeof(double));
+  }
+}
+
+static void unpack_panel( const BatchJob* job, const double* c,
+			  long nslices, double* out )
+{
+  /* out[i + fast*(r+nright*p)] = c[(i+fast*p) + fast*nslices*r] */
+  int elt= (job->complex_flg ? 2 : 1);
+  long rowsize= elt*job->fast;
+  long rows= rowsize*nslices;
+  long p;
+  long r;
+
+  for (p=0; p<nslices; p++) {
+    const double* src= c + rowsize*p;
+    double* dst= out + rowsize*job->nright*p;
+    for (r=0; r<job->nright; r++)
+      memcpy(dst+rowsize*r, src+rows*r, rowsize*sizeof(double));
+  }
+}
+
+static void run_segment( const BatchJob* job, const double* left,
+			 const double* right, double* out, long nslices )
+{
+  int elt= (job->complex_flg ? 2 : 1);
+  long left_step= elt*job->fast*job->summed;
+  long out_step= elt*job->fast*job->nright;
+  long step= call_slices(job);
+  int fast= (int)job->fast;
+  int se= (int)job->summed;
+  int nr= (int)job->nright;
+  double* a= NULL;
+  double* c= NULL;
+  long s;
+
+  if (job->fast>1 && job->fast<BATCH_PACK_MAX_FAST) {
+    long panel= (step<nslices) ? step : nslices;
+    long bufsize= elt*job->fast*panel*(job->summed+job->nright);
+    if (!(a= (double*)malloc(bufsize*sizeof(double))))
+      Abort("batch_matmult: unable to allocate %ld bytes!\n",
+	    bufsize*sizeof(double));
+    c= a + elt*job->fast*panel*job->summed;
+  }
+
+  for (s=0; s<nslices; s += step) {
+    long n= (nslices-s < step) ? nslices-s : step;
+    if (job->fast==1) {
+      gemm( job->complex_flg, "t", "n", nr, (int)n, se,
+	    right, se, left+s*left_step, se, out+s*out_step, nr );
+    }
+    else if (job->fast>=BATCH_PACK_MAX_FAST) {
+      gemm( job->complex_flg, "n", "n", fast, nr, se,
+	    left+s*left_step, fast, right, se, out+s*out_step, fast );
+    }
+    else {
+      int rows= (int)(job->fast*n);
+      pack_panel(job, left+s*left_step, n, a);
+      gemm( job->complex_flg, "n", "n", rows, nr, se,
+	    a, rows, right, se, c, rows );
+      unpack_panel(job, c, n, out+s*out_step);
+    }
+  }
+  if (a) free(a);
+}
+
+static void run_job( BatchJob* job )
+{
+  int elt= (job->complex_flg ? 2 : 1);
+  long left_step= elt*job->fast*job->summed;
+  long out_step= elt*job->fast*job->nright;
+  long right_step= elt*job->summed*job->nright;
+  long s= job->first;
+  long end= job->first + job->nslices;
+
+  while (s<end) {
+    long group_end= (s/job->group + 1)*job->group;
+    long n= ((group_end<end) ? group_end : end) - s;
+    run_segment(job, job->left+s*left_step,
+		job->right+(s/job->group)*right_step,
+		job->out+s*out_step, n);
+    s += n;
+  }
+}
+
+static void batch_worker( void* arg )
+{
+  run_job((BatchJob*)arg);
+}
+
+void batch_matmult( const double* left, const double* right, double* out,
+		    long nslices, long fast, long summed, long nright,
+		    long group, int complex_flg, int nthreads )
+{
+  BatchJob job;
+  double flops= (double)nslices*fast*summed*nright;
+
+  job.left= left;
+  job.right= right;
+  job.out= out;
+  job.fast= fast;
+  job.summed= summed;
+  job.nright= nright;
+  job.group= (group>0) ? group : nslices;
+  job.complex_flg= complex_flg;
+  job.first= 0;
+  job.nslices= nslices;
+
+  nthreads= fthr_count("batch_matmult", nthreads);
+  if (nthreads>nslices/call_slices(&job)) 
+    nthreads= (int)(nslices/call_slices(&job));
+  if (nthreads<1) nthreads= 1;
+  if (flops < MIN_THREADED_FLOPS) nthreads= 1;
+
+  if (nthreads>1) {
+    BatchJob* jobs;
+    int i;
+
+    if (!(jobs= (BatchJob*)malloc(nthreads*sizeof(BatchJob))))
+      Abort("batch_matmult: unable to allocate %ld bytes!\n",
+	    nthreads*sizeof(BatchJob));
+    for (i=0; i<nthreads; i++) {
+      jobs[i]= job;
+      jobs[i].first= share_start(&job, nslices, nthreads, i);
+      jobs[i].nslices= share_start(&job, nslices, nthreads, i+1)
+	- jobs[i].first;
+    }
+    fthr_run_jobs(jobs, nthreads, sizeof(BatchJob), batch_worker);
+    free(jobs);
+    return;
+  }
+
+  run_job(&job);
+}
@@ -0,0 +1,51 @@
+/************************************************************
+ *                                                          *
+ *  batchmult.h                                             *
+ *                                                          *
+ *  Permission is hereby granted to any individual or       *
+ *  institution for use, copying, or redistribution of      *
+ *  this code and associated documentation, provided        *
+ *  that such code and documentation are not sold for       *
+ *  profit and the following copyright notice is retained   *
+ *  in the code and documentation:                          *
+ *     Copyright (c) 1998 Department of Statistics,         *
+ *                        Carnegie Mellon University        *
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ ************************************************************/
+/* Header file for batchmult.c */
+
+#ifndef INCL_BATCHMULT_H
+#define INCL_BATCHMULT_H 1
+
+/* Slices at least this wide are multiplied one GEMM at a time */
+#define BATCH_PACK_MAX_FAST 8
+
+/* batch_matmult() multiplies each of nslices left matrices by a
+ * right matrix.  Slice s of left is a fast by summed matrix starting
+ * at left+fast*summed*s, and slice s of the product starts at
+ * out+fast*nright*s.  Each run of group slices shares one summed by
+ * nright right matrix; the one for slice s starts at
+ * right+summed*nright*(s/group).  All are in column major order,
+ * which is the layout mri_matmult uses for each left_slow index.
+ * If complex_flg is set each element is a (re,im) pair of doubles
+ * and the sizes count pairs.  The slices are divided among nthreads
+ * threads; 0 means one per processor.  The result is bitwise the
+ * same for any thread count.
+ */
+void batch_matmult( const double* left, const double* right, double* out,
+		    long nslices, long fast, long summed, long nright,
+		    long group, int complex_flg, int nthreads );
+
+#endif
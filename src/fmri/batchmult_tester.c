@@ -0,0 +1,184 @@
+/************************************************************
+ *                                                          *
+ *  batchmult_tester.c                                      *
+ *                                                          *
+ *  Permission is hereby granted to any individual or       *
+ *  institution for use, copying, or redistribution of      *
+ *  this code and associated documentation, provided        *
+ *  that such code and documentation are not sold for       *
+ *  profit and the following copyright notice is retained   *
+ *  in the code and documentation:                          *
+ *     Copyright (c) 1998 Department of Statistics,         *
+ *                        Carnegie Mellon University        *
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ ************************************************************/
+
+/* This program checks batch_matmult() against a naive product.  The
+ * cases between them take each of its paths: transposed GEMMs for
+ * fast==1, packed panels for small fast blocks (with a short final
+ * panel), one GEMM per slice for wide slices, and ZGEMM for complex
+ * data.  Several cases have a right matrix per group of slices with
+ * a short final group, and each case is run with 1 to MAX_THREADS
+ * threads and with one thread per processor.  Every thread count
+ * must give exactly the bits that one thread gives.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "mri.h"
+#include "fmri.h"
+
+#define MAX_THREADS 4
+#define TOLERANCE 1.0e-12
+
+typedef struct test_case_struct {
+  const char* name;
+  long nslices;
+  long fast;
+  long summed;
+  long nright;
+  long group; /* 0 means one right matrix for all slices */
+} TestCase;
+
+static TestCase cases[]= {
+  { "fast 1", 1000, 1, 50, 30, 0 },
+  { "fast 1, groups", 1001, 1, 40, 30, 300 },
+  { "packed", 2003, 7, 20, 5, 0 },
+  { "packed, groups", 2003, 3, 30, 12, 250 },
+  { "packed, one slice per panel", 20, 7, 700, 4000, 0 },
+  { "wide", 101, 80, 20, 10, 0 },
+  { "wide, groups", 101, 100, 20, 10, 33 },
+  { "small", 3, 2, 2, 2, 0 },
+};
+#define N_CASES (sizeof(cases)/sizeof(TestCase))
+
+static double* random_doubles( long n )
+{
+  double* result= (double*)malloc(n*sizeof(double));
+  long i;
+
+  if (!result) {
+    fprintf(stderr,"Unable to allocate %ld doubles!\n",n);
+    exit(-1);
+  }
+  for (i=0; i<n; i++) result[i]= 2.0*drand48()-1.0;
+  return result;
+}
+
+/* out_s = left_s * right_g in column major order, with g= s/group */
+static void naive_matmult( const double* left, const double* right, 
+			   double* out, long nslices, long fast, long summed,
+			   long nright, long group, int complex_flg )
+{
+  int elt= (complex_flg ? 2 : 1);
+  long s;
+  long i;
+  long q;
+  long r;
+
+  for (s=0; s<nslices; s++) {
+    const double* l= left + elt*fast*summed*s;
+    const double* m= right + elt*summed*nright*(s/group);
+    double* o= out + elt*fast*nright*s;
+    for (i=0; i<fast; i++)
+      for (r=0; r<nright; r++) {
+	double re= 0.0;
+	double im= 0.0;
+	for (q=0; q<summed; q++) {
+	  if (complex_flg) {
+	    const double* a= l + 2*(i+fast*q);
+	    const double* b= m + 2*(q+summed*r);
+	    re += a[0]*b[0] - a[1]*b[1];
+	    im += a[0]*b[1] + a[1]*b[0];
+	  }
+	  else re += l[i+fast*q]*m[q+summed*r];
+	}
+	if (complex_flg) {
+	  o[2*(i+fast*r)]= re;
+	  o[2*(i+fast*r)+1]= im;
+	}
+	else o[i+fast*r]= re;
+      }
+  }
+}
+
+static int run_case( const TestCase* c, int complex_flg )
+{
+  int elt= (complex_flg ? 2 : 1);
+  long group= (c->group>0) ? c->group : c->nslices;
+  long ngroups= (c->nslices+group-1)/group;
+  long nOut= elt*c->fast*c->nright*c->nslices;
+  double* left= random_doubles(elt*c->fast*c->summed*c->nslices);
+  double* right= random_doubles(elt*c->summed*c->nright*ngroups);
+  double* ref= random_doubles(nOut);
+  double* out= random_doubles(nOut);
+  double* serial= random_doubles(nOut);
+  int failures= 0;
+  int nthreads;
+  long i;
+
+  naive_matmult(left, right, ref, c->nslices, c->fast, c->summed,
+		c->nright, group, complex_flg);
+  batch_matmult(left, right, serial, c->nslices, c->fast, c->summed,
+		c->nright, c->group, complex_flg, 1);
+  for (nthreads=0; nthreads<=MAX_THREADS; nthreads++) {
+    double maxErr= 0.0;
+    for (i=0; i<nOut; i++) out[i]= -999.0;
+    batch_matmult(left, right, out, c->nslices, c->fast, c->summed,
+		  c->nright, c->group, complex_flg, nthreads);
+    for (i=0; i<nOut; i++) {
+      double err= fabs(out[i]-ref[i])/c->summed;
+      if (!(err<=maxErr)) maxErr= err;
+    }
+    printf("%-28s %s threads %d: max error %.3g", c->name, 
+	   (complex_flg ? "complex" : "real   "), nthreads, maxErr);
+    if (!(maxErr<=TOLERANCE)) {
+      printf("   FAILED\n");
+      failures++;
+    }
+    else if (memcmp(out, serial, nOut*sizeof(double))) {
+      printf("   FAILED (differs from one thread)\n");
+      failures++;
+    }
+    else printf("   ok\n");
+  }
+  free(left);
+  free(right);
+  free(ref);
+  free(out);
+  free(serial);
+  return failures;
+}
+
+int main( int argc, char* argv[] )
+{
+  int failures= 0;
+  int complex_flg;
+  int i;
+
+  srand48(1234);
+  for (i=0; i<N_CASES; i++)
+    for (complex_flg=0; complex_flg<2; complex_flg++)
+      failures += run_case(&(cases[i]), complex_flg);
+
+  if (failures) {
+    printf("%d cases FAILED\n",failures);
+    exit(1);
+  }
+  printf("batch_matmult agrees with the naive product\n");
+  return 0;
+}
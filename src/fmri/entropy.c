@@ -32,6 +32,9 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "mri.h"
 #include "fmri.h"
 #include "misc.h"
@@ -158,6 +161,9 @@ MutualInfoContext* ent_createMIContext()
   result->num_of_boxes= 0;
   result->ec1= ent_createContext();
   result->ec2= ent_createContext();
+  result->reference= NULL;
+  result->partialVolume= 0;
+  result->nThreads= 1;
 
   return result;
 }
@@ -167,6 +173,8 @@ void ent_destroyMIContext(MutualInfoContext* ctx)
   if (ctx->histogram) free(ctx->histogram);
   if (ctx->ec1) ent_destroyContext(ctx->ec1);
   if (ctx->ec2) ent_destroyContext(ctx->ec2);
+  ent_clearMIReference(ctx);
+  free(ctx);
 }
 
 void ent_setMIDebug(MutualInfoContext* ctx, int val)
@@ -196,11 +204,13 @@ int ent_getMIVerbose(const MutualInfoContext* ctx)
 void ent_setMIMin1(MutualInfoContext* ctx, double val)
 {
   ent_setMin(ctx->ec1,val);
+  ent_clearMIReference(ctx);
 }
 
 void ent_setMIMax1(MutualInfoContext* ctx, double val)
 {
   ent_setMax(ctx->ec1,val);
+  ent_clearMIReference(ctx);
 }
 
 double ent_getMIMin1(const MutualInfoContext* ctx)
@@ -226,11 +236,13 @@ int ent_getMIMax1Set(const MutualInfoContext* ctx)
 void ent_unsetMIMin1(MutualInfoContext* ctx)
 {
   ent_unsetMin(ctx->ec1);
+  ent_clearMIReference(ctx);
 }
 
 void ent_unsetMIMax1(MutualInfoContext* ctx)
 {
   ent_unsetMax(ctx->ec1);
+  ent_clearMIReference(ctx);
 }
 
 void ent_setMIMin2(MutualInfoContext* ctx, double val)
@@ -279,6 +291,7 @@ void ent_setMINBins(MutualInfoContext* ctx, const long nbins)
   ctx->num_of_boxes= nbins;
   ent_setNBins(ctx->ec1,nbins);
   ent_setNBins(ctx->ec2,nbins);
+  ent_clearMIReference(ctx);
 }
 
 long ent_getMINBins(const MutualInfoContext* ctx)
@@ -1319,3 +1332,424 @@ double ent_calcMutualInformationFloat( MutualInfoContext* mc,
   return mutualInformation;
 }
 
+
+/*
+ * Mutual information against a fixed reference image
+ */
+
+/* Notes-
+ * -A registration evaluates MI between one fixed reference image and
+ *  many trial placements of the moving image.  ent_setMIReferenceFloat()
+ *  bins the reference once, keeping the histogram row of each voxel
+ *  under the mask, its entropy, and a table of c*log(c) for every
+ *  possible count.  Each evaluation then makes a single pass over the
+ *  moving image.  The joint histogram has an extra row for reference
+ *  samples outside the binned range, so the moving image's marginal
+ *  is just the column sums.
+ * -With n samples in all, the entropy of counts c is 
+ *  (T*log(n) - sum c*log(c))/n where T is the sum of the counts, so
+ *  no log is needed per bin.  Counts falling outside the binned range
+ *  are dropped but still count in n, as in the routines above, so the
+ *  results match them to rounding.
+ * -Partial volume binning splits each moving sample between the two
+ *  nearest bins in proportion to its distance from their centers,
+ *  which makes MI a smooth function of the transform.  The counts are
+ *  then fractional and need a log each.  The pair of bins is updated
+ *  with one SSE2 add where available.
+ * -The samples may be divided among several threads, each with its
+ *  own histogram, and the histograms are summed at the end.
+ */
+
+#define MAX_CLOGC_TABLE (1L<<22)
+#define MIN_THREADED_SAMPLES 65536
+
+struct mi_reference_struct {
+  long nSamples;   /* voxels under the mask */
+  long* pix;       /* pixel index of each, or NULL if unmasked */
+  int* row;        /* offset of each one's histogram row */
+  long nbins;
+  double entropy1; /* entropy of the reference, in bits */
+  double* cLogC;   /* c*log(c) for c up to nSamples, or NULL */
+  void* hists;     /* (nbins+1)*nbins counts per thread */
+  int nHists;
+};
+
+typedef struct mi_job_struct {
+  const struct mi_reference_struct* ref;
+  const float* img2;
+  long stride2;
+  double min2;
+  double scale2;
+  int partialVolume;
+  long first;
+  long last;
+  void* hist;
+} MIJob;
+
+static void freeMIReference( struct mi_reference_struct* ref )
+{
+  if (ref->pix) free(ref->pix);
+  free(ref->row);
+  if (ref->cLogC) free(ref->cLogC);
+  if (ref->hists) free(ref->hists);
+  free(ref);
+}
+
+void ent_clearMIReference(MutualInfoContext* ctx)
+{
+  if (ctx->reference) freeMIReference(ctx->reference);
+  ctx->reference= NULL;
+}
+
+int ent_getMIReferenceSet(const MutualInfoContext* ctx)
+{
+  return (ctx->reference != NULL);
+}
+
+void ent_setMIPartialVolume(MutualInfoContext* ctx, int val)
+{
+  ctx->partialVolume= val;
+}
+
+int ent_getMIPartialVolume(const MutualInfoContext* ctx)
+{
+  return ctx->partialVolume;
+}
+
+void ent_setMIThreads(MutualInfoContext* ctx, int val)
+{
+  ctx->nThreads= (val>1) ? val : 1;
+}
+
+int ent_getMIThreads(const MutualInfoContext* ctx)
+{
+  return ctx->nThreads;
+}
+
+void ent_setMIReferenceFloat( MutualInfoContext* mc, const float* img1, 
+			      const int* mask, long dx, long dy, long dz, 
+			      long stride1, long maskstride )
+{
+  struct mi_reference_struct* ref;
+  long pixels= dx*dy*dz;
+  long nSamples;
+  long nb;
+  long* hist1;
+  double range1;
+  double scale1;
+  long i;
+  long n;
+
+  if (stride1<1) Abort("setMIReferenceFloat: nonsense stride1!\n");
+  if (mask && maskstride<1) 
+    Abort("setMIReferenceFloat: nonsense maskstride!\n");
+
+  ent_clearMIReference(mc);
+  if (mask) nSamples= scanMaskedRegionFloat(mc->ec1, img1, mask, pixels,
+					    stride1, maskstride);
+  else {
+    scanRegionFloat(mc->ec1, img1, pixels, stride1);
+    nSamples= pixels;
+  }
+  if (mc->num_of_boxes==0) ent_setMINBins(mc, pickNBins(nSamples,1,NULL));
+  nb= mc->num_of_boxes;
+
+  if (!(ref=(struct mi_reference_struct*)
+	malloc(sizeof(struct mi_reference_struct))))
+    Abort("setMIReferenceFloat: unable to allocate %d bytes!\n",
+	  sizeof(struct mi_reference_struct));
+  ref->nSamples= nSamples;
+  ref->nbins= nb;
+  ref->pix= NULL;
+  ref->cLogC= NULL;
+  ref->hists= NULL;
+  ref->nHists= 0;
+  if (!(ref->row=(int*)malloc((nSamples>0 ? nSamples : 1)*sizeof(int))))
+    Abort("setMIReferenceFloat: unable to allocate %ld bytes!\n",
+	  nSamples*sizeof(int));
+  if (mask) {
+    if (!(ref->pix=(long*)malloc((nSamples>0 ? nSamples : 1)*sizeof(long))))
+      Abort("setMIReferenceFloat: unable to allocate %ld bytes!\n",
+	    nSamples*sizeof(long));
+    n= 0;
+    for (i=0; i<pixels; i++) 
+      if (mask[i*maskstride] != 0) ref->pix[n++]= i;
+  }
+
+  /* A reference with no range bins nowhere, as the routines above do */
+  range1= mc->ec1->max - mc->ec1->min;
+  scale1= (range1 != 0.0) ? 1.0/(range1/(nb-1)) : 0.0;
+  if (!(hist1=(long*)malloc(nb*sizeof(long))))
+    Abort("setMIReferenceFloat: unable to allocate %ld bytes!\n",
+	  nb*sizeof(long));
+  for (i=0; i<nb; i++) hist1[i]= 0;
+  for (n=0; n<nSamples; n++) {
+    long p= (ref->pix ? ref->pix[n] : n);
+    long bin= (long)((img1[p*stride1]-mc->ec1->min)*scale1);
+    if (range1 != 0.0 && bin>=0 && bin<nb) {
+      ref->row[n]= (int)(bin*nb);
+      hist1[bin]++;
+    }
+    else ref->row[n]= (int)(nb*nb);
+  }
+
+  if (nSamples<=MAX_CLOGC_TABLE) {
+    if (!(ref->cLogC=(double*)malloc((nSamples+1)*sizeof(double))))
+      Abort("setMIReferenceFloat: unable to allocate %ld bytes!\n",
+	    (nSamples+1)*sizeof(double));
+    ref->cLogC[0]= 0.0;
+    for (n=1; n<=nSamples; n++) ref->cLogC[n]= n*log((double)n);
+  }
+
+  ref->entropy1= 0.0;
+  if (nSamples>0 && range1 != 0.0) {
+    double total= 0.0;
+    double sum= 0.0;
+    for (i=0; i<nb; i++) 
+      if (hist1[i]) {
+	total += hist1[i];
+	sum += hist1[i]*log((double)hist1[i]);
+      }
+    ref->entropy1= (total*log((double)nSamples) - sum)
+      /(nSamples*log(2.0));
+  }
+  free(hist1);
+
+  if (mc->debugFlag)
+    fprintf(stderr,"MI reference: %ld samples in %ld bins, entropy %lg\n",
+	    nSamples, nb, ref->entropy1);
+  mc->reference= ref;
+}
+
+static void binMovingSamples( MIJob* job )
+{
+  const struct mi_reference_struct* ref= job->ref;
+  const float* img2= job->img2;
+  const long* pix= ref->pix;
+  const int* row= ref->row;
+  long stride2= job->stride2;
+  double min2= job->min2;
+  double scale2= job->scale2;
+  long nb= ref->nbins;
+  long cells= (nb+1)*nb;
+  long n;
+
+  if (job->partialVolume) {
+    double* hist= (double*)job->hist;
+    double top= (double)(nb-1);
+    for (n=0; n<cells; n++) hist[n]= 0.0;
+    for (n=job->first; n<job->last; n++) {
+      double t= (img2[(pix ? pix[n] : n)*stride2]-min2)*scale2;
+      double* cell;
+      long lo;
+      double f;
+      if (!(t>=0.0 && t<=top)) continue;
+      lo= (long)t;
+      if (lo==nb-1) lo--;
+      f= t-lo;
+      cell= hist + row[n] + lo;
+#ifdef __SSE2__
+      _mm_storeu_pd(cell, _mm_add_pd(_mm_loadu_pd(cell), 
+				     _mm_set_pd(f, 1.0-f)));
+#else
+      cell[0] += 1.0-f;
+      cell[1] += f;
+#endif
+    }
+  }
+  else {
+    int* hist= (int*)job->hist;
+    for (n=0; n<cells; n++) hist[n]= 0;
+    if (pix) {
+      for (n=job->first; n<job->last; n++) {
+	long bin2= (long)((img2[pix[n]*stride2]-min2)*scale2);
+	if (bin2>=0 && bin2<nb) hist[row[n]+bin2]++;
+      }
+    }
+    else {
+      for (n=job->first; n<job->last; n++) {
+	long bin2= (long)((img2[n*stride2]-min2)*scale2);
+	if (bin2>=0 && bin2<nb) hist[row[n]+bin2]++;
+      }
+    }
+  }
+}
+
+static void miWorker( void* arg )
+{
+  binMovingSamples((MIJob*)arg);
+}
+
+static double bitsFromSums( long nSamples, double total, double sum )
+{
+  /* Entropy of counts summing to total, with sum the sum of c*log(c) */
+  return (total*log((double)nSamples) - sum)/(nSamples*log(2.0));
+}
+
+static void countEntropies( const struct mi_reference_struct* ref, 
+			    int partialVolume, double* entropy2, 
+			    double* jointEntropy )
+{
+  long nb= ref->nbins;
+  double* marg;
+  double total= 0.0;
+  double sum= 0.0;
+  long i;
+  long j;
+
+  if (!(marg=(double*)malloc(nb*sizeof(double))))
+    Abort("countEntropies: unable to allocate %ld bytes!\n",
+	  nb*sizeof(double));
+  for (j=0; j<nb; j++) marg[j]= 0.0;
+
+  if (partialVolume) {
+    const double* hist= (const double*)ref->hists;
+    for (i=0; i<nb; i++)
+      for (j=0; j<nb; j++) {
+	double c= hist[i*nb+j];
+	if (c>0.0) {
+	  total += c;
+	  sum += c*log(c);
+	  marg[j] += c;
+	}
+      }
+    for (j=0; j<nb; j++) marg[j] += hist[nb*nb+j];
+  }
+  else {
+    const int* hist= (const int*)ref->hists;
+    const double* cLogC= ref->cLogC;
+    for (i=0; i<nb; i++)
+      for (j=0; j<nb; j++) {
+	int c= hist[i*nb+j];
+	if (c) {
+	  total += c;
+	  sum += (cLogC ? cLogC[c] : c*log((double)c));
+	  marg[j] += c;
+	}
+      }
+    for (j=0; j<nb; j++) marg[j] += hist[nb*nb+j];
+  }
+  *jointEntropy= bitsFromSums(ref->nSamples, total, sum);
+
+  total= 0.0;
+  sum= 0.0;
+  for (j=0; j<nb; j++) 
+    if (marg[j]>0.0) {
+      total += marg[j];
+      if (!partialVolume && ref->cLogC) sum += ref->cLogC[(long)marg[j]];
+      else sum += marg[j]*log(marg[j]);
+    }
+  *entropy2= bitsFromSums(ref->nSamples, total, sum);
+  free(marg);
+}
+
+static void calcRefEntropies( MutualInfoContext* mc, const float* img2,
+			      long stride2, double* entropy2, 
+			      double* jointEntropy )
+{
+  struct mi_reference_struct* ref= mc->reference;
+  long nb;
+  long cells;
+  long cellSize;
+  double range2;
+  MIJob job;
+  int nThreads= mc->nThreads;
+  long n;
+  int i;
+
+  if (!ref) Abort("calcRefEntropies: no reference image has been set!\n");
+  if (stride2<1) Abort("calcRefEntropies: nonsense stride2!\n");
+  *entropy2= *jointEntropy= 0.0;
+  if (ref->nSamples==0) return;
+  nb= ref->nbins;
+  cells= (nb+1)*nb;
+
+  if (!mc->ec2->min_set || !mc->ec2->max_set) {
+    double lo= img2[(ref->pix ? ref->pix[0] : 0)*stride2];
+    double hi= lo;
+    for (n=1; n<ref->nSamples; n++) {
+      double v= img2[(ref->pix ? ref->pix[n] : n)*stride2];
+      if (v<lo) lo= v;
+      if (v>hi) hi= v;
+    }
+    if (!mc->ec2->min_set) ent_setMin(mc->ec2, lo);
+    if (!mc->ec2->max_set) ent_setMax(mc->ec2, hi);
+  }
+  range2= mc->ec2->max - mc->ec2->min;
+  if (range2==0.0) return;
+
+  /* Room for either integer or partial volume counts */
+  cellSize= sizeof(double);
+  if (ref->nSamples < MIN_THREADED_SAMPLES) nThreads= 1;
+  if (ref->nHists < nThreads) {
+    if (ref->hists) free(ref->hists);
+    if (!(ref->hists= malloc(nThreads*cells*cellSize)))
+      Abort("calcRefEntropies: unable to allocate %ld bytes!\n",
+	    nThreads*cells*cellSize);
+    ref->nHists= nThreads;
+  }
+
+  job.ref= ref;
+  job.img2= img2;
+  job.stride2= stride2;
+  job.min2= mc->ec2->min;
+  job.scale2= 1.0/(range2/(nb-1));
+  job.partialVolume= mc->partialVolume;
+  job.first= 0;
+  job.last= ref->nSamples;
+  job.hist= ref->hists;
+
+  if (nThreads>1) {
+    MIJob* jobs;
+
+    if (!(jobs=(MIJob*)malloc(nThreads*sizeof(MIJob))))
+      Abort("calcRefEntropies: unable to allocate %ld bytes!\n",
+	    nThreads*sizeof(MIJob));
+    for (i=0; i<nThreads; i++) {
+      jobs[i]= job;
+      jobs[i].first= fthr_share_start(ref->nSamples, nThreads, i);
+      jobs[i].last= fthr_share_start(ref->nSamples, nThreads, i+1);
+      jobs[i].hist= (char*)ref->hists + i*cells*cellSize;
+    }
+    fthr_run_jobs(jobs, nThreads, sizeof(MIJob), miWorker);
+    for (i=1; i<nThreads; i++) {
+      if (mc->partialVolume) {
+	double* sum= (double*)ref->hists;
+	double* h= (double*)jobs[i].hist;
+	for (n=0; n<cells; n++) sum[n] += h[n];
+      }
+      else {
+	int* sum= (int*)ref->hists;
+	int* h= (int*)jobs[i].hist;
+	for (n=0; n<cells; n++) sum[n] += h[n];
+      }
+    }
+    free(jobs);
+  }
+  else binMovingSamples(&job);
+
+  countEntropies(ref, mc->partialVolume, entropy2, jointEntropy);
+  if (mc->debugFlag) 
+    fprintf(stderr,"Reference MI: entropy %lg, joint entropy %lg\n",
+	    *entropy2, *jointEntropy);
+}
+
+double ent_calcRefMutualInformationFloat( MutualInfoContext* mc,
+					  const float* img2, long stride2 )
+{
+  double entropy2;
+  double jointEntropy;
+
+  calcRefEntropies(mc, img2, stride2, &entropy2, &jointEntropy);
+  return mc->reference->entropy1 + entropy2 - jointEntropy;
+}
+
+double ent_calcRefJointEntropyFloat( MutualInfoContext* mc,
+				     const float* img2, long stride2 )
+{
+  double entropy2;
+  double jointEntropy;
+
+  calcRefEntropies(mc, img2, stride2, &entropy2, &jointEntropy);
+  return jointEntropy;
+}
@@ -49,6 +49,9 @@ typedef struct mutual_info_ctx_struct {
   int verboseFlag;
   EntropyContext* ec1;
   EntropyContext* ec2;
+  struct mi_reference_struct* reference;
+  int partialVolume;
+  int nThreads;
 } MutualInfoContext;
 
 EntropyContext* ent_createContext(void);
@@ -164,3 +167,27 @@ double ent_calcMutualInformationFloat( MutualInfoContext* mc,
 					long dx, long dy, long dz,
 					long stride1, long stride2);
 
+/* These routines compute MI or joint entropy between a fixed
+ * reference image (img1) and a series of moving images (img2), which
+ * is the pattern of a registration search.  ent_setMIReferenceFloat()
+ * bins the reference once, using Min1 and Max1 if they are set and
+ * the masked range of img1 otherwise; mask may be NULL.  Each moving
+ * image must have the same geometry as the reference, and is binned
+ * using Min2 and Max2.  Changing Min1, Max1 or the bin count drops
+ * the reference.  The results match ent_calcMaskedMutualInformationFloat()
+ * and ent_calcMaskedJointEntropyFloat() (or the unmasked versions)
+ * to rounding, unless partial volume binning is turned on.
+ */
+void ent_setMIReferenceFloat( MutualInfoContext* mc, const float* img1, 
+			      const int* mask, long dx, long dy, long dz, 
+			      long stride1, long maskstride );
+void ent_clearMIReference(MutualInfoContext* ctx);
+int ent_getMIReferenceSet(const MutualInfoContext* ctx);
+void ent_setMIPartialVolume(MutualInfoContext* ctx, int val);
+int ent_getMIPartialVolume(const MutualInfoContext* ctx);
+void ent_setMIThreads(MutualInfoContext* ctx, int val);
+int ent_getMIThreads(const MutualInfoContext* ctx);
+double ent_calcRefMutualInformationFloat( MutualInfoContext* mc,
+					  const float* img2, long stride2 );
+double ent_calcRefJointEntropyFloat( MutualInfoContext* mc,
+				     const float* img2, long stride2 );
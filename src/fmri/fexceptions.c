@@ -44,8 +44,17 @@ static const char* __fex_exceptionTypeNames[]= {
   "MemoryException"
 };
 
-static Exception* __fex_currentException= NULL;
-static ExceptionContext* __fex_currentExceptionContext= NULL;
+/* Each thread unwinds its own stack, so the context chain must be
+ * per-thread when threads are in use.
+ */
+#ifdef USE_PTHREAD
+#define FEX_THREAD_LOCAL __thread
+#else
+#define FEX_THREAD_LOCAL
+#endif
+
+static FEX_THREAD_LOCAL Exception* __fex_currentException= NULL;
+static FEX_THREAD_LOCAL ExceptionContext* __fex_currentExceptionContext= NULL;
 
 Exception* __fex_getCurrentException()
 {
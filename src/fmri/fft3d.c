@@ -60,6 +60,9 @@
 #endif
 #include <string.h>
 #include <strings.h>
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif
 #include "mri.h"
 #include "fmri.h"
 #include "stdcrg.h"
@@ -68,6 +71,10 @@
 
 /* Notes-
    -z varies fastest within plan_temp.  Use plan_temp[(((x*ydim)+y)*zdim)+z].
+   -The FFTW planner is not thread-safe, and fft3d() itself works in the
+    shared plan_temp, so both run under planner_lock.  The batched
+    routines keep their plans and buffers per thread and hold the lock
+    only while planning.
  */
 
 #define FFTW_WISDOM_ENV "F_WISDOM_FILE"
@@ -116,6 +123,15 @@ static fftwnd_plan plan_xyz_b= NULL;
 static FFTW_COMPLEX* plan_temp= NULL;
 #endif
 
+#ifdef USE_PTHREAD
+static pthread_mutex_t planner_lock= PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_PLANNER() pthread_mutex_lock(&planner_lock)
+#define UNLOCK_PLANNER() pthread_mutex_unlock(&planner_lock)
+#else
+#define LOCK_PLANNER()
+#define UNLOCK_PLANNER()
+#endif
+
 static int wisdom_loaded= 0;
 static int plan_temp_xdim= 0;
 static int plan_temp_ydim= 0;
@@ -178,11 +194,42 @@ static void save_wisdom()
   (void)fclose(f);
 }
 
+#define FORGET_PLAN(plan,destroy) if (plan) { destroy(plan); plan= NULL; }
+
+static void forget_plans()
+{
+  /* Every plan refers to plan_temp and its dimensions */
+  FORGET_PLAN(plan_x_f,fftw_destroy_plan);
+  FORGET_PLAN(plan_x_b,fftw_destroy_plan);
+  FORGET_PLAN(plan_y_f,fftw_destroy_plan);
+  FORGET_PLAN(plan_y_b,fftw_destroy_plan);
+  FORGET_PLAN(plan_z_f,fftw_destroy_plan);
+  FORGET_PLAN(plan_z_b,fftw_destroy_plan);
+#ifdef FFTW3
+  FORGET_PLAN(plan_xy_f,fftw_destroy_plan);
+  FORGET_PLAN(plan_xy_b,fftw_destroy_plan);
+  FORGET_PLAN(plan_yz_f,fftw_destroy_plan);
+  FORGET_PLAN(plan_yz_b,fftw_destroy_plan);
+  FORGET_PLAN(plan_xz_f,fftw_destroy_plan);
+  FORGET_PLAN(plan_xz_b,fftw_destroy_plan);
+  FORGET_PLAN(plan_xyz_f,fftw_destroy_plan);
+  FORGET_PLAN(plan_xyz_b,fftw_destroy_plan);
+#else
+  FORGET_PLAN(plan_xy_f,fftwnd_destroy_plan);
+  FORGET_PLAN(plan_xy_b,fftwnd_destroy_plan);
+  FORGET_PLAN(plan_yz_f,fftwnd_destroy_plan);
+  FORGET_PLAN(plan_yz_b,fftwnd_destroy_plan);
+  FORGET_PLAN(plan_xyz_f,fftwnd_destroy_plan);
+  FORGET_PLAN(plan_xyz_b,fftwnd_destroy_plan);
+#endif
+}
+
 static int check_temp( int xdim, int ydim, int zdim )
 {
   /* return value non-zero means it was reallocated */
   if ((xdim != plan_temp_xdim) || (ydim != plan_temp_ydim)
       || (zdim != plan_temp_zdim)) {
+    forget_plans();
 #ifdef FFTW3
     if (plan_temp) fftw_free(plan_temp);
     if (!(plan_temp= 
@@ -479,8 +526,8 @@ static void check_plan_yz( int xdim, int ydim, int zdim, fftw_direction dir )
 static void check_plan_xz( int xdim, int ydim, int zdim, fftw_direction dir )
 {
   if (check_temp(xdim,ydim,zdim) 
-      || ((dir==FFTW_FORWARD && !plan_yz_f) 
-	  || ((dir==FFTW_BACKWARD && !plan_yz_b)))
+      || ((dir==FFTW_FORWARD && !plan_xz_f) 
+	  || ((dir==FFTW_BACKWARD && !plan_xz_b)))
       || (plan_xdim != xdim) || (plan_ydim != ydim) || (plan_zdim != zdim)) {
       fftw_iodim dims[2];
       fftw_iodim howmany_dims[1];
@@ -1160,6 +1207,8 @@ void fft3d( FComplex* data, long nx, long ny, long nz, long sign,
   if (sign==1) fftw_dir= FFTW_BACKWARD;
   else fftw_dir= FFTW_FORWARD;
 
+  LOCK_PLANNER();
+
   if (!strcasecmp(rowcol,"3") || !strcasecmp(rowcol,"xyz")) {
     /* Check for plan and temp space */
     check_plan_xyz((int)nx,(int)ny,(int)nz,fftw_dir);
@@ -1344,7 +1393,440 @@ void fft3d( FComplex* data, long nx, long ny, long nz, long sign,
   else {
     Abort( "FFT3D: Unrecognized row-column indicator (%s).", rowcol );
   }
-  
+
+  UNLOCK_PLANNER();
   return;
 }
 
+
+/*************************************************************
+ * Batched transforms                                        *
+ *                                                           *
+ * fft3d_many() does to each of nvol volumes what fft3d()    *
+ *   does to one.  Volume v starts at data+v*vol_stride.     *
+ *   As many volumes as fit in BATCH_MAX_BYTES are packed    *
+ *   together and transformed by a single FFTW plan.         *
+ *                                                           *
+ * fft3d_filter_many() transforms each volume with the given *
+ *   sign, calls filter() on its spectrum, and transforms    *
+ *   back with the opposite sign.  The spectrum is double    *
+ *   precision (re,im) pairs with z varying fastest, in      *
+ *   natural order: index m of a transformed dimension of    *
+ *   extent n holds frequency m if m<(n+1)/2, else m-n.  It  *
+ *   is not normalized; instead the filter is passed scale,  *
+ *   1/(product of the transformed extents), to fold into    *
+ *   its own multiplication.  The filter must multiply each  *
+ *   coefficient by a factor depending only on its position, *
+ *   so the centering fft3d() does is not needed.            *
+ *                                                           *
+ * Plans and the packing buffer belong to the calling        *
+ * thread, so different threads may transform at once.       *
+ *************************************************************/
+
+#define BATCH_MAX_PLANS 8
+#define BATCH_MAX_BYTES (64*1024*1024)
+
+#define AXIS_X 4
+#define AXIS_Y 2
+#define AXIS_Z 1
+
+static int parse_axes( char* rowcol )
+{
+  if (!strcasecmp(rowcol,"3") || !strcasecmp(rowcol,"xyz")) 
+    return AXIS_X|AXIS_Y|AXIS_Z;
+  else if (!strcasecmp(rowcol,"xy")) return AXIS_X|AXIS_Y;
+  else if (!strcasecmp(rowcol,"yz")) return AXIS_Y|AXIS_Z;
+  else if (!strcasecmp(rowcol,"xz")) return AXIS_X|AXIS_Z;
+  else if (!strcasecmp(rowcol,"x")) return AXIS_X;
+  else if (!strcasecmp(rowcol,"y")) return AXIS_Y;
+  else if (!strcasecmp(rowcol,"z")) return AXIS_Z;
+  else Abort( "FFT3D: Unrecognized row-column indicator (%s).", rowcol );
+  return 0;
+}
+
+static long transform_size( int axes, long nx, long ny, long nz )
+{
+  long n= 1;
+
+  if (axes & AXIS_X) n *= nx;
+  if (axes & AXIS_Y) n *= ny;
+  if (axes & AXIS_Z) n *= nz;
+  return n;
+}
+
+/* Copies src into the double (re,im) pairs at dst, such that
+ * dst[i,j,k]= src[(i+sx)%nx,(j+sy)%ny,(k+sz)%nz]
+ */
+static void batch_pack( double* dst, FComplex* src, 
+			long nx, long ny, long nz, long sx, long sy, long sz )
+{
+  FComplex* row;
+  long i;
+  long j;
+  long k;
+
+  for (i=0; i<nx; i++) {
+    for (j=0; j<ny; j++) {
+      row= &(MEM(src,nx,ny,nz,(i+sx)%nx,(j+sy)%ny,0));
+      for (k=sz; k<nz; k++) {
+	*dst++= row[k].real;
+	*dst++= row[k].imag;
+      }
+      for (k=0; k<sz; k++) {
+	*dst++= row[k].real;
+	*dst++= row[k].imag;
+      }
+    }
+  }
+}
+
+/* The reverse of batch_pack, with a scale factor:
+ * dst[i,j,k]= scale*src[(i+sx)%nx,(j+sy)%ny,(k+sz)%nz]
+ */
+static void batch_unpack( FComplex* dst, double* src,
+			  long nx, long ny, long nz, long sx, long sy, long sz,
+			  double scale )
+{
+  double* row;
+  long i;
+  long j;
+  long k;
+
+  for (i=0; i<nx; i++) {
+    for (j=0; j<ny; j++) {
+      row= src + 2*((((((i+sx)%nx)*ny)+((j+sy)%ny))*nz));
+      for (k=sz; k<nz; k++) {
+	dst->real= row[2*k]*scale;
+	dst->imag= row[2*k+1]*scale;
+	dst++;
+      }
+      for (k=0; k<sz; k++) {
+	dst->real= row[2*k]*scale;
+	dst->imag= row[2*k+1]*scale;
+	dst++;
+      }
+    }
+  }
+}
+
+#ifdef FFTW3
+
+typedef struct batch_plan_struct {
+  int axes;
+  long nx;
+  long ny;
+  long nz;
+  long nvol;
+  fftw_direction dir;
+  unsigned long last_used;
+  fftw_plan plan;
+} BatchPlan;
+
+typedef struct batch_state_struct {
+  BatchPlan plans[BATCH_MAX_PLANS];
+  unsigned long clock;
+  fftw_complex* buf;
+  long buf_size;
+} BatchState;
+
+#ifdef USE_PTHREAD
+static pthread_key_t batch_key;
+static pthread_once_t batch_key_once= PTHREAD_ONCE_INIT;
+#else
+static BatchState* batch_state= NULL;
+#endif
+
+static void free_batch_state( void* p )
+{
+  BatchState* st= (BatchState*)p;
+  int i;
+
+  LOCK_PLANNER();
+  for (i=0; i<BATCH_MAX_PLANS; i++)
+    if (st->plans[i].plan) fftw_destroy_plan(st->plans[i].plan);
+  UNLOCK_PLANNER();
+  if (st->buf) fftw_free(st->buf);
+  free(st);
+}
+
+#ifdef USE_PTHREAD
+static void make_batch_key()
+{
+  if (pthread_key_create(&batch_key, free_batch_state))
+    Abort("fft3d: unable to create a thread-specific key!\n");
+}
+#endif
+
+static BatchState* get_batch_state()
+{
+  BatchState* st;
+
+#ifdef USE_PTHREAD
+  (void)pthread_once(&batch_key_once, make_batch_key);
+  st= (BatchState*)pthread_getspecific(batch_key);
+#else
+  st= batch_state;
+#endif
+  if (!st) {
+    if (!(st= (BatchState*)calloc(1,sizeof(BatchState))))
+      Abort("fft3d: get_batch_state: unable to allocate %ld bytes!\n",
+	    (long)sizeof(BatchState));
+#ifdef USE_PTHREAD
+    (void)pthread_setspecific(batch_key, st);
+#else
+    batch_state= st;
+#endif
+  }
+  return st;
+}
+
+static void check_batch_buf( BatchState* st, long n )
+{
+  if (n > st->buf_size) {
+    if (st->buf) fftw_free(st->buf);
+    if (!(st->buf= (fftw_complex*)fftw_malloc(n*sizeof(fftw_complex))))
+      Abort("fft3d: check_batch_buf: unable to allocate %ld bytes!\n",
+	    (long)(n*sizeof(fftw_complex)));
+    st->buf_size= n;
+  }
+}
+
+static void set_iodim( fftw_iodim* d, long n, long stride )
+{
+  d->n= n;
+  d->is= d->os= stride;
+}
+
+/* Returns a plan transforming nvol volumes packed end to end in
+ * st->buf, creating it if it is not among the most recently used.
+ * Creating a plan overwrites st->buf.
+ */
+static fftw_plan get_batch_plan( BatchState* st, int axes, 
+				 long nx, long ny, long nz, long nvol,
+				 fftw_direction dir )
+{
+  BatchPlan* p;
+  BatchPlan* victim;
+  fftw_iodim dims[3];
+  fftw_iodim howmany_dims[4];
+  int rank= 0;
+  int howmany_rank= 0;
+  int i;
+
+  st->clock++;
+  victim= &(st->plans[0]);
+  for (i=0; i<BATCH_MAX_PLANS; i++) {
+    p= &(st->plans[i]);
+    if (p->plan && p->axes==axes && p->dir==dir && p->nvol==nvol
+	&& p->nx==nx && p->ny==ny && p->nz==nz) {
+      p->last_used= st->clock;
+      return p->plan;
+    }
+    if (p->last_used < victim->last_used) victim= p;
+  }
+
+  if (axes & AXIS_X) set_iodim(&(dims[rank++]), nx, ny*nz);
+  else set_iodim(&(howmany_dims[howmany_rank++]), nx, ny*nz);
+  if (axes & AXIS_Y) set_iodim(&(dims[rank++]), ny, nz);
+  else set_iodim(&(howmany_dims[howmany_rank++]), ny, nz);
+  if (axes & AXIS_Z) set_iodim(&(dims[rank++]), nz, 1);
+  else set_iodim(&(howmany_dims[howmany_rank++]), nz, 1);
+  set_iodim(&(howmany_dims[howmany_rank++]), nvol, nx*ny*nz);
+
+  LOCK_PLANNER();
+  if (victim->plan) fftw_destroy_plan(victim->plan);
+  (void)check_wisdom();
+  victim->plan= fftw_plan_guru_dft( rank, dims, howmany_rank, howmany_dims,
+				    st->buf, st->buf, dir, FFTW_MEASURE );
+  save_wisdom();
+  UNLOCK_PLANNER();
+  if (!victim->plan)
+    Abort("fft3d: unable to plan %ld transforms of %ld by %ld by %ld!\n",
+	  nvol, nx, ny, nz);
+
+  victim->axes= axes;
+  victim->nx= nx;
+  victim->ny= ny;
+  victim->nz= nz;
+  victim->nvol= nvol;
+  victim->dir= dir;
+  victim->last_used= st->clock;
+  return victim->plan;
+}
+
+static long batch_size( long nvol, long n )
+{
+  long batch= BATCH_MAX_BYTES/(n*sizeof(fftw_complex));
+
+  if (batch<1) batch= 1;
+  if (batch>nvol) batch= nvol;
+  return batch;
+}
+
+void fft3d_many( FComplex* data, long nvol, long vol_stride,
+		 long nx, long ny, long nz, long sign, char* rowcol )
+{
+  BatchState* st;
+  fftw_plan plan;
+  fftw_direction fftw_dir;
+  double scale;
+  long n= nx*ny*nz;
+  long batch;
+  long nb;
+  long v;
+  long w;
+  int axes;
+
+  if ((sign != -1)&&(sign != 1))
+    Abort("fft3d_many: invalid sign: %d\n",sign);
+  axes= parse_axes(rowcol);
+  if (nvol<=0) return;
+  if (nvol>1 && vol_stride<n)
+    Abort("fft3d_many: volume stride %ld is less than volume size %ld!\n",
+	  vol_stride, n);
+
+  if (sign==1) fftw_dir= FFTW_BACKWARD;
+  else fftw_dir= FFTW_FORWARD;
+  scale= 1.0/sqrt( (double)transform_size(axes,nx,ny,nz) );
+
+  st= get_batch_state();
+  batch= batch_size(nvol,n);
+  check_batch_buf(st, batch*n);
+
+  for (v=0; v<nvol; v += nb) {
+    nb= (nvol-v < batch) ? nvol-v : batch;
+    plan= get_batch_plan(st, axes, nx, ny, nz, nb, fftw_dir);
+
+    /* Pack, rotating transformed dims by n/2 as data_to_temp_* do */
+    for (w=0; w<nb; w++)
+      batch_pack( (double*)(st->buf + w*n), data + (v+w)*vol_stride, 
+		  nx, ny, nz, 
+		  (axes & AXIS_X) ? nx/2 : 0,
+		  (axes & AXIS_Y) ? ny/2 : 0,
+		  (axes & AXIS_Z) ? nz/2 : 0 );
+
+    fftw_execute_dft(plan, st->buf, st->buf);
+
+    /* Unpack, rotating back by (n+1)/2 and correcting scale */
+    for (w=0; w<nb; w++)
+      batch_unpack( data + (v+w)*vol_stride, (double*)(st->buf + w*n),
+		    nx, ny, nz, 
+		    (axes & AXIS_X) ? (nx+1)/2 : 0,
+		    (axes & AXIS_Y) ? (ny+1)/2 : 0,
+		    (axes & AXIS_Z) ? (nz+1)/2 : 0, scale );
+  }
+}
+
+void fft3d_filter_many( FComplex* data, long nvol, long vol_stride,
+			long nx, long ny, long nz, long sign, char* rowcol,
+			FFT3DFilter filter, void* hook )
+{
+  BatchState* st;
+  fftw_plan plan_f;
+  fftw_plan plan_b;
+  fftw_direction fftw_dir;
+  fftw_direction fftw_inv;
+  double scale;
+  long n= nx*ny*nz;
+  long batch;
+  long nb;
+  long v;
+  long w;
+  int axes;
+
+  if ((sign != -1)&&(sign != 1))
+    Abort("fft3d_filter_many: invalid sign: %d\n",sign);
+  axes= parse_axes(rowcol);
+  if (nvol<=0) return;
+  if (nvol>1 && vol_stride<n)
+    Abort("fft3d_filter_many: volume stride %ld is less than volume size %ld!\n",
+	  vol_stride, n);
+
+  if (sign==1) {
+    fftw_dir= FFTW_BACKWARD;
+    fftw_inv= FFTW_FORWARD;
+  }
+  else {
+    fftw_dir= FFTW_FORWARD;
+    fftw_inv= FFTW_BACKWARD;
+  }
+  scale= 1.0/(double)transform_size(axes,nx,ny,nz);
+
+  st= get_batch_state();
+  batch= batch_size(nvol,n);
+  check_batch_buf(st, batch*n);
+
+  for (v=0; v<nvol; v += nb) {
+    nb= (nvol-v < batch) ? nvol-v : batch;
+    plan_f= get_batch_plan(st, axes, nx, ny, nz, nb, fftw_dir);
+    plan_b= get_batch_plan(st, axes, nx, ny, nz, nb, fftw_inv);
+
+    for (w=0; w<nb; w++)
+      batch_pack( (double*)(st->buf + w*n), data + (v+w)*vol_stride, 
+		  nx, ny, nz, 0, 0, 0 );
+
+    fftw_execute_dft(plan_f, st->buf, st->buf);
+    for (w=0; w<nb; w++)
+      filter( (double*)(st->buf + w*n), v+w, nx, ny, nz, scale, hook );
+    fftw_execute_dft(plan_b, st->buf, st->buf);
+
+    for (w=0; w<nb; w++)
+      batch_unpack( data + (v+w)*vol_stride, (double*)(st->buf + w*n),
+		    nx, ny, nz, 0, 0, 0, 1.0 );
+  }
+}
+
+#else /* ifdef FFTW3 */
+
+/* FFTW 2 offers no single plan over all the dimensions we need, so
+ * these simply apply fft3d() a volume at a time.  The spectrum seen
+ * by the filter is fft3d()'s, normalized and moved into natural
+ * order.  It differs from the unshifted spectrum by a phase on each
+ * coefficient, which a multiplying filter does not notice.
+ */
+
+void fft3d_many( FComplex* data, long nvol, long vol_stride,
+		 long nx, long ny, long nz, long sign, char* rowcol )
+{
+  long v;
+
+  for (v=0; v<nvol; v++)
+    fft3d( data + v*vol_stride, nx, ny, nz, sign, rowcol );
+}
+
+void fft3d_filter_many( FComplex* data, long nvol, long vol_stride,
+			long nx, long ny, long nz, long sign, char* rowcol,
+			FFT3DFilter filter, void* hook )
+{
+  double* spectrum;
+  FComplex* vol;
+  long v;
+  int axes;
+
+  if ((sign != -1)&&(sign != 1))
+    Abort("fft3d_filter_many: invalid sign: %d\n",sign);
+  axes= parse_axes(rowcol);
+  if (nvol<=0) return;
+  if (!(spectrum= (double*)malloc(2*nx*ny*nz*sizeof(double))))
+    Abort("fft3d_filter_many: unable to allocate %ld bytes!\n",
+	  (long)(2*nx*ny*nz*sizeof(double)));
+
+  for (v=0; v<nvol; v++) {
+    vol= data + v*vol_stride;
+    fft3d( vol, nx, ny, nz, sign, rowcol );
+    batch_pack( spectrum, vol, nx, ny, nz,
+		(axes & AXIS_X) ? nx/2 : 0,
+		(axes & AXIS_Y) ? ny/2 : 0,
+		(axes & AXIS_Z) ? nz/2 : 0 );
+    filter( spectrum, v, nx, ny, nz, 1.0, hook );
+    batch_unpack( vol, spectrum, nx, ny, nz,
+		  (axes & AXIS_X) ? (nx+1)/2 : 0,
+		  (axes & AXIS_Y) ? (ny+1)/2 : 0,
+		  (axes & AXIS_Z) ? (nz+1)/2 : 0, 1.0 );
+    fft3d( vol, nx, ny, nz, -sign, rowcol );
+  }
+
+  free(spectrum);
+}
+
+#endif /* ifdef FFTW3 */
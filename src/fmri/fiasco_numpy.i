@@ -270,6 +270,7 @@ Optimizer* createNelminOptimizer(double stopping_val, double scale,
 				 int maxRestarts);
 Optimizer* createNelminTOptimizer(double stopping_val, double scale, double T,
 				  int maxRestarts);
+Optimizer* createLBFGSOptimizer(double tol, double scale);
 
 typedef enum { INTRP_CLOSEST, INTRP_LINEAR, INTRP_CATMULLROM, 
 	       INTRP_BEZIER, INTRP_BSPLINE, INTRP_UNKNOWN } InterpolatorType;
@@ -106,6 +106,14 @@ void fft2d( FComplex** data, long nx, long ny, long sign,
 	    char rowcol, long from, long to );
 void fft3d( FComplex* data, long nx, long ny, long nz, long sign,
 	    char* rowcol );
+typedef void (*FFT3DFilter)( double* spectrum, long vol,
+			     long nx, long ny, long nz, double scale,
+			     void* hook );
+void fft3d_many( FComplex* data, long nvol, long vol_stride,
+		 long nx, long ny, long nz, long sign, char* rowcol );
+void fft3d_filter_many( FComplex* data, long nvol, long vol_stride,
+			long nx, long ny, long nz, long sign, char* rowcol,
+			FFT3DFilter filter, void* hook );
 void fourier_shift_rot( RegPars par, FComplex** orig_image, 
 			FComplex** moved_image, long nx, long ny, 
 			char domain );
@@ -172,3 +180,12 @@ void fourier_shift_rot( RegPars par, FComplex** orig_image,
 
 /* Header for Kalman filter utilities */
 #include "kalmanfilter.h"
+
+/* Header for batched matrix multiplication */
+#include "batchmult.h"
+
+/* Header for order statistics */
+#include "orderstat.h"
+
+/* Header for shared thread helpers */
+#include "fthreads.h"
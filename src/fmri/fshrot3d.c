@@ -46,6 +46,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif
 #include "mri.h"
 #include "fmri.h"
 #include "stdcrg.h"
@@ -53,8 +56,21 @@
 
 /* Notes-
  * -Note that the routine expects data presented in z-fastest order!
+ * -The shear phase ramps are separable: along a shear in x, the phase
+ *  at frequency f of voxel (j,k) is f*(base + cy*(j-halfy) + cz*(k-halfz)),
+ *  so its exponential is a product of factors from small tables indexed
+ *  by (f,j) and (f,k).  The row kernels multiply those out, with
+ *  SSE2 or AVX versions chosen at run time.
  */
 
+#if defined(__GNUC__) && (__GNUC__ >= 5) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define FR3D_X86_SIMD
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX __attribute__((target("avx")))
+#endif
+
 static char rcsid[] = "$Id: fshrot3d.c,v 1.18 2004/03/19 18:27:18 welling Exp $";
 
 /* How bad does cancellation have to get before we consider a quat bad? */
@@ -100,6 +116,13 @@ typedef struct trans_param_struct {
   double dx, dy, dz;
 } TransParams;
 
+typedef struct shear_hook_struct {
+  int axis; /* 0, 1, or 2 for x, y, or z */
+  double base; /* phase per unit frequency along axis */
+  double coef[3]; /* change in base per voxel along each axis */
+  int skip_nyquist;
+} ShearHook;
+
 static int debug= 0;
 static int shear_pattern= FR3D_SHEAR_4;
 static int qual_measure_type= FR3D_QUAL_COX;
@@ -108,6 +131,46 @@ static int count_shear_y= 0;
 static int count_shear_z= 0;
 static int count_set_phase= 0;
 static int count_calls= 0;
+static int phase_ramp= -1; /* -1 means not yet chosen */
+
+/* The routines are re-entrant apart from the operation counters and
+ * the first choice of phase ramp method.
+ */
+#ifdef USE_PTHREAD
+static pthread_mutex_t count_lock= PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ramp_once= PTHREAD_ONCE_INIT;
+#define BUMP_COUNT(counter) \
+  { pthread_mutex_lock(&count_lock); counter++; \
+    pthread_mutex_unlock(&count_lock); }
+#else
+#define BUMP_COUNT(counter) { counter++; }
+#endif
+
+static int best_phase_ramp()
+{
+  int level= FR3D_RAMP_TABLE;
+#ifdef FR3D_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx")) level= FR3D_RAMP_AVX;
+  else if (__builtin_cpu_supports("sse2")) level= FR3D_RAMP_SSE2;
+#endif
+  return level;
+}
+
+static void choose_phase_ramp()
+{
+  if (phase_ramp<0) phase_ramp= best_phase_ramp();
+}
+
+static int phase_ramp_level()
+{
+#ifdef USE_PTHREAD
+  pthread_once(&ramp_once, choose_phase_ramp);
+#else
+  choose_phase_ramp();
+#endif
+  return phase_ramp;
+}
 
 void fshrot3d_set( int flag, int value )
 {
@@ -124,6 +187,12 @@ void fshrot3d_set( int flag, int value )
     qual_measure_type= value;
   }
   break;
+  case FR3D_PHASE_RAMP: {
+    if (value<FR3D_RAMP_TRIG || value>best_phase_ramp()) 
+      phase_ramp= best_phase_ramp();
+    else phase_ramp= value;
+  }
+  break;
   }
 }
 
@@ -142,6 +211,10 @@ int fshrot3d_get( int flag )
     return qual_measure_type;
   }
     /* break; -NOTREACHED- */
+  case FR3D_PHASE_RAMP: {
+    return phase_ramp_level();
+  }
+    /* break; -NOTREACHED- */
   default:
     Abort("fshrot3d_get: unknown flag %d!\n",flag);
   }
@@ -952,23 +1025,349 @@ static void find_repairing_quat_long( Quat* result, Quat* q ) {
   step_repairing_quat_long( result, q, 0 );
 }
 
+/* Row kernels for the phase ramps.  Each multiplies n complex values
+ * (re,im pairs) in place; ramp_scaled() by r*table[k] and 
+ * ramp_product() by t1[k]*t2[k].  The vector versions do the same
+ * arithmetic in the same order, so all give identical results.
+ */
+static void ramp_scaled_scalar( double* spec, const double* table,
+				double r_re, double r_im, long n )
+{
+  double p_re;
+  double p_im;
+  double s_re;
+  double s_im;
+  long k;
+
+  for (k=0; k<n; k++) {
+    p_re= r_re*table[2*k] - r_im*table[2*k+1];
+    p_im= r_im*table[2*k] + r_re*table[2*k+1];
+    s_re= spec[2*k];
+    s_im= spec[2*k+1];
+    spec[2*k]= p_re*s_re - p_im*s_im;
+    spec[2*k+1]= p_im*s_re + p_re*s_im;
+  }
+}
+
+static void ramp_product_scalar( double* spec, const double* t1, 
+				 const double* t2, long n )
+{
+  double p_re;
+  double p_im;
+  double s_re;
+  double s_im;
+  long k;
+
+  for (k=0; k<n; k++) {
+    p_re= t1[2*k]*t2[2*k] - t1[2*k+1]*t2[2*k+1];
+    p_im= t1[2*k+1]*t2[2*k] + t1[2*k]*t2[2*k+1];
+    s_re= spec[2*k];
+    s_im= spec[2*k+1];
+    spec[2*k]= p_re*s_re - p_im*s_im;
+    spec[2*k+1]= p_im*s_re + p_re*s_im;
+  }
+}
+
+#ifdef FR3D_X86_SIMD
+
+/* (a_re*b_re - a_im*b_im, a_im*b_re + a_re*b_im) */
+TARGET_SSE2 static inline __m128d cmul_sse2( __m128d a, __m128d b )
+{
+  const __m128d neg_re= _mm_set_pd(0.0,-0.0);
+  __m128d t1= _mm_mul_pd(a, _mm_unpacklo_pd(b,b));
+  __m128d t2= _mm_mul_pd(_mm_shuffle_pd(a,a,1), _mm_unpackhi_pd(b,b));
+  return _mm_add_pd(t1, _mm_xor_pd(t2, neg_re));
+}
+
+TARGET_SSE2 static void ramp_scaled_sse2( double* spec, const double* table,
+					   double r_re, double r_im, long n )
+{
+  __m128d r= _mm_set_pd(r_im, r_re);
+  long k;
+
+  for (k=0; k<n; k++)
+    _mm_storeu_pd(spec+2*k, 
+		  cmul_sse2(cmul_sse2(r, _mm_loadu_pd(table+2*k)),
+			    _mm_loadu_pd(spec+2*k)));
+}
+
+TARGET_SSE2 static void ramp_product_sse2( double* spec, const double* t1,
+					    const double* t2, long n )
+{
+  long k;
+
+  for (k=0; k<n; k++)
+    _mm_storeu_pd(spec+2*k, 
+		  cmul_sse2(cmul_sse2(_mm_loadu_pd(t1+2*k),
+				      _mm_loadu_pd(t2+2*k)),
+			    _mm_loadu_pd(spec+2*k)));
+}
+
+/* Two complex values at a time, as cmul_sse2.  An odd value at the
+ * end of a row is done with cmul_sse2, which compiles to VEX code
+ * here; calling the scalar routine would mix in legacy SSE code.
+ * The row kernels clear the upper ymm state before returning, since
+ * gcc does not do so at -O.
+ */
+TARGET_AVX static inline __m256d cmul_avx( __m256d a, __m256d b )
+{
+  __m256d t1= _mm256_mul_pd(a, _mm256_movedup_pd(b));
+  __m256d t2= _mm256_mul_pd(_mm256_permute_pd(a,0x5), 
+			    _mm256_permute_pd(b,0xf));
+  return _mm256_addsub_pd(t1, t2);
+}
+
+TARGET_AVX static void ramp_scaled_avx( double* spec, const double* table,
+					double r_re, double r_im, long n )
+{
+  __m256d r= _mm256_set_pd(r_im, r_re, r_im, r_re);
+  long k;
+
+  for (k=0; k+1<n; k+=2)
+    _mm256_storeu_pd(spec+2*k, 
+		     cmul_avx(cmul_avx(r, _mm256_loadu_pd(table+2*k)),
+			      _mm256_loadu_pd(spec+2*k)));
+  if (k<n)
+    _mm_storeu_pd(spec+2*k, 
+		  cmul_sse2(cmul_sse2(_mm256_castpd256_pd128(r),
+				      _mm_loadu_pd(table+2*k)),
+			    _mm_loadu_pd(spec+2*k)));
+  _mm256_zeroupper();
+}
+
+TARGET_AVX static void ramp_product_avx( double* spec, const double* t1,
+					 const double* t2, long n )
+{
+  long k;
+
+  for (k=0; k+1<n; k+=2)
+    _mm256_storeu_pd(spec+2*k, 
+		     cmul_avx(cmul_avx(_mm256_loadu_pd(t1+2*k),
+				       _mm256_loadu_pd(t2+2*k)),
+			      _mm256_loadu_pd(spec+2*k)));
+  if (k<n)
+    _mm_storeu_pd(spec+2*k, 
+		  cmul_sse2(cmul_sse2(_mm_loadu_pd(t1+2*k),
+				      _mm_loadu_pd(t2+2*k)),
+			    _mm_loadu_pd(spec+2*k)));
+  _mm256_zeroupper();
+}
+
+#endif /* FR3D_X86_SIMD */
+
+static void ramp_scaled( double* spec, const double* table,
+			 double r_re, double r_im, long n )
+{
+  switch (phase_ramp_level()) {
+#ifdef FR3D_X86_SIMD
+  case FR3D_RAMP_AVX: ramp_scaled_avx(spec, table, r_re, r_im, n); break;
+  case FR3D_RAMP_SSE2: ramp_scaled_sse2(spec, table, r_re, r_im, n); break;
+#endif
+  default: ramp_scaled_scalar(spec, table, r_re, r_im, n);
+  }
+}
+
+static void ramp_product( double* spec, const double* t1, const double* t2,
+			  long n )
+{
+  switch (phase_ramp_level()) {
+#ifdef FR3D_X86_SIMD
+  case FR3D_RAMP_AVX: ramp_product_avx(spec, t1, t2, n); break;
+  case FR3D_RAMP_SSE2: ramp_product_sse2(spec, t1, t2, n); break;
+#endif
+  default: ramp_product_scalar(spec, t1, t2, n);
+  }
+}
+
+/* Stores exp(i*f*rate) in e, where f is the frequency at index m of
+ * an axis of extent n.  The phase is left at 0 at the Nyquist
+ * frequency if skip_nyquist is set.
+ */
+static void ramp_entry( double* e, long m, long n, int skip_nyquist, 
+			double rate )
+{
+  long f= (m >= (n+1)/2) ? m-n : m;
+
+  if (skip_nyquist && m==n/2) {
+    e[0]= 1.0;
+    e[1]= 0.0;
+  }
+  else {
+    e[0]= cos(f*rate);
+    e[1]= sin(f*rate);
+  }
+}
+
+static double* ramp_alloc( long n )
+{
+  double* result;
+
+  if (!(result= (double*)malloc(2*n*sizeof(double))))
+    Abort("fshrot3d: unable to allocate %ld bytes!\n",
+	  (long)(2*n*sizeof(double)));
+  return result;
+}
+
+/* Phase ramp for a shear along axis, applied to the natural-order
+ * spectrum from fft3d_filter_many().  The phase at frequency f along
+ * the shear axis is f*(base + coef[0]*(i-halfx) + coef[1]*(j-halfy)
+ * + coef[2]*(k-halfz)), where i, j, and k are voxel indices (the
+ * one along the shear axis does not appear).  This version calls
+ * cos() and sin() at every voxel, and is the reference for the
+ * table-driven shear_phase().
+ */
+static void shear_phase_trig( double* spectrum, long nx, long ny, long nz,
+			      double scale, ShearHook* h )
+{
+  double* here= spectrum;
+  long n[3];
+  long idx[3];
+  long half[3];
+  long n_axis;
+  long f;
+  double rate;
+  double theta;
+  double c;
+  double s;
+  double re;
+  double im;
+
+  n[0]= nx;
+  n[1]= ny;
+  n[2]= nz;
+  half[0]= nx/2;
+  half[1]= ny/2;
+  half[2]= nz/2;
+  n_axis= n[h->axis];
+
+  for (idx[0]=0; idx[0]<nx; idx[0]++) {
+    for (idx[1]=0; idx[1]<ny; idx[1]++) {
+      for (idx[2]=0; idx[2]<nz; idx[2]++) {
+	f= idx[h->axis];
+	if (h->skip_nyquist && f==n_axis/2) {
+	  /* no phase shift at Nyquist freq */
+	  here[0] *= scale;
+	  here[1] *= scale;
+	  here += 2;
+	  continue;
+	}
+	if (f >= (n_axis+1)/2) f -= n_axis;
+	rate= h->base;
+	if (h->axis != 0) rate += h->coef[0]*(idx[0]-half[0]);
+	if (h->axis != 1) rate += h->coef[1]*(idx[1]-half[1]);
+	if (h->axis != 2) rate += h->coef[2]*(idx[2]-half[2]);
+	theta= f*rate;
+	c= scale*cos(theta);
+	s= scale*sin(theta);
+	re= here[0];
+	im= here[1];
+	here[0]= c*re - s*im;
+	here[1]= c*im + s*re;
+	here += 2;
+      }
+    }
+  }
+}
+
+/* The same phase ramp, built from tables.  For a shear along x or y
+ * each z row is multiplied by a constant times a table row indexed by
+ * the frequency; for a shear along z each row is the product of a
+ * table row for its x index and one for its y index.  Only
+ * O(n^2) values need cos() and sin().
+ */
+static void shear_phase( double* spectrum, long vol, 
+			 long nx, long ny, long nz, double scale, void* hook )
+{
+  ShearHook* h= (ShearHook*)hook;
+  long n[3];
+  long half[3];
+  int a= h->axis;
+  int skip= h->skip_nyquist;
+  long i;
+  long j;
+  long k;
+
+  if (phase_ramp_level()==FR3D_RAMP_TRIG) {
+    shear_phase_trig(spectrum, nx, ny, nz, scale, h);
+    return;
+  }
+
+  n[0]= nx;
+  n[1]= ny;
+  n[2]= nz;
+  half[0]= nx/2;
+  half[1]= ny/2;
+  half[2]= nz/2;
+
+  if (a != 2) {
+    /* Shear along x or y; o is the other outer axis */
+    int o= 1-a;
+    double* ea= ramp_alloc(n[a]);
+    double* eo= ramp_alloc(n[a]*n[o]);
+    double* ez= ramp_alloc(n[a]*nz);
+    long m;
+    double r_re;
+    double r_im;
+
+    for (m=0; m<n[a]; m++) {
+      ramp_entry(ea+2*m, m, n[a], skip, h->base);
+      for (i=0; i<n[o]; i++) 
+	ramp_entry(eo+2*(m*n[o]+i), m, n[a], skip, 
+		   h->coef[o]*(i-half[o]));
+      for (k=0; k<nz; k++) 
+	ramp_entry(ez+2*(m*nz+k), m, n[a], skip, h->coef[2]*(k-half[2]));
+    }
+
+    for (i=0; i<nx; i++) {
+      for (j=0; j<ny; j++) {
+	double* ea_here= ea + 2*((a==0) ? i : j);
+	double* eo_here= eo + 2*((a==0) ? (i*ny+j) : (j*nx+i));
+	r_re= scale*(ea_here[0]*eo_here[0] - ea_here[1]*eo_here[1]);
+	r_im= scale*(ea_here[1]*eo_here[0] + ea_here[0]*eo_here[1]);
+	ramp_scaled(spectrum + 2*((i*ny+j)*nz), 
+		    ez + 2*(((a==0) ? i : j)*nz), r_re, r_im, nz);
+      }
+    }
+
+    free(ea);
+    free(eo);
+    free(ez);
+  }
+  else {
+    /* Shear along z; w holds the product of the z and x factors */
+    double* ea= ramp_alloc(nz);
+    double* ex= ramp_alloc(nx*nz);
+    double* ey= ramp_alloc(ny*nz);
+    double* w= ramp_alloc(nz);
+
+    for (k=0; k<nz; k++) {
+      ramp_entry(ea+2*k, k, nz, skip, h->base);
+      for (i=0; i<nx; i++) 
+	ramp_entry(ex+2*(i*nz+k), k, nz, skip, h->coef[0]*(i-half[0]));
+      for (j=0; j<ny; j++) 
+	ramp_entry(ey+2*(j*nz+k), k, nz, skip, h->coef[1]*(j-half[1]));
+    }
+
+    for (i=0; i<nx; i++) {
+      for (k=0; k<2*nz; k++) w[k]= ea[k];
+      ramp_scaled(w, ex + 2*i*nz, scale, 0.0, nz);
+      for (j=0; j<ny; j++)
+	ramp_product(spectrum + 2*((i*ny+j)*nz), w, ey + 2*j*nz, nz);
+    }
+
+    free(ea);
+    free(ex);
+    free(ey);
+    free(w);
+  }
+}
+
 static void shear_x( FComplex* image, double a, double b, double delta,
 		     long nx, long ny, long nz,
 		     double length_x, double length_y, double length_z,
 		     int real_flag )
 {
-  FComplex* here;
-  long halfx= nx/2;
-  long halfy= ny/2;
-  long halfz= nz/2;
-  int i;
-  int j;
-  int k;
-  int lowerbound;
-  double theta;
-  double x_phase_scale;
-  double y_phase_scale;
-  double z_phase_scale;
+  ShearHook h;
   long nx_mod;
   long ny_mod;
   long nz_mod;
@@ -987,47 +1386,23 @@ static void shear_x( FComplex* image, double a, double b, double delta,
   else nz_mod= nz;
 
   /* Step counter */
-  count_shear_x++;
-
-  /* FFT in x */
-  fft3d( image, nx, ny, nz, +1, "x" );
+  BUMP_COUNT(count_shear_x);
 
   /* delta is in voxels, a and b in fractional shears 
-   * (typical range -1 to 1).
+   * (typical range -1 to 1).  Signs of terms are determined by 
+   * relationship between data coordinate system and geometric 
+   * coordinate system.
    */
-  x_phase_scale= 2.0*M_PI*delta/((double)nx_mod);
-  y_phase_scale= 2.0*M_PI*a*length_y/(length_x*ny_mod);
-  z_phase_scale= 2.0*M_PI*b*length_z/(length_x*nz_mod);
-
-  /* Apply phase changes */
-  if (real_flag && !(nx%2)) lowerbound= 1; /* no phase shift at Nyquist freq */
-  else lowerbound= 0;
-  for (i=lowerbound; i<nx; i++) {
-    for (j=0; j<ny; j++) {
-      for (k=0; k<nz; k++) {
-	FComplex t;
-	float c;
-	float s;
-	here= &(MEM(image,nx,ny,nz,i,j,k));
-	t.real= here->real;
-	t.imag= here->imag;
-	/* Signs of terms are determined by relationship between data
-	 * coordinate system and geometric coordinate system.
-	 */
-	theta= (i-halfx)*x_phase_scale 
-	  - (j-halfy)*(i-halfx)*y_phase_scale
-	  + (k-halfz)*(i-halfx)*z_phase_scale;
-	c= cos(theta);
-	s= sin(theta);
-	here->real= c*t.real - s*t.imag;
-	here->imag= c*t.imag + s*t.real;
-      }
-    }
-  }
-
-  /* FFT back in x */
-  fft3d( image, nx, ny, nz, -1, "x" );
-
+  h.axis= 0;
+  h.base= 2.0*M_PI*delta/((double)nx_mod);
+  h.coef[0]= 0.0;
+  h.coef[1]= -2.0*M_PI*a*length_y/(length_x*ny_mod);
+  h.coef[2]= 2.0*M_PI*b*length_z/(length_x*nz_mod);
+  h.skip_nyquist= (real_flag && !(nx%2));
+
+  /* FFT in x, apply phase changes, FFT back */
+  fft3d_filter_many( image, 1, nx*ny*nz, nx, ny, nz, +1, "x", 
+		     shear_phase, &h );
 }
 
 static void shear_y( FComplex* image, double a, double b, double delta,
@@ -1035,18 +1410,7 @@ static void shear_y( FComplex* image, double a, double b, double delta,
 		     double length_x, double length_y, double length_z,
 		     int real_flag )
 {
-  FComplex* here;
-  long halfx= nx/2;
-  long halfy= ny/2;
-  long halfz= nz/2;
-  int i;
-  int j;
-  int k;
-  int lowerbound;
-  double theta;
-  double x_phase_scale;
-  double y_phase_scale;
-  double z_phase_scale;
+  ShearHook h;
   long nx_mod;
   long ny_mod;
   long nz_mod;
@@ -1065,46 +1429,23 @@ static void shear_y( FComplex* image, double a, double b, double delta,
   else nz_mod= nz;
 
   /* Step counter */
-  count_shear_y++;
-
-  /* FFT in y */
-  fft3d( image, nx, ny, nz, +1, "y" );
+  BUMP_COUNT(count_shear_y);
 
   /* delta is in voxels, a and b in fractional shears 
-   * (typical range -1 to 1).
+   * (typical range -1 to 1).  Signs of terms are determined by 
+   * relationship between data coordinate system and geometric 
+   * coordinate system.
    */
-  y_phase_scale= 2.0*M_PI*delta/((double)ny_mod);
-  z_phase_scale= 2.0*M_PI*a*length_z/(length_y*nz_mod);
-  x_phase_scale= 2.0*M_PI*b*length_x/(length_y*nx_mod);
-
-  /* Apply phase changes */
-  if (real_flag && !(ny%2)) lowerbound= 1; /* no phase shift at Nyquist freq */
-  else lowerbound= 0;
-  for (i=0; i<nx; i++) {
-    for (j=lowerbound; j<ny; j++) {
-      for (k=0; k<nz; k++) {
-	FComplex t;
-	float c;
-	float s;
-	here= &(MEM(image,nx,ny,nz,i,j,k));
-	t.real= here->real;
-	t.imag= here->imag;
-	/* Signs of terms are determined by relationship between data
-	 * coordinate system and geometric coordinate system.
-	 */
-	theta= -(j-halfy)*y_phase_scale 
-	  - (k-halfz)*(j-halfy)*z_phase_scale
-	  - (i-halfx)*(j-halfy)*x_phase_scale;
-	c= cos(theta);
-	s= sin(theta);
-	here->real= c*t.real - s*t.imag;
-	here->imag= c*t.imag + s*t.real;
-      }
-    }
-  }
-
-  /* FFT back in y */
-  fft3d( image, nx, ny, nz, -1, "y" );
+  h.axis= 1;
+  h.base= -2.0*M_PI*delta/((double)ny_mod);
+  h.coef[0]= -2.0*M_PI*b*length_x/(length_y*nx_mod);
+  h.coef[1]= 0.0;
+  h.coef[2]= -2.0*M_PI*a*length_z/(length_y*nz_mod);
+  h.skip_nyquist= (real_flag && !(ny%2));
+
+  /* FFT in y, apply phase changes, FFT back */
+  fft3d_filter_many( image, 1, nx*ny*nz, nx, ny, nz, +1, "y", 
+		     shear_phase, &h );
 }
 
 static void shear_z( FComplex* image, double a, double b, double delta,
@@ -1112,18 +1453,7 @@ static void shear_z( FComplex* image, double a, double b, double delta,
 		     double length_x, double length_y, double length_z,
 		     int real_flag )
 {
-  FComplex* here;
-  long halfx= nx/2;
-  long halfy= ny/2;
-  long halfz= nz/2;
-  int i;
-  int j;
-  int k;
-  int lowerbound;
-  double theta;
-  double x_phase_scale;
-  double y_phase_scale;
-  double z_phase_scale;
+  ShearHook h;
   long nx_mod;
   long ny_mod;
   long nz_mod;
@@ -1142,46 +1472,23 @@ static void shear_z( FComplex* image, double a, double b, double delta,
   else nz_mod= nz;
 
   /* Step counter */
-  count_shear_z++;
-
-  /* FFT in z */
-  fft3d( image, nx, ny, nz, +1, "z" );
+  BUMP_COUNT(count_shear_z);
 
   /* delta is in voxels, a and b in fractional shears 
-   * (typical range -1 to 1).
+   * (typical range -1 to 1).  Signs of terms are determined by 
+   * relationship between data coordinate system and geometric 
+   * coordinate system.
    */
-  z_phase_scale= 2.0*M_PI*delta/((double)nz_mod);
-  x_phase_scale= 2.0*M_PI*a*length_x/(length_z*nx_mod);
-  y_phase_scale= 2.0*M_PI*b*length_y/(length_z*ny_mod);
-
-  /* Apply phase changes */
-  if (real_flag && !(nz%2)) lowerbound= 1; /* no phase shift at Nyquist freq */
-  else lowerbound= 0;
-  for (i=0; i<nx; i++) {
-    for (j=0; j<ny; j++) {
-      for (k=lowerbound; k<nz; k++) {
-	FComplex t;
-	float c;
-	float s;
-	here= &(MEM(image,nx,ny,nz,i,j,k));
-	t.real= here->real;
-	t.imag= here->imag;
-	/* Signs of terms are determined by relationship between data
-	 * coordinate system and geometric coordinate system.
-	 */
-	theta= (k-halfz)*z_phase_scale 
-	  + (i-halfx)*(k-halfz)*x_phase_scale
-	  - (j-halfy)*(k-halfz)*y_phase_scale;
-	c= cos(theta);
-	s= sin(theta);
-	here->real= c*t.real - s*t.imag;
-	here->imag= c*t.imag + s*t.real;
-      }
-    }
-  }
-
-  /* FFT back in z */
-  fft3d( image, nx, ny, nz, -1, "z" );
+  h.axis= 2;
+  h.base= 2.0*M_PI*delta/((double)nz_mod);
+  h.coef[0]= 2.0*M_PI*a*length_x/(length_z*nx_mod);
+  h.coef[1]= -2.0*M_PI*b*length_y/(length_z*ny_mod);
+  h.coef[2]= 0.0;
+  h.skip_nyquist= (real_flag && !(nz%2));
+
+  /* FFT in z, apply phase changes, FFT back */
+  fft3d_filter_many( image, 1, nx*ny*nz, nx, ny, nz, +1, "z", 
+		     shear_phase, &h );
 }
 
 static void shift_only( TransParams* t, FComplex* moved_image, 
@@ -1618,7 +1925,7 @@ void fshrot3d_set_shift_phases( double dx, double dy, double dz,
   else nz_mod= nz;
 
   /* Step counter */
-  count_set_phase++;
+  BUMP_COUNT(count_set_phase);
 
   /* No need for FFT here; we are assuming k-space data. */
 
@@ -1707,7 +2014,7 @@ void fourier_shift_rot3d( Quat* q, double dx, double dy, double dz,
   trans.dz= dz;
 
   /* Step counter */
-  count_calls++;
+  BUMP_COUNT(count_calls);
 
   /* Copy into output buffer */
   for (i=0; i<nx*ny*nz; i++) {
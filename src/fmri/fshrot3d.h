@@ -33,6 +33,7 @@
 #define FR3D_DEBUG 0
 #define FR3D_SHEAR_PATTERN 1
 #define FR3D_QUAL_MEASURE 2
+#define FR3D_PHASE_RAMP 3
 
 #define FR3D_SHEAR_4 0
 #define FR3D_SHEAR_7 1
@@ -44,6 +45,15 @@
 #define FR3D_QUAL_SUM_SQR 3
 #define FR3D_QUAL_UNIT_CELL 4
 
+/* Ways of computing the shear phase ramps.  The default is the
+ * fastest the processor supports; FR3D_RAMP_TRIG evaluates cos()
+ * and sin() at every voxel and serves as a reference.
+ */
+#define FR3D_RAMP_TRIG 0
+#define FR3D_RAMP_TABLE 1
+#define FR3D_RAMP_SSE2 2
+#define FR3D_RAMP_AVX 3
+
 /* Entry points for getting and setting fshrot3d switches */
 void fshrot3d_set(int, int);
 int fshrot3d_get(int);
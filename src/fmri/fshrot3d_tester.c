@@ -0,0 +1,350 @@
+/************************************************************
+ *                                                          *
+ *  fshrot3d_tester.c                                       *
+ *                                                          *
+ *  Permission is hereby granted to any individual or       *
+ *  institution for use, copying, or redistribution of      *
+ *  this code and associated documentation, provided        *
+ *  that such code and documentation are not sold for       *
+ *  profit and the following copyright notice is retained   *
+ *  in the code and documentation:                          *
+ *                                                          *
+ *  Copyright (c) 1999 Department of Statistics             *
+ *                     Carnegie Mellon University           *
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ *                                                          *
+ ************************************************************/
+
+/* This program checks the phase ramp kernels used by fourier_shift_rot3d.
+ * A random volume is rotated and shifted with each shear pattern,
+ * once for each ramp method the processor supports.  The table-driven
+ * and vector methods must agree with FR3D_RAMP_TRIG (cos() and sin()
+ * at every voxel) to float precision, and with each other exactly.
+ * The time per call is reported for each.
+ *
+ * Since all of those share the new shear code, the volume is also
+ * shifted alone and rotated about each axis (which between them use
+ * every shear term) and compared with ref_shift_rot(), a copy of the
+ * original implementation: fft3d() along the shear axis, then a
+ * phase loop over centered frequencies.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include "mri.h"
+#include "fmri.h"
+
+/* Largest acceptable error, relative to the largest output value */
+#define TOLERANCE 1.0e-5
+#define REF_TOLERANCE 1.0e-6 /* against the original implementation */
+
+#define MEM(matrix,nx,ny,nz,x,y,z) matrix[((((x)*ny)+(y))*nz)+(z)]
+
+static char* ramp_names[]= { "trig", "table", "sse2", "avx" };
+static char* pattern_names[]= { "4 shears", "7 shears", "13 shears" };
+static char* axis_names[]= { "x", "y", "z" };
+
+static double now()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6*tv.tv_usec;
+}
+
+/* The shear along one axis as the original shear_x(), shear_y() and
+ * shear_z() did it, with the same arithmetic.
+ */
+static void ref_shear( FComplex* image, int axis, double a, double b, 
+		       double delta, long nx, long ny, long nz,
+		       double length_x, double length_y, double length_z,
+		       int real_flag )
+{
+  FComplex* here;
+  long halfx= nx/2;
+  long halfy= ny/2;
+  long halfz= nz/2;
+  long n_axis= (axis==0) ? nx : ((axis==1) ? ny : nz);
+  int i;
+  int j;
+  int k;
+  int lowerbound;
+  double theta;
+  double x_phase_scale;
+  double y_phase_scale;
+  double z_phase_scale;
+  long nx_mod;
+  long ny_mod;
+  long nz_mod;
+
+  if (a==0.0 && b==0.0 && delta==0.0) return;
+
+  if (nx>1 && (nx % 2)) nx_mod= nx-1;
+  else nx_mod= nx;
+  if (ny>1 && (ny % 2)) ny_mod= ny-1;
+  else ny_mod= ny;
+  if (nz>1 && (nz % 2)) nz_mod= nz-1;
+  else nz_mod= nz;
+
+  fft3d( image, nx, ny, nz, +1, axis_names[axis] );
+
+  switch (axis) {
+  case 0:
+    x_phase_scale= 2.0*M_PI*delta/((double)nx_mod);
+    y_phase_scale= 2.0*M_PI*a*length_y/(length_x*ny_mod);
+    z_phase_scale= 2.0*M_PI*b*length_z/(length_x*nz_mod);
+    break;
+  case 1:
+    y_phase_scale= 2.0*M_PI*delta/((double)ny_mod);
+    z_phase_scale= 2.0*M_PI*a*length_z/(length_y*nz_mod);
+    x_phase_scale= 2.0*M_PI*b*length_x/(length_y*nx_mod);
+    break;
+  default:
+    z_phase_scale= 2.0*M_PI*delta/((double)nz_mod);
+    x_phase_scale= 2.0*M_PI*a*length_x/(length_z*nx_mod);
+    y_phase_scale= 2.0*M_PI*b*length_y/(length_z*ny_mod);
+  }
+
+  if (real_flag && !(n_axis%2)) lowerbound= 1;
+  else lowerbound= 0;
+  for (i=(axis==0) ? lowerbound : 0; i<nx; i++) {
+    for (j=(axis==1) ? lowerbound : 0; j<ny; j++) {
+      for (k=(axis==2) ? lowerbound : 0; k<nz; k++) {
+	FComplex t;
+	float c;
+	float s;
+	here= &(MEM(image,nx,ny,nz,i,j,k));
+	t.real= here->real;
+	t.imag= here->imag;
+	if (axis==0)
+	  theta= (i-halfx)*x_phase_scale 
+	    - (j-halfy)*(i-halfx)*y_phase_scale
+	    + (k-halfz)*(i-halfx)*z_phase_scale;
+	else if (axis==1)
+	  theta= -(j-halfy)*y_phase_scale 
+	    - (k-halfz)*(j-halfy)*z_phase_scale
+	    - (i-halfx)*(j-halfy)*x_phase_scale;
+	else
+	  theta= (k-halfz)*z_phase_scale 
+	    + (i-halfx)*(k-halfz)*x_phase_scale
+	    - (j-halfy)*(k-halfz)*y_phase_scale;
+	c= cos(theta);
+	s= sin(theta);
+	here->real= c*t.real - s*t.imag;
+	here->imag= c*t.imag + s*t.real;
+      }
+    }
+  }
+
+  fft3d( image, nx, ny, nz, -1, axis_names[axis] );
+}
+
+/* The original fourier_shift_rot3d() for a pure shift or a rotation
+ * about one axis (rot_axis 0, 1 or 2), which skip the shear patterns.
+ */
+static void ref_shift_rot( Quat* q, int rot_axis, 
+			   double dx, double dy, double dz,
+			   FComplex* orig, FComplex* moved,
+			   long nx, long ny, long nz,
+			   double lx, double ly, double lz, int real_flag )
+{
+  double alpha;
+  double delta;
+
+  memcpy(moved, orig, nx*ny*nz*sizeof(FComplex));
+  switch (rot_axis) {
+  case 0:
+    alpha= -(q->x/q->w);
+    delta= 2.0*q->x*q->w;
+    ref_shear(moved, 1, alpha, 0.0, 0.0, nx, ny, nz, lx, ly, lz, real_flag);
+    ref_shear(moved, 2, 0.0, delta, dz, nx, ny, nz, lx, ly, lz, real_flag);
+    ref_shear(moved, 1, alpha, 0.0, dy - alpha*dz, nx, ny, nz, 
+	      lx, ly, lz, real_flag);
+    ref_shear(moved, 0, 0.0, 0.0, dx, nx, ny, nz, lx, ly, lz, real_flag);
+    break;
+  case 1:
+    alpha= -(q->y/q->w);
+    delta= 2.0*q->y*q->w;
+    ref_shear(moved, 2, alpha, 0.0, 0.0, nx, ny, nz, lx, ly, lz, real_flag);
+    ref_shear(moved, 0, 0.0, delta, dx, nx, ny, nz, lx, ly, lz, real_flag);
+    ref_shear(moved, 2, alpha, 0.0, dz - alpha*dx, nx, ny, nz, 
+	      lx, ly, lz, real_flag);
+    ref_shear(moved, 1, 0.0, 0.0, dy, nx, ny, nz, lx, ly, lz, real_flag);
+    break;
+  case 2:
+    alpha= -(q->z/q->w);
+    delta= 2.0*q->z*q->w;
+    ref_shear(moved, 0, alpha, 0.0, 0.0, nx, ny, nz, lx, ly, lz, real_flag);
+    ref_shear(moved, 1, 0.0, delta, dy, nx, ny, nz, lx, ly, lz, real_flag);
+    ref_shear(moved, 0, alpha, 0.0, dx - alpha*dy, nx, ny, nz, 
+	      lx, ly, lz, real_flag);
+    ref_shear(moved, 2, 0.0, 0.0, dz, nx, ny, nz, lx, ly, lz, real_flag);
+    break;
+  default:
+    ref_shear(moved, 0, 0.0, 0.0, dx, nx, ny, nz, lx, ly, lz, real_flag);
+    ref_shear(moved, 1, 0.0, 0.0, dy, nx, ny, nz, lx, ly, lz, real_flag);
+    ref_shear(moved, 2, 0.0, 0.0, dz, nx, ny, nz, lx, ly, lz, real_flag);
+  }
+}
+
+/* Largest difference between a and b, relative to the largest value in b */
+static double rel_error( FComplex* a, FComplex* b, long n )
+{
+  double max_val= 0.0;
+  double max_err= 0.0;
+  double err;
+  long i;
+
+  for (i=0; i<n; i++) {
+    if (fabs(b[i].real)>max_val) max_val= fabs(b[i].real);
+    err= fabs(a[i].real-b[i].real)+fabs(a[i].imag-b[i].imag);
+    if (!(err<=max_err)) max_err= err;
+  }
+  return max_err/max_val;
+}
+
+int main( int argc, char* argv[] ) 
+{
+  FComplex* orig;
+  FComplex* ref;
+  FComplex* first;
+  FComplex* moved;
+  Quat q;
+  long nx= 64;
+  long ny= 64;
+  long nz= 32;
+  long n;
+  long i;
+  int reps= 5;
+  int rep;
+  int pattern;
+  int axis;
+  int ramp;
+  int best;
+  int failures= 0;
+  double dx= 1.3;
+  double dy= -0.7;
+  double dz= 0.45;
+  double t0= 0.0;
+  double secs;
+  double err;
+
+  if (argc != 1 && argc != 4 && argc != 5) {
+    fprintf(stderr,"Usage: %s [nx ny nz [reps]]\n",argv[0]);
+    exit(-1);
+  }
+  if (argc >= 4) {
+    nx= atol(argv[1]);
+    ny= atol(argv[2]);
+    nz= atol(argv[3]);
+  }
+  if (argc == 5) reps= atoi(argv[4]);
+  if (nx<=0 || ny<=0 || nz<=0 || reps<=0) {
+    fprintf(stderr,"%s: dimensions and reps must be positive\n",argv[0]);
+    exit(-1);
+  }
+  n= nx*ny*nz;
+
+  if (!(orig= (FComplex*)malloc(n*sizeof(FComplex)))
+      || !(ref= (FComplex*)malloc(n*sizeof(FComplex)))
+      || !(first= (FComplex*)malloc(n*sizeof(FComplex)))
+      || !(moved= (FComplex*)malloc(n*sizeof(FComplex)))) {
+    fprintf(stderr,"%s: unable to allocate %ld FComplex!\n",argv[0],4*n);
+    exit(-1);
+  }
+  for (i=0; i<n; i++) {
+    orig[i].real= drand48();
+    orig[i].imag= 0.0;
+  }
+
+  fshrot3d_set(FR3D_PHASE_RAMP, -1);
+  best= fshrot3d_get(FR3D_PHASE_RAMP);
+  printf("%ld by %ld by %ld, %d reps, best ramp method %s\n",
+	 nx, ny, nz, reps, ramp_names[best]);
+
+  quat_from_axis_angle(&q, 0.3, -0.5, 0.8, 0.12);
+  for (pattern=FR3D_SHEAR_4; pattern<=FR3D_SHEAR_13; pattern++) {
+    fshrot3d_set(FR3D_SHEAR_PATTERN, pattern);
+    /* The 13 shear pattern does not support translations */
+    if (pattern==FR3D_SHEAR_13) dx= dy= dz= 0.0;
+    for (ramp=FR3D_RAMP_TRIG; ramp<=best; ramp++) {
+      fshrot3d_set(FR3D_PHASE_RAMP, ramp);
+      /* The first call also makes the FFT plans, so it is not timed */
+      for (rep=0; rep<=reps; rep++) {
+	if (rep==1) t0= now();
+	fourier_shift_rot3d(&q, dx, dy, dz, orig, moved, nx, ny, nz,
+			    1.0, 1.1, 2.5, 1);
+      }
+      secs= (now()-t0)/reps;
+
+      if (ramp==FR3D_RAMP_TRIG) {
+	memcpy(ref, moved, n*sizeof(FComplex));
+	printf("%-10s %-6s %9.2f ms\n",
+	       pattern_names[pattern], ramp_names[ramp], 1000.0*secs);
+	continue;
+      }
+      if (ramp==FR3D_RAMP_TABLE) memcpy(first, moved, n*sizeof(FComplex));
+
+      err= rel_error(moved, ref, n);
+      printf("%-10s %-6s %9.2f ms   error %g",
+	     pattern_names[pattern], ramp_names[ramp], 1000.0*secs, err);
+      if (!(err <= TOLERANCE)) {
+	printf("   TOO LARGE\n");
+	failures++;
+      }
+      else if (memcmp(first, moved, n*sizeof(FComplex))) {
+	printf("   DIFFERS FROM TABLE\n");
+	failures++;
+      }
+      else printf("   ok\n");
+    }
+  }
+
+  /* Against the original implementation */
+  dx= 1.3;
+  dy= -0.7;
+  dz= 0.45;
+  for (axis=-1; axis<3; axis++) {
+    if (axis<0) quat_identity(&q);
+    else quat_from_axis_angle(&q, (axis==0), (axis==1), (axis==2), 0.12);
+    ref_shift_rot(&q, axis, dx, dy, dz, orig, ref, nx, ny, nz, 
+		  1.0, 1.1, 2.5, 1);
+    for (ramp=FR3D_RAMP_TRIG; ramp<=best; ramp++) {
+      fshrot3d_set(FR3D_PHASE_RAMP, ramp);
+      fourier_shift_rot3d(&q, dx, dy, dz, orig, moved, nx, ny, nz,
+			  1.0, 1.1, 2.5, 1);
+      err= rel_error(moved, ref, n);
+      printf("%-10s %-6s vs. original   error %g", 
+	     (axis<0) ? "shift" : ((axis==0) ? "x rot" : 
+				   ((axis==1) ? "y rot" : "z rot")),
+	     ramp_names[ramp], err);
+      if (!(err <= REF_TOLERANCE)) {
+	printf("   TOO LARGE\n");
+	failures++;
+      }
+      else printf("   ok\n");
+    }
+  }
+
+  if (failures) {
+    printf("%d ramp methods FAILED\n",failures);
+    exit(1);
+  }
+  printf("all ramp methods agree\n");
+  return 0;
+}
@@ -0,0 +1,263 @@
+/************************************************************
+ *                                                          *
+ *  fthreads.c                                              *
+ *                                                          *
+ *  Permission is hereby granted to any individual or       *
+ *  institution for use, copying, or redistribution of      *
+ *  this code and associated documentation, provided        *
+ *  that such code and documentation are not sold for       *
+ *  profit and the following copyright notice is retained   *
+ *  in the code and documentation:                          *
+ *     Copyright (c) 1998 Department of Statistics,         *
+ *                        Carnegie Mellon University        *
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ ************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif
+#include "mri.h"
+#include "fmri.h"
+#include "misc.h"
+
+/* Notes-
+ * -These are the pieces shared by the tools and library routines
+ *  that divide their work among threads, so that the thread count
+ *  means the same thing everywhere and the fork/join logic lives in
+ *  one place.
+ * -fthr_run_jobs() starts fresh threads on each call rather than
+ *  keeping a pool.  No thread outlives the call, so a program can
+ *  still fork safely between calls (libpar's PAR_LOCAL workers do),
+ *  and there is nothing to shut down.  The price is a thread start
+ *  per job per call, so each caller sends small problems down its
+ *  serial path (MIN_THREADED_FLOPS in batchmult.c, for example).
+ * -In fthr_run_ordered() the slot for item i is free once item
+ *  i-nslots has been written, so the reader never gets more than
+ *  nslots items ahead of the writer.  The workers take READY slots
+ *  strictly in item order; next_work names the next one.
+ */
+
+#define SLOT_FREE 0
+#define SLOT_READY 1 /* input read, waiting for a worker */
+#define SLOT_BUSY 2
+#define SLOT_DONE 3 /* output waiting to be written */
+
+typedef struct {
+  void (*func)(void*);
+  void* job;
+} JobCall;
+
+int fthr_count( const char* caller, int requested )
+{
+  int n= requested;
+
+  if (n<0) Abort("%s: thread count must be non-negative.\n",caller);
+  if (n==0) n= (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (n<1) n= 1;
+  return n;
+}
+
+long fthr_share_start( long n, int nshares, int i )
+{
+  return (n*i)/nshares;
+}
+
+#ifdef USE_PTHREAD
+static void* jobTrampoline( void* arg )
+{
+  JobCall* call= (JobCall*)arg;
+  call->func(call->job);
+  return NULL;
+}
+#endif
+
+void fthr_run_jobs( void* jobs, int njobs, size_t jobSize,
+		    void (*func)(void*) )
+{
+  char* base= (char*)jobs;
+  int i;
+
+#ifdef USE_PTHREAD
+  if (njobs>1) {
+    JobCall* calls;
+    pthread_t* threads;
+
+    if (!(calls= (JobCall*)malloc(njobs*sizeof(JobCall))))
+      Abort("fthr_run_jobs: unable to allocate %ld bytes!\n",
+	    njobs*sizeof(JobCall));
+    if (!(threads= (pthread_t*)malloc(njobs*sizeof(pthread_t))))
+      Abort("fthr_run_jobs: unable to allocate %ld bytes!\n",
+	    njobs*sizeof(pthread_t));
+    /* The calling thread takes the first job itself */
+    for (i=1; i<njobs; i++) {
+      calls[i].func= func;
+      calls[i].job= base + i*jobSize;
+      if (pthread_create(&(threads[i]), NULL, jobTrampoline, &(calls[i])))
+	Abort("fthr_run_jobs: unable to start a worker thread!\n");
+    }
+    func(base);
+    for (i=1; i<njobs; i++) pthread_join(threads[i], NULL);
+    free(threads);
+    free(calls);
+    return;
+  }
+#endif
+
+  for (i=0; i<njobs; i++) func(base + i*jobSize);
+}
+
+#ifdef USE_PTHREAD
+
+typedef struct ordered_slot_struct {
+  int state;
+  long long item;
+} OrderedSlot;
+
+typedef struct ordered_pool_struct {
+  pthread_mutex_t lock;
+  pthread_cond_t ready; /* a slot became READY, or no more input */
+  pthread_cond_t done; /* a slot became DONE */
+  OrderedSlot* slots;
+  int nslots;
+  long long next_work; /* next item to be given to a worker */
+  int finished;
+  void* (*startWorker)(void* hook);
+  void (*endWorker)(void* hook, void* state);
+  void (*work)(void* hook, void* state, long long item, int slot);
+  void* hook;
+} OrderedPool;
+
+static void* orderedWorker( void* arg )
+{
+  OrderedPool* p= (OrderedPool*)arg;
+  void* state= (p->startWorker ? p->startWorker(p->hook) : NULL);
+  OrderedSlot* s;
+  int slot;
+
+  pthread_mutex_lock(&(p->lock));
+  while (1) {
+    slot= (int)(p->next_work % p->nslots);
+    s= &(p->slots[slot]);
+    if (s->state==SLOT_READY && s->item==p->next_work) {
+      s->state= SLOT_BUSY;
+      p->next_work++;
+      pthread_mutex_unlock(&(p->lock));
+      p->work(p->hook, state, s->item, slot);
+      pthread_mutex_lock(&(p->lock));
+      s->state= SLOT_DONE;
+      pthread_cond_broadcast(&(p->done));
+    }
+    else if (p->finished) break;
+    else pthread_cond_wait(&(p->ready), &(p->lock));
+  }
+  pthread_mutex_unlock(&(p->lock));
+  if (p->endWorker) p->endWorker(p->hook, state);
+  return NULL;
+}
+
+/* Waits for item to be processed, then writes it and frees its slot */
+static void writeOrdered( OrderedPool* p, long long item,
+			  void (*write)(void* hook, long long item, int slot) )
+{
+  int slot= (int)(item % p->nslots);
+  OrderedSlot* s= &(p->slots[slot]);
+
+  pthread_mutex_lock(&(p->lock));
+  while (s->state != SLOT_DONE) pthread_cond_wait(&(p->done), &(p->lock));
+  pthread_mutex_unlock(&(p->lock));
+  write(p->hook, item, slot);
+  pthread_mutex_lock(&(p->lock));
+  s->state= SLOT_FREE;
+  pthread_mutex_unlock(&(p->lock));
+}
+
+#endif /* USE_PTHREAD */
+
+void fthr_run_ordered( long long nitems, int nthreads, int nslots,
+		       void* (*startWorker)(void* hook),
+		       void (*endWorker)(void* hook, void* state),
+		       void (*read)(void* hook, long long item, int slot),
+		       void (*work)(void* hook, void* state, long long item,
+				    int slot),
+		       void (*write)(void* hook, long long item, int slot),
+		       void* hook )
+{
+#ifdef USE_PTHREAD
+  OrderedPool p;
+  pthread_t* threads;
+  long long next_write= 0;
+  long long item;
+  int i;
+
+  if (nthreads<1) nthreads= 1;
+  if (nslots<1) Abort("fthr_run_ordered: need at least one slot!\n");
+  p.nslots= nslots;
+  p.next_work= 0;
+  p.finished= 0;
+  p.startWorker= startWorker;
+  p.endWorker= endWorker;
+  p.work= work;
+  p.hook= hook;
+  if (!(p.slots= (OrderedSlot*)calloc(nslots, sizeof(OrderedSlot))))
+    Abort("fthr_run_ordered: unable to allocate %ld bytes!\n",
+	  nslots*sizeof(OrderedSlot));
+  pthread_mutex_init(&(p.lock), NULL);
+  pthread_cond_init(&(p.ready), NULL);
+  pthread_cond_init(&(p.done), NULL);
+  if (!(threads= (pthread_t*)malloc(nthreads*sizeof(pthread_t))))
+    Abort("fthr_run_ordered: unable to allocate %ld bytes!\n",
+	  nthreads*sizeof(pthread_t));
+  for (i=0; i<nthreads; i++)
+    if (pthread_create(&(threads[i]), NULL, orderedWorker, &p))
+      Abort("fthr_run_ordered: unable to start a worker thread!\n");
+
+  for (item=0; item<nitems; item++) {
+    OrderedSlot* s= &(p.slots[item % nslots]);
+    while (next_write <= item-nslots) writeOrdered(&p, next_write++, write);
+    read(hook, item, (int)(item % nslots));
+    pthread_mutex_lock(&(p.lock));
+    s->item= item;
+    s->state= SLOT_READY;
+    pthread_cond_broadcast(&(p.ready));
+    pthread_mutex_unlock(&(p.lock));
+  }
+  while (next_write < nitems) writeOrdered(&p, next_write++, write);
+
+  pthread_mutex_lock(&(p.lock));
+  p.finished= 1;
+  pthread_cond_broadcast(&(p.ready));
+  pthread_mutex_unlock(&(p.lock));
+  for (i=0; i<nthreads; i++) pthread_join(threads[i], NULL);
+
+  free(threads);
+  free(p.slots);
+  pthread_cond_destroy(&(p.ready));
+  pthread_cond_destroy(&(p.done));
+  pthread_mutex_destroy(&(p.lock));
+#else
+  void* state= (startWorker ? startWorker(hook) : NULL);
+  long long item;
+
+  for (item=0; item<nitems; item++) {
+    read(hook, item, 0);
+    work(hook, state, item, 0);
+    write(hook, item, 0);
+  }
+  if (endWorker) endWorker(hook, state);
+#endif
+}
@@ -0,0 +1,82 @@
+/************************************************************
+ *                                                          *
+ *  fthreads.h                                              *
+ *                                                          *
+ *  Permission is hereby granted to any individual or       *
+ *  institution for use, copying, or redistribution of      *
+ *  this code and associated documentation, provided        *
+ *  that such code and documentation are not sold for       *
+ *  profit and the following copyright notice is retained   *
+ *  in the code and documentation:                          *
+ *     Copyright (c) 1998 Department of Statistics,         *
+ *                        Carnegie Mellon University        *
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ ************************************************************/
+/* Header file for fthreads.c */
+
+#ifndef INCL_FTHREADS_H
+#define INCL_FTHREADS_H 1
+
+#include <stddef.h>
+
+/* fthr_count() turns a requested thread count into the number to
+ * use.  0 means one per online processor; a negative request is an
+ * error, reported under the name caller.  The result is at least 1.
+ */
+int fthr_count( const char* caller, int requested );
+
+/* fthr_share_start() returns the first index of share i when n
+ * items are divided as evenly as possible into nshares contiguous
+ * shares.  Share i covers fthr_share_start(n,nshares,i) up to but
+ * not including fthr_share_start(n,nshares,i+1).
+ */
+long fthr_share_start( long n, int nshares, int i );
+
+/* fthr_run_jobs() calls func once for each of the njobs elements of
+ * the array jobs, each jobSize bytes long, and returns when all of
+ * the calls have finished.  Under USE_PTHREAD each element after the
+ * first gets a thread of its own and the calling thread does the
+ * first; otherwise the calls are made in order.  The threads are
+ * created and joined on every call, which costs some tens of
+ * microseconds, so callers must give each call enough work to cover
+ * that and run small problems serially.
+ */
+void fthr_run_jobs( void* jobs, int njobs, size_t jobSize,
+		    void (*func)(void*) );
+
+/* fthr_run_ordered() runs a reader/worker/writer pipeline over nitems
+ * items which must be read and written in order but can be processed
+ * independently.  The calling thread does all the I/O: it calls read
+ * for each item in turn and write for each item once it has been
+ * processed, in the same order.  In between, nthreads worker threads
+ * call work on the items.  Item i always uses buffer slot i%nslots,
+ * and at most nslots items are in flight at once, so the caller
+ * needs nslots sets of buffers; 2*nthreads is a good choice.  Each
+ * worker calls startWorker once (if it is non-NULL) to get a state
+ * pointer which it passes to work, and endWorker at the end.  All of
+ * the callbacks get hook as their first argument.  Without
+ * USE_PTHREAD the items are simply read, processed and written one
+ * at a time.
+ */
+void fthr_run_ordered( long long nitems, int nthreads, int nslots,
+		       void* (*startWorker)(void* hook),
+		       void (*endWorker)(void* hook, void* state),
+		       void (*read)(void* hook, long long item, int slot),
+		       void (*work)(void* hook, void* state, long long item,
+				    int slot),
+		       void (*write)(void* hook, long long item, int slot),
+		       void* hook );
+
+#endif
@@ -79,6 +79,15 @@
  *     the factor matrix to the product of squared diagonal elements of the
  *     factor matrix, as a measure of orthogonality of the factors, if 
  *     requested.
+ * -glm_fit_many fits nseries observation vectors against the same factor
+ *  matrix.  Series s starts at obs+s*obs_stride and its parameters go to
+ *  param_out+s*param_stride;  residuals replace the observations as for
+ *  glm_fit.  The llsq regressor does this with a single SVD and a few
+ *  matrix-matrix products;  the other types just fit the series one by one.
+ * -The llsq regressor keeps the SVD of the last factor matrix it saw, and
+ *  reuses it if the next fit has exactly the same factors.  Packing out
+ *  a different set of missing observations changes the packed factors,
+ *  so the missing-data pattern is part of the key.
  *
  * Implementation Notes-
  * -subscripts in the range i,j,k,etc. denote values 0<i<nobs, or
@@ -99,12 +108,21 @@ typedef struct regressor_llsq_data_struct {
   double* inv_singular;
   double* residuals;
   double* covariance_ftn;
+  double* xtx_inv_ftn;
   double* rwork;
   int lwork;
   int nfactorsAllocated;
   int nobsAllocated;
   int complexFlagAllocated;
   int lastFitValid;
+  double* factors_key; /* the factors which were decomposed */
+  int keyValid;
+  int keyNobs;
+  int keyNfactors;
+  double* batch_obs_ftn; /* nobs by ncols; becomes the residuals */
+  double* batch_tmp_ftn; /* nfactors by ncols */
+  double* batch_b_ftn; /* nfactors by ncols */
+  int batchColsAllocated;
 } LLSqData;
 
 static char rcsid[] = "$Id: glm.c,v 1.29.2.6 2008/01/29 00:57:21 welling Exp $";
@@ -197,6 +215,15 @@ int glm_fit(Regressor* r, double* obs, const double* factors,
   return( (r->fit)(r, obs, factors, counts, param_out, nobs, nfactors) );
 }
 
+int glm_fit_many(Regressor* r, double* obs, int obs_stride,
+		 const double* factors, const double* counts, 
+		 double* param_out, int param_stride,
+		 int nobs, int nfactors, int nseries)
+{
+  return( (r->fit_many)(r, obs, obs_stride, factors, counts, 
+			param_out, param_stride, nobs, nfactors, nseries) );
+}
+
 int glm_project(Regressor* r, const double* obs_vec_in, 
 		double* factor_vec_out, int nobs, int nfactors)
 {
@@ -317,6 +344,21 @@ static int base_fit(Regressor* r, double* obs, const double* factors,
   return 0;
 }
 
+static int base_fit_many(Regressor* r, double* obs, int obs_stride,
+			 const double* factors, const double* counts, 
+			 double* param_out, int param_stride,
+			 int nobs, int nfactors, int nseries)
+{
+  int s;
+  int retcode= 0;
+
+  /* Every series is fit, even if an earlier one fails */
+  for (s=0; s<nseries; s++) 
+    if ((r->fit)(r, obs+s*obs_stride, factors, counts, 
+		 param_out+s*param_stride, nobs, nfactors)) retcode= 1;
+  return retcode;
+}
+
 static int base_project(Regressor* r, const double* obs_vec_in, 
 			double* factor_vec_out, int nobs, int nfactors)
 {
@@ -357,6 +399,7 @@ Regressor* glm_create_base_regressor(void)
   result->get= base_get;
   result->n_params= base_n_params;
   result->fit= base_fit;
+  result->fit_many= base_fit_many;
   result->project= base_project;
   result->normproject= base_normproject;
   result->getXtXInv= base_getXtXInv;
@@ -415,6 +458,18 @@ static void llsq_check_memory(Regressor* r, int nobs, int nfactors)
 	  (double*)malloc(complex_fac*complex_fac*nfactors*nfactors*sizeof(double)))) 
       MALLOC_FAILURE(complex_fac*complex_fac*nfactors*nfactors,double);
 
+    if (data->xtx_inv_ftn) free(data->xtx_inv_ftn);
+    if (!(data->xtx_inv_ftn=
+	  (double*)malloc(nfactors*nfactors*sizeof(double))))
+      MALLOC_FAILURE(nfactors*nfactors,double);
+
+    if (data->factors_key) free(data->factors_key);
+    if (!(data->factors_key=
+	  (double*)malloc(nobs*nfactors*sizeof(double))))
+      MALLOC_FAILURE(nobs*nfactors,double);
+    data->keyValid= 0;
+    data->batchColsAllocated= 0; /* batch buffers are sized by nobs */
+
     data->lwork= 5*nfactors+nobs; /* upper limit of what everyone needs */
     if (data->rwork) free(data->rwork);
     if (!(data->rwork= (double*)malloc(data->lwork*sizeof(double))))
@@ -525,15 +580,31 @@ static void llsq_calc_residuals(double* res,
 
 }
 
-static void calc_covariances(double* covariance_ftn, double* residuals, 
-			   double* v_ftn, double* inv_singular,
-			   int nfactors, int nobs, int complex_flag)
+static void calc_xtx_inv(double* xtx_inv_ftn, double* v_ftn, 
+			 double* inv_singular, int nfactors)
 {
-  int i;
   int a;
   int b;
   int c;
 
+  for (a=0; a<nfactors; a++)
+    for (b=0; b<nfactors; b++) {
+      double sum= 0.0;
+      for (c=0; c<nfactors; c++) 
+	sum += v_ftn[(a*nfactors)+c] * v_ftn[(b*nfactors)+c] 
+	  * inv_singular[c] * inv_singular[c];
+      xtx_inv_ftn[(b*nfactors)+a]= sum;
+    }
+}
+
+static void calc_covariances(double* covariance_ftn, const double* residuals, 
+			     double* xtx_inv_ftn, 
+			     int nfactors, int nobs, int complex_flag)
+{
+  int i;
+  int a;
+  int b;
+
   if (nobs>nfactors) {
     if (complex_flag) {
       double sigmasqr_rr;
@@ -552,10 +623,7 @@ static void calc_covariances(double* covariance_ftn, double* residuals,
       sigmasqr_ri /= (double)(nobs-nfactors);
       for (a=0; a<nfactors; a++)
 	for (b=0; b<nfactors; b++) {
-	  double sum= 0.0;
-	  for (c=0; c<nfactors; c++) 
-	    sum += v_ftn[(a*nfactors)+c] * v_ftn[(b*nfactors)+c] 
-	      * inv_singular[c] * inv_singular[c];
+	  double sum= xtx_inv_ftn[(b*nfactors)+a];
 	  covariance_ftn[2*( 2*((b*nfactors)+a)   )   ]= sum*sigmasqr_rr;
 	  covariance_ftn[2*( 2*((b*nfactors)+a)   ) +1]= sum*sigmasqr_ri;
 	  covariance_ftn[2*( 2*((b*nfactors)+a)+1 )   ]= sum*sigmasqr_ri;
@@ -568,13 +636,9 @@ static void calc_covariances(double* covariance_ftn, double* residuals,
       for (i=0; i<nobs; i++) sigmasqr += residuals[i]*residuals[i];
       sigmasqr /= (double)(nobs-nfactors);
       for (a=0; a<nfactors; a++)
-	for (b=0; b<nfactors; b++) {
-	  double sum= 0.0;
-	  for (c=0; c<nfactors; c++) 
-	    sum += v_ftn[(a*nfactors)+c] * v_ftn[(b*nfactors)+c] 
-	      * inv_singular[c] * inv_singular[c];
-	  covariance_ftn[(b*nfactors)+a]= sum*sigmasqr;
-	}
+	for (b=0; b<nfactors; b++) 
+	  covariance_ftn[(b*nfactors)+a]= 
+	    xtx_inv_ftn[(b*nfactors)+a]*sigmasqr;
     }
     
   }
@@ -597,6 +661,47 @@ static void calc_covariances(double* covariance_ftn, double* residuals,
   }
 }
 
+static void store_covariances(Regressor* r, double* covariance_ftn,
+			      double* variances, double* covariances,
+			      int nfactors)
+{
+  int a;
+  int b;
+
+  if (r->get(r,GLM_VARIANCES)) {
+    if (r->get(r,GLM_COMPLEX)) {
+      for (a=0; a<nfactors; a++) {
+	variances[2*a]= covariance_ftn[2*(2*((a*nfactors)+a))];
+	variances[(2*a)+1]= covariance_ftn[(2*((a*nfactors)+a)+1)+1];
+      }
+    }
+    else {
+      for (a=0; a<nfactors; a++) 
+	variances[a]= covariance_ftn[(a*nfactors)+a];
+    }
+  }
+  if (r->get(r,GLM_COVARIANCES)) {
+    if (r->get(r,GLM_COMPLEX)) {
+      for (a=0; a<nfactors; a++) 
+	for (b=0; b<nfactors; b++) {
+	  covariances[(2*a)*nfactors+(2*b)]=
+	    covariance_ftn[(2*b)*nfactors+(2*a)];
+	  covariances[(2*a+1)*nfactors+(2*b)]=
+	    covariance_ftn[(2*b)*nfactors+(2*a+1)];
+	  covariances[(2*a)*nfactors+(2*b+1)]=
+	    covariance_ftn[(2*b+1)*nfactors+(2*a)];
+	  covariances[(2*a+1)*nfactors+(2*b+1)]=
+	    covariance_ftn[(2*b+1)*nfactors+(2*a+1)];
+	}
+    }
+    else {
+      for (a=0; a<nfactors; a++) 
+	for (b=0; b<nfactors; b++)
+	  covariances[a*nfactors+b]= covariance_ftn[(b*nfactors)+a];
+    }
+  }
+}
+
 static void calc_sum_squares(double* ssto, double* y_sqr_by_n, 
 			     double* ssr_terms, const double* obs, 
 			     double* bvals, double* singular,
@@ -702,6 +807,87 @@ static double calc_ortho_measure( double* v_ftn, double* singular, int nfactors
   return(eigen_prod/trace_prod);
 }
 
+static int llsq_decompose( Regressor* r, const double* factors,
+			   int nobs, int nfactors )
+{
+  LLSqData* data= (LLSqData*)(r->hook);
+  int lapack_retcode;
+  int i;
+
+  /* Reuse the current decomposition if the factors have not changed */
+  if (data->keyValid && data->lastFitValid && data->keyNobs==nobs 
+      && data->keyNfactors==nfactors) {
+    for (i=0; i<nobs*nfactors; i++) 
+      if (factors[i] != data->factors_key[i]) break;
+    if (i==nobs*nfactors) return 0;
+  }
+  data->keyValid= 0;
+
+  flip_to_ftn(factors, data->factors_or_u_ftn, nobs, nfactors);
+
+  /* Do SVD.  This destroys the factors_or_u_ftn matrix. */
+  (void)DGESVD("O", "A", &nobs, &nfactors, data->factors_or_u_ftn,
+	       &nobs, data->singular, NULL, &nobs, data->v_ftn, &nfactors,
+	       data->rwork, &(data->lwork), &lapack_retcode);
+  if (lapack_retcode<0) {
+    sprintf(err_buf,
+	    "DGESVD argument %d had an illegal value",
+	    -lapack_retcode);
+    _glm_err_txt= err_buf;
+    data->lastFitValid= 0;
+    return 1;
+  }
+  else if (lapack_retcode>0) {
+    sprintf(err_buf,
+	    "DBDSQR did not converge in SGESVD; %d superdiagonals failed",
+	    lapack_retcode);
+    _glm_err_txt= err_buf;
+    data->lastFitValid= 0;
+    return 1;
+  }
+
+  /* Zero out appropriate parts of the diagonal matrix */
+  zero_singular_coeffs(data->singular, data->inv_singular, nfactors, nobs);
+  calc_xtx_inv(data->xtx_inv_ftn, data->v_ftn, data->inv_singular, nfactors);
+
+  /* We can now have faith in v_ftn, u_ftn (in factors_or_u_ftn), 
+   * and inv_singular 
+   */
+  data->lastFitValid= 1;
+  for (i=0; i<nobs*nfactors; i++) data->factors_key[i]= factors[i];
+  data->keyNobs= nobs;
+  data->keyNfactors= nfactors;
+  data->keyValid= 1;
+  return 0;
+}
+
+/* Returns 1 and fills param_out if any factor is not finite */
+static int llsq_check_factors( Regressor* r, const double* factors, 
+			       double* param_out, int nparam, int param_stride,
+			       int nobs, int nfactors, int nseries )
+{
+  LLSqData* data= (LLSqData*)(r->hook);
+  int i;
+  int j;
+  int s;
+
+  /* Perform a check for non-finite values in the factors.  For
+   * example, this can happen if the user fails to detect an underflow.
+   * We'll just initialize everything to the same non-finite value 
+   * if we find any.
+   */
+  for (i=0; i<nobs*nfactors; i++) {
+    if (!finite(factors[i])) {
+      for (s=0; s<nseries; s++) 
+	for (j=0; j<nparam; j++) param_out[s*param_stride+j]= factors[i];
+      data->lastFitValid= 0;
+      _glm_err_txt= "An input factor value was not finite";
+      return 1;
+    }
+  }
+  return 0;
+}
+
 static int llsq_context_valid( Regressor* r, int nobs, int nfactors )
 {
   LLSqData* data= (LLSqData*)(r->hook);
@@ -829,8 +1015,7 @@ int llsq_fit(Regressor* r, double* obs, const double* factors,
 {
   int nparam;
   int i;
-  int a,b;
-  int lapack_retcode;
+  int b;
   double sing_max;
   double *bvals;
   double *variances;
@@ -874,22 +1059,9 @@ int llsq_fit(Regressor* r, double* obs, const double* factors,
 
   llsq_check_memory(r, nobs, nfactors);
 
-  /* Perform a check for non-finite values in the factors.  For
-   * example, this can happen if the user fails to detect an underflow.
-   * We'll just initialize everything to the same non-finite value 
-   * if we find any.
-   */
-  for (i=0; i<nobs*nfactors; i++) {
-    if (!finite(factors[i])) {
-      int j;
-      for (j=0; j<nparam; j++) param_out[j]= factors[i];
-      data->lastFitValid= 0;
-      _glm_err_txt= "An input factor value was not finite";
-      return 1;
-    }
-  }
-  
-  flip_to_ftn(factors, data->factors_or_u_ftn, nobs, nfactors);
+  if (llsq_check_factors(r, factors, param_out, nparam, nparam,
+			 nobs, nfactors, 1))
+    return 1;
 
   if (CHECK_DEBUG(r)) {
     /* Some handy diagnostics */
@@ -911,34 +1083,7 @@ int llsq_fit(Regressor* r, double* obs, const double* factors,
     }
   }
 
-  /* Do SVD.  This destroys the factors_or_u_ftn matrix. */
-  (void)DGESVD("O", "A", &nobs, &nfactors, data->factors_or_u_ftn,
-	       &nobs, data->singular, NULL, &nobs, data->v_ftn, &nfactors,
-	       data->rwork, &(data->lwork), &lapack_retcode);
-  if (lapack_retcode<0) {
-    sprintf(err_buf,
-	    "DGESVD argument %d had an illegal value",
-	    -lapack_retcode);
-    _glm_err_txt= err_buf;
-    data->lastFitValid= 0;
-    return 1;
-  }
-  else if (lapack_retcode>0) {
-    sprintf(err_buf,
-	    "DBDSQR did not converge in SGESVD; %d superdiagonals failed",
-	    lapack_retcode);
-    _glm_err_txt= err_buf;
-    data->lastFitValid= 0;
-    return 1;
-  }
-
-  /* Zero out appropriate parts of the diagonal matrix */
-  zero_singular_coeffs(data->singular, data->inv_singular, nfactors, nobs);
-
-  /* We can now have faith in v_ftn, u_ftn (in factors_or_u_ftn), 
-   * and inv_singular 
-   */
-  data->lastFitValid= 1;
+  if (llsq_decompose(r, factors, nobs, nfactors)) return 1;
 
   /* Calculate best fit parameters */
   llsq_calc_b(bvals, data->v_ftn, data->inv_singular, data->factors_or_u_ftn, 
@@ -954,40 +1099,10 @@ int llsq_fit(Regressor* r, double* obs, const double* factors,
 
   /* Calculate covariances */
   if (r->get(r,GLM_VARIANCES) || r->get(r,GLM_COVARIANCES)) {
-    calc_covariances(data->covariance_ftn, data->residuals, data->v_ftn, 
-		     data->inv_singular, nfactors, nobs, r->get(r,GLM_COMPLEX));
-    if (r->get(r,GLM_VARIANCES)) {
-      if (r->get(r,GLM_COMPLEX)) {
-	for (a=0; a<nfactors; a++) {
-	  variances[2*a]= data->covariance_ftn[2*(2*((a*nfactors)+a))];
-	  variances[(2*a)+1]= data->covariance_ftn[(2*((a*nfactors)+a)+1)+1];
-	}
-      }
-      else {
-	for (a=0; a<nfactors; a++) 
-	  variances[a]= data->covariance_ftn[(a*nfactors)+a];
-      }
-    }
-    if (r->get(r,GLM_COVARIANCES)) {
-      if (r->get(r,GLM_COMPLEX)) {
-	for (a=0; a<nfactors; a++) 
-	  for (b=0; b<nfactors; b++) {
-	    covariances[(2*a)*nfactors+(2*b)]=
-	      data->covariance_ftn[(2*b)*nfactors+(2*a)];
-	    covariances[(2*a+1)*nfactors+(2*b)]=
-	      data->covariance_ftn[(2*b)*nfactors+(2*a+1)];
-	    covariances[(2*a)*nfactors+(2*b+1)]=
-	      data->covariance_ftn[(2*b+1)*nfactors+(2*a)];
-	    covariances[(2*a+1)*nfactors+(2*b+1)]=
-	      data->covariance_ftn[(2*b+1)*nfactors+(2*a+1)];
-	  }
-      }
-      else {
-	for (a=0; a<nfactors; a++) 
-	  for (b=0; b<nfactors; b++)
-	    covariances[a*nfactors+b]= data->covariance_ftn[(b*nfactors)+a];
-      }
-    }
+    calc_covariances(data->covariance_ftn, data->residuals, data->xtx_inv_ftn,
+		     nfactors, nobs, r->get(r,GLM_COMPLEX));
+    store_covariances(r, data->covariance_ftn, variances, covariances, 
+		      nfactors);
   }
 
   /* Calculate sums of squares */
@@ -1090,6 +1205,173 @@ int llsq_fit(Regressor* r, double* obs, const double* factors,
   return 0;
 }
 
+static void llsq_check_batch_memory(Regressor* r, int ncols)
+{
+  LLSqData* data= (LLSqData*)(r->hook);
+  int nobs= data->nobsAllocated;
+  int nfactors= data->nfactorsAllocated;
+
+  if (ncols>data->batchColsAllocated) {
+    if (data->batch_obs_ftn) free(data->batch_obs_ftn);
+    if (!(data->batch_obs_ftn= (double*)malloc(nobs*ncols*sizeof(double))))
+      MALLOC_FAILURE(nobs*ncols,double);
+    if (data->batch_tmp_ftn) free(data->batch_tmp_ftn);
+    if (!(data->batch_tmp_ftn= 
+	  (double*)malloc(nfactors*ncols*sizeof(double))))
+      MALLOC_FAILURE(nfactors*ncols,double);
+    if (data->batch_b_ftn) free(data->batch_b_ftn);
+    if (!(data->batch_b_ftn= (double*)malloc(nfactors*ncols*sizeof(double))))
+      MALLOC_FAILURE(nfactors*ncols,double);
+    data->batchColsAllocated= ncols;
+  }
+}
+
+static int llsq_fit_many(Regressor* r, double* obs, int obs_stride,
+			 const double* factors, const double* counts, 
+			 double* param_out, int param_stride,
+			 int nobs, int nfactors, int nseries)
+{
+  LLSqData* data= (LLSqData*)(r->hook);
+  int complex_flag= r->get(r,GLM_COMPLEX);
+  int complex_fac= (complex_flag ? 2 : 1);
+  int ncols= complex_fac*nseries;
+  int need_residuals= (r->get(r,GLM_RESIDUALS) || r->get(r,GLM_VARIANCES) 
+		       || r->get(r,GLM_COVARIANCES));
+  int nparam;
+  int var_offset;
+  int covar_offset;
+  int ssqr_offset;
+  int ortho_offset;
+  double ortho_measure= 0.0;
+  double one= 1.0;
+  double zero= 0.0;
+  double minus_one= -1.0;
+  double* y_ftn;
+  double* res;
+  int i;
+  int a;
+  int s;
+
+  /* Debugging output is per series, so let llsq_fit produce it */
+  if (nseries<2 || CHECK_DEBUG(r))
+    return base_fit_many(r, obs, obs_stride, factors, counts, param_out,
+			 param_stride, nobs, nfactors, nseries);
+
+  if (nobs<nfactors) {
+    _glm_err_txt= "Number of factors is greater than number of observations!";
+    return 1;
+  }
+
+  /* Breakdown of each parameter vector, as in llsq_fit */
+  nparam= complex_fac*nfactors;
+  var_offset= covar_offset= ssqr_offset= ortho_offset= 0;
+  if (r->get(r,GLM_VARIANCES)) {
+    var_offset= nparam;
+    nparam += complex_fac*nfactors;
+  }
+  if (r->get(r,GLM_COVARIANCES)) {
+    covar_offset= nparam;
+    nparam += complex_fac*complex_fac*nfactors*nfactors;
+  }
+  if (r->get(r,GLM_SSQR)) {
+    ssqr_offset= nparam;
+    nparam += nfactors+2;
+  }
+  if (r->get(r,GLM_ORTHO)) ortho_offset= nparam++;
+
+  llsq_check_memory(r, nobs, nfactors);
+
+  if (llsq_check_factors(r, factors, param_out, nparam, param_stride,
+			 nobs, nfactors, nseries))
+    return 1;
+  if (llsq_decompose(r, factors, nobs, nfactors)) return 1;
+
+  /* Gather the observations into the columns of an nobs by ncols 
+   * matrix; complex series contribute a real and an imaginary column.
+   */
+  llsq_check_batch_memory(r, ncols);
+  y_ftn= data->batch_obs_ftn;
+  for (s=0; s<nseries; s++) {
+    const double* o= obs + s*obs_stride;
+    if (complex_flag) {
+      for (i=0; i<nobs; i++) {
+	y_ftn[(2*s*nobs)+i]= o[2*i];
+	y_ftn[((2*s+1)*nobs)+i]= o[(2*i)+1];
+      }
+    }
+    else {
+      for (i=0; i<nobs; i++) y_ftn[(s*nobs)+i]= o[i];
+    }
+  }
+
+  /* b = V (1/S) U' y for all the columns at once */
+  DGEMM("t", "n", &nfactors, &ncols, &nobs, &one, data->factors_or_u_ftn,
+	&nobs, y_ftn, &nobs, &zero, data->batch_tmp_ftn, &nfactors);
+  for (s=0; s<ncols; s++)
+    for (a=0; a<nfactors; a++) 
+      data->batch_tmp_ftn[(s*nfactors)+a] *= data->inv_singular[a];
+  DGEMM("t", "n", &nfactors, &ncols, &nfactors, &one, data->v_ftn,
+	&nfactors, data->batch_tmp_ftn, &nfactors, &zero, 
+	data->batch_b_ftn, &nfactors);
+
+  /* Sums of squares need the original observations, so the residuals
+   * y - X b are formed in the batch buffer.  Since factors is X in C 
+   * order, it is X' to Fortran.
+   */
+  if (need_residuals)
+    DGEMM("t", "n", &nobs, &ncols, &nfactors, &minus_one, (double*)factors,
+	  &nfactors, data->batch_b_ftn, &nfactors, &one, y_ftn, &nobs);
+
+  if (r->get(r,GLM_ORTHO)) 
+    ortho_measure= calc_ortho_measure(data->v_ftn, data->singular, nfactors);
+
+  for (s=0; s<nseries; s++) {
+    double* o= obs + s*obs_stride;
+    double* p= param_out + s*param_stride;
+
+    if (complex_flag) {
+      for (a=0; a<nfactors; a++) {
+	p[2*a]= data->batch_b_ftn[(2*s*nfactors)+a];
+	p[(2*a)+1]= data->batch_b_ftn[((2*s+1)*nfactors)+a];
+      }
+    }
+    else {
+      for (a=0; a<nfactors; a++) p[a]= data->batch_b_ftn[(s*nfactors)+a];
+    }
+
+    res= NULL;
+    if (need_residuals) {
+      if (complex_flag) {
+	for (i=0; i<nobs; i++) {
+	  data->residuals[2*i]= y_ftn[(2*s*nobs)+i];
+	  data->residuals[(2*i)+1]= y_ftn[((2*s+1)*nobs)+i];
+	}
+	res= data->residuals;
+      }
+      else res= y_ftn + s*nobs;
+    }
+
+    if (r->get(r,GLM_VARIANCES) || r->get(r,GLM_COVARIANCES)) {
+      calc_covariances(data->covariance_ftn, res, data->xtx_inv_ftn,
+		       nfactors, nobs, complex_flag);
+      store_covariances(r, data->covariance_ftn, p+var_offset, 
+			p+covar_offset, nfactors);
+    }
+
+    if (r->get(r,GLM_SSQR)) 
+      calc_sum_squares(p+ssqr_offset, p+ssqr_offset+1, p+ssqr_offset+2, o, 
+		       p, data->singular, data->v_ftn, nobs, nfactors, 
+		       complex_flag);
+
+    if (r->get(r,GLM_ORTHO)) p[ortho_offset]= ortho_measure;
+
+    if (r->get(r,GLM_RESIDUALS)) 
+      for (i=0; i<complex_fac*nobs; i++) o[i]= res[i];
+  }
+
+  return 0;
+}
+
 static void llsq_destroy_self(Regressor* r)
 {
   if (r->hook) {
@@ -1100,7 +1382,12 @@ static void llsq_destroy_self(Regressor* r)
     if (data->inv_singular) free(data->inv_singular);
     if (data->residuals) free(data->residuals);
     if (data->covariance_ftn) free(data->covariance_ftn);
+    if (data->xtx_inv_ftn) free(data->xtx_inv_ftn);
     if (data->rwork) free(data->rwork);
+    if (data->factors_key) free(data->factors_key);
+    if (data->batch_obs_ftn) free(data->batch_obs_ftn);
+    if (data->batch_tmp_ftn) free(data->batch_tmp_ftn);
+    if (data->batch_b_ftn) free(data->batch_b_ftn);
   }
   glm_base_destroy_self(r);
 }
@@ -1144,7 +1431,6 @@ static int llsq_getXtXInv(Regressor* r, double* buf_out,
   int i;
   int a;
   int b;
-  int c;
 
   if (!(r->context_valid)(r,nobs,nfactors)) {
     snprintf(err_buf,sizeof(err_buf),
@@ -1154,14 +1440,8 @@ static int llsq_getXtXInv(Regressor* r, double* buf_out,
   }
   
   if (nobs>nfactors) {
-    for (a=0; a<nfactors; a++)
-      for (b=0; b<nfactors; b++) {
-	double sum= 0.0;
-	for (c=0; c<nfactors; c++) 
-	  sum += data->v_ftn[(a*nfactors)+c] * data->v_ftn[(b*nfactors)+c] 
-	    * data->inv_singular[c] * data->inv_singular[c];
-	buf_out[(a*nfactors)+b]= sum;
-      }
+    /* The matrix is symmetric, so Fortran order doesn't matter */
+    for (a=0; a<nfactors*nfactors; a++) buf_out[a]= data->xtx_inv_ftn[a];
   }
   else {
     /* set them all to zero */
@@ -1184,6 +1464,7 @@ Regressor* glm_create_llsq_regressor()
   result->destroy_self= llsq_destroy_self;
   result->context_valid= llsq_context_valid;
   result->fit= llsq_fit;
+  result->fit_many= llsq_fit_many;
   result->project= llsq_project;
   result->normproject= llsq_normproject;
   result->getXtXInv= llsq_getXtXInv;
@@ -1196,12 +1477,21 @@ Regressor* glm_create_llsq_regressor()
   data->inv_singular= NULL;
   data->residuals= NULL;
   data->covariance_ftn= NULL;
+  data->xtx_inv_ftn= NULL;
   data->rwork= NULL;
   data->lwork= 0;
   data->nfactorsAllocated= 0;
   data->nobsAllocated= 0;
   data->complexFlagAllocated= 0;
   data->lastFitValid= 0;
+  data->factors_key= NULL;
+  data->keyValid= 0;
+  data->keyNobs= 0;
+  data->keyNfactors= 0;
+  data->batch_obs_ftn= NULL;
+  data->batch_tmp_ftn= NULL;
+  data->batch_b_ftn= NULL;
+  data->batchColsAllocated= 0;
 
   return result;
 }
@@ -64,6 +64,11 @@ typedef struct regressor_struct {
   int (*fit)(struct regressor_struct* self, 
 	     double* obs, const double* factors, const double* counts, 
 	     double* param_out, int nobs, int nfactors);
+  /* Fits nseries observation vectors sharing one factor matrix */
+  int (*fit_many)(struct regressor_struct* self, 
+		  double* obs, int obs_stride, const double* factors,
+		  const double* counts, double* param_out, int param_stride,
+		  int nobs, int nfactors, int nseries);
   int (*project)(struct regressor_struct* self, 
 		 const double* obs_vec_in, 
 		 double* factor_vec_out,
@@ -100,6 +105,11 @@ int glm_fit(Regressor* r, double* obs, const double* factors,
 	    const double* counts, double* param_out, 
 	    int nobs, int nfactors);
 
+int glm_fit_many(Regressor* r, double* obs, int obs_stride,
+		 const double* factors, const double* counts, 
+		 double* param_out, int param_stride,
+		 int nobs, int nfactors, int nseries);
+
 int glm_project( Regressor* r, const double* obs_vec_in, 
 		 double* factor_vec_out, int nobs, int nfactors );
 
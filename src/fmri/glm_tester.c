@@ -30,6 +30,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include "glm.h"
 
 #ifdef never
@@ -315,6 +317,173 @@ static void dump_data(Regressor* r, int afterFlag,
   else fprintf(stderr,"Debug flag is NOT set\n");
 }
 
+/* The fit_many checks compare glm_fit_many() against glm_fit() run one
+ * series at a time.  Each reference fit uses a fresh regressor, so it
+ * cannot be helped by a cached decomposition.  MANY_NSERIES is more
+ * than the 256 series mri_glm hands over per call.
+ */
+#define MANY_NOBS 40
+#define MANY_NFACTORS 5
+#define MANY_NSERIES 300
+#define MANY_TOL 1.0e-9
+
+static const glm_feature many_flags[]= { GLM_RESIDUALS, GLM_VARIANCES, 
+					 GLM_COVARIANCES, GLM_SSQR, 
+					 GLM_ORTHO };
+#define N_MANY_FLAGS (sizeof(many_flags)/sizeof(glm_feature))
+
+static Regressor* make_llsq( int complex_flag, int flag_mask )
+{
+  Regressor* r= glm_create_llsq_regressor();
+  int i;
+
+  glm_set(r,GLM_COMPLEX,complex_flag);
+  for (i=0; i<N_MANY_FLAGS; i++) 
+    glm_set(r,many_flags[i],((flag_mask>>i) & 1));
+  return r;
+}
+
+static void fill_factors( double* factors, int nobs, int nfactors )
+{
+  int i;
+  int j;
+
+  for (i=0; i<nobs; i++) {
+    factors[i*nfactors]= 1.0;
+    for (j=1; j<nfactors; j++) 
+      factors[i*nfactors+j]= sin(0.37*(i+1)*j) + 0.1*j;
+  }
+}
+
+static double rel_diff( double a, double b )
+{
+  double scale= fabs(a)+fabs(b);
+  if (a==b) return 0.0;
+  if (scale<1.0) scale= 1.0;
+  return fabs(a-b)/scale;
+}
+
+/* Fits the same series both ways with regressor r and returns the
+ * number of mismatched values.
+ */
+static int check_fit_many( Regressor* r, int complex_flag, int flag_mask,
+			   const double* obs, const double* factors,
+			   int nobs, int nfactors, int nseries )
+{
+  int complex_fac= (complex_flag ? 2 : 1);
+  int obs_stride= complex_fac*nobs;
+  int nparams= glm_n_params(r,nfactors);
+  double* obs_many;
+  double* obs_one;
+  double* par_many;
+  double* par_one;
+  int bad= 0;
+  int i;
+  int s;
+
+  obs_many= (double*)malloc(nseries*obs_stride*sizeof(double));
+  obs_one= (double*)malloc(nseries*obs_stride*sizeof(double));
+  par_many= (double*)malloc(nseries*nparams*sizeof(double));
+  par_one= (double*)malloc(nseries*nparams*sizeof(double));
+  if (!obs_many || !obs_one || !par_many || !par_one) {
+    fprintf(stderr,"Unable to allocate test buffers!\n");
+    exit(-1);
+  }
+  memcpy(obs_many, obs, nseries*obs_stride*sizeof(double));
+  memcpy(obs_one, obs, nseries*obs_stride*sizeof(double));
+  /* The complex covariance block is not completely filled in by
+   * either path, so start both parameter buffers out the same.
+   */
+  memset(par_many, 0, nseries*nparams*sizeof(double));
+  memset(par_one, 0, nseries*nparams*sizeof(double));
+
+  if (glm_fit_many(r, obs_many, obs_stride, factors, NULL, par_many, nparams,
+		   nobs, nfactors, nseries)) {
+    fprintf(stderr,"glm_fit_many error: <%s>\n",glm_error_msg());
+    glm_clear_error_msg();
+    bad++;
+  }
+  for (s=0; s<nseries; s++) {
+    Regressor* ref= make_llsq(complex_flag, flag_mask);
+    if (glm_fit(ref, obs_one+s*obs_stride, factors, NULL, 
+		par_one+s*nparams, nobs, nfactors)) {
+      fprintf(stderr,"glm_fit error: <%s>\n",glm_error_msg());
+      glm_clear_error_msg();
+      bad++;
+    }
+    glm_destroy(ref);
+  }
+
+  for (i=0; i<nseries*nparams; i++) 
+    if (rel_diff(par_many[i],par_one[i])>MANY_TOL) bad++;
+  if (glm_get(r,GLM_RESIDUALS)) {
+    for (i=0; i<nseries*obs_stride; i++)
+      if (rel_diff(obs_many[i],obs_one[i])>MANY_TOL) bad++;
+  }
+
+  free(obs_many);
+  free(obs_one);
+  free(par_many);
+  free(par_one);
+  return bad;
+}
+
+/* Runs the fit_many checks for real and complex data and every 
+ * combination of output flags, returning the number of failures.
+ */
+static int test_fit_many(void)
+{
+  double* factors;
+  double* obs;
+  int nobs= MANY_NOBS;
+  int nfactors= MANY_NFACTORS;
+  int nseries= MANY_NSERIES;
+  int complex_flag;
+  int flag_mask;
+  int failures= 0;
+  int i;
+
+  factors= (double*)malloc(nobs*nfactors*sizeof(double));
+  obs= (double*)malloc(2*nobs*nseries*sizeof(double));
+  if (!factors || !obs) {
+    fprintf(stderr,"Unable to allocate test buffers!\n");
+    exit(-1);
+  }
+  srand(1234);
+  for (i=0; i<2*nobs*nseries; i++) 
+    obs[i]= (double)rand()/RAND_MAX + 0.01*(i%nobs);
+
+  for (complex_flag=0; complex_flag<2; complex_flag++) {
+    for (flag_mask=0; flag_mask<(1<<N_MANY_FLAGS); flag_mask++) {
+      Regressor* r= make_llsq(complex_flag, flag_mask);
+      int bad;
+
+      /* Fit with one factor matrix, then a slightly different one, then
+       * the first again;  a stale cached decomposition would show up in
+       * the second or third comparison.
+       */
+      fill_factors(factors, nobs, nfactors);
+      bad= check_fit_many(r, complex_flag, flag_mask, obs, factors, 
+			  nobs, nfactors, nseries);
+      factors[7*nfactors+2] += 0.5;
+      bad += check_fit_many(r, complex_flag, flag_mask, obs, factors, 
+			    nobs, nfactors, nseries);
+      fill_factors(factors, nobs, nfactors);
+      bad += check_fit_many(r, complex_flag, flag_mask, obs, factors, 
+			    nobs, nfactors, nseries);
+      glm_destroy(r);
+      if (bad) {
+	fprintf(stderr,"fit_many: %s flags 0x%x: %d mismatches\n",
+		(complex_flag ? "complex" : "real"), flag_mask, bad);
+	failures++;
+      }
+    }
+  }
+  free(factors);
+  free(obs);
+  return failures;
+}
+
 int main()
 {
   int nparams;
@@ -475,5 +644,12 @@ int main()
     fprintf(stderr,"  SSR: %f\n",tmp-ssqr_terms[1]);
   }
   glm_destroy(r);
+
+  fprintf(stderr,"*****Checking glm_fit_many:*****\n");
+  if (test_fit_many()) {
+    fprintf(stderr,"glm_fit_many check FAILED\n");
+    return 1;
+  }
+  fprintf(stderr,"glm_fit_many check passed\n");
   return 0;
 }
@@ -34,10 +34,21 @@
 #include <string.h>
 #include <strings.h>
 #include <assert.h>
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif
 #include "mri.h"
 #include "fmri.h"
 #include "interpolator.h"
 
+#if defined(__GNUC__) && (__GNUC__ >= 5) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define INTRP_X86_SIMD
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX __attribute__((target("avx")))
+#endif
+
 static char rcsid[] = "$Id: interpolator.c,v 1.17 2008/02/12 01:04:58 welling Exp $";
 
 /********************
@@ -49,6 +60,18 @@ static char rcsid[] = "$Id: interpolator.c,v 1.17 2008/02/12 01:04:58 welling Ex
  *  through class methods.
  * -Spline interpolator will fail on creation if dim<4.  Work around that
  *  by substituting appropriate linear interpolators?
+ * -intrp_warpApply() bypasses the interpolator methods for affine
+ *  transforms of scalar fields.  The source point then moves by a
+ *  fixed step along each output scanline, so the run of output voxels
+ *  which land inside the input can be solved for directly and the
+ *  bounds test drops out of the inner loop.  The kernels read the
+ *  input themselves and keep no state in the Interpolator, so slabs
+ *  of z can be done by separate threads.
+ * -The engine's kernels clamp tap indices into the grid, which is
+ *  what the 1D interpolators do at the edges.  Catmull-Rom and
+ *  B-spline read their four x taps as one vector away from the x
+ *  edges; linear does four (AVX) or two (SSE2) voxels at a time.
+ *  Closest is a pure gather and stays scalar.
  ********************/
 
 /* These names must correspond to opts, in order. */
@@ -96,6 +119,690 @@ void intrp_warpGetCounts( long* count )
   *count= warpCount;
 }
 
+/*
+ * Affine warp engine
+ */
+
+/* Warps smaller than this many voxels are not worth threading */
+#define MIN_THREADED_VOXELS (32*1024)
+
+static int warpThreads= 0;
+
+typedef struct WarpJob_struct {
+  InterpolatorType type;
+  double tension;
+  const double* in;
+  double* out;
+  char* check;
+  long nx;
+  long ny;
+  long nz;
+  double t[12]; /* the transform itself, in centered grid coords */
+  double half[3];
+  double origin[3]; /* source grid coords for output voxel (0,0,0) */
+  double stepX[3]; /* change in source grid coords per output step */
+  double stepY[3];
+  double stepZ[3];
+  long kFirst;
+  long kEnd;
+} WarpJob;
+
+/* Fills out[i0..i1] for scanline (j,k), whose first voxel maps to p0 */
+typedef void (*WarpRowFunc)( const WarpJob* job, long j, long k,
+			     const double* p0, long i0, long i1, 
+			     double* out );
+
+void intrp_warpSetThreads( int nthreads )
+{
+  warpThreads= nthreads;
+}
+
+static int warpInBounds( const WarpJob* job, const double* p0, long i )
+{
+  double x= p0[0] + i*job->stepX[0];
+  double y= p0[1] + i*job->stepX[1];
+  double z= p0[2] + i*job->stepX[2];
+  return !((x<(-EPSILON)) || (x>(double)(job->nx-1)+EPSILON)
+	   || (y<(-EPSILON)) || (y>(double)(job->ny-1)+EPSILON)
+	   || (z<(-EPSILON)) || (z>(double)(job->nz-1)+EPSILON));
+}
+
+static void warpSpan( const WarpJob* job, const double* p0,
+		      long* first, long* last )
+{
+  /* Each coordinate is linear in i, so the voxels which land inside
+   * the input form a single run.  Solve for its ends, then nudge them
+   * until they agree exactly with the per-voxel test.
+   */
+  long n[3];
+  double lo= 0.0;
+  double hi= (double)(job->nx-1);
+  long a;
+  long b;
+  int i;
+
+  n[0]= job->nx;
+  n[1]= job->ny;
+  n[2]= job->nz;
+  for (i=0; i<3; i++) {
+    double below= -EPSILON - p0[i];
+    double above= (double)(n[i]-1) + EPSILON - p0[i];
+    double s= job->stepX[i];
+    if (s>0.0) {
+      if (below/s>lo) lo= below/s;
+      if (above/s<hi) hi= above/s;
+    }
+    else if (s<0.0) {
+      if (above/s>lo) lo= above/s;
+      if (below/s<hi) hi= below/s;
+    }
+    else if (below>0.0 || above<0.0) {
+      *first= 0;
+      *last= -1;
+      return;
+    }
+  }
+  a= (lo>(double)job->nx) ? job->nx : (long)ceil(lo);
+  b= (hi<0.0) ? -1 : (long)floor(hi);
+  if (a>b) {
+    /* Rounding may have hidden a run of one voxel */
+    if (b>=0 && warpInBounds(job, p0, b)) a= b;
+    else if (a<job->nx && warpInBounds(job, p0, a)) b= a;
+  }
+  while (a<=b && !warpInBounds(job, p0, a)) a++;
+  while (b>=a && !warpInBounds(job, p0, b)) b--;
+  if (a<=b) {
+    while (a>0 && warpInBounds(job, p0, a-1)) a--;
+    while (b<job->nx-1 && warpInBounds(job, p0, b+1)) b++;
+  }
+  *first= a;
+  *last= b;
+}
+
+static void warpRowClosest( const WarpJob* job, long j, long k,
+			    const double* p0, long i0, long i1, double* out )
+{
+  /* Rounding decides ties here, so the source point is found with
+   * the same arithmetic as trans_vec_mult() rather than by stepping.
+   */
+  const double* t= job->t;
+  double y= j - job->half[1];
+  double z= k - job->half[2];
+  long nx= job->nx;
+  long ny= job->ny;
+  long nz= job->nz;
+  long i;
+
+  for (i=i0; i<=i1; i++) {
+    double x= i - job->half[0];
+    long ix= (long)rint(t[0]*x + t[1]*y + t[2]*z + t[3] + job->half[0]);
+    long iy= (long)rint(t[4]*x + t[5]*y + t[6]*z + t[7] + job->half[1]);
+    long iz= (long)rint(t[8]*x + t[9]*y + t[10]*z + t[11] + job->half[2]);
+    if (ix<0) ix= 0;
+    if (ix>nx-1) ix= nx-1;
+    if (iy<0) iy= 0;
+    if (iy>ny-1) iy= ny-1;
+    if (iz<0) iz= 0;
+    if (iz>nz-1) iz= nz-1;
+    out[i]= job->in[(iz*ny+iy)*nx+ix];
+  }
+}
+
+/* Lower tap and fraction for linear interpolation along one axis.
+ * The tap is kept below n-1 so that its neighbor always exists.
+ */
+static void linearTap( double x, long n, long* tap, double* frac )
+{
+  long f;
+  if (x<0.0) x= 0.0;
+  if (x>(double)(n-1)) x= (double)(n-1);
+  f= (long)x;
+  if (f>n-2) f= (n>1) ? n-2 : 0;
+  *tap= f;
+  *frac= x-f;
+}
+
+static void warpRowLinear( const WarpJob* job, long j, long k,
+			   const double* p0, long i0, long i1, double* out )
+{
+  long nx= job->nx;
+  long ny= job->ny;
+  long nz= job->nz;
+  long sx= (nx>1) ? 1 : 0;
+  long sy= (ny>1) ? nx : 0;
+  long sz= (nz>1) ? nx*ny : 0;
+  long i;
+
+  for (i=i0; i<=i1; i++) {
+    long ix, iy, iz;
+    double dx, dy, dz;
+    const double* v;
+    double v00, v01, v10, v11, v0, v1;
+    linearTap(p0[0] + i*job->stepX[0], nx, &ix, &dx);
+    linearTap(p0[1] + i*job->stepX[1], ny, &iy, &dy);
+    linearTap(p0[2] + i*job->stepX[2], nz, &iz, &dz);
+    v= job->in + (iz*ny+iy)*nx+ix;
+    /* z, then y, then x, as the separable interpolators do it */
+    v00= (1.0-dz)*v[0] + dz*v[sz];
+    v01= (1.0-dz)*v[sy] + dz*v[sy+sz];
+    v10= (1.0-dz)*v[sx] + dz*v[sx+sz];
+    v11= (1.0-dz)*v[sx+sy] + dz*v[sx+sy+sz];
+    v0= (1.0-dy)*v00 + dy*v01;
+    v1= (1.0-dy)*v10 + dy*v11;
+    out[i]= (1.0-dx)*v0 + dx*v1;
+  }
+}
+
+/* Segment and offset within it for cubic interpolation along one
+ * axis, placed as spl_calc() places them.
+ */
+static void cubicTap( double x, long n, long* seg, double* u )
+{
+  long s;
+  if (n<2) {
+    *seg= 0;
+    *u= 0.0;
+    return;
+  }
+  if (x<0.0) x= 0.0;
+  if (x>(double)(n-1)) x= (double)(n-1);
+  s= (long)x;
+  if (s>n-2) s= n-2;
+  *seg= s;
+  *u= x-s;
+}
+
+static void cubicWeights( InterpolatorType type, double aux, double u,
+			  double* w )
+{
+  if (type==INTRP_BSPLINE) {
+    double sixth= 1.0/6.0;
+    w[0]= ((1.0-u)*(1.0-u)*(1.0-u))*sixth;
+    w[1]= (3.0*u*u*u - 6.0*u*u + 4.0)*sixth;
+    w[2]= (-3.0*u*u*u + 3.0*u*u + 3.0*u +1)*sixth;
+    w[3]= (u*u*u)*sixth;
+  }
+  else {
+    w[0]= ((-aux*u+2.0*aux)*u - aux)*u+0.0;
+    w[1]= (((2-aux)*u+(aux-3))*u*u)+1.0;
+    w[2]= (((aux-2)*u+(3.0-2.0*aux))*u + aux)*u;
+    w[3]= aux*(u-1)*u*u;
+  }
+}
+
+/* Offsets of the four taps around seg, replicating the edge samples */
+static void cubicOffsets( long seg, long n, long stride, long* off )
+{
+  int m;
+  for (m=0; m<4; m++) {
+    long t= seg-1+m;
+    if (t<0) t= 0;
+    if (t>n-1) t= n-1;
+    off[m]= t*stride;
+  }
+}
+
+static double cubicVoxel( const WarpJob* job, const double* p0, long i )
+{
+  long nx= job->nx;
+  long ny= job->ny;
+  long nz= job->nz;
+  long seg;
+  double u;
+  double wx[4], wy[4], wz[4];
+  long ox[4], oy[4], oz[4];
+  double result= 0.0;
+  int a, b;
+
+  cubicTap(p0[0] + i*job->stepX[0], nx, &seg, &u);
+  cubicWeights(job->type, job->tension, u, wx);
+  cubicOffsets(seg, nx, 1, ox);
+  cubicTap(p0[1] + i*job->stepX[1], ny, &seg, &u);
+  cubicWeights(job->type, job->tension, u, wy);
+  cubicOffsets(seg, ny, nx, oy);
+  cubicTap(p0[2] + i*job->stepX[2], nz, &seg, &u);
+  cubicWeights(job->type, job->tension, u, wz);
+  cubicOffsets(seg, nz, nx*ny, oz);
+  for (a=0; a<4; a++) {
+    double vy= 0.0;
+    for (b=0; b<4; b++) {
+      const double* v= job->in + ox[a] + oy[b];
+      vy += wy[b]*(wz[0]*v[oz[0]] + wz[1]*v[oz[1]] 
+		   + wz[2]*v[oz[2]] + wz[3]*v[oz[3]]);
+    }
+    result += wx[a]*vy;
+  }
+  return result;
+}
+
+static void warpRowCubic( const WarpJob* job, long j, long k,
+			  const double* p0, long i0, long i1, double* out )
+{
+  long i;
+  for (i=i0; i<=i1; i++) out[i]= cubicVoxel(job, p0, i);
+}
+
+#ifdef INTRP_X86_SIMD
+
+TARGET_SSE2 static void warpRowLinearSSE2( const WarpJob* job, 
+					   long j, long k, const double* p0,
+					   long i0, long i1, double* out )
+{
+  long nx= job->nx;
+  long ny= job->ny;
+  long nz= job->nz;
+  long sx= (nx>1) ? 1 : 0;
+  long sy= (ny>1) ? nx : 0;
+  long sz= (nz>1) ? nx*ny : 0;
+  __m128d one= _mm_set1_pd(1.0);
+  __m128d zero= _mm_setzero_pd();
+  __m128d px= _mm_set1_pd(p0[0]);
+  __m128d py= _mm_set1_pd(p0[1]);
+  __m128d pz= _mm_set1_pd(p0[2]);
+  __m128d stx= _mm_set1_pd(job->stepX[0]);
+  __m128d sty= _mm_set1_pd(job->stepX[1]);
+  __m128d stz= _mm_set1_pd(job->stepX[2]);
+  __m128d topx= _mm_set1_pd((double)(nx-1));
+  __m128d topy= _mm_set1_pd((double)(ny-1));
+  __m128d topz= _mm_set1_pd((double)(nz-1));
+  __m128d maxx= _mm_set1_pd((double)((nx>1) ? nx-2 : 0));
+  __m128d maxy= _mm_set1_pd((double)((ny>1) ? ny-2 : 0));
+  __m128d maxz= _mm_set1_pd((double)((nz>1) ? nz-2 : 0));
+  __m128d rowLen= _mm_set1_pd((double)nx);
+  __m128d sliceLen= _mm_set1_pd((double)(nx*ny));
+  long i;
+
+  for (i=i0; i+1<=i1; i+=2) {
+    __m128d iv= _mm_set_pd((double)(i+1), (double)i);
+    __m128d x= _mm_add_pd(px, _mm_mul_pd(iv, stx));
+    __m128d y= _mm_add_pd(py, _mm_mul_pd(iv, sty));
+    __m128d z= _mm_add_pd(pz, _mm_mul_pd(iv, stz));
+    __m128d fx, fy, fz, dx, dy, dz, base, v0, v1, v00, v01, v10, v11;
+    double idx[2];
+    double t[8][2];
+    int l;
+
+    /* The coordinates are clamped non-negative, so truncation floors */
+    x= _mm_min_pd(_mm_max_pd(x, zero), topx);
+    y= _mm_min_pd(_mm_max_pd(y, zero), topy);
+    z= _mm_min_pd(_mm_max_pd(z, zero), topz);
+    fx= _mm_min_pd(_mm_cvtepi32_pd(_mm_cvttpd_epi32(x)), maxx);
+    fy= _mm_min_pd(_mm_cvtepi32_pd(_mm_cvttpd_epi32(y)), maxy);
+    fz= _mm_min_pd(_mm_cvtepi32_pd(_mm_cvttpd_epi32(z)), maxz);
+    dx= _mm_sub_pd(x, fx);
+    dy= _mm_sub_pd(y, fy);
+    dz= _mm_sub_pd(z, fz);
+    base= _mm_add_pd(fx, _mm_add_pd(_mm_mul_pd(fy, rowLen),
+				    _mm_mul_pd(fz, sliceLen)));
+    _mm_storeu_pd(idx, base);
+    for (l=0; l<2; l++) {
+      const double* v= job->in + (long)idx[l];
+      t[0][l]= v[0];
+      t[1][l]= v[sz];
+      t[2][l]= v[sy];
+      t[3][l]= v[sy+sz];
+      t[4][l]= v[sx];
+      t[5][l]= v[sx+sz];
+      t[6][l]= v[sx+sy];
+      t[7][l]= v[sx+sy+sz];
+    }
+#define LERP(a,b,d) \
+    _mm_add_pd(_mm_mul_pd(_mm_sub_pd(one,d),a), _mm_mul_pd(d,b))
+    v00= LERP(_mm_loadu_pd(t[0]), _mm_loadu_pd(t[1]), dz);
+    v01= LERP(_mm_loadu_pd(t[2]), _mm_loadu_pd(t[3]), dz);
+    v10= LERP(_mm_loadu_pd(t[4]), _mm_loadu_pd(t[5]), dz);
+    v11= LERP(_mm_loadu_pd(t[6]), _mm_loadu_pd(t[7]), dz);
+    v0= LERP(v00, v01, dy);
+    v1= LERP(v10, v11, dy);
+    _mm_storeu_pd(out+i, LERP(v0, v1, dx));
+#undef LERP
+  }
+  if (i<=i1) warpRowLinear(job, j, k, p0, i, i1, out);
+}
+
+TARGET_AVX static void warpRowLinearAVX( const WarpJob* job, 
+					 long j, long k, const double* p0,
+					 long i0, long i1, double* out )
+{
+  long nx= job->nx;
+  long ny= job->ny;
+  long nz= job->nz;
+  long sx= (nx>1) ? 1 : 0;
+  long sy= (ny>1) ? nx : 0;
+  long sz= (nz>1) ? nx*ny : 0;
+  __m256d one= _mm256_set1_pd(1.0);
+  __m256d zero= _mm256_setzero_pd();
+  __m256d px= _mm256_set1_pd(p0[0]);
+  __m256d py= _mm256_set1_pd(p0[1]);
+  __m256d pz= _mm256_set1_pd(p0[2]);
+  __m256d stx= _mm256_set1_pd(job->stepX[0]);
+  __m256d sty= _mm256_set1_pd(job->stepX[1]);
+  __m256d stz= _mm256_set1_pd(job->stepX[2]);
+  __m256d topx= _mm256_set1_pd((double)(nx-1));
+  __m256d topy= _mm256_set1_pd((double)(ny-1));
+  __m256d topz= _mm256_set1_pd((double)(nz-1));
+  __m256d maxx= _mm256_set1_pd((double)((nx>1) ? nx-2 : 0));
+  __m256d maxy= _mm256_set1_pd((double)((ny>1) ? ny-2 : 0));
+  __m256d maxz= _mm256_set1_pd((double)((nz>1) ? nz-2 : 0));
+  __m256d rowLen= _mm256_set1_pd((double)nx);
+  __m256d sliceLen= _mm256_set1_pd((double)(nx*ny));
+  long i;
+
+  for (i=i0; i+3<=i1; i+=4) {
+    __m256d iv= _mm256_set_pd((double)(i+3), (double)(i+2),
+			      (double)(i+1), (double)i);
+    __m256d x= _mm256_add_pd(px, _mm256_mul_pd(iv, stx));
+    __m256d y= _mm256_add_pd(py, _mm256_mul_pd(iv, sty));
+    __m256d z= _mm256_add_pd(pz, _mm256_mul_pd(iv, stz));
+    __m256d fx, fy, fz, dx, dy, dz, base, v0, v1, v00, v01, v10, v11;
+    double idx[4];
+    double t[8][4];
+    int l;
+
+    x= _mm256_min_pd(_mm256_max_pd(x, zero), topx);
+    y= _mm256_min_pd(_mm256_max_pd(y, zero), topy);
+    z= _mm256_min_pd(_mm256_max_pd(z, zero), topz);
+    fx= _mm256_min_pd(_mm256_round_pd(x, _MM_FROUND_TO_ZERO), maxx);
+    fy= _mm256_min_pd(_mm256_round_pd(y, _MM_FROUND_TO_ZERO), maxy);
+    fz= _mm256_min_pd(_mm256_round_pd(z, _MM_FROUND_TO_ZERO), maxz);
+    dx= _mm256_sub_pd(x, fx);
+    dy= _mm256_sub_pd(y, fy);
+    dz= _mm256_sub_pd(z, fz);
+    base= _mm256_add_pd(fx, _mm256_add_pd(_mm256_mul_pd(fy, rowLen),
+					  _mm256_mul_pd(fz, sliceLen)));
+    _mm256_storeu_pd(idx, base);
+    for (l=0; l<4; l++) {
+      const double* v= job->in + (long)idx[l];
+      t[0][l]= v[0];
+      t[1][l]= v[sz];
+      t[2][l]= v[sy];
+      t[3][l]= v[sy+sz];
+      t[4][l]= v[sx];
+      t[5][l]= v[sx+sz];
+      t[6][l]= v[sx+sy];
+      t[7][l]= v[sx+sy+sz];
+    }
+#define LERP(a,b,d) \
+    _mm256_add_pd(_mm256_mul_pd(_mm256_sub_pd(one,d),a), _mm256_mul_pd(d,b))
+    v00= LERP(_mm256_loadu_pd(t[0]), _mm256_loadu_pd(t[1]), dz);
+    v01= LERP(_mm256_loadu_pd(t[2]), _mm256_loadu_pd(t[3]), dz);
+    v10= LERP(_mm256_loadu_pd(t[4]), _mm256_loadu_pd(t[5]), dz);
+    v11= LERP(_mm256_loadu_pd(t[6]), _mm256_loadu_pd(t[7]), dz);
+    v0= LERP(v00, v01, dy);
+    v1= LERP(v10, v11, dy);
+    _mm256_storeu_pd(out+i, LERP(v0, v1, dx));
+#undef LERP
+  }
+  _mm256_zeroupper();
+  if (i<=i1) warpRowLinearSSE2(job, j, k, p0, i, i1, out);
+}
+
+TARGET_SSE2 static void warpRowCubicSSE2( const WarpJob* job, 
+					  long j, long k, const double* p0,
+					  long i0, long i1, double* out )
+{
+  long nx= job->nx;
+  long ny= job->ny;
+  long nz= job->nz;
+  long i;
+
+  for (i=i0; i<=i1; i++) {
+    long seg;
+    double u;
+    double wx[4], wy[4], wz[4];
+    long oy[4], oz[4];
+    const double* row;
+    __m128d accLo= _mm_setzero_pd();
+    __m128d accHi= _mm_setzero_pd();
+    double sum[2];
+    int b;
+
+    cubicTap(p0[0] + i*job->stepX[0], nx, &seg, &u);
+    if (seg<1 || seg+2>nx-1) {
+      /* The x taps run off the edge and must be replicated */
+      out[i]= cubicVoxel(job, p0, i);
+      continue;
+    }
+    cubicWeights(job->type, job->tension, u, wx);
+    row= job->in + seg-1;
+    cubicTap(p0[1] + i*job->stepX[1], ny, &seg, &u);
+    cubicWeights(job->type, job->tension, u, wy);
+    cubicOffsets(seg, ny, nx, oy);
+    cubicTap(p0[2] + i*job->stepX[2], nz, &seg, &u);
+    cubicWeights(job->type, job->tension, u, wz);
+    cubicOffsets(seg, nz, nx*ny, oz);
+    for (b=0; b<4; b++) {
+      const double* v= row + oy[b];
+      __m128d w0= _mm_set1_pd(wz[0]);
+      __m128d w1= _mm_set1_pd(wz[1]);
+      __m128d w2= _mm_set1_pd(wz[2]);
+      __m128d w3= _mm_set1_pd(wz[3]);
+      __m128d wb= _mm_set1_pd(wy[b]);
+      __m128d lo= _mm_mul_pd(w0, _mm_loadu_pd(v+oz[0]));
+      __m128d hi= _mm_mul_pd(w0, _mm_loadu_pd(v+oz[0]+2));
+      lo= _mm_add_pd(lo, _mm_mul_pd(w1, _mm_loadu_pd(v+oz[1])));
+      hi= _mm_add_pd(hi, _mm_mul_pd(w1, _mm_loadu_pd(v+oz[1]+2)));
+      lo= _mm_add_pd(lo, _mm_mul_pd(w2, _mm_loadu_pd(v+oz[2])));
+      hi= _mm_add_pd(hi, _mm_mul_pd(w2, _mm_loadu_pd(v+oz[2]+2)));
+      lo= _mm_add_pd(lo, _mm_mul_pd(w3, _mm_loadu_pd(v+oz[3])));
+      hi= _mm_add_pd(hi, _mm_mul_pd(w3, _mm_loadu_pd(v+oz[3]+2)));
+      accLo= _mm_add_pd(accLo, _mm_mul_pd(wb, lo));
+      accHi= _mm_add_pd(accHi, _mm_mul_pd(wb, hi));
+    }
+    accLo= _mm_add_pd(_mm_mul_pd(accLo, _mm_loadu_pd(wx)),
+		      _mm_mul_pd(accHi, _mm_loadu_pd(wx+2)));
+    _mm_storeu_pd(sum, accLo);
+    out[i]= sum[0]+sum[1];
+  }
+}
+
+TARGET_AVX static void warpRowCubicAVX( const WarpJob* job, 
+					long j, long k, const double* p0,
+					long i0, long i1, double* out )
+{
+  long nx= job->nx;
+  long ny= job->ny;
+  long nz= job->nz;
+  long i;
+
+  for (i=i0; i<=i1; i++) {
+    long seg;
+    double u;
+    double wx[4], wy[4], wz[4];
+    long oy[4], oz[4];
+    const double* row;
+    __m256d acc= _mm256_setzero_pd();
+    __m128d sum;
+    int b;
+
+    cubicTap(p0[0] + i*job->stepX[0], nx, &seg, &u);
+    if (seg<1 || seg+2>nx-1) {
+      out[i]= cubicVoxel(job, p0, i);
+      continue;
+    }
+    cubicWeights(job->type, job->tension, u, wx);
+    row= job->in + seg-1;
+    cubicTap(p0[1] + i*job->stepX[1], ny, &seg, &u);
+    cubicWeights(job->type, job->tension, u, wy);
+    cubicOffsets(seg, ny, nx, oy);
+    cubicTap(p0[2] + i*job->stepX[2], nz, &seg, &u);
+    cubicWeights(job->type, job->tension, u, wz);
+    cubicOffsets(seg, nz, nx*ny, oz);
+    for (b=0; b<4; b++) {
+      const double* v= row + oy[b];
+      __m256d col= _mm256_mul_pd(_mm256_set1_pd(wz[0]),
+				 _mm256_loadu_pd(v+oz[0]));
+      col= _mm256_add_pd(col, _mm256_mul_pd(_mm256_set1_pd(wz[1]),
+					    _mm256_loadu_pd(v+oz[1])));
+      col= _mm256_add_pd(col, _mm256_mul_pd(_mm256_set1_pd(wz[2]),
+					    _mm256_loadu_pd(v+oz[2])));
+      col= _mm256_add_pd(col, _mm256_mul_pd(_mm256_set1_pd(wz[3]),
+					    _mm256_loadu_pd(v+oz[3])));
+      acc= _mm256_add_pd(acc, _mm256_mul_pd(_mm256_set1_pd(wy[b]), col));
+    }
+    acc= _mm256_mul_pd(acc, _mm256_loadu_pd(wx));
+    sum= _mm_add_pd(_mm256_castpd256_pd128(acc),
+		    _mm256_extractf128_pd(acc, 1));
+    out[i]= _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+    /* The tap helpers are SSE code, which stalls on dirty AVX state */
+    _mm256_zeroupper();
+  }
+}
+
+#endif
+
+static WarpRowFunc warpRowLinearFunc= NULL;
+static WarpRowFunc warpRowCubicFunc= NULL;
+
+static void chooseWarpRows()
+{
+  warpRowLinearFunc= warpRowLinear;
+  warpRowCubicFunc= warpRowCubic;
+#ifdef INTRP_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx")) {
+    warpRowLinearFunc= warpRowLinearAVX;
+    warpRowCubicFunc= warpRowCubicAVX;
+  }
+  else if (__builtin_cpu_supports("sse2")) {
+    warpRowLinearFunc= warpRowLinearSSE2;
+    warpRowCubicFunc= warpRowCubicSSE2;
+  }
+#endif
+}
+
+static WarpRowFunc getWarpRow( InterpolatorType type )
+{
+#ifdef USE_PTHREAD
+  static pthread_once_t warpRowOnce= PTHREAD_ONCE_INIT;
+  pthread_once(&warpRowOnce, chooseWarpRows);
+#else
+  if (!warpRowLinearFunc) chooseWarpRows();
+#endif
+  switch (type) {
+  case INTRP_CLOSEST: return warpRowClosest;
+  case INTRP_LINEAR: return warpRowLinearFunc;
+  default: return warpRowCubicFunc;
+  }
+}
+
+static void runWarpJob( const WarpJob* job )
+{
+  WarpRowFunc rowFunc= getWarpRow(job->type);
+  long nx= job->nx;
+  long ny= job->ny;
+  long j;
+  long k;
+
+  for (k=job->kFirst; k<job->kEnd; k++)
+    for (j=0; j<ny; j++) {
+      long offset= (k*ny+j)*nx;
+      double* out= job->out + offset;
+      char* check= job->check + offset;
+      double p0[3];
+      long first;
+      long last;
+      long i;
+      for (i=0; i<3; i++)
+	p0[i]= job->origin[i] + j*job->stepY[i] + k*job->stepZ[i];
+      warpSpan(job, p0, &first, &last);
+      if (first>last) {
+	/* This whole scanline maps outside the input array */
+	for (i=0; i<nx; i++) out[i]= 0.0;
+	memset(check, 0, nx);
+	continue;
+      }
+      for (i=0; i<first; i++) out[i]= 0.0;
+      for (i=last+1; i<nx; i++) out[i]= 0.0;
+      memset(check, 0, first);
+      memset(check+first, 1, last+1-first);
+      memset(check+last+1, 0, nx-(last+1));
+      rowFunc(job, j, k, p0, first, last, out);
+    }
+}
+
+static void warpWorker( void* arg )
+{
+  runWarpJob((WarpJob*)arg);
+}
+
+static int affineWarpApplies( const Interpolator* interp, const Transform t,
+			      long nx, long ny, long nz, long fast_blk )
+{
+  if (fast_blk!=1 || interp->extent!=nx*ny*nz) return 0;
+  if (t[12]!=0.0 || t[13]!=0.0 || t[14]!=0.0 || t[15]!=1.0) return 0;
+  switch (interp->type) {
+  case INTRP_CLOSEST:
+  case INTRP_LINEAR:
+  case INTRP_CATMULLROM:
+  case INTRP_BSPLINE:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static void affineWarp( const Interpolator* interp, const Transform t,
+			const double* orig_image, double* moved_image,
+			char* check, long nx, long ny, long nz )
+{
+  /* t maps centered output grid coords to centered input grid coords,
+   * so the source point for voxel (i,j,k) is origin+i*stepX+j*stepY
+   * +k*stepZ once the centering offsets are folded into origin.
+   */
+  WarpJob job;
+  double half[3];
+  int nthreads;
+  int r;
+
+  half[0]= (double)(nx/2);
+  half[1]= (double)(ny/2);
+  half[2]= (double)(nz/2);
+  job.type= interp->type;
+  job.tension= (interp->type==INTRP_CATMULLROM) ?
+    interp->getDouble(interp, INTRP_OPT_TENSION) : 0.0;
+  job.in= orig_image;
+  job.out= moved_image;
+  job.check= check;
+  job.nx= nx;
+  job.ny= ny;
+  job.nz= nz;
+  for (r=0; r<12; r++) job.t[r]= t[r];
+  for (r=0; r<3; r++) {
+    job.half[r]= half[r];
+    job.stepX[r]= t[4*r];
+    job.stepY[r]= t[4*r+1];
+    job.stepZ[r]= t[4*r+2];
+    job.origin[r]= t[4*r+3] + half[r] - t[4*r]*half[0] - t[4*r+1]*half[1]
+      - t[4*r+2]*half[2];
+  }
+  job.kFirst= 0;
+  job.kEnd= nz;
+
+  nthreads= fthr_count("intrp_warpApply", warpThreads);
+  if (nthreads>nz) nthreads= (int)nz;
+  if (nx*ny*nz < MIN_THREADED_VOXELS) nthreads= 1;
+
+  if (nthreads>1) {
+    WarpJob* jobs;
+    int i;
+
+    if (!(jobs= (WarpJob*)malloc(nthreads*sizeof(WarpJob))))
+      Abort("intrp_warpApply: unable to allocate %ld bytes!\n",
+	    nthreads*sizeof(WarpJob));
+    for (i=0; i<nthreads; i++) {
+      jobs[i]= job;
+      jobs[i].kFirst= fthr_share_start(nz, nthreads, i);
+      jobs[i].kEnd= fthr_share_start(nz, nthreads, i+1);
+    }
+    fthr_run_jobs(jobs, nthreads, sizeof(WarpJob), warpWorker);
+    free(jobs);
+    return;
+  }
+
+  runWarpJob(&job);
+}
+
 void intrp_warpApply( Interpolator* interp, Transform t_in,
 		      double* orig_image,
 		      double* moved_image,
@@ -142,6 +849,10 @@ void intrp_warpApply( Interpolator* interp, Transform t_in,
 
   /* Just do it */
   interp->prep(interp, orig_image, nx*ny*nz*fast_blk);
+  if (affineWarpApplies(interp, t, nx, ny, nz, fast_blk)) {
+    affineWarp(interp, t, orig_image, moved_image, check, nx, ny, nz);
+    return;
+  }
   pout[3]= 1.0;
   for (kout=0; kout<nz; kout++) {
     pout[2]= (double)(kout-halfz); 
@@ -405,6 +1116,7 @@ static Interpolator* createBaseInterpolator( int extent, int fast_blksize )
   result->getInt= baseGetInt;
   result->getDouble= baseGetDouble;
   result->typeName= "base";
+  result->type= INTRP_UNKNOWN;
 
   result->dataField= NULL;
   result->dataFieldLength= fast_blksize*extent;
@@ -434,6 +1146,7 @@ Interpolator* intrp_createClosestInterpolator1D( long nx, long fast_blksize )
 {
   Interpolator* result= createBaseInterpolator( nx, fast_blksize );
   result->typeName= "closest1D";
+  result->type= INTRP_CLOSEST;
   result->calc= calcClosest1D;
   return result;
 }
@@ -581,6 +1294,7 @@ Interpolator* intrp_createClosestInterpolator2D( long nx, long ny,
     result->getInt= getInt2D;
     result->getDouble= getDouble2D;
     result->typeName= "closest2D";
+    result->type= INTRP_CLOSEST;
   }
 
   return result;
@@ -734,6 +1448,7 @@ Interpolator* intrp_createClosestInterpolator3D( long nx, long ny, long nz,
     result->getInt= getInt3D;
     result->getDouble= getDouble3D;
     result->typeName= "closest3D";
+    result->type= INTRP_CLOSEST;
   }
 
   return result;
@@ -768,6 +1483,7 @@ Interpolator* intrp_createLinearInterpolator1D( long nx, long fast_blksize )
 {
   Interpolator* result= createBaseInterpolator( nx, fast_blksize );
   result->typeName= "linear1D";
+  result->type= INTRP_LINEAR;
   result->calc= calcLinear1D;
   return result;
 }
@@ -806,6 +1522,7 @@ Interpolator* intrp_createLinearInterpolator2D( long nx, long ny, long fast_blks
     result->getInt= getInt2D;
     result->getDouble= getDouble2D;
     result->typeName= "linear2D";
+    result->type= INTRP_LINEAR;
   }
 
   return result;
@@ -848,11 +1565,22 @@ Interpolator* intrp_createLinearInterpolator3D( long nx, long ny, long nz,
     result->getInt= getInt3D;
     result->getDouble= getDouble3D;
     result->typeName= "linear3D";
+    result->type= INTRP_LINEAR;
   }
 
   return result;
 }
 
+static InterpolatorType typeFromSplineType( SplineType type )
+{
+  switch (type) {
+  case SPL_CATMULLROM: return INTRP_CATMULLROM;
+  case SPL_BEZIER: return INTRP_BEZIER;
+  case SPL_BSPLINE: return INTRP_BSPLINE;
+  default: return INTRP_UNKNOWN;
+  }
+}
+
 static void splineSetDouble( Interpolator* self, int which, double val )
 {
   switch (which) {
@@ -918,6 +1646,7 @@ Interpolator* intrp_createSplineInterpolator1D( SplineType type,
 {
   Interpolator* result= createBaseInterpolator( nx, fast_blksize );
   result->typeName= "spline1D";
+  result->type= typeFromSplineType(type);
   result->setDouble= splineSetDouble;
   result->getDouble= splineGetDouble;
   result->destroySelf= destroySpline1D;
@@ -932,38 +1661,39 @@ static void calcSpline2D( Interpolator* self, double* result, double* loc,
 			  long runLength, long offset )
 {
   Info2D* info= (Info2D*)self->hook;
-  long lvlB= (long)floor(loc[0]);
-  long lvlC= (long)ceil(loc[0]);
-  long lvlA, lvlD;
-  if (lvlB<0) {
-    lvlB= 0;
-    if (lvlC<0) lvlC= 0;
-  }
-  if (lvlC>info->nx-1) {
-    lvlC= info->nx-1;
-    if (lvlB>info->nx-1) lvlB= info->nx-1;
-  }
-  if (lvlB>0) lvlA= lvlB-1;
-  else lvlA= 0;
-  if (lvlC<info->nx-1) lvlD= lvlC+1;
-  else lvlD= info->nx-1;
+  long lvlA= 0;
+  long lvlD= 0;
+
+  if (info->nx>1) {
+    /* The x spline reads the four samples around the segment which
+     * spl_calc() picks, so find that segment exactly as it does.
+     */
+    double sloc= loc[0]/((double)(info->nx - 1));
+    long seg;
+    if (sloc<0.0) sloc= 0.0;
+    if (sloc>1.0) sloc= 1.0;
+    seg= (int)((info->nx - 1)*sloc);
+    if (seg==info->nx-1) seg--;
+    lvlA= (seg>0) ? seg-1 : 0;
+    lvlD= (seg+2<info->nx-1) ? seg+2 : info->nx-1;
+  }
 
   if (self->debug)
     fprintf(stderr,
 	    "interpolator:calcSpline2D: %ld values, offset %ld, loc= %f %f\n",
 	    runLength, offset, loc[0], loc[1]);
 
-  if (lvlD-lvlA>0) {
+  if (lvlD>lvlA) {
     info->interpY->calc( info->interpY, 
 			 info->buf+lvlA*self->fast_blksize, loc+1,
-			 (lvlD-lvlA)*self->fast_blksize, 
+			 (lvlD-lvlA+1)*self->fast_blksize, 
 			 lvlA*self->fast_blksize );
     info->interpX->calc( info->interpX, result, loc, runLength, offset );
   }
   else {
     /* All stacked up on one point */
     info->interpY->calc( info->interpY, result, loc+1, runLength, 
-			 offset+self->fast_blksize*lvlB );
+			 offset );
   }
 }
 
@@ -1005,6 +1735,7 @@ Interpolator* intrp_createSplineInterpolator2D( SplineType type,
     result->getInt= getInt2D;
     result->getDouble= getDouble2D;
     result->typeName= "spline2D";
+    result->type= typeFromSplineType(type);
   }
 
   return result;
@@ -1014,37 +1745,38 @@ static void calcSpline3D( Interpolator* self, double* result, double* loc,
 		    long runLength, long offset )
 {
   Info3D* info= (Info3D*)self->hook;
-  long lvlB= (long)floor(loc[0]);
-  long lvlC= (long)ceil(loc[0]);
-  long lvlA, lvlD;
-  if (lvlB<0) {
-    lvlB= 0;
-    if (lvlC<0) lvlC= 0;
-  }
-  if (lvlC>info->nx-1) {
-    lvlC= info->nx-1;
-    if (lvlB>info->nx-1) lvlB= info->nx-1;
-  } 
-  if (lvlB>0) lvlA= lvlB-1;
-  else lvlA= 0;
-  if (lvlC<info->nx-1) lvlD= lvlC+1;
-  else lvlD= info->nx-1; 
+  long lvlA= 0;
+  long lvlD= 0;
+
+  if (info->nx>1) {
+    /* The x spline reads the four samples around the segment which
+     * spl_calc() picks, so find that segment exactly as it does.
+     */
+    double sloc= loc[0]/((double)(info->nx - 1));
+    long seg;
+    if (sloc<0.0) sloc= 0.0;
+    if (sloc>1.0) sloc= 1.0;
+    seg= (int)((info->nx - 1)*sloc);
+    if (seg==info->nx-1) seg--;
+    lvlA= (seg>0) ? seg-1 : 0;
+    lvlD= (seg+2<info->nx-1) ? seg+2 : info->nx-1;
+  }
 
   if (self->debug)
     fprintf(stderr,
 	    "interpolator:calcSpline3D: %ld values, offset %ld, loc= %f %f %f\n",
 	    runLength, offset, loc[0], loc[1], loc[2]);
-  if (lvlD-lvlA>0) {
+  if (lvlD>lvlA) {
     info->interpYZ->calc( info->interpYZ, 
 			  info->buf+lvlA*self->fast_blksize, loc+1,
-			  (lvlD-lvlA)*self->fast_blksize, 
+			  (lvlD-lvlA+1)*self->fast_blksize, 
 			  lvlA*self->fast_blksize );
     info->interpX->calc( info->interpX, result, loc, runLength, offset );
   }
   else {
     /* All stacked up on one point */
     info->interpYZ->calc( info->interpYZ, result, loc+1, runLength, 
-			  offset+self->fast_blksize*lvlB );
+			  offset );
   }
 }
 
@@ -1088,6 +1820,7 @@ Interpolator* intrp_createSplineInterpolator3D( SplineType type,
     result->getInt= getInt3D;
     result->getDouble= getDouble3D;
     result->typeName= "spline3D";
+    result->type= typeFromSplineType(type);
   }
 
   return result;
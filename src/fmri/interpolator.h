@@ -47,6 +47,7 @@ extern InterpolatorType intrp_typeFromName( const char* name );
 extern const char* intrp_nameFromType( InterpolatorType type );
 extern void intrp_warpClearCounts(void);
 extern void intrp_warpGetCounts(long* count);
+extern void intrp_warpSetThreads(int nthreads);
 
 typedef struct Interpolator_struct {
   void (*prep)( struct Interpolator_struct* self, double* data, long sz );
@@ -59,6 +60,7 @@ typedef struct Interpolator_struct {
   long (*getInt)( const struct Interpolator_struct* self, int which );
   double (*getDouble)( const struct Interpolator_struct* self, int which );
   const char* typeName;
+  InterpolatorType type; /* INTRP_UNKNOWN for internal helpers */
   double* dataField;
   long dataFieldLength;
   void* hook;
@@ -80,6 +82,13 @@ typedef struct Interpolator_struct {
  * Input and output data are assumed to be ordered such that x is 
  * fastest in memory.  Note that this differs from closest_warp
  * and linwarp!
+ *
+ * If t is affine, fast_blk is 1 and interp is a closest, linear,
+ * Catmull-Rom or B-spline interpolator, the warp is done by a
+ * specialized engine which does not use interp's methods; the
+ * results agree with the general path to rounding error.  That
+ * engine splits the work over z among intrp_warpSetThreads()
+ * threads; the default of 0 means one per available processor.
  */
 void intrp_warpApply( Interpolator* interp, Transform t,
 		      double* orig_image,
@@ -0,0 +1,234 @@
+/************************************************************
+ *                                                          *
+ *  interpolator_tester.c                                   *
+ *                                                          *
+ *  Permission is hereby granted to any individual or       *
+ *  institution for use, copying, or redistribution of      *
+ *  this code and associated documentation, provided        *
+ *  that such code and documentation are not sold for       *
+ *  profit and the following copyright notice is retained   *
+ *  in the code and documentation:                          *
+ *     Copyright (c) 1998 Department of Statistics,         *
+ *                        Carnegie Mellon University        *
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ ************************************************************/
+
+/* This program checks intrp_warpApply().  Affine transforms of
+ * scalar fields go through a dedicated warp engine; doubling every
+ * entry of the transform leaves the warp unchanged but makes it
+ * projective, which forces the general per-voxel path.  The two must
+ * produce the same check mask and (up to rounding) the same values.
+ * The spline interpolators are also checked directly, since the
+ * general path is only as good as their calc methods: a field which
+ * varies only in x must interpolate exactly as a 1D spline does.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "mri.h"
+#include "fmri.h"
+
+#define N_TRANSFORMS 20
+#define TOLERANCE 1.0e-9
+#define SPLINE_TOLERANCE 1.0e-12
+
+static long dims[][3]= {
+  { 32, 28, 20 },
+  { 17, 9, 1 },
+  { 40, 40, 36 },
+  { 5, 6, 7 }
+};
+#define N_DIMS (sizeof(dims)/sizeof(dims[0]))
+
+static InterpolatorType types[]= {
+  INTRP_CLOSEST, INTRP_LINEAR, INTRP_CATMULLROM, INTRP_BSPLINE
+};
+#define N_TYPES (sizeof(types)/sizeof(InterpolatorType))
+
+static void make_transform( Transform t, int which )
+{
+  Quat q;
+  int m;
+
+  trans_identity(t);
+  switch (which) {
+  case 0: break;
+  case 1: 
+    {
+      quat_from_euler_RzRyRx(&q,0.1,0.05,-0.2);
+      quat_to_trans(t,&q,1.3,-2.1,0.7);
+    }
+    break;
+  case 2:
+    {
+      t[0]= 1.1; t[5]= 0.9; t[10]= 1.05; t[3]= 0.5;
+    }
+    break;
+  case 3:
+    {
+      t[1]= 0.2; t[6]= -0.1; t[3]= 3.0; t[11]= -1.0;
+    }
+    break;
+  case 4:
+    {
+      t[0]= -1.0;
+    }
+    break;
+  default:
+    {
+      for (m=0; m<12; m++) 
+	t[m] += (drand48()-0.5)*((m%4==3) ? 8.0 : 0.4);
+    }
+  }
+}
+
+static int compare_warps( InterpolatorType type, long nx, long ny, long nz,
+			  int nthreads )
+{
+  long n= nx*ny*nz;
+  double* in= (double*)malloc(n*sizeof(double));
+  double* engine= (double*)malloc(n*sizeof(double));
+  double* general= (double*)malloc(n*sizeof(double));
+  char* engineCheck= (char*)malloc(n);
+  char* generalCheck= (char*)malloc(n);
+  Interpolator* interp= intrp_createInterpolator3DByType(type,nx,ny,nz,1);
+  long nMaskDiffs= 0;
+  double maxErr= 0.0;
+  int failed;
+  int which;
+  long i;
+
+  if (!in || !engine || !general || !engineCheck || !generalCheck) {
+    fprintf(stderr,"Unable to allocate %ld voxels!\n",n);
+    exit(-1);
+  }
+  for (i=0; i<n; i++) in[i]= 100.0*drand48() + (double)(i%nx);
+
+  intrp_warpSetThreads(nthreads);
+  for (which=0; which<N_TRANSFORMS; which++) {
+    Transform t;
+    Transform tDoubled;
+    make_transform(t, which);
+    for (i=0; i<16; i++) tDoubled[i]= 2.0*t[i];
+    intrp_warpApply(interp, t, in, engine, engineCheck, nx, ny, nz, 1,
+		    (double)nx, (double)ny, (double)nz);
+    intrp_warpApply(interp, tDoubled, in, general, generalCheck, 
+		    nx, ny, nz, 1, (double)nx, (double)ny, (double)nz);
+    for (i=0; i<n; i++) {
+      if (engineCheck[i]!=generalCheck[i]) nMaskDiffs++;
+      else if (engineCheck[i]) {
+	double err= fabs(engine[i]-general[i]);
+	if (!(err<=maxErr)) maxErr= err;
+      }
+    }
+  }
+  intrp_warpSetThreads(1);
+
+  failed= (nMaskDiffs!=0 
+	   || (type==INTRP_CLOSEST && maxErr!=0.0)
+	   || !(maxErr<=TOLERANCE));
+  printf("warp %-10s %ldx%ldx%ld threads %d: %ld mask diffs, max diff %.3g",
+	 intrp_nameFromType(type), nx, ny, nz, nthreads, nMaskDiffs, maxErr);
+  printf("   %s\n", failed ? "FAILED" : "ok");
+
+  interp->destroySelf(interp);
+  free(in);
+  free(engine);
+  free(general);
+  free(engineCheck);
+  free(generalCheck);
+  return failed;
+}
+
+static int check_spline( SplineType type, const char* name, 
+			 long nx, long ny, long nz )
+{
+  long n= nx*ny*nz;
+  double* row= (double*)malloc(nx*sizeof(double));
+  double* data= (double*)malloc(n*sizeof(double));
+  Interpolator* interp= 
+    intrp_createSplineInterpolator3D(type, nx, ny, nz, 1);
+  Interpolator* interp1D= intrp_createSplineInterpolator1D(type, nx, 1);
+  double maxErr= 0.0;
+  int failed;
+  int trial;
+  long i;
+
+  if (!row || !data) {
+    fprintf(stderr,"Unable to allocate %ld voxels!\n",n);
+    exit(-1);
+  }
+  for (i=0; i<nx; i++) row[i]= 100.0*drand48();
+  for (i=0; i<n; i++) data[i]= row[i%nx];
+  interp->prep(interp, data, n);
+  interp1D->prep(interp1D, row, nx);
+
+  for (trial=0; trial<1000; trial++) {
+    double loc[3];
+    double val;
+    double ref;
+    double err;
+    loc[0]= (nx-1)*drand48();
+    loc[1]= (ny-1)*drand48();
+    loc[2]= (nz-1)*drand48();
+    if (trial<nx) loc[0]= (double)trial; /* include the knots */
+    interp->calc(interp, &val, loc, 1, 0);
+    interp1D->calc(interp1D, &ref, loc, 1, 0);
+    err= fabs(val-ref);
+    if (!(err<=maxErr)) maxErr= err;
+  }
+
+  failed= !(maxErr<=SPLINE_TOLERANCE);
+  printf("spline %-10s %ldx%ldx%ld: max diff from 1D %.3g   %s\n",
+	 name, nx, ny, nz, maxErr, failed ? "FAILED" : "ok");
+
+  interp->destroySelf(interp);
+  interp1D->destroySelf(interp1D);
+  free(row);
+  free(data);
+  return failed;
+}
+
+int main( int argc, char* argv[] )
+{
+  int failures= 0;
+  int i;
+  int j;
+
+  srand48(1234);
+  for (i=0; i<N_DIMS; i++)
+    for (j=0; j<N_TYPES; j++)
+      failures += compare_warps(types[j], dims[i][0], dims[i][1], 
+				dims[i][2], 1);
+  for (j=0; j<N_TYPES; j++)
+    failures += compare_warps(types[j], dims[2][0], dims[2][1], 
+			      dims[2][2], 3);
+
+  for (i=0; i<N_DIMS; i++) {
+    failures += check_spline(SPL_CATMULLROM, "catmullrom", 
+			     dims[i][0], dims[i][1], dims[i][2]);
+    failures += check_spline(SPL_BSPLINE, "bspline", 
+			     dims[i][0], dims[i][1], dims[i][2]);
+  }
+
+  if (failures) {
+    printf("%d cases FAILED\n",failures);
+    exit(1);
+  }
+  printf("warp engine and interpolators agree\n");
+  return 0;
+}
@@ -8,6 +8,20 @@
 #include <math.h>
 #include <string.h>
 
+/* This file is part of libfmri, which is linked with the real BLAS.
+ * Keep the reference BLAS and LINPACK routines below from standing in
+ * for the library versions in every program that uses the optimizer.
+ */
+#define daxpy_ lbfgs_daxpy_
+#define dcopy_ lbfgs_dcopy_
+#define ddot_ lbfgs_ddot_
+#define dnrm2_ lbfgs_dnrm2_
+#define dscal_ lbfgs_dscal_
+#define dpofa_ lbfgs_dpofa_
+#define dtrsl_ lbfgs_dtrsl_
+#define dpmeps_ lbfgs_dpmeps_
+#define timer_ lbfgs_timer_
+
 /* #include "f2c.h" */
 
 /* Some things from f2c.h */
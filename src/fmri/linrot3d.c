@@ -286,4 +286,100 @@ void linear_shift_rot3d( Quat* q, double dx, double dy, double dz,
 
 }
 
+/* out gets the vector part of a*v*b */
+static void quat_sandwich( double out[3], Quat* a, Quat* v, Quat* b )
+{
+  Quat t;
+  quat_copy(&t, v);
+  quat_mult_right(quat_mult_left(a,&t), b);
+  out[0]= t.x;
+  out[1]= t.y;
+  out[2]= t.z;
+}
+
+/*
+ * The inverse transform q'(In - d)q used by linear_shift_rot3d() is
+ * an affine map, so this builds it as a Transform and lets
+ * linwarp_warp_grad() collect the derivatives with respect to its
+ * elements.  Those are then carried back to q and d by the chain rule;
+ * the derivative of q'vq with respect to a component of q is
+ * e'vq + q've, where e is the unit quaternion for that component.
+ */
+void linear_shift_rot3d_grad( Quat* q, double dx, double dy, double dz,
+			      FComplex* orig_image,
+			      float* dvalue,
+			      long nx, long ny, long nz,
+			      double length_x, double length_y, 
+			      double length_z,
+			      double grad[7] )
+{
+  Transform t;
+  Transform tGrad;
+  double m[3][3];
+  double dm[3];
+  double d[3];
+  Quat qConj;
+  Quat e;
+  Quat eConj;
+  Quat v;
+  int row, col;
+  int comp;
+
+  d[0]= dx;
+  d[1]= dy;
+  d[2]= dz;
+  quat_copy(&qConj, q);
+  quat_conjugate(&qConj);
+
+  /* Columns of the rotation part are the images of the unit vectors */
+  for (col=0; col<3; col++) {
+    double out[3];
+    v.x= (col==0) ? 1.0 : 0.0;
+    v.y= (col==1) ? 1.0 : 0.0;
+    v.z= (col==2) ? 1.0 : 0.0;
+    v.w= 0.0;
+    quat_sandwich(out, &qConj, &v, q);
+    for (row=0; row<3; row++) m[row][col]= out[row];
+  }
+  trans_identity(t);
+  for (row=0; row<3; row++) {
+    for (col=0; col<3; col++) t[4*row+col]= m[row][col];
+    t[4*row+3]= -(m[row][0]*d[0] + m[row][1]*d[1] + m[row][2]*d[2]);
+  }
+
+  linwarp_warp_grad(t, orig_image, dvalue, nx, ny, nz,
+		    length_x, length_y, length_z, tGrad);
+
+  /* Shifts enter only through the translation column */
+  for (col=0; col<3; col++) {
+    grad[4+col]= 0.0;
+    for (row=0; row<3; row++) grad[4+col] -= tGrad[4*row+3]*m[row][col];
+  }
 
+  /* Quaternion components, in the order x, y, z, w */
+  for (comp=0; comp<4; comp++) {
+    e.x= (comp==0) ? 1.0 : 0.0;
+    e.y= (comp==1) ? 1.0 : 0.0;
+    e.z= (comp==2) ? 1.0 : 0.0;
+    e.w= (comp==3) ? 1.0 : 0.0;
+    quat_copy(&eConj, &e);
+    quat_conjugate(&eConj);
+    grad[comp]= 0.0;
+    for (col=0; col<3; col++) {
+      double term1[3];
+      double term2[3];
+      v.x= (col==0) ? 1.0 : 0.0;
+      v.y= (col==1) ? 1.0 : 0.0;
+      v.z= (col==2) ? 1.0 : 0.0;
+      v.w= 0.0;
+      quat_sandwich(term1, &eConj, &v, q);
+      quat_sandwich(term2, &qConj, &v, &e);
+      for (row=0; row<3; row++) {
+	dm[row]= term1[row]+term2[row];
+	/* The column's own element, and its share of the translation */
+	grad[comp] += tGrad[4*row+col]*dm[row]
+	  - tGrad[4*row+3]*dm[row]*d[col];
+      }
+    }
+  }
+}
@@ -59,6 +59,22 @@ void linear_shift_rot3d( Quat* q, double dx, double dy, double dz,
 			 double length_x, double length_y, double length_z,
 			 int kspace_flag );
 
+/*
+  Given dvalue, a per-voxel weight on the output grid, this sets grad
+  to the derivatives of the sum over voxels of dvalue times the real
+  part of the image linear_shift_rot3d() would produce.  The order is
+  q->x, q->y, q->z, q->w, dx, dy, dz, with the components of q taken
+  as independent (that is, without renormalization).  Voxels which map
+  outside the input are left out.
+ */
+void linear_shift_rot3d_grad( Quat* q, double dx, double dy, double dz,
+			      FComplex* orig_image,
+			      float* dvalue,
+			      long nx, long ny, long nz,
+			      double length_x, double length_y, 
+			      double length_z,
+			      double grad[7] );
+
 
 /* Clear and get the counters for operations (for diagnostics) */
 void linrot3d_clear_counts(void);
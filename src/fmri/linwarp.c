@@ -122,6 +122,29 @@ void linwarp_get_counts( int* ncalls )
  * Input and output data are assumed to be ordered such that z is 
  * fastest in memory.
  */
+static void grid_transform( Transform t, Transform t_in,
+			    long nx, long ny, long nz,
+			    double length_x, double length_y, double length_z )
+{
+  Transform tTemp;
+
+  /* Make a version of the transform in which the voxel scale
+   * factors have been sucked into the matrix.  Signs of terms 
+   * are determined by relationship between grid and 3D (radiological) 
+   * coords.
+   */
+  trans_identity(tTemp);
+  tTemp[0]= length_x/(double)nx;
+  tTemp[5]= -length_y/(double)ny;
+  tTemp[10]= length_z/(double)nz;
+  trans_copy(t, t_in);
+  trans_mult_right(t,tTemp);
+  tTemp[0]= 1.0/tTemp[0];
+  tTemp[5]= 1.0/tTemp[5];
+  tTemp[10]= 1.0/tTemp[10];
+  trans_mult_left(tTemp,t);
+}
+
 void linwarp_warp( Transform t_in, 
 		   FComplex* orig_image,
 		   FComplex* moved_image,
@@ -138,7 +161,6 @@ void linwarp_warp( Transform t_in,
   long halfy= ny/2;
   long halfz= nz/2;
   Transform t;
-  Transform tTemp;
 
 #ifdef never
   double xmin= 1000.0;
@@ -152,21 +174,7 @@ void linwarp_warp( Transform t_in,
   /* Step counter */
   count_calls++;
 
-  /* Make a version of the transform in which the voxel scale
-   * factors have been sucked into the matrix.  Signs of terms 
-   * are determined by relationship between grid and 3D (radiological) 
-   * coords.
-   */
-  trans_identity(tTemp);
-  tTemp[0]= length_x/(double)nx;
-  tTemp[5]= -length_y/(double)ny;
-  tTemp[10]= length_z/(double)nz;
-  trans_copy(t, t_in);
-  trans_mult_right(t,tTemp);
-  tTemp[0]= 1.0/tTemp[0];
-  tTemp[5]= 1.0/tTemp[5];
-  tTemp[10]= 1.0/tTemp[10];
-  trans_mult_left(tTemp,t);
+  grid_transform(t, t_in, nx, ny, nz, length_x, length_y, length_z);
 
   /* Just do it */
   pout[3]= 1.0;
@@ -254,4 +262,120 @@ void linwarp_warp( Transform t_in,
 #endif
 }
 
+/*
+ * This finds the derivative of sum(dvalue*moved_image.real) over
+ * the output grid with respect to each element of t_in, where
+ * moved_image is what linwarp_warp() would produce.  The output grid
+ * point o maps to the input grid point p = T(o-half)+half, where T is
+ * t_in rescaled to grid units.  The derivative of the sum with respect
+ * to T[r][c] is the sum of dvalue times the r'th component of the
+ * trilinear interpolant's gradient at p, times the c'th component of
+ * o-half (1 for the translation column).  Those 12 sums are gathered
+ * in one pass and then rescaled to the units of t_in.
+ */
+void linwarp_warp_grad( Transform t_in,
+			FComplex* orig_image,
+			float* dvalue,
+			long nx, long ny, long nz,
+			double length_x, double length_y, double length_z,
+			Transform grad )
+{
+  Vec4 pout; /* point in output space (grid-aligned) */
+  Vec4 p; /* point in input space */
+  long i, j, k;
+  long iout, jout, kout;
+  long halfx= nx/2;
+  long halfy= ny/2;
+  long halfz= nz/2;
+  long stride[3];
+  double scale[4];
+  double sums[3][4];
+  Transform t;
+  int r, col;
+
+  grid_transform(t, t_in, nx, ny, nz, length_x, length_y, length_z);
+  stride[0]= ny*nz;
+  stride[1]= nz;
+  stride[2]= 1;
+  for (r=0; r<3; r++) 
+    for (col=0; col<4; col++) sums[r][col]= 0.0;
+
+  pout[3]= 1.0;
+  for (iout=0; iout<nx; iout++) {
+    pout[0]= (double)(iout-halfx);
+    for (jout=0; jout<ny; jout++) {
+      pout[1]= (double)(jout-halfy);
+      for (kout=0; kout<nz; kout++) {
+	double dv= MEM(dvalue,nx,ny,nz,iout,jout,kout);
+	double ax, ay, az;
+	double v[2][2][2];
+	double g[3];
+	FComplex* here;
+	int a, b, cc;
 
+	if (dv==0.0) continue;
+	pout[2]= (double)(kout-halfz);
+	bcopy(pout,p,sizeof(pout));
+	trans_vec_mult(t, p);
+	p[0] += halfx;
+	p[1] += halfy;
+	p[2] += halfz;
+	if ((p[0]<(-EPSILON)) || (p[0]>(double)(nx-1))
+	    || (p[1]<(-EPSILON)) || (p[1]>(double)(ny-1))
+	    || (p[2]<(-EPSILON)) || (p[2]>(double)(nz-1)))
+	  continue; /* linwarp_warp() sets these to a constant 0.0 */
+
+	i= (int)floor( p[0] );
+	if (i<0) i= 0;
+	ax= p[0]-i;
+	j= (int)floor( p[1] );
+	if (j<0) j= 0;
+	ay= p[1]-j;
+	k= (int)floor( p[2] );
+	if (k<0) k= 0;
+	az= p[2]-k;
+
+	/* Corners of the cell, repeating the last plane at the far edge */
+	here= (&(MEM(orig_image,nx,ny,nz,i,j,k)));
+	for (a=0; a<2; a++)
+	  for (b=0; b<2; b++)
+	    for (cc=0; cc<2; cc++) {
+	      long off= 0;
+	      if (a && i<nx-1) off += stride[0];
+	      if (b && j<ny-1) off += stride[1];
+	      if (cc && k<nz-1) off += stride[2];
+	      v[a][b][cc]= (here+off)->real;
+	    }
+
+	/* Gradient of the trilinear interpolant */
+	g[0]= (1.0-ay)*(1.0-az)*(v[1][0][0]-v[0][0][0])
+	  + ay*(1.0-az)*(v[1][1][0]-v[0][1][0])
+	  + (1.0-ay)*az*(v[1][0][1]-v[0][0][1])
+	  + ay*az*(v[1][1][1]-v[0][1][1]);
+	g[1]= (1.0-ax)*(1.0-az)*(v[0][1][0]-v[0][0][0])
+	  + ax*(1.0-az)*(v[1][1][0]-v[1][0][0])
+	  + (1.0-ax)*az*(v[0][1][1]-v[0][0][1])
+	  + ax*az*(v[1][1][1]-v[1][0][1]);
+	g[2]= (1.0-ax)*(1.0-ay)*(v[0][0][1]-v[0][0][0])
+	  + ax*(1.0-ay)*(v[1][0][1]-v[1][0][0])
+	  + (1.0-ax)*ay*(v[0][1][1]-v[0][1][0])
+	  + ax*ay*(v[1][1][1]-v[1][1][0]);
+
+	for (r=0; r<3; r++) {
+	  double u= dv*g[r];
+	  for (col=0; col<4; col++) sums[r][col] += u*pout[col];
+	}
+      }
+    }
+  }
+
+  /* T = D^-1 t_in D, where D holds the signed voxel sizes */
+  scale[0]= length_x/(double)nx;
+  scale[1]= -length_y/(double)ny;
+  scale[2]= length_z/(double)nz;
+  scale[3]= 1.0;
+  for (r=0; r<3; r++)
+    for (col=0; col<4; col++)
+      grad[4*r+col]= sums[r][col]*scale[col]/scale[r];
+  for (col=0; col<4; col++) grad[12+col]= 0.0;
+}
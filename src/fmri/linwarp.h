@@ -61,6 +61,21 @@ void linwarp_warp( Transform t,
 		   double length_x, double length_y, double length_z,
 		   int kspace_flag );
 
+/*
+ * Given dvalue, a per-voxel weight on the output grid, this sets
+ * grad[i] to the derivative of the sum over voxels of dvalue times the
+ * real part of the image linwarp_warp() would produce, with respect to
+ * t[i].  Voxels which map outside the input are left out.  The bottom
+ * row of grad is zero.  If dvalue is the derivative of some measure
+ * with respect to the warped image, grad is the measure's gradient.
+ */
+void linwarp_warp_grad( Transform t,
+			FComplex* orig_image,
+			float* dvalue,
+			long nx, long ny, long nz,
+			double length_x, double length_y, double length_z,
+			Transform grad );
+
 /* Clear and get the counters for operations (for diagnostics) */
 void linwarp_clear_counts(void);
 void linwarp_get_counts( int* ncalls );
@@ -41,10 +41,43 @@
 
 static char rcsid[] = "$Id: optimizer.c,v 1.6 2005/06/01 19:54:25 welling Exp $";
 
+/* Notes-
+ * -The L-BFGS optimizer drives the f2c translation of L-BFGS-B in
+ *  lbfgs.c through its reverse communication interface.  Parameters
+ *  are divided by the scale before they are handed to it, so its
+ *  first step, which has unit length, is 'scale' long in the caller's
+ *  units.  It stops when an iteration moves no parameter by more than
+ *  the tolerance, which is what the praxis tolerance roughly means.
+ * -If the ScalarFunction has no valueGrad method, the gradient is
+ *  found by central differences with a step proportional to the scale.
+ *  LBFGS_MAX_EVALS limits the value and gradient evaluations L-BFGS-B
+ *  asks for, not the function calls; each of those costs 2*nPar+1
+ *  calls with differences, and with 12 parameters a limit on calls
+ *  stopped searches that were converging at the analytic gradient's
+ *  rate.
+ * -The reset method is called once, at the starting point.  Unlike
+ *  praxis there is no outer loop, since redefining the function in
+ *  mid-search would spoil the curvature information L-BFGS collects.
+ */
+
+/* L-BFGS-B settings */
+#define LBFGS_CORRECTIONS 5
+#define LBFGS_FACTR 1.0e7
+#define LBFGS_MAX_ITER 200
+#define LBFGS_MAX_EVALS 1000 /* value and gradient evaluations */
+#define LBFGS_FD_STEP 1.0e-3
+
+/* From lbfgs.c */
+int setulb(int *n, int *m, double *x, double *l, double *u, int *nbd, 
+	   double *f, double *g, double *factr, double *pgtol, double *wa, 
+	   int *iwa, char *task, int *iprint, char *csave, int *lsave, 
+	   int *isave, double *dsave, short task_len, short csave_len);
+
 static double praxis_machep= 0.0;
 
 typedef struct SSFData {
   double (*value)(const double*, const int, void*);
+  double (*valueGrad)(const double*, const int, double*, void*);
   void (*reset)(const double*, const int, void*);
   void* userHook;
   int n;
@@ -72,6 +105,16 @@ static void ssfReset( ScalarFunction* sf, const double* par, const int nPar )
   d->reset(par, d->n, d->userHook );
 }
 
+static double ssfValueGrad( ScalarFunction* sf, const double* par, 
+			    const int nPar, double* grad )
+{
+  SSFData* d= (SSFData*)(sf->data);
+  if (nPar != d->n) 
+    Abort("ssfValueGrad: dimensionalities %d and %d do not match!\n",
+	  nPar,d->n);
+  return d->valueGrad(par, d->n, grad, d->userHook );
+}
+
 ScalarFunction* buildSimpleScalarFunction( 
 	     double (*value)(const double*, const int, void*),
 	     void (*reset)(const double*, const int, void*),
@@ -86,17 +129,35 @@ ScalarFunction* buildSimpleScalarFunction(
     Abort("buildSimpleScalarFunction: unable to allocate %d bytes!\n",
 	  sizeof(SSFData));
   d->value= value;
+  d->valueGrad= NULL;
   d->reset= reset;
   d->n= nDim;
   d->userHook= userHook;
   result->data= d;
   result->destroySelf= ssfDestroySelf;
   result->value= ssfValue;
+  result->valueGrad= NULL;
   result->reset= ssfReset;
 
   return result;
 }
 
+ScalarFunction* buildGradientScalarFunction( 
+	     double (*value)(const double*, const int, void*),
+	     double (*valueGrad)(const double*, const int, double*, void*),
+	     void (*reset)(const double*, const int, void*),
+	     const int nDim, void* userHook)
+{
+  ScalarFunction* result= 
+    buildSimpleScalarFunction(value, reset, nDim, userHook);
+  SSFData* d= (SSFData*)(result->data);
+
+  d->valueGrad= valueGrad;
+  result->valueGrad= ssfValueGrad;
+
+  return result;
+}
+
 static const char* baseGetMethodName(Optimizer* self)
 {
   static const char* name= "base";
@@ -631,6 +692,233 @@ Optimizer* createNelminTOptimizer(double stopping_val, double scale,
   return result;
 }
 
+typedef struct LBFGSData {
+  double tol;
+  double scale;
+} LBFGSData;
+
+static const char* lbfgsGetMethodName(Optimizer* self)
+{
+  static const char* name= "lbfgs";
+  return name;
+}
+
+static char* lbfgsGetStringRep(Optimizer* self)
+{
+  LBFGSData* pd= (LBFGSData*)(self->data);
+  char buf[256];
+  snprintf(buf,sizeof(buf),
+	   "LBFGSOptimizer(%lg,%lg)",pd->tol,pd->scale);
+  return strdup(buf);
+}
+
+static void lbfgsSetTol(Optimizer* self, const double tol)
+{
+  LBFGSData* pd= (LBFGSData*)(self->data);
+  baseSetTol(self,tol);
+  pd->tol= tol;
+}
+
+static double lbfgsGetTol(Optimizer* self)
+{
+  LBFGSData* pd= (LBFGSData*)(self->data);
+  return pd->tol;
+}
+
+static void lbfgsSetScale(Optimizer* self, const double scale)
+{
+  LBFGSData* pd= (LBFGSData*)(self->data);
+  baseSetScale(self,scale);
+  pd->scale= scale;
+}
+
+static double lbfgsGetScale(Optimizer* self)
+{
+  LBFGSData* pd= (LBFGSData*)(self->data);
+  return pd->scale;
+}
+
+/* Value and gradient at par; work must hold nPar doubles */
+static double lbfgsValueGrad(Optimizer* self, ScalarFunction* f, 
+			     double* par, const int nPar, double* grad,
+			     double* work, int* nEvals)
+{
+  LBFGSData* pd= (LBFGSData*)(self->data);
+  double h= LBFGS_FD_STEP*pd->scale;
+  double val;
+  int i;
+
+  if (f->valueGrad) {
+    (*nEvals)++;
+    return f->valueGrad(f,par,nPar,grad);
+  }
+
+  val= f->value(f,par,nPar);
+  for (i=0; i<nPar; i++) work[i]= par[i];
+  for (i=0; i<nPar; i++) {
+    double fPlus;
+    double fMinus;
+    work[i]= par[i]+h;
+    fPlus= f->value(f,work,nPar);
+    work[i]= par[i]-h;
+    fMinus= f->value(f,work,nPar);
+    work[i]= par[i];
+    grad[i]= (fPlus-fMinus)/(2.0*h);
+  }
+  *nEvals += 2*nPar+1;
+  return val;
+}
+
+static int lbfgsGo(Optimizer* self, ScalarFunction* f, double* par, 
+		   const int nPar, double* best)
+{
+  LBFGSData* pd= (LBFGSData*)(self->data);
+  int n= nPar;
+  int m= LBFGS_CORRECTIONS;
+  int iprint= -1;
+  double factr= LBFGS_FACTR;
+  double pgtol= 0.0;
+  char task[61];
+  char csave[61];
+  int lsave[4];
+  int isave[44];
+  double dsave[29];
+  double* x;
+  double* lower;
+  double* upper;
+  double* g;
+  double* xLast;
+  double* p;
+  double* pBest;
+  double* work;
+  double* wa;
+  int* nbd;
+  int* iwa;
+  long nWa= (2*m+4)*n + 11*m*m + 8*m;
+  double fval= 0.0;
+  double fBest= 0.0;
+  int haveBest= 0;
+  int nEvals= 0;
+  int nGrads= 0;
+  int nIter= 0;
+  int retval= 1;
+  int i;
+
+  if (!(x=(double*)malloc((8*n+nWa)*sizeof(double))))
+    Abort("lbfgsGo: cannot allocate %d bytes!\n",
+	  (8*n+nWa)*sizeof(double));
+  lower= x+n;
+  upper= lower+n;
+  g= upper+n;
+  xLast= g+n;
+  p= xLast+n;
+  pBest= p+n;
+  work= pBest+n;
+  wa= work+n;
+  if (!(nbd=(int*)malloc(4*n*sizeof(int))))
+    Abort("lbfgsGo: cannot allocate %d bytes!\n",4*n*sizeof(int));
+  iwa= nbd+n;
+
+  for (i=0; i<n; i++) {
+    x[i]= xLast[i]= par[i]/pd->scale;
+    pBest[i]= par[i];
+    lower[i]= upper[i]= 0.0;
+    nbd[i]= 0; /* unbounded */
+  }
+  f->reset(f,par,nPar);
+
+  memset(task,' ',sizeof(task)-1);
+  task[sizeof(task)-1]= '\0';
+  strncpy(task,"START",5);
+  while (1) {
+    setulb(&n, &m, x, lower, upper, nbd, &fval, g, &factr, &pgtol, wa, iwa,
+	   task, &iprint, csave, lsave, isave, dsave, 60, 60);
+    if (!strncmp(task,"FG",2)) {
+      /* L-BFGS-B wants the value and gradient at x */
+      for (i=0; i<n; i++) p[i]= x[i]*pd->scale;
+      fval= lbfgsValueGrad(self, f, p, nPar, g, work, &nEvals);
+      nGrads++;
+      for (i=0; i<n; i++) g[i] *= pd->scale;
+      if (!haveBest || fval<fBest) {
+	haveBest= 1;
+	fBest= fval;
+	for (i=0; i<n; i++) pBest[i]= p[i];
+      }
+      if (nGrads>=LBFGS_MAX_EVALS) {
+	Warning(1,"lbfgsGo: no convergence after %d evaluations!\n",
+		nGrads);
+	retval= 0;
+	break;
+      }
+    }
+    else if (!strncmp(task,"NEW_X",5)) {
+      /* One iteration is complete; see if it moved far enough */
+      double step= 0.0;
+      nIter++;
+      for (i=0; i<n; i++) {
+	double dx= fabs(x[i]-xLast[i])*pd->scale;
+	if (dx>step) step= dx;
+	xLast[i]= x[i];
+      }
+      if (self->debugLevel)
+	Message("L-BFGS iteration %d: value %lg after %d evaluations, "
+		"largest step %lg\n", nIter, fval, nEvals, step);
+      if (step<=pd->tol) break;
+      if (nIter>=LBFGS_MAX_ITER) {
+	Warning(1,"lbfgsGo: no convergence after %d iterations!\n",nIter);
+	retval= 0;
+	break;
+      }
+    }
+    else if (!strncmp(task,"CONV",4)) {
+      break;
+    }
+    else if (!strncmp(task,"ABNORMAL",8)) {
+      /* The line search failed; typically this means the function is
+       * too rough near the minimum to make further progress.
+       */
+      if (self->debugLevel)
+	Message("L-BFGS stopped after %d evaluations: %.60s\n",nEvals,task);
+      break;
+    }
+    else {
+      Warning(1,"lbfgsGo: L-BFGS-B failed: %.60s\n",task);
+      retval= 0;
+      break;
+    }
+  }
+
+  for (i=0; i<n; i++) par[i]= pBest[i];
+  *best= fBest;
+  free(nbd);
+  free(x);
+  return retval;
+}
+
+Optimizer* createLBFGSOptimizer(double tol, double scale)
+{
+  Optimizer* result= createBaseOptimizer();
+  LBFGSData* pd= NULL;
+
+  if (result->data) free(result->data);
+  if (!(pd=(LBFGSData*)malloc(sizeof(LBFGSData))))
+    Abort("createLBFGSOptimizer: unable to allocate %d bytes!\n",
+	  sizeof(LBFGSData));
+  result->data= pd;
+  pd->tol= tol;
+  pd->scale= scale;
+
+  result->getMethodName= lbfgsGetMethodName;
+  result->getStringRep= lbfgsGetStringRep;
+  result->setTol= lbfgsSetTol;
+  result->getTol= lbfgsGetTol;
+  result->setScale= lbfgsSetScale;
+  result->getScale= lbfgsGetScale;
+  result->go= lbfgsGo;
+
+  return result;
+}
+
 Optimizer* optimizerFromStringRep( const char* rep )
 {
   char* args= strchr(rep,'(');
@@ -667,6 +955,13 @@ Optimizer* optimizerFromStringRep( const char* rep )
 					    maxRestarts);
     else return NULL;
   }
+  else if (!strncmp(rep,"LBFGSOptimizer",strlen("LBFGSOptimizer"))) {
+    double tol;
+    double scale;
+    int n= sscanf(args,"(%lg,%lg)",&tol,&scale);
+    if (n==2) return createLBFGSOptimizer(tol,scale);
+    else return NULL;
+  }
   else return NULL;
 }
 
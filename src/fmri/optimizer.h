@@ -37,6 +37,12 @@ typedef struct ScalarFunction {
   void (*reset)( struct ScalarFunction* self, const double* par, 
 		 const int nPar );
   void (*destroySelf)( struct ScalarFunction* self );
+  /* Returns the value and fills grad[nPar] with the gradient.  This is
+   * NULL if the function has no analytic gradient, in which case
+   * gradient-based optimizers fall back to finite differences.
+   */
+  double (*valueGrad)( struct ScalarFunction* self,
+		       const double* par, const int nPar, double* grad );
   int nPar;
   void* data;
 } ScalarFunction;
@@ -62,6 +68,11 @@ ScalarFunction* buildSimpleScalarFunction(
 	     double (*value)(const double*, const int, void*),
 	     void (*reset)(const double*, const int, void*),
 	     const int nDim, void* userHook);
+ScalarFunction* buildGradientScalarFunction( 
+	     double (*value)(const double*, const int, void*),
+	     double (*valueGrad)(const double*, const int, double*, void*),
+	     void (*reset)(const double*, const int, void*),
+	     const int nDim, void* userHook);
 
 Optimizer* optimizerFromStringRep( const char* rep );
 Optimizer* createBaseOptimizer(void);
@@ -71,5 +82,6 @@ Optimizer* createNelminOptimizer(double stopping_val, double scale,
 				 int maxRestarts);
 Optimizer* createNelminTOptimizer(double stopping_val, double scale, double T,
 				  int maxRestarts);
+Optimizer* createLBFGSOptimizer(double tol, double scale);
 
 #endif  /* ifndef INCL_OPTIMIZER_H */
@@ -80,9 +80,10 @@ int main( int argc, char* argv[] )
   double best;
   int code;
 
-  if (!(sf=(ScalarFunction*)malloc(sizeof(ScalarFunction*))))
+  if (!(sf=(ScalarFunction*)malloc(sizeof(ScalarFunction))))
     Abort("%s: unable to allocate %d bytes!\n",argv[0]);
   sf->value= value;
+  sf->valueGrad= NULL;
   sf->reset= reset;
   sf->destroySelf= destroy;
   sf->data= &data;
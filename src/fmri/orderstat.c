@@ -0,0 +1,311 @@
+/************************************************************
+ *                                                          *
+ *  orderstat.c                                             *
+ *                                                          *
+ *  Permission is hereby granted to any individual or       *
+ *  institution for use, copying, or redistribution of      *
+ *  this code and associated documentation, provided        *
+ *  that such code and documentation are not sold for       *
+ *  profit and the following copyright notice is retained   *
+ *  in the code and documentation:                          *
+ *     Copyright (c) 1998 Department of Statistics,         *
+ *                        Carnegie Mellon University        *
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ ************************************************************/
+/* This package implements order statistics: selection of the k'th
+ * smallest of a set of values, and the running median of a sliding
+ * window.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "mri.h"
+#include "fmri.h" /* Includes orderstat.h */
+#include "misc.h"
+
+/* Notes-
+ * -Selection is introselect: quickselect with a median-of-three
+ *  pivot and a three-way partition, so runs of equal values (common
+ *  in byte and short data) cost nothing extra.  If the recursion gets
+ *  deeper than twice log2(n) the remaining range is heapsorted
+ *  instead, which bounds the worst case at n log n.
+ * -The running median keeps two heaps.  The max-heap 'low' holds the
+ *  count/2+1 smallest values and the min-heap 'high' the rest, so the
+ *  median is the top of low.  Each id maps to slot id%capacity, which
+ *  records the value and where it sits in which heap, so removal by
+ *  id needs no search.
+ */
+
+#define DEF_SELECT( type, name ) \
+static void heapsort_ ## name ( type* v, long n ) \
+{ \
+  long i; \
+  long end; \
+  for (i=n/2-1; i>=0; i--) { \
+    long root= i; \
+    for (;;) { \
+      long child= 2*root+1; \
+      type tmp; \
+      if (child>=n) break; \
+      if (child+1<n && v[child]<v[child+1]) child++; \
+      if (!(v[root]<v[child])) break; \
+      tmp= v[root]; v[root]= v[child]; v[child]= tmp; \
+      root= child; \
+    } \
+  } \
+  for (end=n-1; end>0; end--) { \
+    long root= 0; \
+    type tmp= v[0]; v[0]= v[end]; v[end]= tmp; \
+    for (;;) { \
+      long child= 2*root+1; \
+      if (child>=end) break; \
+      if (child+1<end && v[child]<v[child+1]) child++; \
+      if (!(v[root]<v[child])) break; \
+      tmp= v[root]; v[root]= v[child]; v[child]= tmp; \
+      root= child; \
+    } \
+  } \
+} \
+type os_select_ ## name ( type* v, long n, long k ) \
+{ \
+  long lo= 0; \
+  long hi= n-1; \
+  int depth= 0; \
+  int maxDepth= 0; \
+  long tmpN; \
+  if (k<0 || k>=n) \
+    Abort("os_select_%s: rank %ld out of range 0 to %ld!\n", \
+	  #name, k, n-1); \
+  for (tmpN=n; tmpN>1; tmpN >>= 1) maxDepth += 2; \
+  while (hi>lo) { \
+    long mid= lo + (hi-lo)/2; \
+    long lt= lo; \
+    long gt= hi; \
+    long i= lo; \
+    type pivot; \
+    type tmp; \
+    if (depth++ > maxDepth) { \
+      heapsort_ ## name (v+lo, hi+1-lo); \
+      break; \
+    } \
+    /* median of three */ \
+    if (v[mid]<v[lo]) { tmp= v[mid]; v[mid]= v[lo]; v[lo]= tmp; } \
+    if (v[hi]<v[lo]) { tmp= v[hi]; v[hi]= v[lo]; v[lo]= tmp; } \
+    if (v[hi]<v[mid]) { tmp= v[hi]; v[hi]= v[mid]; v[mid]= tmp; } \
+    pivot= v[mid]; \
+    /* three-way partition: <pivot, ==pivot, >pivot */ \
+    while (i<=gt) { \
+      if (v[i]<pivot) { \
+	tmp= v[i]; v[i]= v[lt]; v[lt]= tmp; lt++; i++; \
+      } \
+      else if (pivot<v[i]) { \
+	tmp= v[i]; v[i]= v[gt]; v[gt]= tmp; gt--; \
+      } \
+      else i++; \
+    } \
+    if (k<lt) hi= lt-1; \
+    else if (k>gt) lo= gt+1; \
+    else break; \
+  } \
+  return v[k]; \
+}
+
+DEF_SELECT( unsigned char, uchar )
+DEF_SELECT( short, short )
+DEF_SELECT( int, int )
+DEF_SELECT( long long, longlong )
+DEF_SELECT( float, float )
+DEF_SELECT( double, double )
+
+#undef DEF_SELECT
+
+/*
+ * Running median
+ */
+
+#define HEAP_LOW 1
+#define HEAP_HIGH 2
+
+typedef struct rm_slot_struct {
+  int id;
+  int heap; /* 0 if the slot is empty */
+  int pos;
+  double val;
+} RMSlot;
+
+struct running_median_struct {
+  int capacity;
+  RMSlot* slots;
+  int* low;   /* max-heap of slot indices */
+  int nLow;
+  int* high;  /* min-heap of slot indices */
+  int nHigh;
+};
+
+/* In the low heap a parent is >= its children; in the high heap <= */
+static int rm_above( const RunningMedian* rm, int heap, int a, int b )
+{
+  if (heap==HEAP_LOW) return (rm->slots[a].val > rm->slots[b].val);
+  else return (rm->slots[a].val < rm->slots[b].val);
+}
+
+static void rm_place( RunningMedian* rm, int heap, int pos, int slot )
+{
+  int* h= (heap==HEAP_LOW) ? rm->low : rm->high;
+  h[pos]= slot;
+  rm->slots[slot].heap= heap;
+  rm->slots[slot].pos= pos;
+}
+
+static void rm_sift_up( RunningMedian* rm, int heap, int pos )
+{
+  int* h= (heap==HEAP_LOW) ? rm->low : rm->high;
+  int slot= h[pos];
+  while (pos>0) {
+    int parent= (pos-1)/2;
+    if (!rm_above(rm, heap, slot, h[parent])) break;
+    rm_place(rm, heap, pos, h[parent]);
+    pos= parent;
+  }
+  rm_place(rm, heap, pos, slot);
+}
+
+static void rm_sift_down( RunningMedian* rm, int heap, int pos )
+{
+  int* h= (heap==HEAP_LOW) ? rm->low : rm->high;
+  int n= (heap==HEAP_LOW) ? rm->nLow : rm->nHigh;
+  int slot= h[pos];
+  for (;;) {
+    int child= 2*pos+1;
+    if (child>=n) break;
+    if (child+1<n && rm_above(rm, heap, h[child+1], h[child])) child++;
+    if (!rm_above(rm, heap, h[child], slot)) break;
+    rm_place(rm, heap, pos, h[child]);
+    pos= child;
+  }
+  rm_place(rm, heap, pos, slot);
+}
+
+static void rm_push( RunningMedian* rm, int heap, int slot )
+{
+  if (heap==HEAP_LOW) rm_place(rm, heap, rm->nLow++, slot);
+  else rm_place(rm, heap, rm->nHigh++, slot);
+  rm_sift_up(rm, heap, rm->slots[slot].pos);
+}
+
+static int rm_pop( RunningMedian* rm, int heap )
+{
+  int* h= (heap==HEAP_LOW) ? rm->low : rm->high;
+  int* n= (heap==HEAP_LOW) ? &(rm->nLow) : &(rm->nHigh);
+  int top= h[0];
+  (*n)--;
+  if (*n>0) {
+    rm_place(rm, heap, 0, h[*n]);
+    rm_sift_down(rm, heap, 0);
+  }
+  rm->slots[top].heap= 0;
+  return top;
+}
+
+static void rm_balance( RunningMedian* rm )
+{
+  int count= rm->nLow + rm->nHigh;
+  int want= (count>0) ? count/2+1 : 0;
+  while (rm->nLow > want) rm_push(rm, HEAP_HIGH, rm_pop(rm, HEAP_LOW));
+  while (rm->nLow < want) rm_push(rm, HEAP_LOW, rm_pop(rm, HEAP_HIGH));
+}
+
+RunningMedian* os_create_running_median( int capacity )
+{
+  RunningMedian* rm;
+
+  if (capacity<1) capacity= 1;
+  if (!(rm= (RunningMedian*)malloc(sizeof(RunningMedian))))
+    Abort("os_create_running_median: unable to allocate %d bytes!\n",
+	  sizeof(RunningMedian));
+  if (!(rm->slots= (RMSlot*)malloc(capacity*sizeof(RMSlot))))
+    Abort("os_create_running_median: unable to allocate %d bytes!\n",
+	  capacity*sizeof(RMSlot));
+  if (!(rm->low= (int*)malloc(2*capacity*sizeof(int))))
+    Abort("os_create_running_median: unable to allocate %d bytes!\n",
+	  2*capacity*sizeof(int));
+  rm->high= rm->low + capacity;
+  rm->capacity= capacity;
+  os_rm_clear(rm);
+  return rm;
+}
+
+void os_destroy_running_median( RunningMedian* rm )
+{
+  free(rm->low);
+  free(rm->slots);
+  free(rm);
+}
+
+void os_rm_clear( RunningMedian* rm )
+{
+  int i;
+  for (i=0; i<rm->capacity; i++) rm->slots[i].heap= 0;
+  rm->nLow= rm->nHigh= 0;
+}
+
+void os_rm_insert( RunningMedian* rm, int id, double val )
+{
+  int slot= id % rm->capacity;
+
+  if (rm->slots[slot].heap)
+    Abort("os_rm_insert: id %d collides with id %d; capacity %d is "
+	  "too small!\n", id, rm->slots[slot].id, rm->capacity);
+  rm->slots[slot].id= id;
+  rm->slots[slot].val= val;
+  if (rm->nLow==0 || val <= rm->slots[rm->low[0]].val)
+    rm_push(rm, HEAP_LOW, slot);
+  else rm_push(rm, HEAP_HIGH, slot);
+  rm_balance(rm);
+}
+
+void os_rm_remove( RunningMedian* rm, int id )
+{
+  /* Removing an id which is not present does nothing */
+  int slot= id % rm->capacity;
+  int heap= rm->slots[slot].heap;
+  int pos= rm->slots[slot].pos;
+  int* h;
+  int* n;
+
+  if (!heap || rm->slots[slot].id != id) return;
+  h= (heap==HEAP_LOW) ? rm->low : rm->high;
+  n= (heap==HEAP_LOW) ? &(rm->nLow) : &(rm->nHigh);
+  (*n)--;
+  if (pos < *n) {
+    int moved= h[*n];
+    rm_place(rm, heap, pos, moved);
+    rm_sift_up(rm, heap, pos);
+    rm_sift_down(rm, heap, rm->slots[moved].pos);
+  }
+  rm->slots[slot].heap= 0;
+  rm_balance(rm);
+}
+
+int os_rm_count( const RunningMedian* rm )
+{
+  return rm->nLow + rm->nHigh;
+}
+
+double os_rm_median( const RunningMedian* rm )
+{
+  if (rm->nLow==0) Abort("os_rm_median: no values are present!\n");
+  return rm->slots[rm->low[0]].val;
+}
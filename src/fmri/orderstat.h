@@ -0,0 +1,65 @@
+/************************************************************
+ *                                                          *
+ *  orderstat.h                                             *
+ *                                                          *
+ *  Permission is hereby granted to any individual or       *
+ *  institution for use, copying, or redistribution of      *
+ *  this code and associated documentation, provided        *
+ *  that such code and documentation are not sold for       *
+ *  profit and the following copyright notice is retained   *
+ *  in the code and documentation:                          *
+ *     Copyright (c) 1998 Department of Statistics,         *
+ *                        Carnegie Mellon University        *
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ ************************************************************/
+/* Header file for orderstat.c */
+
+#ifndef INCL_ORDERSTAT_H
+#define INCL_ORDERSTAT_H 1
+
+/* os_select_<type>() returns the k'th smallest (counting from 0) of
+ * the n values in v, which is what v[k] would be after sorting.  v
+ * is rearranged so that v[k] holds that value, with no larger value
+ * before it and no smaller value after it.  This takes time linear
+ * in n, rather than the n log n of a sort.
+ */
+unsigned char os_select_uchar( unsigned char* v, long n, long k );
+short os_select_short( short* v, long n, long k );
+int os_select_int( int* v, long n, long k );
+long long os_select_longlong( long long* v, long n, long k );
+float os_select_float( float* v, long n, long k );
+double os_select_double( double* v, long n, long k );
+
+/* A RunningMedian holds a changing set of values, each tagged by an
+ * integer id, and can report their median at any time.  Insertion
+ * and removal take time proportional to the log of the set size.
+ * The ids present at any one time must span fewer than the capacity
+ * given at creation; a sliding window over sample indices meets this
+ * if its width is less than the capacity.  The median reported is
+ * the value of rank count/2 counting from 0, so for an even count it
+ * is the upper of the two middle values.  Missing data is handled
+ * by simply not inserting it.
+ */
+typedef struct running_median_struct RunningMedian;
+
+RunningMedian* os_create_running_median( int capacity );
+void os_destroy_running_median( RunningMedian* rm );
+void os_rm_clear( RunningMedian* rm );
+void os_rm_insert( RunningMedian* rm, int id, double val );
+void os_rm_remove( RunningMedian* rm, int id );
+int os_rm_count( const RunningMedian* rm );
+double os_rm_median( const RunningMedian* rm );
+
+#endif
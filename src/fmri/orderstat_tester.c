@@ -0,0 +1,348 @@
+/************************************************************
+ *                                                          *
+ *  orderstat_tester.c                                      *
+ *                                                          *
+ *  Permission is hereby granted to any individual or       *
+ *  institution for use, copying, or redistribution of      *
+ *  this code and associated documentation, provided        *
+ *  that such code and documentation are not sold for       *
+ *  profit and the following copyright notice is retained   *
+ *  in the code and documentation:                          *
+ *     Copyright (c) 1998 Department of Statistics,         *
+ *                        Carnegie Mellon University        *
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ ************************************************************/
+
+/* This program checks the order statistics routines against sorting.
+ * os_select_<type> is run on random arrays of each type, with and
+ * without many repeated values.  The running median follows a
+ * sliding window over a series with missing samples, and the median
+ * smoother is run with and without a threshold, including missing
+ * runs long enough that some windows have no valid samples; those
+ * outputs must equal the inputs.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "mri.h"
+#include "fmri.h"
+#include "stdcrg.h"
+
+static long lengths[]= { 1, 2, 3, 7, 64, 1001 };
+#define N_LENGTHS (sizeof(lengths)/sizeof(long))
+
+static double bandwidths[]= { 1.0, 4.0, 7.0, 20.0 };
+#define N_BANDWIDTHS (sizeof(bandwidths)/sizeof(double))
+
+static int compare_doubles( const void* p1, const void* p2 )
+{
+  double d1= *(const double*)p1;
+  double d2= *(const double*)p2;
+  if (d1<d2) return -1;
+  else if (d1>d2) return 1;
+  else return 0;
+}
+
+static int compare_floats( const void* p1, const void* p2 )
+{
+  float f1= *(const float*)p1;
+  float f2= *(const float*)p2;
+  if (f1<f2) return -1;
+  else if (f1>f2) return 1;
+  else return 0;
+}
+
+/* Checks os_select_<name> for every k of one array.  The values are
+ * generated as doubles and converted, and the reference is the
+ * sorted array.  Returns the number of failures.
+ */
+#define DEF_CHECK_SELECT( type, name ) \
+static int check_select_ ## name ( const double* vals, long n ) \
+{ \
+  type* v= (type*)malloc(n*sizeof(type)); \
+  double* sorted= (double*)malloc(n*sizeof(double)); \
+  int failures= 0; \
+  long i; \
+  long k; \
+  if (!v || !sorted) { \
+    fprintf(stderr,"Unable to allocate %ld values!\n",n); \
+    exit(-1); \
+  } \
+  for (i=0; i<n; i++) sorted[i]= (double)((type)vals[i]); \
+  qsort(sorted, n, sizeof(double), compare_doubles); \
+  for (k=0; k<n; k++) { \
+    type result; \
+    for (i=0; i<n; i++) v[i]= (type)vals[i]; \
+    result= os_select_ ## name (v, n, k); \
+    if ((double)result != sorted[k] || v[k] != result) failures++; \
+    for (i=0; i<k; i++) if (v[i]>result) failures++; \
+    for (i=k+1; i<n; i++) if (v[i]<result) failures++; \
+  } \
+  free(v); \
+  free(sorted); \
+  return failures; \
+}
+
+DEF_CHECK_SELECT( unsigned char, uchar )
+DEF_CHECK_SELECT( short, short )
+DEF_CHECK_SELECT( int, int )
+DEF_CHECK_SELECT( long long, longlong )
+DEF_CHECK_SELECT( float, float )
+DEF_CHECK_SELECT( double, double )
+
+static int test_select( void )
+{
+  double* vals;
+  int failures= 0;
+  int l;
+  int spread;
+  long i;
+
+  for (l=0; l<N_LENGTHS; l++) {
+    long n= lengths[l];
+    if (!(vals= (double*)malloc(n*sizeof(double)))) {
+      fprintf(stderr,"Unable to allocate %ld doubles!\n",n);
+      exit(-1);
+    }
+    /* A narrow spread gives long runs of equal values */
+    for (spread=0; spread<2; spread++) {
+      int bad= 0;
+      for (i=0; i<n; i++)
+	vals[i]= (spread ? floor(250.0*drand48()) : floor(5.0*drand48()));
+      bad += check_select_uchar(vals, n);
+      bad += check_select_short(vals, n);
+      bad += check_select_int(vals, n);
+      bad += check_select_longlong(vals, n);
+      for (i=0; i<n; i++) vals[i] += drand48();
+      bad += check_select_float(vals, n);
+      bad += check_select_double(vals, n);
+      printf("select n %5ld %s: %s\n", n, (spread ? "wide  " : "narrow"),
+	     (bad ? "FAILED" : "ok"));
+      if (bad) failures++;
+    }
+    free(vals);
+  }
+  return failures;
+}
+
+/* The median of the valid samples of data between low and high, as
+ * the smoother and running median define it, or 'fallback' if there
+ * are none.
+ */
+static float ref_median( const float* data, const unsigned char* missing,
+			 int low, int high, float* buf, float fallback )
+{
+  int nValid= 0;
+  int i;
+
+  for (i=low; i<=high; i++)
+    if (!missing || !missing[i]) buf[nValid++]= data[i];
+  if (!nValid) return fallback;
+  qsort(buf, nValid, sizeof(float), compare_floats);
+  return buf[nValid/2];
+}
+
+static int test_running_median( void )
+{
+  int n= 2000;
+  int widths[]= { 1, 2, 5, 16, 101 };
+  int nWidths= sizeof(widths)/sizeof(int);
+  float* data= (float*)malloc(n*sizeof(float));
+  float* buf= (float*)malloc(n*sizeof(float));
+  unsigned char* missing= (unsigned char*)malloc(n);
+  int failures= 0;
+  int w;
+  int i;
+
+  if (!data || !buf || !missing) {
+    fprintf(stderr,"Unable to allocate test buffers!\n");
+    exit(-1);
+  }
+  for (i=0; i<n; i++) {
+    data[i]= (float)floor(40.0*drand48());
+    missing[i]= (drand48()<0.2 || (i>=500 && i<700));
+  }
+
+  for (w=0; w<nWidths; w++) {
+    int width= widths[w];
+    RunningMedian* rm= os_create_running_median(width+1);
+    int bad= 0;
+
+    /* The window is [i-width+1, i]; ids enter at the front and leave
+     * at the back, and missing samples are never inserted.
+     */
+    for (i=0; i<n; i++) {
+      int low= (i-width+1<0) ? 0 : i-width+1;
+      int count= 0;
+      int j;
+      if (!missing[i]) os_rm_insert(rm, i, data[i]);
+      if (i-width>=0 && !missing[i-width]) os_rm_remove(rm, i-width);
+      for (j=low; j<=i; j++) if (!missing[j]) count++;
+      if (os_rm_count(rm) != count) bad++;
+      else if (count && os_rm_median(rm) 
+	       != ref_median(data, missing, low, i, buf, 0.0)) bad++;
+      /* Starting over part way along must give the same answers */
+      if (i==n/2) {
+	os_rm_clear(rm);
+	for (j=low; j<=i; j++) 
+	  if (!missing[j]) os_rm_insert(rm, j, data[j]);
+      }
+    }
+    os_destroy_running_median(rm);
+    printf("running median width %3d: %s\n", width, (bad ? "FAILED" : "ok"));
+    if (bad) failures++;
+  }
+  free(data);
+  free(buf);
+  free(missing);
+  return failures;
+}
+
+/* Reproduces the smoother's window for sample 'here', including the
+ * trimming done when a threshold is set.
+ */
+static void ref_window( const float* data, int n, int here, int half_band,
+			double thresh, int* low_out, int* high_out )
+{
+  int low= here-half_band;
+  int high= here+(half_band-1);
+  int i;
+
+  if (low<0) low= 0;
+  if (high>=n) high= n-1;
+  if (thresh>0.0) {
+    for (i=here-1; i>=low; i--)
+      if (fabs(data[i]-data[here]) > thresh) {
+	low= i+1;
+	break;
+      }
+    for (i=here+1; i<=high; i++)
+      if (fabs(data[i]-data[here]) > thresh) {
+	high= i-1;
+	break;
+      }
+  }
+  *low_out= low;
+  *high_out= high;
+}
+
+static int test_median_smoother( void )
+{
+  int n= 300;
+  int ndata= 8;
+  float** data= Matrix(ndata, n, float);
+  float** out= Matrix(ndata, n, float);
+  unsigned char** missing= Matrix(n, 1, unsigned char);
+  unsigned char* miss1= (unsigned char*)malloc(n);
+  float* buf= (float*)malloc(n*sizeof(float));
+  int failures= 0;
+  int useMissing;
+  int useThresh;
+  int b;
+  int i;
+  int j;
+
+  if (!miss1 || !buf) {
+    fprintf(stderr,"Unable to allocate test buffers!\n");
+    exit(-1);
+  }
+  for (j=0; j<ndata; j++)
+    for (i=0; i<n; i++) data[j][i]= (float)(sin(0.05*i*(j+1)) + drand48());
+  /* Scattered missing samples, plus a run longer than any window */
+  for (i=0; i<n; i++) {
+    miss1[i]= (drand48()<0.15 || (i>=100 && i<130));
+    missing[i][0]= miss1[i];
+  }
+
+  for (useMissing=0; useMissing<2; useMissing++)
+    for (useThresh=0; useThresh<2; useThresh++)
+      for (b=0; b<N_BANDWIDTHS; b++) {
+	double thresh= (useThresh ? 0.6 : 0.0);
+	int half_band= (int)(rint(0.5*bandwidths[b]));
+	unsigned char* m= (useMissing ? miss1 : NULL);
+	Smoother* sm;
+	int bad= 0;
+	int passed= 0;
+
+	sm_set_params(SM_MEDIAN, bandwidths[b], 0.0, thresh, NULL);
+	sm= sm_create_smoother();
+	sm_set_direction(sm, 't');
+	for (j=0; j<ndata; j++) {
+	  SM_SMOOTH(sm, data[j], out[j], n, 
+		    (useMissing ? missing : NULL), 0);
+	  for (i=0; i<n; i++) {
+	    int low;
+	    int high;
+	    float expected;
+	    ref_window(data[j], n, i, half_band, thresh, &low, &high);
+	    expected= ref_median(data[j], m, low, high, buf, data[j][i]);
+	    if (out[j][i] != expected) bad++;
+	    if (m) {
+	      int k;
+	      for (k=low; k<=high && m[k]; k++);
+	      if (k>high) passed++; /* no valid samples in this window */
+	    }
+	  }
+	}
+	/* The grouped form shares one window, so check it unthresholded */
+	if (!useThresh) {
+	  for (j=0; j<ndata; j++) for (i=0; i<n; i++) out[j][i]= -1.0;
+	  SM_SMOOTH_GROUP(sm, data, out, ndata, n, 
+			  (useMissing ? missing : NULL), 0);
+	  for (j=0; j<ndata; j++)
+	    for (i=0; i<n; i++) {
+	      int low;
+	      int high;
+	      ref_window(data[j], n, i, half_band, 0.0, &low, &high);
+	      if (out[j][i] != ref_median(data[j], m, low, high, buf, 
+					  data[j][i])) bad++;
+	    }
+	}
+	sm_destroy(sm);
+	printf("median smoother band %4.1f %s %s: %s", bandwidths[b],
+	       (useMissing ? "missing" : "full   "),
+	       (useThresh ? "thresh" : "plain "), (bad ? "FAILED" : "ok"));
+	if (passed) printf(" (%d empty windows passed through)", passed);
+	printf("\n");
+	if (bad) failures++;
+      }
+
+  FreeMatrix(data);
+  FreeMatrix(out);
+  FreeMatrix(missing);
+  free(miss1);
+  free(buf);
+  return failures;
+}
+
+int main( int argc, char* argv[] )
+{
+  int failures= 0;
+
+  sm_init();
+  srand48(1234);
+  failures += test_select();
+  failures += test_running_median();
+  failures += test_median_smoother();
+
+  if (failures) {
+    printf("%d cases FAILED\n",failures);
+    exit(1);
+  }
+  printf("order statistics agree with sorting\n");
+  return 0;
+}
@@ -0,0 +1,363 @@
+/************************************************************
+ *                                                          *
+ *  register_bench.c                                        *
+ *                                                          *
+ *  Permission is hereby granted to any individual or       *
+ *  institution for use, copying, or redistribution of      *
+ *  this code and associated documentation, provided        *
+ *  that such code and documentation are not sold for       *
+ *  profit and the following copyright notice is retained   *
+ *  in the code and documentation:                          *
+ *     Copyright (c) 1998 Department of Statistics,         *
+ *                        Carnegie Mellon University        *
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ ************************************************************/
+
+/* This program compares optimizers on the registration problems
+ * solved by estireg3d and estiwarp.  A smooth synthetic volume is
+ * moved by a known rigid (linear_shift_rot3d) or affine (linwarp_warp)
+ * motion, and the motion is recovered by minimizing the mean squared
+ * difference, starting from the identity.  Praxis is compared with
+ * L-BFGS using the analytic gradient and L-BFGS using differences.
+ * The time, the number of function evaluations, the final mean
+ * squared difference and the largest parameter error are reported.
+ * A case fails if the optimizer reports that it did not converge,
+ * even if the motion it found is close enough.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include "mri.h"
+#include "fmri.h"
+#include "stdcrg.h"
+#include "misc.h"
+
+/* Largest acceptable parameter error, and mean squared difference
+ * relative to the variance of the volume, for any method.
+ */
+#define PAR_TOLERANCE 1.0e-3
+#define MSE_TOLERANCE 1.0e-5
+
+#define MAX_PAR 12
+
+#define MEM(matrix,nx,ny,nz,x,y,z) matrix[((((x)*ny)+(y))*nz)+(z)]
+
+typedef struct bench_problem_struct {
+  int affine;          /* else rigid */
+  long n;              /* voxels along each edge */
+  double length;       /* edge length */
+  FComplex* orig;
+  FComplex* moved;
+  float* target;
+  float* dvalue;
+  char* check;
+  long nEvals;
+} BenchProblem;
+
+static double now()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6*tv.tv_usec;
+}
+
+/* Rigid parameters are the vector part of the quaternion and the
+ * shifts as fractions of the edge, as in estireg3d.  Affine parameters
+ * are the top three rows of the transform, as in estiwarp.
+ */
+static int nPar( const BenchProblem* p )
+{
+  return (p->affine ? 12 : 6);
+}
+
+static void rigidFromPar( const BenchProblem* p, const double* par,
+			  Quat* q, double* shift )
+{
+  int i;
+
+  q->x= par[0];
+  q->y= par[1];
+  q->z= par[2];
+  q->w= sqrt(1.0 - (q->x*q->x + q->y*q->y + q->z*q->z));
+  for (i=0; i<3; i++) shift[i]= p->n*par[3+i];
+}
+
+static void affineFromPar( const double* par, Transform t )
+{
+  int i;
+
+  trans_identity(t);
+  for (i=0; i<12; i++) t[i]= par[i];
+}
+
+static void moveImage( BenchProblem* p, const double* par, FComplex* in,
+		       FComplex* out )
+{
+  long n= p->n;
+
+  if (p->affine) {
+    Transform t;
+    affineFromPar(par, t);
+    linwarp_warp(t, in, out, p->check, n, n, n,
+		 p->length, p->length, p->length, 0);
+  }
+  else {
+    Quat q;
+    double shift[3];
+    rigidFromPar(p, par, &q, shift);
+    linear_shift_rot3d(&q, shift[0], shift[1], shift[2], in, out, p->check,
+		       n, n, n, p->length, p->length, p->length, 0);
+  }
+}
+
+/* Mean squared difference over the interior, as algCalcChiSqr() does
+ * with constant weights.  If dvalue is not NULL it gets the derivative
+ * with respect to each moved voxel.
+ */
+static double calcMSE( BenchProblem* p, float* dvalue )
+{
+  long n= p->n;
+  long x, y, z;
+  long count= 0;
+  double sse= 0.0;
+
+  if (dvalue) for (x=0; x<n*n*n; x++) dvalue[x]= 0.0;
+  for (x=2; x<n-2; x++)
+    for (y=2; y<n-2; y++)
+      for (z=2; z<n-2; z++)
+	if (MEM(p->check,n,n,n,x,y,z)) {
+	  double diff= MEM(p->moved,n,n,n,x,y,z).real
+	    - MEM(p->target,n,n,n,x,y,z);
+	  sse += diff*diff;
+	  if (dvalue) MEM(dvalue,n,n,n,x,y,z)= diff;
+	  count++;
+	}
+  if (count==0) return 0.0;
+  if (dvalue) for (x=0; x<n*n*n; x++) dvalue[x] *= 2.0/count;
+  return sse/count;
+}
+
+static double value( const double* par, const int npar, void* hook )
+{
+  BenchProblem* p= (BenchProblem*)hook;
+
+  p->nEvals++;
+  moveImage(p, par, p->orig, p->moved);
+  return calcMSE(p, NULL);
+}
+
+static double valueGrad( const double* par, const int npar, double* grad,
+			 void* hook )
+{
+  BenchProblem* p= (BenchProblem*)hook;
+  long n= p->n;
+  double val;
+  int i;
+
+  p->nEvals++;
+  moveImage(p, par, p->orig, p->moved);
+  val= calcMSE(p, p->dvalue);
+  if (p->affine) {
+    Transform t;
+    Transform tGrad;
+    affineFromPar(par, t);
+    linwarp_warp_grad(t, p->orig, p->dvalue, n, n, n,
+		      p->length, p->length, p->length, tGrad);
+    for (i=0; i<12; i++) grad[i]= tGrad[i];
+  }
+  else {
+    Quat q;
+    double shift[3];
+    double g[7];
+    rigidFromPar(p, par, &q, shift);
+    linear_shift_rot3d_grad(&q, shift[0], shift[1], shift[2], p->orig,
+			    p->dvalue, n, n, n,
+			    p->length, p->length, p->length, g);
+    /* q.w is determined by the other components */
+    for (i=0; i<3; i++) grad[i]= g[i] - g[3]*par[i]/q.w;
+    for (i=0; i<3; i++) grad[3+i]= n*g[4+i];
+  }
+  return val;
+}
+
+static void reset( const double* par, const int npar, void* hook )
+{
+  /* Nothing to do */
+}
+
+/* A few Gaussian blobs, with a little noise */
+static void buildProblem( BenchProblem* p, int affine, long n,
+			  const double* truePar )
+{
+  long nVox= n*n*n;
+  long x, y, z;
+  int b;
+
+  p->affine= affine;
+  p->n= n;
+  p->length= (double)n;
+  p->nEvals= 0;
+  if (!(p->orig= (FComplex*)malloc(2*nVox*sizeof(FComplex))))
+    Abort("register_bench: unable to allocate %d bytes!\n",
+	  2*nVox*sizeof(FComplex));
+  p->moved= p->orig + nVox;
+  if (!(p->target= (float*)malloc(2*nVox*sizeof(float))))
+    Abort("register_bench: unable to allocate %d bytes!\n",
+	  2*nVox*sizeof(float));
+  p->dvalue= p->target + nVox;
+  if (!(p->check= (char*)malloc(nVox*sizeof(char))))
+    Abort("register_bench: unable to allocate %d bytes!\n",
+	  nVox*sizeof(char));
+
+  srand48(12345);
+  for (x=0; x<nVox; x++) {
+    p->orig[x].real= 0.5*(drand48()-0.5);
+    p->orig[x].imag= 0.0;
+  }
+  for (b=0; b<8; b++) {
+    double cx= n*(0.3+0.4*drand48());
+    double cy= n*(0.3+0.4*drand48());
+    double cz= n*(0.3+0.4*drand48());
+    double sigma= n*(0.06+0.08*drand48());
+    double amp= 50.0+100.0*drand48();
+    for (x=0; x<n; x++)
+      for (y=0; y<n; y++)
+	for (z=0; z<n; z++) {
+	  double r2= (x-cx)*(x-cx) + (y-cy)*(y-cy) + (z-cz)*(z-cz);
+	  MEM(p->orig,n,n,n,x,y,z).real += amp*exp(-0.5*r2/(sigma*sigma));
+	}
+  }
+
+  moveImage(p, truePar, p->orig, p->moved);
+  for (x=0; x<nVox; x++) p->target[x]= p->moved[x].real;
+}
+
+static void freeProblem( BenchProblem* p )
+{
+  free(p->orig);
+  free(p->target);
+  free(p->check);
+}
+
+static double targetVariance( BenchProblem* p )
+{
+  long nVox= p->n*p->n*p->n;
+  double sum= 0.0;
+  double sumSqr= 0.0;
+  long i;
+
+  for (i=0; i<nVox; i++) {
+    sum += p->target[i];
+    sumSqr += p->target[i]*p->target[i];
+  }
+  sum /= nVox;
+  return sumSqr/nVox - sum*sum;
+}
+
+static int runCase( BenchProblem* p, const char* label, Optimizer* opt,
+		    int useGrad, const double* truePar )
+{
+  ScalarFunction* sf;
+  double par[MAX_PAR];
+  double best= 0.0;
+  double err= 0.0;
+  double var= targetVariance(p);
+  double t0;
+  double t;
+  int i;
+  int converged;
+  int ok;
+
+  if (useGrad)
+    sf= buildGradientScalarFunction(value, valueGrad, reset, nPar(p), p);
+  else sf= buildSimpleScalarFunction(value, reset, nPar(p), p);
+
+  if (p->affine) {
+    Transform ident;
+    trans_identity(ident);
+    for (i=0; i<12; i++) par[i]= ident[i];
+  }
+  else for (i=0; i<6; i++) par[i]= 0.0;
+
+  p->nEvals= 0;
+  t0= now();
+  converged= opt->go(opt, sf, par, nPar(p), &best);
+  t= now()-t0;
+
+  for (i=0; i<nPar(p); i++) {
+    double e= fabs(par[i]-truePar[i]);
+    if (!(e<=err)) err= e;
+  }
+  ok= (converged && err<=PAR_TOLERANCE && best<=MSE_TOLERANCE*var);
+  printf("%s %-14s %8.3f s %6ld evals  mse %9.3g  par err %9.3g   %s\n",
+	 (p->affine ? "affine" : "rigid "), label, t, p->nEvals,
+	 best, err, (!converged ? "NO CONVERGENCE" : (ok ? "ok" : "POOR")));
+  sf->destroySelf(sf);
+  return ok;
+}
+
+int main( int argc, char* argv[] )
+{
+  /* Typical fMRI motions: about a degree of rotation, a voxel of shift */
+  static double rigidPar[6]= { 0.004, -0.007, 0.009, 0.03, -0.02, 0.045 };
+  static double affinePar[12]= { 1.01, 0.012, -0.008, 1.3,
+				 -0.015, 0.99, 0.006, -0.7,
+				 0.01, -0.004, 1.02, 0.9 };
+  BenchProblem prob;
+  Optimizer* praxis;
+  Optimizer* lbfgs;
+  long n= 32;
+  int affine;
+  int failures= 0;
+
+  if (argc != 1 && argc != 2) {
+    fprintf(stderr,"Usage: %s [n]\n",argv[0]);
+    exit(-1);
+  }
+  if (argc == 2) n= atol(argv[1]);
+  if (n<8) {
+    fprintf(stderr,"%s: n must be at least 8\n",argv[0]);
+    exit(-1);
+  }
+
+  /* These match the estireg3d and estiwarp defaults */
+  praxis= createPraxisOptimizer(0.000001,0.1);
+  lbfgs= createLBFGSOptimizer(0.000001,0.01);
+
+  printf("%ld by %ld by %ld volumes\n", n, n, n);
+  for (affine=0; affine<2; affine++) {
+    double* truePar= (affine ? affinePar : rigidPar);
+    buildProblem(&prob, affine, n, truePar);
+    if (!runCase(&prob, "praxis", praxis, 0, truePar)) failures++;
+    if (!runCase(&prob, "lbfgs", lbfgs, 1, truePar)) failures++;
+    if (!runCase(&prob, "lbfgs (diffs)", lbfgs, 0, truePar)) failures++;
+    freeProblem(&prob);
+  }
+
+  praxis->destroySelf(praxis);
+  lbfgs->destroySelf(lbfgs);
+
+  if (failures) {
+    printf("%d cases did not converge or did not recover the motion\n",
+	   failures);
+    exit(1);
+  }
+  printf("all optimizers recover the motion\n");
+  return 0;
+}
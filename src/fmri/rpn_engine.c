@@ -55,6 +55,19 @@
 #define finite( foo ) isfinite( foo )
 #endif
 
+#if defined(__GNUC__) && defined(__SSE2__)
+#define RPN_SSE2
+#include <emmintrin.h>
+#endif
+
+/* dcdflib keeps its working variables in statics, so engines running
+ * in different threads must take turns inside it.  The cdf_*_v array
+ * routines take the lock themselves; ops which still call the scalar
+ * routines hold it for the duration of the op.
+ */
+#define CDF_LOCK() cdf_lock()
+#define CDF_UNLOCK() cdf_unlock()
+
 #define MAX_INPUT_FILES 20
 #define MAX_STACK 300
 #define MAX_SCRIPT_CHARS 512
@@ -140,6 +153,90 @@ void rpnSetComplex(RpnEngine* re, int flag)
   re->complexFlag= flag;
 }
 
+void rpnSetFusion(RpnEngine* re, int flag)
+{
+  re->fuseFlag= flag;
+}
+
+/* The random stream is the same 48-bit linear congruential generator
+ * drand48() uses, but its state lives in the engine.  The seed and
+ * stream number are hashed together so that neighboring streams start
+ * far apart in the sequence.
+ */
+#define RAND48_MASK 0xffffffffffffULL
+
+void rpnSetRandomStream(RpnEngine* re, long seed, long long stream)
+{
+  unsigned long long z= (unsigned long long)seed*0x9E3779B97F4A7C15ULL
+    + (unsigned long long)stream;
+  z= (z ^ (z>>30))*0xBF58476D1CE4E5B9ULL;
+  z= (z ^ (z>>27))*0x94D049BB133111EBULL;
+  z= z ^ (z>>31);
+  re->randState= z & RAND48_MASK;
+  re->randStreamFlag= 1;
+}
+
+static double rand_stream_next(RpnEngine* re)
+{
+  re->randState= (0x5DEECE66DULL*re->randState + 0xBULL) & RAND48_MASK;
+  return ldexp((double)re->randState, -48);
+}
+
+static int is_cdf_op(Op op)
+{
+  switch (op) {
+  case OP_CBINOM:
+  case OP_INV_CBINOM:
+  case OP_CPOISSON:
+  case OP_INV_CPOISSON:
+  case OP_FCBINOM:
+  case OP_INV_FCBINOM:
+  case OP_FCPOISSON:
+  case OP_INV_FCPOISSON:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* Sets up the P and Q arrays for an inverse cdf op from the P values
+ * on the stack.  Where zeroSpecial or oneSpecial is set, P values of
+ * exactly 0 or 1 are given to the op directly, so a placeholder of
+ * 0.5 is passed to the cdf routine in their place.
+ */
+static void unpack_p(const double* in, long n, int zeroSpecial, 
+		     int oneSpecial, double* p, double* q)
+{
+  long i;
+  for (i=0; i<n; i++) {
+    if ((zeroSpecial && in[i]==0.0) || (oneSpecial && in[i]==1.0))
+      p[i]= q[i]= 0.5;
+    else {
+      p[i]= in[i];
+      q[i]= 1.0-in[i];
+    }
+  }
+}
+
+/* As above, for the folded P values of the fc* ops: the smaller tail,
+ * negated if it is Q.  Signed zeros are always handled by the op.
+ */
+static void unpack_folded_p(const double* in, long n, double* p, double* q)
+{
+  long i;
+  for (i=0; i<n; i++) {
+    if (in[i]==0.0) p[i]= q[i]= 0.5;
+    else if (in[i]>=0.0) {
+      p[i]= in[i];
+      q[i]= 1.0-p[i];
+    }
+    else {
+      q[i]= -in[i];
+      p[i]= 1.0-q[i];
+    }
+  }
+}
+
 static Clock* clock_init(RpnEngine* re, int whichInput)
 {
   Clock* clock= NULL;
@@ -587,6 +684,7 @@ static Program* compile( RpnEngine* re, char* string, Clock* clock )
   }
 
   result->code_length= runner-code;
+  result->fused= NULL;
   return result;
 }
 
@@ -652,16 +750,873 @@ static Program* compile_file( RpnEngine* re, const char* fname, Clock* clock )
   }
 
   result->code_length= runner-code;
+  result->fused= NULL;
   if (infile != stdin)
     if (fclose(infile)) perror("Error closing script (ignored)");
   return result;
 }
 
-#define BAILOUT(msg) { setErrorStr(re, msg); return NULL; }
-#define BAILOUT1(msg,msg1) { setErrorStr(re, msg,msg1); return NULL; }
-#define BAILOUT2(msg,msg1,msg2) { setErrorStr(re, msg,msg1,msg2); return NULL; }
+/* Fused evaluation-
+ *
+ * The interpreter in rpnRun() makes one full pass over RPN_CHUNKSIZE
+ * values per op, so every op streams a stack slot through memory.
+ * After compilation, each run of straight-line elementwise ops
+ * (arithmetic, comparisons, if_keep, unary math, loads, constants
+ * and stack shuffles) is translated into a small register program.
+ * Stack shuffles disappear at translation time, ops on constants
+ * are folded or turned into immediate forms, unused results are
+ * dropped, and the remaining instructions are evaluated RPN_TILE
+ * values at a time so that the intermediates stay in cache.  Where
+ * SSE2 is available the arithmetic, comparison, min/max, abs, sqrt
+ * and if_keep kernels use it; these are exact, so results match the
+ * interpreter bit for bit apart from the sign of NaNs.  Input callbacks happen in the same order
+ * as in the interpreter, and a load whose value is simply left on the
+ * stack goes straight into its stack slot.
+ *
+ * A segment is skipped in favor of the interpreter when the stack
+ * at entry is too shallow or too deep for it (so that the usual
+ * error messages appear), or when it contains loads and the engine
+ * is in complex mode.
+ */
+
+#define RPN_TILE 256
+#define MAX_FUSED_OPS 256
+
+/* Each binary op is followed by its _RK form (top of stack is a
+ * constant) and its _KR form (the value below it is a constant).
+ */
+typedef enum { FOP_COPY, FOP_FILL, FOP_CLOCK,
+	       FOP_SQRT, FOP_LN, FOP_EXP, FOP_SIN, FOP_COS, FOP_TAN,
+	       FOP_ASIN, FOP_ACOS, FOP_ATAN, FOP_ABS, FOP_IS_FINITE,
+	       FOP_ROUND, FOP_FLOOR, FOP_CEILING, FOP_SIGNBIT,
+	       FOP_IF_KEEP,
+	       FOP_PLUS, FOP_PLUS_RK, FOP_PLUS_KR,
+	       FOP_MINUS, FOP_MINUS_RK, FOP_MINUS_KR,
+	       FOP_MULT, FOP_MULT_RK, FOP_MULT_KR,
+	       FOP_DIV, FOP_DIV_RK, FOP_DIV_KR,
+	       FOP_GT, FOP_GT_RK, FOP_GT_KR,
+	       FOP_LT, FOP_LT_RK, FOP_LT_KR,
+	       FOP_EQ, FOP_EQ_RK, FOP_EQ_KR,
+	       FOP_GE, FOP_GE_RK, FOP_GE_KR,
+	       FOP_LE, FOP_LE_RK, FOP_LE_KR,
+	       FOP_NE, FOP_NE_RK, FOP_NE_KR,
+	       FOP_MIN, FOP_MIN_RK, FOP_MIN_KR,
+	       FOP_MAX, FOP_MAX_RK, FOP_MAX_KR
+} FusedOp;
+
+/* Operands and destinations are indices into a table of addresses
+ * which is refreshed for each tile: registers first, then the stack
+ * slots the segment touches, then the load buffers.
+ */
+typedef struct fused_instr_struct {
+  FusedOp op;
+  int dst;
+  int src[3]; /* below, top, condition; -1 if unused */
+  double k;   /* immediate operand */
+  long l;     /* clock index for FOP_CLOCK */
+} FusedInstr;
+
+typedef struct fused_store_struct {
+  int dst;  /* stack slot location */
+  int src;  /* location, or -1 to fill with k */
+  double k;
+} FusedStore;
+
+typedef struct fused_load_struct {
+  long input;
+  int direct;  /* read straight into stack position pos */
+  int pos;
+} FusedLoad;
+
+typedef struct fused_segment_struct {
+  long nOps;      /* interpreter instructions this segment replaces */
+  int minEntry;   /* stack depth required on entry */
+  int maxRise;    /* highest stack position reached, relative to entry */
+  int delta;      /* net change in stack depth */
+  int nLoads;
+  FusedLoad* loads; /* in program order */
+  int nInstr;
+  FusedInstr* instr;
+  int nStores;
+  FusedStore* stores;
+  int nRegs;
+  int slotMin;    /* lowest stack position touched, relative to entry */
+  int nSlots;
+  int nLocs;
+  double** loc;
+} FusedSegment;
+
+/* Symbolic stack entries used while translating a segment */
+typedef enum { FREF_SLOT, FREF_LOAD, FREF_VREG, FREF_CONST } FRefType;
+
+typedef struct fref_struct {
+  FRefType type;
+  long i;   /* stack position, load number, or defining instruction */
+  double f; /* value of a constant */
+} FRef;
+
+typedef struct vinstr_struct {
+  FusedOp op;
+  int nSrc;
+  FRef src[3];
+  double k;
+  long l;
+  int live;
+  int direct;  /* result is written straight to stack position slot */
+  int slot;
+  int reg;
+} VInstr;
+
+#define F_PLUS(x,y) ((x)+(y))
+#define F_MINUS(x,y) ((x)-(y))
+#define F_MULT(x,y) ((x)*(y))
+#define F_DIV(x,y) ((x)/(y))
+/* comparisons and min/max have the top of stack on the left */
+#define F_GT(x,y) (((y) > (x)) ? 1.0 : 0.0)
+#define F_LT(x,y) (((y) < (x)) ? 1.0 : 0.0)
+#define F_EQ(x,y) (((y) == (x)) ? 1.0 : 0.0)
+#define F_GE(x,y) (((y) >= (x)) ? 1.0 : 0.0)
+#define F_LE(x,y) (((y) <= (x)) ? 1.0 : 0.0)
+#define F_NE(x,y) (((y) != (x)) ? 1.0 : 0.0)
+#define F_MIN(x,y) (((y) < (x)) ? (y) : (x))
+#define F_MAX(x,y) (((y) > (x)) ? (y) : (x))
+
+#define UNARY_CASE(fop,expr) \
+    case fop: for (i=0; i<n; i++) d[i]= (expr); break
+
+#ifdef RPN_SSE2
+
+/* SSE2 equivalents; the compare and min/max instructions treat NaNs
+ * exactly as the C expressions above do.
+ */
+#define V_PLUS(x,y) _mm_add_pd(x,y)
+#define V_MINUS(x,y) _mm_sub_pd(x,y)
+#define V_MULT(x,y) _mm_mul_pd(x,y)
+#define V_DIV(x,y) _mm_div_pd(x,y)
+#define V_GT(x,y) _mm_and_pd(_mm_cmpgt_pd(y,x),vone)
+#define V_LT(x,y) _mm_and_pd(_mm_cmplt_pd(y,x),vone)
+#define V_EQ(x,y) _mm_and_pd(_mm_cmpeq_pd(y,x),vone)
+#define V_GE(x,y) _mm_and_pd(_mm_cmpge_pd(y,x),vone)
+#define V_LE(x,y) _mm_and_pd(_mm_cmple_pd(y,x),vone)
+#define V_NE(x,y) _mm_and_pd(_mm_cmpneq_pd(y,x),vone)
+#define V_MIN(x,y) _mm_min_pd(y,x)
+#define V_MAX(x,y) _mm_max_pd(y,x)
+
+#define UNARY_VCASE(fop,expr,vexpr) \
+    case fop: \
+      for (i=0; i+2<=n; i+=2) { \
+        __m128d va= _mm_loadu_pd(a+i); \
+        _mm_storeu_pd(d+i, (vexpr)); \
+      } \
+      for (; i<n; i++) d[i]= (expr); \
+      break
+#define BINARY_CASES(fop,F) \
+    case fop: \
+      for (i=0; i+2<=n; i+=2) \
+        _mm_storeu_pd(d+i, V_##F(_mm_loadu_pd(a+i),_mm_loadu_pd(b+i))); \
+      for (; i<n; i++) d[i]= F_##F(a[i],b[i]); \
+      break; \
+    case fop##_RK: \
+      for (i=0; i+2<=n; i+=2) \
+        _mm_storeu_pd(d+i, V_##F(_mm_loadu_pd(a+i),vk)); \
+      for (; i<n; i++) d[i]= F_##F(a[i],k); \
+      break; \
+    case fop##_KR: \
+      for (i=0; i+2<=n; i+=2) \
+        _mm_storeu_pd(d+i, V_##F(vk,_mm_loadu_pd(b+i))); \
+      for (; i<n; i++) d[i]= F_##F(k,b[i]); \
+      break
+
+#else
+
+#define UNARY_VCASE(fop,expr,vexpr) UNARY_CASE(fop,expr)
+#define BINARY_CASES(fop,F) \
+    case fop: for (i=0; i<n; i++) d[i]= F_##F(a[i],b[i]); break; \
+    case fop##_RK: for (i=0; i<n; i++) d[i]= F_##F(a[i],k); break; \
+    case fop##_KR: for (i=0; i<n; i++) d[i]= F_##F(k,b[i]); break
+
+#endif
+
+static void fused_exec( const FusedInstr* in, double** loc, long n,
+			long long first, const Clock* clock )
+{
+  double* d= loc[in->dst];
+  const double* a= (in->src[0]>=0) ? loc[in->src[0]] : NULL;
+  const double* b= (in->src[1]>=0) ? loc[in->src[1]] : NULL;
+  const double* c= (in->src[2]>=0) ? loc[in->src[2]] : NULL;
+  const double k= in->k;
+  long i;
+#ifdef RPN_SSE2
+  const __m128d vone= _mm_set1_pd(1.0);
+  const __m128d vzero= _mm_setzero_pd();
+  const __m128d vsign= _mm_set1_pd(-0.0);
+  const __m128d vk= _mm_set1_pd(k);
+#endif
+
+  switch (in->op) {
+  case FOP_COPY:
+    if (d != a) memcpy(d, a, n*sizeof(double));
+    break;
+  case FOP_FILL:
+    for (i=0; i<n; i++) d[i]= k;
+    break;
+  case FOP_CLOCK:
+    for (i=0; i<n; i++) {
+      int pos= (((first + i)/clock->strides[in->l])
+		% clock->limits[in->l]);
+      d[i]= (double)(pos);
+    }
+    break;
+  UNARY_VCASE(FOP_SQRT, sqrt(a[i]), _mm_sqrt_pd(va));
+  UNARY_CASE(FOP_LN, log(a[i]));
+  UNARY_CASE(FOP_EXP, exp(a[i]));
+  UNARY_CASE(FOP_SIN, sin(a[i]));
+  UNARY_CASE(FOP_COS, cos(a[i]));
+  UNARY_CASE(FOP_TAN, tan(a[i]));
+  UNARY_CASE(FOP_ASIN, asin(a[i]));
+  UNARY_CASE(FOP_ACOS, acos(a[i]));
+  UNARY_CASE(FOP_ATAN, atan(a[i]));
+  UNARY_VCASE(FOP_ABS, fabs(a[i]), _mm_andnot_pd(vsign,va));
+  UNARY_CASE(FOP_IS_FINITE, (finite(a[i]) ? 1.0 : 0.0));
+  UNARY_CASE(FOP_ROUND, rint(a[i]));
+  UNARY_CASE(FOP_FLOOR, floor(a[i]));
+  UNARY_CASE(FOP_CEILING, ceil(a[i]));
+#if ( defined(SGI5) || defined(SGI6) || defined(SGI64) || defined(SGIMP64) )
+  UNARY_CASE(FOP_SIGNBIT, (_signbit(a[i]) ? 1:0));
+#else
+  UNARY_CASE(FOP_SIGNBIT, (signbit(a[i]) ? 1:0));
+#endif
+  case FOP_IF_KEEP:
+    i= 0;
+#ifdef RPN_SSE2
+    for (; i+2<=n; i+=2) {
+      __m128d mask= _mm_cmpneq_pd(_mm_loadu_pd(c+i),vzero);
+      _mm_storeu_pd(d+i, _mm_or_pd(_mm_and_pd(mask,_mm_loadu_pd(b+i)),
+				   _mm_andnot_pd(mask,_mm_loadu_pd(a+i))));
+    }
+#endif
+    for (; i<n; i++) d[i]= ((c[i] != 0.0) ? b[i] : a[i]);
+    break;
+  BINARY_CASES(FOP_PLUS, PLUS);
+  BINARY_CASES(FOP_MINUS, MINUS);
+  BINARY_CASES(FOP_MULT, MULT);
+  BINARY_CASES(FOP_DIV, DIV);
+  BINARY_CASES(FOP_GT, GT);
+  BINARY_CASES(FOP_LT, LT);
+  BINARY_CASES(FOP_EQ, EQ);
+  BINARY_CASES(FOP_GE, GE);
+  BINARY_CASES(FOP_LE, LE);
+  BINARY_CASES(FOP_NE, NE);
+  BINARY_CASES(FOP_MIN, MIN);
+  BINARY_CASES(FOP_MAX, MAX);
+  }
+}
+
+#undef UNARY_CASE
+#undef UNARY_VCASE
+#undef BINARY_CASES
+
+/* Returns the number of operands the op takes from the stack if it
+ * has a fused equivalent, or -1 if it does not.
+ */
+static int fused_op_for( Op op, FusedOp* fop )
+{
+  switch (op) {
+  case OP_SQRT: *fop= FOP_SQRT; return 1;
+  case OP_LN: *fop= FOP_LN; return 1;
+  case OP_EXP: *fop= FOP_EXP; return 1;
+  case OP_SIN: *fop= FOP_SIN; return 1;
+  case OP_COS: *fop= FOP_COS; return 1;
+  case OP_TAN: *fop= FOP_TAN; return 1;
+  case OP_ASIN: *fop= FOP_ASIN; return 1;
+  case OP_ACOS: *fop= FOP_ACOS; return 1;
+  case OP_ATAN: *fop= FOP_ATAN; return 1;
+  case OP_ABS: *fop= FOP_ABS; return 1;
+  case OP_IS_FINITE: *fop= FOP_IS_FINITE; return 1;
+  case OP_ROUND: *fop= FOP_ROUND; return 1;
+  case OP_FLOOR: *fop= FOP_FLOOR; return 1;
+  case OP_CEILING: *fop= FOP_CEILING; return 1;
+  case OP_SIGNBIT: *fop= FOP_SIGNBIT; return 1;
+  case OP_PLUS: *fop= FOP_PLUS; return 2;
+  case OP_MINUS: *fop= FOP_MINUS; return 2;
+  case OP_MULT: *fop= FOP_MULT; return 2;
+  case OP_DIV: *fop= FOP_DIV; return 2;
+  case OP_GT: *fop= FOP_GT; return 2;
+  case OP_LT: *fop= FOP_LT; return 2;
+  case OP_EQ: *fop= FOP_EQ; return 2;
+  case OP_GE: *fop= FOP_GE; return 2;
+  case OP_LE: *fop= FOP_LE; return 2;
+  case OP_NE: *fop= FOP_NE; return 2;
+  case OP_MIN: *fop= FOP_MIN; return 2;
+  case OP_MAX: *fop= FOP_MAX; return 2;
+  case OP_IF_KEEP: *fop= FOP_IF_KEEP; return 3;
+  default: return -1;
+  }
+}
+
+static int fusable( RpnEngine* re, const Instruction* inst )
+{
+  FusedOp fop;
+  switch (inst->op) {
+  case OP_LOAD:
+    return !(re->complexFlag);
+  case OP_CONST:
+  case OP_CLOCK:
+  case OP_DIM:
+  case OP_DUP:
+  case OP_SWAP:
+  case OP_POP:
+  case OP_ROT:
+  case OP_NOOP:
+    return 1;
+  default:
+    return (fused_op_for(inst->op, &fop) >= 0);
+  }
+}
+
+/* Evaluate a fused op on constant operands, using the same kernel
+ * the tiles use so that folding cannot change any result.
+ */
+static double fused_fold( FusedOp op, double a, double b, double c,
+			  double k )
+{
+  FusedInstr in;
+  double out;
+  double* loc[4];
+  loc[0]= &out;
+  loc[1]= &a;
+  loc[2]= &b;
+  loc[3]= &c;
+  in.op= op;
+  in.dst= 0;
+  in.src[0]= 1;
+  in.src[1]= 2;
+  in.src[2]= 3;
+  in.k= k;
+  in.l= 0;
+  fused_exec(&in, loc, 1, 0, NULL);
+  return out;
+}
+
+static void destroy_fused_segment( FusedSegment* seg )
+{
+  free(seg->loads);
+  free(seg->instr);
+  free(seg->stores);
+  free(seg->loc);
+  free(seg);
+}
+
+static VInstr* add_vinstr( VInstr* vi, int* nVi, FusedOp op, int nSrc )
+{
+  VInstr* v= vi + (*nVi)++;
+  int j;
+  v->op= op;
+  v->nSrc= nSrc;
+  for (j=0; j<3; j++) {
+    v->src[j].type= FREF_CONST;
+    v->src[j].i= 0;
+    v->src[j].f= 0.0;
+  }
+  v->k= 0.0;
+  v->l= 0;
+  v->live= 0;
+  v->direct= 0;
+  v->slot= 0;
+  v->reg= -1;
+  return v;
+}
+
+static int fref_reads_slot( const FRef* r, long pos )
+{
+  return (r->type==FREF_SLOT && r->i==pos);
+}
+
+static int fref_location( const FusedSegment* seg, const VInstr* vi,
+			  const FRef* r )
+{
+  switch (r->type) {
+  case FREF_SLOT: return seg->nRegs + (int)(r->i - seg->slotMin);
+  case FREF_LOAD:
+    if (seg->loads[r->i].direct)
+      return seg->nRegs + (seg->loads[r->i].pos - seg->slotMin);
+    else return seg->nRegs + seg->nSlots + (int)r->i;
+  case FREF_VREG:
+    {
+      const VInstr* def= vi + r->i;
+      if (def->direct) return seg->nRegs + (def->slot - seg->slotMin);
+      else return def->reg;
+    }
+  default: return -1;
+  }
+}
+
+/* Translate nOps instructions starting at code into a fused segment.
+ * Returns NULL if the instructions can't be fused profitably.
+ */
+static FusedSegment* fuse_segment( RpnEngine* re, const Instruction* code,
+				   long nOps )
+{
+  FRef stackBuf[MAX_STACK+MAX_FUSED_OPS+1];
+  FRef* sym= stackBuf+MAX_STACK; /* sym[p] is stack position p */
+  FusedLoad loads[MAX_FUSED_OPS];
+  VInstr* vi;
+  VInstr* v;
+  int* lastUse;
+  int* freeRegs;
+  int maxVi= 4*MAX_FUSED_OPS+MAX_STACK;
+  int nVi= 0;
+  int nLoads= 0;
+  int nFree= 0;
+  int nRegs= 0;
+  int minEntry= 0;
+  int maxRise= 0;
+  int top= 0;
+  int lowest;
+  int slotMin;
+  int slotMax;
+  int i;
+  int j;
+  long p;
+  FusedSegment* seg= NULL;
+
+  if (!(vi=(VInstr*)malloc(maxVi*sizeof(VInstr))))
+    Abort("rpn_engine: fuse_segment: unable to allocate %d bytes!\n",
+	  maxVi*sizeof(VInstr));
+  if (!(lastUse=(int*)malloc(2*maxVi*sizeof(int))))
+    Abort("rpn_engine: fuse_segment: unable to allocate %d bytes!\n",
+	  2*maxVi*sizeof(int));
+  freeRegs= lastUse+maxVi;
+
+  for (p= -(MAX_STACK-1); p<=0; p++) {
+    sym[p].type= FREF_SLOT;
+    sym[p].i= p;
+    sym[p].f= 0.0;
+  }
+
+#define NEED(n) { if ((n)-top > minEntry) minEntry= (n)-top; \
+                  if (minEntry>MAX_STACK) goto done; }
+#define PUSH(r) { top++; if (top>maxRise) maxRise= top; sym[top]= (r); }
+
+  for (i=0; i<nOps; i++) {
+    const Instruction* inst= code+i;
+    FRef r;
+    FusedOp fop;
+    int nArgs;
+
+    switch (inst->op) {
+    case OP_NOOP:
+      break;
+    case OP_LOAD:
+      r.type= FREF_LOAD;
+      r.i= nLoads;
+      r.f= 0.0;
+      loads[nLoads].input= inst->param.l;
+      loads[nLoads].direct= 0;
+      loads[nLoads].pos= 0;
+      nLoads++;
+      PUSH(r);
+      break;
+    case OP_CONST:
+    case OP_DIM:
+      r.type= FREF_CONST;
+      r.i= 0;
+      if (inst->op==OP_CONST) r.f= inst->param.f;
+      else r.f= (double)(re->clock->limits[inst->param.l]);
+      PUSH(r);
+      break;
+    case OP_CLOCK:
+      v= add_vinstr(vi, &nVi, FOP_CLOCK, 0);
+      v->l= inst->param.l;
+      r.type= FREF_VREG;
+      r.i= v-vi;
+      r.f= 0.0;
+      PUSH(r);
+      break;
+    case OP_DUP:
+      NEED(1);
+      r= sym[top];
+      PUSH(r);
+      break;
+    case OP_SWAP:
+      NEED(2);
+      r= sym[top];
+      sym[top]= sym[top-1];
+      sym[top-1]= r;
+      break;
+    case OP_POP:
+      NEED(2);
+      top--;
+      break;
+    case OP_ROT:
+      {
+	long depth= labs(inst->param.l);
+	NEED(depth);
+	if (inst->param.l>1) {
+	  r= sym[top-(depth-1)];
+	  for (j=depth-1; j>0; j--) sym[top-j]= sym[top-(j-1)];
+	  sym[top]= r;
+	}
+	if (inst->param.l<-1) {
+	  r= sym[top];
+	  for (j=1; j<depth; j++) sym[top-(j-1)]= sym[top-j];
+	  sym[top-(depth-1)]= r;
+	}
+      }
+      break;
+    default:
+      nArgs= fused_op_for(inst->op, &fop);
+      if (nArgs==1) {
+	NEED(1);
+	if (sym[top].type==FREF_CONST) {
+	  sym[top].f= fused_fold(fop, sym[top].f, 0.0, 0.0, 0.0);
+	}
+	else {
+	  v= add_vinstr(vi, &nVi, fop, 1);
+	  v->src[0]= sym[top];
+	  sym[top].type= FREF_VREG;
+	  sym[top].i= v-vi;
+	}
+      }
+      else if (nArgs==2) {
+	FRef below;
+	FRef above;
+	NEED(2);
+	above= sym[top--];
+	below= sym[top];
+	if (below.type==FREF_CONST && above.type==FREF_CONST) {
+	  sym[top].f= fused_fold(fop, below.f, above.f, 0.0, 0.0);
+	}
+	else {
+	  if (above.type==FREF_CONST) {
+	    v= add_vinstr(vi, &nVi, fop+1, 1); /* _RK form */
+	    v->src[0]= below;
+	    v->k= above.f;
+	  }
+	  else if (below.type==FREF_CONST) {
+	    v= add_vinstr(vi, &nVi, fop+2, 2); /* _KR form */
+	    v->src[1]= above;
+	    v->k= below.f;
+	  }
+	  else {
+	    v= add_vinstr(vi, &nVi, fop, 2);
+	    v->src[0]= below;
+	    v->src[1]= above;
+	  }
+	  sym[top].type= FREF_VREG;
+	  sym[top].i= v-vi;
+	}
+      }
+      else if (nArgs==3) {
+	FRef cond;
+	NEED(3);
+	cond= sym[top];
+	top -= 2;
+	if (cond.type==FREF_CONST) {
+	  if (cond.f != 0.0) sym[top]= sym[top+1];
+	}
+	else {
+	  FRef args[2];
+	  args[0]= sym[top];
+	  args[1]= sym[top+1];
+	  for (j=0; j<2; j++) {
+	    if (args[j].type==FREF_CONST) {
+	      v= add_vinstr(vi, &nVi, FOP_FILL, 0);
+	      v->k= args[j].f;
+	      args[j].type= FREF_VREG;
+	      args[j].i= v-vi;
+	    }
+	  }
+	  v= add_vinstr(vi, &nVi, FOP_IF_KEEP, 3);
+	  v->src[0]= args[0];
+	  v->src[1]= args[1];
+	  v->src[2]= cond;
+	  sym[top].type= FREF_VREG;
+	  sym[top].i= v-vi;
+	}
+      }
+      else goto done; /* not fusable after all */
+    }
+  }
+
+#undef NEED
+#undef PUSH
+
+  if (maxRise+minEntry>MAX_STACK) goto done;
+
+  /* Stack positions lowest..top may hold new values on exit.  Entries
+   * that are just other stack slots get copied out first, so that
+   * stores can't clobber a slot before it is read.
+   */
+  lowest= 1-minEntry;
+  for (p=lowest; p<=top; p++) {
+    if (sym[p].type==FREF_SLOT && sym[p].i!=p) {
+      v= add_vinstr(vi, &nVi, FOP_COPY, 1);
+      v->src[0]= sym[p];
+      sym[p].type= FREF_VREG;
+      sym[p].i= v-vi;
+    }
+  }
+
+  /* Results that end up on the stack are live, as is anything they
+   * depend on.  A result goes straight into its final stack slot if no
+   * later instruction reads that slot's original value.
+   */
+  for (p=lowest; p<=top; p++) {
+    if (sym[p].type==FREF_VREG) {
+      VInstr* def= vi+sym[p].i;
+      def->live= 1;
+      if (!def->direct) {
+	int clash= 0;
+	for (i=sym[p].i+1; i<nVi && !clash; i++)
+	  for (j=0; j<3; j++)
+	    if (fref_reads_slot(vi[i].src+j, p)) clash= 1;
+	if (!clash) {
+	  def->direct= 1;
+	  def->slot= p;
+	}
+      }
+    }
+  }
+  for (i=nVi-1; i>=0; i--) {
+    if (vi[i].live) {
+      for (j=0; j<3; j++)
+	if (vi[i].src[j].type==FREF_VREG) vi[vi[i].src[j].i].live= 1;
+    }
+  }
+
+  /* Likewise a load that is left on the stack is read straight into
+   * its slot, unless something still needs the slot's old value.
+   */
+  for (p=lowest; p<=top; p++) {
+    if (sym[p].type==FREF_LOAD && !loads[sym[p].i].direct) {
+      int clash= 0;
+      for (i=0; i<nVi && !clash; i++)
+	if (vi[i].live)
+	  for (j=0; j<3; j++)
+	    if (fref_reads_slot(vi[i].src+j, p)) clash= 1;
+      if (!clash) {
+	loads[sym[p].i].direct= 1;
+	loads[sym[p].i].pos= p;
+      }
+    }
+  }
+
+  /* Assign tile registers, reusing each one after its last reader */
+  for (i=0; i<nVi; i++) lastUse[i]= -1;
+  for (i=0; i<nVi; i++) {
+    if (!vi[i].live) continue;
+    for (j=0; j<3; j++)
+      if (vi[i].src[j].type==FREF_VREG) lastUse[vi[i].src[j].i]= i;
+  }
+  for (p=lowest; p<=top; p++)
+    if (sym[p].type==FREF_VREG) lastUse[sym[p].i]= nVi;
+  for (i=0; i<nVi; i++) {
+    if (!vi[i].live) continue;
+    for (j=0; j<3; j++) {
+      FRef* r= vi[i].src+j;
+      if (r->type==FREF_VREG && lastUse[r->i]==i && !vi[r->i].direct) {
+	freeRegs[nFree++]= vi[r->i].reg;
+	lastUse[r->i]= -1; /* so a repeated operand is freed only once */
+      }
+    }
+    if (!vi[i].direct) {
+      if (nFree>0) vi[i].reg= freeRegs[--nFree];
+      else vi[i].reg= nRegs++;
+    }
+  }
+
+  /* The stack positions the segment touches */
+  slotMin= top+1;
+  slotMax= lowest-1;
+  for (p=lowest; p<=top; p++) {
+    if (sym[p].type!=FREF_SLOT || sym[p].i!=p) {
+      if (p<slotMin) slotMin= p;
+      if (p>slotMax) slotMax= p;
+    }
+  }
+  for (i=0; i<nVi; i++) {
+    if (!vi[i].live) continue;
+    for (j=0; j<3; j++) {
+      if (vi[i].src[j].type==FREF_SLOT) {
+	p= vi[i].src[j].i;
+	if (p<slotMin) slotMin= p;
+	if (p>slotMax) slotMax= p;
+      }
+    }
+  }
+
+  if (!(seg=(FusedSegment*)malloc(sizeof(FusedSegment))))
+    Abort("rpn_engine: fuse_segment: unable to allocate %d bytes!\n",
+	  sizeof(FusedSegment));
+  seg->nOps= nOps;
+  seg->minEntry= minEntry;
+  seg->maxRise= maxRise;
+  seg->delta= top;
+  seg->nLoads= nLoads;
+  seg->nRegs= nRegs;
+  seg->slotMin= slotMin;
+  seg->nSlots= (slotMax>=slotMin) ? slotMax-slotMin+1 : 0;
+  seg->nLocs= seg->nRegs + seg->nSlots + seg->nLoads;
+  if (!(seg->loads=(FusedLoad*)malloc((nLoads+1)*sizeof(FusedLoad))))
+    Abort("rpn_engine: fuse_segment: unable to allocate %d bytes!\n",
+	  (nLoads+1)*sizeof(FusedLoad));
+  for (i=0; i<nLoads; i++) seg->loads[i]= loads[i];
+  if (!(seg->instr=(FusedInstr*)malloc((nVi+1)*sizeof(FusedInstr))))
+    Abort("rpn_engine: fuse_segment: unable to allocate %d bytes!\n",
+	  (nVi+1)*sizeof(FusedInstr));
+  if (!(seg->stores=(FusedStore*)malloc((top-lowest+2)*sizeof(FusedStore))))
+    Abort("rpn_engine: fuse_segment: unable to allocate %d bytes!\n",
+	  (top-lowest+2)*sizeof(FusedStore));
+  if (!(seg->loc=(double**)malloc((seg->nLocs+1)*sizeof(double*))))
+    Abort("rpn_engine: fuse_segment: unable to allocate %d bytes!\n",
+	  (seg->nLocs+1)*sizeof(double*));
+
+  seg->nInstr= 0;
+  for (i=0; i<nVi; i++) {
+    FusedInstr* in;
+    if (!vi[i].live) continue;
+    in= seg->instr + seg->nInstr++;
+    in->op= vi[i].op;
+    in->k= vi[i].k;
+    in->l= vi[i].l;
+    if (vi[i].direct) in->dst= seg->nRegs + (vi[i].slot - seg->slotMin);
+    else in->dst= vi[i].reg;
+    for (j=0; j<3; j++) in->src[j]= fref_location(seg, vi, vi[i].src+j);
+  }
+
+  seg->nStores= 0;
+  for (p=lowest; p<=top; p++) {
+    FusedStore* st;
+    if (sym[p].type==FREF_SLOT) continue; /* already in place */
+    if (sym[p].type==FREF_VREG && vi[sym[p].i].direct
+	&& vi[sym[p].i].slot==p) continue; /* written in place */
+    if (sym[p].type==FREF_LOAD && loads[sym[p].i].direct
+	&& loads[sym[p].i].pos==p) continue; /* loaded in place */
+    st= seg->stores + seg->nStores++;
+    st->dst= seg->nRegs + (int)(p - seg->slotMin);
+    st->src= fref_location(seg, vi, sym+p);
+    st->k= (sym[p].type==FREF_CONST) ? sym[p].f : 0.0;
+  }
+
+ done:
+  free(vi);
+  free(lastUse);
+  return seg;
+}
+
+/* Find the runs of fusable instructions in a newly compiled program */
+static void fuse_program( RpnEngine* re, Program* prog )
+{
+  long start;
+  long end;
+  long need= 0;
+
+  prog->fused= NULL;
+  start= 0;
+  while (start<prog->code_length) {
+    FusedSegment* seg;
+    if (!fusable(re, prog->code+start)) {
+      start++;
+      continue;
+    }
+    end= start+1;
+    while (end<prog->code_length && end-start<MAX_FUSED_OPS
+	   && fusable(re, prog->code+end)) end++;
+    if (end-start>1
+	&& (seg= fuse_segment(re, prog->code+start, end-start)) != NULL) {
+      long size= seg->nRegs*RPN_TILE + seg->nLoads*RPN_CHUNKSIZE;
+      if (!prog->fused) {
+	long i;
+	if (!(prog->fused= (FusedSegment**)malloc(prog->code_length
+						  *sizeof(FusedSegment*))))
+	  Abort("rpn_engine: fuse_program: unable to allocate %d bytes!\n",
+		prog->code_length*sizeof(FusedSegment*));
+	for (i=0; i<prog->code_length; i++) prog->fused[i]= NULL;
+      }
+      prog->fused[start]= seg;
+      if (size>need) need= size;
+      if (re->debugFlag)
+	fprintf(stderr,
+		"fused ops %ld-%ld: %d instructions, %d registers, %d stores\n",
+		start, end-1, seg->nInstr, seg->nRegs, seg->nStores);
+    }
+    start= end;
+  }
+
+  if (need>re->fuseBlockSize) {
+    if (re->fuseBlock) free(re->fuseBlock);
+    if (!(re->fuseBlock= (double*)malloc(need*sizeof(double))))
+      Abort("rpn_engine: fuse_program: unable to allocate %d bytes!\n",
+	    need*sizeof(double));
+    re->fuseBlockSize= need;
+  }
+}
+
+/* Run a fused segment on the stack whose top is *stack_top.  Returns 0
+ * without touching anything if the interpreter should handle it instead.
+ */
+static int run_fused( RpnEngine* re, FusedSegment* seg, double** stack_top,
+		      long length, long long offset )
+{
+  double* stack_first= &(re->stackBlock[0][0]);
+  double* top= *stack_top;
+  double** loc= seg->loc;
+  long depth= ((top - stack_first)/RPN_CHUNKSIZE) + 1;
+  double* slots= NULL;
+  double* loadBuf;
+  long base;
+  int i;
+
+  if (depth<seg->minEntry || depth+seg->maxRise>MAX_STACK
+      || (seg->nLoads>0 && re->complexFlag))
+    return 0;
+
+  loadBuf= re->fuseBlock + seg->nRegs*RPN_TILE;
+  for (i=0; i<seg->nLoads; i++) {
+    FusedLoad* ld= seg->loads+i;
+    re->getInputCB((int)ld->input, length, offset,
+		   (ld->direct ? top+ld->pos*RPN_CHUNKSIZE
+		    : loadBuf+i*RPN_CHUNKSIZE),
+		   re->usrHook);
+  }
+
+  for (i=0; i<seg->nRegs; i++) loc[i]= re->fuseBlock + i*RPN_TILE;
+  if (seg->nSlots>0) slots= top + seg->slotMin*RPN_CHUNKSIZE;
+
+  for (base=0; base<length; base += RPN_TILE) {
+    long n= (length-base < RPN_TILE) ? length-base : RPN_TILE;
+    long j;
+    for (i=0; i<seg->nSlots; i++)
+      loc[seg->nRegs+i]= slots + i*RPN_CHUNKSIZE + base;
+    for (i=0; i<seg->nLoads; i++)
+      loc[seg->nRegs+seg->nSlots+i]= loadBuf + i*RPN_CHUNKSIZE + base;
+    for (i=0; i<seg->nInstr; i++)
+      fused_exec(seg->instr+i, loc, n, offset+base, re->clock);
+    for (i=0; i<seg->nStores; i++) {
+      FusedStore* st= seg->stores+i;
+      double* d= loc[st->dst];
+      if (st->src<0) for (j=0; j<n; j++) d[j]= st->k;
+      else {
+	const double* s= loc[st->src];
+	for (j=0; j<n; j++) d[j]= s[j];
+      }
+    }
+  }
+
+  *stack_top= top + seg->delta*RPN_CHUNKSIZE;
+  return 1;
+}
+
+#define BAILOUT(msg) \
+{ if (cdfLocked) CDF_UNLOCK(); setErrorStr(re, msg); return NULL; }
+#define BAILOUT1(msg,msg1) \
+{ if (cdfLocked) CDF_UNLOCK(); setErrorStr(re, msg,msg1); return NULL; }
+#define BAILOUT2(msg,msg1,msg2) \
+{ if (cdfLocked) CDF_UNLOCK(); setErrorStr(re, msg,msg1,msg2); return NULL; }
 #define BAILOUT3(msg,msg1,msg2,msg3) \
-{ setErrorStr(re, msg,msg1,msg2,msg3); return NULL; }
+{ if (cdfLocked) CDF_UNLOCK(); setErrorStr(re, msg,msg1,msg2,msg3); \
+  return NULL; }
 
 double* rpnRun( RpnEngine* re, long length, long long offset )
 {
@@ -672,6 +1627,7 @@ double* rpnRun( RpnEngine* re, long length, long long offset )
   int i;
   Program* prog= re->program;
   Clock* clock= re->clock;
+  int cdfLocked= 0;
 
   if (length>RPN_CHUNKSIZE) 
     BAILOUT2("Internal error; rpnRun request of %d values vs. chunksize %d!",
@@ -681,6 +1637,14 @@ double* rpnRun( RpnEngine* re, long length, long long offset )
 
   for (runner= prog->code; (runner - prog->code) < prog->code_length; 
        runner++) {
+    if (prog->fused && re->fuseFlag && prog->fused[runner - prog->code]) {
+      FusedSegment* seg= prog->fused[runner - prog->code];
+      if (run_fused(re, seg, &stack_top, length, offset)) {
+	runner += seg->nOps - 1;
+	continue;
+      }
+    }
+    if ((cdfLocked= is_cdf_op(runner->op)) != 0) CDF_LOCK();
     switch (runner->op) {
     case OP_CLOCK:
       {
@@ -1019,62 +1983,51 @@ double* rpnRun( RpnEngine* re, long length, long long offset )
     case OP_CT:
       {
 	int i;
-	int one= 1;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
+	double* df= re->cdfBlock+(3*RPN_CHUNKSIZE);
 	/* fprintf(stderr,"exec: OP_CT\n"); */
 	if (stack_top < stack_first+RPN_CHUNKSIZE)
 	  BAILOUT("stack underflow on ct!\n");
 	stack_top -= (1*RPN_CHUNKSIZE);
-	for (i=0; i<length; i++) {
-	  /* We encounter normalized maps with T=0 and no counts in
-	   * the unsampled regions.  This hack gives an appropriate
-	   * value at these points.
-	   */
-	  if (*(stack_top+i) == 0.0) qval= 0.5;
-	  else {
-	    cdf_t(&one, &val, &qval, stack_top+i, stack_top+RPN_CHUNKSIZE+i,
-		  &status, &bound);
-	    if (status != 0)
-	      BAILOUT2("can't get P from T= %f, df= %f\n",
-		       *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i));
-	  }
-	  *(stack_top+i)= val;
-	}
+	/* We encounter normalized maps with T=0 and no counts in
+	 * the unsampled regions.  cdf_t_v() gives P=0.5 at T=0; the
+	 * df is replaced there so that a df of 0 is not an error.
+	 */
+	for (i=0; i<length; i++)
+	  df[i]= (*(stack_top+i)==0.0) ? 1.0 : *(stack_top+RPN_CHUNKSIZE+i);
+	if ((bad= cdf_t_v(1, length, pval, qval, stack_top, df,
+			  &status, &bound)) >= 0)
+	  BAILOUT2("can't get P from T= %f, df= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad));
+	for (i=0; i<length; i++) *(stack_top+i)= pval[i];
       }
     break;
     case OP_INV_CT:
       {
 	int i;
-	int two= 2;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
+	double* x= re->cdfBlock+(2*RPN_CHUNKSIZE);
 	/* fprintf(stderr,"exec: OP_INV_CT\n"); */
 	if (stack_top < stack_first+RPN_CHUNKSIZE)
 	  BAILOUT("stack underflow on inv_ct!\n");
 	stack_top -= (1*RPN_CHUNKSIZE);
+	unpack_p(stack_top, length, 1, 1, pval, qval);
+	if ((bad= cdf_t_v(2, length, pval, qval, x, stack_top+RPN_CHUNKSIZE,
+			  &status, &bound)) >= 0)
+	  BAILOUT2("can't get T from P= %f, df= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad));
 	for (i=0; i<length; i++) {
-	  if (*(stack_top+i) != 0.0) {
-	    if (*(stack_top+i) != 1.0) {
-	      qval= 1.0- *(stack_top+i);
-	      cdf_t(&two, stack_top+i, &qval, &val, stack_top+RPN_CHUNKSIZE+i,
-		    &status, &bound);
-	      if (status != 0)
-		BAILOUT2("can't get T from P= %f, df= %f\n",
-			 *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i));
-	      *(stack_top+i)= val;
-	    }
-	    else {
-	      *(stack_top+i)= DLAMCH("o");
-	    }
-	  }
-	  else {
-	    *(stack_top+i)= -DLAMCH("o");
-	  }
+	  if (*(stack_top+i) == 0.0) *(stack_top+i)= -DLAMCH("o");
+	  else if (*(stack_top+i) == 1.0) *(stack_top+i)= DLAMCH("o");
+	  else *(stack_top+i)= x[i];
 	}
       }
     break;
@@ -1138,50 +2091,46 @@ double* rpnRun( RpnEngine* re, long length, long long offset )
     case OP_CF:
       {
 	int i;
-	int one= 1;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
 	/* fprintf(stderr,"exec: OP_CF\n"); */
 	if (stack_top < stack_first+(2*RPN_CHUNKSIZE))
 	  BAILOUT("stack underflow on cf!\n");
 	stack_top -= (2*RPN_CHUNKSIZE);
-	for (i=0; i<length; i++) {
-	  cdf_f(&one, &val, &qval, stack_top+i, stack_top+RPN_CHUNKSIZE+i,
-		stack_top+(2*RPN_CHUNKSIZE)+i, &status, &bound);
-	  if (status != 0)
-	    BAILOUT3("can't get P from F= %f, dfn= %f, dfd= %f\n",
-		  *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i),
-		  *(stack_top+(2*RPN_CHUNKSIZE)+i));
-	  *(stack_top+i)= val;
-	}
+	if ((bad= cdf_f_v(1, length, pval, qval, stack_top,
+			  stack_top+RPN_CHUNKSIZE, stack_top+(2*RPN_CHUNKSIZE),
+			  &status, &bound)) >= 0)
+	  BAILOUT3("can't get P from F= %f, dfn= %f, dfd= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad),
+		   *(stack_top+(2*RPN_CHUNKSIZE)+bad));
+	for (i=0; i<length; i++) *(stack_top+i)= pval[i];
       }
     break;
     case OP_INV_CF:
       {
 	int i;
-	int two= 2;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
+	double* x= re->cdfBlock+(2*RPN_CHUNKSIZE);
 	/* fprintf(stderr,"exec: OP_INV_CF\n"); */
 	if (stack_top < stack_first+(2*RPN_CHUNKSIZE))
 	  BAILOUT("stack underflow on inv_cf!\n");
 	stack_top -= (2*RPN_CHUNKSIZE);
+	unpack_p(stack_top, length, 0, 1, pval, qval);
+	if ((bad= cdf_f_v(2, length, pval, qval, x, stack_top+RPN_CHUNKSIZE,
+			  stack_top+(2*RPN_CHUNKSIZE), &status, &bound)) >= 0)
+	  BAILOUT3("can't get F from P= %f, dfn= %f, dfd= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad),
+		   *(stack_top+(2*RPN_CHUNKSIZE)+bad));
 	for (i=0; i<length; i++) {
-	  if (*(stack_top+i) != 1.0) {
-	    qval= 1.0- *(stack_top+i);
-	    cdf_f(&two, stack_top+i, &qval, &val, stack_top+RPN_CHUNKSIZE+i,
-		  stack_top+(2*RPN_CHUNKSIZE)+i, &status, &bound);
-	    if (status != 0)
-	      BAILOUT3("can't get F from P= %f, dfn= %f, dfd= %f\n",
-		       *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i),
-		       *(stack_top+(2*RPN_CHUNKSIZE)+i));
-	    *(stack_top+i)= val;
-	  }
-	  else *(stack_top+i)= DLAMCH("o");
+	  if (*(stack_top+i) == 1.0) *(stack_top+i)= DLAMCH("o");
+	  else *(stack_top+i)= x[i];
 	}
       }
     break;
@@ -1189,48 +2138,43 @@ double* rpnRun( RpnEngine* re, long length, long long offset )
     case OP_CCHISQR:
       {
 	int i;
-	int one= 1;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
 	/* fprintf(stderr,"exec: OP_CCHISQR\n"); */
 	if (stack_top < stack_first+RPN_CHUNKSIZE)
 	  BAILOUT("stack underflow on cchisqr!\n");
 	stack_top -= (1*RPN_CHUNKSIZE);
-	for (i=0; i<length; i++) {
-	  cdf_chi(&one, &val, &qval, stack_top+i, stack_top+RPN_CHUNKSIZE+i,
-		&status, &bound);
-	  if (status != 0)
-	    BAILOUT2(" can't get P from chisqr= %f, df= %f\n",
-		     *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i));
-	  *(stack_top+i)= val;
-	}
+	if ((bad= cdf_chi_v(1, length, pval, qval, stack_top,
+			    stack_top+RPN_CHUNKSIZE, &status, &bound)) >= 0)
+	  BAILOUT2(" can't get P from chisqr= %f, df= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad));
+	for (i=0; i<length; i++) *(stack_top+i)= pval[i];
       }
     break;
     case OP_INV_CCHISQR:
       {
 	int i;
-	int two= 2;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
+	double* x= re->cdfBlock+(2*RPN_CHUNKSIZE);
 	/* fprintf(stderr,"exec: OP_INV_CCHISQR\n"); */
 	if (stack_top < stack_first+RPN_CHUNKSIZE)
 	  BAILOUT("stack underflow on inv_cchisqr!\n");
 	stack_top -= (1*RPN_CHUNKSIZE);
+	unpack_p(stack_top, length, 0, 1, pval, qval);
+	if ((bad= cdf_chi_v(2, length, pval, qval, x, stack_top+RPN_CHUNKSIZE,
+			    &status, &bound)) >= 0)
+	  BAILOUT2(" can't get chisqr from P= %f, df= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad));
 	for (i=0; i<length; i++) {
-	  if (*(stack_top+i)!=1.0) {
-	    qval= 1.0- *(stack_top+i);
-	    cdf_chi(&two, stack_top+i, &qval, &val, stack_top+RPN_CHUNKSIZE+i,
-		    &status, &bound);
-	    if (status != 0)
-	      BAILOUT2(" can't get chisqr from P= %f, df= %f\n",
-		       *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i));
-	    *(stack_top+i)= val;
-	  }
-	  else *(stack_top+i)= DLAMCH("o");
+	  if (*(stack_top+i) == 1.0) *(stack_top+i)= DLAMCH("o");
+	  else *(stack_top+i)= x[i];
 	}
       }
     break;
@@ -1238,51 +2182,50 @@ double* rpnRun( RpnEngine* re, long length, long long offset )
     case OP_CBETA:
       {
 	int i;
-	int one= 1;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
-	double b;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
+	double* y= re->cdfBlock+(3*RPN_CHUNKSIZE);
 	/* fprintf(stderr,"exec: OP_CBETA\n"); */
 	if (stack_top < stack_first+(2*RPN_CHUNKSIZE))
 	  BAILOUT("stack underflow on cbeta!\n");
 	stack_top -= (2*RPN_CHUNKSIZE);
-	for (i=0; i<length; i++) {
-	  b= 1.0- *(stack_top+i);
-	  cdf_bet(&one, &val, &qval, stack_top+i, &b, stack_top+RPN_CHUNKSIZE+i,
-		stack_top+(2*RPN_CHUNKSIZE)+i, &status, &bound);
-	  if (status != 0)
-	    BAILOUT3("can't get P from Beta= %f, A= %f, B= %f\n",
-		     *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i),
-		     *(stack_top+(2*RPN_CHUNKSIZE)+i));
-	  *(stack_top+i)= val;
-	}
+	for (i=0; i<length; i++) y[i]= 1.0- *(stack_top+i);
+	if ((bad= cdf_bet_v(1, length, pval, qval, stack_top, y,
+			    stack_top+RPN_CHUNKSIZE,
+			    stack_top+(2*RPN_CHUNKSIZE),
+			    &status, &bound)) >= 0)
+	  BAILOUT3("can't get P from Beta= %f, A= %f, B= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad),
+		   *(stack_top+(2*RPN_CHUNKSIZE)+bad));
+	for (i=0; i<length; i++) *(stack_top+i)= pval[i];
       }
     break;
     case OP_INV_CBETA:
       {
 	int i;
-	int two= 2;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
-	double b;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
+	double* x= re->cdfBlock+(2*RPN_CHUNKSIZE);
+	double* y= re->cdfBlock+(3*RPN_CHUNKSIZE);
 	/* fprintf(stderr,"exec: OP_INV_CBETA\n"); */
 	if (stack_top < stack_first+(2*RPN_CHUNKSIZE))
 	  BAILOUT("stack underflow on inv_cbeta!\n");
 	stack_top -= (2*RPN_CHUNKSIZE);
-	for (i=0; i<length; i++) {
-	  qval= 1.0- *(stack_top+i);
-	  cdf_bet(&two, stack_top+i, &qval, &val, &b, stack_top+RPN_CHUNKSIZE+i,
-		stack_top+(2*RPN_CHUNKSIZE)+i, &status, &bound);
-	  if (status != 0)
-	    BAILOUT3(" can't get Beta from P= %f, A= %f, B= %f\n",
-		     *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i),
-		     *(stack_top+(2*RPN_CHUNKSIZE)+i));
-	  *(stack_top+i)= val;
-	}
+	unpack_p(stack_top, length, 0, 0, pval, qval);
+	if ((bad= cdf_bet_v(2, length, pval, qval, x, y,
+			    stack_top+RPN_CHUNKSIZE,
+			    stack_top+(2*RPN_CHUNKSIZE),
+			    &status, &bound)) >= 0)
+	  BAILOUT3(" can't get Beta from P= %f, A= %f, B= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad),
+		   *(stack_top+(2*RPN_CHUNKSIZE)+bad));
+	for (i=0; i<length; i++) *(stack_top+i)= x[i];
       }
     break;
 
@@ -1344,105 +2287,95 @@ double* rpnRun( RpnEngine* re, long length, long long offset )
     case OP_CGAMMA:
       {
 	int i;
-	int one= 1;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
 	/* fprintf(stderr,"exec: OP_CGAMMA\n"); */
 	if (stack_top < stack_first+(2*RPN_CHUNKSIZE))
 	  BAILOUT("stack underflow on cgamma!\n");
 	stack_top -= (2*RPN_CHUNKSIZE);
-	for (i=0; i<length; i++) {
-	  cdf_gam(&one, &val, &qval, stack_top+i, stack_top+RPN_CHUNKSIZE+i,
-		stack_top+(2*RPN_CHUNKSIZE)+i, &status, &bound);
-	  if (status != 0)
-	    BAILOUT3(" can't get P from X= %f, shape= %f, scale= %f\n",
-		     *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i),
-		     *(stack_top+(2*RPN_CHUNKSIZE)+i));
-	  *(stack_top+i)= val;
-	}
+	if ((bad= cdf_gam_v(1, length, pval, qval, stack_top,
+			    stack_top+RPN_CHUNKSIZE,
+			    stack_top+(2*RPN_CHUNKSIZE),
+			    &status, &bound)) >= 0)
+	  BAILOUT3(" can't get P from X= %f, shape= %f, scale= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad),
+		   *(stack_top+(2*RPN_CHUNKSIZE)+bad));
+	for (i=0; i<length; i++) *(stack_top+i)= pval[i];
       }
     break;
     case OP_INV_CGAMMA:
       {
 	int i;
-	int two= 2;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
+	double* x= re->cdfBlock+(2*RPN_CHUNKSIZE);
 	/* fprintf(stderr,"exec: OP_INV_CGAMMA\n"); */
 	if (stack_top < stack_first+(2*RPN_CHUNKSIZE))
 	  BAILOUT("stack underflow on inv_cgamma!\n");
 	stack_top -= (2*RPN_CHUNKSIZE);
-	for (i=0; i<length; i++) {
-	  qval= 1.0- *(stack_top+i);
-	  cdf_gam(&two, stack_top+i, &qval, &val, stack_top+RPN_CHUNKSIZE+i,
-		stack_top+(2*RPN_CHUNKSIZE)+i, &status, &bound);
-	  if (status != 0)
-	    BAILOUT3(" can't get X from P= %f, shape= %f, scale= %f\n",
-		     *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i),
-		     *(stack_top+(2*RPN_CHUNKSIZE)+i));
-	  *(stack_top+i)= val;
-	}
+	unpack_p(stack_top, length, 0, 0, pval, qval);
+	if ((bad= cdf_gam_v(2, length, pval, qval, x, stack_top+RPN_CHUNKSIZE,
+			    stack_top+(2*RPN_CHUNKSIZE),
+			    &status, &bound)) >= 0)
+	  BAILOUT3(" can't get X from P= %f, shape= %f, scale= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad),
+		   *(stack_top+(2*RPN_CHUNKSIZE)+bad));
+	for (i=0; i<length; i++) *(stack_top+i)= x[i];
       }
     break;
 
     case OP_CNORMAL:
       {
 	int i;
-	int one= 1;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
 	/* fprintf(stderr,"exec: OP_CNORMAL\n"); */
 	if (stack_top < stack_first+(2*RPN_CHUNKSIZE))
 	  BAILOUT("stack underflow on cnormal!\n");
 	stack_top -= (2*RPN_CHUNKSIZE);
-	for (i=0; i<length; i++) {
-	  cdf_nor(&one, &val, &qval, stack_top+i, stack_top+RPN_CHUNKSIZE+i,
-		stack_top+(2*RPN_CHUNKSIZE)+i, &status, &bound);
-	  if (status != 0)
-	    BAILOUT3(" can't get P from X= %f, mean= %f, stdv= %f\n",
-		     *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i),
-		     *(stack_top+(2*RPN_CHUNKSIZE)+i));
-	  *(stack_top+i)= val;
-	}
+	if ((bad= cdf_nor_v(1, length, pval, qval, stack_top,
+			    stack_top+RPN_CHUNKSIZE,
+			    stack_top+(2*RPN_CHUNKSIZE),
+			    &status, &bound)) >= 0)
+	  BAILOUT3(" can't get P from X= %f, mean= %f, stdv= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad),
+		   *(stack_top+(2*RPN_CHUNKSIZE)+bad));
+	for (i=0; i<length; i++) *(stack_top+i)= pval[i];
       }
     break;
     case OP_INV_CNORMAL:
       {
 	int i;
-	int two= 2;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
+	double* x= re->cdfBlock+(2*RPN_CHUNKSIZE);
 	/* fprintf(stderr,"exec: OP_INV_CNORMAL\n"); */
 	if (stack_top < stack_first+(2*RPN_CHUNKSIZE))
 	  BAILOUT("stack underflow on inv_cnormal!\n");
 	stack_top -= (2*RPN_CHUNKSIZE);
+	unpack_p(stack_top, length, 1, 1, pval, qval);
+	if ((bad= cdf_nor_v(2, length, pval, qval, x, stack_top+RPN_CHUNKSIZE,
+			    stack_top+(2*RPN_CHUNKSIZE),
+			    &status, &bound)) >= 0)
+	  BAILOUT3(" can't get X from P= %f, mean= %f, stdv= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad),
+		   *(stack_top+(2*RPN_CHUNKSIZE)+bad));
 	for (i=0; i<length; i++) {
-	  if (*(stack_top+i)!=0.0) {
-	    if (*(stack_top+i)!=1.0) {
-	      qval= 1.0- *(stack_top+i);
-	      cdf_nor(&two, stack_top+i, &qval, &val, stack_top+RPN_CHUNKSIZE+i,
-		      stack_top+(2*RPN_CHUNKSIZE)+i, &status, &bound);
-	      if (status != 0)
-		BAILOUT3(" can't get X from P= %f, mean= %f, stdv= %f\n",
-			 *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i),
-			 *(stack_top+(2*RPN_CHUNKSIZE)+i));
-	      *(stack_top+i)= val;
-	    }
-	    else {
-	      *(stack_top+i)= DLAMCH("o");
-	    }
-	  }
-	  else {
-	    *(stack_top+i)= -DLAMCH("o");
-	  }
+	  if (*(stack_top+i) == 0.0) *(stack_top+i)= -DLAMCH("o");
+	  else if (*(stack_top+i) == 1.0) *(stack_top+i)= DLAMCH("o");
+	  else *(stack_top+i)= x[i];
 	}
       }
     break;
@@ -1450,75 +2383,57 @@ double* rpnRun( RpnEngine* re, long length, long long offset )
     case OP_FCT:
       {
 	int i;
-	int one= 1;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
+	double* df= re->cdfBlock+(3*RPN_CHUNKSIZE);
 	/* fprintf(stderr,"exec: OP_FCT\n"); */
 	if (stack_top < stack_first+RPN_CHUNKSIZE)
 	  BAILOUT("stack underflow on ct!\n");
 	stack_top -= (1*RPN_CHUNKSIZE);
-	for (i=0; i<length; i++) {
-	  /* We encounter normalized maps with T=0 and no counts in
-	   * the unsampled regions.  This hack gives an appropriate
-	   * value at these points.
-	   */
-	  if (*(stack_top+i) == 0.0) val= qval= 0.5;
-	  else {
-	    cdf_t(&one, &val, &qval, stack_top+i, stack_top+RPN_CHUNKSIZE+i,
-		  &status, &bound);
-	    if (status != 0)
-	      BAILOUT2("can't get P from T= %f, df= %f\n",
-		       *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i));
-	  }
-	  *(stack_top+i)= (qval>=val)?val:-qval;
-	}
+	/* We encounter normalized maps with T=0 and no counts in
+	 * the unsampled regions.  cdf_t_v() gives P=0.5 at T=0; the
+	 * df is replaced there so that a df of 0 is not an error.
+	 */
+	for (i=0; i<length; i++)
+	  df[i]= (*(stack_top+i)==0.0) ? 1.0 : *(stack_top+RPN_CHUNKSIZE+i);
+	if ((bad= cdf_t_v(1, length, pval, qval, stack_top, df,
+			  &status, &bound)) >= 0)
+	  BAILOUT2("can't get P from T= %f, df= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad));
+	for (i=0; i<length; i++)
+	  *(stack_top+i)= (qval[i]>=pval[i])?pval[i]:-qval[i];
       }
     break;
     case OP_INV_FCT:
       {
 	int i;
-	int two= 2;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
-	double x;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
+	double* x= re->cdfBlock+(2*RPN_CHUNKSIZE);
 	/* fprintf(stderr,"exec: OP_INV_FCT\n"); */
 	if (stack_top < stack_first+RPN_CHUNKSIZE)
 	  BAILOUT("stack underflow on inv_ct!\n");
 	stack_top -= (1*RPN_CHUNKSIZE);
+	unpack_folded_p(stack_top, length, pval, qval);
+	if ((bad= cdf_t_v(2, length, pval, qval, x, stack_top+RPN_CHUNKSIZE,
+			  &status, &bound)) >= 0)
+	  BAILOUT2("can't get T from P= %f, df= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad));
 	for (i=0; i<length; i++) {
-	  if (*(stack_top+i)!=0.0) {
-	    if (*(stack_top+i)>=0.0) {
-	      val= *(stack_top+i);
-	      qval= 1.0-val;
-	    }
-	    else {
-	      qval= -(*(stack_top+i));
-	      val= 1.0-qval;
-	    }
-	    cdf_t(&two, &val, &qval, &x, 
-		  stack_top+RPN_CHUNKSIZE+i, &status, &bound);
-	    if (status != 0)
-	      BAILOUT2("can't get T from P= %f, df= %f\n",
-		       *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i));
-	    *(stack_top+i)= x;
-	  }
-	  else {
-	    /* These values *should* be NInf and Inf, but... */
+	  if (*(stack_top+i) != 0.0) *(stack_top+i)= x[i];
+	  /* These values *should* be the exact limits, but... */
 #if ( defined(SGI5) || defined(SGI6) || defined(SGI64) || defined(SGIMP64) )
-	    if (_signbit(*(stack_top+i))) {
+	  else if (_signbit(*(stack_top+i))) *(stack_top+i)= DLAMCH("o");
 #else
-	    if (signbit(*(stack_top+i))) {
+	  else if (signbit(*(stack_top+i))) *(stack_top+i)= DLAMCH("o");
 #endif
-	      *(stack_top+i)= DLAMCH("o");
-	    }
-	    else {
-	      *(stack_top+i)= -DLAMCH("o");
-	    }
-	  }
+	  else *(stack_top+i)= -DLAMCH("o");
 	}
       }
     break;
@@ -1595,139 +2510,104 @@ double* rpnRun( RpnEngine* re, long length, long long offset )
     case OP_FCF:
       {
 	int i;
-	int one= 1;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
 	/* fprintf(stderr,"exec: OP_FCF\n"); */
 	if (stack_top < stack_first+(2*RPN_CHUNKSIZE))
 	  BAILOUT("stack underflow on cf!\n");
 	stack_top -= (2*RPN_CHUNKSIZE);
-	for (i=0; i<length; i++) {
-	  cdf_f(&one, &val, &qval, stack_top+i, stack_top+RPN_CHUNKSIZE+i,
-		stack_top+(2*RPN_CHUNKSIZE)+i, &status, &bound);
-	  if (status != 0)
-	    BAILOUT3("can't get P from F= %f, dfn= %f, dfd= %f\n",
-		  *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i),
-		  *(stack_top+(2*RPN_CHUNKSIZE)+i));
-	  *(stack_top+i)= (qval>=val)?val:-qval;
-	}
+	if ((bad= cdf_f_v(1, length, pval, qval, stack_top,
+			  stack_top+RPN_CHUNKSIZE, stack_top+(2*RPN_CHUNKSIZE),
+			  &status, &bound)) >= 0)
+	  BAILOUT3("can't get P from F= %f, dfn= %f, dfd= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad),
+		   *(stack_top+(2*RPN_CHUNKSIZE)+bad));
+	for (i=0; i<length; i++)
+	  *(stack_top+i)= (qval[i]>=pval[i])?pval[i]:-qval[i];
       }
     break;
     case OP_INV_FCF:
       {
 	int i;
-	int two= 2;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
-	double x;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
+	double* x= re->cdfBlock+(2*RPN_CHUNKSIZE);
 	/* fprintf(stderr,"exec: OP_INV_FCF\n"); */
 	if (stack_top < stack_first+(2*RPN_CHUNKSIZE))
 	  BAILOUT("stack underflow on inv_cf!\n");
 	stack_top -= (2*RPN_CHUNKSIZE);
+	unpack_folded_p(stack_top, length, pval, qval);
+	if ((bad= cdf_f_v(2, length, pval, qval, x, stack_top+RPN_CHUNKSIZE,
+			  stack_top+(2*RPN_CHUNKSIZE), &status, &bound)) >= 0)
+	  BAILOUT3("can't get F from P= %f, dfn= %f, dfd= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad),
+		   *(stack_top+(2*RPN_CHUNKSIZE)+bad));
 	for (i=0; i<length; i++) {
-	  if (*(stack_top+i)!=0.0) {
-	    if (*(stack_top+i)>=0.0) {
-	      val= *(stack_top+i);
-	      qval= 1.0-val;
-	    }
-	    else {
-	      qval= -(*(stack_top+i));
-	      val= 1.0-qval;
-	    }
-	    cdf_f(&two, &val, &qval, &x, stack_top+RPN_CHUNKSIZE+i,
-		  stack_top+(2*RPN_CHUNKSIZE)+i, &status, &bound);
-	    if (status != 0)
-	      BAILOUT3("can't get F from P= %f, dfn= %f, dfd= %f\n",
-		       *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i),
-		       *(stack_top+(2*RPN_CHUNKSIZE)+i));
-	    *(stack_top+i)= x;
-	  }
-	  else {
-	    /* These values *should* be 0.0 and Inf, but... */
+	  if (*(stack_top+i) != 0.0) *(stack_top+i)= x[i];
+	  /* These values *should* be the exact limits, but... */
 #if ( defined(SGI5) || defined(SGI6) || defined(SGI64) || defined(SGIMP64) )
-	    if (_signbit(*(stack_top+i))) {
+	  else if (_signbit(*(stack_top+i))) *(stack_top+i)= DLAMCH("o");
 #else
-	    if (signbit(*(stack_top+i))) {
+	  else if (signbit(*(stack_top+i))) *(stack_top+i)= DLAMCH("o");
 #endif
-	      *(stack_top+i)= DLAMCH("o");
-	    }
-	    else {
-	      *(stack_top+i)= 0.0;
-	    }
-	  }
+	  else *(stack_top+i)= 0.0;
 	}
       }
-      break;
+    break;
 
     case OP_FCCHISQR:
       {
 	int i;
-	int one= 1;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
 	/* fprintf(stderr,"exec: OP_FCCHISQR\n"); */
 	if (stack_top < stack_first+RPN_CHUNKSIZE)
 	  BAILOUT("stack underflow on cchisqr!\n");
 	stack_top -= (1*RPN_CHUNKSIZE);
-	for (i=0; i<length; i++) {
-	  cdf_chi(&one, &val, &qval, stack_top+i, stack_top+RPN_CHUNKSIZE+i,
-		&status, &bound);
-	  if (status != 0)
-	    BAILOUT2(" can't get P from chisqr= %f, df= %f\n",
-		     *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i));
-	  *(stack_top+i)= (qval>=val)?val:-qval;
-	}
+	if ((bad= cdf_chi_v(1, length, pval, qval, stack_top,
+			    stack_top+RPN_CHUNKSIZE, &status, &bound)) >= 0)
+	  BAILOUT2(" can't get P from chisqr= %f, df= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad));
+	for (i=0; i<length; i++)
+	  *(stack_top+i)= (qval[i]>=pval[i])?pval[i]:-qval[i];
       }
     break;
     case OP_INV_FCCHISQR:
       {
 	int i;
-	int two= 2;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
-	double x;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
+	double* x= re->cdfBlock+(2*RPN_CHUNKSIZE);
 	/* fprintf(stderr,"exec: OP_INV_FCCHISQR\n"); */
 	if (stack_top < stack_first+RPN_CHUNKSIZE)
 	  BAILOUT("stack underflow on inv_cchisqr!\n");
 	stack_top -= (1*RPN_CHUNKSIZE);
+	unpack_folded_p(stack_top, length, pval, qval);
+	if ((bad= cdf_chi_v(2, length, pval, qval, x, stack_top+RPN_CHUNKSIZE,
+			    &status, &bound)) >= 0)
+	  BAILOUT2(" can't get chisqr from P= %f, df= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad));
 	for (i=0; i<length; i++) {
-	  if (*(stack_top+i)!=0.0) {
-	    if (*(stack_top+i)>=0.0) {
-	      val= *(stack_top+i);
-	      qval= 1.0-val;
-	    }
-	    else {
-	      qval= -(*(stack_top+i));
-	      val= 1.0-qval;
-	    }
-	    cdf_chi(&two, &val, &qval, &x, stack_top+RPN_CHUNKSIZE+i,
-		    &status, &bound);
-	    if (status != 0)
-	      BAILOUT2(" can't get chisqr from P= %f, df= %f\n",
-		       *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i));
-	    *(stack_top+i)= x;
-	  }
-	  else {
-	    /* These values *should* be 0.0 and Inf, but... */
+	  if (*(stack_top+i) != 0.0) *(stack_top+i)= x[i];
+	  /* These values *should* be the exact limits, but... */
 #if ( defined(SGI5) || defined(SGI6) || defined(SGI64) || defined(SGIMP64) )
-	    if (_signbit(*(stack_top+i))) {
+	  else if (_signbit(*(stack_top+i))) *(stack_top+i)= DLAMCH("o");
 #else
-	    if (signbit(*(stack_top+i))) {
+	  else if (signbit(*(stack_top+i))) *(stack_top+i)= DLAMCH("o");
 #endif
-	      *(stack_top+i)= DLAMCH("o");
-	    }
-	    else {
-	      *(stack_top+i)= 0.0;
-	    }
-	  }
+	  else *(stack_top+i)= 0.0;
 	}
       }
     break;
@@ -1735,85 +2615,77 @@ double* rpnRun( RpnEngine* re, long length, long long offset )
     case OP_FCBETA:
       {
 	int i;
-	int one= 1;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
-	double x;
-	double y;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
+	double* x= re->cdfBlock+(2*RPN_CHUNKSIZE);
+	double* y= re->cdfBlock+(3*RPN_CHUNKSIZE);
 	/* fprintf(stderr,"exec: OP_FCBETA\n"); */
 	if (stack_top < stack_first+(2*RPN_CHUNKSIZE))
 	  BAILOUT("stack underflow on cbeta!\n");
 	stack_top -= (2*RPN_CHUNKSIZE);
+	/* The argument is folded like a P value; x==0 and y==0 are
+	 * given their limits directly, and a placeholder computed.
+	 */
 	for (i=0; i<length; i++) {
 	  if (*(stack_top+i)>=0.0) {
-	    x= *(stack_top+i);
-	    y= 1.0-x;
+	    x[i]= *(stack_top+i);
+	    y[i]= 1.0-x[i];
 	  }
 	  else {
-	    y= -(*(stack_top+i));
-	    x= 1.0-y;
-	  }
-	  if (x==0.0) *(stack_top+i)= 0.0;
-	  else if (y==0.0) *(stack_top+i)= -0.0;
-	  else {
-	    cdf_bet(&one, &val, &qval, &x, &y, stack_top+RPN_CHUNKSIZE+i,
-		    stack_top+(2*RPN_CHUNKSIZE)+i, &status, &bound);
-	    if (status != 0)
-	      BAILOUT3("can't get P from Beta= %f, A= %f, B= %f\n",
-		       *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i),
-		       *(stack_top+(2*RPN_CHUNKSIZE)+i));
-	    *(stack_top+i)= (qval>=val)?val:-qval;
+	    y[i]= -(*(stack_top+i));
+	    x[i]= 1.0-y[i];
 	  }
+	  if (x[i]==0.0 || y[i]==0.0) x[i]= y[i]= 0.5;
+	}
+	if ((bad= cdf_bet_v(1, length, pval, qval, x, y,
+			    stack_top+RPN_CHUNKSIZE,
+			    stack_top+(2*RPN_CHUNKSIZE),
+			    &status, &bound)) >= 0)
+	  BAILOUT3("can't get P from Beta= %f, A= %f, B= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad),
+		   *(stack_top+(2*RPN_CHUNKSIZE)+bad));
+	for (i=0; i<length; i++) {
+	  double v= *(stack_top+i);
+	  if (v==0.0 || v==-1.0) *(stack_top+i)= 0.0;
+	  else if (v==1.0) *(stack_top+i)= -0.0;
+	  else *(stack_top+i)= (qval[i]>=pval[i])?pval[i]:-qval[i];
 	}
       }
     break;
     case OP_INV_FCBETA:
       {
 	int i;
-	int two= 2;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
-	double x;
-	double y;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
+	double* x= re->cdfBlock+(2*RPN_CHUNKSIZE);
+	double* y= re->cdfBlock+(3*RPN_CHUNKSIZE);
 	/* fprintf(stderr,"exec: OP_INV_FCBETA\n"); */
 	if (stack_top < stack_first+(2*RPN_CHUNKSIZE))
 	  BAILOUT("stack underflow on inv_cbeta!\n");
 	stack_top -= (2*RPN_CHUNKSIZE);
+	unpack_folded_p(stack_top, length, pval, qval);
+	if ((bad= cdf_bet_v(2, length, pval, qval, x, y,
+			    stack_top+RPN_CHUNKSIZE,
+			    stack_top+(2*RPN_CHUNKSIZE),
+			    &status, &bound)) >= 0)
+	  BAILOUT3(" can't get Beta from P= %f, A= %f, B= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad),
+		   *(stack_top+(2*RPN_CHUNKSIZE)+bad));
 	for (i=0; i<length; i++) {
-	  if (*(stack_top+i)!=0.0) {
-	    if (*(stack_top+i)>=0.0) {
-	      val= *(stack_top+i);
-	      qval= 1.0-val;
-	    }
-	    else {
-	      qval= -(*(stack_top+i));
-	      val= 1.0-qval;
-	    }
-	    cdf_bet(&two, &val, &qval, &x, &y, stack_top+RPN_CHUNKSIZE+i,
-		    stack_top+(2*RPN_CHUNKSIZE)+i, &status, &bound);
-	    if (status != 0)
-	      BAILOUT3(" can't get Beta from P= %f, A= %f, B= %f\n",
-		       *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i),
-		       *(stack_top+(2*RPN_CHUNKSIZE)+i));
-	    *(stack_top+i)= (y>=x)?x:-y;
-	  }
-	  else {
-	    /* These values *should* be 0.0 and 1.0, but... */
+	  if (*(stack_top+i) != 0.0) *(stack_top+i)= (y[i]>=x[i])?x[i]:-y[i];
+	  /* These values *should* be the exact limits, but... */
 #if ( defined(SGI5) || defined(SGI6) || defined(SGI64) || defined(SGIMP64) )
-	    if (_signbit(*(stack_top+i))) {
+	  else if (_signbit(*(stack_top+i))) *(stack_top+i)= 1.0;
 #else
-	    if (signbit(*(stack_top+i))) {
+	  else if (signbit(*(stack_top+i))) *(stack_top+i)= 1.0;
 #endif
-	      *(stack_top+i)= 1.0;
-	    }
-	    else {
-	      *(stack_top+i)= 0.0;
-	    }
-	  }
+	  else *(stack_top+i)= 0.0;
 	}
       }
     break;
@@ -1896,69 +2768,55 @@ double* rpnRun( RpnEngine* re, long length, long long offset )
     case OP_FCGAMMA:
       {
 	int i;
-	int one= 1;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
 	/* fprintf(stderr,"exec: OP_FCGAMMA\n"); */
 	if (stack_top < stack_first+(2*RPN_CHUNKSIZE))
 	  BAILOUT("stack underflow on cgamma!\n");
 	stack_top -= (2*RPN_CHUNKSIZE);
-	for (i=0; i<length; i++) {
-	  cdf_gam(&one, &val, &qval, stack_top+i, stack_top+RPN_CHUNKSIZE+i,
-		stack_top+(2*RPN_CHUNKSIZE)+i, &status, &bound);
-	  if (status != 0)
-	    BAILOUT3(" can't get P from X= %f, shape= %f, scale= %f\n",
-		     *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i),
-		     *(stack_top+(2*RPN_CHUNKSIZE)+i));
-	  *(stack_top+i)= (qval>=val)?val:-qval;
-	}
+	if ((bad= cdf_gam_v(1, length, pval, qval, stack_top,
+			    stack_top+RPN_CHUNKSIZE,
+			    stack_top+(2*RPN_CHUNKSIZE),
+			    &status, &bound)) >= 0)
+	  BAILOUT3(" can't get P from X= %f, shape= %f, scale= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad),
+		   *(stack_top+(2*RPN_CHUNKSIZE)+bad));
+	for (i=0; i<length; i++)
+	  *(stack_top+i)= (qval[i]>=pval[i])?pval[i]:-qval[i];
       }
     break;
     case OP_INV_FCGAMMA:
       {
 	int i;
-	int two= 2;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
-	double x;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
+	double* x= re->cdfBlock+(2*RPN_CHUNKSIZE);
 	/* fprintf(stderr,"exec: OP_INV_FCGAMMA\n"); */
 	if (stack_top < stack_first+(2*RPN_CHUNKSIZE))
 	  BAILOUT("stack underflow on inv_cgamma!\n");
 	stack_top -= (2*RPN_CHUNKSIZE);
+	unpack_folded_p(stack_top, length, pval, qval);
+	if ((bad= cdf_gam_v(2, length, pval, qval, x, stack_top+RPN_CHUNKSIZE,
+			    stack_top+(2*RPN_CHUNKSIZE),
+			    &status, &bound)) >= 0)
+	  BAILOUT3(" can't get X from P= %f, shape= %f, scale= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad),
+		   *(stack_top+(2*RPN_CHUNKSIZE)+bad));
 	for (i=0; i<length; i++) {
-	  if (*(stack_top+i)!=0.0) {
-	    if (*(stack_top+i)>=0.0) {
-	      val= *(stack_top+i);
-	      qval= 1.0-val;
-	    }
-	    else {
-	      qval= -(*(stack_top+i));
-	      val= 1.0-qval;
-	    }
-	    cdf_gam(&two, &val, &qval, &x, stack_top+RPN_CHUNKSIZE+i,
-		    stack_top+(2*RPN_CHUNKSIZE)+i, &status, &bound);
-	    if (status != 0)
-	      BAILOUT3(" can't get X from P= %f, shape= %f, scale= %f\n",
-		       *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i),
-		       *(stack_top+(2*RPN_CHUNKSIZE)+i));
-	    *(stack_top+i)= x;
-	  }
-	  else {
+	  if (*(stack_top+i) != 0.0) *(stack_top+i)= x[i];
+	  /* These values *should* be the exact limits, but... */
 #if ( defined(SGI5) || defined(SGI6) || defined(SGI64) || defined(SGIMP64) )
-	    if (_signbit(*(stack_top+i))) {
+	  else if (_signbit(*(stack_top+i))) *(stack_top+i)= DLAMCH("o");
 #else
-	    if (signbit(*(stack_top+i))) {
+	  else if (signbit(*(stack_top+i))) *(stack_top+i)= DLAMCH("o");
 #endif
-	      *(stack_top+i)= DLAMCH("o");
-	    }
-	    else {
-	      *(stack_top+i)= 0.0;
-	    }
-	  }
+	  else *(stack_top+i)= 0.0;
 	}
       }
     break;
@@ -1966,70 +2824,55 @@ double* rpnRun( RpnEngine* re, long length, long long offset )
     case OP_FCNORMAL:
       {
 	int i;
-	int one= 1;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
 	/* fprintf(stderr,"exec: OP_FCNORMAL\n"); */
 	if (stack_top < stack_first+(2*RPN_CHUNKSIZE))
 	  BAILOUT("stack underflow on cnormal!\n");
 	stack_top -= (2*RPN_CHUNKSIZE);
-	for (i=0; i<length; i++) {
-	  cdf_nor(&one, &val, &qval, stack_top+i, stack_top+RPN_CHUNKSIZE+i,
-		stack_top+(2*RPN_CHUNKSIZE)+i, &status, &bound);
-	  if (status != 0)
-	    BAILOUT3(" can't get P from X= %f, mean= %f, stdv= %f\n",
-		     *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i),
-		     *(stack_top+(2*RPN_CHUNKSIZE)+i));
-	  *(stack_top+i)= (qval>=val)?val:-qval;
-	}
+	if ((bad= cdf_nor_v(1, length, pval, qval, stack_top,
+			    stack_top+RPN_CHUNKSIZE,
+			    stack_top+(2*RPN_CHUNKSIZE),
+			    &status, &bound)) >= 0)
+	  BAILOUT3(" can't get P from X= %f, mean= %f, stdv= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad),
+		   *(stack_top+(2*RPN_CHUNKSIZE)+bad));
+	for (i=0; i<length; i++)
+	  *(stack_top+i)= (qval[i]>=pval[i])?pval[i]:-qval[i];
       }
     break;
     case OP_INV_FCNORMAL:
       {
 	int i;
-	int two= 2;
 	int status;
+	long bad;
 	double bound;
-	double val;
-	double qval;
-	double x;
+	double* pval= re->cdfBlock;
+	double* qval= re->cdfBlock+RPN_CHUNKSIZE;
+	double* x= re->cdfBlock+(2*RPN_CHUNKSIZE);
 	/* fprintf(stderr,"exec: OP_INV_FCNORMAL\n"); */
 	if (stack_top < stack_first+(2*RPN_CHUNKSIZE))
 	  BAILOUT("stack underflow on inv_cnormal!\n");
 	stack_top -= (2*RPN_CHUNKSIZE);
+	unpack_folded_p(stack_top, length, pval, qval);
+	if ((bad= cdf_nor_v(2, length, pval, qval, x, stack_top+RPN_CHUNKSIZE,
+			    stack_top+(2*RPN_CHUNKSIZE),
+			    &status, &bound)) >= 0)
+	  BAILOUT3(" can't get X from P= %f, mean= %f, stdv= %f\n",
+		   *(stack_top+bad),*(stack_top+RPN_CHUNKSIZE+bad),
+		   *(stack_top+(2*RPN_CHUNKSIZE)+bad));
 	for (i=0; i<length; i++) {
-	  if (*(stack_top+i) != 0.0) {
-	    if (*(stack_top+i)>0.0) {
-	      val= *(stack_top+i);
-	      qval= 1.0-val;
-	    }
-	    else {
-	      qval= -(*(stack_top+i));
-	      val= 1.0-qval;
-	    }
-	    cdf_nor(&two, &val, &qval, &x, stack_top+RPN_CHUNKSIZE+i,
-		    stack_top+(2*RPN_CHUNKSIZE)+i, &status, &bound);
-	    if (status != 0)
-	      BAILOUT3(" can't get X from P= %f, mean= %f, stdv= %f\n",
-		       *(stack_top+i),*(stack_top+RPN_CHUNKSIZE+i),
-		       *(stack_top+(2*RPN_CHUNKSIZE)+i));
-	    *(stack_top+i)= x;
-	  }
-	  else {
-	    /* These values *should* be NInf and Inf, but... */
+	  if (*(stack_top+i) != 0.0) *(stack_top+i)= x[i];
+	  /* These values *should* be the exact limits, but... */
 #if ( defined(SGI5) || defined(SGI6) || defined(SGI64) || defined(SGIMP64) )
-	    if (_signbit(*(stack_top+i))) {
+	  else if (_signbit(*(stack_top+i))) *(stack_top+i)= DLAMCH("o");
 #else
-	    if (signbit(*(stack_top+i))) {
+	  else if (signbit(*(stack_top+i))) *(stack_top+i)= DLAMCH("o");
 #endif
-	      *(stack_top+i)= DLAMCH("o");
-	    }
-	    else {
-	      *(stack_top+i)= -DLAMCH("o");
-	    }
-	  }
+	  else *(stack_top+i)= -DLAMCH("o");
 	}
       }
     break;
@@ -2043,7 +2886,9 @@ double* rpnRun( RpnEngine* re, long length, long long offset )
 	  BAILOUT("stack overflow on load random!\n");
 	stack_top += RPN_CHUNKSIZE;
 	for (i=0; i<length; i++) {
-	  do { val= drand48(); } while (val == 0.0);
+	  do {
+	    val= (re->randStreamFlag ? rand_stream_next(re) : drand48());
+	  } while (val == 0.0);
 	  *(stack_top+i)= val;
 	}
 
@@ -2382,6 +3227,10 @@ double* rpnRun( RpnEngine* re, long length, long long offset )
       /* fprintf(stderr,"exec: OP_NOOP\n"); */
       break;
     }
+    if (cdfLocked) {
+      CDF_UNLOCK();
+      cdfLocked= 0;
+    }
 
   }
 
@@ -2417,6 +3266,12 @@ double* rpnRun( RpnEngine* re, long length, long long offset )
 
 static void destroyProgram(Program* prog)
 {
+  if (prog->fused) {
+    long i;
+    for (i=0; i<prog->code_length; i++)
+      if (prog->fused[i]) destroy_fused_segment(prog->fused[i]);
+    free(prog->fused);
+  }
   free(prog->code);
   free(prog);
 }
@@ -2426,6 +3281,7 @@ static void destroyClock(Clock* clock)
   if (clock->limits) free(clock->limits);
   if (clock->strides) free(clock->strides);
   if (clock->string) free(clock->string);
+  free(clock);
 }
 
 RpnEngine* createRpnEngine(const int nInputs_in, void* usrHook_in,
@@ -2462,6 +3318,15 @@ RpnEngine* createRpnEngine(const int nInputs_in, void* usrHook_in,
   result->outfileFlag= 0;
   result->verboseFlag= 0;
   result->debugFlag= 0;
+  result->fuseFlag= 1;
+  result->fuseBlock= NULL;
+  result->fuseBlockSize= 0;
+  if (!(result->cdfBlock=
+	(double*)malloc(4*RPN_CHUNKSIZE*sizeof(double))))
+    Abort("createRpnEngine: unable to allocate %d bytes!\n",
+	  4*RPN_CHUNKSIZE*sizeof(double));
+  result->randStreamFlag= 0;
+  result->randState= 0;
   result->clock= NULL;
   result->program= NULL;
   result->errorString= NULL;
@@ -2486,9 +3351,65 @@ void rpnDestroyEngine( RpnEngine* re )
   }
   if (re->clock) destroyClock(re->clock);
   if (re->program) destroyProgram(re->program);
+  if (re->fuseBlock) free(re->fuseBlock);
+  if (re->cdfBlock) free(re->cdfBlock);
   free(re);
 }
 
+/* Make an engine that runs the same compiled program as re but has
+ * its own stack, so that the two can run in different threads.  The
+ * inputs are passed usrHook_in rather than re's hook.
+ */
+RpnEngine* rpnCloneEngine( RpnEngine* re, void* usrHook_in )
+{
+  RpnEngine* result= createRpnEngine(re->nInputs, usrHook_in,
+				     re->getDimensionsCB, re->getDimExtentCB,
+				     re->getInputCB, re->getInputComplexCB,
+				     re->getMissingCB);
+  result->complexFlag= re->complexFlag;
+  result->outfileFlag= re->outfileFlag;
+  result->verboseFlag= re->verboseFlag;
+  result->fuseFlag= re->fuseFlag;
+  result->randStreamFlag= re->randStreamFlag;
+  result->randState= re->randState;
+
+  if (re->clock) {
+    int n= strlen(re->clock->string);
+    if (!(result->clock=(Clock*)malloc(sizeof(Clock))))
+      Abort("rpnCloneEngine: unable to allocate %d bytes!\n",sizeof(Clock));
+    *(result->clock)= *(re->clock);
+    result->clock->string= strdup(re->clock->string);
+    if (!(result->clock->limits= (int*)malloc(n*sizeof(int))))
+      Abort("rpnCloneEngine: unable to allocate %d bytes!\n",n*sizeof(int));
+    if (!(result->clock->strides= (long long*)malloc(n*sizeof(long long))))
+      Abort("rpnCloneEngine: unable to allocate %d bytes!\n",
+	    n*sizeof(long long));
+    memcpy(result->clock->limits, re->clock->limits, n*sizeof(int));
+    memcpy(result->clock->strides, re->clock->strides, n*sizeof(long long));
+  }
+
+  if (re->program) {
+    Program* prog;
+    if (!(prog=(Program*)malloc(sizeof(Program))))
+      Abort("rpnCloneEngine: unable to allocate %d bytes!\n",sizeof(Program));
+    prog->code_length= re->program->code_length;
+    if (!(prog->code=(Instruction*)malloc((prog->code_length ? 
+					   prog->code_length : 1)
+					  *sizeof(Instruction))))
+      Abort("rpnCloneEngine: unable to allocate %d bytes!\n",
+	    prog->code_length*sizeof(Instruction));
+    memcpy(prog->code, re->program->code,
+	   prog->code_length*sizeof(Instruction));
+    prog->fused= NULL;
+    fuse_program(result, prog);
+    result->program= prog;
+  }
+
+  /* Set after fusing so the segment listing is only printed once */
+  result->debugFlag= re->debugFlag;
+  return result;
+}
+
 const char* rpnGetErrorString(RpnEngine* re)
 {
   return re->errorString;
@@ -2503,6 +3424,7 @@ int rpnCompile( RpnEngine* re, const char* script )
     return 0;
   }
   free(myScript);
+  fuse_program(re, re->program);
   return 1;
 }
 
@@ -2512,6 +3434,7 @@ int rpnCompileFile( RpnEngine* re, const char* fname )
     setErrorStr(re,"error compiling script file <%s>!\n",fname);
     return 0;
   }
+  fuse_program(re, re->program);
   return 1;
 }
 
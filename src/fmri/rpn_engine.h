@@ -62,9 +62,12 @@ typedef struct instruction_struct {
     } param;
 } Instruction;
 
+struct fused_segment_struct; /* private to rpn_engine.c */
+
 typedef struct program_struct {
   Instruction* code;
   long code_length;
+  struct fused_segment_struct** fused; /* per instruction, or NULL */
 } Program;
 
 typedef struct parsepair_struct {
@@ -104,6 +107,12 @@ typedef struct rpn_engine_struct {
   int outfileFlag; /* will we be producing output, or just printing? */
   int verboseFlag;
   int debugFlag;
+  int fuseFlag; /* run straight-line op sequences as fused tiles */
+  double* fuseBlock; /* tile registers and load buffers for fusion */
+  long fuseBlockSize;
+  double* cdfBlock; /* P, Q and X buffers for the cdf ops */
+  int randStreamFlag; /* use randState rather than drand48() for rand */
+  unsigned long long randState;
   char* errorString;
 } RpnEngine;
 	
@@ -123,6 +132,7 @@ RpnEngine* createRpnEngine(const int nInputs_in, void* usrHook_in,
 						     double* buf2, void* hook),
 			   int (*missingCB_in)(const long z, const long t,
 					       void* hook));
+RpnEngine* rpnCloneEngine( RpnEngine* re, void* usrHook_in );
 void rpnDestroyEngine( RpnEngine* re );
 int rpnInit( RpnEngine* re);
 int rpnCompile( RpnEngine* re, const char* script );
@@ -133,3 +143,5 @@ void rpnSetOutputFlag(RpnEngine* re, int flag);
 void rpnSetVerbose(RpnEngine* re, int flag);
 void rpnSetDebug(RpnEngine* re, int flag);
 void rpnSetComplex(RpnEngine* re, int flag);
+void rpnSetFusion(RpnEngine* re, int flag);
+void rpnSetRandomStream(RpnEngine* re, long seed, long long stream);
@@ -0,0 +1,435 @@
+/************************************************************
+ *                                                          *
+ *  rpn_engine_tester.c                                     *
+ *                                                          *
+ *  Permission is hereby granted to any individual or       *
+ *  institution for use, copying, or redistribution of      *
+ *  this code and associated documentation, provided        *
+ *  that such code and documentation are not sold for       *
+ *  profit and the following copyright notice is retained   *
+ *  in the code and documentation:                          *
+ *                                                          *
+ *  Copyright (c) 1999 Department of Statistics             *
+ *                     Carnegie Mellon University           *
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ *                                                          *
+ ************************************************************/
+
+/* This program checks the fused evaluator in rpn_engine against the
+ * op-at-a-time interpreter.  Each script is run over some synthetic
+ * inputs (including NaNs, infinities and signed zeros) by two engines,
+ * one with fusion disabled, and every live stack slot must agree bit
+ * for bit.  The one exception is the sign of a NaN, which depends on
+ * the order in which the compiler happens to put the operands of a
+ * commutative op.  Scripts that fail must fail the same way.  A set of fixed
+ * scripts is followed by randomly generated ones.  The fixed scripts are
+ * then rerun on an engine made by rpnCloneEngine, chunk by chunk in
+ * reverse order, to check that clones and per-chunk random streams
+ * reproduce the original results.  Finally the time per voxel of a
+ * typical thresholding expression is reported.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <sys/time.h>
+#include "mri.h"
+#include "fmri.h"
+
+#define N_INPUTS 3
+#define MAX_SCRIPT 1024
+
+static char* fixed_scripts[]= {
+  "$1,$2,-,abs,3,>",
+  "$1,$2,+,$3,*,2,/",
+  "$1,dup,*,$2,dup,*,+,sqrt",
+  "$1,0.5,>=,$2,$3,rot_3,if_keep",
+  "$1,$2,$3,if_keep,1,+",
+  "2,3,+,$1,*",
+  "1,$1,-,$1,1,-,/",
+  "$1,$2,min,$3,max,$1,swap,-",
+  "$1,$2,swap,-,$3,swap,/",
+  "$1,foldp",
+  "$1,inv_foldp",
+  "$1,is_finite,$1,0,swap,if_keep",
+  "$1,signbit,$2,round,+,$3,floor,-,$1,ceiling,*",
+  "$x,$y,+,$z,-,$t,*,$xdim,/",
+  "$1,$2,$3,rot_-3,-,/",
+  "$1,$2,$3,dup,rot_4,pop,+,+",
+  "$1,exp,ln,sin,cos,atan,$2,tan,+",
+  "$1,0.25,*,asin,$2,0.25,*,acos,-",
+  "$1,$2,==,$1,$2,!=,+,$1,$2,<=,*,$1,$2,<,+",
+  "$1,1,if_keep",
+  "3,$1,$2,0,if_keep",
+  "$1,$2,pop,pop",
+  "$1,$2,abs,1,+,%,$3,+",
+  "$1,$2,and,$3,+",
+  "$1,dup,rand,pop,swap,-",
+  "$1,$2,$3,1,switch_2,+",
+  "$1,$2,$3,2,switch_2,+",
+  "$1,inf,min,ninf,max,nan,+",
+  "$1,$2,$3,dup,dup,dup,rot_6,rot_-5,swap,pop,*,+,-,/,max",
+  "+",
+  "$1,pop,pop",
+  "$1,swap",
+  "$1,rot_4",
+  NULL
+};
+
+/* These run in complex mode, where loads push two slots */
+static char* complex_scripts[]= {
+  "$1,$2,cx_+,2,*",
+  "$1,swap,3,+,swap,cx_mag,1,-,abs",
+  "$1,$2,cx_*,swap,dup,*,swap,dup,*,+,sqrt",
+  "$1,$2,$3,rot_-3,0.5,>,rot_3,cx_if_keep,min",
+  NULL
+};
+
+static char* random_ops[]= {
+  "+", "-", "*", "/", ">", "<", "==", ">=", "<=", "!=", "min", "max",
+  "sqrt", "abs", "ln", "exp", "sin", "round", "floor", "ceiling",
+  "is_finite", "signbit", "dup", "swap", "pop", "if_keep", "rot_3",
+  "rot_-3", "$1", "$2", "$3", "$t", "$xdim", "0", "1", "-2.5", "0.5",
+  "rand", "and"
+};
+static unsigned short script_seed[3]= { 1, 2, 3 };
+
+static long extents[4]= { 17, 13, 9, 5 };
+static double* inputs[N_INPUTS];
+
+static double now()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6*tv.tv_usec;
+}
+
+static const char* dimensionsCB(const int which, void* hook)
+{
+  return "xyzt";
+}
+
+static const long extentCB(const int which, const char dim, void* hook)
+{
+  switch (dim) {
+  case 'x': return extents[0];
+  case 'y': return extents[1];
+  case 'z': return extents[2];
+  case 't': return extents[3];
+  default: return 1;
+  }
+}
+
+static void inputCB(const int which, const long n, const long long offset,
+		    double* buf, void* hook)
+{
+  memcpy(buf, inputs[which]+offset, n*sizeof(double));
+}
+
+static void inputComplexCB(const int which, const long n,
+			   const long long offset, double* buf1,
+			   double* buf2, void* hook)
+{
+  long i;
+  for (i=0; i<n; i++) {
+    buf1[i]= inputs[which][offset+i];
+    buf2[i]= 0.0;
+  }
+}
+
+static int missingCB(const long z, const long t, void* hook)
+{
+  return 0;
+}
+
+static int same_value(double a, double b)
+{
+  if (isnan(a) && isnan(b)) return 1;
+  return !memcmp(&a, &b, sizeof(double));
+}
+
+static RpnEngine* make_engine(const char* script, int fuse, int complex,
+			      int* ok)
+{
+  RpnEngine* re= createRpnEngine(N_INPUTS, NULL, dimensionsCB, extentCB,
+				 inputCB, inputComplexCB, missingCB);
+  rpnSetOutputFlag(re,1);
+  rpnSetComplex(re,complex);
+  rpnSetFusion(re,fuse);
+  *ok= (rpnInit(re) && rpnCompile(re,script));
+  return re;
+}
+
+/* Returns 1 if fused and interpreted runs of the script agree */
+static int check_script(const char* script, long nvox, int complex)
+{
+  RpnEngine* plain;
+  RpnEngine* fused;
+  int ok1;
+  int ok2;
+  int result= 1;
+  long long offset;
+
+  plain= make_engine(script, 0, complex, &ok1);
+  fused= make_engine(script, 1, complex, &ok2);
+  if (!ok1 || !ok2) {
+    fprintf(stderr,"<%s>: compile failed: %s\n",script,
+	    rpnGetErrorString(ok1 ? fused : plain));
+    rpnDestroyEngine(plain);
+    rpnDestroyEngine(fused);
+    return 0;
+  }
+
+  for (offset=0; offset<nvox && result; offset += RPN_CHUNKSIZE) {
+    long n= (nvox-offset < RPN_CHUNKSIZE) ? nvox-offset : RPN_CHUNKSIZE;
+    double* top1;
+    double* top2;
+    srand48(offset);
+    top1= rpnRun(plain, n, offset);
+    srand48(offset);
+    top2= rpnRun(fused, n, offset);
+    if (!top1 || !top2) {
+      if (top1 || top2
+	  || strcmp(rpnGetErrorString(plain), rpnGetErrorString(fused))) {
+	fprintf(stderr,"<%s>: failure mismatch: <%s> vs <%s>\n", script,
+		top1 ? "ok" : rpnGetErrorString(plain),
+		top2 ? "ok" : rpnGetErrorString(fused));
+	result= 0;
+      }
+      break;
+    }
+    else {
+      long depth1= (top1-plain->stackBlock[0])/RPN_CHUNKSIZE;
+      long depth2= (top2-fused->stackBlock[0])/RPN_CHUNKSIZE;
+      long slot;
+      if (depth1 != depth2) {
+	fprintf(stderr,"<%s>: stack depth %ld vs %ld\n",script,
+		depth1+1,depth2+1);
+	result= 0;
+      }
+      for (slot=0; slot<=depth1 && result; slot++) {
+	long i;
+	for (i=0; i<n; i++)
+	  if (!same_value(plain->stackBlock[slot][i],
+			  fused->stackBlock[slot][i])) break;
+	if (i<n) {
+	  fprintf(stderr,"<%s>: slot %ld differs at %lld: %.17g vs %.17g\n",
+		  script, slot, offset+i, plain->stackBlock[slot][i],
+		  fused->stackBlock[slot][i]);
+	  result= 0;
+	}
+      }
+    }
+  }
+
+  rpnDestroyEngine(plain);
+  rpnDestroyEngine(fused);
+  return result;
+}
+
+/* Returns 1 if a cloned engine, running the chunks in reverse order
+ * with per-chunk random streams, gets the same answers as the original.
+ * A script that fails must fail on the same chunk in the same way.
+ */
+static int check_clone(const char* script, long nvox)
+{
+  RpnEngine* re;
+  RpnEngine* clone;
+  double* saved;
+  char* err= NULL;
+  int ok;
+  int result= 1;
+  long long offset;
+  long long last= ((nvox-1)/RPN_CHUNKSIZE)*RPN_CHUNKSIZE;
+
+  re= make_engine(script, 1, 0, &ok);
+  if (!ok) {
+    fprintf(stderr,"<%s>: compile failed: %s\n",script,rpnGetErrorString(re));
+    rpnDestroyEngine(re);
+    return 0;
+  }
+  clone= rpnCloneEngine(re, NULL);
+  if (!(saved= (double*)malloc(nvox*sizeof(double))))
+    Abort("rpn_engine_tester: unable to allocate %d bytes!\n",
+	  nvox*sizeof(double));
+
+  for (offset=0; offset<nvox; offset += RPN_CHUNKSIZE) {
+    long n= (nvox-offset < RPN_CHUNKSIZE) ? nvox-offset : RPN_CHUNKSIZE;
+    double* top;
+    rpnSetRandomStream(re, 17, offset/RPN_CHUNKSIZE);
+    if (!(top= rpnRun(re, n, offset))) {
+      err= strdup(rpnGetErrorString(re));
+      last= offset;
+      break;
+    }
+    memcpy(saved+offset, top, n*sizeof(double));
+  }
+  for (offset=last; offset>=0 && result; offset -= RPN_CHUNKSIZE) {
+    long n= (nvox-offset < RPN_CHUNKSIZE) ? nvox-offset : RPN_CHUNKSIZE;
+    double* top;
+    long i;
+    rpnSetRandomStream(clone, 17, offset/RPN_CHUNKSIZE);
+    top= rpnRun(clone, n, offset);
+    if (err && offset==last) {
+      if (top || strcmp(err, rpnGetErrorString(clone))) {
+	fprintf(stderr,"<%s>: clone failure mismatch: <%s> vs <%s>\n", 
+		script, err, top ? "ok" : rpnGetErrorString(clone));
+	result= 0;
+      }
+      continue;
+    }
+    if (!top) {
+      fprintf(stderr,"<%s>: clone failed: %s\n",script,
+	      rpnGetErrorString(clone));
+      result= 0;
+      break;
+    }
+    for (i=0; i<n; i++)
+      if (!same_value(saved[offset+i], top[i])) break;
+    if (i<n) {
+      fprintf(stderr,"<%s>: clone differs at %lld: %.17g vs %.17g\n",
+	      script, offset+i, saved[offset+i], top[i]);
+      result= 0;
+    }
+  }
+
+  if (err) free(err);
+  free(saved);
+  rpnDestroyEngine(clone);
+  rpnDestroyEngine(re);
+  return result;
+}
+
+static void random_script(char* buf, long size)
+{
+  int depth= 0;
+  int len= 2 + (int)(nrand48(script_seed) % 25);
+  int i;
+
+  buf[0]= '\0';
+  for (i=0; i<len; i++) {
+    const char* tok;
+    if (depth<2 && (nrand48(script_seed)%3)) {
+      /* mostly keep the stack deep enough to be interesting */
+      tok= random_ops[28 + nrand48(script_seed)%8];
+    }
+    else tok= random_ops[nrand48(script_seed)
+			 % (sizeof(random_ops)/sizeof(char*))];
+    /* dup of an empty stack reads outside the stack in either engine */
+    if (depth==0 && !strcmp(tok,"dup")) tok= "$1";
+    if (strlen(buf)+strlen(tok)+2 >= size) break;
+    if (buf[0]) strcat(buf,",");
+    strcat(buf,tok);
+    if (tok[0]=='$' || isdigit(tok[0]) || (tok[0]=='-' && tok[1])
+	|| !strcmp(tok,"dup") || !strcmp(tok,"rand")) depth++;
+    else if (!strcmp(tok,"if_keep")) depth -= 2;
+    else if (strchr("+-*/<>=!",tok[0]) || !strcmp(tok,"min")
+	     || !strcmp(tok,"max") || !strcmp(tok,"pop")) depth--;
+    if (depth<0) break; /* the rest would never run */
+  }
+}
+
+static double time_script(const char* script, long nvox, int fuse)
+{
+  RpnEngine* re;
+  int ok;
+  long long offset;
+  double start;
+
+  re= make_engine(script, fuse, 0, &ok);
+  if (!ok) Abort("rpn_engine_tester: cannot compile <%s>!\n",script);
+  start= now();
+  for (offset=0; offset<nvox; offset += RPN_CHUNKSIZE) {
+    long n= (nvox-offset < RPN_CHUNKSIZE) ? nvox-offset : RPN_CHUNKSIZE;
+    if (!rpnRun(re, n, offset))
+      Abort("rpn_engine_tester: <%s> failed: %s\n",script,
+	    rpnGetErrorString(re));
+  }
+  rpnDestroyEngine(re);
+  return now()-start;
+}
+
+int main( int argc, char* argv[] )
+{
+  long nvox= extents[0]*extents[1]*extents[2]*extents[3];
+  long timing_vox;
+  long i;
+  int j;
+  int nRandom= 2000;
+  int nChecked= 0;
+  int failures= 0;
+  char buf[MAX_SCRIPT];
+
+  if (argc>1) nRandom= atoi(argv[1]);
+
+  /* Inputs are big enough to be used for the timing test too */
+  timing_vox= 64*64*32*4;
+  for (j=0; j<N_INPUTS; j++) {
+    if (!(inputs[j]= (double*)malloc(timing_vox*sizeof(double))))
+      Abort("rpn_engine_tester: unable to allocate %d bytes!\n",
+	    timing_vox*sizeof(double));
+    for (i=0; i<timing_vox; i++) inputs[j][i]= 8.0*(drand48()-0.5);
+  }
+  for (i=0; i<nvox; i+=37) {
+    inputs[0][i]= 0.0;
+    inputs[1][(i+5)%nvox]= -0.0;
+    inputs[2][(i+11)%nvox]= 1.0;
+  }
+  for (i=3; i<nvox; i+=101) {
+    inputs[0][i]= log(-1.0);
+    inputs[1][(i+7)%nvox]= -log(0.0);
+    inputs[2][(i+13)%nvox]= log(0.0);
+    inputs[1][(i+17)%nvox]= inputs[0][(i+17)%nvox];
+  }
+
+  for (j=0; fixed_scripts[j]; j++) {
+    if (!check_script(fixed_scripts[j], nvox, 0)) failures++;
+    nChecked++;
+  }
+  for (j=0; complex_scripts[j]; j++) {
+    if (!check_script(complex_scripts[j], nvox, 1)) failures++;
+    nChecked++;
+  }
+  for (j=0; j<nRandom; j++) {
+    random_script(buf, sizeof(buf));
+    if (!check_script(buf, nvox, 0)) failures++;
+    nChecked++;
+  }
+  for (j=0; fixed_scripts[j]; j++) {
+    if (!check_clone(fixed_scripts[j], nvox)) failures++;
+    nChecked++;
+  }
+  if (!check_clone("rand,$1,*,rand,+,$2,abs,1,3,cf,-", nvox)) failures++;
+  nChecked++;
+  fprintf(stderr,"%d of %d scripts agree\n",nChecked-failures,nChecked);
+
+  for (j=0; j<4; j++) {
+    double tPlain= time_script(fixed_scripts[j], timing_vox, 0);
+    double tFused= time_script(fixed_scripts[j], timing_vox, 1);
+    fprintf(stderr,"<%s>: %.2f ns/voxel interpreted, %.2f ns/voxel fused\n",
+	    fixed_scripts[j], 1.0e9*tPlain/timing_vox,
+	    1.0e9*tFused/timing_vox);
+  }
+
+  if (failures) {
+    fprintf(stderr,"rpn_engine_tester: %d failures!\n",failures);
+    return 1;
+  }
+  fprintf(stderr,"rpn_engine_tester: all tests passed\n");
+  return 0;
+}
@@ -38,9 +38,55 @@
 #include "fmri.h" /* Includes smoother.h */
 #include "misc.h"
 #include "stdcrg.h"
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif
+
+#if defined(__GNUC__) && (__GNUC__ >= 5) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SM_X86_SIMD
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX __attribute__((target("avx")))
+#endif
 
 /* Notes:
   -At this moment, smoother->k is unused.
+  -The median smoother slides a running median along the data, so
+   each output costs log(bandwidth) rather than a sort of the window.
+   With a threshold the window bounds depend on the data, so each
+   window is instead gathered and its median found by selection.
+   A window with no non-missing samples passes its center through.
+  -The fftgauss and iirgauss smoothers use the Gaussian kernel, but
+   compute the normalized convolution conv(data*mask)/conv(mask) over
+   the whole series at once rather than a weighted sum per sample.
+   The mask is 1 for valid samples and 0 for missing ones, and the
+   series is treated as zero beyond its ends, so this is what
+   kernel_smooth computes.  The data are centered on their mean first
+   to keep the rounding error of the long sums small.
+  -fftgauss convolves by FFT, padding the series by the kernel's reach
+   so the circular convolution does not wrap.  Each complex transform
+   carries two real series; for groups the mask smooths once for all.
+  -iirgauss uses Deriche's fourth order recursive Gaussian, which
+   costs a few operations per sample whatever the bandwidth.  Its
+   causal and anticausal halves both start from rest at the ends of
+   the series, which is exactly the zero extension.  The kernel is
+   a fit, good to about 5e-4 of the peak weight.
+  -Where the smoothed mask is nearly zero (a sample far from any valid
+   data) the ratio is unreliable, and the output is computed directly.
+  -Thresholds make the window depend on the data, which neither fast
+   method can do, so with a threshold both fall back to kernel_smooth.
+   So does iirgauss for bandwidths too narrow for the recursive form.
+  -smooth_tile smooths many series stored voxel-fast, as they come
+   from a dataset with t outermost.  For the kernel smoothers the
+   weights for each output sample are worked out once per tile and
+   applied to a row of adjacent voxels with SSE2 or AVX, picked at
+   run time; the sums are done in double in the same order as
+   kernel_smooth, so the results are identical.  Kernel weights which
+   have underflowed to zero are skipped.  Other smoothers, and kernel
+   smoothing with a threshold, do the tile one series at a time.
+  -kernel_smooth_group without a threshold transposes its group into
+   a tile, so it too accumulates in double.
 */
 
 static char rcsid[] = "$Id: smoother.c,v 1.17 2007/03/21 23:50:20 welling Exp $";
@@ -75,6 +121,8 @@ void sm_parse_cl_opts()
     else if (!strncasecmp(buf,"linterp",7)) default_type= SM_LINTERP;
     else if (!strncasecmp(buf,"runningsum",10)) default_type= SM_RUNNINGSUM;
     else if (!strncasecmp(buf,"median",10)) default_type= SM_MEDIAN;
+    else if (!strncasecmp(buf,"fftgauss",8)) default_type= SM_GAUSSIAN_FFT;
+    else if (!strncasecmp(buf,"iirgauss",8)) default_type= SM_GAUSSIAN_IIR;
     else Abort("sm_parse_cl_opts: unknown smoother type <%s>\n",buf);
   }
   (void)cl_get("smoother_bandwidth","%option %lf",&default_bandwidth);
@@ -122,6 +170,15 @@ static void trim_bounds_group( Smoother* sm, int here, int* low, int* high,
   }
 }
 
+static int sm_is_missing( Smoother* sm, unsigned char** missing,
+			  int i, int z )
+{
+  if (!missing) return 0;
+  if (sm->smDim=='t') return missing[i][z];
+  else if (sm->smDim=='z') return missing[z][i];
+  else return 0;
+}
+
 static void check_kernel( Smoother* sm, int n )
 {
   double* kernel;
@@ -138,6 +195,8 @@ static void check_kernel( Smoother* sm, int n )
   sm->data= (void*)kernel;
   switch (sm->type) {
   case SM_GAUSSIAN:
+  case SM_GAUSSIAN_FFT:
+  case SM_GAUSSIAN_IIR:
     for (i=0; i<n; i++) {
       double dist= (double)i/sm->bandwidth;
       kernel[i]= exp(-dist*dist);
@@ -259,6 +318,231 @@ static void kernel_smooth( Smoother* sm,
 
 }
 
+/* Voxels per tile in the tile smoothers */
+#define SM_TILE_VOXELS 256
+
+/* A tile row function sets out[v] to the weighted sum over t of
+ * in[ks[t]*stride + v] with weights ws[t], divided by total, for
+ * nv voxels v.  The sum is accumulated in double in order of t, as
+ * kernel_smooth does, so every version gives identical results.
+ */
+typedef void (*TileRowFunc)( const float* in, long stride, const int* ks,
+			     const double* ws, int nk, double total,
+			     float* out, int nv );
+
+static void tile_row_scalar( const float* in, long stride, const int* ks,
+			     const double* ws, int nk, double total,
+			     float* out, int nv )
+{
+  int v;
+  int t;
+
+  for (v=0; v<nv; v++) {
+    double val= 0.0;
+    for (t=0; t<nk; t++) val += ws[t]*in[ks[t]*stride + v];
+    out[v]= val/total;
+  }
+}
+
+#ifdef SM_X86_SIMD
+
+TARGET_SSE2 static void tile_row_sse2( const float* in, long stride, 
+				       const int* ks, const double* ws, 
+				       int nk, double total,
+				       float* out, int nv )
+{
+  __m128d tot= _mm_set1_pd(total);
+  int v;
+  int t;
+
+  for (v=0; v+4<=nv; v+=4) {
+    __m128d acc0= _mm_setzero_pd();
+    __m128d acc1= _mm_setzero_pd();
+    for (t=0; t<nk; t++) {
+      __m128 x= _mm_loadu_ps(in + ks[t]*stride + v);
+      __m128d w= _mm_set1_pd(ws[t]);
+      acc0= _mm_add_pd(acc0, _mm_mul_pd(w, _mm_cvtps_pd(x)));
+      acc1= _mm_add_pd(acc1, 
+		       _mm_mul_pd(w, _mm_cvtps_pd(_mm_movehl_ps(x,x))));
+    }
+    _mm_storeu_ps(out+v, _mm_movelh_ps(_mm_cvtpd_ps(_mm_div_pd(acc0,tot)),
+				       _mm_cvtpd_ps(_mm_div_pd(acc1,tot))));
+  }
+  if (v<nv) tile_row_scalar(in+v, stride, ks, ws, nk, total, out+v, nv-v);
+}
+
+TARGET_AVX static void tile_row_avx( const float* in, long stride, 
+				     const int* ks, const double* ws, 
+				     int nk, double total,
+				     float* out, int nv )
+{
+  __m256d tot= _mm256_set1_pd(total);
+  int v;
+  int t;
+
+  for (v=0; v+8<=nv; v+=8) {
+    __m256d acc0= _mm256_setzero_pd();
+    __m256d acc1= _mm256_setzero_pd();
+    for (t=0; t<nk; t++) {
+      __m256 x= _mm256_loadu_ps(in + ks[t]*stride + v);
+      __m256d w= _mm256_set1_pd(ws[t]);
+      acc0= _mm256_add_pd(acc0, 
+			  _mm256_mul_pd(w, 
+					_mm256_cvtps_pd(_mm256_castps256_ps128(x))));
+      acc1= _mm256_add_pd(acc1, 
+			  _mm256_mul_pd(w, 
+					_mm256_cvtps_pd(_mm256_extractf128_ps(x,1))));
+    }
+    _mm_storeu_ps(out+v, _mm256_cvtpd_ps(_mm256_div_pd(acc0,tot)));
+    _mm_storeu_ps(out+v+4, _mm256_cvtpd_ps(_mm256_div_pd(acc1,tot)));
+  }
+  _mm256_zeroupper();
+  if (v<nv) tile_row_sse2(in+v, stride, ks, ws, nk, total, out+v, nv-v);
+}
+
+#endif
+
+static TileRowFunc tile_row= NULL;
+
+static void choose_tile_row()
+{
+  tile_row= tile_row_scalar;
+#ifdef SM_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx")) tile_row= tile_row_avx;
+  else if (__builtin_cpu_supports("sse2")) tile_row= tile_row_sse2;
+#endif
+}
+
+static TileRowFunc get_tile_row()
+{
+#ifdef USE_PTHREAD
+  static pthread_once_t tile_row_once= PTHREAD_ONCE_INIT;
+  pthread_once(&tile_row_once, choose_tile_row);
+#else
+  if (!tile_row) choose_tile_row();
+#endif
+  return tile_row;
+}
+
+static void kernel_tile_core( Smoother* sm, float* data_in, float* data_out,
+			      int n, int nvox, long stride,
+			      unsigned char** missing, int z )
+{
+  /* Sample i of voxel v is at data_in[i*stride+v].  The kernel
+   * weights for each output sample are gathered once and applied
+   * across the voxels of a tile, which are adjacent in memory.
+   */
+  TileRowFunc rowFunc= get_tile_row();
+  double* kernel;
+  double* ws;
+  int* ks;
+  int reach;
+  int i;
+  int k;
+  int v0;
+
+  check_kernel(sm, n);
+  kernel= (double*)sm->data;
+  /* Weights which have underflowed to zero add nothing */
+  reach= sm->last;
+  while (reach>0 && kernel[reach]==0.0) reach--;
+
+  if (!(ks=(int*)malloc((2*reach+1)*sizeof(int))))
+    Abort("smoother:kernel_tile_core: unable to allocate %d ints!\n",
+	  2*reach+1);
+  if (!(ws=(double*)malloc((2*reach+1)*sizeof(double))))
+    Abort("smoother:kernel_tile_core: unable to allocate %d doubles!\n",
+	  2*reach+1);
+
+  for (v0=0; v0<nvox; v0 += SM_TILE_VOXELS) {
+    int nv= (nvox-v0 < SM_TILE_VOXELS) ? nvox-v0 : SM_TILE_VOXELS;
+    for (i=0; i<n; i++) {
+      int low= (i-reach > 0) ? i-reach : 0;
+      int high= (i+reach < n-1) ? i+reach : n-1;
+      double total_weight= 0.0;
+      int nk= 0;
+      for (k=low; k<=high; k++) {
+	if (!sm_is_missing(sm, missing, k, z)) {
+	  ks[nk]= k;
+	  ws[nk]= kernel[(k<i) ? i-k : k-i];
+	  total_weight += ws[nk];
+	  nk++;
+	}
+      }
+      if (total_weight != 0.0)
+	(*rowFunc)(data_in+v0, stride, ks, ws, nk, total_weight,
+		   data_out+i*stride+v0, nv);
+    }
+  }
+
+  free(ks);
+  free(ws);
+}
+
+static void generic_smooth_tile( Smoother* sm, 
+				 float* data_in, float* data_out, int n,
+				 int nvox, long stride,
+				 unsigned char** missing, int z )
+{
+  /* Smooth each voxel's series separately with sm->smooth */
+  float* ibuf;
+  float* obuf;
+  int i;
+  int v;
+
+  if (!(ibuf=(float*)malloc(2*n*sizeof(float))))
+    Abort("smoother:generic_smooth_tile: unable to allocate %d floats!\n",
+	  2*n);
+  obuf= ibuf+n;
+  for (v=0; v<nvox; v++) {
+    for (i=0; i<n; i++) {
+      ibuf[i]= data_in[i*stride+v];
+      obuf[i]= data_out[i*stride+v];
+    }
+    (*(sm->smooth))(sm, ibuf, obuf, n, missing, z);
+    for (i=0; i<n; i++) data_out[i*stride+v]= obuf[i];
+  }
+  free(ibuf);
+}
+
+static void kernel_smooth_tile( Smoother* sm, 
+				float* data_in, float* data_out, int n,
+				int nvox, long stride,
+				unsigned char** missing, int z )
+{
+  if (sm->threshold>0.0) 
+    generic_smooth_tile(sm, data_in, data_out, n, nvox, stride, missing, z);
+  else kernel_tile_core(sm, data_in, data_out, n, nvox, stride, missing, z);
+}
+
+static void kernel_smooth_group_tiled( Smoother* sm,
+				       float** dtbl_in, float** dtbl_out, 
+				       int ndata, int n,
+				       unsigned char** missing, int z )
+{
+  /* Transpose the group so that the series are adjacent, and smooth
+   * them all at once.  Samples with no weight at all come out 0, as
+   * they always have for groups.
+   */
+  float* tin;
+  float* tout;
+  int i;
+  int j;
+
+  if (!(tin=(float*)malloc(2*(long)n*ndata*sizeof(float))))
+    Abort("smoother:kernel_smooth_group: unable to allocate %ld floats!\n",
+	  2*(long)n*ndata);
+  tout= tin + (long)n*ndata;
+  for (j=0; j<ndata; j++)
+    for (i=0; i<n; i++) tin[(long)i*ndata+j]= dtbl_in[j][i];
+  memset(tout, 0, (long)n*ndata*sizeof(float));
+  kernel_tile_core(sm, tin, tout, n, ndata, ndata, missing, z);
+  for (j=0; j<ndata; j++)
+    for (i=0; i<n; i++) dtbl_out[j][i]= tout[(long)i*ndata+j];
+  free(tin);
+}
+
 static void kernel_smooth_group( Smoother* sm,
 				 float** dtbl_in, float** dtbl_out, 
 				 int ndata, int n,
@@ -272,6 +556,11 @@ static void kernel_smooth_group( Smoother* sm,
   int band_high;
   double* kernel;
 
+  if (sm->threshold<=0.0) {
+    kernel_smooth_group_tiled(sm, dtbl_in, dtbl_out, ndata, n, missing, z);
+    return;
+  }
+
   check_kernel(sm, n);
   kernel= (double*)sm->data;
 
@@ -489,13 +778,46 @@ static void check_sortbuf( Smoother* sm, int n )
   sm->data= (void*)sortbuf;
 }
 
-static int compare_floats( const void *p1, const void *p2 )
+static void median_slide( Smoother* sm, RunningMedian* rm,
+			  float* data_in, float* data_out, int n,
+			  unsigned char** missing, int z, int half_band )
 {
-  float* f1= (float*)p1;
-  float* f2= (float*)p2;
-  if (*f1<*f2) return -1;
-  else if (*f1>*f2) return 1;
-  else return 0;
+  /* Without thresholding both ends of the window only move forward,
+   * so each sample enters and leaves the running median once.
+   */
+  int i;
+  int k;
+  int prevLow= 0;
+  int prevHigh= -1;
+
+  os_rm_clear(rm);
+  for (i=0; i<n; i++) {
+    int low= i-half_band;
+    int high= i+(half_band-1);
+    if (low<0) low= 0;
+    if (high>=n) high=n-1;
+    for (k=prevLow; k<low && k<=prevHigh; k++) os_rm_remove(rm, k);
+    for (k=(prevHigh<low) ? low : prevHigh+1; k<=high; k++)
+      if (!sm_is_missing(sm, missing, k, z)) 
+	os_rm_insert(rm, k, data_in[k]);
+    if (high>prevHigh) prevHigh= high;
+    prevLow= low;
+    if (os_rm_count(rm)) data_out[i]= (float)os_rm_median(rm);
+    else data_out[i]= data_in[i];
+  }
+}
+
+static void median_select( Smoother* sm, float* sortbuf,
+			   float* data_in, float* data_out, int i, 
+			   int low, int high, unsigned char** missing, int z )
+{
+  int nSort= 0;
+  int j;
+
+  for (j=low; j<=high; j++)
+    if (!sm_is_missing(sm, missing, j, z)) sortbuf[nSort++]= data_in[j];
+  if (nSort) data_out[i]= os_select_float(sortbuf, nSort, nSort/2);
+  else data_out[i]= data_in[i];
 }
 
 static void median_smooth( Smoother* sm, 
@@ -506,41 +828,24 @@ static void median_smooth( Smoother* sm,
   int half_band= (int)(rint(0.5*sm->bandwidth));
   float* sortbuf= NULL;
 
+  if (sm->threshold<=0.0) {
+    RunningMedian* rm= 
+      os_create_running_median((2*half_band<n) ? 2*half_band+1 : n+1);
+    median_slide(sm, rm, data_in, data_out, n, missing, z, half_band);
+    os_destroy_running_median(rm);
+    return;
+  }
+
   check_sortbuf(sm, n);
   sortbuf= (float*)sm->data;
 
   for (i=0; i<n; i++) {
     int low= i-half_band;
     int high= i+(half_band-1);
-    int nSort= 0;
     if (low<0) low= 0;
     if (high>=n) high=n-1;
-    if (sm->threshold>0.0)
-      trim_bounds( i, &low, &high, data_in, sm->threshold );
-    if (!missing || ((sm->smDim != 't') && (sm->smDim != 'z'))) {
-      nSort= high+1-low;
-      bcopy(data_in+low, sortbuf, nSort*sizeof(float));
-    }
-    else {
-      assert(missing!=NULL);
-      if (sm->smDim=='t') {
-	int j;
-	for (j=low; j<=high; j++) 
-	  if (!missing[j][z]) {
-	    sortbuf[nSort++]= data_in[j];
-	  }
-      }
-      else {
-	int j;
-	assert(sm->smDim=='z');
-	for (j=low; j<=high; j++) 
-	  if (!missing[z][j]) {
-	    sortbuf[nSort++]= data_in[j];
-	  }
-      }
-    }
-    qsort(sortbuf, nSort, sizeof(float), compare_floats);
-    data_out[i]= sortbuf[nSort/2];
+    trim_bounds( i, &low, &high, data_in, sm->threshold );
+    median_select(sm, sortbuf, data_in, data_out, i, low, high, missing, z);
   }
 }
 
@@ -554,42 +859,351 @@ static void median_smooth_group( Smoother* sm,
   int half_band= (int)(rint(0.5*sm->bandwidth));
   float* sortbuf= NULL;
 
+  if (sm->threshold<=0.0) {
+    RunningMedian* rm= 
+      os_create_running_median((2*half_band<n) ? 2*half_band+1 : n+1);
+    for (j=0; j<ndata; j++) 
+      median_slide(sm, rm, dtbl_in[j], dtbl_out[j], n, missing, z, 
+		   half_band);
+    os_destroy_running_median(rm);
+    return;
+  }
+
   check_sortbuf(sm, n);
   sortbuf= (float*)sm->data;
 
-  for (j=0; j<ndata; j++) 
+  for (i=0; i<n; i++) {
+    int low= i-half_band;
+    int high= i+(half_band-1);
+    if (low<0) low= 0;
+    if (high>=n) high=n-1;
+    trim_bounds_group( sm, i, &low, &high, dtbl_in, ndata );
+    for (j=0; j<ndata; j++) 
+      median_select(sm, sortbuf, dtbl_in[j], dtbl_out[j], i, low, high, 
+		    missing, z);
+  }
+}
+
+/* Gaussian weights below this fraction of the peak are left out of
+ * the FFT smoother's kernel.
+ */
+#define FFT_KERNEL_CUTOFF 1.0e-12
+
+/* Deriche's fit is only good for sigma>=0.5 */
+#define IIR_MIN_SIGMA 0.5
+
+/* Outputs whose smoothed mask, in units of the kernel's peak weight,
+ * falls below these are recomputed directly.  The recursive kernel's
+ * tails are only good to about 1e-3 of the peak, so it needs the
+ * larger value.
+ */
+#define MIN_FFT_WEIGHT 1.0e-6
+#define MIN_IIR_WEIGHT 0.1
+
+typedef struct fast_gauss_struct {
+  long nfft;       /* FFT length; 0 for the recursive smoother */
+  double coef[12]; /* recursive smoother: n0..n3, m1..m4, d1..d4 */
+  double* kernel;  /* n direct kernel weights */
+  double* filter;  /* nfft spectral weights */
+  double* work;    /* 4*n doubles for the recursive smoother */
+} FastGauss;
+
+static long good_fft_length( long n )
+{
+  /* Smallest length >= n with no prime factors but 2, 3 and 5 */
+  long len;
+
+  for (len=(n>1 ? n : 1); ; len++) {
+    long m= len;
+    while (m%2==0) m /= 2;
+    while (m%3==0) m /= 3;
+    while (m%5==0) m /= 5;
+    if (m==1) return len;
+  }
+}
+
+static void poly_mult( const double* p, int np, const double* q, int nq,
+		       double* result )
+{
+  int i;
+  int j;
+
+  for (i=0; i<np+nq-1; i++) result[i]= 0.0;
+  for (i=0; i<np; i++)
+    for (j=0; j<nq; j++) result[i+j] += p[i]*q[j];
+}
+
+static void iir_coefficients( double sigma, double* coef )
+{
+  /* Deriche, INRIA report 1893 (1993).  For x>=0 the Gaussian is fit
+   * by two damped sinusoids, (a cos(w x/s) + b sin(w x/s))
+   * exp(-beta x/s), each of which is a second order recursion.  The
+   * causal filter gives the kernel for offsets >= 0 and the
+   * anticausal one for offsets < 0; their outputs are summed.
+   */
+  static double fit[2][4]= { /* a, b, beta, w */
+    { 1.680, 3.735, 1.783, 0.6318 },
+    { -0.6803, -0.2598, 1.723, 1.997 }
+  };
+  double num[2][2];
+  double den[2][3];
+  double tmp[4];
+  double* n= coef;
+  double* m= coef+4;
+  double* d= coef+8;
+  double dFull[5];
+  int i;
+
+  for (i=0; i<2; i++) {
+    double e= exp(-fit[i][2]/sigma);
+    double c= cos(fit[i][3]/sigma);
+    double s= sin(fit[i][3]/sigma);
+    num[i][0]= fit[i][0];
+    num[i][1]= e*(fit[i][1]*s - fit[i][0]*c);
+    den[i][0]= 1.0;
+    den[i][1]= -2.0*e*c;
+    den[i][2]= e*e;
+  }
+  poly_mult(num[0], 2, den[1], 3, n);
+  poly_mult(num[1], 2, den[0], 3, tmp);
+  for (i=0; i<4; i++) n[i] += tmp[i];
+  poly_mult(den[0], 3, den[1], 3, dFull);
+  for (i=0; i<4; i++) d[i]= dFull[i+1];
+  /* Scale so the kernel's peak weight is 1, as in check_kernel() */
+  for (i=3; i>=0; i--) n[i] /= n[0];
+  for (i=0; i<3; i++) m[i]= n[i+1] - d[i]*n[0];
+  m[3]= -d[3]*n[0];
+}
+
+static FastGauss* check_fast_gauss( Smoother* sm, int n )
+{
+  FastGauss* fg;
+  long reach;
+  long nfft= 0;
+  long nwork= 0;
+  long size;
+  long i;
+  long k;
+
+  if (sm->data && n==sm->n) return (FastGauss*)sm->data;
+
+  if (sm->data) free(sm->data);
+  reach= (long)ceil(sm->bandwidth*sqrt(-log(FFT_KERNEL_CUTOFF)));
+  if (reach>n-1) reach= n-1;
+  if (sm->type==SM_GAUSSIAN_FFT) nfft= good_fft_length(n+reach);
+  else nwork= 4*n;
+  size= sizeof(FastGauss) + (n + nfft + nwork)*sizeof(double);
+  if (!(fg=(FastGauss*)malloc(size)))
+    Abort("smoother:check_fast_gauss: unable to allocate %ld bytes!\n",
+	  size);
+  sm->n= n;
+  sm->data= (void*)fg;
+  fg->nfft= nfft;
+  fg->kernel= (double*)(fg+1);
+  fg->filter= fg->kernel + n;
+  fg->work= fg->filter + nfft;
+
+  for (i=0; i<n; i++) {
+    double dist= (double)i/sm->bandwidth;
+    fg->kernel[i]= exp(-dist*dist);
+  }
+
+  if (nfft) {
+    /* The kernel is real and even, so its transform is a cosine sum */
+    double* cosTbl;
+    if (!(cosTbl=(double*)malloc(nfft*sizeof(double))))
+      Abort("smoother:check_fast_gauss: unable to allocate %ld doubles!\n",
+	    nfft);
+    for (i=0; i<nfft; i++) cosTbl[i]= cos((2.0*M_PI*i)/nfft);
+    for (k=0; k<nfft; k++) {
+      double sum= 0.0;
+      for (i=reach; i>0; i--) sum += fg->kernel[i]*cosTbl[(i*k)%nfft];
+      fg->filter[k]= fg->kernel[0] + 2.0*sum;
+    }
+    free(cosTbl);
+  }
+  else iir_coefficients(sm->bandwidth/M_SQRT2, fg->coef);
+
+  return fg;
+}
+
+static double masked_mean( Smoother* sm, float* data, int n,
+			   unsigned char** missing, int z )
+{
+  double sum= 0.0;
+  int count= 0;
+  int i;
+
+  for (i=0; i<n; i++)
+    if (!sm_is_missing(sm, missing, i, z)) {
+      sum += data[i];
+      count++;
+    }
+  return (count ? sum/count : 0.0);
+}
+
+static void gauss_direct( Smoother* sm, FastGauss* fg,
+			  float* data_in, float* data_out, int n,
+			  unsigned char** missing, int z, int i )
+{
+  double val= 0.0;
+  double total_weight= 0.0;
+  int k;
+
+  for (k=0; k<n; k++) {
+    if (!sm_is_missing(sm, missing, k, z)) {
+      double weight= fg->kernel[(k<i) ? i-k : k-i];
+      val += weight*data_in[k];
+      total_weight += weight;
+    }
+  }
+  if (total_weight != 0.0) data_out[i]= val/total_weight;
+}
+
+static float* fft_slot( FComplex* buf, long nfft, int slot, long i )
+{
+  /* Two real series share each complex FFT */
+  FComplex* c= buf + (slot/2)*nfft + i;
+  return ((slot%2) ? &(c->imag) : &(c->real));
+}
+
+static void gauss_fft_filter( double* spectrum, long vol,
+			      long nx, long ny, long nz, double scale,
+			      void* hook )
+{
+  double* filter= (double*)hook;
+  long k;
+
+  for (k=0; k<nz; k++) {
+    spectrum[2*k] *= scale*filter[k];
+    spectrum[2*k+1] *= scale*filter[k];
+  }
+}
+
+static void fft_gauss_smooth_group( Smoother* sm,
+				    float** dtbl_in, float** dtbl_out, 
+				    int ndata, int n,
+				    unsigned char** missing, int z )
+{
+  FastGauss* fg= check_fast_gauss(sm, n);
+  long nfft= fg->nfft;
+  long nvol= ndata/2 + 1;
+  FComplex* buf;
+  double* center;
+  int i;
+  int j;
+
+  if (!(buf=(FComplex*)calloc(nvol*nfft, sizeof(FComplex))))
+    Abort("smoother:fft_gauss_smooth_group: unable to allocate %ld bytes!\n",
+	  nvol*nfft*sizeof(FComplex));
+  if (!(center=(double*)malloc(ndata*sizeof(double))))
+    Abort("smoother:fft_gauss_smooth_group: unable to allocate %d doubles!\n",
+	  ndata);
+
+  /* Slot ndata holds the mask, the others the centered, masked data */
+  for (i=0; i<n; i++)
+    *fft_slot(buf, nfft, ndata, i)= 
+      (sm_is_missing(sm, missing, i, z) ? 0.0 : 1.0);
+  for (j=0; j<ndata; j++) {
+    center[j]= masked_mean(sm, dtbl_in[j], n, missing, z);
+    for (i=0; i<n; i++)
+      if (!sm_is_missing(sm, missing, i, z))
+	*fft_slot(buf, nfft, j, i)= dtbl_in[j][i] - center[j];
+  }
+
+  fft3d_filter_many(buf, nvol, nfft, 1, 1, nfft, -1, "z",
+		    gauss_fft_filter, fg->filter);
+
+  for (i=0; i<n; i++) {
+    double weight= *fft_slot(buf, nfft, ndata, i);
+    if (weight >= MIN_FFT_WEIGHT) {
+      for (j=0; j<ndata; j++)
+	dtbl_out[j][i]= *fft_slot(buf, nfft, j, i)/weight + center[j];
+    }
+    else {
+      for (j=0; j<ndata; j++)
+	gauss_direct(sm, fg, dtbl_in[j], dtbl_out[j], n, missing, z, i);
+    }
+  }
+
+  free(center);
+  free(buf);
+}
+
+static void fft_gauss_smooth( Smoother* sm, 
+			      float* data_in, float* data_out, int n,
+			      unsigned char** missing, int z)
+{
+  fft_gauss_smooth_group(sm, &data_in, &data_out, 1, n, missing, z);
+}
+
+static void iir_gauss( const double* coef, const double* x, double* y,
+		       int n )
+{
+  const double* nc= coef;
+  const double* mc= coef+4;
+  const double* d= coef+8;
+  double x1, x2, x3, x4;
+  double y1, y2, y3, y4;
+  int i;
+
+  /* Causal pass, for offsets >= 0 */
+  x1= x2= x3= 0.0;
+  y1= y2= y3= y4= 0.0;
+  for (i=0; i<n; i++) {
+    double v= nc[0]*x[i] + nc[1]*x1 + nc[2]*x2 + nc[3]*x3
+      - d[0]*y1 - d[1]*y2 - d[2]*y3 - d[3]*y4;
+    x3= x2; x2= x1; x1= x[i];
+    y4= y3; y3= y2; y2= y1; y1= v;
+    y[i]= v;
+  }
+
+  /* Anticausal pass, for offsets < 0 */
+  x1= x2= x3= x4= 0.0;
+  y1= y2= y3= y4= 0.0;
+  for (i=n-1; i>=0; i--) {
+    double v= mc[0]*x1 + mc[1]*x2 + mc[2]*x3 + mc[3]*x4
+      - d[0]*y1 - d[1]*y2 - d[2]*y3 - d[3]*y4;
+    x4= x3; x3= x2; x2= x1; x1= x[i];
+    y4= y3; y3= y2; y2= y1; y1= v;
+    y[i] += v;
+  }
+}
+
+static void iir_gauss_smooth_group( Smoother* sm,
+				    float** dtbl_in, float** dtbl_out, 
+				    int ndata, int n,
+				    unsigned char** missing, int z )
+{
+  FastGauss* fg= check_fast_gauss(sm, n);
+  double* mask= fg->work;
+  double* weight= fg->work + n;
+  double* x= fg->work + 2*n;
+  double* val= fg->work + 3*n;
+  int i;
+  int j;
+
+  for (i=0; i<n; i++)
+    mask[i]= (sm_is_missing(sm, missing, i, z) ? 0.0 : 1.0);
+  iir_gauss(fg->coef, mask, weight, n);
+
+  for (j=0; j<ndata; j++) {
+    double center= masked_mean(sm, dtbl_in[j], n, missing, z);
+    for (i=0; i<n; i++) x[i]= mask[i]*(dtbl_in[j][i] - center);
+    iir_gauss(fg->coef, x, val, n);
     for (i=0; i<n; i++) {
-      int low= i-half_band;
-      int high= i+(half_band-1);
-      int nSort= 0;
-      if (low<0) low= 0;
-      if (high>=n) high=n-1;
-      if (sm->threshold>0.0) 
-	trim_bounds_group( sm, i, &low, &high, dtbl_in, ndata );
-      if (!missing || ((sm->smDim != 't') && (sm->smDim != 'z'))) {
-	nSort= high+1-low;
-	bcopy(&(dtbl_in[j][low]), sortbuf, nSort*sizeof(float));
-      }
-      else {
-	int k;
-	assert(missing != NULL);
-	if (sm->smDim=='t') {
-	  for (k=low; k<=high; k++)
-	    if (!missing[k][z]) {
-	      sortbuf[nSort++]= dtbl_in[j][k];
-	    }
-	}
-	else {
-	  assert(sm->smDim=='z');
-	  for (k=low; k<=high; k++)
-	    if (!missing[z][k]) {
-	      sortbuf[nSort++]= dtbl_in[j][k];
-	    }
-	}
-      }
-      qsort(sortbuf, nSort, sizeof(float), compare_floats);
-      dtbl_out[j][i]= sortbuf[nSort/2];
+      if (weight[i] >= MIN_IIR_WEIGHT) 
+	dtbl_out[j][i]= val[i]/weight[i] + center;
+      else gauss_direct(sm, fg, dtbl_in[j], dtbl_out[j], n, missing, z, i);
     }
+  }
+}
+
+static void iir_gauss_smooth( Smoother* sm, 
+			      float* data_in, float* data_out, int n,
+			      unsigned char** missing, int z)
+{
+  iir_gauss_smooth_group(sm, &data_in, &data_out, 1, n, missing, z);
 }
 
 static void none_smooth( Smoother* sm, 
@@ -631,24 +1245,28 @@ Smoother* sm_create_smoother()
   result->data= NULL;
   result->last= 0;
   result->smDim= default_sm_dim;
+  result->smooth_tile= generic_smooth_tile;
 
   switch (default_type) {
   case SM_GAUSSIAN: 
     {
       result->smooth= kernel_smooth; 
       result->smooth_group= kernel_smooth_group;
+      result->smooth_tile= kernel_smooth_tile;
     }
   break;
   case SM_TRIANGULAR: 
     {
       result->smooth= kernel_smooth; 
       result->smooth_group= kernel_smooth_group;
+      result->smooth_tile= kernel_smooth_tile;
     }
   break;
   case SM_POWER: 
     {
       result->smooth= kernel_smooth; 
       result->smooth_group= kernel_smooth_group;
+      result->smooth_tile= kernel_smooth_tile;
     }
   break;
   case SM_NONE:
@@ -687,6 +1305,33 @@ Smoother* sm_create_smoother()
       result->smooth_group= median_smooth_group;
     }
   break;
+  case SM_GAUSSIAN_FFT:
+    {
+      if (result->threshold>0.0) {
+	result->smooth= kernel_smooth; 
+	result->smooth_group= kernel_smooth_group;
+	result->smooth_tile= kernel_smooth_tile;
+      }
+      else {
+	result->smooth= fft_gauss_smooth;
+	result->smooth_group= fft_gauss_smooth_group;
+      }
+    }
+  break;
+  case SM_GAUSSIAN_IIR:
+    {
+      if (result->threshold>0.0 
+	  || result->bandwidth < M_SQRT2*IIR_MIN_SIGMA) {
+	result->smooth= kernel_smooth; 
+	result->smooth_group= kernel_smooth_group;
+	result->smooth_tile= kernel_smooth_tile;
+      }
+      else {
+	result->smooth= iir_gauss_smooth;
+	result->smooth_group= iir_gauss_smooth_group;
+      }
+    }
+  break;
   }
 
   return result;
@@ -31,7 +31,7 @@
 typedef enum { 
   SM_GAUSSIAN, SM_TRIANGULAR, SM_POWER, SM_NONE, 
   SM_DDX, SM_SHIFT, SM_LINTERP, SM_RUNNINGSUM,
-  SM_MEDIAN
+  SM_MEDIAN, SM_GAUSSIAN_FFT, SM_GAUSSIAN_IIR
 } sm_type;
 
 struct smoother_struct;
@@ -45,6 +45,8 @@ typedef struct smoother_struct {
 		 unsigned char**, int);
   void (*smooth_group)(struct smoother_struct*, float**, float**, int, int,
 		       unsigned char**, int);
+  void (*smooth_tile)(struct smoother_struct*, float*, float*, int, int,
+		      long, unsigned char**, int);
   sm_type type;
   double bandwidth;
   double k;
@@ -93,4 +95,13 @@ void sm_destroy( Smoother* smoother );
 #define SM_SMOOTH_GROUP(smoother,datatbl_in,datatbl_out,ndata,n,miss,z) \
   (*(smoother->smooth_group))(smoother,datatbl_in,datatbl_out,ndata,n,miss,z)
 
+/* SM_SMOOTH_TILE smooths nvox series of length n at once.  Sample i
+ * of series v is at data_in[i*stride+v], which is how a block of
+ * voxels with t outermost is laid out.  All the series share the
+ * same missing data index z.  As with SM_SMOOTH, outputs for which
+ * there is no valid input are left unchanged.
+ */
+#define SM_SMOOTH_TILE(smoother,data_in,data_out,n,nvox,stride,miss,z) \
+  (*(smoother->smooth_tile))(smoother,data_in,data_out,n,nvox,stride,miss,z)
+
 
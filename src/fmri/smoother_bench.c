@@ -0,0 +1,180 @@
+/************************************************************
+ *                                                          *
+ *  smoother_bench.c                                        *
+ *                                                          *
+ *  Permission is hereby granted to any individual or       *
+ *  institution for use, copying, or redistribution of      *
+ *  this code and associated documentation, provided        *
+ *  that such code and documentation are not sold for       *
+ *  profit and the following copyright notice is retained   *
+ *  in the code and documentation:                          *
+ *     Copyright (c) 1998 Department of Statistics,         *
+ *                        Carnegie Mellon University        *
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ ************************************************************/
+
+/* This program compares the fftgauss and iirgauss smoothers with the
+ * direct Gaussian kernel smoother.  A set of drifting, noisy time
+ * series is smoothed at several bandwidths, with and without missing
+ * samples, by each method.  The time per series is reported, along
+ * with the largest difference from SM_GAUSSIAN relative to the range
+ * of the data.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include "mri.h"
+#include "fmri.h"
+#include "stdcrg.h"
+
+/* Largest acceptable differences, relative to the range of the data */
+#define FFT_TOLERANCE 1.0e-4
+#define IIR_TOLERANCE 5.0e-3
+
+static double bandwidths[]= { 3.0, 15.0, 45.0, 150.0 };
+#define N_BANDWIDTHS (sizeof(bandwidths)/sizeof(double))
+
+static double now()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6*tv.tv_usec;
+}
+
+static double smooth_all( sm_type type, double band,
+			  float** data, float** out, int ndata, int n,
+			  unsigned char** missing, int reps )
+{
+  Smoother* sm;
+  double t0= 0.0;
+  int rep;
+  int j;
+
+  sm_set_params(type, band, 0.0, 0.0, NULL);
+  sm= sm_create_smoother();
+  /* The first pass builds kernels and FFT plans, so it is not timed */
+  for (rep=0; rep<=reps; rep++) {
+    if (rep==1) t0= now();
+    for (j=0; j<ndata; j++)
+      SM_SMOOTH(sm, data[j], out[j], n, missing, 0);
+  }
+  sm_destroy(sm);
+  return (now()-t0)/(reps*ndata);
+}
+
+static double max_diff( float** a, float** b, int ndata, int n )
+{
+  double result= 0.0;
+  int i;
+  int j;
+
+  for (j=0; j<ndata; j++)
+    for (i=0; i<n; i++) {
+      double err= fabs(a[j][i]-b[j][i]);
+      if (!(err<=result)) result= err;
+    }
+  return result;
+}
+
+int main( int argc, char* argv[] )
+{
+  float** data;
+  float** ref;
+  float** out;
+  unsigned char** missing;
+  int n= 400;
+  int ndata= 200;
+  int reps= 3;
+  int i;
+  int j;
+  int b;
+  int useMissing;
+  int failures= 0;
+  float lo;
+  float hi;
+
+  if (argc != 1 && argc != 3 && argc != 4) {
+    fprintf(stderr,"Usage: %s [n ndata [reps]]\n",argv[0]);
+    exit(-1);
+  }
+  if (argc >= 3) {
+    n= atoi(argv[1]);
+    ndata= atoi(argv[2]);
+  }
+  if (argc == 4) reps= atoi(argv[3]);
+  if (n<=0 || ndata<=0 || reps<=0) {
+    fprintf(stderr,"%s: n, ndata and reps must be positive\n",argv[0]);
+    exit(-1);
+  }
+
+  sm_init();
+  data= Matrix(ndata, n, float);
+  ref= Matrix(ndata, n, float);
+  out= Matrix(ndata, n, float);
+  missing= Matrix(n, 1, unsigned char);
+
+  lo= hi= 1000.0;
+  for (j=0; j<ndata; j++)
+    for (i=0; i<n; i++) {
+      data[j][i]= 1000.0 + 20.0*sin((3.0*(j%5+1)*i)/n) + 0.02*i
+	+ 5.0*(drand48()-0.5);
+      if (data[j][i]<lo) lo= data[j][i];
+      if (data[j][i]>hi) hi= data[j][i];
+    }
+  /* Scattered missing samples, plus one long run of them */
+  for (i=0; i<n; i++)
+    missing[i][0]= (drand48()<0.1 || (i>=n/3 && i<n/3+n/20));
+
+  printf("%d series of length %d, %d reps\n", ndata, n, reps);
+  for (useMissing=0; useMissing<2; useMissing++) {
+    unsigned char** m= (useMissing ? missing : NULL);
+    for (b=0; b<N_BANDWIDTHS; b++) {
+      double tRef= smooth_all(SM_GAUSSIAN, bandwidths[b], data, ref,
+			      ndata, n, m, reps);
+      double tFFT= smooth_all(SM_GAUSSIAN_FFT, bandwidths[b], data, out,
+			      ndata, n, m, reps);
+      double errFFT= max_diff(ref, out, ndata, n)/(hi-lo);
+      double tIIR= smooth_all(SM_GAUSSIAN_IIR, bandwidths[b], data, out,
+			      ndata, n, m, reps);
+      double errIIR= max_diff(ref, out, ndata, n)/(hi-lo);
+
+      printf("%s band %6.1f: gauss %8.1f us, fftgauss %8.1f us (%.2g), "
+	     "iirgauss %8.1f us (%.2g)",
+	     (useMissing ? "missing" : "full   "), bandwidths[b],
+	     1.0e6*tRef, 1.0e6*tFFT, errFFT, 1.0e6*tIIR, errIIR);
+      if (!(errFFT<=FFT_TOLERANCE) || !(errIIR<=IIR_TOLERANCE)) {
+	printf("   TOO LARGE\n");
+	failures++;
+      }
+      else printf("   ok\n");
+    }
+  }
+
+  FreeMatrix(data);
+  FreeMatrix(ref);
+  FreeMatrix(out);
+  FreeMatrix(missing);
+
+  if (failures) {
+    printf("%d cases FAILED\n",failures);
+    exit(1);
+  }
+  printf("fast Gaussian smoothers agree with SM_GAUSSIAN\n");
+  return 0;
+}
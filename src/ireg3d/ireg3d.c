@@ -52,6 +52,25 @@ typedef struct regpar3d_struct {
   double z;
 } RegPar3D;
 
+/* Scratch space for transforming a volume; each thread has its own */
+typedef struct work_struct {
+  FComplex* c_image;
+  FComplex* c_corr_image;
+  long complex_buffer_size;
+  char* check;
+  long check_buffer_size;
+} Work;
+
+/* The volumes being transformed.  Each is block_size elements of
+ * block_type, which occupy 8*dx*dy*dz bytes whether dv is 1 or 2.
+ */
+typedef struct volume_info_struct {
+  long dv, dx, dy, dz, dt;
+  double length_x, length_y, length_z;
+  long block_size;
+  MRI_ArrayType block_type;
+} VolumeInfo;
+
 static int debug_flag= 0;
 static int verbose_flag= 0;
 static int fourier_mode= 1; 
@@ -62,10 +81,7 @@ static InterpolatorType interpolatorType= INTRP_LINEAR; /*if not fourier_mode*/
 static Interpolator* interpolator= NULL;
 static int real_flag= 0;
 static const char* progname;
-static FComplex *c_image = NULL, *c_corr_image = NULL;
-static long complex_buffer_size= 0;
-static char* check = NULL;
-static long check_buffer_size= 0;
+static int nthreads= 1;
 
 static void regpar3d_copy(RegPar3D* out, RegPar3D* in)
 {
@@ -220,19 +236,19 @@ static void load_reg_params(char* parfile, RegPar3D* par, long dt)
   free(covered);
 }
 
-void checkFourierBufferSize( long dv, long dx, long dy, long dz )
+void checkFourierBufferSize( Work* w, long dv, long dx, long dy, long dz )
 {
   long bufsize= dx*dy*dz;
   long x, y, z;
 
-  if (complex_buffer_size<bufsize) {
-    if (c_image) free(c_image);
-    if (c_corr_image) free(c_corr_image);
+  if (w->complex_buffer_size<bufsize) {
+    if (w->c_image) free(w->c_image);
+    if (w->c_corr_image) free(w->c_corr_image);
     
-    if (!(c_image= (FComplex*)malloc(bufsize*sizeof(FComplex)))) 
+    if (!(w->c_image= (FComplex*)malloc(bufsize*sizeof(FComplex)))) 
       Abort("%s: unable to allocate %d bytes!\n",
 	    progname,bufsize*sizeof(FComplex));
-    if (!(c_corr_image= (FComplex*)malloc(bufsize*sizeof(FComplex)))) 
+    if (!(w->c_corr_image= (FComplex*)malloc(bufsize*sizeof(FComplex)))) 
       Abort("%s: unable to allocate %d bytes!\n",
 	    progname,bufsize*sizeof(FComplex));
 
@@ -240,33 +256,46 @@ void checkFourierBufferSize( long dv, long dx, long dy, long dz )
       for(x=0; x<dx; x++)
 	for(y=0; y<dy; y++)
 	  for (z = 0; z<dz; z++)
-	    MEM(c_image,dx,dy,dz,x,y,z).imag= 0.0;
+	    MEM(w->c_image,dx,dy,dz,x,y,z).imag= 0.0;
     }
     
-    complex_buffer_size= bufsize;
+    w->complex_buffer_size= bufsize;
   }
 }
 
-void checkCheckBufferSize( long dv, long dx, long dy, long dz )
+void checkCheckBufferSize( Work* w, long dv, long dx, long dy, long dz )
 {
   long bufsize= dx*dy*dz;
-  if (check_buffer_size<bufsize) {
-    if (check) free(check);
-    if (!(check= (char*)malloc(bufsize*sizeof(char))))
+  if (w->check_buffer_size<bufsize) {
+    if (w->check) free(w->check);
+    if (!(w->check= (char*)malloc(bufsize*sizeof(char))))
       Abort("%s: unable to allocate %d bytes!\n",
 	    progname,bufsize*sizeof(char));
-    check_buffer_size= bufsize;
+    w->check_buffer_size= bufsize;
   }
 }
 
-void applyFourierTransReal( double* image_in, double* corr_image,
+static void freeWork( Work* w )
+{
+  if (w->c_image) free(w->c_image);
+  if (w->c_corr_image) free(w->c_corr_image);
+  if (w->check) free(w->check);
+  w->c_image= w->c_corr_image= NULL;
+  w->check= NULL;
+  w->complex_buffer_size= w->check_buffer_size= 0;
+}
+
+void applyFourierTransReal( Work* w, double* image_in, double* corr_image,
 			    long dv, long dx, long dy, long dz,
 			    double length_x, double length_y, 
 			    double length_z,
 			    RegPar3D* par)
 {
   long x, y, z;
-  checkFourierBufferSize( dv, dx, dy, dz );
+  FComplex *c_image, *c_corr_image;
+  checkFourierBufferSize( w, dv, dx, dy, dz );
+  c_image= w->c_image;
+  c_corr_image= w->c_corr_image;
   for (z=0; z<dz; z++) 
     for(y=0; y<dy; y++)
       for(x=0; x<dx; x++)
@@ -289,14 +318,18 @@ void applyFourierTransReal( double* image_in, double* corr_image,
       }
 }
 
-void applyFourierTransComplex( FComplex* c_image_in, FComplex* c_image_out,
+void applyFourierTransComplex( Work* w, 
+			       FComplex* c_image_in, FComplex* c_image_out,
 			       long dv, long dx, long dy, long dz,
 			       double length_x, double length_y, 
 			       double length_z,
 			       RegPar3D* par)
 {
   long x, y, z;
-  checkFourierBufferSize( dv, dx, dy, dz );
+  FComplex *c_image, *c_corr_image;
+  checkFourierBufferSize( w, dv, dx, dy, dz );
+  c_image= w->c_image;
+  c_corr_image= w->c_corr_image;
   for (z=0; z<dz; z++) 
     for(y=0; y<dy; y++)
       for(x=0; x<dx; x++) {
@@ -310,8 +343,10 @@ void applyFourierTransComplex( FComplex* c_image_in, FComplex* c_image_out,
    * by a future conversion to image space- only the phases
    * needed for the shift are set.
    */
-  /* Must do FFT in Z, since data is only in k-space in XY */
-  fft3d( c_image, dx, dy, dz, +1, "z" );
+  /* Must do FFT in Z, since data is only in k-space in XY.  The
+   * batched form keeps its plans per thread.
+   */
+  fft3d_many( c_image, 1, dx*dy*dz, dx, dy, dz, +1, "z" );
   fourier_shift_rot3d( &(par->q), 0.0, 0.0, 0.0,
 		       c_image, c_corr_image, dx, dy, dz,
 		       length_x, length_y, length_z, real_flag );
@@ -320,7 +355,7 @@ void applyFourierTransComplex( FComplex* c_image_in, FComplex* c_image_out,
 			     length_x, length_y, length_z, 
 			     1, real_flag );
   /* Undo earlier Z FFT */
-  fft3d( c_corr_image, dx, dy, dz, -1, "z" );
+  fft3d_many( c_corr_image, 1, dx*dy*dz, dx, dy, dz, -1, "z" );
 
   /* Write out registered image.  This requires flipping the
    * data back to x-fastest order;  we use the other complex
@@ -337,7 +372,8 @@ void applyFourierTransComplex( FComplex* c_image_in, FComplex* c_image_out,
       }
 }
 
-void applyInterpolatorTransReal( double* image_in, double* image_out,
+void applyInterpolatorTransReal( Work* w, 
+				 double* image_in, double* image_out,
 				 long dv, long dx, long dy, long dz,
 				 double length_x, double length_y, 
 				 double length_z,
@@ -346,7 +382,7 @@ void applyInterpolatorTransReal( double* image_in, double* image_out,
   Transform trans;
   Transform invTrans;
   double xTrans, yTrans, zTrans;
-  checkCheckBufferSize(dv,dx,dy,dz);
+  checkCheckBufferSize(w,dv,dx,dy,dz);
   /* Remember that displacements are in voxels- we must rescale
    * to mm, because that is what intrp_warpApply expects.
    */
@@ -364,11 +400,12 @@ void applyInterpolatorTransReal( double* image_in, double* image_out,
   fprintf(stderr,"Inverse transform follows: \n");
   trans_dump(stderr,invTrans);
 #endif
-  intrp_warpApply( interpolator, invTrans, image_in, image_out, check, 
+  intrp_warpApply( interpolator, invTrans, image_in, image_out, w->check, 
 		   dx, dy, dz, 1, length_x, length_y, length_z );
 }
 
-void applyInterpolatorTransComplex( FComplex* image_in, FComplex* corr_image,
+void applyInterpolatorTransComplex( Work* w, 
+				    FComplex* image_in, FComplex* corr_image,
 				    long dv, long dx, long dy, long dz,
 				    double length_x, double length_y, 
 				    double length_z,
@@ -395,6 +432,149 @@ static void printProgress(long t, long dt)
   }
 }
 
+static void transformVolume( Work* w, void* in, void* out, VolumeInfo* v,
+			     RegPar3D* par )
+{
+  if (v->dv==1) {
+    if (fourier_mode) 
+      applyFourierTransReal( w, (double*)in, (double*)out, 
+			     v->dv, v->dx, v->dy, v->dz, 
+			     v->length_x, v->length_y, v->length_z, par );
+    else
+      applyInterpolatorTransReal( w, (double*)in, (double*)out, 
+				  v->dv, v->dx, v->dy, v->dz, 
+				  v->length_x, v->length_y, v->length_z, par );
+  }
+  else {
+    if (fourier_mode) 
+      applyFourierTransComplex( w, (FComplex*)in, (FComplex*)out,
+				v->dv, v->dx, v->dy, v->dz, 
+				v->length_x, v->length_y, v->length_z, par );
+    else
+      applyInterpolatorTransComplex( w, (FComplex*)in, (FComplex*)out,
+				     v->dv, v->dx, v->dy, v->dz, 
+				     v->length_x, v->length_y, v->length_z, 
+				     par );
+  }
+}
+
+static void transformSerial( MRI_Dataset* Input, MRI_Dataset* Output,
+			     VolumeInfo* v, RegPar3D* par )
+{
+  Work w;
+  void* image_in;
+  void* image_out;
+  long long block_offset= 0;
+  long t;
+
+  bzero(&w, sizeof(w));
+  if (!(image_out= malloc(8*v->dx*v->dy*v->dz)))
+    Abort("%s: unable to allocate %d bytes!\n",progname,
+	  8*v->dx*v->dy*v->dz);
+  for (t=0; t<v->dt; t++) {
+    image_in= mri_get_chunk(Input, "images", v->block_size,
+			    block_offset, v->block_type);
+    transformVolume( &w, image_in, image_out, v, &(par[t]) );
+    mri_set_chunk( Output, "images", v->block_size, block_offset, 
+		   v->block_type, image_out );
+    printProgress(t,v->dt);
+    block_offset += v->block_size;
+  }
+  free(image_out);
+  freeWork(&w);
+}
+
+/* In the threaded version the main thread does all the I/O, reading
+ * volumes ahead and writing the results out in order, while the
+ * workers transform the volumes in between.  fthr_run_ordered() runs
+ * the pipeline; volume t always occupies slot t%nslots.
+ */
+
+typedef struct pool_struct {
+  MRI_Dataset* Input;
+  MRI_Dataset* Output;
+  VolumeInfo* v;
+  RegPar3D* par;
+  void** in; /* one input and one output buffer per slot */
+  void** out;
+} Pool;
+
+static void* startTransformWorker( void* hook )
+{
+  Work* w;
+
+  if (!(w= (Work*)malloc(sizeof(Work))))
+    Abort("%s: unable to allocate %d bytes!\n",progname,sizeof(Work));
+  bzero(w, sizeof(Work));
+  return w;
+}
+
+static void endTransformWorker( void* hook, void* state )
+{
+  freeWork((Work*)state);
+  free(state);
+}
+
+static void readVolume( void* hook, long long t, int slot )
+{
+  Pool* p= (Pool*)hook;
+
+  (void)mri_read_chunk(p->Input, "images", p->v->block_size, 
+		       t*(long long)p->v->block_size, p->v->block_type,
+		       p->in[slot]);
+}
+
+static void transformSlot( void* hook, void* state, long long t, int slot )
+{
+  Pool* p= (Pool*)hook;
+
+  transformVolume( (Work*)state, p->in[slot], p->out[slot], p->v, 
+		   &(p->par[t]) );
+}
+
+static void writeVolume( void* hook, long long t, int slot )
+{
+  Pool* p= (Pool*)hook;
+
+  mri_set_chunk( p->Output, "images", p->v->block_size, 
+		 t*(long long)p->v->block_size, p->v->block_type, 
+		 p->out[slot] );
+  printProgress(t,p->v->dt);
+}
+
+static void transformThreaded( MRI_Dataset* Input, MRI_Dataset* Output,
+			       VolumeInfo* v, RegPar3D* par )
+{
+  Pool p;
+  long bytes= 8*v->dx*v->dy*v->dz;
+  int nslots= 2*nthreads;
+  int i;
+
+  p.Input= Input;
+  p.Output= Output;
+  p.v= v;
+  p.par= par;
+  if (!(p.in= (void**)malloc(nslots*sizeof(void*)))
+      || !(p.out= (void**)malloc(nslots*sizeof(void*))))
+    Abort("%s: unable to allocate %d bytes!\n",progname,
+	  nslots*sizeof(void*));
+  for (i=0; i<nslots; i++) {
+    if (!(p.in[i]= malloc(bytes)) || !(p.out[i]= malloc(bytes)))
+      Abort("%s: unable to allocate %d bytes!\n",progname,bytes);
+  }
+
+  fthr_run_ordered( v->dt, nthreads, nslots, 
+		    startTransformWorker, endTransformWorker,
+		    readVolume, transformSlot, writeVolume, &p );
+
+  for (i=0; i<nslots; i++) {
+    free(p.in[i]);
+    free(p.out[i]);
+  }
+  free(p.in);
+  free(p.out);
+}
+
 int main( int argc, char* argv[] ) 
 {
 
@@ -409,6 +589,7 @@ int main( int argc, char* argv[] )
   const char* dimstr= NULL;
   double length_x, length_y, length_z;
   double xvoxel, yvoxel, zvoxel;
+  VolumeInfo vinfo;
 
   progname= argv[0];
 
@@ -483,6 +664,8 @@ int main( int argc, char* argv[] )
   }
   
   cl_get("qualmeasure","%option %s[%]", "ssqr", qual_string);
+  if (cl_get("threads","%option %d",&nthreads))
+    nthreads= fthr_count(argv[0], nthreads);
 
   if (cl_cleanup_check()) {
     int i;
@@ -615,6 +798,11 @@ int main( int argc, char* argv[] )
     fshrot3d_clear_shear_counts();
   }
   else {
+    /* The interpolator keeps internal state, so it cannot be shared
+     * between volumes; the threads go to the warp of each volume.
+     */
+    intrp_warpSetThreads(nthreads);
+    nthreads= 1;
     interpolator= intrp_createInterpolator3DByType(interpolatorType,
 						   dx,dy,dz,1);
     intrp_warpClearCounts();
@@ -624,66 +812,26 @@ int main( int argc, char* argv[] )
     }
   }
 
+  vinfo.dv= dv;
+  vinfo.dx= dx;
+  vinfo.dy= dy;
+  vinfo.dz= dz;
+  vinfo.dt= dt;
+  vinfo.length_x= length_x;
+  vinfo.length_y= length_y;
+  vinfo.length_z= length_z;
   if (dv==1) {
-    double *image_in = NULL, *image_out = NULL;
-    long long block_offset= 0;
-    long block_size= dx*dy*dz;
-    if (!(image_out= (double*)malloc(block_size*sizeof(double))))
-      Abort("%s: unable to allocate %d bytes!\n",progname,
-	    block_size*sizeof(double));
-    for (t=0; t<dt; t++) {
-      image_in= (double*)mri_get_chunk(Input, "images", block_size,
-				      block_offset, MRI_DOUBLE);
-      if (fourier_mode) {
-	applyFourierTransReal( image_in, image_out, 
-			       dv, dx, dy, dz, 
-			       length_x, length_y, length_z,
-			       &(par[t]) );
-      }
-      else {
-	applyInterpolatorTransReal( image_in, image_out, 
-				    dv, dx, dy, dz, 
-				    length_x, length_y, length_z,
-				    &(par[t]) );
-      }
-      mri_set_chunk( Output, "images", block_size, block_offset, MRI_DOUBLE,
-		     image_out );
-      printProgress(t,dt);
-      block_offset += block_size;
-    }
-    free(image_out);
+    vinfo.block_size= dx*dy*dz;
+    vinfo.block_type= MRI_DOUBLE;
   }
   else {
-    FComplex *c_image_in= NULL, *c_image_out= NULL;
-    long long block_offset= 0;
-    long block_size= 2*dx*dy*dz;
-
-    if (!(c_image_out= (FComplex*)malloc(dx*dy*dz*sizeof(FComplex))))
-      Abort("%s: unable to allocate %d bytes!\n",
-	    progname,dx*dy*dz*sizeof(FComplex));
-    for (t=0; t<dt; t++) {
-      c_image_in= (FComplex*)mri_get_chunk(Input, "images", block_size,
-					   block_offset, MRI_FLOAT);
-      if (fourier_mode) {
-	applyFourierTransComplex( c_image_in, c_image_out,
-				  dv, dx, dy, dz,
-				  length_x, length_y, length_z,
-				  &(par[t]) );
-      }
-      else {
-	applyInterpolatorTransComplex( c_image_in, c_image_out,
-				       dv, dx, dy, dz,
-				       length_x, length_y, length_z,
-				       &(par[t]) );
-      }
-      mri_set_chunk( Output, "images", block_size, block_offset, MRI_FLOAT,
-		     (float*)c_image_out );
-      printProgress(t,dt);
-      block_offset += block_size;
-    }
-    free(c_image_out);
+    vinfo.block_size= 2*dx*dy*dz;
+    vinfo.block_type= MRI_FLOAT;
   }
 
+  if (nthreads>1) transformThreaded( Input, Output, &vinfo, par );
+  else transformSerial( Input, Output, &vinfo, par );
+
   /* Write out op counts */
   if (verbose_flag) {
     if (fourier_mode) {
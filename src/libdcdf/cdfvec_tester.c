@@ -0,0 +1,378 @@
+/* cdfvec_tester.c
+ *
+ * Compares the array routines of cdfvec.c against the scalar cdf_*
+ * routines for each distribution, in both directions, over a grid of
+ * parameters, and reports the worst relative error and the time per
+ * value of each.  The forward results are compared in the smaller
+ * of P and Q, and the inverses directly in X.  The scalar beta
+ * inverse searches for Y rather than X when P>Q, so that is the one
+ * it gets to 1e-8 relative; there its Y is compared instead.
+ *
+ * usage: cdfvec_tester [reps]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/time.h>
+#include <dcdflib.h>
+
+#define FWD_TOL 1.0e-10
+#define INV_TOL 1.0e-7
+
+typedef enum { D_T, D_F, D_CHI, D_NOR, D_GAM, D_BET } Dist;
+
+static const char* distNames[]= { "t", "F", "chisqr", "normal", "gamma",
+				  "beta" };
+
+static double now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6*tv.tv_usec;
+}
+
+/* Tails smaller than this are compared absolutely; the scalar
+ * routines lose precision and underflow differently down there.
+ */
+#define TINY 1.0e-280
+
+static double relerr(double a, double b)
+{
+  double scale= fabs(b);
+  if (a==b) return 0.0;
+  if (scale<TINY) scale= TINY;
+  return fabs(a-b)/scale;
+}
+
+/* Parameter grids */
+static const double dofs[]= { 0.5, 1.0, 2.0, 3.0, 5.0, 10.0, 30.0, 100.0,
+			      1000.0 };
+static const double shapes[]= { 0.05, 0.3, 1.0, 2.5, 7.0, 40.0, 300.0 };
+#define NDOFS (sizeof(dofs)/sizeof(double))
+#define NSHAPES (sizeof(shapes)/sizeof(double))
+#define NX 200
+
+typedef struct cases_struct {
+  long n;
+  double* p;
+  double* q;
+  double* x;
+  double* y;
+  double* a;
+  double* b;
+} Cases;
+
+static void allocCases(Cases* c, long n)
+{
+  c->n= n;
+  c->p= (double*)malloc(n*sizeof(double));
+  c->q= (double*)malloc(n*sizeof(double));
+  c->x= (double*)malloc(n*sizeof(double));
+  c->y= (double*)malloc(n*sizeof(double));
+  c->a= (double*)malloc(n*sizeof(double));
+  c->b= (double*)malloc(n*sizeof(double));
+  if (!c->p || !c->q || !c->x || !c->y || !c->a || !c->b) {
+    fprintf(stderr,"Unable to allocate %ld cases!\n",n);
+    exit(-1);
+  }
+}
+
+static void freeCases(Cases* c)
+{
+  free(c->p);
+  free(c->q);
+  free(c->x);
+  free(c->y);
+  free(c->a);
+  free(c->b);
+}
+
+static void copyOne(Cases* to, long i, const Cases* from, long j)
+{
+  to->p[i]= from->p[j];
+  to->q[i]= from->q[j];
+  to->x[i]= from->x[j];
+  to->y[i]= from->y[j];
+  to->a[i]= from->a[j];
+  to->b[i]= from->b[j];
+}
+
+static void copyCases(Cases* to, const Cases* from)
+{
+  long i;
+  for (i=0; i<from->n; i++) copyOne(to, i, from, i);
+}
+
+/* Fills in the parameters and X values for a distribution.  The
+ * P and Q values for the inverse tests are generated by the scalar
+ * forward routines from these.
+ */
+static void makeCases(Dist d, Cases* c)
+{
+  long n= 0;
+  long i, k;
+  long npar= (d==D_F || d==D_BET) ? NSHAPES*NSHAPES
+    : (d==D_GAM) ? NSHAPES*3 : (d==D_NOR) ? 4 : NDOFS;
+  allocCases(c, npar*NX);
+  for (k=0; k<npar; k++) {
+    for (i=0; i<NX; i++) {
+      double u= (i+0.5)/NX; /* in (0,1) */
+      double s= tan(M_PI*(u-0.5)); /* wide spread of both signs */
+      switch (d) {
+      case D_T:
+	c->a[n]= dofs[k];
+	c->x[n]= 3.0*s;
+	break;
+      case D_F:
+	c->a[n]= 2.0*shapes[k/NSHAPES];
+	c->b[n]= 2.0*shapes[k%NSHAPES];
+	c->x[n]= exp(4.0*s/(1.0+fabs(s)));
+	break;
+      case D_CHI:
+	c->a[n]= dofs[k];
+	c->x[n]= dofs[k]*exp(3.0*s/(1.0+fabs(s)));
+	break;
+      case D_NOR:
+	c->a[n]= (k&1) ? 3.0 : 0.0;
+	c->b[n]= (k&2) ? 0.25 : 1.0;
+	c->x[n]= c->a[n] + c->b[n]*4.0*s/(1.0+0.1*fabs(s));
+	break;
+      case D_GAM:
+	c->a[n]= shapes[k/3];
+	c->b[n]= (k%3==0) ? 1.0 : (k%3==1) ? 0.1 : 7.0;
+	c->x[n]= (c->a[n]/c->b[n])*exp(3.0*s/(1.0+fabs(s)));
+	break;
+      case D_BET:
+	c->a[n]= shapes[k/NSHAPES];
+	c->b[n]= shapes[k%NSHAPES];
+	c->x[n]= u*u*(3.0-2.0*u);
+	c->y[n]= 1.0-c->x[n];
+	break;
+      }
+      n++;
+    }
+  }
+  /* A few values for the scalar routine to deal with */
+  c->x[0]= 0.0;
+  if (d==D_BET) c->y[0]= 1.0;
+}
+
+static void scalarForward(Dist d, Cases* c, long i, int* status,
+			  double* bound)
+{
+  int one= 1;
+  switch (d) {
+  case D_T: cdf_t(&one, c->p+i, c->q+i, c->x+i, c->a+i, status, bound);
+    break;
+  case D_F: cdf_f(&one, c->p+i, c->q+i, c->x+i, c->a+i, c->b+i, status,
+		  bound);
+    break;
+  case D_CHI: cdf_chi(&one, c->p+i, c->q+i, c->x+i, c->a+i, status, bound);
+    break;
+  case D_NOR: cdf_nor(&one, c->p+i, c->q+i, c->x+i, c->a+i, c->b+i, status,
+		      bound);
+    break;
+  case D_GAM: cdf_gam(&one, c->p+i, c->q+i, c->x+i, c->a+i, c->b+i, status,
+		      bound);
+    break;
+  case D_BET: cdf_bet(&one, c->p+i, c->q+i, c->x+i, c->y+i, c->a+i, c->b+i,
+		      status, bound);
+    break;
+  }
+}
+
+static void scalarInverse(Dist d, Cases* c, long i, int* status,
+			  double* bound)
+{
+  int two= 2;
+  switch (d) {
+  case D_T: cdf_t(&two, c->p+i, c->q+i, c->x+i, c->a+i, status, bound);
+    break;
+  case D_F: cdf_f(&two, c->p+i, c->q+i, c->x+i, c->a+i, c->b+i, status,
+		  bound);
+    break;
+  case D_CHI: cdf_chi(&two, c->p+i, c->q+i, c->x+i, c->a+i, status, bound);
+    break;
+  case D_NOR: cdf_nor(&two, c->p+i, c->q+i, c->x+i, c->a+i, c->b+i, status,
+		      bound);
+    break;
+  case D_GAM: cdf_gam(&two, c->p+i, c->q+i, c->x+i, c->a+i, c->b+i, status,
+		      bound);
+    break;
+  case D_BET: cdf_bet(&two, c->p+i, c->q+i, c->x+i, c->y+i, c->a+i, c->b+i,
+		      status, bound);
+    break;
+  }
+}
+
+static long vectorCall(Dist d, int which, Cases* c, int* status,
+		       double* bound)
+{
+  switch (d) {
+  case D_T: return cdf_t_v(which, c->n, c->p, c->q, c->x, c->a, status,
+			   bound);
+  case D_F: return cdf_f_v(which, c->n, c->p, c->q, c->x, c->a, c->b,
+			   status, bound);
+  case D_CHI: return cdf_chi_v(which, c->n, c->p, c->q, c->x, c->a,
+			       status, bound);
+  case D_NOR: return cdf_nor_v(which, c->n, c->p, c->q, c->x, c->a, c->b,
+			       status, bound);
+  case D_GAM: return cdf_gam_v(which, c->n, c->p, c->q, c->x, c->a, c->b,
+			       status, bound);
+  case D_BET: return cdf_bet_v(which, c->n, c->p, c->q, c->x, c->y, c->a,
+			       c->b, status, bound);
+  }
+  return -1;
+}
+
+static int testDist(Dist d, int reps)
+{
+  Cases ref, vec, tmp;
+  int status;
+  double bound;
+  double worstFwd= 0.0;
+  double worstInv= 0.0;
+  double tScalar, tVector;
+  long i;
+  long n;
+  long bad;
+  int r;
+  int fail= 0;
+
+  makeCases(d, &ref);
+  allocCases(&vec, ref.n);
+  allocCases(&tmp, ref.n);
+
+  /* Forward */
+  tScalar= now();
+  for (r=0; r<reps; r++)
+    for (i=0; i<ref.n; i++) {
+      scalarForward(d, &ref, i, &status, &bound);
+      if (status) {
+	fprintf(stderr,"%s: scalar forward failed at %ld, status %d\n",
+		distNames[d],i,status);
+	return 1;
+      }
+    }
+  tScalar= (now()-tScalar)/(reps*ref.n);
+  copyCases(&vec, &ref);
+  tVector= now();
+  for (r=0; r<reps; r++) {
+    if ((bad= vectorCall(d, 1, &vec, &status, &bound)) >= 0) {
+      fprintf(stderr,"%s: vector forward failed at %ld, status %d\n",
+	      distNames[d],bad,status);
+      return 1;
+    }
+  }
+  tVector= (now()-tVector)/(reps*ref.n);
+  for (i=0; i<ref.n; i++) {
+    double e= (ref.p[i]<ref.q[i]) ? relerr(vec.p[i],ref.p[i])
+      : relerr(vec.q[i],ref.q[i]);
+    if (e>worstFwd) worstFwd= e;
+    if (e>FWD_TOL) {
+      fprintf(stderr,"%s: forward %ld: x=%.17g a=%g b=%g: p %.17g vs %.17g\n",
+	      distNames[d],i,ref.x[i],ref.a[i],ref.b[i],vec.p[i],ref.p[i]);
+      fail= 1;
+    }
+  }
+  printf("%-7s forward: scalar %8.1f ns, vector %8.1f ns, "
+	 "max rel err %.2g\n",
+	 distNames[d],1.0e9*tScalar,1.0e9*tVector,worstFwd);
+
+  /* Inverse, starting from the scalar P and Q values.  Values at
+   * which the scalar inverse gives up (P or Q 0 or 1, or beyond its
+   * search range) are dropped.
+   */
+  copyCases(&tmp, &ref);
+  for (i=0, n=0; i<ref.n; i++) {
+    scalarInverse(d, &tmp, i, &status, &bound);
+    if (status==0) copyOne(&ref, n++, &ref, i);
+  }
+  ref.n= vec.n= tmp.n= n;
+  copyCases(&vec, &ref);
+  tScalar= now();
+  for (r=0; r<reps; r++)
+    for (i=0; i<ref.n; i++) {
+      scalarInverse(d, &ref, i, &status, &bound);
+      if (status) {
+	fprintf(stderr,"%s: scalar inverse failed at %ld, status %d\n",
+		distNames[d],i,status);
+	return 1;
+      }
+    }
+  tScalar= (now()-tScalar)/(reps*ref.n);
+  tVector= now();
+  for (r=0; r<reps; r++) {
+    if ((bad= vectorCall(d, 2, &vec, &status, &bound)) >= 0) {
+      fprintf(stderr,"%s: vector inverse failed at %ld, status %d\n",
+	      distNames[d],bad,status);
+      return 1;
+    }
+  }
+  tVector= (now()-tVector)/(reps*ref.n);
+  for (i=0; i<ref.n; i++) {
+    int useY= (d==D_BET && vec.p[i]>vec.q[i]);
+    double vx= useY ? vec.y[i] : vec.x[i];
+    double rx= useY ? ref.y[i] : ref.x[i];
+    double e= relerr(vx,rx);
+    /* The scalar search itself stops at a relative 1e-8 */
+    if (fabs(vx-rx)<1.0e-12) e= 0.0;
+    if (e>worstInv) worstInv= e;
+    if (e>INV_TOL) {
+      fprintf(stderr,"%s: inverse %ld: p=%.17g a=%g b=%g: %c %.17g vs %.17g\n",
+	      distNames[d],i,vec.p[i],ref.a[i],ref.b[i],useY ? 'y' : 'x',
+	      vx,rx);
+      fail= 1;
+    }
+  }
+  printf("%-7s inverse: scalar %8.1f ns, vector %8.1f ns, "
+	 "max rel err %.2g\n",
+	 distNames[d],1.0e9*tScalar,1.0e9*tVector,worstInv);
+
+  freeCases(&ref);
+  freeCases(&vec);
+  freeCases(&tmp);
+  return fail;
+}
+
+/* Checks that a bad argument is reported at the right index */
+static int testErrors(void)
+{
+  double p[100], q[100], t[100], df[100];
+  int status= 0;
+  double bound= 0.0;
+  long i;
+  long bad;
+  for (i=0; i<100; i++) {
+    t[i]= 0.01*i;
+    df[i]= 4.0;
+  }
+  df[70]= -1.0;
+  df[90]= -2.0;
+  bad= cdf_t_v(1, 100, p, q, t, df, &status, &bound);
+  if (bad!=70 || status!=-5) {
+    fprintf(stderr,"error test: got index %ld status %d\n",bad,status);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  int reps= 1;
+  int fail= 0;
+  int d;
+
+  if (argc>1) reps= atoi(argv[1]);
+  if (reps<1) {
+    fprintf(stderr,"usage: %s [reps]\n",argv[0]);
+    return -1;
+  }
+
+  for (d=D_T; d<=D_BET; d++) fail |= testDist((Dist)d, reps);
+  fail |= testErrors();
+
+  if (fail) printf("FAILED\n");
+  else printf("all tests passed\n");
+  return fail;
+}
@@ -22,3 +22,20 @@ extern void cdf_t(int* which, double* p, double* q, double* t, double* df,
 		  int* status, double* bound);
 extern int cdf_ipmpar(int* which);
 
+/* Array versions for which==1 and which==2; see cdfvec.c */
+extern long cdf_bet_v(int which, long n, double* p, double* q, double* x,
+		      double* y, double* a, double* b, int* status,
+		      double* bound);
+extern long cdf_chi_v(int which, long n, double* p, double* q, double* x,
+		      double* df, int* status, double* bound);
+extern long cdf_f_v(int which, long n, double* p, double* q, double* f,
+		    double* dfn, double* dfd, int* status, double* bound);
+extern long cdf_gam_v(int which, long n, double* p, double* q, double* x,
+		      double* shape, double* scale, int* status,
+		      double* bound);
+extern long cdf_nor_v(int which, long n, double* p, double* q, double* x,
+		      double* mean, double* sd, int* status, double* bound);
+extern long cdf_t_v(int which, long n, double* p, double* q, double* t,
+		    double* df, int* status, double* bound);
+extern void cdf_lock(void);
+extern void cdf_unlock(void);
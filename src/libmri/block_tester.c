@@ -0,0 +1,370 @@
+/************************************************************
+ *                                                          *
+ *  Permission is hereby granted to any individual or       *
+ *  institution for use, copying, or redistribution of      *
+ *  this code and associated documentation, provided        *
+ *  that such code and documentation are not sold for       *
+ *  profit and the following copyright notice is retained   *
+ *  in the code and documentation:                          *
+ *                                                          *
+ *     Copyright (c) 1999 Carnegie Mellon University        *
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ ***********************************************************/
+/*
+ *	block_tester.c - check libmri's compressed chunk layout
+ *
+ *	usage: block_tester [directory [seed]]
+ *
+ *	For every datatype, both the "lz" and "shuffle_lz" codings
+ *	and several block shapes, a dataset holding one xyzt chunk
+ *	is written into the directory (default /tmp) in pieces, then
+ *
+ *		read back in random regions,
+ *		partly rewritten, some of it with incompressible
+ *		or all-zero data, and read back again before and
+ *		after closing,
+ *		switched to no compression, which must also drop
+ *		the chunk's block.<dim> keys, and
+ *		compressed again with a different block shape,
+ *
+ *	with the contents compared byte for byte against a copy kept
+ *	in memory after every step.  The regions are chosen with
+ *	a fixed pseudo-random sequence, which the seed changes.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mri.h"
+
+#define N_READS		40	/* random regions read after each step */
+#define N_REWRITES	12	/* random regions rewritten */
+
+static char *dims = "xyzt";
+static long long extent[4] = { 61, 47, 13, 9 };
+
+static char *datatypes[] = {
+  "uint8", "int16", "int32", "int64", "float32", "float64"
+};
+static int type_sizes[] = { 1, 2, 4, 8, 4, 8 };
+#define N_DATATYPES	6
+
+static char *codings[] = { "lz", "shuffle_lz" };
+#define N_CODINGS	2
+
+/* block shapes; 0 leaves that dimension to the default */
+static long long shapes[][4] = {
+  {  0,  0, 0, 0 },		/* all default */
+  { 61, 47, 1, 1 },		/* one slice per block */
+  {  8,  8, 8, 1 },		/* ragged cubes */
+  {  5,  3, 2, 2 },		/* many small blocks */
+  {  0,  0, 0, 1 }		/* one time point per block */
+};
+#define N_SHAPES	5
+
+static char dir[512] = "/tmp";
+static unsigned long long rng_state = 1;
+static unsigned char *model = NULL;	/* what the chunk should hold */
+static long long n_bytes;		/* size of the chunk in bytes */
+static int failures = 0;
+
+static unsigned long long
+Random ()
+{
+  /* 64-bit linear congruential generator, high bits only */
+  rng_state = rng_state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return(rng_state >> 17);
+}
+
+static char *
+Name ()
+{
+  static char name[1024];
+
+  sprintf(name, "%s/block_test", dir);
+  return(name);
+}
+
+/* Fills n elements starting at element first with data of the
+   given kind: zeros, a smooth ramp, a short repeating pattern or
+   random bytes.  Mixing them exercises empty blocks, long and
+   short matches, and literal runs. */
+static void
+Fill (unsigned char *p, long long first, long long n, int type, int kind)
+{
+  long long i;
+  int b, size;
+  double v;
+
+  size = type_sizes[type];
+  for (i = 0; i < n; ++i, p += size)
+    {
+      if (kind == 3)
+	{
+	  for (b = 0; b < size; ++b)
+	    p[b] = (unsigned char) Random();
+	  continue;
+	}
+      if (kind == 0)
+	v = 0.0;
+      else if (kind == 1)
+	v = 0.25 * ((first + i) / 3) + 17.0;
+      else
+	v = (double) ((first + i) % 11) * 9.0 - 40.0;
+      switch (type)
+	{
+	case 0: *p = (unsigned char) ((long long) v & 0xff); break;
+	case 1: *(short *) p = (short) v; break;
+	case 2: *(int *) p = (int) v; break;
+	case 3: *(long long *) p = (long long) v; break;
+	case 4: *(float *) p = (float) v; break;
+	case 5: *(double *) p = v; break;
+	}
+    }
+}
+
+/* Writes count elements at element offset into both the dataset
+   and the model */
+static void
+Write (MRI_Dataset *ds, int type, long long offset, long long count,
+       int kind)
+{
+  int size;
+
+  size = type_sizes[type];
+  Fill(model + offset*size, offset, count, type, kind);
+  mri_set_chunk(ds, "images", count*size, offset*size, MRI_RAW,
+		model + offset*size);
+}
+
+/* Reads a byte range from the dataset and compares it with the
+   model */
+static int
+Compare (MRI_Dataset *ds, long long offset, long long count)
+{
+  unsigned char *p;
+
+  p = (unsigned char *) mri_get_chunk(ds, "images", count, offset, MRI_RAW);
+  return(p != NULL && memcmp(p, model + offset, count) == 0);
+}
+
+static int
+CompareRandom (MRI_Dataset *ds)
+{
+  long long offset, count;
+  int i;
+
+  for (i = 0; i < N_READS; ++i)
+    {
+      offset = Random() % n_bytes;
+      count = 1 + Random() % (n_bytes / 3);
+      if (offset + count > n_bytes)
+	count = n_bytes - offset;
+      if (!Compare(ds, offset, count))
+	return(0);
+    }
+  return(1);
+}
+
+static int
+CompareAll (int random)
+{
+  MRI_Dataset *ds;
+  int ok;
+
+  ds = mri_open_dataset(Name(), MRI_READ);
+  if (random)
+    ok = CompareRandom(ds);
+  else
+    ok = Compare(ds, 0, n_bytes);
+  mri_close_dataset(ds);
+  return(ok);
+}
+
+static void
+SetShape (MRI_Dataset *ds, long long *shape)
+{
+  char key[64];
+  int i;
+
+  for (i = 0; i < 4; ++i)
+    if (shape[i] > 0)
+      {
+	sprintf(key, "images.block.%c", dims[i]);
+	mri_set_int(ds, key, shape[i]);
+      }
+}
+
+/* Checks that the header holds a block.<dim> key for every
+   dimension, or for none */
+static int
+HasBlockKeys (int wanted)
+{
+  MRI_Dataset *ds;
+  char key[64];
+  int i, ok;
+
+  ds = mri_open_dataset(Name(), MRI_READ);
+  ok = 1;
+  for (i = 0; i < 4; ++i)
+    {
+      sprintf(key, "images.block.%c", dims[i]);
+      if (mri_has(ds, key) != wanted)
+	ok = 0;
+    }
+  mri_close_dataset(ds);
+  return(ok);
+}
+
+static void
+Report (char *step, int ok)
+{
+  if (!ok)
+    {
+      printf("  %-28s FAILED\n", step);
+      ++failures;
+    }
+}
+
+static void
+Create (int type, int coding, long long *shape)
+{
+  MRI_Dataset *ds;
+  long long n, i, k;
+  char key[64];
+  int j;
+
+  ds = mri_open_dataset(Name(), MRI_WRITE);
+  mri_create_chunk(ds, "images");
+  mri_set_string(ds, "images.datatype", datatypes[type]);
+  mri_set_string(ds, "images.dimensions", dims);
+  n = 1;
+  for (j = 0; j < 4; ++j)
+    {
+      sprintf(key, "images.extent.%c", dims[j]);
+      mri_set_int(ds, key, extent[j]);
+      n *= extent[j];
+    }
+  mri_set_string(ds, "images.file", ".dat");
+  mri_set_string(ds, "images.compression", codings[coding]);
+  SetShape(ds, shape);
+
+  /* write the whole chunk in pieces of assorted sizes and kinds */
+  for (i = 0; i < n; i += k)
+    {
+      k = 1 + Random() % 20000;
+      if (k > n - i)
+	k = n - i;
+      Write(ds, type, i, k, (int) (Random() % 4));
+    }
+  mri_close_dataset(ds);
+}
+
+static void
+Rewrite (int type)
+{
+  MRI_Dataset *ds;
+  long long n, offset, count;
+  int i, ok;
+
+  n = n_bytes / type_sizes[type];
+  ds = mri_open_dataset(Name(), MRI_MODIFY);
+  ok = 1;
+  for (i = 0; i < N_REWRITES; ++i)
+    {
+      offset = Random() % n;
+      count = 1 + Random() % (n / 4);
+      if (offset + count > n)
+	count = n - offset;
+      Write(ds, type, offset, count, (int) (Random() % 4));
+      /* reads must see the new data before the dataset is closed */
+      if (!CompareRandom(ds))
+	ok = 0;
+    }
+  mri_close_dataset(ds);
+  Report("rewrite (open)", ok);
+  Report("rewrite (reopened)", CompareAll(1) && CompareAll(0));
+}
+
+static void
+Switch (int type, int coding, int shape)
+{
+  MRI_Dataset *ds;
+
+  /* turn compression off, either way it can be done */
+  ds = mri_open_dataset(Name(), MRI_MODIFY);
+  if (shape % 2)
+    mri_remove(ds, "images.compression");
+  else
+    mri_set_string(ds, "images.compression", "none");
+  mri_close_dataset(ds);
+  Report("uncompressed", CompareAll(0) && CompareAll(1));
+  Report("block keys dropped", HasBlockKeys(0));
+
+  /* and on again, with the other coding and another shape */
+  ds = mri_open_dataset(Name(), MRI_MODIFY);
+  mri_set_string(ds, "images.compression", codings[1 - coding]);
+  SetShape(ds, shapes[(shape + 2) % N_SHAPES]);
+  mri_close_dataset(ds);
+  Report("recompressed", CompareAll(0) && CompareAll(1));
+  Report("block keys recorded", HasBlockKeys(1));
+}
+
+int
+main (int argc, char **argv)
+{
+  MRI_Dataset *ds;
+  int type, coding, shape, before;
+  long long n;
+
+  if (argc > 1)
+    strcpy(dir, argv[1]);
+  if (argc > 2)
+    rng_state = atoll(argv[2]);
+  if (argc > 3)
+    {
+      fprintf(stderr, "usage: %s [directory [seed]]\n", argv[0]);
+      exit(-1);
+    }
+
+  n = extent[0] * extent[1] * extent[2] * extent[3];
+  model = (unsigned char *) malloc(n * sizeof(double));
+  for (type = 0; type < N_DATATYPES; ++type)
+    for (coding = 0; coding < N_CODINGS; ++coding)
+      for (shape = 0; shape < N_SHAPES; ++shape)
+	{
+	  before = failures;
+	  n_bytes = n * type_sizes[type];
+	  Create(type, coding, shapes[shape]);
+	  Report("write", CompareAll(0));
+	  Report("random reads", CompareAll(1));
+	  Report("block keys recorded", HasBlockKeys(1));
+	  Rewrite(type);
+	  Switch(type, coding, shape);
+	  printf("%-8s %-11s shape %d   %s\n", datatypes[type], codings[coding],
+		 shape, failures == before ? "ok" : "FAILED");
+	  ds = mri_open_dataset(Name(), MRI_MODIFY);
+	  mri_destroy_dataset(ds);
+	}
+  free(model);
+
+  if (failures)
+    {
+      printf("%d checks FAILED\n", failures);
+      exit(1);
+    }
+  printf("all checks passed\n");
+  return(0);
+}
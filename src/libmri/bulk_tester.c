@@ -0,0 +1,238 @@
+/************************************************************
+ *                                                          *
+ *  Permission is hereby granted to any individual or       *
+ *  institution for use, copying, or redistribution of      *
+ *  this code and associated documentation, provided        *
+ *  that such code and documentation are not sold for       *
+ *  profit and the following copyright notice is retained   *
+ *  in the code and documentation:                          *
+ *                                                          *
+ *     Copyright (c) 1999 Carnegie Mellon University        *
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ ***********************************************************/
+/*
+ *	bulk_tester.c - check and time libmri's whole-chunk transfers
+ *
+ *	usage: bulk_tester [megabytes [directory]]
+ *
+ *	A dataset holding one int16 chunk of the given size (default
+ *	256 MB) is written into the directory (default /tmp), then
+ *
+ *		copied with mri_copy_dataset,
+ *		repositioned by moving the chunk to another file, and
+ *		converted by changing its datatype to float32,
+ *
+ *	each once with stdio (MRI_BULK_IO=0) and once through the bulk
+ *	transfer path, and with O_DIRECT as well if MRI_DIRECT_IO is
+ *	set in the environment.  The data are checked after every step
+ *	and the rate of each is reported in MB/s of chunk data.  The
+ *	files live in the page cache unless the dataset is larger than
+ *	memory, so the rates are best compared with one another.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "mri.h"
+
+#define PIECE	(1024*1024)	/* elements checked at a time */
+
+static long long n;		/* elements in the chunk */
+static char dir[512] = "/tmp";
+static int failures = 0;
+
+static double
+Now ()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return(tv.tv_sec + 1.0e-6*tv.tv_usec);
+}
+
+static short
+Value (long long i)
+{
+  return((short) ((i * 7919) ^ (i >> 13)));
+}
+
+static char *
+Name (char *base)
+{
+  static char name[1024];
+
+  sprintf(name, "%s/%s", dir, base);
+  return(name);
+}
+
+static void
+Create ()
+{
+  MRI_Dataset *ds;
+  short *buf;
+  long long i, j, k;
+
+  buf = (short *) malloc(PIECE * sizeof(short));
+  ds = mri_open_dataset(Name("bulk_a"), MRI_WRITE);
+  mri_create_chunk(ds, "images");
+  mri_set_string(ds, "images.datatype", "int16");
+  mri_set_string(ds, "images.dimensions", "x");
+  mri_set_int(ds, "images.extent.x", n);
+  mri_set_string(ds, "images.file", ".dat");
+  for (i = 0; i < n; i += PIECE)
+    {
+      k = (n - i < PIECE) ? n - i : PIECE;
+      for (j = 0; j < k; ++j)
+	buf[j] = Value(i + j);
+      mri_set_chunk(ds, "images", k, i, MRI_SHORT, buf);
+    }
+  mri_close_dataset(ds);
+  free(buf);
+}
+
+static int
+Check (char *base)
+{
+  MRI_Dataset *ds;
+  float *f;
+  long long i, j, k;
+  int ok;
+
+  ok = 1;
+  ds = mri_open_dataset(Name(base), MRI_READ);
+  for (i = 0; ok && i < n; i += PIECE)
+    {
+      k = (n - i < PIECE) ? n - i : PIECE;
+      f = (float *) mri_get_chunk(ds, "images", k, i, MRI_FLOAT);
+      for (j = 0; j < k; ++j)
+	if (f[j] != (float) Value(i + j))
+	  {
+	    ok = 0;
+	    break;
+	  }
+    }
+  mri_close_dataset(ds);
+  return(ok);
+}
+
+static double
+CopyStep ()
+{
+  MRI_Dataset *ds, *nds;
+  double t0;
+
+  t0 = Now();
+  ds = mri_open_dataset(Name("bulk_a"), MRI_READ);
+  nds = mri_copy_dataset(Name("bulk_b"), ds);
+  mri_close_dataset(nds);
+  mri_close_dataset(ds);
+  return(Now() - t0);
+}
+
+static double
+RepositionStep ()
+{
+  MRI_Dataset *ds;
+  double t0;
+
+  t0 = Now();
+  ds = mri_open_dataset(Name("bulk_b"), MRI_MODIFY);
+  mri_set_string(ds, "images.file", ".moved.dat");
+  mri_close_dataset(ds);
+  return(Now() - t0);
+}
+
+static double
+ConvertStep ()
+{
+  MRI_Dataset *ds;
+  double t0;
+
+  t0 = Now();
+  ds = mri_open_dataset(Name("bulk_b"), MRI_MODIFY);
+  mri_set_string(ds, "images.datatype", "float32");
+  mri_close_dataset(ds);
+  return(Now() - t0);
+}
+
+static void
+Report (char *name, char *mode, double t, int ok)
+{
+  printf("%-12s %-8s %9.1f MB/s   %s\n", name, mode,
+	 2.0*n/(1.0e6*t), ok ? "ok" : "MISMATCH");
+  if (!ok)
+    ++failures;
+}
+
+static void
+Run (char *mode)
+{
+  MRI_Dataset *ds;
+  double t;
+
+  t = CopyStep();
+  Report("copy", mode, t, Check("bulk_b"));
+  t = RepositionStep();
+  Report("reposition", mode, t, Check("bulk_b"));
+  t = ConvertStep();
+  Report("convert", mode, t, Check("bulk_b"));
+  ds = mri_open_dataset(Name("bulk_b"), MRI_MODIFY);
+  mri_destroy_dataset(ds);
+}
+
+int
+main (int argc, char **argv)
+{
+  MRI_Dataset *ds;
+  long long mb = 256;
+  int direct;
+
+  if (argc > 1)
+    mb = atoll(argv[1]);
+  if (argc > 2)
+    strcpy(dir, argv[2]);
+  if (mb <= 0 || argc > 3)
+    {
+      fprintf(stderr, "usage: %s [megabytes [directory]]\n", argv[0]);
+      exit(-1);
+    }
+  n = mb * 1024 * 1024 / 2;
+  direct = getenv("MRI_DIRECT_IO") != NULL && atoi(getenv("MRI_DIRECT_IO"));
+  unsetenv("MRI_DIRECT_IO");
+
+  printf("%lld MB chunk in %s\n", mb, dir);
+  Create();
+
+  setenv("MRI_BULK_IO", "0", 1);
+  Run("stdio");
+  setenv("MRI_BULK_IO", "1", 1);
+  Run("bulk");
+  if (direct)
+    {
+      setenv("MRI_DIRECT_IO", "1", 1);
+      Run("direct");
+    }
+
+  ds = mri_open_dataset(Name("bulk_a"), MRI_MODIFY);
+  mri_destroy_dataset(ds);
+  if (failures)
+    {
+      printf("%d transfers FAILED\n", failures);
+      exit(1);
+    }
+  printf("all transfers correct\n");
+  return(0);
+}
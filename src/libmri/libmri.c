@@ -34,6 +34,11 @@
 #endif
 #endif
 
+#if !defined(CRAY) && !defined(T3D) && !defined(T3E)
+#define USE_MMAP
+#define USE_BULK_IO
+#endif
+
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
@@ -47,10 +52,19 @@
 #include <values.h>
 #endif
 #include <errno.h>
-#ifdef AFS
 #include <sys/types.h>
+#include <sys/stat.h>
+#ifdef AFS
 #include <sys/wait.h>
-#include <errno.h>
+#endif
+#ifdef USE_MMAP
+#include <sys/mman.h>
+#endif
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif
+#if defined(USE_PTHREAD) || defined(USE_BULK_IO)
+#include <fcntl.h>
 #endif
 #include "mri.h"
 #include "bio.h"
@@ -72,6 +86,13 @@
 #define BUFFER_SIZE	1048575
 #define MAX_CHUNK_SIZE  LONGLONG_MAX
 
+/* bulk transfers; see "Bulk transfers" */
+#define BULK_ALIGNMENT	4096	/* suits O_DIRECT on most devices */
+#if defined(LINUX) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#endif
+
 typedef struct EmptyBlock {
   long long start;
   long long end;
@@ -85,8 +106,174 @@ typedef struct CopyRequest {
   long long dest_offset;
   long long size;
   MRI_Chunk *chunk;
+  struct MRI_File *unpacked;	/* a flat copy of a compressed chunk's
+				   old data to be removed afterwards,
+				   or NULL */
 } CopyRequest;
 
+/* a single block of background I/O */
+typedef struct IOJob {
+  struct IOJob *next;		/* the next job in the engine's queue */
+  struct IOJob *next_in_stream;	/* the next job belonging to the
+				   same stream */
+  struct MRI_Stream *stream;	/* the stream that owns this job */
+  int is_write;			/* TRUE for write-behind, FALSE for
+				   read-ahead */
+  long long file_offset;	/* the absolute byte offset in the file */
+  long long nbytes;		/* the length of the block in bytes */
+  unsigned char *data;		/* the block itself, in file byte order */
+  int cancelled;		/* if TRUE, the engine should skip this job */
+  int done;			/* set by the engine when the job completes */
+  int failed;			/* set by the engine if the I/O failed */
+} IOJob;
+
+typedef struct MRI_Stream {
+  MRI_Chunk *chunk;		/* the chunk being streamed */
+  int fd;			/* a private descriptor for the chunk's file,
+				   used only by the engine thread */
+  long long read_end;		/* the file offset at which the last
+				   read ended */
+  long long read_len;		/* the length of the last read */
+  int read_run;			/* the number of consecutive sequential
+				   reads of equal length */
+  long long write_end;		/* likewise for writes */
+  long long write_len;
+  int write_run;
+  IOJob *reads;			/* queued read-ahead blocks, oldest first */
+  int n_reads;
+  IOJob *writes;		/* queued write-behind blocks, oldest first */
+  int n_writes;
+  IOJob *spares;		/* finished jobs kept for reuse */
+  int dirty;			/* TRUE if the engine has written to the
+				   file since stdio last looked at it */
+} MRI_Stream;
+
+typedef struct MRI_StreamEngine {
+#ifdef USE_PTHREAD
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t work;		/* signalled when a job is queued */
+  pthread_cond_t finished;	/* signalled when a job completes */
+#endif
+  IOJob *head;			/* the queue of jobs not yet started */
+  IOJob *tail;
+  int shutdown;			/* set to tell the engine thread to exit */
+  int busy;			/* TRUE while the thread performs a job */
+  int orphaned;			/* TRUE in a forked child, which has no
+				   engine thread; jobs then run inline */
+  struct MRI_StreamEngine *next_engine;	/* all live engines */
+} MRI_StreamEngine;
+
+/* the container format of compressed chunks; see "Blocked storage" */
+#define BLK_MAGIC		"PghMRIblk1"
+#define BLK_SUPERBLOCK_SIZE	512
+#define BLK_INDEX_ENTRY_SIZE	16
+#define MAX_BLOCK_BYTES		(1LL << 30)
+
+/* how an individual block is coded */
+#define BLK_ABSENT	0	/* all zero, and not stored */
+#define BLK_STORED	1	/* stored as is */
+#define BLK_LZ		2	/* LZ compressed */
+#define BLK_SHUFFLE_LZ	3	/* byte-shuffled, then LZ compressed */
+
+#define LZ_HASH_BITS	14
+#define LZ_MIN_MATCH	4
+
+/* a decoded block of a compressed chunk held in memory */
+typedef struct BlockCacheEntry {
+  long long index;		/* the block number, or -1 if unused */
+  unsigned char *data;		/* the decoded block, in file byte order */
+  int dirty;			/* TRUE if it must be written back */
+  unsigned int last_use;	/* for least-recently-used replacement */
+} BlockCacheEntry;
+
+/* the open container of a compressed chunk */
+typedef struct MRI_BlockStore {
+  MRI_Dataset *ds;
+  MRI_File *file;		/* the file holding the container */
+  int writeable;		/* TRUE if blocks may be written */
+  MRI_Compression compression;	/* how new blocks are coded */
+  int element_size;		/* the number of bytes per element */
+  int n_dims;			/* the chunk's extents and block shape */
+  long long extent[MRI_MAX_DIMS];
+  long long block[MRI_MAX_DIMS];
+  int n_merged;			/* the same after merging dimensions that
+				   are not split (dimension 0 in bytes) */
+  long long m_extent[MRI_MAX_DIMS];
+  long long m_block[MRI_MAX_DIMS];
+  long long m_count[MRI_MAX_DIMS]; /* the number of blocks along each
+				   merged dimension */
+  long long block_bytes;	/* the decoded size of every block */
+  long long n_blocks;
+  long long *blk_offset;	/* the index */
+  int *blk_length;
+  unsigned char *blk_coding;
+  long long end_offset;		/* the end of the block data */
+  long long dead_bytes;		/* bytes of block data no longer in use */
+  int index_dirty;		/* TRUE if the index on disk is stale */
+  BlockCacheEntry cache[MRI_BLOCK_CACHE_COUNT];
+  unsigned int use_count;
+  unsigned char *scratch;	/* the staging area handed out by
+				   BlockFetch and BlockWriteBegin */
+  long long scratch_size;
+  long long pending_offset;	/* the write awaiting BlockWriteCommit */
+  long long pending_bytes;
+  unsigned char *coded;		/* working space for the coder */
+  unsigned char *shuffled;
+  int *hash;
+} MRI_BlockStore;
+
+/* the binary index of a dataset's header; see "Header index" */
+#define IDX_MAGIC		"PghMRIidx1"
+#define IDX_BYTE_ORDER		0x01020304
+
+/* file times in nanoseconds, as finely as the system keeps them, so
+   that a rewrite within the same second still shows */
+#if defined(LINUX)
+#define MTIME_NS(st)	(1000000000LL*(st).st_mtime + (st).st_mtim.tv_nsec)
+#define CTIME_NS(st)	(1000000000LL*(st).st_ctime + (st).st_ctim.tv_nsec)
+#elif defined(DARWIN)
+#define MTIME_NS(st)	(1000000000LL*(st).st_mtime + \
+			 (st).st_mtimespec.tv_nsec)
+#define CTIME_NS(st)	(1000000000LL*(st).st_ctime + \
+			 (st).st_ctimespec.tv_nsec)
+#else
+#define MTIME_NS(st)	(1000000000LL*(st).st_mtime)
+#define CTIME_NS(st)	(1000000000LL*(st).st_ctime)
+#endif
+
+typedef struct IndexPreamble {
+  char magic[16];
+  int byte_order;		/* IDX_BYTE_ORDER, as the writer saw it */
+  int n_keys;
+  int n_buckets;		/* a power of 2 */
+  int n_chunks;
+  long long header_size;	/* as ReadHeader would have found it */
+  long long mri_size;		/* the .mri file that was indexed */
+  long long mri_mtime;		/* in nanoseconds */
+  long long mri_ctime;
+  long long mri_inode;
+  long long strings_size;	/* the length of the string area */
+} IndexPreamble;
+
+typedef struct IndexEntry {
+  int next;			/* the next entry in the bucket, or -1 */
+  int key;			/* offsets into the string area */
+  int value;
+} IndexEntry;
+
+/* an open header index */
+typedef struct MRI_HeaderIndex {
+  char *base;			/* the contents of the index file */
+  long long length;
+  int mapped;			/* TRUE if base is memory-mapped */
+  IndexPreamble *preamble;
+  int *buckets;			/* the first entry in each bucket, or -1 */
+  IndexEntry *entries;
+  int *chunk_list;		/* the entries whose value is "[chunk]" */
+  char *strings;
+} MRI_HeaderIndex;
+
 static char rcsid[] = "$Id: libmri.c,v 1.46 2007/04/26 23:17:23 welling Exp $";
 
 char *mri_error = NULL;
@@ -151,6 +338,52 @@ static int CheckForRemovalHooks (MRI_Dataset *ds, MRI_KeyValue *kv);
 static int ConvertDatatype (MRI_Datatype *pdt, char *s);
 static void mri_report_error (MRI_Dataset *ds, char *fmt, ...);
 static void mri_report_warning (MRI_Dataset *ds, char *fmt, ...);
+static int IsNativeLayout (MRI_Chunk *ch, MRI_ArrayType type);
+static void *MapChunk (MRI_Chunk *ch, long long size, long long offset,
+		       MRI_ArrayType type, int transient);
+static void UnmapAll (MRI_Dataset *ds);
+static int ReleaseMapping (MRI_Dataset *ds, void *ptr);
+static MRI_Stream *GetStream (MRI_Chunk *ch);
+static void CloseStream (MRI_Chunk *ch);
+static void CloseAllStreams (MRI_Dataset *ds);
+static void StopStreamEngine (MRI_Dataset *ds);
+static IOJob *StreamFetch (MRI_Chunk *ch, long long offset, long long nbytes);
+static IOJob *StreamWriteBegin (MRI_Chunk *ch, long long offset,
+				long long nbytes);
+static void StreamWriteCommit (IOJob *job);
+static void RecycleJob (IOJob *job);
+static void SyncFile (MRI_File *file);
+static int ConvertCompression (MRI_Compression *pc, char *s);
+static void ComputeBlockShape (MRI_Chunk *ch);
+static void RemoveBlockKeys (MRI_Chunk *ch);
+static int SameBlockLayout (MRI_Chunk *ch);
+static unsigned char *BlockFetch (MRI_Chunk *ch, long long offset,
+				  long long nbytes);
+static unsigned char *BlockWriteBegin (MRI_Chunk *ch, long long offset,
+				       long long nbytes);
+static void BlockWriteCommit (MRI_Chunk *ch);
+static int ReserveScratch (MRI_BlockStore *bs, long long nbytes);
+static void FreeBlockStore (MRI_BlockStore *bs);
+static void CloseBlockStore (MRI_Chunk *ch);
+static void CloseAllBlockStores (MRI_Dataset *ds);
+static void PackChunk (MRI_Chunk *ch, MRI_File *src);
+static MRI_File *UnpackChunk (MRI_Chunk *ch);
+static MRI_KeyValue *AddToHashTable (MRI_Dataset *ds, const char *key);
+static int BulkRead (MRI_File *file, long long offset, unsigned char *buf,
+		     long long n);
+static int BulkWrite (MRI_File *file, long long offset, unsigned char *buf,
+		      long long n);
+static int BulkCopy (MRI_File *dest_file, long long dest_offset,
+		     MRI_File *src_file, long long src_offset, long long size);
+static int BulkClear (MRI_File *dest_file, long long dest_offset,
+		      long long size);
+static int HeaderIndexThreshold (void);
+static void IndexFileName (MRI_Dataset *ds, char *name);
+static int OpenHeaderIndex (MRI_Dataset *ds);
+static void CloseHeaderIndex (MRI_HeaderIndex *hi);
+static char *IndexLookup (MRI_HeaderIndex *hi, const char *key);
+static void LoadHeaderIndex (MRI_Dataset *ds);
+static void WriteHeaderIndex (MRI_Dataset *ds);
 static void CopyConvFloatLonglong(float* float_buf,
 				  long long* longlong_buf,
 				  int size,int* error);
@@ -186,11 +419,13 @@ MRI_Dataset
 {
   MRI_Dataset *ds;
   MRI_KeyValue *kv;
+  MRI_HeaderIndex *hi;
   int i;
   MRI_Chunk *ch;
   long long first_start;
   char file_name[MRI_MAX_FILENAME_LENGTH+1];
   int empty;
+  char *s;
   static int bio_initialized = FALSE;
 
 #ifdef DEBUG
@@ -239,6 +474,7 @@ MRI_Dataset
   ds->n_keys = 0;
   ds->hash_table_size = 64;
   ds->hash_table = (MRI_KeyValue **) calloc(ds->hash_table_size, sizeof(MRI_KeyValue *));
+  ds->header_index = NULL;
 
   ds->iteration_table = NULL;
   ds->iteration_count = 0;
@@ -249,6 +485,12 @@ MRI_Dataset
 
   ds->buffers = NULL;
   ds->retained_buffers = NULL;
+  ds->mappings = NULL;
+  ds->map_images = FALSE;
+  ds->stream_depth = MRI_DEFAULT_STREAM_DEPTH;
+  if ((s = getenv("MRI_STREAM_DEPTH")) != NULL)
+    ds->stream_depth = atoi(s);
+  ds->stream_engine = NULL;
 
 #ifdef AFS
   ds->some_parts_in_afs= CheckForAFS(ds->name);
@@ -275,7 +517,7 @@ MRI_Dataset
   rewind(ds->header_file->fp);
   if (ds->mode == MRI_WRITE || empty)
     CreateNewDataset(ds);
-  else if (!ReadHeader(ds, ds->header_file->fp))
+  else if (!OpenHeaderIndex(ds) && !ReadHeader(ds, ds->header_file->fp))
     {
       DeallocateDataset(ds);
       return(NULL);
@@ -294,16 +536,31 @@ MRI_Dataset
 
 
   /* build the associated chunk data structures */
-  for (i = 0; i < ds->hash_table_size; ++i)
-    for (kv = ds->hash_table[i]; kv != NULL; kv = kv->next_in_hash_table)
-      if (strcmp(kv->value, "[chunk]") == 0)
-	if (NewChunk(ds, kv->key) == NULL)
+  if ((hi = ds->header_index) != NULL)
+    {
+      /* the index lists the chunks, so we need not look
+	 at every key */
+      for (i = 0; i < hi->preamble->n_chunks; ++i)
+	if (NewChunk(ds, hi->strings + hi->entries[hi->chunk_list[i]].key)
+	    == NULL)
 	  {
 	    mri_report_error(ds, "mri_open_dataset: error in chunk %s\n",
-			     kv->key);
+			     hi->strings + hi->entries[hi->chunk_list[i]].key);
 	    DeallocateDataset(ds);
 	    return(NULL);
 	  }
+    }
+  else
+    for (i = 0; i < ds->hash_table_size; ++i)
+      for (kv = ds->hash_table[i]; kv != NULL; kv = kv->next_in_hash_table)
+	if (strcmp(kv->value, "[chunk]") == 0)
+	  if (NewChunk(ds, kv->key) == NULL)
+	    {
+	      mri_report_error(ds, "mri_open_dataset: error in chunk %s\n",
+			       kv->key);
+	      DeallocateDataset(ds);
+	      return(NULL);
+	    }
 
   /* check if there is actually more space reserved for the header */
   first_start = 999999999999999999LL;
@@ -320,6 +577,7 @@ MRI_Dataset
 MRI_Dataset *mri_copy_dataset (const char *filename, MRI_Dataset *original)
 {
   MRI_Dataset *ds, *nds;
+  int i;
   int count;
   int len;
   long long total;
@@ -419,6 +677,9 @@ MRI_Dataset *mri_copy_dataset (const char *filename, MRI_Dataset *original)
 	  nch->actual_little_endian = ch->little_endian;
 	  nch->actual_offset = ch->offset;
 	  nch->actual_size = ch->size;
+	  nch->actual_compression = ch->compression;
+	  for (i = 0; i < (int) strlen(ch->dimensions); ++i)
+	    nch->actual_block[i] = ch->block[i];
 	  nch->modified = TRUE;
 	  nds->recompute_positions = TRUE;
 	}
@@ -448,10 +709,27 @@ mri_close_dataset (MRI_Dataset *ds)
   Log("Closing dataset %s\n", ds->name);
 #endif
 
+  /* mappings and background I/O must go before any chunks
+     get moved or files truncated */
+  UnmapAll(ds);
+  CloseAllStreams(ds);
+  CloseAllBlockStores(ds);
+
   /* if the dataset is read-only or just data-writable,
      we only have to throw away the stuff in memory */
   if (ds->mode == MRI_READ || ds->mode == MRI_MODIFY_DATA)
     {
+      /* data written into the .mri file itself changes the
+	 file's dates, which a header index must be brought
+	 up to date with */
+      if (ds->mode == MRI_MODIFY_DATA)
+	for (ch = ds->chunks; ch != NULL; ch = ch->next)
+	  if (ch->file == ds->header_file)
+	    {
+	      CloseFile(ds->header_file);
+	      WriteHeaderIndex(ds);
+	      break;
+	    }
       DeallocateDataset(ds);
       return;
     }
@@ -527,6 +805,11 @@ mri_close_dataset (MRI_Dataset *ds)
   if (ds->some_parts_in_afs) FlushAFS(ds);
 #endif
 
+  /* the header index is stamped with the final state of
+     the .mri file, so that must be on disk first */
+  CloseFile(ds->header_file);
+  WriteHeaderIndex(ds);
+
   /* throw away stuff in memory */
   DeallocateDataset(ds);
 }
@@ -535,6 +818,7 @@ void
 mri_destroy_dataset (MRI_Dataset *ds)
 {
   MRI_File *f;
+  char name[MRI_MAX_FILENAME_LENGTH+5];
 
   if (ds->mode == MRI_READ || ds->mode == MRI_MODIFY_DATA)
     {
@@ -553,6 +837,8 @@ mri_destroy_dataset (MRI_Dataset *ds)
 #endif
 	(void) unlink(f->name);
       }
+  IndexFileName(ds, name);
+  (void) unlink(name);
 
   /* deallocate */
   DeallocateDataset(ds);
@@ -701,6 +987,9 @@ mri_iterate_over_keys (MRI_Dataset *ds)
   if (ds->iteration_table != NULL)
     free(ds->iteration_table);
 
+  /* every key must be in the hash table */
+  LoadHeaderIndex(ds);
+
   /* sort the keys in a table */
   ds->iteration_table = (MRI_KeyValue **) malloc(ds->n_keys * sizeof(MRI_KeyValue *));
   n = 0;
@@ -798,6 +1087,8 @@ mri_read_chunk (MRI_Dataset *ds, const char *key, long long size,
   int conv_error;
   int saved_bio_big_endian_input;
   int saved_bio_error;
+  IOJob *job;
+  unsigned char *data;
 
   for (ch = ds->chunks; ch != NULL; ch = ch->next)
     if (strcmp(ch->name, key) == 0)
@@ -854,16 +1145,42 @@ mri_read_chunk (MRI_Dataset *ds, const char *key, long long size,
   if (type == MRI_RAW)
     {
       uchar_buf = (unsigned char*)buffer;
-      ChunkSeek(ch, offset);
-      FRdUInt8Array(ch->file->fp, uchar_buf, size);
+      if (ch->compression != MRI_NO_COMPRESSION)
+	{
+	  if ((data = BlockFetch(ch, offset, size)) != NULL)
+	    BRdUInt8Array(data, uchar_buf, size);
+	}
+      else if ((job = StreamFetch(ch, offset, size)) != NULL)
+	{
+	  BRdUInt8Array(job->data, uchar_buf, size);
+	  RecycleJob(job);
+	}
+      else
+	{
+	  ChunkSeek(ch, offset);
+	  FRdUInt8Array(ch->file->fp, uchar_buf, size);
+	}
     }
   else switch (ch->datatype)
     {
     case MRI_UINT8:
       if (uchar_buf==NULL) 
 	uchar_buf= (unsigned char*)GetBuffer(ds,size*sizeof(char));
-      ChunkSeek(ch, offset);
-      FRdUInt8Array(ch->file->fp, uchar_buf, size);
+      if (ch->compression != MRI_NO_COMPRESSION)
+	{
+	  if ((data = BlockFetch(ch, offset, size)) != NULL)
+	    BRdUInt8Array(data, uchar_buf, size);
+	}
+      else if ((job = StreamFetch(ch, offset, size)) != NULL)
+	{
+	  BRdUInt8Array(job->data, uchar_buf, size);
+	  RecycleJob(job);
+	}
+      else
+	{
+	  ChunkSeek(ch, offset);
+	  FRdUInt8Array(ch->file->fp, uchar_buf, size);
+	}
       switch (type)
 	{
 	case MRI_UNSIGNED_CHAR:
@@ -905,8 +1222,21 @@ mri_read_chunk (MRI_Dataset *ds, const char *key, long long size,
     case MRI_INT16:
       if (short_buf==NULL)
 	short_buf = (short *)GetBuffer(ds, size*sizeof(short));
-      ChunkSeek(ch, 2*offset);
-      FRdInt16Array(ch->file->fp, short_buf, size);
+      if (ch->compression != MRI_NO_COMPRESSION)
+	{
+	  if ((data = BlockFetch(ch, 2*offset, 2*size)) != NULL)
+	    BRdInt16Array(data, short_buf, size);
+	}
+      else if ((job = StreamFetch(ch, 2*offset, 2*size)) != NULL)
+	{
+	  BRdInt16Array(job->data, short_buf, size);
+	  RecycleJob(job);
+	}
+      else
+	{
+	  ChunkSeek(ch, 2*offset);
+	  FRdInt16Array(ch->file->fp, short_buf, size);
+	}
       switch (type)
 	{
 	case MRI_UNSIGNED_CHAR:
@@ -929,7 +1259,7 @@ mri_read_chunk (MRI_Dataset *ds, const char *key, long long size,
 	  break;
 
 	case MRI_INT:
-	  for (i = 0; i < size; ++i) int_buf[i] = short_buf[i];
+	  BCvtInt16ToInt32Array(short_buf, int_buf, size);
 	  break;
 
 	case MRI_LONG:
@@ -941,11 +1271,11 @@ mri_read_chunk (MRI_Dataset *ds, const char *key, long long size,
 	  break;
 
 	case MRI_FLOAT:
-	  for (i = 0; i < size; ++i) float_buf[i] = short_buf[i];
+	  BCvtInt16ToFloat32Array(short_buf, float_buf, size);
 	  break;
 
 	case MRI_DOUBLE:
-	  for (i = 0; i < size; ++i) double_buf[i] = short_buf[i];
+	  BCvtInt16ToFloat64Array(short_buf, double_buf, size);
 	  break;
 
 	default:
@@ -959,8 +1289,21 @@ mri_read_chunk (MRI_Dataset *ds, const char *key, long long size,
     case MRI_INT32:
       if (int_buf==NULL)
 	int_buf = (int *)GetBuffer(ds, size*sizeof(int));
-      ChunkSeek(ch, 4*offset);
-      FRdInt32Array(ch->file->fp, int_buf, size);
+      if (ch->compression != MRI_NO_COMPRESSION)
+	{
+	  if ((data = BlockFetch(ch, 4*offset, 4*size)) != NULL)
+	    BRdInt32Array(data, int_buf, size);
+	}
+      else if ((job = StreamFetch(ch, 4*offset, 4*size)) != NULL)
+	{
+	  BRdInt32Array(job->data, int_buf, size);
+	  RecycleJob(job);
+	}
+      else
+	{
+	  ChunkSeek(ch, 4*offset);
+	  FRdInt32Array(ch->file->fp, int_buf, size);
+	}
       switch (type)
 	{
 	case MRI_UNSIGNED_CHAR:
@@ -979,18 +1322,8 @@ mri_read_chunk (MRI_Dataset *ds, const char *key, long long size,
 	  break;
 
 	case MRI_SHORT:
-	  for (i = 0; i < size; ++i)
-	    if (int_buf[i] < SHRT_MIN)
-	      {
-		short_buf[i] = SHRT_MIN;
-		conv_error = TRUE;
-	      }
-	    else if (int_buf[i] > SHRT_MAX)
-	      {
-		short_buf[i] = SHRT_MAX;
-		conv_error = TRUE;
-	      }
-	    else short_buf[i] = int_buf[i];
+	  if (BCvtInt32ToInt16Array(int_buf, short_buf, size))
+	    conv_error = TRUE;
 	  break;
 
 	case MRI_INT:
@@ -1006,11 +1339,11 @@ mri_read_chunk (MRI_Dataset *ds, const char *key, long long size,
 	  break;
 
 	case MRI_FLOAT:
-	  for (i = 0; i < size; ++i) float_buf[i] = int_buf[i];
+	  BCvtInt32ToFloat32Array(int_buf, float_buf, size);
 	  break;
 
 	case MRI_DOUBLE:
-	  for (i = 0; i < size; ++i) double_buf[i] = int_buf[i];
+	  BCvtInt32ToFloat64Array(int_buf, double_buf, size);
 	  break;
 
 	default:
@@ -1024,8 +1357,21 @@ mri_read_chunk (MRI_Dataset *ds, const char *key, long long size,
     case MRI_INT64:
       if (longlong_buf==NULL)
 	longlong_buf = (long long *)GetBuffer(ds, size*sizeof(long long));
-      ChunkSeek(ch, 8*offset);
-      FRdInt64Array(ch->file->fp, longlong_buf, size);
+      if (ch->compression != MRI_NO_COMPRESSION)
+	{
+	  if ((data = BlockFetch(ch, 8*offset, 8*size)) != NULL)
+	    BRdInt64Array(data, longlong_buf, size);
+	}
+      else if ((job = StreamFetch(ch, 8*offset, 8*size)) != NULL)
+	{
+	  BRdInt64Array(job->data, longlong_buf, size);
+	  RecycleJob(job);
+	}
+      else
+	{
+	  ChunkSeek(ch, 8*offset);
+	  FRdInt64Array(ch->file->fp, longlong_buf, size);
+	}
       switch (type)
 	{
 	case MRI_UNSIGNED_CHAR:
@@ -1111,8 +1457,21 @@ mri_read_chunk (MRI_Dataset *ds, const char *key, long long size,
     case MRI_FLOAT32:
       if (float_buf==NULL)
 	float_buf = (float *)GetBuffer(ds, size*sizeof(float));
-      ChunkSeek(ch, 4*offset);
-      FRdFloat32Array(ch->file->fp, float_buf, size);
+      if (ch->compression != MRI_NO_COMPRESSION)
+	{
+	  if ((data = BlockFetch(ch, 4*offset, 4*size)) != NULL)
+	    BRdFloat32Array(data, float_buf, size);
+	}
+      else if ((job = StreamFetch(ch, 4*offset, 4*size)) != NULL)
+	{
+	  BRdFloat32Array(job->data, float_buf, size);
+	  RecycleJob(job);
+	}
+      else
+	{
+	  ChunkSeek(ch, 4*offset);
+	  FRdFloat32Array(ch->file->fp, float_buf, size);
+	}
       switch (type)
 	{
 	case MRI_UNSIGNED_CHAR:
@@ -1131,33 +1490,13 @@ mri_read_chunk (MRI_Dataset *ds, const char *key, long long size,
 	  break;
 
 	case MRI_SHORT:
-	  for (i = 0; i < size; ++i)
-	    if (float_buf[i] < (float) SHRT_MIN)
-	      {
-		short_buf[i] = SHRT_MIN;
-		conv_error = TRUE;
-	      }
-	    else if (float_buf[i] > (float)SHRT_MAX)
-	      {
-		short_buf[i] = SHRT_MAX;
-		conv_error = TRUE;
-	      }
-	    else short_buf[i] = (int) float_buf[i];
+	  if (BCvtFloat32ToInt16Array(float_buf, short_buf, size))
+	    conv_error = TRUE;
 	  break;
 
 	case MRI_INT:
-	  for (i = 0; i < size; ++i)
-	    if (float_buf[i] < (float)INT_MIN)
-	      {
-		int_buf[i] = INT_MIN;
-		conv_error = TRUE;
-	      }
-	    else if (float_buf[i] > (float)INT_MAX)
-	      {
-		int_buf[i] = INT_MAX;
-		conv_error = TRUE;
-	      }
-	    else int_buf[i] = float_buf[i];
+	  if (BCvtFloat32ToInt32Array(float_buf, int_buf, size))
+	    conv_error = TRUE;
 	  break;
 
 	case MRI_LONG:
@@ -1195,7 +1534,7 @@ mri_read_chunk (MRI_Dataset *ds, const char *key, long long size,
 	  break;
 
 	case MRI_DOUBLE:
-	  for (i = 0; i < size; ++i) double_buf[i] = float_buf[i];
+	  BCvtFloat32ToFloat64Array(float_buf, double_buf, size);
 	  break;
 
 	default:
@@ -1209,8 +1548,21 @@ mri_read_chunk (MRI_Dataset *ds, const char *key, long long size,
     case MRI_FLOAT64:
       if (double_buf==NULL)
 	double_buf = (double *)GetBuffer(ds, size*sizeof(double));
-      ChunkSeek(ch, 8*offset);
-      FRdFloat64Array(ch->file->fp, double_buf, size);
+      if (ch->compression != MRI_NO_COMPRESSION)
+	{
+	  if ((data = BlockFetch(ch, 8*offset, 8*size)) != NULL)
+	    BRdFloat64Array(data, double_buf, size);
+	}
+      else if ((job = StreamFetch(ch, 8*offset, 8*size)) != NULL)
+	{
+	  BRdFloat64Array(job->data, double_buf, size);
+	  RecycleJob(job);
+	}
+      else
+	{
+	  ChunkSeek(ch, 8*offset);
+	  FRdFloat64Array(ch->file->fp, double_buf, size);
+	}
       switch (type)
 	{
 	case MRI_UNSIGNED_CHAR:
@@ -1229,33 +1581,13 @@ mri_read_chunk (MRI_Dataset *ds, const char *key, long long size,
 	  break;
 
 	case MRI_SHORT:
-	  for (i = 0; i < size; ++i)
-	    if (double_buf[i] < (double)SHRT_MIN)
-	      {
-		short_buf[i] = SHRT_MIN;
-		conv_error = TRUE;
-	      }
-	    else if (double_buf[i] > (double)SHRT_MAX)
-	      {
-		short_buf[i] = SHRT_MAX;
-		conv_error = TRUE;
-	      }
-	    else short_buf[i] = (int) double_buf[i];
+	  if (BCvtFloat64ToInt16Array(double_buf, short_buf, size))
+	    conv_error = TRUE;
 	  break;
 
 	case MRI_INT:
-	  for (i = 0; i < size; ++i)
-	    if (double_buf[i] < (double)INT_MIN)
-	      {
-		int_buf[i] = INT_MIN;
-		conv_error = TRUE;
-	      }
-	    else if (double_buf[i] > (double)INT_MAX)
-	      {
-		int_buf[i] = INT_MAX;
-		conv_error = TRUE;
-	      }
-	    else int_buf[i] = double_buf[i];
+	  if (BCvtFloat64ToInt32Array(double_buf, int_buf, size))
+	    conv_error = TRUE;
 	  break;
 
 	case MRI_LONG:
@@ -1289,18 +1621,8 @@ mri_read_chunk (MRI_Dataset *ds, const char *key, long long size,
 	  break;
 
 	case MRI_FLOAT:
-	  for (i = 0; i < size; ++i)
-	    if (double_buf[i] < -MAXFLOAT)
-	      {
-		float_buf[i] = -MAXFLOAT;
-		conv_error = TRUE;
-	      }
-	    else if (double_buf[i] > MAXFLOAT)
-	      {
-		float_buf[i] = MAXFLOAT;
-		conv_error = TRUE;
-	      }
-	    else float_buf[i] = (float) double_buf[i];
+	  if (BCvtFloat64ToFloat32Array(double_buf, float_buf, size, FALSE))
+	    conv_error = TRUE;
 	  break;
 
 	case MRI_DOUBLE:
@@ -1350,6 +1672,65 @@ mri_get_chunk (MRI_Dataset *ds, const char *key, long long size,
 			GetBuffer(ds, MRI_ArrayTypeLength(type,size)));
 }
 
+void *
+mri_map_chunk (MRI_Dataset *ds, const char *key, long long size,
+	       long long offset, MRI_ArrayType type)
+{
+  MRI_Chunk *ch;
+  MRI_Mapping *m;
+  void *ptr;
+
+  for (ch = ds->chunks; ch != NULL; ch = ch->next)
+    if (strcmp(ch->name, key) == 0)
+      break;
+  if (ch == NULL)
+    {
+      mri_report_error(ds, "mri_map_chunk: no such chunk named %s\n",
+		       key);
+      return(NULL);
+    }
+
+  /* check that everything is in-bounds */
+  if (offset < 0 ||
+      (offset+size)*(type == MRI_RAW ? 1 : MRI_TypeLength(ch->datatype)) > ch->size)
+    { 
+      mri_report_error(ds, "mri_map_chunk: out-of-bounds parameters\n");
+      return(NULL);
+    }
+
+  if ((ptr = MapChunk(ch, size, offset, type, FALSE)) != NULL)
+    return(ptr);
+
+  /* the data cannot be used in place, so fall back to an
+     ordinary read into a buffer that mri_unmap_chunk will free */
+  if ((ptr = malloc((size_t) MRI_ArrayTypeLength(type, size))) == NULL)
+    {
+      mri_report_error(ds, "mri_map_chunk: cannot allocate %lld bytes\n",
+		       (long long) MRI_ArrayTypeLength(type, size));
+      return(NULL);
+    }
+  if (mri_read_chunk(ds, key, size, offset, type, ptr) == NULL)
+    {
+      free(ptr);
+      return(NULL);
+    }
+  m = (MRI_Mapping *) malloc(sizeof(MRI_Mapping));
+  m->base = NULL;
+  m->length = MRI_ArrayTypeLength(type, size);
+  m->ptr = ptr;
+  m->transient = FALSE;
+  m->next = ds->mappings;
+  ds->mappings = m;
+  return(ptr);
+}
+
+void
+mri_unmap_chunk (MRI_Dataset *ds, void *ptr)
+{
+  if (!ReleaseMapping(ds, ptr))
+    mri_report_error(ds, "mri_unmap_chunk: pointer was not returned by mri_map_chunk\n");
+}
+
 #if (HPPA || HPPA20)
 #pragma optimize off
 #endif
@@ -1411,6 +1792,8 @@ mri_set_chunk (MRI_Dataset *ds, const char *key,
   int conv_error;
   int saved_bio_big_endian_output;
   int saved_bio_error;
+  IOJob *job;
+  unsigned char *data;
 
   for (ch = ds->chunks; ch != NULL; ch = ch->next)
     if (strcmp(ch->name, key) == 0)
@@ -1442,16 +1825,48 @@ mri_set_chunk (MRI_Dataset *ds, const char *key,
   switch (type)
     {
     case MRI_RAW:
-      ChunkSeek(ch, offset);
-      FWrUInt8Array(ch->file->fp, buf, size);
+      if (ch->compression != MRI_NO_COMPRESSION)
+	{
+	  if ((data = BlockWriteBegin(ch, offset, size)) != NULL)
+	    {
+	      BWrUInt8Array(data, buf, size);
+	      BlockWriteCommit(ch);
+	    }
+	}
+      else if ((job = StreamWriteBegin(ch, offset, size)) != NULL)
+	{
+	  BWrUInt8Array(job->data, buf, size);
+	  StreamWriteCommit(job);
+	}
+      else
+	{
+	  ChunkSeek(ch, offset);
+	  FWrUInt8Array(ch->file->fp, buf, size);
+	}
       break;
 
     case MRI_UNSIGNED_CHAR:
       switch (ch->datatype)
 	{
 	case MRI_UINT8:
-	  ChunkSeek(ch, offset);
-	  FWrUInt8Array(ch->file->fp, buf, size);
+	  if (ch->compression != MRI_NO_COMPRESSION)
+	    {
+	      if ((data = BlockWriteBegin(ch, offset, size)) != NULL)
+		{
+		  BWrUInt8Array(data, buf, size);
+		  BlockWriteCommit(ch);
+		}
+	    }
+	  else if ((job = StreamWriteBegin(ch, offset, size)) != NULL)
+	    {
+	      BWrUInt8Array(job->data, buf, size);
+	      StreamWriteCommit(job);
+	    }
+	  else
+	    {
+	      ChunkSeek(ch, offset);
+	      FWrUInt8Array(ch->file->fp, buf, size);
+	    }
 	  break;
 	case MRI_INT16:
 	  uchar_buf = (unsigned char *) buf;
@@ -1515,13 +1930,28 @@ mri_set_chunk (MRI_Dataset *ds, const char *key,
 	  mri_set_chunk(ds, key, size, offset, MRI_UNSIGNED_CHAR, uchar_buf);
 	  break;
 	case MRI_INT16:
-	  ChunkSeek(ch, 2*offset);
-	  FWrInt16Array(ch->file->fp, buf, size);
+	  if (ch->compression != MRI_NO_COMPRESSION)
+	    {
+	      if ((data = BlockWriteBegin(ch, 2*offset, 2*size)) != NULL)
+		{
+		  BWrInt16Array(data, buf, size);
+		  BlockWriteCommit(ch);
+		}
+	    }
+	  else if ((job = StreamWriteBegin(ch, 2*offset, 2*size)) != NULL)
+	    {
+	      BWrInt16Array(job->data, buf, size);
+	      StreamWriteCommit(job);
+	    }
+	  else
+	    {
+	      ChunkSeek(ch, 2*offset);
+	      FWrInt16Array(ch->file->fp, buf, size);
+	    }
 	  break;
 	case MRI_INT32:
 	  int_buf = (int *) GetBuffer(ds, size*sizeof(int));
-	  for (i = 0; i < size; ++i)
-	    int_buf[i] = short_buf[i];
+	  BCvtInt16ToInt32Array(short_buf, int_buf, size);
 	  mri_set_chunk(ds, key, size, offset, MRI_INT, int_buf);
 	  break;
 	case MRI_INT64:
@@ -1532,14 +1962,12 @@ mri_set_chunk (MRI_Dataset *ds, const char *key,
 	  break;
 	case MRI_FLOAT32:
 	  float_buf = (float *) GetBuffer(ds, size*sizeof(float));
-	  for (i = 0; i < size; ++i)
-	    float_buf[i] = short_buf[i];
+	  BCvtInt16ToFloat32Array(short_buf, float_buf, size);
 	  mri_set_chunk(ds, key, size, offset, MRI_FLOAT, float_buf);
 	  break;
 	case MRI_FLOAT64:
 	  double_buf = (double *) GetBuffer(ds, size*sizeof(double));
-	  for (i = 0; i < size; ++i)
-	    double_buf[i] = short_buf[i];
+	  BCvtInt16ToFloat64Array(short_buf, double_buf, size);
 	  mri_set_chunk(ds, key, size, offset, MRI_DOUBLE, double_buf);
 	  break;
 	default:
@@ -1570,23 +1998,29 @@ mri_set_chunk (MRI_Dataset *ds, const char *key,
 	  break;
 	case MRI_INT16:
 	  short_buf = (short *) GetBuffer(ds, size*sizeof(short));
-	  for (i = 0; i < size; ++i)
-	    if (int_buf[i] < SHRT_MIN)
-	      {
-		short_buf[i] = SHRT_MIN;
-		conv_error = TRUE;
-	      }
-	    else if (int_buf[i] > SHRT_MAX)
-	      {
-		short_buf[i] = SHRT_MAX;
-		conv_error = TRUE;
-	      }
-	    else short_buf[i] = int_buf[i];
+	  if (BCvtInt32ToInt16Array(int_buf, short_buf, size))
+	    conv_error = TRUE;
 	  mri_set_chunk(ds, key, size, offset, MRI_SHORT, short_buf);
 	  break;
 	case MRI_INT32:
-	  ChunkSeek(ch, 4*offset);
-	  FWrInt32Array(ch->file->fp, buf, size);
+	  if (ch->compression != MRI_NO_COMPRESSION)
+	    {
+	      if ((data = BlockWriteBegin(ch, 4*offset, 4*size)) != NULL)
+		{
+		  BWrInt32Array(data, buf, size);
+		  BlockWriteCommit(ch);
+		}
+	    }
+	  else if ((job = StreamWriteBegin(ch, 4*offset, 4*size)) != NULL)
+	    {
+	      BWrInt32Array(job->data, buf, size);
+	      StreamWriteCommit(job);
+	    }
+	  else
+	    {
+	      ChunkSeek(ch, 4*offset);
+	      FWrInt32Array(ch->file->fp, buf, size);
+	    }
 	  break;
 	case MRI_INT64:
 	  longlong_buf = (long long *) GetBuffer(ds, size*sizeof(long long));
@@ -1596,14 +2030,12 @@ mri_set_chunk (MRI_Dataset *ds, const char *key,
 	  break;
 	case MRI_FLOAT32:
 	  float_buf = (float *) GetBuffer(ds, size*sizeof(float));
-	  for (i = 0; i < size; ++i)
-	    float_buf[i] = int_buf[i];
+	  BCvtInt32ToFloat32Array(int_buf, float_buf, size);
 	  mri_set_chunk(ds, key, size, offset, MRI_FLOAT, float_buf);
 	  break;
 	case MRI_FLOAT64:
 	  double_buf = (double *) GetBuffer(ds, size*sizeof(double));
-	  for (i = 0; i < size; ++i)
-	    double_buf[i] = int_buf[i];
+	  BCvtInt32ToFloat64Array(int_buf, double_buf, size);
 	  mri_set_chunk(ds, key, size, offset, MRI_DOUBLE, double_buf);
 	  break;
 	default:
@@ -1741,8 +2173,24 @@ mri_set_chunk (MRI_Dataset *ds, const char *key,
 	  mri_set_chunk(ds, key, size, offset, MRI_INT, int_buf);
 	  break;
 	case MRI_INT64:
-	  ChunkSeek(ch, 8*offset);
-	  FWrInt64Array(ch->file->fp, buf, size);
+	  if (ch->compression != MRI_NO_COMPRESSION)
+	    {
+	      if ((data = BlockWriteBegin(ch, 8*offset, 8*size)) != NULL)
+		{
+		  BWrInt64Array(data, buf, size);
+		  BlockWriteCommit(ch);
+		}
+	    }
+	  else if ((job = StreamWriteBegin(ch, 8*offset, 8*size)) != NULL)
+	    {
+	      BWrInt64Array(job->data, buf, size);
+	      StreamWriteCommit(job);
+	    }
+	  else
+	    {
+	      ChunkSeek(ch, 8*offset);
+	      FWrInt64Array(ch->file->fp, buf, size);
+	    }
 	  break;
 	case MRI_FLOAT32:
 	  float_buf = (float *) GetBuffer(ds, size*sizeof(float));
@@ -1784,34 +2232,14 @@ mri_set_chunk (MRI_Dataset *ds, const char *key,
 	  break;
 	case MRI_INT16:
 	  short_buf = (short *) GetBuffer(ds, size*sizeof(short));
-	  for (i = 0; i < size; ++i)
-	    if (float_buf[i] < (float)SHRT_MIN)
-	      {
-		short_buf[i] = SHRT_MIN;
-		conv_error = TRUE;
-	      }
-	    else if (float_buf[i] > (float)SHRT_MAX)
-	      {
-		short_buf[i] = SHRT_MAX;
-		conv_error = TRUE;
-	      }
-	    else short_buf[i] = (int) float_buf[i];
+	  if (BCvtFloat32ToInt16Array(float_buf, short_buf, size))
+	    conv_error = TRUE;
 	  mri_set_chunk(ds, key, size, offset, MRI_SHORT, short_buf);
 	  break;
 	case MRI_INT32:
 	  int_buf = (int *) GetBuffer(ds, size*sizeof(int));
-	  for (i = 0; i < size; ++i)
-	    if (float_buf[i] < (float)INT_MIN)
-	      {
-		int_buf[i] = INT_MIN;
-		conv_error = TRUE;
-	      }
-	    else if (float_buf[i] > (float)INT_MAX)
-	      {
-		int_buf[i] = INT_MAX;
-		conv_error = TRUE;
-	      }
-	    else int_buf[i] = float_buf[i];
+	  if (BCvtFloat32ToInt32Array(float_buf, int_buf, size))
+	    conv_error = TRUE;
 	  mri_set_chunk(ds, key, size, offset, MRI_INT, int_buf);
 	  break;
 	case MRI_INT64:
@@ -1822,13 +2250,28 @@ mri_set_chunk (MRI_Dataset *ds, const char *key,
 	  }
 	  break;
 	case MRI_FLOAT32:
-	  ChunkSeek(ch, 4*offset);
-	  FWrFloat32Array(ch->file->fp, buf, size);
+	  if (ch->compression != MRI_NO_COMPRESSION)
+	    {
+	      if ((data = BlockWriteBegin(ch, 4*offset, 4*size)) != NULL)
+		{
+		  BWrFloat32Array(data, buf, size);
+		  BlockWriteCommit(ch);
+		}
+	    }
+	  else if ((job = StreamWriteBegin(ch, 4*offset, 4*size)) != NULL)
+	    {
+	      BWrFloat32Array(job->data, buf, size);
+	      StreamWriteCommit(job);
+	    }
+	  else
+	    {
+	      ChunkSeek(ch, 4*offset);
+	      FWrFloat32Array(ch->file->fp, buf, size);
+	    }
 	  break;
 	case MRI_FLOAT64:
 	  double_buf = (double *) GetBuffer(ds, size*sizeof(double));
-	  for (i = 0; i < size; ++i)
-	    double_buf[i] = float_buf[i];
+	  BCvtFloat32ToFloat64Array(float_buf, double_buf, size);
 	  mri_set_chunk(ds, key, size, offset, MRI_DOUBLE, double_buf);
 	  break;
 	default:
@@ -1859,34 +2302,14 @@ mri_set_chunk (MRI_Dataset *ds, const char *key,
 	  break;
 	case MRI_INT16:
 	  short_buf = (short *) GetBuffer(ds, size*sizeof(short));
-	  for (i = 0; i < size; ++i)
-	    if (double_buf[i] < (double)SHRT_MIN)
-	      {
-		short_buf[i] = SHRT_MIN;
-		conv_error = TRUE;
-	      }
-	    else if (double_buf[i] > (double)SHRT_MAX)
-	      {
-		short_buf[i] = SHRT_MAX;
-		conv_error = TRUE;
-	      }
-	    else short_buf[i] = (int) double_buf[i];
+	  if (BCvtFloat64ToInt16Array(double_buf, short_buf, size))
+	    conv_error = TRUE;
 	  mri_set_chunk(ds, key, size, offset, MRI_SHORT, short_buf);
 	  break;
 	case MRI_INT32:
 	  int_buf = (int *) GetBuffer(ds, size*sizeof(int));
-	  for (i = 0; i < size; ++i)
-	    if (double_buf[i] < (double)INT_MIN)
-	      {
-		int_buf[i] = INT_MIN;
-		conv_error = TRUE;
-	      }
-	    else if (double_buf[i] > (double)INT_MAX)
-	      {
-		int_buf[i] = INT_MAX;
-		conv_error = TRUE;
-	      }
-	    else int_buf[i] = double_buf[i];
+	  if (BCvtFloat64ToInt32Array(double_buf, int_buf, size))
+	    conv_error = TRUE;
 	  mri_set_chunk(ds, key, size, offset, MRI_INT, int_buf);
 	  break;
 	case MRI_INT64:
@@ -1896,29 +2319,30 @@ mri_set_chunk (MRI_Dataset *ds, const char *key,
 	  break;
 	case MRI_FLOAT32:
 	  float_buf = (float *) GetBuffer(ds, size*sizeof(float));
-	  for (i = 0; i < size; ++i)
-	    if (finite(double_buf[i])) {
-	      if (double_buf[i] < -MAXFLOAT)
-		{
-		  float_buf[i] = -MAXFLOAT;
-		  conv_error = TRUE;
-		}
-	      else if (double_buf[i] > MAXFLOAT)
+	  /* NaNs and infinities are passed through unchanged */
+	  if (BCvtFloat64ToFloat32Array(double_buf, float_buf, size, TRUE))
+	    conv_error = TRUE;
+	  mri_set_chunk(ds, key, size, offset, MRI_FLOAT, float_buf);
+	  break;
+	case MRI_FLOAT64:
+	  if (ch->compression != MRI_NO_COMPRESSION)
+	    {
+	      if ((data = BlockWriteBegin(ch, 8*offset, 8*size)) != NULL)
 		{
-		  float_buf[i] = MAXFLOAT;
-		  conv_error = TRUE;
+		  BWrFloat64Array(data, buf, size);
+		  BlockWriteCommit(ch);
 		}
-	      else float_buf[i] = (float) double_buf[i];
 	    }
-	    else {
-	      /* We'll let the compiler translate the NaN or Inf */
-	      float_buf[i]= (float)double_buf[i];
+	  else if ((job = StreamWriteBegin(ch, 8*offset, 8*size)) != NULL)
+	    {
+	      BWrFloat64Array(job->data, buf, size);
+	      StreamWriteCommit(job);
+	    }
+	  else
+	    {
+	      ChunkSeek(ch, 8*offset);
+	      FWrFloat64Array(ch->file->fp, buf, size);
 	    }
-	  mri_set_chunk(ds, key, size, offset, MRI_FLOAT, float_buf);
-	  break;
-	case MRI_FLOAT64:
-	  ChunkSeek(ch, 8*offset);
-	  FWrFloat64Array(ch->file->fp, buf, size);
 	  break;
 	default:
 	  mri_report_error(ds, "mri_set_chunk: Invalid array type\n");
@@ -1947,6 +2371,7 @@ void
 mri_retain_buffer (MRI_Dataset *ds, void *ptr)
 {
   MRI_Buffer *pb, *b;
+  MRI_Mapping *m;
 
   for (pb = NULL, b = ds->buffers; b != NULL; pb = b, b = b->next)
     if (b->buffer == ptr)
@@ -1964,6 +2389,13 @@ mri_retain_buffer (MRI_Dataset *ds, void *ptr)
     if (b->buffer == ptr)
       return;
 
+  for (m = ds->mappings; m != NULL; m = m->next)
+    if (m->ptr == ptr)
+      {
+	m->transient = FALSE;
+	return;
+      }
+
   mri_report_error(ds, "mri_retain_buffer: buffer parameter is not valid\n");
 }
 
@@ -1996,10 +2428,23 @@ mri_discard_buffer (MRI_Dataset *ds, void *ptr)
 	return;
       }
 
+  if (ReleaseMapping(ds, ptr))
+    return;
+
   mri_report_error(ds, "mri_discard_buffer: buffer parameter is not valid\n");
 }
 
 
+/*--------- STREAMING --------------------------------------------*/
+
+void
+mri_set_stream_depth (MRI_Dataset *ds, int depth)
+{
+  CloseAllStreams(ds);
+  ds->stream_depth = (depth > 0 ? depth : 0);
+}
+
+
 /*--------- ERROR HANDLING ---------------------------------------*/
 
 void mri_set_error_handling (MRI_Error_Handling mode)
@@ -2020,6 +2465,9 @@ void *
 mri_get_image (MRI_Dataset *ds, const int time, const int slice,
 	       MRI_ArrayType type)
 {
+  MRI_Chunk *ch;
+  void *ptr;
+
   if (!ds->std_images)
     {
       mri_report_error(ds, "libmri: non-standard images prevent mri_get_image\n");
@@ -2047,6 +2495,18 @@ mri_get_image (MRI_Dataset *ds, const int time, const int slice,
       mri_report_error(ds, "mri_get_image: invalid array type\n");
       return(NULL);
     }
+  if (ds->map_images)
+    {
+      for (ch = ds->chunks; ch != NULL; ch = ch->next)
+	if (strcmp(ch->name, "images") == 0)
+	  break;
+      if (ch != NULL &&
+	  (ptr = MapChunk(ch, ds->std_image_size,
+			  (((long long) time) * ds->std_n_slices + slice) *
+			  ds->std_image_size,
+			  type & 0xf, TRUE)) != NULL)
+	return(ptr);
+    }
   return(mri_get_chunk(ds, "images",
 		       ds->std_image_size,
 		       (((long long) time) * ds->std_n_slices + slice) *
@@ -2093,6 +2553,13 @@ mri_set_image (MRI_Dataset *ds, const int time, const int slice,
 }
 
 
+void
+mri_set_image_mapping (MRI_Dataset *ds, int flag)
+{
+  ds->map_images = flag;
+}
+
+
 /*------------------------INTERNAL FUNCTIONS---------------------------------*/
    
 static void
@@ -2130,6 +2597,18 @@ NewChunk (MRI_Dataset *ds, char *name)
 	return(NULL);
       }
 
+  if (!mri_has(ds, mri_cat(name, ".compression")))
+    ch->compression = MRI_NO_COMPRESSION;
+  else
+    if (!ConvertCompression(&ch->compression, mri_get_string(ds, mri_cat(name, ".compression"))))
+      {
+	mri_report_error(ds, "libmri: Invalid chunk compression.\n");
+	ds->chunks = ch->next;
+	free(ch->name);
+	free(ch);
+	return(NULL);
+      }
+
   if (!mri_has(ds, mri_cat(name, ".dimensions")))
     s = "xyzt";
   else
@@ -2144,6 +2623,7 @@ NewChunk (MRI_Dataset *ds, char *name)
       else
 	ch->extent[i] = mri_get_int(ds, mri_cat(name, fieldname));
     }
+  ComputeBlockShape(ch);
 
   if (mri_has(ds, mri_cat(name, ".little_endian")) &&
       mri_get_int(ds, mri_cat(name, ".little_endian")) == 1)
@@ -2197,12 +2677,17 @@ NewChunk (MRI_Dataset *ds, char *name)
   ch->actual_little_endian = ch->little_endian;
   ch->actual_offset = ch->offset;
   ch->actual_size = ch->size;
+  ch->actual_compression = ch->compression;
+  for (i = 0; i < (int) strlen(ch->dimensions); ++i)
+    ch->actual_block[i] = ch->block[i];
 
   ch->modified = FALSE;
   ch->checked = FALSE;
   ch->repositioning = FALSE;
   ch->ready_to_read = FALSE;
   ch->ready_to_write = FALSE;
+  ch->stream = NULL;
+  ch->blocks = NULL;
 
   CheckForStdImages(ds);
   return(ch);
@@ -2236,9 +2721,18 @@ CleanFiles (MRI_Dataset *ds)
   int n_empty_blocks;
   EmptyBlock empty_blocks[MRI_MAX_CHUNKS+2];
 
+  CloseAllStreams(ds);
+
   for (f = ds->files; f != NULL; f = f->next)
     if (!f->external)
       {
+	/* the container of a compressed chunk looks after itself */
+	for (ch = ds->chunks; ch != NULL; ch = ch->next)
+	  if (ch->file == f && ch->compression != MRI_NO_COMPRESSION)
+	    break;
+	if (ch != NULL)
+	  continue;
+
 	/* set up the empty block array */
 	if (f == ds->header_file)
 	  empty_blocks[0].start = ds->header_size;
@@ -2302,6 +2796,10 @@ DeallocateDataset (MRI_Dataset *ds)
   MRI_Buffer *b, *nb;
   int i;
 
+  /* finish any background I/O */
+  CloseAllStreams(ds);
+  StopStreamEngine(ds);
+
   /* deallocate the files */
   f = ds->files;
   while (f != NULL)
@@ -2319,6 +2817,8 @@ DeallocateDataset (MRI_Dataset *ds)
   while (ch != NULL)
     {
       nch = ch->next;
+      if (ch->blocks != NULL)
+	FreeBlockStore(ch->blocks);
       free(ch->dimensions);
       free(ch->actual_dimensions);
       free(ch);
@@ -2345,6 +2845,9 @@ DeallocateDataset (MRI_Dataset *ds)
       b = nb;
     }
   ds->retained_buffers = NULL;
+
+  /* release any mapped regions */
+  UnmapAll(ds);
   
   /* deallocate the key/value pairs */
   for (i = 0; i < ds->hash_table_size; ++i)
@@ -2358,6 +2861,8 @@ DeallocateDataset (MRI_Dataset *ds)
       }
 
   /* deallocate other fields */
+  if (ds->header_index != NULL)
+    CloseHeaderIndex(ds->header_index);
   if (ds->iteration_table != NULL)
     free(ds->iteration_table);
   free(ds->name);
@@ -2398,6 +2903,7 @@ CheckForHooks (MRI_Dataset *ds, MRI_KeyValue *kv)
   long long new_extent;
   long long new_size;
   int new_little_endian;
+  MRI_Compression new_compression;
   MRI_Chunk *ch;
   char chunk_name[MRI_MAX_KEY_LENGTH+1];
 
@@ -2417,6 +2923,7 @@ CheckForHooks (MRI_Dataset *ds, MRI_KeyValue *kv)
       ch->actual_file = ds->header_file;
       ch->actual_offset = 0;
       ch->actual_size = 0;
+      ch->actual_compression = MRI_NO_COMPRESSION;
       ModifyChunk(ch);
 
       if (!mri_has(ds, mri_cat(ch->name, ".little_endian")))
@@ -2445,6 +2952,15 @@ CheckForHooks (MRI_Dataset *ds, MRI_KeyValue *kv)
       *(tail-8) = '\0';
       tail -= 7;
     }
+
+  /* likewise for ".block" */
+  if ((tail - chunk_name) >= 7 &&
+      strcmp(tail-7, ".block") == 0)
+    {
+      *(tail-1) = '.';
+      *(tail-7) = '\0';
+      tail -= 6;
+    }
   
   /* check if the key has a corresponding chunk */
   for (ch = ds->chunks; ch != NULL; ch = ch->next)
@@ -2545,6 +3061,37 @@ CheckForHooks (MRI_Dataset *ds, MRI_KeyValue *kv)
       return(TRUE);
     }
 
+  /* handle a change in compression */
+  if (strcmp(tail, "compression") == 0)
+    {
+      if (!ConvertCompression(&new_compression, kv->value))
+	{
+	  mri_report_error(ds, "libmri: Invalid compression specified for chunk.\n");
+	  return(FALSE);
+	}
+      if (new_compression != ch->compression)
+	{
+	  if (new_compression == MRI_NO_COMPRESSION)
+	    RemoveBlockKeys(ch);
+	  ch->compression = new_compression;
+	  ModifyChunk(ch);
+	}
+      return(TRUE);
+    }
+
+  /* handle a change in block shape */
+  if (strncmp(tail, "block.", 6) == 0 &&
+      strlen(tail) == 7)
+    {
+      if (sscanf(kv->value, "%lld", &new_extent) != 1 || new_extent < 1)
+	{
+	  mri_report_error(ds, "libmri: Invalid block size.\n");
+	  return(FALSE);
+	}
+      ModifyChunk(ch);
+      return(TRUE);
+    }
+
   /* handle a change in endianness */
   if (strcmp(tail, "little_endian") == 0)
     {
@@ -2612,6 +3159,8 @@ ModifyChunk (MRI_Chunk *ch)
 static void
 SetChunkNotReady (MRI_Chunk *ch)
 {
+  if (ch->stream != NULL)
+    CloseStream(ch);
   ch->ready_to_read = FALSE;
   ch->ready_to_write = FALSE;
 }
@@ -2689,6 +3238,15 @@ CheckForRemovalHooks (MRI_Dataset *ds, MRI_KeyValue *kv)
       *(tail-8) = '\0';
       tail -= 7;
     }
+
+  /* likewise for ".block" */
+  if ((tail - chunk_name) >= 7 &&
+      strcmp(tail-7, ".block") == 0)
+    {
+      *(tail-1) = '.';
+      *(tail-7) = '\0';
+      tail -= 6;
+    }
   
   /* check if the key has a corresponding chunk */
   for (ch = ds->chunks; ch != NULL; ch = ch->next)
@@ -2759,6 +3317,26 @@ CheckForRemovalHooks (MRI_Dataset *ds, MRI_KeyValue *kv)
       return(TRUE);
     }
 
+  /* stop compressing */
+  if (strcmp(tail, "compression") == 0)
+    {
+      if (ch->compression != MRI_NO_COMPRESSION)
+	{
+	  RemoveBlockKeys(ch);
+	  ch->compression = MRI_NO_COMPRESSION;
+	  ModifyChunk(ch);
+	}
+      return(TRUE);
+    }
+
+  /* revert to the default block shape */
+  if (strncmp(tail, "block.", 6) == 0 &&
+      strlen(tail) == 7)
+    {
+      ModifyChunk(ch);
+      return(TRUE);
+    }
+
   /* reset the endianness */
   if (strcmp(tail, "little_endian") == 0)
     {
@@ -2785,6 +3363,8 @@ CheckForRemovalHooks (MRI_Dataset *ds, MRI_KeyValue *kv)
 static void
 ChunkSeek (MRI_Chunk *ch, long long offset)
 {
+  /* stdio must not overtake or be overtaken by background I/O */
+  SyncFile(ch->file);
   if (mri_fseek(ch->file->fp, ch->offset + offset, SEEK_SET) != 0)
     mri_report_error(ch->ds,
 		     "libmri: could not seek to position %lld in file %s\n",
@@ -2812,6 +3392,8 @@ DeallocateChunk (MRI_Chunk *chunk)
     pch->next = ch->next;
   else
     ds->chunks = ch->next;
+  if (ch->blocks != NULL)
+    FreeBlockStore(ch->blocks);
   free(ch->dimensions);
   free(ch->actual_dimensions);
   free(ch);
@@ -3026,9 +3608,8 @@ FindInHashTable (MRI_Dataset *ds, const char *key,
 		 int add)
 {
   int hv;
-  MRI_KeyValue *kv, *nkv;
-  MRI_KeyValue **new;
-  int i;
+  MRI_KeyValue *kv;
+  char *value;
 
   hv = HashFunction(key);
   if (ds->hash_table != NULL)
@@ -3043,12 +3624,36 @@ FindInHashTable (MRI_Dataset *ds, const char *key,
 	}
     }
 
-  /* not found */
+  /* not found, but it may be among the keys of the
+     header index that have not yet been brought in;
+     those are already counted in n_keys */
+  if (ds->header_index != NULL &&
+      (value = IndexLookup(ds->header_index, key)) != NULL)
+    {
+      kv = AddToHashTable(ds, key);
+      kv->value = (char *) malloc(strlen(value) + 1);
+      strcpy(kv->value, value);
+      return(kv);
+    }
+
   if (!add)
     return(NULL);
+  ++ds->n_keys;
+  return(AddToHashTable(ds, key));
+}
+
+/* Enters a key with no value into the hash table, which is
+   enlarged if n_keys has outgrown it */
+static MRI_KeyValue *
+AddToHashTable (MRI_Dataset *ds, const char *key)
+{
+  int hv;
+  MRI_KeyValue *kv, *nkv;
+  MRI_KeyValue **new;
+  int i;
 
-  /* add to hash table */
-  if (++ds->n_keys > 2*ds->hash_table_size)
+  hv = HashFunction(key) & (ds->hash_table_size - 1);
+  if (ds->n_keys > 2*ds->hash_table_size)
     {
       int new_size= 4*ds->hash_table_size;
       /* quadruple the hash table */
@@ -3087,6 +3692,9 @@ RemoveFromHashTable (MRI_Dataset *ds, const char *key)
   int hv;
   MRI_KeyValue *pkv, *kv;
 
+  /* a removed key must not reappear from the index */
+  LoadHeaderIndex(ds);
+
   hv = HashFunction(key);
   if (ds->hash_table == NULL)
     return;
@@ -3123,6 +3731,319 @@ HashFunction (const char *s)
   return(hv);
 }
 
+/*
+ * Header index.  Parsing the text header of a dataset with a long
+ * history can cost far more than the data access a program goes on to
+ * do, so when a dataset with many keys is closed for writing, a binary
+ * index of its header is left beside it in "<name>.mri.idx":
+ *
+ *	preamble	an IndexPreamble
+ *	buckets		n_buckets ints, each the first entry in its
+ *			hash chain or -1
+ *	entries		n_keys IndexEntries, in key order
+ *	chunk list	n_chunks ints, the entries naming chunks
+ *	strings		the keys and values, each terminated by a NUL
+ *
+ * The chains hash keys with HashFunction, just as the in-memory table
+ * does.  The index is in the byte order of the machine that wrote it,
+ * and is simply ignored on a machine of the other order, as it is if
+ * the .mri file's size, dates or inode no longer match the ones
+ * recorded in the preamble.  The text header remains the definitive
+ * copy; the index is only ever a shortcut to it.
+ *
+ * A dataset opened through the index brings keys into its hash table
+ * one at a time as they are asked for.  Anything that needs all of
+ * them at once (iteration, which includes writing the header, and the
+ * removal of keys) loads the rest and closes the index.
+ */
+
+/* Returns the smallest number of keys that earns a dataset a header
+   index, or 0 if indexing is disabled */
+static int
+HeaderIndexThreshold ()
+{
+  char *s;
+
+  if ((s = getenv("MRI_HEADER_INDEX")) != NULL)
+    return(atoi(s) > 0 ? atoi(s) : 0);
+  return(MRI_INDEX_MIN_KEYS);
+}
+
+static void
+IndexFileName (MRI_Dataset *ds, char *name)
+{
+  strcpy(name, ds->name);
+  strcat(name, ".idx");
+}
+
+/* Opens the header index of ds if there is a current one, in which
+   case the key count and header size are taken from it and TRUE is
+   returned */
+static int
+OpenHeaderIndex (MRI_Dataset *ds)
+{
+  char name[MRI_MAX_FILENAME_LENGTH+5];
+  FILE *fp;
+  struct stat st, mri_st;
+  MRI_HeaderIndex *hi;
+  IndexPreamble *p;
+  long long n;
+
+  if (HeaderIndexThreshold() == 0)
+    return(FALSE);
+  IndexFileName(ds, name);
+  if ((fp = fopen(name, "rb")) == NULL)
+    return(FALSE);
+  if (fstat(fileno(fp), &st) != 0 || stat(ds->name, &mri_st) != 0 ||
+      st.st_size < (off_t) sizeof(IndexPreamble) ||
+      (hi = (MRI_HeaderIndex *) malloc(sizeof(MRI_HeaderIndex))) == NULL)
+    {
+      fclose(fp);
+      return(FALSE);
+    }
+  hi->length = st.st_size;
+  hi->base = NULL;
+  hi->mapped = FALSE;
+#ifdef USE_MMAP
+  hi->base = (char *) mmap(NULL, (size_t) hi->length, PROT_READ, MAP_SHARED,
+			   fileno(fp), (off_t) 0);
+  if (hi->base == (char *) MAP_FAILED)
+    hi->base = NULL;
+  else
+    hi->mapped = TRUE;
+#endif
+  if (hi->base == NULL &&
+      ((hi->base = (char *) malloc(hi->length)) == NULL ||
+       fread(hi->base, 1, hi->length, fp) != hi->length))
+    {
+      fclose(fp);
+      CloseHeaderIndex(hi);
+      return(FALSE);
+    }
+  fclose(fp);
+
+  /* check that the index is intact and describes the
+     .mri file as it now is */
+  p = hi->preamble = (IndexPreamble *) hi->base;
+  n = sizeof(IndexPreamble) + 4LL*p->n_buckets +
+    (long long) sizeof(IndexEntry)*p->n_keys + 4LL*p->n_chunks;
+  if (strncmp(p->magic, IDX_MAGIC, sizeof(p->magic)) != 0 ||
+      p->byte_order != IDX_BYTE_ORDER ||
+      p->n_keys <= 0 || p->n_chunks < 0 || p->n_chunks > p->n_keys ||
+      p->n_buckets <= 0 || (p->n_buckets & (p->n_buckets - 1)) != 0 ||
+      p->strings_size <= 0 || n + p->strings_size != hi->length ||
+      hi->base[hi->length - 1] != '\0' ||
+      p->mri_size != (long long) mri_st.st_size ||
+      p->mri_mtime != MTIME_NS(mri_st) ||
+      p->mri_ctime != CTIME_NS(mri_st) ||
+      p->mri_inode != (long long) mri_st.st_ino)
+    {
+      CloseHeaderIndex(hi);
+      return(FALSE);
+    }
+  hi->buckets = (int *) (hi->base + sizeof(IndexPreamble));
+  hi->entries = (IndexEntry *) (hi->buckets + p->n_buckets);
+  hi->chunk_list = (int *) (hi->entries + p->n_keys);
+  hi->strings = hi->base + n;
+
+  /* check the links, so that lookups may trust them
+     (a loop in a chain is caught in IndexLookup) */
+  for (n = 0; n < p->n_buckets; ++n)
+    if (hi->buckets[n] < -1 || hi->buckets[n] >= p->n_keys)
+      break;
+  if (n == p->n_buckets)
+    for (n = 0; n < p->n_keys; ++n)
+      if (hi->entries[n].next < -1 || hi->entries[n].next >= p->n_keys ||
+	  hi->entries[n].key < 0 || hi->entries[n].key >= p->strings_size ||
+	  hi->entries[n].value < 0 ||
+	  hi->entries[n].value >= p->strings_size)
+	break;
+  if (n == p->n_keys)
+    for (n = 0; n < p->n_chunks; ++n)
+      if (hi->chunk_list[n] < 0 || hi->chunk_list[n] >= p->n_keys)
+	break;
+  if (n != p->n_chunks)
+    {
+      CloseHeaderIndex(hi);
+      return(FALSE);
+    }
+
+  ds->header_index = hi;
+  ds->n_keys = p->n_keys;
+  ds->header_size = p->header_size;
+  return(TRUE);
+}
+
+static void
+CloseHeaderIndex (MRI_HeaderIndex *hi)
+{
+#ifdef USE_MMAP
+  if (hi->mapped)
+    (void) munmap(hi->base, (size_t) hi->length);
+  else
+#endif
+  if (hi->base != NULL)
+    free(hi->base);
+  free(hi);
+}
+
+/* Returns the value of key from the index, or NULL if it has none */
+static char *
+IndexLookup (MRI_HeaderIndex *hi, const char *key)
+{
+  int e;
+  int steps;
+
+  e = hi->buckets[HashFunction(key) & (hi->preamble->n_buckets - 1)];
+  for (steps = 0; e >= 0 && steps < hi->preamble->n_keys; ++steps)
+    {
+      if (strcmp(hi->strings + hi->entries[e].key, key) == 0)
+	return(hi->strings + hi->entries[e].value);
+      e = hi->entries[e].next;
+    }
+  return(NULL);
+}
+
+/* Brings every key that is still only in the header index into the
+   hash table, and closes the index */
+static void
+LoadHeaderIndex (MRI_Dataset *ds)
+{
+  MRI_HeaderIndex *hi;
+  MRI_KeyValue *kv;
+  char *value;
+  int i;
+
+  if ((hi = ds->header_index) == NULL)
+    return;
+  ds->header_index = NULL;
+  for (i = 0; i < hi->preamble->n_keys; ++i)
+    if (FindInHashTable(ds, hi->strings + hi->entries[i].key, FALSE) == NULL)
+      {
+	kv = AddToHashTable(ds, hi->strings + hi->entries[i].key);
+	value = hi->strings + hi->entries[i].value;
+	kv->value = (char *) malloc(strlen(value) + 1);
+	strcpy(kv->value, value);
+      }
+  CloseHeaderIndex(hi);
+}
+
+/* Replaces the header index of ds with one describing the header as
+   it now stands on disk, or just removes it if the dataset is too
+   small to be worth indexing.  The .mri file must already have been
+   closed. */
+static void
+WriteHeaderIndex (MRI_Dataset *ds)
+{
+  char name[MRI_MAX_FILENAME_LENGTH+5];
+  char temp_name[MRI_MAX_FILENAME_LENGTH+16];
+  struct stat mri_st;
+  IndexPreamble p;
+  int *buckets, *chunk_list;
+  IndexEntry *entries;
+  char *strings;
+  long long strings_size;
+  MRI_KeyValue *kv;
+  FILE *fp;
+  int i, b, ok;
+
+  /* any existing index no longer matches the .mri file */
+  IndexFileName(ds, name);
+  (void) unlink(name);
+  i = HeaderIndexThreshold();
+  if (i == 0 || ds->n_keys < i)
+    return;
+
+  mri_iterate_over_keys(ds);
+  strings_size = 0;
+  for (i = 0; i < ds->iteration_count; ++i)
+    {
+      kv = ds->iteration_table[i];
+      strings_size += strlen(kv->key) + strlen(kv->value) + 2;
+    }
+  if (strings_size > INT_MAX || stat(ds->name, &mri_st) != 0)
+    return;
+
+  memset(&p, 0, sizeof(p));
+  strcpy(p.magic, IDX_MAGIC);
+  p.byte_order = IDX_BYTE_ORDER;
+  p.n_keys = ds->iteration_count;
+  p.n_buckets = 1;
+  while (p.n_buckets < p.n_keys)
+    p.n_buckets *= 2;
+  p.n_chunks = 0;
+  p.header_size = ds->header_size;
+  p.mri_size = mri_st.st_size;
+  p.mri_mtime = MTIME_NS(mri_st);
+  p.mri_ctime = CTIME_NS(mri_st);
+  p.mri_inode = mri_st.st_ino;
+  p.strings_size = strings_size;
+
+  buckets = (int *) malloc(p.n_buckets * sizeof(int));
+  entries = (IndexEntry *) malloc(p.n_keys * sizeof(IndexEntry));
+  chunk_list = (int *) malloc(p.n_keys * sizeof(int));
+  strings = (char *) malloc(strings_size);
+  if (buckets == NULL || entries == NULL || chunk_list == NULL ||
+      strings == NULL)
+    {
+      mri_report_warning(ds, "libmri: no memory to index header of %s\n",
+			 ds->name);
+      ok = FALSE;
+    }
+  else
+    {
+      for (b = 0; b < p.n_buckets; ++b)
+	buckets[b] = -1;
+      strings_size = 0;
+      for (i = 0; i < p.n_keys; ++i)
+	{
+	  kv = ds->iteration_table[i];
+	  b = HashFunction(kv->key) & (p.n_buckets - 1);
+	  entries[i].next = buckets[b];
+	  buckets[b] = i;
+	  entries[i].key = strings_size;
+	  strcpy(strings + strings_size, kv->key);
+	  strings_size += strlen(kv->key) + 1;
+	  entries[i].value = strings_size;
+	  strcpy(strings + strings_size, kv->value);
+	  strings_size += strlen(kv->value) + 1;
+	  if (strcmp(kv->value, "[chunk]") == 0)
+	    chunk_list[p.n_chunks++] = i;
+	}
+
+      /* write it under another name first, so that a reader
+	 never sees a partial index */
+      sprintf(temp_name, "%s.%d", name, (int) getpid());
+      ok = ((fp = fopen(temp_name, "wb")) != NULL);
+      if (ok)
+	{
+	  ok = (fwrite(&p, sizeof(p), 1, fp) == 1 &&
+		fwrite(buckets, sizeof(int), p.n_buckets, fp) == p.n_buckets &&
+		fwrite(entries, sizeof(IndexEntry), p.n_keys, fp) == p.n_keys &&
+		fwrite(chunk_list, sizeof(int), p.n_chunks, fp) == p.n_chunks &&
+		fwrite(strings, 1, strings_size, fp) == strings_size);
+	  if (fclose(fp) != 0)
+	    ok = FALSE;
+	  if (!ok || rename(temp_name, name) != 0)
+	    {
+	      (void) unlink(temp_name);
+	      ok = FALSE;
+	    }
+	}
+      if (!ok)
+	mri_report_warning(ds, "libmri: could not write header index %s\n",
+			   name);
+    }
+  if (buckets != NULL)
+    free(buckets);
+  if (entries != NULL)
+    free(entries);
+  if (chunk_list != NULL)
+    free(chunk_list);
+  if (strings != NULL)
+    free(strings);
+}
+
 static void
 WriteHeader (MRI_Dataset *ds, int separator, FILE *f)
 {
@@ -3231,6 +4152,9 @@ ComputeChunkPositions (MRI_Dataset *ds)
   int first;
   char key_name[MRI_MAX_KEY_LENGTH+1];
 
+  /* chunks may move, so background I/O must be finished */
+  CloseAllStreams(ds);
+
   /* mark all chunks as unchecked; also mark files
      as external */
   for (ch = ds->chunks; ch != NULL; ch = ch->next)
@@ -3247,10 +4171,45 @@ ComputeChunkPositions (MRI_Dataset *ds)
       if (ch->checked || ch->order == MRI_EXTERNAL)
 	continue;
 
+      if (ch->compression != MRI_NO_COMPRESSION)
+	{
+	  /* a compressed chunk must have its file to itself */
+	  for (nch = ds->chunks; nch != NULL; nch = nch->next)
+	    if (nch != ch && nch->file == ch->file)
+	      break;
+	  if (ch->file == ds->header_file || nch != NULL)
+	    {
+	      mri_report_error(ds, "libmri: compressed chunk %s must have a file of its own\n",
+			       ch->name);
+	      mri_set_string(ds, mri_cat(ch->name, ".compression"), "none");
+	    }
+	  else
+	    {
+	      /* record the block shape so that later changes to
+		 the default do not affect this dataset */
+	      ComputeBlockShape(ch);
+	      for (n = 0; n < (int) strlen(ch->dimensions); ++n)
+		{
+		  sprintf(key_name, "%s.block.%c", ch->name, ch->dimensions[n]);
+		  if (!mri_has(ds, key_name) ||
+		      mri_get_int(ds, key_name) != ch->block[n])
+		    mri_set_int(ds, key_name, ch->block[n]);
+		}
+	      ch->offset = 0;
+	      sprintf(key_name, "%s.offset", ch->name);
+	      mri_set_int(ds, key_name, ch->offset);
+	      if (!SameBlockLayout(ch))
+		ch->modified = TRUE;
+	      ch->checked = TRUE;
+	      continue;
+	    }
+	}
+
       /* find all other chunks destined for the same file */
       n_chunks = 0;
       for (nch = ch; nch != NULL; nch = nch->next)
-	if (nch->file == ch->file)
+	if (nch->file == ch->file &&
+	    nch->compression == MRI_NO_COMPRESSION)
 	  chunks[n_chunks++] = nch;
 
       /* set up the empty block array */
@@ -3587,6 +4546,9 @@ RepositionChunk (MRI_Chunk *ch, CopyRequest **copy_queue)
   MRI_File *temp;
   MRI_Chunk *och;
   MRI_File *pf, *f, *nf;
+  MRI_File *unpacked;
+
+  CloseAllStreams(ch->ds);
 
   /* we want to have the chunk be in file ch->file
      at bytes ch->offset through (ch->offset + ch->size - 1);
@@ -3602,15 +4564,34 @@ RepositionChunk (MRI_Chunk *ch, CopyRequest **copy_queue)
       return;
     }
 
+  if (ch->compression != MRI_NO_COMPRESSION && SameBlockLayout(ch))
+    {
+      /* the blocks can stay as they are; a change of compression
+	 applies only to blocks written from now on */
+      if (ch->blocks != NULL)
+	ch->blocks->compression = ch->compression;
+      UpdateChunkAttributes(ch);
+      return;
+    }
+
   ch->repositioning = TRUE;
   use_temp_file = FALSE;
   queue = NULL;
 
-  /* go through other chunks and see which ones have to be moved */
+  /* data held in blocks are first expanded into a flat
+     temporary copy */
+  unpacked = NULL;
+  if (ch->actual_compression != MRI_NO_COMPRESSION)
+    unpacked = UnpackChunk(ch);
+
+  /* go through other chunks and see which ones have to be moved;
+     a compressed chunk occupies the whole of its file */
   for (och = ch->ds->chunks; och != NULL; och = och->next)
     if (ch->file == och->actual_file &&
-	ch->offset <= och->actual_offset + och->actual_size + 1 &&
-	ch->offset + ch->size + 1 >= och->actual_offset)
+	(ch->compression != MRI_NO_COMPRESSION ||
+	 och->actual_compression != MRI_NO_COMPRESSION ||
+	 ch->offset <= och->actual_offset + och->actual_size + 1 &&
+	 ch->offset + ch->size + 1 >= och->actual_offset))
       /* there is an overlap */
       if (!och->repositioning)
 	/* move the chunk */
@@ -3641,6 +4622,7 @@ RepositionChunk (MRI_Chunk *ch, CopyRequest **copy_queue)
       req->dest_offset = ch->offset;
       req->size = ch->size;
       req->chunk = ch;
+      req->unpacked = unpacked;
       if (copy_queue != NULL)
 	{
 	  req->next = *copy_queue;
@@ -3652,11 +4634,27 @@ RepositionChunk (MRI_Chunk *ch, CopyRequest **copy_queue)
 	  queue = req;
 	}
     }
+  else if (ch->compression != MRI_NO_COMPRESSION)
+    {
+      /* pack a flat copy of the data into blocks */
+      if (ch->actual_size > 0)
+	{
+	  temp = CreateTempFile(ch->ds);
+	  ConvertChunk(ch, temp, 0);
+	  PackChunk(ch, temp);
+	  DestroyFile(temp);
+	}
+      else
+	PackChunk(ch, NULL);
+      UpdateChunkAttributes(ch);
+    }
   else
     {
       ConvertChunk(ch, ch->file, ch->offset);
       UpdateChunkAttributes(ch);
     }
+  if (unpacked != NULL && !use_temp_file)
+    DestroyFile(unpacked);
 
   /* check if we are back at the top-level call
      to RepositionChunk, and it is time to do
@@ -3666,10 +4664,15 @@ RepositionChunk (MRI_Chunk *ch, CopyRequest **copy_queue)
       for (req = queue; req != NULL; req = nreq)
 	{
 	  nreq = req->next;
-	  CopyBlock(req->dest_file, req->dest_offset, req->src_file, req->src_offset, req->size);
+	  if (req->chunk->compression != MRI_NO_COMPRESSION)
+	    PackChunk(req->chunk, req->src_file);
+	  else
+	    CopyBlock(req->dest_file, req->dest_offset, req->src_file, req->src_offset, req->size);
 	  /* remove the temporary file holding the chunk */
 	  UpdateChunkAttributes(req->chunk);
 	  DestroyFile(req->src_file);
+	  if (req->unpacked != NULL)
+	    DestroyFile(req->unpacked);
 	  free(req);
 	}
 
@@ -3720,23 +4723,302 @@ UpdateChunkAttributes(MRI_Chunk *ch)
     }
   strcpy(ch->actual_dimensions, ch->dimensions);
   for (i = 0; i < (int) strlen(ch->dimensions); ++i)
-    ch->actual_extent[i] = ch->extent[i];
+    {
+      ch->actual_extent[i] = ch->extent[i];
+      ch->actual_block[i] = ch->block[i];
+    }
   ch->actual_little_endian = ch->little_endian;
   ch->actual_offset = ch->offset;
   ch->actual_size = ch->size;
+  ch->actual_compression = ch->compression;
   ch->modified = FALSE;
   ch->repositioning = FALSE;
 }
 
+/*
+ * Bulk transfers.  Repositioning, converting and clearing chunks move
+ * whole chunks at a time, which stdio would do a buffer's worth at a
+ * time with a seek for each buffer.  These routines instead go straight
+ * to the file descriptors with pread and pwrite, in pieces of
+ * MRI_BULK_IO_SIZE bytes that (after the first) start on
+ * BULK_ALIGNMENT boundaries.  Where the system can copy between
+ * files by itself (copy_file_range, which on some filesystems just
+ * shares the blocks) a plain copy never comes into user space at all.
+ * If the MRI_DIRECT_IO environment variable is 1, the aligned pieces
+ * of large transfers also bypass the page cache (O_DIRECT), so that
+ * copying a dataset of many gigabytes does not push everything else
+ * out of memory; and if MRI_BULK_IO is 0, stdio is used throughout.
+ *
+ * Stdio may hold buffered data for the same files, so every transfer
+ * first flushes the streams involved; that also discards any
+ * read-ahead that the transfer could make stale.
+ */
+
+static int
+BulkIOEnabled ()
+{
+#ifdef USE_BULK_IO
+  char *s;
+
+  return((s = getenv("MRI_BULK_IO")) == NULL || atoi(s) != 0);
+#else
+  return(FALSE);
+#endif
+}
+
+/* Returns the descriptor to use for bulk transfers on an open file,
+   or -1 if stdio must be used */
+static int
+BulkDescriptor (MRI_File *file)
+{
+  (void) fflush(file->fp);
+  return(BulkIOEnabled() ? fileno(file->fp) : -1);
+}
+
+/* Opens a second descriptor on a file that bypasses the page cache,
+   if that is wanted and possible; returns -1 otherwise */
+static int
+OpenDirect (MRI_File *file, int for_writing)
+{
+#if defined(USE_BULK_IO) && defined(O_DIRECT)
+  char *s;
+
+  if ((s = getenv("MRI_DIRECT_IO")) == NULL || atoi(s) == 0)
+    return(-1);
+  return(open(file->name, (for_writing ? O_WRONLY : O_RDONLY) | O_DIRECT));
+#else
+  return(-1);
+#endif
+}
+
+/* Allocates an aligned buffer large enough for any piece of a
+   transfer of size bytes */
+static unsigned char *
+BulkBuffer (long long size)
+{
+  void *p;
+
+  size = (size + BULK_ALIGNMENT - 1) / BULK_ALIGNMENT * BULK_ALIGNMENT;
+  if (size > MRI_BULK_IO_SIZE)
+    size = MRI_BULK_IO_SIZE;
+#ifdef USE_BULK_IO
+  if (posix_memalign(&p, BULK_ALIGNMENT, (size_t) size) != 0)
+    return(NULL);
+#else
+  p = malloc((size_t) size);
+#endif
+  return((unsigned char *) p);
+}
+
+/* Returns the length of the next piece of a transfer that has n bytes
+   left, the next of which goes at offset */
+static long long
+BulkPiece (long long offset, long long n)
+{
+  long long k;
+
+  k = (n > MRI_BULK_IO_SIZE) ? MRI_BULK_IO_SIZE : n;
+  if (offset % BULK_ALIGNMENT != 0)
+    {
+      if (k > BULK_ALIGNMENT - offset % BULK_ALIGNMENT)
+	k = BULK_ALIGNMENT - offset % BULK_ALIGNMENT;
+    }
+  else if (k > BULK_ALIGNMENT)
+    k -= k % BULK_ALIGNMENT;
+  return(k);
+}
+
+/* Reads or writes n bytes at offset in file, through descriptor fd,
+   or through stdio if fd is -1; returns FALSE on any failure
+   (including reading past the end of the file) */
+static int
+BulkIO (MRI_File *file, int fd, int writing, long long offset,
+	unsigned char *buf, long long n)
+{
+#ifdef USE_BULK_IO
+  long long done;
+  ssize_t k;
+
+  if (fd >= 0)
+    {
+      for (done = 0; done < n; done += k)
+	{
+	  if (writing)
+	    k = pwrite(fd, buf + done, (size_t) (n - done),
+		       (off_t) (offset + done));
+	  else
+	    k = pread(fd, buf + done, (size_t) (n - done),
+		      (off_t) (offset + done));
+	  if (k < 0 && errno == EINTR)
+	    k = 0;
+	  else if (k <= 0)
+	    return(FALSE);
+	}
+      return(TRUE);
+    }
+#endif
+  if (mri_fseek(file->fp, offset, SEEK_SET) != 0)
+    return(FALSE);
+  if (writing)
+    return(fwrite(buf, (size_t) n, 1, file->fp) == 1);
+  return(fread(buf, (size_t) n, 1, file->fp) == 1);
+}
+
+static int
+BulkRead (MRI_File *file, long long offset, unsigned char *buf, long long n)
+{
+  return(BulkIO(file, BulkDescriptor(file), FALSE, offset, buf, n));
+}
+
+static int
+BulkWrite (MRI_File *file, long long offset, unsigned char *buf, long long n)
+{
+  return(BulkIO(file, BulkDescriptor(file), TRUE, offset, buf, n));
+}
+
+#ifdef HAVE_COPY_FILE_RANGE
+/* Has the system copy as much as it is willing to between two
+   descriptors, returning the number of bytes copied; whatever is left
+   over (which is everything if the filesystems do not support this)
+   must be copied by hand */
+static long long
+SystemCopy (int dest_fd, long long dest_offset,
+	    int src_fd, long long src_offset, long long size)
+{
+  loff_t in, out;
+  ssize_t n;
+  long long done;
+
+  in = src_offset;
+  out = dest_offset;
+  for (done = 0; done < size; done += n)
+    {
+      n = copy_file_range(src_fd, &in, dest_fd, &out,
+			  (size_t) ((size - done > (1LL << 30)) ?
+				    (1LL << 30) : size - done), 0);
+      if (n < 0 && errno == EINTR)
+	n = 0;
+      else if (n <= 0)
+	break;
+    }
+  return(done);
+}
+#endif
+
+/* Copies size bytes, which may overlap if both are in the same file;
+   returns FALSE on failure */
+static int
+BulkCopy (MRI_File *dest_file, long long dest_offset,
+	  MRI_File *src_file, long long src_offset, long long size)
+{
+  unsigned char *buf;
+  long long done, n, o;
+  int src_fd, dest_fd;
+  int src_direct, dest_direct;
+  int overlap, backward, direct;
+  int ok;
+
+  src_fd = BulkDescriptor(src_file);
+  dest_fd = BulkDescriptor(dest_file);
+  overlap = (src_file == dest_file &&
+	     dest_offset < src_offset + size &&
+	     src_offset < dest_offset + size);
+  backward = overlap && dest_offset > src_offset;
+
+#ifdef HAVE_COPY_FILE_RANGE
+  if (src_fd >= 0 && !overlap)
+    {
+      n = SystemCopy(dest_fd, dest_offset, src_fd, src_offset, size);
+      if (n == size)
+	return(TRUE);
+      dest_offset += n;
+      src_offset += n;
+      size -= n;
+    }
+#endif
+
+  src_direct = dest_direct = -1;
+  if (src_fd >= 0 && !overlap && size >= MRI_BULK_IO_SIZE &&
+      (dest_offset - src_offset) % BULK_ALIGNMENT == 0 &&
+      (src_direct = OpenDirect(src_file, FALSE)) >= 0 &&
+      (dest_direct = OpenDirect(dest_file, TRUE)) < 0)
+    {
+      close(src_direct);
+      src_direct = -1;
+    }
+
+  if ((buf = BulkBuffer(size)) == NULL)
+    return(FALSE);
+  ok = TRUE;
+  for (done = 0; ok && done < size; done += n)
+    {
+      /* work from the end if the destination overlaps
+	 the later part of the source */
+      if (backward)
+	{
+	  n = (size - done > MRI_BULK_IO_SIZE) ? MRI_BULK_IO_SIZE
+	    : size - done;
+	  o = size - done - n;
+	}
+      else
+	{
+	  o = done;
+	  n = BulkPiece(dest_offset + o, size - done);
+	}
+      direct = (dest_direct >= 0 && (dest_offset + o) % BULK_ALIGNMENT == 0 &&
+		n % BULK_ALIGNMENT == 0);
+      ok = (BulkIO(src_file, direct ? src_direct : src_fd, FALSE,
+		   src_offset + o, buf, n) &&
+	    BulkIO(dest_file, direct ? dest_direct : dest_fd, TRUE,
+		   dest_offset + o, buf, n));
+    }
+  free(buf);
+  if (src_direct >= 0)
+    close(src_direct);
+  if (dest_direct >= 0)
+    close(dest_direct);
+  return(ok);
+}
+
+/* Writes size zero bytes; returns FALSE on failure */
+static int
+BulkClear (MRI_File *dest_file, long long dest_offset, long long size)
+{
+  unsigned char *buf;
+  long long done, n;
+  int fd, direct_fd;
+  int direct;
+  int ok;
+
+  fd = BulkDescriptor(dest_file);
+  direct_fd = -1;
+  if (fd >= 0 && size >= MRI_BULK_IO_SIZE)
+    direct_fd = OpenDirect(dest_file, TRUE);
+  if ((buf = BulkBuffer(size)) == NULL)
+    return(FALSE);
+  memset(buf, 0, (size_t) ((size < MRI_BULK_IO_SIZE) ? size
+			   : MRI_BULK_IO_SIZE));
+  ok = TRUE;
+  for (done = 0; ok && done < size; done += n)
+    {
+      n = BulkPiece(dest_offset + done, size - done);
+      direct = (direct_fd >= 0 &&
+		(dest_offset + done) % BULK_ALIGNMENT == 0 &&
+		n % BULK_ALIGNMENT == 0);
+      ok = BulkIO(dest_file, direct ? direct_fd : fd, TRUE,
+		  dest_offset + done, buf, n);
+    }
+  free(buf);
+  if (direct_fd >= 0)
+    close(direct_fd);
+  return(ok);
+}
+
 static void
 CopyBlock (MRI_File *dest_file, long long dest_offset,
 	   MRI_File *src_file, long long src_offset,
 	   long long size)
 {
-  long long n;
-  long long offset;
-  char buffer[BUFFER_SIZE];
-
   /* check if this is a null operation */
   if (src_file == dest_file &&
       src_offset == dest_offset)
@@ -3754,36 +5036,12 @@ CopyBlock (MRI_File *dest_file, long long dest_offset,
 	      dest_file->name);
       abort();
     }
-  offset = 0;
-  while (size > 0)
+  if (size > 0 &&
+      !BulkCopy(dest_file, dest_offset, src_file, src_offset, size))
     {
-      n = (size > BUFFER_SIZE) ? BUFFER_SIZE : size;
-      if (mri_fseek(src_file->fp, src_offset+offset, SEEK_SET) != 0)
-	{
-	  fprintf(stderr, "libmri: could not seek to position %lld in file %s\n",
-		  src_offset+offset, src_file->name);
-	  abort();
-	}
-      if (fread(buffer, (size_t) n, 1, src_file->fp) != 1)
-	{
-	  fprintf(stderr, "libmri: attempt to read past EOF in %s\n",
-			   src_file->name);
-	  abort();
-	}
-      if (mri_fseek(dest_file->fp, dest_offset+offset, SEEK_SET) != 0)
-	{
-	  fprintf(stderr, "libmri: could not seek to position %lld in file %s\n",
-		  dest_offset+offset, dest_file->name);
-	  abort();
-	}
-      if (fwrite(buffer, (size_t) n, 1, dest_file->fp) != 1)
-	{
-	  fprintf(stderr, "libmri: could not copy to file %s\n",
-		  dest_file->name);
-	  abort();
-	}
-      size -= n;
-      offset += n;
+      fprintf(stderr, "libmri: could not copy %lld bytes from %s to %s\n",
+	      size, src_file->name, dest_file->name);
+      abort();
     }
 }
 
@@ -3817,13 +5075,10 @@ ConvertChunk (MRI_Chunk *ch, MRI_File *f, long long offset)
      double            *d;
      void      *me;
    } in_buffer, out_buffer;
+   unsigned char *raw;
  
    int saved_bio_big_endian_input;
    int saved_bio_big_endian_output;
-   int saved_bio_error;
- 
-   in_buffer.me = calloc (N_READ, sizeof(element));
-   out_buffer.me = calloc (N_READ, sizeof(element));
  
    /* check if a copy operation will suffice */
    if (ch->datatype == ch->actual_datatype &&
@@ -3837,12 +5092,15 @@ ConvertChunk (MRI_Chunk *ch, MRI_File *f, long long offset)
       return;
     }
 
+  in_buffer.me = calloc (N_READ, sizeof(element));
+  out_buffer.me = calloc (N_READ, sizeof(element));
+  raw = (unsigned char *) malloc (N_READ * sizeof(element));
+
   /* we have to do some data conversion at this point */
   read_size = MRI_TypeLength(ch->actual_datatype);
   write_size = MRI_TypeLength(ch->datatype);
   saved_bio_big_endian_input = bio_big_endian_input;
   saved_bio_big_endian_output = bio_big_endian_output;
-  saved_bio_error = bio_error;
   bio_big_endian_input = !ch->actual_little_endian;
   bio_big_endian_output = !ch->little_endian;
 
@@ -3859,99 +5117,85 @@ ConvertChunk (MRI_Chunk *ch, MRI_File *f, long long offset)
   while (count > 0)
     {
       n = (count > N_READ) ? N_READ : count;
-      if (mri_fseek(ch->actual_file->fp,
-		ch->actual_offset + read_offset,
-		SEEK_SET) != 0)
-	mri_report_error(ch->ds,
-			 "libmri: could not seek to position %ld in file %s\n",
-			 (long) (ch->actual_offset + read_offset),
+      if (!BulkRead(ch->actual_file, ch->actual_offset + read_offset,
+		    raw, n * read_size))
+	mri_report_error(ch->ds, "libmri: could not read chunk data from file %s\n",
 			 ch->actual_file->name);
-      bio_error = FALSE;
       switch (ch->actual_datatype)
 	{
 	case MRI_UINT8:
-	  FRdUInt8Array(ch->actual_file->fp, in_buffer.u, n);
+	  BRdUInt8Array(raw, in_buffer.u, n);
 	  for (i = 0; i < n; ++i)
 	    dbl[i] = in_buffer.u[i];
 	  break;
 	case MRI_INT16:
-	  FRdInt16Array(ch->actual_file->fp, in_buffer.s, n);
+	  BRdInt16Array(raw, in_buffer.s, n);
 	  for (i = 0; i < n; ++i)
 	    dbl[i] = in_buffer.s[i];
 	  break;
 	case MRI_INT32:
-	  FRdInt32Array(ch->actual_file->fp, in_buffer.i, n);
+	  BRdInt32Array(raw, in_buffer.i, n);
 	  for (i = 0; i < n; ++i)
 	    dbl[i] = in_buffer.i[i];
 	  break;
 	case MRI_INT64:
-	  FRdInt64Array(ch->actual_file->fp, in_buffer.ll, n);
+	  BRdInt64Array(raw, in_buffer.ll, n);
 	  for (i = 0; i < n; ++i)
 	    dbl[i] = in_buffer.ll[i];
 	  break;
 	case MRI_FLOAT32:
-	  FRdFloat32Array(ch->actual_file->fp, in_buffer.f, n);
+	  BRdFloat32Array(raw, in_buffer.f, n);
 	  for (i = 0; i < n; ++i)
 	    dbl[i] = in_buffer.f[i];
 	  break;
 	case MRI_FLOAT64:
-	  FRdFloat64Array(ch->actual_file->fp, in_buffer.d, n);
+	  BRdFloat64Array(raw, in_buffer.d, n);
 	  for (i = 0; i < n; ++i)
 	    dbl[i] = in_buffer.d[i];
 	  break;
 	default:
 	  break;
 	}
-      if (bio_error)
-	mri_report_error(ch->ds, "libmri: could not read chunk data from file %s\n",
-			 ch->actual_file->name);
       read_offset += n * read_size;
-       
-      if (mri_fseek(f->fp, offset + write_offset, SEEK_SET) != 0)
-	mri_report_error(ch->ds,
-			 "libmri: could not seek to position %lld in file %s\n",
-			 offset + write_offset,
-			 f->name);
 
-      bio_error = FALSE;
       switch (ch->datatype)
 	{
 	case MRI_UINT8:
 	  for (i = 0; i < n; ++i)
 	    out_buffer.u[i] = (unsigned char) dbl[i];
-	  FWrUInt8Array(f->fp, out_buffer.u, n);
+	  BWrUInt8Array(raw, out_buffer.u, n);
 	  break;
 	case MRI_INT16:
 	  for (i = 0; i < n; ++i)
 	    out_buffer.s[i] = (short) dbl[i];
-	  FWrInt16Array(f->fp, out_buffer.s, n);
+	  BWrInt16Array(raw, out_buffer.s, n);
 	  break;
 	case MRI_INT32:
 	  for (i = 0; i < n; ++i)
 	    out_buffer.i[i] = (int) dbl[i];
-	  FWrInt32Array(f->fp, out_buffer.i, n);
+	  BWrInt32Array(raw, out_buffer.i, n);
 	  break;
 	case MRI_INT64:
 	  for (i = 0; i < n; ++i)
 	    out_buffer.ll[i] = (long long) dbl[i];
-	  FWrInt64Array(f->fp, out_buffer.ll, n);
+	  BWrInt64Array(raw, out_buffer.ll, n);
 	  break;
 	case MRI_FLOAT32:
 	  for (i = 0; i < n; ++i)
 	    out_buffer.f[i] = (float) dbl[i];
-	  FWrFloat32Array(f->fp, out_buffer.f, n);
+	  BWrFloat32Array(raw, out_buffer.f, n);
 	  break;
 	case MRI_FLOAT64:
 	  for (i = 0; i < n; ++i)
 	    out_buffer.d[i] = dbl[i];
-	  FWrFloat64Array(f->fp, out_buffer.d, n);
+	  BWrFloat64Array(raw, out_buffer.d, n);
 	  break;
 	default:
 	  mri_report_error(ch->ds, "libmri: Internal error - invalid chunk datatype\n");
 	  abort();
 	  break;
 	}
-      if (bio_error)
+      if (!BulkWrite(f, offset + write_offset, raw, n * write_size))
 	mri_report_error(ch->ds, "libmri: could not write converted chunk data into file %s\n",
 			 f->name);
        write_offset += n * write_size;
@@ -3963,42 +5207,27 @@ ConvertChunk (MRI_Chunk *ch, MRI_File *f, long long offset)
      ClearBlock(f, offset + write_offset, n);
   bio_big_endian_input = saved_bio_big_endian_input;
   bio_big_endian_output = saved_bio_big_endian_output;
-  bio_error = saved_bio_error;
 
   free (in_buffer.me);
   free (out_buffer.me);
+  free (raw);
 #undef N_READ
 }
 
 static void
 ClearBlock (MRI_File *dest_file, long long dest_offset, long long size)
 {
-  char buffer[BUFFER_SIZE];
-
   if (!OpenFile(dest_file, TRUE))
     {
       fprintf(stderr, "libmri: internal error in ClearBlock\n");
       abort();
     }
-  memset(buffer, 0, (size_t)((size > BUFFER_SIZE) ? BUFFER_SIZE : size));
-  if (mri_fseek(dest_file->fp, dest_offset, SEEK_SET) != 0)
+  if (size > 0 && !BulkClear(dest_file, dest_offset, size))
     {
-      fprintf(stderr, "libmri: could not seek to position %lld in file %s\n",
-	      dest_offset, dest_file->name);
+      fprintf(stderr, "libmri: cannot clear chunk in file %s\n",
+	      dest_file->name);
       abort();
     }
-  while (size > 0)
-    {
-      if (fwrite(buffer,
-		 (size_t) ((size > BUFFER_SIZE) ? BUFFER_SIZE : size), 1,
-		 dest_file->fp) != 1)
-	{
-	  fprintf(stderr, "libmri: cannot clear chunk in file %s\n",
-		  dest_file->name);
-	  abort();
-	}
-      size -= BUFFER_SIZE;
-    }
 }
 
 static MRI_File *
@@ -4106,6 +5335,1912 @@ GetBuffer (MRI_Dataset *ds, long long size)
   return(b->buffer);
 }
 
+/*
+ * Background streaming.  Each dataset may have one engine thread,
+ * which services a FIFO of read-ahead and write-behind jobs using
+ * pread and pwrite on private file descriptors.  Only the engine
+ * thread touches those descriptors, and only the calling thread
+ * touches the stdio FILE pointers, the streams and the job lists;
+ * the engine's lock protects just the queue and the done flags.
+ * Because there is a single FIFO, jobs complete in the order they
+ * were issued, so a read-ahead queued after a write-behind of the
+ * same bytes always sees the new data.
+ *
+ * Only the forking thread survives a fork, so an engine thread that
+ * held its lock then would leave that lock held forever in the child.
+ * libpar forks its PAR_LOCAL workers from a master that may have
+ * streams open, so fork handlers drain every engine and hold its lock
+ * across the fork.  In the child the engines are marked orphaned:
+ * the queue is empty, and later jobs are done inline by SubmitJob.
+ */
+
+#ifdef USE_PTHREAD
+static MRI_StreamEngine *engines = NULL;
+static pthread_mutex_t engines_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t engines_once = PTHREAD_ONCE_INIT;
+
+/* transfer a job's bytes; returns the number actually moved */
+static long long
+PerformJob (IOJob *job)
+{
+  long long done;
+  ssize_t n;
+  int fd;
+
+  fd = job->stream->fd;
+  for (done = 0; done < job->nbytes; done += n)
+    {
+      if (job->is_write)
+	n = pwrite(fd, job->data + done, (size_t) (job->nbytes - done),
+		   (off_t) (job->file_offset + done));
+      else
+	n = pread(fd, job->data + done, (size_t) (job->nbytes - done),
+		  (off_t) (job->file_offset + done));
+      if (n < 0 && errno == EINTR)
+	n = 0;
+      else if (n <= 0)
+	break;
+    }
+  return(done);
+}
+
+static void
+PrepareFork ()
+{
+  MRI_StreamEngine *e;
+
+  /* wait until every engine is idle and keep it that way */
+  pthread_mutex_lock(&engines_lock);
+  for (e = engines; e != NULL; e = e->next_engine)
+    {
+      pthread_mutex_lock(&e->lock);
+      while (e->head != NULL || e->busy)
+	pthread_cond_wait(&e->finished, &e->lock);
+    }
+}
+
+static void
+ParentAfterFork ()
+{
+  MRI_StreamEngine *e;
+
+  for (e = engines; e != NULL; e = e->next_engine)
+    pthread_mutex_unlock(&e->lock);
+  pthread_mutex_unlock(&engines_lock);
+}
+
+static void
+ChildAfterFork ()
+{
+  MRI_StreamEngine *e;
+
+  /* the engine thread is not here to wait on the condition
+     variables, so they are started afresh */
+  for (e = engines; e != NULL; e = e->next_engine)
+    {
+      e->orphaned = TRUE;
+      pthread_cond_init(&e->work, NULL);
+      pthread_cond_init(&e->finished, NULL);
+      pthread_mutex_unlock(&e->lock);
+    }
+  pthread_mutex_unlock(&engines_lock);
+}
+
+static void
+InstallForkHandlers ()
+{
+  pthread_atfork(PrepareFork, ParentAfterFork, ChildAfterFork);
+}
+
+static void *
+StreamEngineMain (void *arg)
+{
+  MRI_StreamEngine *e;
+  IOJob *job;
+  long long done;
+
+  e = (MRI_StreamEngine *) arg;
+  pthread_mutex_lock(&e->lock);
+  for (;;)
+    {
+      while (e->head == NULL && !e->shutdown)
+	pthread_cond_wait(&e->work, &e->lock);
+      if (e->head == NULL)
+	break;
+      job = e->head;
+      e->head = job->next;
+      if (e->head == NULL)
+	e->tail = NULL;
+      if (job->cancelled)
+	{
+	  job->done = TRUE;
+	  pthread_cond_broadcast(&e->finished);
+	  continue;
+	}
+      e->busy = TRUE;
+      pthread_mutex_unlock(&e->lock);
+
+      done = PerformJob(job);
+
+      pthread_mutex_lock(&e->lock);
+      job->failed = (done < job->nbytes);
+      job->done = TRUE;
+      e->busy = FALSE;
+      pthread_cond_broadcast(&e->finished);
+    }
+  pthread_mutex_unlock(&e->lock);
+  return(NULL);
+}
+#endif
+
+static MRI_Stream *
+GetStream (MRI_Chunk *ch)
+{
+#ifdef USE_PTHREAD
+  MRI_Dataset *ds;
+  MRI_StreamEngine *e;
+  MRI_Stream *s;
+  int fd;
+
+  if (ch->stream != NULL)
+    return(ch->stream);
+  ds = ch->ds;
+  if (ds->stream_depth <= 0)
+    return(NULL);
+
+  if (ds->stream_engine == NULL)
+    {
+      pthread_once(&engines_once, InstallForkHandlers);
+      e = (MRI_StreamEngine *) malloc(sizeof(MRI_StreamEngine));
+      e->head = e->tail = NULL;
+      e->shutdown = FALSE;
+      e->busy = FALSE;
+      e->orphaned = FALSE;
+      pthread_mutex_init(&e->lock, NULL);
+      pthread_cond_init(&e->work, NULL);
+      pthread_cond_init(&e->finished, NULL);
+      if (pthread_create(&e->thread, NULL, StreamEngineMain, e) != 0)
+	{
+	  /* no thread, no streaming; carry on synchronously */
+	  pthread_mutex_destroy(&e->lock);
+	  pthread_cond_destroy(&e->work);
+	  pthread_cond_destroy(&e->finished);
+	  free(e);
+	  ds->stream_depth = 0;
+	  return(NULL);
+	}
+      pthread_mutex_lock(&engines_lock);
+      e->next_engine = engines;
+      engines = e;
+      pthread_mutex_unlock(&engines_lock);
+      ds->stream_engine = e;
+    }
+
+  if ((fd = open(ch->file->name,
+		 (ds->mode == MRI_READ ? O_RDONLY : O_RDWR))) < 0)
+    return(NULL);
+  s = (MRI_Stream *) malloc(sizeof(MRI_Stream));
+  s->chunk = ch;
+  s->fd = fd;
+  s->read_end = s->write_end = -1;
+  s->read_len = s->write_len = 0;
+  s->read_run = s->write_run = 0;
+  s->reads = s->writes = s->spares = NULL;
+  s->n_reads = s->n_writes = 0;
+  s->dirty = FALSE;
+  ch->stream = s;
+  return(s);
+#else
+  return(NULL);
+#endif
+}
+
+static void
+StopStreamEngine (MRI_Dataset *ds)
+{
+#ifdef USE_PTHREAD
+  MRI_StreamEngine *e, **pe;
+
+  if ((e = ds->stream_engine) == NULL)
+    return;
+  pthread_mutex_lock(&engines_lock);
+  for (pe = &engines; *pe != e; pe = &(*pe)->next_engine) ;
+  *pe = e->next_engine;
+  pthread_mutex_unlock(&engines_lock);
+  if (!e->orphaned)
+    {
+      pthread_mutex_lock(&e->lock);
+      e->shutdown = TRUE;
+      pthread_cond_signal(&e->work);
+      pthread_mutex_unlock(&e->lock);
+      pthread_join(e->thread, NULL);
+    }
+  pthread_mutex_destroy(&e->lock);
+  pthread_cond_destroy(&e->work);
+  pthread_cond_destroy(&e->finished);
+  free(e);
+  ds->stream_engine = NULL;
+#endif
+}
+
+static IOJob *
+NewJob (MRI_Stream *s, long long nbytes, int is_write)
+{
+  IOJob *pj, *job;
+
+  for (pj = NULL, job = s->spares; job != NULL;
+       pj = job, job = job->next_in_stream)
+    if (job->nbytes == nbytes)
+      {
+	if (pj != NULL)
+	  pj->next_in_stream = job->next_in_stream;
+	else
+	  s->spares = job->next_in_stream;
+	break;
+      }
+  if (job == NULL)
+    {
+      job = (IOJob *) malloc(sizeof(IOJob));
+      job->data = (unsigned char *) malloc((size_t) nbytes);
+      job->nbytes = nbytes;
+    }
+  job->next = job->next_in_stream = NULL;
+  job->stream = s;
+  job->is_write = is_write;
+  job->file_offset = 0;
+  job->cancelled = job->done = job->failed = FALSE;
+  return(job);
+}
+
+static void
+RecycleJob (IOJob *job)
+{
+  MRI_Stream *s;
+  IOJob *j;
+  int count;
+
+  /* keep no more spares than could possibly be in flight */
+  s = job->stream;
+  count = 0;
+  for (j = s->spares; j != NULL; j = j->next_in_stream)
+    ++count;
+  if (count > 2*s->chunk->ds->stream_depth)
+    {
+      free(job->data);
+      free(job);
+      return;
+    }
+  job->next_in_stream = s->spares;
+  s->spares = job;
+}
+
+static void
+SubmitJob (IOJob *job)
+{
+#ifdef USE_PTHREAD
+  MRI_StreamEngine *e;
+
+  e = job->stream->chunk->ds->stream_engine;
+  if (e->orphaned)
+    {
+      /* no engine thread in this process; the queue is empty, so
+	 doing the job now keeps the order */
+      job->failed = (PerformJob(job) < job->nbytes);
+      job->done = TRUE;
+      return;
+    }
+  pthread_mutex_lock(&e->lock);
+  if (e->tail != NULL)
+    e->tail->next = job;
+  else
+    e->head = job;
+  e->tail = job;
+  pthread_cond_signal(&e->work);
+  pthread_mutex_unlock(&e->lock);
+#endif
+}
+
+static void
+WaitForJob (IOJob *job, int cancel)
+{
+#ifdef USE_PTHREAD
+  MRI_StreamEngine *e;
+
+  e = job->stream->chunk->ds->stream_engine;
+  pthread_mutex_lock(&e->lock);
+  if (cancel)
+    job->cancelled = TRUE;
+  while (!job->done)
+    pthread_cond_wait(&e->finished, &e->lock);
+  pthread_mutex_unlock(&e->lock);
+#endif
+}
+
+/* has the engine finished with this job?  done is written by the
+   engine thread, so it may only be read under the engine lock */
+static int
+JobDone (IOJob *job)
+{
+#ifdef USE_PTHREAD
+  MRI_StreamEngine *e;
+  int done;
+
+  e = job->stream->chunk->ds->stream_engine;
+  pthread_mutex_lock(&e->lock);
+  done = job->done;
+  pthread_mutex_unlock(&e->lock);
+  return(done);
+#else
+  return(job->done);
+#endif
+}
+
+static void
+DropReads (MRI_Stream *s)
+{
+  IOJob *job;
+
+  while ((job = s->reads) != NULL)
+    {
+      s->reads = job->next_in_stream;
+      WaitForJob(job, TRUE);
+      RecycleJob(job);
+    }
+  s->n_reads = 0;
+}
+
+/* retire completed write-behind blocks; if wait is TRUE, retire
+   them all, otherwise stop at the first one still in progress */
+static void
+RetireWrites (MRI_Stream *s, int wait)
+{
+  IOJob *job;
+
+  while ((job = s->writes) != NULL)
+    {
+      if (!wait && s->n_writes < s->chunk->ds->stream_depth
+	  && !JobDone(job))
+	break;
+      WaitForJob(job, FALSE);
+      s->writes = job->next_in_stream;
+      --s->n_writes;
+      if (job->failed)
+	mri_report_error(s->chunk->ds,
+			 "libmri: could not write chunk data to file %s\n",
+			 s->chunk->file->name);
+      RecycleJob(job);
+    }
+}
+
+static void
+CloseStream (MRI_Chunk *ch)
+{
+  MRI_Stream *s;
+  IOJob *job;
+
+  s = ch->stream;
+  ch->stream = NULL;
+  DropReads(s);
+  RetireWrites(s, TRUE);
+  while ((job = s->spares) != NULL)
+    {
+      s->spares = job->next_in_stream;
+      free(job->data);
+      free(job);
+    }
+  if (s->dirty && ch->file->fp != NULL)
+    (void) fflush(ch->file->fp);
+  close(s->fd);
+  free(s);
+}
+
+static void
+CloseAllStreams (MRI_Dataset *ds)
+{
+  MRI_Chunk *ch;
+
+  for (ch = ds->chunks; ch != NULL; ch = ch->next)
+    if (ch->stream != NULL)
+      CloseStream(ch);
+}
+
+/* wait for all background writes to the given file, and make
+   sure stdio will not serve stale buffered data afterwards */
+static void
+SyncFile (MRI_File *file)
+{
+  MRI_Chunk *ch;
+
+  for (ch = file->ds->chunks; ch != NULL; ch = ch->next)
+    if (ch->stream != NULL && ch->file == file)
+      {
+	RetireWrites(ch->stream, TRUE);
+	if (ch->stream->dirty)
+	  {
+	    /* this discards stdio's read buffer */
+	    if (file->fp != NULL)
+	      (void) fflush(file->fp);
+	    ch->stream->dirty = FALSE;
+	  }
+      }
+}
+
+/* discard any read-ahead blocks that overlap bytes start through end-1
+   of the given file, since they are about to become stale */
+static void
+InvalidateReads (MRI_File *file, long long start, long long end)
+{
+  MRI_Chunk *ch;
+  IOJob *job;
+
+  for (ch = file->ds->chunks; ch != NULL; ch = ch->next)
+    if (ch->stream != NULL && ch->file == file)
+      for (job = ch->stream->reads; job != NULL; job = job->next_in_stream)
+	if (job->file_offset < end && job->file_offset + job->nbytes > start)
+	  {
+	    DropReads(ch->stream);
+	    break;
+	  }
+}
+
+/* Called before reading nbytes at byte offset 'offset' within the
+   chunk.  Returns the block if it was read ahead, in which case the
+   caller must convert it and then pass it to RecycleJob; returns
+   NULL if the caller should read the data itself.  Either way,
+   further blocks may be queued if the access pattern is sequential. */
+static IOJob *
+StreamFetch (MRI_Chunk *ch, long long offset, long long nbytes)
+{
+  MRI_Stream *s;
+  IOJob *job, *last, *ahead;
+  long long start;
+  long long next;
+
+  if ((s = GetStream(ch)) == NULL)
+    return(NULL);
+  start = ch->offset + offset;
+  if (start == s->read_end && nbytes == s->read_len)
+    ++s->read_run;
+  else
+    s->read_run = 0;
+  s->read_end = start + nbytes;
+  s->read_len = nbytes;
+
+  job = NULL;
+  if (s->reads != NULL &&
+      s->reads->file_offset == start && s->reads->nbytes == nbytes)
+    {
+      job = s->reads;
+      s->reads = job->next_in_stream;
+      --s->n_reads;
+      WaitForJob(job, FALSE);
+      if (job->failed)
+	{
+	  RecycleJob(job);
+	  job = NULL;
+	}
+    }
+  else if (s->reads != NULL)
+    DropReads(s);
+
+  if (s->read_run > 0 && s->n_reads < ch->ds->stream_depth)
+    {
+      /* buffered stdio writes must reach the file before the
+	 engine reads it */
+      if (ch->file->writeable)
+	(void) fflush(ch->file->fp);
+      for (last = s->reads; last != NULL && last->next_in_stream != NULL;
+	   last = last->next_in_stream)
+	;
+      next = (last != NULL ? last->file_offset : start) + nbytes;
+      while (s->n_reads < ch->ds->stream_depth &&
+	     next + nbytes <= ch->offset + ch->size)
+	{
+	  ahead = NewJob(s, nbytes, FALSE);
+	  ahead->file_offset = next;
+	  if (last != NULL)
+	    last->next_in_stream = ahead;
+	  else
+	    s->reads = ahead;
+	  last = ahead;
+	  ++s->n_reads;
+	  SubmitJob(ahead);
+	  next += nbytes;
+	}
+    }
+  return(job);
+}
+
+/* Called before writing nbytes at byte offset 'offset' within the
+   chunk.  If the write can go behind, returns a job whose data
+   field the caller must fill in file byte order and then pass to
+   StreamWriteCommit; otherwise returns NULL. */
+static IOJob *
+StreamWriteBegin (MRI_Chunk *ch, long long offset, long long nbytes)
+{
+  MRI_Stream *s;
+  IOJob *job;
+  long long start;
+
+  start = ch->offset + offset;
+  InvalidateReads(ch->file, start, start + nbytes);
+  if ((s = GetStream(ch)) == NULL)
+    return(NULL);
+  if (start == s->write_end && nbytes == s->write_len)
+    ++s->write_run;
+  else
+    s->write_run = 0;
+  s->write_end = start + nbytes;
+  s->write_len = nbytes;
+  if (s->write_run == 0)
+    return(NULL);
+
+  /* bound the queue, and put anything stdio has buffered
+     ahead of us in the file */
+  RetireWrites(s, FALSE);
+  (void) fflush(ch->file->fp);
+
+  job = NewJob(s, nbytes, TRUE);
+  job->file_offset = start;
+  return(job);
+}
+
+static void
+StreamWriteCommit (IOJob *job)
+{
+  MRI_Stream *s;
+  IOJob *j;
+
+  s = job->stream;
+  if (s->writes == NULL)
+    s->writes = job;
+  else
+    {
+      for (j = s->writes; j->next_in_stream != NULL; j = j->next_in_stream)
+	;
+      j->next_in_stream = job;
+    }
+  ++s->n_writes;
+  s->dirty = TRUE;
+  SubmitJob(job);
+}
+
+/*
+ * Blocked storage.  A chunk whose compression key is not "none" is
+ * kept in a file of its own, as a container of separately coded
+ * blocks:
+ *
+ *	bytes 0-511	a superblock describing the layout
+ *	...		the coded blocks, in no particular order
+ *	index_offset	for each block, its offset, length and coding
+ *
+ * The blocks tile the chunk's dimensions in the shape given by the
+ * "block.<dim>" keys (by default, as many whole rows, planes, etc. as
+ * fit into about MRI_DEFAULT_BLOCK_SIZE bytes), and the last block
+ * along each dimension is padded out to the full shape.  Blocks that
+ * are entirely zero are not stored at all.  A rewritten block goes
+ * back in its old place if it still fits and is otherwise appended;
+ * the index is rewritten when the chunk is closed, and the dead space
+ * is squeezed out then if it has grown larger than the live data.
+ *
+ * The integers in the superblock and the index are little-endian; the
+ * elements within the blocks keep the byte order given by the chunk's
+ * little_endian key, so decoded blocks feed the same conversion code
+ * as flat chunks do.
+ */
+
+/* Fills in the merged layout of a store from its extents and block
+   shape.  Leading dimensions that are not split are folded together,
+   and dimension 0 is counted in bytes rather than elements so that
+   arbitrary byte ranges can be located. */
+static void
+SetBlockGeometry (MRI_BlockStore *bs)
+{
+  int i, j;
+
+  j = 0;
+  bs->m_extent[0] = bs->element_size * bs->extent[0];
+  bs->m_block[0] = bs->element_size * bs->block[0];
+  for (i = 1; i < bs->n_dims; ++i)
+    if (bs->m_block[j] == bs->m_extent[j])
+      {
+	bs->m_extent[j] *= bs->extent[i];
+	bs->m_block[j] *= bs->block[i];
+      }
+    else
+      {
+	++j;
+	bs->m_extent[j] = bs->extent[i];
+	bs->m_block[j] = bs->block[i];
+      }
+  bs->n_merged = j + 1;
+  bs->block_bytes = 1;
+  bs->n_blocks = 1;
+  for (j = 0; j < bs->n_merged; ++j)
+    {
+      bs->m_count[j] = (bs->m_extent[j] + bs->m_block[j] - 1) / bs->m_block[j];
+      bs->block_bytes *= bs->m_block[j];
+      bs->n_blocks *= bs->m_count[j];
+    }
+}
+
+/* Sets up the block shape of a compressed chunk from its
+   "block.<dim>" keys, filling in a default for any that are
+   missing. */
+static void
+ComputeBlockShape (MRI_Chunk *ch)
+{
+  int i;
+  long long bytes, b;
+  char fieldname[16];
+
+  bytes = MRI_TypeLength(ch->datatype);
+  for (i = 0; i < (int) strlen(ch->dimensions); ++i)
+    {
+      sprintf(fieldname, ".block.%c", ch->dimensions[i]);
+      if (mri_has(ch->ds, mri_cat(ch->name, fieldname)))
+	b = mri_get_int(ch->ds, mri_cat(ch->name, fieldname));
+      else if (bytes * ch->extent[i] <= MRI_DEFAULT_BLOCK_SIZE)
+	b = ch->extent[i];
+      else
+	b = MRI_DEFAULT_BLOCK_SIZE / bytes;
+      if (b > ch->extent[i])
+	b = ch->extent[i];
+      if (b < 1)
+	b = 1;
+      ch->block[i] = b;
+      bytes *= b;
+    }
+}
+
+/* Drops the "block.<dim>" keys of a chunk that is no longer
+   compressed, including any left over from dimensions it no
+   longer has.  They are removed from the hash table directly,
+   since the removal hooks would only mark the chunk modified
+   again. */
+static void
+RemoveBlockKeys (MRI_Chunk *ch)
+{
+  MRI_Dataset *ds;
+  MRI_KeyValue *kv, *nkv;
+  char prefix[MRI_MAX_KEY_LENGTH+8];
+  int i, len;
+
+  ds = ch->ds;
+  LoadHeaderIndex(ds);
+  if (ds->hash_table == NULL)
+    return;
+  sprintf(prefix, "%s.block.", ch->name);
+  len = strlen(prefix);
+  for (i = 0; i < ds->hash_table_size; ++i)
+    for (kv = ds->hash_table[i]; kv != NULL; kv = nkv)
+      {
+	nkv = kv->next_in_hash_table;
+	if (strncmp(kv->key, prefix, len) == 0 &&
+	    (int) strlen(kv->key) == len + 1)
+	  RemoveFromHashTable(ds, kv->key);
+      }
+}
+
+static int
+ConvertCompression (MRI_Compression *pc, char *s)
+{
+  if (strcmp(s, "none") == 0)
+    *pc = MRI_NO_COMPRESSION;
+  else if (strcmp(s, "lz") == 0)
+    *pc = MRI_LZ_COMPRESSION;
+  else if (strcmp(s, "shuffle_lz") == 0)
+    *pc = MRI_SHUFFLE_LZ_COMPRESSION;
+  else return(FALSE);
+  return(TRUE);
+}
+
+/* Groups the i-th byte of every element together, so that the
+   slowly varying high-order bytes of neighbouring samples end up
+   next to each other where the LZ coder can find them. */
+static void
+Shuffle (unsigned char *src, unsigned char *dest, long long n, int size)
+{
+  long long count, i;
+  int b;
+
+  count = n / size;
+  for (b = 0; b < size; ++b)
+    for (i = 0; i < count; ++i)
+      dest[b*count + i] = src[i*size + b];
+}
+
+static void
+Unshuffle (unsigned char *src, unsigned char *dest, long long n, int size)
+{
+  long long count, i;
+  int b;
+
+  count = n / size;
+  for (b = 0; b < size; ++b)
+    for (i = 0; i < count; ++i)
+      dest[i*size + b] = src[b*count + i];
+}
+
+/* Appends one LZ sequence (a run of literals followed by a match
+   of mlen bytes, offset bytes back) to dest; a sequence with mlen
+   equal to 0 ends the block.  Returns FALSE if it will not fit. */
+static int
+LZEmit (unsigned char *dest, long long *pos, long long cap,
+	unsigned char *lit, long long n_lit, long long offset, long long mlen)
+{
+  long long op, r;
+  unsigned char *token;
+
+  op = *pos;
+  if (op + 1 + n_lit/255 + 1 + n_lit + 2 + mlen/255 + 1 > cap)
+    return(FALSE);
+  token = &dest[op++];
+  if (n_lit >= 15)
+    {
+      *token = 15 << 4;
+      for (r = n_lit - 15; r >= 255; r -= 255)
+	dest[op++] = 255;
+      dest[op++] = (unsigned char) r;
+    }
+  else
+    *token = (unsigned char) (n_lit << 4);
+  memcpy(&dest[op], lit, (size_t) n_lit);
+  op += n_lit;
+  if (mlen > 0)
+    {
+      dest[op++] = (unsigned char) (offset & 0xff);
+      dest[op++] = (unsigned char) (offset >> 8);
+      r = mlen - LZ_MIN_MATCH;
+      if (r >= 15)
+	{
+	  *token |= 15;
+	  for (r -= 15; r >= 255; r -= 255)
+	    dest[op++] = 255;
+	  dest[op++] = (unsigned char) r;
+	}
+      else
+	*token |= (unsigned char) r;
+    }
+  *pos = op;
+  return(TRUE);
+}
+
+/* Compresses n bytes from src into dest, which has room for cap
+   bytes.  Returns the compressed length, or 0 if the data would
+   not fit (in which case they should be stored as they are).  The
+   format is that of LZ4 blocks: each sequence is a token byte
+   holding the literal and match lengths, an extended literal
+   length, the literals, a 2-byte little-endian match offset, and
+   an extended match length. */
+static long long
+LZCompress (unsigned char *src, long long n, unsigned char *dest,
+	    long long cap, int *hash)
+{
+  long long ip, anchor, op, ref, mlen, limit;
+  unsigned int v, h;
+
+  for (h = 0; h < (1 << LZ_HASH_BITS); ++h)
+    hash[h] = -1;
+  ip = 0;
+  anchor = 0;
+  op = 0;
+  limit = n - 12;		/* matches must end 5 bytes short of the end */
+  while (ip < limit)
+    {
+      memcpy(&v, &src[ip], 4);
+      h = (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+      ref = hash[h];
+      hash[h] = (int) ip;
+      if (ref < 0 || ip - ref > 65535 || memcmp(&src[ref], &v, 4) != 0)
+	{
+	  /* skip faster through data that do not compress */
+	  ip += 1 + ((ip - anchor) >> 6);
+	  continue;
+	}
+      mlen = LZ_MIN_MATCH;
+      while (ip + mlen < n - 5 && src[ref + mlen] == src[ip + mlen])
+	++mlen;
+      if (!LZEmit(dest, &op, cap, &src[anchor], ip - anchor, ip - ref, mlen))
+	return(0);
+      ip += mlen;
+      anchor = ip;
+    }
+  if (!LZEmit(dest, &op, cap, &src[anchor], n - anchor, 0, 0))
+    return(0);
+  return(op);
+}
+
+/* Expands n bytes of LZ coded data from src into dest, which has
+   room for cap bytes.  Returns the expanded length, or -1 if the
+   data are corrupt. */
+static long long
+LZDecompress (unsigned char *src, long long n, unsigned char *dest,
+	      long long cap)
+{
+  long long ip, op, len, offset;
+  int token, b;
+
+  ip = 0;
+  op = 0;
+  while (ip < n)
+    {
+      token = src[ip++];
+      len = token >> 4;
+      if (len == 15)
+	do {
+	  if (ip >= n)
+	    return(-1);
+	  b = src[ip++];
+	  len += b;
+	} while (b == 255);
+      if (ip + len > n || op + len > cap)
+	return(-1);
+      memcpy(&dest[op], &src[ip], (size_t) len);
+      ip += len;
+      op += len;
+      if (ip >= n)
+	break;		/* the last sequence has no match */
+
+      if (ip + 2 > n)
+	return(-1);
+      offset = src[ip] | (src[ip+1] << 8);
+      ip += 2;
+      if (offset == 0 || offset > op)
+	return(-1);
+      len = token & 15;
+      if (len == 15)
+	do {
+	  if (ip >= n)
+	    return(-1);
+	  b = src[ip++];
+	  len += b;
+	} while (b == 255);
+      len += LZ_MIN_MATCH;
+      if (op + len > cap)
+	return(-1);
+      if (offset >= len)
+	{
+	  memcpy(&dest[op], &dest[op - offset], (size_t) len);
+	  op += len;
+	}
+      else
+	/* the match overlaps the bytes it produces */
+	for (; len > 0; --len, ++op)
+	  dest[op] = dest[op - offset];
+    }
+  return(op);
+}
+
+static MRI_BlockStore *
+NewBlockStore (MRI_Dataset *ds, MRI_File *file, int writeable)
+{
+  MRI_BlockStore *bs;
+  int i;
+
+  bs = (MRI_BlockStore *) malloc(sizeof(MRI_BlockStore));
+  memset(bs, 0, sizeof(MRI_BlockStore));
+  bs->ds = ds;
+  bs->file = file;
+  bs->writeable = writeable;
+  for (i = 0; i < MRI_BLOCK_CACHE_COUNT; ++i)
+    bs->cache[i].index = -1;
+  return(bs);
+}
+
+/* Allocates the index and the working buffers once the layout of a
+   store is known */
+static int
+AllocateBlockStore (MRI_BlockStore *bs)
+{
+  if (bs->block_bytes > MAX_BLOCK_BYTES)
+    {
+      mri_report_error(bs->ds, "libmri: block of %lld bytes in file %s is too large\n",
+		       bs->block_bytes, bs->file->name);
+      return(FALSE);
+    }
+  bs->blk_offset = (long long *) malloc((size_t) (bs->n_blocks * sizeof(long long)));
+  bs->blk_length = (int *) malloc((size_t) (bs->n_blocks * sizeof(int)));
+  bs->blk_coding = (unsigned char *) malloc((size_t) bs->n_blocks);
+  bs->coded = (unsigned char *) malloc((size_t) bs->block_bytes);
+  bs->shuffled = (unsigned char *) malloc((size_t) bs->block_bytes);
+  bs->hash = (int *) malloc((1 << LZ_HASH_BITS) * sizeof(int));
+  if (bs->blk_offset == NULL || bs->blk_length == NULL ||
+      bs->blk_coding == NULL || bs->coded == NULL ||
+      bs->shuffled == NULL || bs->hash == NULL)
+    {
+      mri_report_error(bs->ds, "libmri: cannot allocate block index for file %s\n",
+		       bs->file->name);
+      return(FALSE);
+    }
+  return(TRUE);
+}
+
+static void
+FreeBlockStore (MRI_BlockStore *bs)
+{
+  int i;
+
+  for (i = 0; i < MRI_BLOCK_CACHE_COUNT; ++i)
+    if (bs->cache[i].data != NULL)
+      free(bs->cache[i].data);
+  if (bs->blk_offset != NULL)
+    free(bs->blk_offset);
+  if (bs->blk_length != NULL)
+    free(bs->blk_length);
+  if (bs->blk_coding != NULL)
+    free(bs->blk_coding);
+  if (bs->coded != NULL)
+    free(bs->coded);
+  if (bs->shuffled != NULL)
+    free(bs->shuffled);
+  if (bs->hash != NULL)
+    free(bs->hash);
+  if (bs->scratch != NULL)
+    free(bs->scratch);
+  free(bs);
+}
+
+/* Copies the layout of a chunk into the store; a chunk with no
+   dimensions is treated as a single element. */
+static void
+SetStoreShape (MRI_BlockStore *bs, MRI_Chunk *ch)
+{
+  int i;
+
+  bs->element_size = MRI_TypeLength(ch->datatype);
+  bs->compression = ch->compression;
+  bs->n_dims = strlen(ch->dimensions);
+  for (i = 0; i < bs->n_dims; ++i)
+    {
+      bs->extent[i] = ch->extent[i];
+      bs->block[i] = ch->block[i];
+    }
+  if (bs->n_dims == 0)
+    {
+      bs->n_dims = 1;
+      bs->extent[0] = bs->block[0] = 1;
+    }
+  SetBlockGeometry(bs);
+}
+
+/* Reads the superblock and index of an existing container */
+static MRI_BlockStore *
+OpenBlockStore (MRI_Dataset *ds, MRI_File *file, int writeable)
+{
+  MRI_BlockStore *bs;
+  unsigned char sb[BLK_SUPERBLOCK_SIZE];
+  unsigned char *index;
+  long long i, index_offset;
+  int saved_bio_big_endian_input;
+  int ok;
+
+  if (!OpenFile(file, FALSE))
+    return(NULL);
+  if (mri_fseek(file->fp, 0LL, SEEK_SET) != 0 ||
+      fread(sb, BLK_SUPERBLOCK_SIZE, 1, file->fp) != 1 ||
+      memcmp(sb, BLK_MAGIC, strlen(BLK_MAGIC)) != 0)
+    {
+      mri_report_error(ds, "libmri: file %s is not a block container\n",
+		       file->name);
+      return(NULL);
+    }
+
+  saved_bio_big_endian_input = bio_big_endian_input;
+  bio_big_endian_input = FALSE;
+  bs = NewBlockStore(ds, file, writeable);
+  bs->compression = BRdInt32(&sb[16]);
+  bs->element_size = BRdInt32(&sb[20]);
+  bs->n_dims = BRdInt32(&sb[24]);
+  bs->n_blocks = BRdInt64(&sb[32]);
+  index_offset = BRdInt64(&sb[40]);
+  bs->end_offset = BRdInt64(&sb[48]);
+  bs->dead_bytes = BRdInt64(&sb[56]);
+  ok = (bs->n_dims >= 1 && bs->n_dims <= MRI_MAX_DIMS &&
+	bs->element_size >= 1 && bs->element_size <= 8);
+  for (i = 0; ok && i < bs->n_dims; ++i)
+    {
+      bs->extent[i] = BRdInt64(&sb[64 + 8*i]);
+      bs->block[i] = BRdInt64(&sb[64 + 8*MRI_MAX_DIMS + 8*i]);
+      if (bs->extent[i] < 1 || bs->block[i] < 1 || bs->block[i] > bs->extent[i])
+	ok = FALSE;
+    }
+  if (ok)
+    {
+      i = bs->n_blocks;
+      SetBlockGeometry(bs);
+      ok = (i == bs->n_blocks);
+    }
+  if (!ok)
+    {
+      bio_big_endian_input = saved_bio_big_endian_input;
+      mri_report_error(ds, "libmri: corrupt superblock in file %s\n", file->name);
+      FreeBlockStore(bs);
+      return(NULL);
+    }
+  if (!AllocateBlockStore(bs))
+    {
+      bio_big_endian_input = saved_bio_big_endian_input;
+      FreeBlockStore(bs);
+      return(NULL);
+    }
+
+  index = (unsigned char *) malloc((size_t) (bs->n_blocks * BLK_INDEX_ENTRY_SIZE));
+  ok = (index != NULL &&
+	mri_fseek(file->fp, index_offset, SEEK_SET) == 0 &&
+	fread(index, (size_t) (bs->n_blocks * BLK_INDEX_ENTRY_SIZE), 1,
+	      file->fp) == 1);
+  for (i = 0; ok && i < bs->n_blocks; ++i)
+    {
+      bs->blk_offset[i] = BRdInt64(&index[BLK_INDEX_ENTRY_SIZE*i]);
+      bs->blk_length[i] = BRdInt32(&index[BLK_INDEX_ENTRY_SIZE*i + 8]);
+      bs->blk_coding[i] = (unsigned char) BRdInt32(&index[BLK_INDEX_ENTRY_SIZE*i + 12]);
+      if (bs->blk_coding[i] > BLK_SHUFFLE_LZ ||
+	  bs->blk_length[i] < 0 || bs->blk_length[i] > bs->block_bytes ||
+	  bs->blk_coding[i] != BLK_ABSENT &&
+	  (bs->blk_offset[i] < BLK_SUPERBLOCK_SIZE ||
+	   bs->blk_offset[i] + bs->blk_length[i] > bs->end_offset))
+	ok = FALSE;
+    }
+  bio_big_endian_input = saved_bio_big_endian_input;
+  if (index != NULL)
+    free(index);
+  if (!ok)
+    {
+      mri_report_error(ds, "libmri: corrupt block index in file %s\n", file->name);
+      FreeBlockStore(bs);
+      return(NULL);
+    }
+  return(bs);
+}
+
+/* Starts a new, empty container for a chunk in its file */
+static MRI_BlockStore *
+CreateBlockStore (MRI_Chunk *ch)
+{
+  MRI_BlockStore *bs;
+  long long i;
+
+  bs = NewBlockStore(ch->ds, ch->file, TRUE);
+  SetStoreShape(bs, ch);
+  if (!AllocateBlockStore(bs) ||
+      !OpenFile(ch->file, TRUE))
+    {
+      FreeBlockStore(bs);
+      return(NULL);
+    }
+  fflush(ch->file->fp);
+  mri_ftruncate(fileno(ch->file->fp), 0LL);
+  for (i = 0; i < bs->n_blocks; ++i)
+    {
+      bs->blk_offset[i] = 0;
+      bs->blk_length[i] = 0;
+      bs->blk_coding[i] = BLK_ABSENT;
+    }
+  bs->end_offset = BLK_SUPERBLOCK_SIZE;
+  bs->dead_bytes = 0;
+  bs->index_dirty = TRUE;
+  return(bs);
+}
+
+/* Decodes block number index into dest */
+static int
+LoadBlock (MRI_BlockStore *bs, long long index, unsigned char *dest)
+{
+  long long n;
+  unsigned char *target;
+
+  if (bs->blk_coding[index] == BLK_ABSENT)
+    {
+      memset(dest, 0, (size_t) bs->block_bytes);
+      return(TRUE);
+    }
+  if (!OpenFile(bs->file, FALSE))
+    return(FALSE);
+  if (mri_fseek(bs->file->fp, bs->blk_offset[index], SEEK_SET) != 0 ||
+      fread((bs->blk_coding[index] == BLK_STORED) ? dest : bs->coded,
+	    (size_t) bs->blk_length[index], 1, bs->file->fp) != 1)
+    {
+      mri_report_error(bs->ds, "libmri: could not read block %lld from file %s\n",
+		       index, bs->file->name);
+      return(FALSE);
+    }
+  switch (bs->blk_coding[index])
+    {
+    case BLK_STORED:
+      n = bs->blk_length[index];
+      break;
+    case BLK_LZ:
+      n = LZDecompress(bs->coded, bs->blk_length[index], dest, bs->block_bytes);
+      break;
+    case BLK_SHUFFLE_LZ:
+      target = bs->shuffled;
+      n = LZDecompress(bs->coded, bs->blk_length[index], target, bs->block_bytes);
+      if (n == bs->block_bytes)
+	Unshuffle(target, dest, n, bs->element_size);
+      break;
+    default:
+      n = -1;
+      break;
+    }
+  if (n != bs->block_bytes)
+    {
+      mri_report_error(bs->ds, "libmri: corrupt block %lld in file %s\n",
+		       index, bs->file->name);
+      return(FALSE);
+    }
+  return(TRUE);
+}
+
+/* Codes a cached block and writes it to the container */
+static int
+StoreBlock (MRI_BlockStore *bs, BlockCacheEntry *e)
+{
+  long long i, index, length, offset;
+  int coding;
+  unsigned char *src;
+
+  index = e->index;
+  e->dirty = FALSE;
+  for (i = 0; i < bs->block_bytes && e->data[i] == 0; ++i)
+    ;
+  if (i == bs->block_bytes)
+    {
+      /* all-zero blocks take no space */
+      coding = BLK_ABSENT;
+      length = 0;
+      offset = 0;
+    }
+  else
+    {
+      src = e->data;
+      if (bs->compression == MRI_SHUFFLE_LZ_COMPRESSION && bs->element_size > 1)
+	{
+	  Shuffle(e->data, bs->shuffled, bs->block_bytes, bs->element_size);
+	  src = bs->shuffled;
+	  coding = BLK_SHUFFLE_LZ;
+	}
+      else
+	coding = BLK_LZ;
+      length = LZCompress(src, bs->block_bytes, bs->coded, bs->block_bytes - 1,
+			  bs->hash);
+      if (length > 0)
+	src = bs->coded;
+      else
+	{
+	  src = e->data;
+	  coding = BLK_STORED;
+	  length = bs->block_bytes;
+	}
+
+      /* reuse the block's old space if the new version fits */
+      if (bs->blk_coding[index] != BLK_ABSENT &&
+	  length <= bs->blk_length[index])
+	offset = bs->blk_offset[index];
+      else
+	offset = bs->end_offset;
+      if (!OpenFile(bs->file, TRUE))
+	return(FALSE);
+      if (mri_fseek(bs->file->fp, offset, SEEK_SET) != 0 ||
+	  fwrite(src, (size_t) length, 1, bs->file->fp) != 1)
+	{
+	  mri_report_error(bs->ds, "libmri: could not write block %lld to file %s\n",
+			   index, bs->file->name);
+	  return(FALSE);
+	}
+      if (offset == bs->end_offset)
+	bs->end_offset += length;
+    }
+
+  if (bs->blk_coding[index] != BLK_ABSENT)
+    bs->dead_bytes += (offset == bs->blk_offset[index]) ?
+      bs->blk_length[index] - length : bs->blk_length[index];
+  bs->blk_offset[index] = offset;
+  bs->blk_length[index] = (int) length;
+  bs->blk_coding[index] = (unsigned char) coding;
+  bs->index_dirty = TRUE;
+  return(TRUE);
+}
+
+/* Returns the cache entry holding block number index, evicting the
+   least recently used entry if necessary.  If load is FALSE, the
+   caller is going to overwrite the whole block, so its old contents
+   are not read. */
+static BlockCacheEntry *
+GetBlock (MRI_BlockStore *bs, long long index, int load)
+{
+  BlockCacheEntry *e, *victim;
+  int i;
+
+  victim = NULL;
+  for (i = 0; i < MRI_BLOCK_CACHE_COUNT; ++i)
+    {
+      e = &bs->cache[i];
+      if (e->index == index)
+	{
+	  e->last_use = ++bs->use_count;
+	  return(e);
+	}
+      if (victim == NULL ||
+	  victim->index >= 0 &&
+	  (e->index < 0 || e->last_use < victim->last_use))
+	victim = e;
+    }
+
+  if (victim->dirty)
+    (void) StoreBlock(bs, victim);
+  if (victim->data == NULL &&
+      (victim->data = (unsigned char *) malloc((size_t) bs->block_bytes)) == NULL)
+    {
+      mri_report_error(bs->ds, "libmri: cannot allocate block buffer\n");
+      return(NULL);
+    }
+  victim->index = -1;
+  if (load && !LoadBlock(bs, index, victim->data))
+    return(NULL);
+  victim->index = index;
+  victim->dirty = FALSE;
+  victim->last_use = ++bs->use_count;
+  return(victim);
+}
+
+/* Copies nbytes at byte offset 'offset' within the chunk between
+   buf and the blocks.  The work is done a block at a time, so that
+   a range that cuts across many blocks decodes (and, when writing,
+   recodes) each of them only once. */
+static int
+BlockTransfer (MRI_BlockStore *bs, long long offset, long long nbytes,
+	       unsigned char *buf, int writing)
+{
+  long long lo[MRI_MAX_DIMS], hi[MRI_MAX_DIMS];
+  long long b[MRI_MAX_DIMS], blo[MRI_MAX_DIMS], bhi[MRI_MAX_DIMS];
+  long long origin[MRI_MAX_DIMS], last[MRI_MAX_DIMS];
+  long long rlo[MRI_MAX_DIMS], rhi[MRI_MAX_DIMS], c[MRI_MAX_DIMS];
+  long long cstride[MRI_MAX_DIMS], bstride[MRI_MAX_DIMS];
+  long long rs, re, end, index, first_byte, last_byte;
+  long long row, block_pos, start, stop;
+  int j, top, whole, padded;
+  BlockCacheEntry *e;
+
+  if (nbytes <= 0)
+    return(TRUE);
+
+  /* find the bounding box of the range; below the highest dimension
+     along which it varies, it may cover everything */
+  end = offset + nbytes;
+  rs = offset;
+  re = end - 1;
+  top = 0;
+  for (j = 0; j < bs->n_merged; ++j)
+    {
+      lo[j] = rs % bs->m_extent[j];
+      hi[j] = re % bs->m_extent[j];
+      rs /= bs->m_extent[j];
+      re /= bs->m_extent[j];
+      if (lo[j] != hi[j])
+	top = j;
+      cstride[j] = (j == 0) ? 1 : cstride[j-1] * bs->m_extent[j-1];
+      bstride[j] = (j == 0) ? 1 : bstride[j-1] * bs->m_block[j-1];
+    }
+  for (j = 0; j < top; ++j)
+    {
+      lo[j] = 0;
+      hi[j] = bs->m_extent[j] - 1;
+    }
+  for (j = 0; j < bs->n_merged; ++j)
+    {
+      blo[j] = lo[j] / bs->m_block[j];
+      bhi[j] = hi[j] / bs->m_block[j];
+      b[j] = blo[j];
+    }
+
+  /* visit each block in the box */
+  for (;;)
+    {
+      index = 0;
+      first_byte = 0;
+      last_byte = 0;
+      padded = FALSE;
+      for (j = bs->n_merged - 1; j >= 0; --j)
+	{
+	  index = index * bs->m_count[j] + b[j];
+	  origin[j] = b[j] * bs->m_block[j];
+	  last[j] = origin[j] + bs->m_block[j] - 1;
+	  if (last[j] >= bs->m_extent[j])
+	    {
+	      last[j] = bs->m_extent[j] - 1;
+	      padded = TRUE;
+	    }
+	  first_byte += origin[j] * cstride[j];
+	  last_byte += last[j] * cstride[j];
+	  rlo[j] = (lo[j] > origin[j]) ? lo[j] : origin[j];
+	  rhi[j] = (hi[j] < last[j]) ? hi[j] : last[j];
+	  c[j] = rlo[j];
+	}
+
+      /* a block that is being entirely overwritten need not be read */
+      whole = (writing && first_byte >= offset && last_byte < end);
+      if ((e = GetBlock(bs, index, !whole)) == NULL)
+	return(FALSE);
+      if (whole && padded)
+	memset(e->data, 0, (size_t) bs->block_bytes);
+
+      /* copy the part of each row of the block that lies in the range */
+      for (;;)
+	{
+	  row = 0;
+	  block_pos = 0;
+	  for (j = 1; j < bs->n_merged; ++j)
+	    {
+	      row += c[j] * cstride[j];
+	      block_pos += (c[j] - origin[j]) * bstride[j];
+	    }
+	  start = row + rlo[0];
+	  stop = row + rhi[0] + 1;
+	  if (start < offset)
+	    start = offset;
+	  if (stop > end)
+	    stop = end;
+	  if (start < stop)
+	    {
+	      block_pos += start - row - origin[0];
+	      if (writing)
+		memcpy(&e->data[block_pos], &buf[start - offset],
+		       (size_t) (stop - start));
+	      else
+		memcpy(&buf[start - offset], &e->data[block_pos],
+		       (size_t) (stop - start));
+	    }
+	  for (j = 1; j < bs->n_merged; ++j)
+	    if (++c[j] <= rhi[j])
+	      break;
+	    else
+	      c[j] = rlo[j];
+	  if (j >= bs->n_merged)
+	    break;
+	}
+      if (writing)
+	e->dirty = TRUE;
+
+      /* step to the next block */
+      for (j = 0; j < bs->n_merged; ++j)
+	if (++b[j] <= bhi[j])
+	  break;
+	else
+	  b[j] = blo[j];
+      if (j >= bs->n_merged)
+	return(TRUE);
+    }
+}
+
+/* Moves the rows of block number index that lie inside the chunk
+   between the decoded block and a flat copy of the chunk starting
+   at byte 0 of file f */
+static int
+TransferBlockRows (MRI_BlockStore *bs, long long index, unsigned char *data,
+		   MRI_File *f, int to_file)
+{
+  long long origin[MRI_MAX_DIMS], lim[MRI_MAX_DIMS], k[MRI_MAX_DIMS];
+  long long cstride[MRI_MAX_DIMS], bstride[MRI_MAX_DIMS];
+  long long rest, chunk_pos, block_pos;
+  int j;
+
+  rest = index;
+  for (j = 0; j < bs->n_merged; ++j)
+    {
+      origin[j] = (rest % bs->m_count[j]) * bs->m_block[j];
+      rest /= bs->m_count[j];
+      lim[j] = bs->m_extent[j] - origin[j];
+      if (lim[j] > bs->m_block[j])
+	lim[j] = bs->m_block[j];
+      k[j] = 0;
+      cstride[j] = (j == 0) ? 1 : cstride[j-1] * bs->m_extent[j-1];
+      bstride[j] = (j == 0) ? 1 : bstride[j-1] * bs->m_block[j-1];
+    }
+
+  for (;;)
+    {
+      chunk_pos = origin[0];
+      block_pos = 0;
+      for (j = 1; j < bs->n_merged; ++j)
+	{
+	  chunk_pos += (origin[j] + k[j]) * cstride[j];
+	  block_pos += k[j] * bstride[j];
+	}
+      if (mri_fseek(f->fp, chunk_pos, SEEK_SET) != 0 ||
+	  (to_file ?
+	   fwrite(&data[block_pos], (size_t) lim[0], 1, f->fp) :
+	   fread(&data[block_pos], (size_t) lim[0], 1, f->fp)) != 1)
+	{
+	  mri_report_error(bs->ds, "libmri: could not %s file %s\n",
+			   to_file ? "write" : "read", f->name);
+	  return(FALSE);
+	}
+
+      /* advance to the next row */
+      for (j = 1; j < bs->n_merged; ++j)
+	if (++k[j] < lim[j])
+	  break;
+	else
+	  k[j] = 0;
+      if (j >= bs->n_merged)
+	return(TRUE);
+    }
+}
+
+/* Rewrites the live blocks of a container contiguously, dropping
+   the space left behind by blocks that have been rewritten */
+static void
+CompactBlockStore (MRI_BlockStore *bs)
+{
+  MRI_File *temp;
+  long long i, pos;
+
+  temp = CreateTempFile(bs->ds);
+  if (!OpenFile(temp, TRUE))
+    return;
+  pos = 0;
+  for (i = 0; i < bs->n_blocks; ++i)
+    if (bs->blk_coding[i] != BLK_ABSENT)
+      {
+	if (!OpenFile(bs->file, FALSE) ||
+	    mri_fseek(bs->file->fp, bs->blk_offset[i], SEEK_SET) != 0 ||
+	    fread(bs->coded, (size_t) bs->blk_length[i], 1, bs->file->fp) != 1 ||
+	    !OpenFile(temp, TRUE) ||
+	    mri_fseek(temp->fp, pos, SEEK_SET) != 0 ||
+	    fwrite(bs->coded, (size_t) bs->blk_length[i], 1, temp->fp) != 1)
+	  {
+	    mri_report_error(bs->ds, "libmri: could not compact file %s\n",
+			     bs->file->name);
+	    DestroyFile(temp);
+	    return;
+	  }
+	bs->blk_offset[i] = BLK_SUPERBLOCK_SIZE + pos;
+	pos += bs->blk_length[i];
+      }
+  CopyBlock(bs->file, BLK_SUPERBLOCK_SIZE, temp, 0LL, pos);
+  DestroyFile(temp);
+  bs->end_offset = BLK_SUPERBLOCK_SIZE + pos;
+  bs->dead_bytes = 0;
+  bs->index_dirty = TRUE;
+}
+
+/* Writes back any modified blocks, then the index and superblock */
+static void
+FlushBlockStore (MRI_BlockStore *bs)
+{
+  unsigned char sb[BLK_SUPERBLOCK_SIZE];
+  unsigned char *index;
+  long long i;
+  int saved_bio_big_endian_output;
+  int ok;
+
+  if (!bs->writeable)
+    return;
+  for (i = 0; i < MRI_BLOCK_CACHE_COUNT; ++i)
+    if (bs->cache[i].index >= 0 && bs->cache[i].dirty)
+      (void) StoreBlock(bs, &bs->cache[i]);
+  if (!bs->index_dirty)
+    return;
+  if (bs->dead_bytes > BUFFER_SIZE &&
+      bs->dead_bytes > bs->end_offset - BLK_SUPERBLOCK_SIZE - bs->dead_bytes)
+    CompactBlockStore(bs);
+
+  saved_bio_big_endian_output = bio_big_endian_output;
+  bio_big_endian_output = FALSE;
+  index = (unsigned char *) malloc((size_t) (bs->n_blocks * BLK_INDEX_ENTRY_SIZE));
+  for (i = 0; index != NULL && i < bs->n_blocks; ++i)
+    {
+      BWrInt64(&index[BLK_INDEX_ENTRY_SIZE*i], bs->blk_offset[i]);
+      BWrInt32(&index[BLK_INDEX_ENTRY_SIZE*i + 8], bs->blk_length[i]);
+      BWrInt32(&index[BLK_INDEX_ENTRY_SIZE*i + 12], bs->blk_coding[i]);
+    }
+  memset(sb, 0, BLK_SUPERBLOCK_SIZE);
+  memcpy(sb, BLK_MAGIC, strlen(BLK_MAGIC));
+  BWrInt32(&sb[16], bs->compression);
+  BWrInt32(&sb[20], bs->element_size);
+  BWrInt32(&sb[24], bs->n_dims);
+  BWrInt64(&sb[32], bs->n_blocks);
+  BWrInt64(&sb[40], bs->end_offset);
+  BWrInt64(&sb[48], bs->end_offset);
+  BWrInt64(&sb[56], bs->dead_bytes);
+  for (i = 0; i < bs->n_dims; ++i)
+    {
+      BWrInt64(&sb[64 + 8*i], bs->extent[i]);
+      BWrInt64(&sb[64 + 8*MRI_MAX_DIMS + 8*i], bs->block[i]);
+    }
+  bio_big_endian_output = saved_bio_big_endian_output;
+
+  ok = (index != NULL && OpenFile(bs->file, TRUE) &&
+	mri_fseek(bs->file->fp, bs->end_offset, SEEK_SET) == 0 &&
+	fwrite(index, (size_t) (bs->n_blocks * BLK_INDEX_ENTRY_SIZE), 1,
+	       bs->file->fp) == 1 &&
+	mri_fseek(bs->file->fp, 0LL, SEEK_SET) == 0 &&
+	fwrite(sb, BLK_SUPERBLOCK_SIZE, 1, bs->file->fp) == 1 &&
+	fflush(bs->file->fp) == 0);
+  if (index != NULL)
+    free(index);
+  if (!ok)
+    {
+      mri_report_error(bs->ds, "libmri: could not write block index to file %s\n",
+		       bs->file->name);
+      return;
+    }
+  mri_ftruncate(fileno(bs->file->fp),
+		bs->end_offset + bs->n_blocks * BLK_INDEX_ENTRY_SIZE);
+  bs->index_dirty = FALSE;
+}
+
+/* Returns the open container of a compressed chunk, opening it
+   and checking it against the chunk's attributes if necessary */
+static MRI_BlockStore *
+GetBlockStore (MRI_Chunk *ch)
+{
+  MRI_BlockStore *bs, shape;
+  int i;
+
+  if (ch->blocks != NULL)
+    return(ch->blocks);
+  if ((bs = OpenBlockStore(ch->ds, ch->file, ch->ds->mode != MRI_READ)) == NULL)
+    return(NULL);
+  SetStoreShape(&shape, ch);
+  if (bs->element_size != shape.element_size || bs->n_dims != shape.n_dims)
+    i = 0;
+  else
+    for (i = 0; i < shape.n_dims; ++i)
+      if (bs->extent[i] != shape.extent[i] || bs->block[i] != shape.block[i])
+	break;
+  if (i < shape.n_dims)
+    {
+      mri_report_error(ch->ds, "libmri: block layout in file %s does not match chunk %s\n",
+		       ch->file->name, ch->name);
+      FreeBlockStore(bs);
+      return(NULL);
+    }
+  bs->compression = ch->compression;
+  ch->blocks = bs;
+  return(bs);
+}
+
+static void
+CloseBlockStore (MRI_Chunk *ch)
+{
+  if (ch->blocks == NULL)
+    return;
+  FlushBlockStore(ch->blocks);
+  FreeBlockStore(ch->blocks);
+  ch->blocks = NULL;
+}
+
+static void
+CloseAllBlockStores (MRI_Dataset *ds)
+{
+  MRI_Chunk *ch;
+
+  for (ch = ds->chunks; ch != NULL; ch = ch->next)
+    CloseBlockStore(ch);
+}
+
+/* Returns a staging area holding nbytes at byte offset 'offset'
+   within a compressed chunk, in file byte order, or NULL (with
+   bio_error set) if they cannot be read */
+static unsigned char *
+BlockFetch (MRI_Chunk *ch, long long offset, long long nbytes)
+{
+  MRI_BlockStore *bs;
+
+  if ((bs = GetBlockStore(ch)) == NULL ||
+      !ReserveScratch(bs, nbytes) ||
+      !BlockTransfer(bs, offset, nbytes, bs->scratch, FALSE))
+    {
+      bio_error = TRUE;
+      return(NULL);
+    }
+  return(bs->scratch);
+}
+
+/* Called before writing nbytes at byte offset 'offset' within a
+   compressed chunk.  Returns a staging area that the caller must
+   fill in file byte order and then pass on with BlockWriteCommit,
+   or NULL (with bio_error set) if the write cannot be done. */
+static unsigned char *
+BlockWriteBegin (MRI_Chunk *ch, long long offset, long long nbytes)
+{
+  MRI_BlockStore *bs;
+
+  if ((bs = GetBlockStore(ch)) == NULL ||
+      !ReserveScratch(bs, nbytes))
+    {
+      bio_error = TRUE;
+      return(NULL);
+    }
+  bs->pending_offset = offset;
+  bs->pending_bytes = nbytes;
+  return(bs->scratch);
+}
+
+static void
+BlockWriteCommit (MRI_Chunk *ch)
+{
+  MRI_BlockStore *bs;
+
+  bs = ch->blocks;
+  if (!BlockTransfer(bs, bs->pending_offset, bs->pending_bytes,
+		     bs->scratch, TRUE))
+    bio_error = TRUE;
+}
+
+static int
+ReserveScratch (MRI_BlockStore *bs, long long nbytes)
+{
+  if (nbytes <= bs->scratch_size)
+    return(TRUE);
+  if (bs->scratch != NULL)
+    free(bs->scratch);
+  if ((bs->scratch = (unsigned char *) malloc((size_t) nbytes)) == NULL)
+    {
+      bs->scratch_size = 0;
+      mri_report_error(bs->ds, "libmri: cannot allocate staging buffer\n");
+      return(FALSE);
+    }
+  bs->scratch_size = nbytes;
+  return(TRUE);
+}
+
+/* Builds a new container for a compressed chunk in ch->file from a
+   flat copy of its data (in the chunk's current datatype and byte
+   order) starting at byte 0 of src, or an empty one if src is NULL */
+static void
+PackChunk (MRI_Chunk *ch, MRI_File *src)
+{
+  MRI_BlockStore *bs;
+  BlockCacheEntry *e;
+  long long i;
+
+  if (ch->blocks != NULL)
+    {
+      FreeBlockStore(ch->blocks);
+      ch->blocks = NULL;
+    }
+  if ((bs = CreateBlockStore(ch)) == NULL)
+    return;
+  ch->blocks = bs;
+  if (src != NULL)
+    for (i = 0; i < bs->n_blocks; ++i)
+      {
+	if ((e = GetBlock(bs, i, FALSE)) == NULL)
+	  break;
+	memset(e->data, 0, (size_t) bs->block_bytes);
+	e->dirty = TRUE;
+	if (!OpenFile(src, FALSE) ||
+	    !TransferBlockRows(bs, i, e->data, src, FALSE))
+	  break;
+      }
+  CloseBlockStore(ch);
+}
+
+/* Expands the container holding a compressed chunk's actual data
+   into a flat temporary file, and points the chunk's actual_*
+   fields at that.  Returns the temporary file. */
+static MRI_File *
+UnpackChunk (MRI_Chunk *ch)
+{
+  MRI_BlockStore *bs;
+  MRI_File *temp;
+  unsigned char *data;
+  long long i, size;
+
+  if (ch->blocks != NULL && ch->blocks->file == ch->actual_file)
+    CloseBlockStore(ch);
+  temp = CreateTempFile(ch->ds);
+  if ((bs = OpenBlockStore(ch->ds, ch->actual_file, FALSE)) == NULL)
+    data = NULL;
+  else if ((data = (unsigned char *) malloc((size_t) bs->block_bytes)) == NULL)
+    mri_report_error(ch->ds, "libmri: cannot allocate block buffer\n");
+  size = 0;
+  if (data != NULL)
+    {
+      for (i = 0; i < bs->n_blocks; ++i)
+	if (bs->blk_coding[i] != BLK_ABSENT)
+	  if (!LoadBlock(bs, i, data) ||
+	      !OpenFile(temp, TRUE) ||
+	      !TransferBlockRows(bs, i, data, temp, TRUE))
+	    break;
+      size = bs->element_size;
+      for (i = 0; i < bs->n_dims; ++i)
+	size *= bs->extent[i];
+      free(data);
+    }
+  if (bs != NULL)
+    FreeBlockStore(bs);
+
+  /* the blocks that were never stored read back as zeros */
+  if (OpenFile(temp, TRUE))
+    {
+      fflush(temp->fp);
+      mri_ftruncate(fileno(temp->fp), size);
+    }
+  ch->actual_file = temp;
+  ch->actual_offset = 0;
+  ch->actual_size = size;
+  ch->actual_compression = MRI_NO_COMPRESSION;
+  return(temp);
+}
+
+/* returns TRUE if a compressed chunk's container already has the
+   layout its attributes call for */
+static int
+SameBlockLayout (MRI_Chunk *ch)
+{
+  int i;
+
+  if (ch->actual_compression == MRI_NO_COMPRESSION ||
+      ch->file != ch->actual_file ||
+      ch->datatype != ch->actual_datatype ||
+      ch->little_endian != ch->actual_little_endian ||
+      strcmp(ch->dimensions, ch->actual_dimensions) != 0)
+    return(FALSE);
+  for (i = 0; i < (int) strlen(ch->dimensions); ++i)
+    if (ch->extent[i] != ch->actual_extent[i] ||
+	ch->block[i] != ch->actual_block[i])
+      return(FALSE);
+  return(TRUE);
+}
+
+/* returns TRUE if the chunk's data on disk is laid out exactly as
+   an array of the given type would be in memory on this machine */
+static int
+IsNativeLayout (MRI_Chunk *ch, MRI_ArrayType type)
+{
+  if (ch->compression != MRI_NO_COMPRESSION)
+    return(FALSE);
+  if (type == MRI_RAW)
+    return(TRUE);
+  if (MRI_TypeLength(ch->datatype) > 1 &&
+      (ch->little_endian ? bio_big_endian_machine : !bio_big_endian_machine))
+    return(FALSE);
+  switch (ch->datatype)
+    {
+    case MRI_UINT8:
+      return(type == MRI_UNSIGNED_CHAR);
+    case MRI_INT16:
+      return(type == MRI_SHORT && sizeof(short) == 2);
+    case MRI_INT32:
+      return((type == MRI_INT && sizeof(int) == 4) ||
+	     (type == MRI_LONG && sizeof(long) == 4));
+    case MRI_INT64:
+      return(type == MRI_LONGLONG ||
+	     (type == MRI_LONG && sizeof(long) == 8));
+    case MRI_FLOAT32:
+      return(type == MRI_FLOAT);
+    case MRI_FLOAT64:
+      return(type == MRI_DOUBLE);
+    }
+  return(FALSE);
+}
+
+/* Try to map the given portion of a chunk directly into memory.
+   Returns NULL (without reporting an error) if the data cannot be
+   used in place, in which case the caller should fall back to
+   reading it. The mapping is private, so the application may scribble
+   on the returned array without affecting the file. */
+static void *
+MapChunk (MRI_Chunk *ch, long long size, long long offset,
+	  MRI_ArrayType type, int transient)
+{
+#ifdef USE_MMAP
+  MRI_Dataset *ds;
+  MRI_Mapping *m, *pm, *oldest, *poldest;
+  struct stat st;
+  long long start;
+  long long base;
+  long long nbytes;
+  long page_size;
+  int elt_size;
+  int count;
+  void *addr;
+
+  ds = ch->ds;
+  if (!IsNativeLayout(ch, type) || size <= 0)
+    return(NULL);
+  if (!ch->ready_to_read &&
+      !PrepareToRead(ch))
+    return(NULL);
+  ch->file->last_use = file_access++;
+
+  elt_size = (type == MRI_RAW ? 1 : MRI_TypeLength(ch->datatype));
+  start = ch->offset + offset*elt_size;
+  nbytes = size*elt_size;
+  if (start % elt_size != 0)
+    return(NULL);		/* the result would be misaligned */
+
+  /* make sure anything we have written is visible through the map */
+  SyncFile(ch->file);
+  if (ch->file->writeable && fflush(ch->file->fp) != 0)
+    return(NULL);
+  if (fstat(fileno(ch->file->fp), &st) != 0 ||
+      (long long) st.st_size < start + nbytes)
+    return(NULL);		/* not all of the data has been written */
+
+  page_size = sysconf(_SC_PAGESIZE);
+  base = (start / page_size) * page_size;
+  addr = mmap(NULL, (size_t) (nbytes + (start - base)),
+	      PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	      fileno(ch->file->fp), (off_t) base);
+  if (addr == MAP_FAILED)
+    return(NULL);
+
+  m = (MRI_Mapping *) malloc(sizeof(MRI_Mapping));
+  m->base = addr;
+  m->length = nbytes + (start - base);
+  m->ptr = (char *) addr + (start - base);
+  m->transient = transient;
+  m->next = ds->mappings;
+  ds->mappings = m;
+
+  if (transient)
+    {
+      /* recycle the least recently made transient mapping once
+	 there are more of them than we would keep buffers */
+      count = 0;
+      oldest = poldest = NULL;
+      for (pm = NULL, m = ds->mappings; m != NULL; pm = m, m = m->next)
+	if (m->transient)
+	  {
+	    ++count;
+	    oldest = m;
+	    poldest = pm;
+	  }
+      if (count > MRI_MAX_BUFFER_COUNT)
+	{
+	  if (poldest != NULL)
+	    poldest->next = oldest->next;
+	  else
+	    ds->mappings = oldest->next;
+	  (void) munmap(oldest->base, (size_t) oldest->length);
+	  free(oldest);
+	}
+    }
+
+  return(ds->mappings->ptr);
+#else
+  return(NULL);
+#endif
+}
+
+/* Release the mapping (or fallback buffer) associated with ptr.
+   Returns FALSE if ptr does not belong to any mapping. */
+static int
+ReleaseMapping (MRI_Dataset *ds, void *ptr)
+{
+  MRI_Mapping *pm, *m;
+
+  for (pm = NULL, m = ds->mappings; m != NULL; pm = m, m = m->next)
+    if (m->ptr == ptr)
+      {
+	if (pm != NULL)
+	  pm->next = m->next;
+	else
+	  ds->mappings = m->next;
+#ifdef USE_MMAP
+	if (m->base != NULL)
+	  (void) munmap(m->base, (size_t) m->length);
+	else
+#endif
+	  free(m->ptr);
+	free(m);
+	return(TRUE);
+      }
+  return(FALSE);
+}
+
+static void
+UnmapAll (MRI_Dataset *ds)
+{
+  while (ds->mappings != NULL)
+    (void) ReleaseMapping(ds, ds->mappings->ptr);
+}
+
 static int
 MRI_TypeLength (MRI_Datatype datatype)
 {
@@ -50,6 +50,30 @@
 #define MRI_ALIGNMENT_BOUNDARY	16384	/* the boundary increment in bytes
 					   to which large chunks will be
 					   aligned */
+#define MRI_DEFAULT_STREAM_DEPTH 2	/* the number of blocks read ahead
+					   of (or written behind) a program
+					   that walks sequentially through
+					   a chunk; the MRI_STREAM_DEPTH
+					   environment variable overrides
+					   this, and 0 disables streaming */
+#define MRI_DEFAULT_BLOCK_SIZE	1048576	/* the approximate number of bytes
+					   in each block of a compressed
+					   chunk whose block shape is not
+					   given explicitly */
+#define MRI_BLOCK_CACHE_COUNT	4	/* the number of decoded blocks of
+					   each compressed chunk that are
+					   kept in memory */
+#define MRI_BULK_IO_SIZE	8388608	/* the number of bytes moved at a
+					   time when whole chunks are copied,
+					   converted or cleared */
+#define MRI_INDEX_MIN_KEYS	256	/* datasets with at least this many
+					   keys are given a binary index of
+					   their header (a ".mri.idx" file)
+					   so that they can be opened
+					   without parsing it; the
+					   MRI_HEADER_INDEX environment
+					   variable overrides this, and 0
+					   disables the index */
 
 
 /*----------- nothing beyond this point----------------*/
@@ -130,6 +154,14 @@ typedef int MRI_Order;
 					   and MRI_LAST */
 #define MRI_LAST		10000	/* place it at the end of the file */
 
+/* these constants designate how a chunk's data are laid out
+   on disk */
+typedef int MRI_Compression;
+#define MRI_NO_COMPRESSION	0	/* a flat array of elements */
+#define MRI_LZ_COMPRESSION	1	/* blocks, each LZ compressed */
+#define MRI_SHUFFLE_LZ_COMPRESSION 2	/* blocks, each byte-shuffled
+					   and then LZ compressed */
+
 
 #define MRI_UNSPECIFIED		(-2147483647)	/* value returned if
 						   key is non-existent */
@@ -154,6 +186,19 @@ typedef struct MRI_Buffer {
   void *buffer;			/* the buffer area itself */
 } MRI_Buffer;
 
+typedef struct MRI_Mapping {
+  struct MRI_Mapping *next;	/* the next mapping on the mappings list */
+  void *base;			/* the page-aligned start of the mapped
+				   region, or NULL if the data had to
+				   be copied into a malloc'ed buffer */
+  long long length;		/* the length of the mapped region
+				   in bytes */
+  void *ptr;			/* the pointer handed to the application */
+  int transient;		/* if TRUE, this mapping was made on
+				   behalf of mri_get_image and will be
+				   recycled like an unretained buffer */
+} MRI_Mapping;
+
 typedef struct MRI_Dataset {
   /* general info */
   char *name;			/* the filename where the dataset's
@@ -176,6 +221,9 @@ typedef struct MRI_Dataset {
 				   table */
   MRI_KeyValue **hash_table;	/* a hash table so that we can go quickly
 				   from a key's name to it's value */
+  struct MRI_HeaderIndex *header_index; /* the binary index of a header
+					   whose keys have not all been
+					   loaded, or NULL */
 
   /* iteration support */
   struct MRI_KeyValue **iteration_table; /* an alphabetically sorted table
@@ -197,6 +245,17 @@ typedef struct MRI_Dataset {
   struct MRI_Buffer *retained_buffers;	/* the buffers that the application
 					   program has retained indefinitely
 					   for its own use */
+  struct MRI_Mapping *mappings;	/* the regions of chunk files that are
+				   currently memory-mapped */
+  int map_images;		/* if TRUE, mri_get_image will try to
+				   map images rather than copy them */
+
+  /* background streaming support */
+  int stream_depth;		/* the maximum number of blocks that
+				   may be queued ahead of reads or
+				   behind writes on any one chunk */
+  struct MRI_StreamEngine *stream_engine; /* the background I/O thread,
+					     or NULL if none is running */
   
   /* higher-level image support */
   int std_images;		/* if TRUE, this dataset contains
@@ -253,6 +312,9 @@ typedef struct MRI_Chunk {
   long long offset;		/* specifies the absolute byte offset
 				   where the chunk should go in its file */
   long long size;		/* the size of the chunk in bytes */
+  MRI_Compression compression;	/* how the data are encoded on disk */
+  long long block[MRI_MAX_DIMS]; /* the block shape of a compressed
+				   chunk */
 
   /* the actual_* fields record the state of the chunk
      on disk; these may lag behind the values above,
@@ -264,6 +326,8 @@ typedef struct MRI_Chunk {
   int actual_little_endian;
   long long actual_offset;
   long long actual_size;
+  MRI_Compression actual_compression;
+  long long actual_block[MRI_MAX_DIMS];
 
   int modified;		/* TRUE if the chunk's location
 			   or attributes have changed */
@@ -277,6 +341,12 @@ typedef struct MRI_Chunk {
 			   called before reading */
   int ready_to_write;	/* if FALSE, PrepareToWrite must be
 			   called before writing */
+
+  struct MRI_Stream *stream;	/* the read-ahead and write-behind state
+				   for this chunk, or NULL if it has
+				   not been accessed sequentially */
+  struct MRI_BlockStore *blocks; /* the open block container of a
+				   compressed chunk, or NULL */
 } MRI_Chunk;
 
 /*-----------------------------------------------------------------------
@@ -325,11 +395,18 @@ extern void *mri_read_chunk (MRI_Dataset *ds, const char *key,
 			     long long size, long long offset,
 			     MRI_ArrayType type, void* buffer);
 #define mri_write_chunk mri_set_chunk
+extern void *mri_map_chunk (MRI_Dataset *ds, const char *key,
+			    long long size, long long offset,
+			    MRI_ArrayType type);
+extern void mri_unmap_chunk (MRI_Dataset *ds, void *ptr);
 
 /*--------- BUFFER MANAGEMENT ------------------------------------*/
 extern void mri_retain_buffer (MRI_Dataset *ds, void *ptr);
 extern void mri_discard_buffer (MRI_Dataset *ds, void *ptr);
 
+/*--------- STREAMING --------------------------------------------*/
+extern void mri_set_stream_depth (MRI_Dataset *ds, int depth);
+
 /*--------- ERROR HANDLING ---------------------------------------*/
 extern char *mri_error;
 extern void mri_set_error_handling (MRI_Error_Handling mode);
@@ -341,3 +418,4 @@ extern void *mri_get_image (MRI_Dataset *ds,
 extern void mri_set_image (MRI_Dataset *ds,
 			   const int time, const int slice,
 			   MRI_ArrayType type, void *image);
+extern void mri_set_image_mapping (MRI_Dataset *ds, int flag);
@@ -70,6 +70,9 @@
 
 #define KEYBUF_SIZE 512
 
+/* Number of time series handed to glm_fit_many at once */
+#define FIT_BATCH 256
+
 static char rcsid[] = "$Id: mri_glm.c,v 1.42 2008/04/29 22:16:10 welling Exp $";
 
 typedef struct mrifile_struct {
@@ -1432,6 +1435,9 @@ static void fit_glm(MRIChunk* Input,
 {
   int z;
   int i;
+  int j;
+  int batch;
+  int nseries;
   double* factors_unpacked;
   double* factors;
   double* factors_scaled;
@@ -1481,8 +1487,9 @@ static void fit_glm(MRIChunk* Input,
   istdv_block= tseries_length*complex_fac;
 
   /* Allocate memory */
-  if (!(input_unpacked= (double*)malloc(in_block*sizeof(double))))
-    Abort("%s: unable to allocate %d doubles!\n",progname,in_block);
+  if (!(input_unpacked= (double*)malloc(FIT_BATCH*in_block*sizeof(double))))
+    Abort("%s: unable to allocate %d doubles!\n",progname,
+	  FIT_BATCH*in_block);
   if (!(factors_unpacked= (double*)malloc(tseries_length*nfactors*
 					 sizeof(double))))
     Abort("%s: unable to allocate %d doubles!\n",
@@ -1500,11 +1507,12 @@ static void fit_glm(MRIChunk* Input,
 					 *sizeof(double))))
     Abort("%s: unable to allocate %d doubles!\n",
 	  progname,tseries_length*complex_fac);
-  if (!(tseries= (double*)malloc(tseries_length*complex_fac*sizeof(double))))
+  if (!(tseries= (double*)malloc(FIT_BATCH*in_block*sizeof(double))))
     Abort("%s: unable to allocate %d doubles!\n",
-	  progname,tseries_length*complex_fac);
-  if (!(parameters= (double*)malloc(nparams*sizeof(double))))
-    Abort("%s: unable to allocate %d doubles!\n",progname,nparams);
+	  progname,FIT_BATCH*in_block);
+  if (!(parameters= (double*)malloc(FIT_BATCH*nparams*sizeof(double))))
+    Abort("%s: unable to allocate %d doubles!\n",progname,
+	  FIT_BATCH*nparams);
   if (!(parameters_out= (double*)malloc(nparams_out*sizeof(double))))
     Abort("%s: unable to allocate %d doubles!\n",progname,nparams_out);
 
@@ -1544,7 +1552,7 @@ static void fit_glm(MRIChunk* Input,
     if (Scale) {
       if (scale_tseries_per_slice==1) {
 	get_next_scale_block(Scale, scale_unpacked, scale, missing,
-			     complex_flag, z, scale_block, tseries_length);
+			     z, complex_flag, scale_block, tseries_length);
 	copy_and_apply_scale( factors_scaled, factors, scale, complex_flag,
 			      factors_length_packed/nfactors, nfactors );
       }
@@ -1567,45 +1575,65 @@ static void fit_glm(MRIChunk* Input,
 			     complex_flag, 1, z, istdv);
     }
 
-    for (i=0; i<tseries_per_slice; i++) {
-      /* load input time series data */
-      mriChunk_read(input_unpacked, Input, in_block);
-      mriChunk_advance(Input, in_block);
-
-      /* pack out missing data */
-      tseries_length_packed= pack_out_missing(input_unpacked,
-					      missing, tseries_length, 
-					      complex_flag, 1, z, tseries);
-
-      /* Apply scale if necessary */
-      if (Scale) {
-	if (scale_tseries_per_slice==1) {
-	  /* Scale data for this slice has been loaded, and factors are
-	   * already scaled.
-	   */
-	  apply_scale( tseries, scale, complex_flag, 
-		       tseries_length_packed, 1 );
-	}
-	else {
-	  /* Scale data for this voxel must be loaded, and both the time
-	   * series data and the factor data must be scaled.
-	   */
-	  get_next_scale_block(Scale, scale_unpacked, scale, missing,
-			       z, complex_flag, scale_block, tseries_length);
-	  copy_and_apply_scale( factors_scaled, factors, scale, complex_flag,
-				factors_length_packed/nfactors, nfactors );
-	  apply_scale( tseries, scale, complex_flag, 
-		       tseries_length_packed, 1 );
+    /* All the time series in a slice share the packed factors, unless
+     * each has its own scale, so llsq can fit them in batches.  The
+     * iterative regressors gain nothing from this, and their context
+     * for glm_normproject belongs to a single series.
+     */
+    if (glm_get(gbl_r,GLM_TYPE)==GLM_TYPE_LLSQ 
+	&& !(Scale && scale_tseries_per_slice!=1)) batch= FIT_BATCH;
+    else batch= 1;
+    for (i=0; i<tseries_per_slice; i += nseries) {
+      nseries= tseries_per_slice-i;
+      if (nseries>batch) nseries= batch;
+
+      for (j=0; j<nseries; j++) {
+	/* load input time series data */
+	mriChunk_read(input_unpacked+j*in_block, Input, in_block);
+	mriChunk_advance(Input, in_block);
+
+	/* pack out missing data */
+	tseries_length_packed= pack_out_missing(input_unpacked+j*in_block,
+						missing, tseries_length, 
+						complex_flag, 1, z, 
+						tseries+j*in_block);
+
+	/* Apply scale if necessary */
+	if (Scale) {
+	  if (scale_tseries_per_slice==1) {
+	    /* Scale data for this slice has been loaded, and factors are
+	     * already scaled.
+	     */
+	    apply_scale( tseries+j*in_block, scale, complex_flag, 
+			 tseries_length_packed, 1 );
+	  }
+	  else {
+	    /* Scale data for this voxel must be loaded, and both the time
+	     * series data and the factor data must be scaled.
+	     */
+	    get_next_scale_block(Scale, scale_unpacked, scale, missing,
+				 z, complex_flag, scale_block, tseries_length);
+	    copy_and_apply_scale( factors_scaled, factors, scale, 
+				  complex_flag, factors_length_packed/nfactors,
+				  nfactors );
+	    apply_scale( tseries+j*in_block, scale, complex_flag, 
+			 tseries_length_packed, 1 );
+	  }
 	}
       }
 
       /* Fit the data.  This may replace input with residuals. */
-      if ((retcode= glm_fit(gbl_r,tseries, factors_scaled, counts, parameters, 
-			    tseries_length_packed, nfactors)) != 0) {
+      if ((retcode= glm_fit_many(gbl_r, tseries, in_block, factors_scaled, 
+				 counts, parameters, nparams, 
+				 tseries_length_packed, nfactors, 
+				 nseries)) != 0) {
 	Warning(1,"%s: error in glm_fit: %s!\n",
 		progname,glm_error_msg());
       }
       if (Istdv) {
+	/* The projection depends only on istdv and the factors, which
+	 * are the same for the whole batch.
+	 */
 	if ((retcode= glm_normproject(gbl_r,istdv, istdv_proj, 
 				      tseries_length_packed, 
 				      nfactors)) != 0) {
@@ -1616,42 +1644,44 @@ static void fit_glm(MRIChunk* Input,
 	}
       }
 
-      if (Output) { /* residuals requested */
-	/* Unscale if necessary */
-	if (Scale) {
-	  /* We can't simply divide out the scale because some scale
-	   * values may have been zero.  We must wastefully and annoyingly 
-	   * recalculate the residuals.  That's the only way I know of
-	   * to get valid residuals for Y elements that had zero weight.
-	   *
-	   * Life is a sea of troubles.  Sigh.
-	   */
-	  calc_residuals_direct( complex_flag, mean, mean_i,
-				 parameters, nfactors, 
-				 input_unpacked,
-				 factors_unpacked, 
-				 tseries_unpacked, tseries_length );
-	}
-	else {
-	  /* pack in 0's for missing data */
-	  pack_in_missing(tseries, missing, tseries_length, 
-			  complex_flag, 1, z, 0.0, tseries_unpacked);
-	}
+      for (j=0; j<nseries; j++) {
+	if (Output) { /* residuals requested */
+	  /* Unscale if necessary */
+	  if (Scale) {
+	    /* We can't simply divide out the scale because some scale
+	     * values may have been zero.  We must wastefully and annoyingly 
+	     * recalculate the residuals.  That's the only way I know of
+	     * to get valid residuals for Y elements that had zero weight.
+	     *
+	     * Life is a sea of troubles.  Sigh.
+	     */
+	    calc_residuals_direct( complex_flag, mean, mean_i,
+				   parameters+j*nparams, nfactors, 
+				   input_unpacked+j*in_block,
+				   factors_unpacked, 
+				   tseries_unpacked, tseries_length );
+	  }
+	  else {
+	    /* pack in 0's for missing data */
+	    pack_in_missing(tseries+j*in_block, missing, tseries_length, 
+			    complex_flag, 1, z, 0.0, tseries_unpacked);
+	  }
 
-	/* write the time series */
-	mriChunk_write(tseries_unpacked, Output, out_block);
-	mriChunk_advance(Output, out_block);
+	  /* write the time series */
+	  mriChunk_write(tseries_unpacked, Output, out_block);
+	  mriChunk_advance(Output, out_block);
+	}
+	if (complex_flag)
+	  format_output_params_complex(parameters_out, parameters+j*nparams, 
+				       istdv_proj, tseries_length_packed,
+				       nparams, nparams_out, nfactors);
+	else 
+	  format_output_params(parameters_out, parameters+j*nparams, 
+			       istdv_proj, tseries_length_packed, nparams, 
+			       nparams_out, nfactors);
+	mriChunk_write(parameters_out, Params, par_block);
+	mriChunk_advance(Params, par_block);
       }
-      if (complex_flag)
-	format_output_params_complex(parameters_out, parameters, istdv_proj,
-				     tseries_length_packed,
-				     nparams, nparams_out, nfactors);
-      else 
-	format_output_params(parameters_out, parameters, istdv_proj,
-			     tseries_length_packed, nparams, nparams_out, 
-			     nfactors);
-      mriChunk_write(parameters_out, Params, par_block);
-      mriChunk_advance(Params, par_block);
     }
     if (GETOPT(MRIGLM_VERBOSE)) {
       if (zdim<=30) {
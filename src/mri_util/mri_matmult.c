@@ -46,12 +46,14 @@
 
 #define KEYBUF_SIZE 512
 #define MAX_AT_ONCE (64*1024*1024)
+#define BATCH_AT_ONCE (4*1024*1024)
 
 static char rcsid[] = "$Id: mri_matmult.c,v 1.17 2007/07/06 18:45:53 welling Exp $";
 
 static char* progname;
 static int verbose_flg= 0;
 static int debug_flg= 0;
+static int nthreads= 1;
 
 #define MAYBE_MAKE_HASHMARK(  n ) if (verbose_flg) makeHashMark(n)
 
@@ -496,10 +498,12 @@ static void mult_leftsmall_accumsmall(MRI_Dataset* Left, MRI_Dataset* Right,
 				      long long out_foreach_offset,
 				      long long foreach_blksize)
 {
+  /* The right matrix is too big to read all at once; if it were
+   * not, mult_batched would have been used.
+   */
   double* left_fast_buf= NULL;
   double* accum_fast_buf= NULL;
   double* summed_buf= NULL;
-  double* summed_buf_all= NULL;
   double one= 1.0;
   double zero= 0.0;
   int int_one= 1;
@@ -507,27 +511,13 @@ static void mult_leftsmall_accumsmall(MRI_Dataset* Left, MRI_Dataset* Right,
   long long right_offset;
   long long out_offset;
   long long accum_offset;
-  int left_fast;
   int right_slow;
   int left_slow;
-  int summed;
-  int preread= 0;
-  int rsb= (int)right_slow_blksize;
   int lfb= (int)left_fast_blksize;
   int se= (int)summed_extent;
 
   if (debug_flg) fprintf(stderr,"Leftsmall_Accumsmall method used.\n");
   
-  if (right_slow_blksize*summed_extent < MAX_AT_ONCE) {
-    if (debug_flg) fprintf(stderr,"Loading entire right matrix!\n");
-    preread= 1;
-    summed_buf_all= mri_get_chunk(Right, chunk, 
-				  summed_extent*right_slow_blksize, 
-				  right_foreach_offset, MRI_DOUBLE);
-    mri_retain_buffer(Right, summed_buf_all);
-  }
-  else preread= 0;
-
   if (!(accum_fast_buf= 
 	(double*)malloc(left_fast_blksize*right_slow_blksize*sizeof(double))))
     Abort("%s: unable to allocate %d bytes!\n",
@@ -545,30 +535,20 @@ static void mult_leftsmall_accumsmall(MRI_Dataset* Left, MRI_Dataset* Right,
 				 left_base_offset, MRI_DOUBLE);
     right_offset= right_foreach_offset;
     accum_offset= 0;
-    if (preread) {
-      DGEMM( "n", "n", 
-	     &lfb, &rsb, &se, 
+    for (right_slow=0; right_slow<right_slow_blksize; right_slow++) { 
+      if (debug_flg)
+	fprintf(stderr,"Reading %d from right at %lld\n", 
+		summed_extent,right_offset);
+      summed_buf= mri_get_chunk(Right, chunk, summed_extent, 
+				right_offset, MRI_DOUBLE);
+      DGEMV( "n", &lfb, &se, 
 	     &one, 
 	     left_fast_buf, &lfb, 
-	     summed_buf_all, &se, 
-	     &zero, accum_fast_buf, &lfb );
-    }
-    else {
-      for (right_slow=0; right_slow<right_slow_blksize; right_slow++) { 
-	if (debug_flg)
-	  fprintf(stderr,"Reading %d from right at %lld\n", 
-		  summed_extent,right_offset);
-	summed_buf= mri_get_chunk(Right, chunk, summed_extent, 
-				  right_offset, MRI_DOUBLE);
-	DGEMV( "n", &lfb, &se, 
-	       &one, 
-	       left_fast_buf, &lfb, 
-	       summed_buf, &int_one,
-	       &zero,
-	       accum_fast_buf+accum_offset, &int_one );
-	accum_offset += left_fast_blksize;
-	right_offset += summed_extent;
-      }
+	     summed_buf, &int_one,
+	     &zero,
+	     accum_fast_buf+accum_offset, &int_one );
+      accum_offset += left_fast_blksize;
+      right_offset += summed_extent;
     }
     if (debug_flg) 
       fprintf(stderr,"Writing block %ld to %lld (size %ld)\n",
@@ -582,7 +562,6 @@ static void mult_leftsmall_accumsmall(MRI_Dataset* Left, MRI_Dataset* Right,
   }
 
   free(accum_fast_buf);
-  if (preread) mri_discard_buffer(Right, summed_buf_all);
 }
 
 static void mult_leftsmall_accumsmall_complex(MRI_Dataset* Left, 
@@ -597,10 +576,12 @@ static void mult_leftsmall_accumsmall_complex(MRI_Dataset* Left,
 					      long long out_foreach_offset,
 					      long long foreach_blksize)
 {
+  /* The right matrix is too big to read all at once; if it were
+   * not, mult_batched would have been used.
+   */
   double* left_fast_buf= NULL;
   double* accum_fast_buf= NULL;
   double* summed_buf= NULL;
-  double* summed_buf_all= NULL;
   double c_one[2]= {1.0,0.0};
   double c_zero[2]= {0.0,0.0};
   int int_one= 1;
@@ -608,28 +589,14 @@ static void mult_leftsmall_accumsmall_complex(MRI_Dataset* Left,
   long long right_offset;
   long long out_offset;
   long long accum_offset;
-  int left_fast;
   int right_slow;
   int left_slow;
-  int summed;
-  int preread= 0;
-  int rsb= (int)right_slow_blksize;
   int hlfb= (int)(left_fast_blksize/2); /* allow for complex */
   int se= (int)summed_extent;
 
   if (debug_flg) 
     fprintf(stderr,"Leftsmall_Accumsmall complex method used.\n");
 
-  if (2*right_slow_blksize*summed_extent < MAX_AT_ONCE) {
-    if (debug_flg) fprintf(stderr,"Loading entire right matrix!\n");
-    preread= 1;
-    summed_buf_all= mri_get_chunk(Right, chunk, 
-				  2*summed_extent*right_slow_blksize, 
-				  right_foreach_offset, MRI_DOUBLE);
-    mri_retain_buffer(Right, summed_buf_all);
-  }
-  else preread= 0;
-
   if (!(accum_fast_buf= 
 	(double*)malloc(left_fast_blksize*right_slow_blksize*sizeof(double))))
     Abort("%s: unable to allocate %d bytes!\n",
@@ -647,30 +614,20 @@ static void mult_leftsmall_accumsmall_complex(MRI_Dataset* Left,
 				 left_base_offset, MRI_DOUBLE);
     right_offset= right_foreach_offset;
     accum_offset= 0;
-    if (preread) {
-      ZGEMM( "n", "n", 
-	     &hlfb, &rsb, &se, 
+    for (right_slow=0; right_slow<right_slow_blksize; right_slow++) { 
+      if (debug_flg)
+	fprintf(stderr,"Reading %d from right at %lld\n", 
+		2*summed_extent,right_offset);
+      summed_buf= mri_get_chunk(Right, chunk, 2*summed_extent, 
+				right_offset, MRI_DOUBLE);
+      ZGEMV( "n", &hlfb, &se, 
 	     c_one, 
 	     left_fast_buf, &hlfb, 
-	     summed_buf_all, &se, 
-	     c_zero, accum_fast_buf, &hlfb );
-    }
-    else {
-      for (right_slow=0; right_slow<right_slow_blksize; right_slow++) { 
-	if (debug_flg)
-	  fprintf(stderr,"Reading %d from right at %lld\n", 
-		  2*summed_extent,right_offset);
-	summed_buf= mri_get_chunk(Right, chunk, 2*summed_extent, 
-				  right_offset, MRI_DOUBLE);
-	ZGEMV( "n", &hlfb, &se, 
-	       c_one, 
-	       left_fast_buf, &hlfb, 
-	       summed_buf, &int_one,
-	       c_zero,
-	       accum_fast_buf+accum_offset, &int_one );
-	accum_offset += left_fast_blksize;
-	right_offset += 2*summed_extent;
-      }
+	     summed_buf, &int_one,
+	     c_zero,
+	     accum_fast_buf+accum_offset, &int_one );
+      accum_offset += left_fast_blksize;
+      right_offset += 2*summed_extent;
     }
     if (debug_flg) 
       fprintf(stderr,"Writing block %ld to %lld (size %ld)\n",
@@ -684,7 +641,94 @@ static void mult_leftsmall_accumsmall_complex(MRI_Dataset* Left,
   }
 
   free(accum_fast_buf);
-  if (preread) mri_discard_buffer(Right, summed_buf_all);
+}
+
+static void mult_batched(MRI_Dataset* Left, MRI_Dataset* Right,
+			 MRI_Dataset* Out, char* chunk, int complex_flg,
+			 long left_fast_blksize, long left_slow_blksize,
+			 long right_slow_blksize, long summed_extent,
+			 long long foreach_blksize)
+{
+  /* Used when the whole right matrix for one foreach entry fits in
+   * memory.  Each read covers many left_slow slices, and several
+   * foreach entries if they are small, and batch_matmult does all
+   * their products at once against the loaded right matrices.
+   */
+  long right_size= (complex_flg ? 2 : 1)*summed_extent*right_slow_blksize;
+  long left_size= left_fast_blksize*summed_extent;
+  long out_size= left_fast_blksize*right_slow_blksize;
+  long fast= (complex_flg ? left_fast_blksize/2 : left_fast_blksize);
+  long long foreach_per_pass;
+  long slices_per_pass;
+  long long foreach_loop;
+  long long n_foreach;
+  long left_slow;
+  long n_slices;
+  long long i;
+  double* right_buf= NULL;
+  double* left_buf= NULL;
+  double* out_buf= NULL;
+
+  if (debug_flg) 
+    fprintf(stderr,"Batched %smethod used.\n",(complex_flg?"complex ":""));
+
+  /* Pick the batch shape */
+  if (left_slow_blksize*(left_size+out_size) + right_size <= BATCH_AT_ONCE) {
+    slices_per_pass= left_slow_blksize;
+    foreach_per_pass= BATCH_AT_ONCE
+      / (left_slow_blksize*(left_size+out_size) + right_size);
+    if (foreach_per_pass>foreach_blksize) foreach_per_pass= foreach_blksize;
+  }
+  else {
+    foreach_per_pass= 1;
+    slices_per_pass= BATCH_AT_ONCE/(left_size+out_size);
+    if (slices_per_pass<1) slices_per_pass= 1;
+  }
+  if (debug_flg)
+    fprintf(stderr,"Batches are %lld foreach entries of %ld slices\n",
+	    foreach_per_pass, slices_per_pass);
+
+  if (!(out_buf= 
+	(double*)malloc(foreach_per_pass*slices_per_pass*out_size
+			*sizeof(double))))
+    Abort("%s: unable to allocate %lld bytes!\n",progname,
+	  foreach_per_pass*slices_per_pass*out_size*sizeof(double));
+
+  /* OK, here we go. */
+  for (foreach_loop=0; foreach_loop<foreach_blksize; 
+       foreach_loop += n_foreach) {
+    n_foreach= foreach_blksize - foreach_loop;
+    if (n_foreach>foreach_per_pass) n_foreach= foreach_per_pass;
+    if (debug_flg)
+      fprintf(stderr,"Reading %lld from right at %lld\n",
+	      n_foreach*right_size, foreach_loop*right_size);
+    right_buf= mri_get_chunk(Right, chunk, n_foreach*right_size,
+			     foreach_loop*right_size, MRI_DOUBLE);
+    mri_retain_buffer(Right, right_buf);
+    for (left_slow=0; left_slow<left_slow_blksize; left_slow += n_slices) {
+      long long slice_offset= foreach_loop*left_slow_blksize + left_slow;
+      n_slices= left_slow_blksize - left_slow;
+      if (n_slices>slices_per_pass) n_slices= slices_per_pass;
+      if (debug_flg)
+	fprintf(stderr,"Reading %lld from left at %lld\n",
+		n_foreach*n_slices*left_size, slice_offset*left_size);
+      left_buf= mri_get_chunk(Left, chunk, n_foreach*n_slices*left_size,
+			      slice_offset*left_size, MRI_DOUBLE);
+      batch_matmult(left_buf, right_buf, out_buf, n_foreach*n_slices,
+		    fast, summed_extent, right_slow_blksize, n_slices,
+		    complex_flg, nthreads);
+      if (debug_flg) 
+	fprintf(stderr,"Writing %lld to %lld\n",
+		n_foreach*n_slices*out_size, slice_offset*out_size);
+      mri_set_chunk(Out, chunk, n_foreach*n_slices*out_size, 
+		    slice_offset*out_size, MRI_DOUBLE, out_buf);
+      for (i=0; i<n_foreach*n_slices; i++)
+	MAYBE_MAKE_HASHMARK( left_slow_blksize*foreach_blksize );
+    }
+    mri_discard_buffer(Right, right_buf);
+  }
+
+  free(out_buf);
 }
 
 static void mult_chunk(MRI_Dataset* Left, MRI_Dataset* Right, 
@@ -733,6 +777,17 @@ static void mult_chunk(MRI_Dataset* Left, MRI_Dataset* Right,
     Abort("%s: internal error: right fast block is not 1!\n",progname);
   if (verbose_flg) 
     Message("Counting out %lld blocks:\n",left_slow_blksize*foreach_blksize);
+
+  if (left_fast_blksize*summed_extent <= MAX_AT_ONCE
+      && left_fast_blksize*right_slow_blksize <= MAX_AT_ONCE
+      && right_slow_blksize*summed_extent < MAX_AT_ONCE) {
+    mult_batched(Left, Right, Out, chunk, 0,
+		 left_fast_blksize, left_slow_blksize,
+		 right_slow_blksize, summed_extent, foreach_blksize);
+    free(dimstr1_orig);
+    free(dimstr2_orig);
+    return;
+  }
   
   for (foreach_loop=0; foreach_loop<foreach_blksize; foreach_loop++) {
     if (left_fast_blksize*summed_extent <= MAX_AT_ONCE) {
@@ -816,6 +871,17 @@ static void mult_chunk_complex(MRI_Dataset* Left, MRI_Dataset* Right,
     Abort("%s: internal error: right fast block is not 2!\n",progname);
   if (verbose_flg) 
     Message("Counting out %d blocks:\n",left_slow_blksize*foreach_blksize);
+
+  if (left_fast_blksize*summed_extent <= MAX_AT_ONCE
+      && left_fast_blksize*right_slow_blksize <= MAX_AT_ONCE
+      && 2*right_slow_blksize*summed_extent < MAX_AT_ONCE) {
+    mult_batched(Left, Right, Out, chunk, 1,
+		 left_fast_blksize, left_slow_blksize,
+		 right_slow_blksize, summed_extent, foreach_blksize);
+    free(dimstr1_orig);
+    free(dimstr2_orig);
+    return;
+  }
   
   for (foreach_loop=0; foreach_loop<foreach_blksize; foreach_loop++){  
     if (left_fast_blksize*summed_extent <= MAX_AT_ONCE) {
@@ -1045,6 +1111,8 @@ int main( int argc, char* argv[] )
   verbose_flg= cl_present("verbose|ver|v");
   debug_flg= cl_present("debug|deb");
   complex_flg= cl_present("complex|cpx");
+  if (cl_get("threads","%option %d",&nthreads))
+    nthreads= fthr_count(argv[0], nthreads);
   cl_get("chunk|chu|c", "%option %s[%]","images",chunk);
   if (!cl_get("outfile|out", "%option %s", outfile)) {
     fprintf(stderr,"%s: Output file name not given.\n",progname);
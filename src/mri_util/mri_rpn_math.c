@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <math.h>
 #include <sys/time.h>
 #include "mri.h"
@@ -67,6 +68,7 @@ static int outfile_flg= 0; /* will we be producing output, or just printing? */
 static int verbose_flg= 0;
 static int debug_flg= 0;
 static int complex_flg= 0; /* read complex from input files */
+static int nthreads= 1;
 
 static void safe_copy(char* str1, char* str2) 
 {
@@ -195,6 +197,34 @@ static void ds_read_complex(double* dest1, double* dest2, MRIFile* f, long n,
   }
 }
 
+/* In the threaded version the main thread does all the I/O, reading
+ * the inputs for each chunk ahead and writing the results out in
+ * order, while the workers run the script on the chunks in between.
+ * fthr_run_ordered() runs the pipeline; chunk c always occupies slot
+ * c%nslots.
+ */
+
+typedef struct slot_struct {
+  long n;
+  long long offset;
+  double* in[MAX_INPUT_FILES]; /* NULL for inputs the script never loads */
+  double* out;
+  char* err; /* set if the script failed on this chunk */
+} Slot;
+
+typedef struct pool_struct {
+  Slot* slots;
+  int used[MAX_INPUT_FILES];
+  MRI_Dataset* Output;
+  RpnEngine* re; /* compiled engine to be cloned by the workers */
+  long rand_seed;
+} Pool;
+
+typedef struct worker_struct {
+  RpnEngine* re;
+  Slot* cur;
+} Worker;
+
 static const char* getDimensionsCB(const int which, void* usrHook)
 {
   char buf[KEYBUF_SIZE];
@@ -218,12 +248,22 @@ static const long getDimExtentCB(const int which, const char dim,
   return mri_get_int(f->ds,buf);
 }
 
+/* Engines run by worker threads have a Worker as their usrHook, and
+ * get their input from the buffers the main thread has already read
+ * into the worker's current slot.  The main engine has a NULL hook
+ * and reads the files directly.
+ */
 static void inputCB(const int which, const long n, 
 		    const long long offset, double* buf,
 		    void* usrHook)
 {
   long long myOffset= offset;
   long myN= n;
+  if (usrHook) {
+    Worker* w= (Worker*)usrHook;
+    memcpy(buf, w->cur->in[which], n*sizeof(double));
+    return;
+  }
   ds_read(buf, Input+which, myN, myOffset);
 }
 
@@ -233,6 +273,12 @@ static void inputComplexCB(const int which, const long n,
 {
   long long myOffset= offset;
   long myN= n;
+  if (usrHook) {
+    Worker* w= (Worker*)usrHook;
+    memcpy(buf1, w->cur->in[which], n*sizeof(double));
+    memcpy(buf2, w->cur->in[which]+RPN_CHUNKSIZE, n*sizeof(double));
+    return;
+  }
   ds_read_complex(buf1, buf2, Input+which, myN, myOffset);
 }
 
@@ -242,6 +288,133 @@ static int missingCB(const long z, const long t, void* usrHook)
   else return 0;
 }
 
+/* Copies a chunk of results off the engine stack.  In complex mode
+ * the real and imaginary values for an output voxel are in first and
+ * second positions in the stack; out_chunk actually points to the
+ * imaginary part.
+ */
+static void copyResult(double* dest, double* out_chunk, long n)
+{
+  long i;
+  if (complex_flg) {
+    for (i=0; i<n; i++) {
+      dest[2*i]= *(out_chunk+i-RPN_CHUNKSIZE);
+      dest[2*i+1]= *(out_chunk+i);
+    }
+  }
+  else memcpy(dest, out_chunk, n*sizeof(double));
+}
+
+static void* startRpnWorker( void* hook )
+{
+  Pool* p= (Pool*)hook;
+  Worker* w;
+
+  if (!(w= (Worker*)malloc(sizeof(Worker))))
+    Abort("%s: unable to allocate %d bytes!\n",progname,sizeof(Worker));
+  w->cur= NULL;
+  w->re= rpnCloneEngine(p->re, w);
+  return w;
+}
+
+static void endRpnWorker( void* hook, void* state )
+{
+  Worker* w= (Worker*)state;
+
+  rpnDestroyEngine(w->re);
+  free(w);
+}
+
+static void readChunk( void* hook, long long c, int slot )
+{
+  Pool* p= (Pool*)hook;
+  Slot* s= &(p->slots[slot]);
+  int j;
+
+  s->offset= c*RPN_CHUNKSIZE;
+  s->n= ((Input[0].length - s->offset) > RPN_CHUNKSIZE) ?
+    RPN_CHUNKSIZE : Input[0].length - s->offset;
+  for (j=0; j<n_input_files; j++) {
+    if (!p->used[j]) continue;
+    if (complex_flg) 
+      ds_read_complex(s->in[j], s->in[j]+RPN_CHUNKSIZE, Input+j, 
+		      s->n, s->offset);
+    else ds_read(s->in[j], Input+j, s->n, s->offset);
+  }
+}
+
+static void runChunk( void* hook, void* state, long long c, int slot )
+{
+  Pool* p= (Pool*)hook;
+  Worker* w= (Worker*)state;
+  Slot* s= &(p->slots[slot]);
+  double* out_chunk;
+
+  w->cur= s;
+  rpnSetRandomStream(w->re, p->rand_seed, c);
+  if ((out_chunk= rpnRun(w->re, s->n, s->offset)) != NULL)
+    copyResult(s->out, out_chunk, s->n);
+  else s->err= strdup(rpnGetErrorString(w->re));
+}
+
+static void writeChunk( void* hook, long long c, int slot )
+{
+  Pool* p= (Pool*)hook;
+  Slot* s= &(p->slots[slot]);
+
+  if (s->err) Abort("%s: execution error after %lld voxels: %s!\n",
+		    progname,s->offset,s->err);
+  if (complex_flg)
+    mri_set_chunk(p->Output, chunkname, 2*s->n, 2*s->offset, MRI_DOUBLE, 
+		  s->out);
+  else
+    mri_set_chunk(p->Output, chunkname, s->n, s->offset, MRI_DOUBLE, s->out);
+}
+
+static void runThreaded( RpnEngine* re, MRI_Dataset* Output, long rand_seed )
+{
+  Pool p;
+  long long nchunks= (Input[0].length + RPN_CHUNKSIZE - 1)/RPN_CHUNKSIZE;
+  int nslots= 2*nthreads;
+  long i;
+  int j;
+
+  /* Only the inputs the script actually loads need to be read */
+  for (j=0; j<n_input_files; j++) p.used[j]= 0;
+  for (i=0; i<re->program->code_length; i++)
+    if (re->program->code[i].op==OP_LOAD)
+      p.used[re->program->code[i].param.l]= 1;
+
+  p.Output= Output;
+  p.re= re;
+  p.rand_seed= rand_seed;
+  if (!(p.slots= (Slot*)calloc(nslots, sizeof(Slot))))
+    Abort("%s: unable to allocate %d bytes!\n",progname,
+	  nslots*sizeof(Slot));
+  for (i=0; i<nslots; i++) {
+    for (j=0; j<n_input_files; j++) {
+      if (p.used[j] 
+	  && !(p.slots[i].in[j]= 
+	       (double*)malloc(2*RPN_CHUNKSIZE*sizeof(double))))
+	Abort("%s: unable to allocate %d bytes!\n",progname,
+	      2*RPN_CHUNKSIZE*sizeof(double));
+    }
+    if (!(p.slots[i].out= (double*)malloc(2*RPN_CHUNKSIZE*sizeof(double))))
+      Abort("%s: unable to allocate %d bytes!\n",progname,
+	    2*RPN_CHUNKSIZE*sizeof(double));
+  }
+
+  fthr_run_ordered( nchunks, nthreads, nslots, startRpnWorker, endRpnWorker,
+		    readChunk, runChunk, writeChunk, &p );
+
+  for (i=0; i<nslots; i++) {
+    for (j=0; j<n_input_files; j++)
+      if (p.slots[i].in[j]) free(p.slots[i].in[j]);
+    free(p.slots[i].out);
+  }
+  free(p.slots);
+}
+
 
 int main( int argc, char* argv[] ) 
 {
@@ -281,7 +454,7 @@ int main( int argc, char* argv[] )
   debug_flg= cl_present("debug");
   cl_get("chunk|chu|c", "%option %s[%]", DEFAULT_CHUNK_NAME, chunkname);
   outfile_flg= cl_get("out|outfile", "%option %s", outfile);
-  if (!cl_get("seed", "%option %d",&rand_seed)) {
+  if (!cl_get("seed", "%option %ld",&rand_seed)) {
     /* Use milliseconds since the epoch */
     struct timeval tv;
     (void)gettimeofday(&tv, NULL);
@@ -289,6 +462,8 @@ int main( int argc, char* argv[] )
   }
   script_from_file= cl_get("expression|exp", "%option %s", scriptfile);
   complex_flg= cl_present("complex|cpx");
+  if (cl_get("threads","%option %d",&nthreads))
+    nthreads= fthr_count(argv[0], nthreads);
 
   if (!script_from_file) {
     if (!cl_get("", "%s", script)) {
@@ -362,9 +537,6 @@ int main( int argc, char* argv[] )
   rpnSetDebug(re,debug_flg);
   rpnSetComplex(re,complex_flg);
 
-  /* Initialize random number generator */
-  (void)srand48(rand_seed);
-  
   /* Initialize the engine */
   if (!rpnInit(re))
     Abort("%s: %s\n",progname,rpnGetErrorString(re));
@@ -432,31 +604,38 @@ int main( int argc, char* argv[] )
   }
   else Output= NULL;
 
-  voxels_moved= 0;
-  while (voxels_moved < Input[0].length) {
+  /* Output from if_print has to come out in order, so printing
+   * scripts are always run by a single engine.
+   */
+  if (nthreads>1 && !outfile_flg) {
+    Warning(1,"%s: scripts without -outfile run single-threaded; "
+	    "ignoring -threads.\n",progname);
+    nthreads= 1;
+  }
+
+  if (nthreads>1) runThreaded(re, Output, rand_seed);
+  else
+  for (voxels_moved= 0; voxels_moved < Input[0].length; 
+       voxels_moved += voxels_this_chunk) {
     voxels_this_chunk= ((Input[0].length - voxels_moved) > RPN_CHUNKSIZE) ?
       RPN_CHUNKSIZE : Input[0].length - voxels_moved;
+    /* Each chunk draws its random numbers from its own stream, so the
+     * result does not depend on how chunks are divided among threads.
+     */
+    rpnSetRandomStream(re, rand_seed, voxels_moved/RPN_CHUNKSIZE);
     if (outfile_flg) {
       out_chunk= rpnRun(re, voxels_this_chunk, voxels_moved);
       if (!out_chunk) Abort("%s: execution error after %lld voxels: %s!\n",
 			    progname,voxels_moved,rpnGetErrorString(re));
       if (complex_flg) {
-	/* Real and imaginary values for an output voxel are in
-	 * first and second positions in the stack; out_chunk
-	 * actually points to the imaginary part.  Allocate a
-	 * buffer on the heap on the first pass through.
-	 */
+	/* Allocate a buffer on the heap on the first pass through. */
 	static double* obuf= NULL;
-	long i;
 	if (!obuf) {
 	  if (!(obuf= (double*)malloc(2*RPN_CHUNKSIZE*sizeof(double))))
 	    Abort("%s: unable to allocate %d bytes!\n",
 		  2*RPN_CHUNKSIZE*sizeof(double));
 	}
-	for (i=0; i<voxels_this_chunk; i++) {
-	  obuf[2*i]= *(out_chunk+i-RPN_CHUNKSIZE);
-	  obuf[2*i+1]= *(out_chunk+i);
-	}
+	copyResult(obuf, out_chunk, voxels_this_chunk);
 	mri_set_chunk(Output, chunkname, 2*voxels_this_chunk, 2*voxels_moved,
 		      MRI_DOUBLE, obuf);
       }
@@ -470,7 +649,6 @@ int main( int argc, char* argv[] )
 	Abort("%s: execution error after %lld voxels: %s!\n",
 	      progname,voxels_moved,rpnGetErrorString(re));
     }
-    voxels_moved += voxels_this_chunk;
   }
 
   /* Write and close data-sets */
@@ -73,6 +73,8 @@ static char* progname;
 static int verbose_flg= 0;
 static int debug= 0;
 static unsigned char **missing = NULL;
+static int nthreads= 1;
+static Smoother** smoothers= NULL; /* one per thread */
 
 static void safe_copy(char* str1, const char* str2) {
   strncpy(str1, str2, KEYBUF_SIZE);
@@ -122,108 +124,213 @@ static void calc_sizes(const char* this_chunk, const char* dimstr, const char li
   *slow_blocksize_out= slow_blocksize;
 }
 
+/* Blocks with fewer voxels than this are read several at a time */
+#define SLAB_VOXELS 4096
+/* Largest run of voxels handed to one SM_SMOOTH_TILE call */
+#define ITEM_VOXELS 1024
+
+typedef struct smooth_job_struct {
+  Smoother* smoother;
+  float* in;
+  float* out;
+  int n;
+  long stride;
+  unsigned char** miss;
+  const long* itemStart;
+  const int* itemLen;
+  const int* itemZ;
+  int first;  /* first item for this thread */
+  int nitems; /* items for this thread */
+} SmoothJob;
+
+static void run_smooth_job( SmoothJob* job )
+{
+  int j;
+
+  for (j=job->first; j<job->first+job->nitems; j++) {
+    long v0= job->itemStart[j];
+    SM_SMOOTH_TILE(job->smoother, job->in+v0, job->out+v0, job->n,
+		   job->itemLen[j], job->stride, job->miss, job->itemZ[j]);
+  }
+}
+
+static void smooth_worker( void* arg )
+{
+  run_smooth_job((SmoothJob*)arg);
+}
+
+static void smooth_items( SmoothJob* job, int nitems )
+{
+  int nt= (nthreads<nitems) ? nthreads : nitems;
+
+  job->first= 0;
+  job->nitems= nitems;
+  if (nt>1) {
+    SmoothJob* jobs;
+    int i;
+
+    if (!(jobs= (SmoothJob*)malloc(nt*sizeof(SmoothJob))))
+      Abort("%s: unable to allocate %ld bytes!\n",
+	    progname, nt*sizeof(SmoothJob));
+    for (i=0; i<nt; i++) {
+      jobs[i]= *job;
+      jobs[i].smoother= smoothers[i];
+      jobs[i].first= (int)fthr_share_start(nitems, nt, i);
+      jobs[i].nitems= (int)fthr_share_start(nitems, nt, i+1) - jobs[i].first;
+    }
+    fthr_run_jobs(jobs, nt, sizeof(SmoothJob), smooth_worker);
+    free(jobs);
+    return;
+  }
+  job->smoother= smoothers[0];
+  run_smooth_job(job);
+}
+
 static void transfer_data(char* this_chunk, 
 			  long long fast_blksize, long long slow_blksize, 
-			  int selected_extent, Smoother* smoother,
+			  int selected_extent,
 			  MissingCase missingCase, long long missingScale,
 			  long long missingMod)
 {
+  /* Each block of fast_blksize*selected_extent values holds
+   * fast_blksize series, with sample i of series ifast at 
+   * block[ifast + i*fast_blksize].  That is already the layout
+   * SM_SMOOTH_TILE wants.  If the blocks are small, a slab of several
+   * is read at once and transposed so that all of its series are
+   * adjacent.  The series are then split into items which share
+   * the same missing data index, and the items into shares for the
+   * threads.
+   */
+  long long collective_blksize= fast_blksize * selected_extent;
   long long in_offset= 0;
   long long out_offset= 0;
-  long long ifast;
+  long long slab= 1;
   long long islow;
-  long long i;
-  long long collective_blksize;
-  int type;
-  float* ibuf= NULL;
-  float* obuf= NULL;
-  float* oblock= NULL;
-
-  if (!(ibuf=(float*)malloc(selected_extent*sizeof(float))))
-    Abort("%s: unable to allocate %d bytes!\n",
-	  progname, selected_extent*sizeof(float));
-  if (!(obuf=(float*)malloc(selected_extent*sizeof(float))))
-    Abort("%s: unable to allocate %d bytes!\n",
-	  progname, selected_extent*sizeof(float));
-  if (!(oblock=(float*)malloc(fast_blksize*selected_extent*sizeof(float))))
-    Abort("%s: unable to allocate %d bytes!\n",
-	  progname, fast_blksize*selected_extent*sizeof(float));
-
-  collective_blksize= fast_blksize * selected_extent;
-  for (islow=0; islow<slow_blksize; islow++) {
-    float* block= mri_get_chunk(Input, this_chunk, collective_blksize,
+  long long maxvox;
+  float* tin= NULL;
+  float* tout= NULL;
+  float* oslab= NULL;
+  long* itemStart;
+  int* itemLen;
+  int* itemZ;
+  unsigned char** miss= (missingCase==MISSING_IGNORE) ? NULL : missing;
+
+  if (fast_blksize<SLAB_VOXELS) slab= SLAB_VOXELS/fast_blksize;
+  if (slab>slow_blksize) slab= slow_blksize;
+  maxvox= slab*fast_blksize;
+
+  if (!(oslab=(float*)malloc(maxvox*selected_extent*sizeof(float))))
+    Abort("%s: unable to allocate %lld bytes!\n",
+	  progname, maxvox*selected_extent*sizeof(float));
+  if (slab>1) {
+    if (!(tin=(float*)malloc(2*maxvox*selected_extent*sizeof(float))))
+      Abort("%s: unable to allocate %lld bytes!\n",
+	    progname, 2*maxvox*selected_extent*sizeof(float));
+    tout= tin + maxvox*selected_extent;
+  }
+  if (!(itemStart=(long*)malloc(maxvox*sizeof(long))))
+    Abort("%s: unable to allocate %lld bytes!\n",
+	  progname, maxvox*sizeof(long));
+  if (!(itemLen=(int*)malloc(maxvox*sizeof(int))))
+    Abort("%s: unable to allocate %lld bytes!\n",
+	  progname, maxvox*sizeof(int));
+  if (!(itemZ=(int*)malloc(maxvox*sizeof(int))))
+    Abort("%s: unable to allocate %lld bytes!\n",
+	  progname, maxvox*sizeof(int));
+
+  for (islow=0; islow<slow_blksize; islow += slab) {
+    long long nblocks= (slow_blksize-islow<slab) ? slow_blksize-islow : slab;
+    long long nvox= nblocks*fast_blksize;
+    long long slabsize= nblocks*collective_blksize;
+    float* block= mri_get_chunk(Input, this_chunk, slabsize,
 				in_offset, MRI_FLOAT);
-    switch (missingCase) {
-    case MISSING_T_SIMPLE: 
-    case MISSING_Z_SIMPLE: 
-      {
-	for (ifast=0; ifast<fast_blksize; ifast++) {
-	  for (i=0; i<selected_extent; i++) 
-	    ibuf[i]= block[ifast + (i*fast_blksize)];
-	  SM_SMOOTH(smoother, ibuf, obuf, selected_extent, 
-		    missing, 0);
-	  for (i=0; i<selected_extent; i++)
-	    oblock[ifast + (i*fast_blksize)]= obuf[i];
-	}
-      }
-      break;
-    case MISSING_T_ZSLOW: 
-    case MISSING_Z_TSLOW: 
-      {
-	for (ifast=0; ifast<fast_blksize; ifast++) {
-	  for (i=0; i<selected_extent; i++) 
-	    ibuf[i]= block[ifast + (i*fast_blksize)];
-	  SM_SMOOTH(smoother, ibuf, obuf, selected_extent, 
-		    missing, (int)((islow/missingScale)%missingMod));
-	  for (i=0; i<selected_extent; i++)
-	    oblock[ifast + (i*fast_blksize)]= obuf[i];
-	}
-      }
-      break;
-    case MISSING_T_ZFAST: 
-    case MISSING_Z_TFAST: 
-      {
-	for (ifast=0; ifast<fast_blksize; ifast++) {
-	  for (i=0; i<selected_extent; i++) 
-	    ibuf[i]= block[ifast + (i*fast_blksize)];
-	  SM_SMOOTH(smoother, ibuf, obuf, selected_extent, 
-		    missing, (int)((ifast/missingScale)%missingMod));
-	  for (i=0; i<selected_extent; i++)
-	    oblock[ifast + (i*fast_blksize)]= obuf[i];
-	}
+    SmoothJob job;
+    long long b;
+    long long ifast;
+    long long i;
+    long long v;
+    int nitems= 0;
+
+    if (nblocks>1) {
+      for (b=0; b<nblocks; b++)
+	for (i=0; i<selected_extent; i++)
+	  memcpy(tin + i*nvox + b*fast_blksize, 
+		 block + b*collective_blksize + i*fast_blksize,
+		 fast_blksize*sizeof(float));
+      job.in= tin;
+      job.out= tout;
+    }
+    else {
+      job.in= block;
+      job.out= oslab;
+    }
+    /* Samples for which there is no valid input pass through */
+    memcpy(job.out, job.in, slabsize*sizeof(float));
+
+    for (v=0; v<nvox; v++) {
+      int z;
+      b= v/fast_blksize;
+      ifast= v%fast_blksize;
+      switch (missingCase) {
+      case MISSING_T_SIMPLE: 
+      case MISSING_Z_SIMPLE: 
+      case MISSING_IGNORE: 
+	z= 0;
+	break;
+      case MISSING_T_ZSLOW: 
+      case MISSING_Z_TSLOW: 
+	z= (int)(((islow+b)/missingScale)%missingMod);
+	break;
+      case MISSING_T_ZFAST: 
+      case MISSING_Z_TFAST: 
+	z= (int)((ifast/missingScale)%missingMod);
+	break;
+      default: 
+	Abort("%s: internal error; unknown missingCase %d!\n",
+	      progname,(int)missingCase);
       }
-      break;
-    case MISSING_IGNORE: 
-      {
-	for (ifast=0; ifast<fast_blksize; ifast++) {
-	  for (i=0; i<selected_extent; i++) 
-	    ibuf[i]= block[ifast + (i*fast_blksize)];
-	  SM_SMOOTH(smoother, ibuf, obuf, selected_extent, NULL, 0);
-	  for (i=0; i<selected_extent; i++)
-	    oblock[ifast + (i*fast_blksize)]= obuf[i];
-	}
+      if (nitems>0 && itemZ[nitems-1]==z && itemLen[nitems-1]<ITEM_VOXELS)
+	itemLen[nitems-1]++;
+      else {
+	itemStart[nitems]= (long)v;
+	itemLen[nitems]= 1;
+	itemZ[nitems]= z;
+	nitems++;
       }
-      break;
-    default: 
-      Abort("%s: internal error; unknown missingCase %d!\n",
-	    progname,(int)missingCase);
     }
-    mri_set_chunk( Output, this_chunk, collective_blksize, out_offset,
-		   MRI_FLOAT, oblock );
+
+    job.n= selected_extent;
+    job.stride= (long)nvox;
+    job.miss= miss;
+    job.itemStart= itemStart;
+    job.itemLen= itemLen;
+    job.itemZ= itemZ;
+    smooth_items(&job, nitems);
+
+    if (nblocks>1) {
+      for (b=0; b<nblocks; b++)
+	for (i=0; i<selected_extent; i++)
+	  memcpy(oslab + b*collective_blksize + i*fast_blksize,
+		 tout + i*nvox + b*fast_blksize,
+		 fast_blksize*sizeof(float));
+    }
+    mri_set_chunk( Output, this_chunk, slabsize, out_offset,
+		   MRI_FLOAT, oslab );
     if (debug) 
       fprintf(stderr,"block: %lld at %lld -> %lld at %lld\n",
-	      collective_blksize, in_offset,
-	      collective_blksize, out_offset);
-    in_offset += collective_blksize;
-    out_offset += collective_blksize;
+	      slabsize, in_offset, slabsize, out_offset);
+    in_offset += slabsize;
+    out_offset += slabsize;
   }
 
-  free(ibuf);
-  free(obuf);
-  free(oblock);
+  free(tin);
+  free(oslab);
+  free(itemStart);
+  free(itemLen);
+  free(itemZ);
 }
 
-static void smooth_chunk(char* this_chunk, Smoother* smoother) {
+static void smooth_chunk(char* this_chunk) {
   char key_buf[KEYBUF_SIZE];
   char* dimstr;
   int selected_extent;
@@ -303,7 +410,7 @@ static void smooth_chunk(char* this_chunk, Smoother* smoother) {
 	safe_concat(key_buf, ".type");
 	mri_set_string(Output, key_buf, "float32");
 	transfer_data(this_chunk, fast_blksize, slow_blksize, 
-		      selected_extent, smoother, missingCase, missingScale, missingMod);
+		      selected_extent, missingCase, missingScale, missingMod);
       }
     }
     else {
@@ -317,10 +424,10 @@ int main( int argc, char* argv[] )
   char infile[512], outfile[512], kernel[512];
   char* this_key;
   char this_chunk[KEYBUF_SIZE];
-  Smoother* smoother;
   sm_type smoother_type;
   float bandwidth;
   float threshold;
+  int i;
 
   progname= argv[0];
 
@@ -351,6 +458,8 @@ int main( int argc, char* argv[] )
 
   verbose_flg= cl_present("verbose|ver|v");
   debug= cl_present("debug");
+  if (cl_get("threads","%option %d",&nthreads))
+    nthreads= fthr_count(argv[0], nthreads);
 
   cl_get( "bandwidth|bdw", "%option %f[%]", 3.0, &bandwidth );
   cl_get( "kernel|ker", "%option %s[%]", "gaussian", kernel );
@@ -416,9 +525,14 @@ int main( int argc, char* argv[] )
   Output = mri_copy_dataset( outfile, Input );
   hist_add_cl( Output, argc, argv );
 
-  /* Create the smoother */
-  smoother= sm_create_smoother();
-  sm_set_direction(smoother,*selected_dim);
+  /* Create the smoothers; each thread needs its own */
+  if (!(smoothers=(Smoother**)malloc(nthreads*sizeof(Smoother*))))
+    Abort("%s: unable to allocate %d bytes!\n",
+	  argv[0], nthreads*sizeof(Smoother*));
+  for (i=0; i<nthreads; i++) {
+    smoothers[i]= sm_create_smoother();
+    sm_set_direction(smoothers[i],*selected_dim);
+  }
 
   /* Import missing information if appropriate */
   if (*selected_dim=='t' || *selected_dim=='z') {
@@ -438,7 +552,7 @@ int main( int argc, char* argv[] )
       strncpy(this_chunk, this_key, KEYBUF_SIZE);
       this_chunk[KEYBUF_SIZE-1]= '\0';
       if (strcmp(this_chunk,"missing")) /* don't smooth missing chunk! */
-	smooth_chunk(this_chunk, smoother);
+	smooth_chunk(this_chunk);
     }
   }
 
@@ -447,7 +561,8 @@ int main( int argc, char* argv[] )
   mri_close_dataset( Output );
   
   /* Clean up */
-  sm_destroy(smoother);
+  for (i=0; i<nthreads; i++) sm_destroy(smoothers[i]);
+  free(smoothers);
 
   if (verbose_flg) Message( "#      Smoothing complete.\n" );
   if (!data_changed) 
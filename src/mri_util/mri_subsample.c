@@ -150,20 +150,7 @@ static void calc_sizes(char* this_chunk, char* dimstr, char* selected,
   *slow_blocksize_out= slow_blocksize;
 }
 
-#define DEF_COMPARATOR( type ) \
-static int compare_ ## type ( const void* p1, const void* p2 ) \
-{ type v1= *(type*)p1; type v2= *(type*)p2; \
-  if (v1<v2) return -1; else if (v1==v2) return 0; else return 1; }
-
-DEF_COMPARATOR( uchar )
-DEF_COMPARATOR( short )
-DEF_COMPARATOR( int )
-DEF_COMPARATOR( float )
-DEF_COMPARATOR( double )
-
-#undef DEF_COMPARATOR
-
-#define MAKEIQR( type, compar ) { \
+#define MAKEIQR( type, select ) { \
 type* in= ibuf; type* out= obuf; unsigned char* m=mbuf; type* s; \
 in += obase*stride; m += obase*stride; \
 for (j=0; j<stride; j++) { \
@@ -174,8 +161,8 @@ for (j=0; j<stride; j++) { \
   } \
   howmany= (s-(type*)sortbuf); \
   if (howmany>1) { \
-    qsort( sortbuf, howmany, sizeof(type), compar ); \
-    out[j]= ((type*)sortbuf)[(3*howmany)/4] - ((type*)sortbuf)[(howmany)/4]; \
+    type q3= select( (type*)sortbuf, howmany, (3*howmany)/4 ); \
+    out[j]= q3 - select( (type*)sortbuf, (3*howmany)/4, howmany/4 ); \
   } \
   else { \
     out[j]= 0; \
@@ -191,12 +178,12 @@ static void subsample_iqr( void* obuf, void* ibuf, unsigned char* mbuf,
   int howmany;
 
   switch (type) {
-  case MRI_UNSIGNED_CHAR: MAKEIQR(unsigned char, compare_uchar); break;
-  case MRI_SHORT: MAKEIQR(short, compare_short); break;
-  case MRI_INT: MAKEIQR(int, compare_int); break;
-  case MRI_LONGLONG: MAKEIQR(long long, compare_int); break;
-  case MRI_FLOAT: MAKEIQR(float, compare_float); break;
-  case MRI_DOUBLE: MAKEIQR(double, compare_double); break;
+  case MRI_UNSIGNED_CHAR: MAKEIQR(unsigned char, os_select_uchar); break;
+  case MRI_SHORT: MAKEIQR(short, os_select_short); break;
+  case MRI_INT: MAKEIQR(int, os_select_int); break;
+  case MRI_LONGLONG: MAKEIQR(long long, os_select_longlong); break;
+  case MRI_FLOAT: MAKEIQR(float, os_select_float); break;
+  case MRI_DOUBLE: MAKEIQR(double, os_select_double); break;
   default:
     Abort("%s: switching on type: unrecognized type %d!\n",progname,type);
   }
@@ -204,7 +191,7 @@ static void subsample_iqr( void* obuf, void* ibuf, unsigned char* mbuf,
 
 #undef MAKEIQR
 
-#define PICKSORTED( type, compar, numerator, denominator ) { \
+#define PICKSORTED( type, select, numerator, denominator ) { \
 type* in= ibuf; type* out= obuf; unsigned char* m=mbuf; type* s; \
 in += obase*stride; m += obase*stride; \
 for (j=0; j<stride; j++) { \
@@ -215,8 +202,8 @@ for (j=0; j<stride; j++) { \
   } \
   howmany= (s-(type*)sortbuf); \
   if (howmany>0) { \
-    qsort( sortbuf, howmany, sizeof(type), compar ); \
-    out[j]= ((type*)sortbuf)[(numerator*howmany)/denominator]; \
+    out[j]= select( (type*)sortbuf, howmany, \
+		    (numerator*howmany)/denominator ); \
   } \
   else { \
     out[j]= in[j]; \
@@ -232,12 +219,13 @@ static void subsample_median( void* obuf, void* ibuf, unsigned char* mbuf,
   int howmany;
 
   switch (type) {
-  case MRI_UNSIGNED_CHAR: PICKSORTED(unsigned char, compare_uchar, 1, 2); break;
-  case MRI_SHORT: PICKSORTED(short, compare_short, 1, 2); break;
-  case MRI_INT: PICKSORTED(int, compare_int, 1, 2); break;
-  case MRI_LONGLONG: PICKSORTED(long long, compare_int, 1, 2); break;
-  case MRI_FLOAT: PICKSORTED(float, compare_float, 1, 2); break;
-  case MRI_DOUBLE: PICKSORTED(double, compare_double, 1, 2); break;
+  case MRI_UNSIGNED_CHAR:
+    PICKSORTED(unsigned char, os_select_uchar, 1, 2); break;
+  case MRI_SHORT: PICKSORTED(short, os_select_short, 1, 2); break;
+  case MRI_INT: PICKSORTED(int, os_select_int, 1, 2); break;
+  case MRI_LONGLONG: PICKSORTED(long long, os_select_longlong, 1, 2); break;
+  case MRI_FLOAT: PICKSORTED(float, os_select_float, 1, 2); break;
+  case MRI_DOUBLE: PICKSORTED(double, os_select_double, 1, 2); break;
   default:
     Abort("%s: switching on type: unrecognized type %d!\n",progname,type);
   }
@@ -252,12 +240,13 @@ static void subsample_q1( void* obuf, void* ibuf, unsigned char* mbuf,
   int howmany;
 
   switch (type) {
-  case MRI_UNSIGNED_CHAR: PICKSORTED(unsigned char, compare_uchar, 1, 4); break;
-  case MRI_SHORT: PICKSORTED(short, compare_short, 1, 4); break;
-  case MRI_INT: PICKSORTED(int, compare_int, 1, 4); break;
-  case MRI_LONGLONG: PICKSORTED(long long, compare_int, 1, 4); break;
-  case MRI_FLOAT: PICKSORTED(float, compare_float, 1, 4); break;
-  case MRI_DOUBLE: PICKSORTED(double, compare_double, 1, 4); break;
+  case MRI_UNSIGNED_CHAR:
+    PICKSORTED(unsigned char, os_select_uchar, 1, 4); break;
+  case MRI_SHORT: PICKSORTED(short, os_select_short, 1, 4); break;
+  case MRI_INT: PICKSORTED(int, os_select_int, 1, 4); break;
+  case MRI_LONGLONG: PICKSORTED(long long, os_select_longlong, 1, 4); break;
+  case MRI_FLOAT: PICKSORTED(float, os_select_float, 1, 4); break;
+  case MRI_DOUBLE: PICKSORTED(double, os_select_double, 1, 4); break;
   default:
     Abort("%s: switching on type: unrecognized type %d!\n",progname,type);
   }
@@ -272,12 +261,13 @@ static void subsample_q3( void* obuf, void* ibuf, unsigned char* mbuf,
   int howmany;
 
   switch (type) {
-  case MRI_UNSIGNED_CHAR: PICKSORTED(unsigned char, compare_uchar, 3, 4); break;
-  case MRI_SHORT: PICKSORTED(short, compare_short, 3, 4); break;
-  case MRI_INT: PICKSORTED(int, compare_int, 3, 4); break;
-  case MRI_LONGLONG: PICKSORTED(long long, compare_int, 3, 4); break;
-  case MRI_FLOAT: PICKSORTED(float, compare_float, 3, 4); break;
-  case MRI_DOUBLE: PICKSORTED(double, compare_double, 3, 4); break;
+  case MRI_UNSIGNED_CHAR:
+    PICKSORTED(unsigned char, os_select_uchar, 3, 4); break;
+  case MRI_SHORT: PICKSORTED(short, os_select_short, 3, 4); break;
+  case MRI_INT: PICKSORTED(int, os_select_int, 3, 4); break;
+  case MRI_LONGLONG: PICKSORTED(long long, os_select_longlong, 3, 4); break;
+  case MRI_FLOAT: PICKSORTED(float, os_select_float, 3, 4); break;
+  case MRI_DOUBLE: PICKSORTED(double, os_select_double, 3, 4); break;
   default:
     Abort("%s: switching on type: unrecognized type %d!\n",progname,type);
   }
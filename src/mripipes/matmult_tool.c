@@ -33,11 +33,23 @@
 
 /***********************
  * Notes-
+ * -When the right matrix for a foreach entry fits in memory, each
+ *  output block covers many left_slow slices.  They are read in one
+ *  piece and multiplied together by batch_matmult(), which uses the
+ *  arena's thread count.  The last block of a foreach entry may be
+ *  short, so obufFill rather than obufSize says how much is valid.
+ * -Batching only pays when it saves GEMM calls or can be threaded.
+ *  For a fast block of BATCH_PACK_MAX_FAST or more, batch_matmult
+ *  does one GEMM per slice anyway, and run serially its multi-megabyte
+ *  output block just falls out of cache.  Those cases use
+ *  mult_leftsmall_accumsmall_preread instead, which gives the same
+ *  bits.  pipeline_bench times both methods.
  **********************/
 
 static char rcsid[] = "$Id: matmult_tool.c,v 1.8 2005/08/09 23:11:06 welling Exp $"; 
 
 #define MAX_AT_ONCE (64*1024*1024)
+#define BATCH_AT_ONCE (1024*1024)
 
 /* Some abbreviations for convenience */
 #define LEFT_IN(self) (self->sinkArray[0]->source)
@@ -56,10 +68,13 @@ typedef struct mm_data_struct {
   long long leftPrevOffset;
   long long rightPrevOffset;
   long leftInbufSize;
-  double* leftInbuf;
+  double* leftInbuf; /* borrowed from leftBlock; read only */
+  CachedBlock* leftBlock;
   long rightInbufSize;
-  double* rightInbuf;
+  double* rightInbuf; /* borrowed from rightBlock; read only */
+  CachedBlock* rightBlock;
   long obufSize;
+  long obufFill; /* valid values in obuf */
   long long obufOffset;
   int obufValid;
   double* obuf;
@@ -130,8 +145,9 @@ static void mult_general(Tool* self, long long outOffset)
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from right at %lld\n", 
 	      self->typeName,data->rightInbufSize,right_base_offset);
-    forceGetAllFloat64(RIGHT_IN(self), data->rightInbufSize, 
-		       right_base_offset, data->rightInbuf);
+    data->rightInbuf= (double*)
+      borrowAllFloat64(RIGHT_IN(self), data->rightInbufSize,
+		       right_base_offset, &(data->rightBlock));
     data->rightPrevOffset= right_base_offset;
   }
   for (left_fast=0; left_fast<data->left_fast_blksize; left_fast++)
@@ -142,8 +158,9 @@ static void mult_general(Tool* self, long long outOffset)
       if (self->debug)
 	fprintf(stderr,"%s: Reading %d from left at %lld\n",self->typeName,
 		data->leftInbufSize, left_offset);
-      forceGetAllFloat64(LEFT_IN(self), data->leftInbufSize, left_offset,
-			 data->leftInbuf);
+      data->leftInbuf= (double*)
+	borrowAllFloat64(LEFT_IN(self), data->leftInbufSize,
+			 left_offset, &(data->leftBlock));
       data->leftPrevOffset= left_offset;
     }
     for (left_fast=0; left_fast<data->left_fast_blksize; left_fast++) {
@@ -178,8 +195,9 @@ static void mult_general_preread(Tool* self, long long outOffset)
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from right at %lld\n", 
 	      self->typeName,data->rightInbufSize,right_base_offset);
-    forceGetAllFloat64(RIGHT_IN(self), data->rightInbufSize, 
-		       right_base_offset, data->rightInbuf);
+    data->rightInbuf= (double*)
+      borrowAllFloat64(RIGHT_IN(self), data->rightInbufSize,
+		       right_base_offset, &(data->rightBlock));
     data->rightPrevOffset= right_base_offset;
   }
   for (left_fast=0; left_fast<data->left_fast_blksize; left_fast++)
@@ -190,8 +208,9 @@ static void mult_general_preread(Tool* self, long long outOffset)
       if (self->debug)
 	fprintf(stderr,"%s: Reading %d from left at %lld\n",self->typeName,
 		data->leftInbufSize, left_offset);
-      forceGetAllFloat64(LEFT_IN(self), data->leftInbufSize, left_offset,
-			 data->leftInbuf);
+      data->leftInbuf= (double*)
+	borrowAllFloat64(LEFT_IN(self), data->leftInbufSize,
+			 left_offset, &(data->leftBlock));
       data->leftPrevOffset= left_offset;
     }
     for (left_fast=0; left_fast<data->left_fast_blksize; left_fast++) {
@@ -223,16 +242,18 @@ static void mult_leftsmall(Tool* self, long long outOffset)
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from left at %lld\n",self->typeName,
 	      data->leftInbufSize, left_base_offset);
-    forceGetAllFloat64(LEFT_IN(self), data->leftInbufSize, left_base_offset,
-		       data->leftInbuf);
+    data->leftInbuf= (double*)
+      borrowAllFloat64(LEFT_IN(self), data->leftInbufSize,
+		       left_base_offset, &(data->leftBlock));
     data->leftPrevOffset= left_base_offset;
   }
   if (right_base_offset != data->rightPrevOffset) {
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from right at %lld\n", 
 	      self->typeName,data->rightInbufSize,right_base_offset);
-    forceGetAllFloat64(RIGHT_IN(self), data->rightInbufSize, 
-		       right_base_offset, data->rightInbuf);
+    data->rightInbuf= (double*)
+      borrowAllFloat64(RIGHT_IN(self), data->rightInbufSize,
+		       right_base_offset, &(data->rightBlock));
     data->rightPrevOffset= right_base_offset;
   }
   for (left_fast=0; left_fast<data->left_fast_blksize; left_fast++)
@@ -269,16 +290,18 @@ static void mult_leftsmall_preread(Tool* self, long long outOffset)
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from left at %lld\n",self->typeName,
 	      data->leftInbufSize, left_base_offset);
-    forceGetAllFloat64(LEFT_IN(self), data->leftInbufSize, left_base_offset,
-		       data->leftInbuf);
+    data->leftInbuf= (double*)
+      borrowAllFloat64(LEFT_IN(self), data->leftInbufSize,
+		       left_base_offset, &(data->leftBlock));
     data->leftPrevOffset= left_base_offset;
   }
   if (right_base_offset != data->rightPrevOffset) {
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from right at %lld\n", 
 	      self->typeName,data->rightInbufSize,right_base_offset);
-    forceGetAllFloat64(RIGHT_IN(self), data->rightInbufSize, 
-		       right_base_offset, data->rightInbuf);
+    data->rightInbuf= (double*)
+      borrowAllFloat64(RIGHT_IN(self), data->rightInbufSize,
+		       right_base_offset, &(data->rightBlock));
     data->rightPrevOffset= right_base_offset;
   }
   for (left_fast=0; left_fast<data->left_fast_blksize; left_fast++) {
@@ -322,8 +345,9 @@ static void mult_leftsmall_accumsmall(Tool* self, long long outOffset)
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from left at %lld\n",self->typeName,
 	      data->leftInbufSize, left_base_offset);
-    forceGetAllFloat64(LEFT_IN(self), data->leftInbufSize, left_base_offset,
-		       data->leftInbuf);
+    data->leftInbuf= (double*)
+      borrowAllFloat64(LEFT_IN(self), data->leftInbufSize,
+		       left_base_offset, &(data->leftBlock));
     data->leftPrevOffset= left_base_offset;
   }
   right_offset= right_base_offset;
@@ -333,8 +357,9 @@ static void mult_leftsmall_accumsmall(Tool* self, long long outOffset)
       if (self->debug)
 	fprintf(stderr,"%s: Reading %d from right at %lld\n", 
 		self->typeName,data->summed_extent,right_offset);
-      forceGetAllFloat64(RIGHT_IN(self), data->rightInbufSize, 
-			 right_offset, data->rightInbuf);
+      data->rightInbuf= (double*)
+	borrowAllFloat64(RIGHT_IN(self), data->rightInbufSize,
+			 right_offset, &(data->rightBlock));
       data->rightPrevOffset= right_offset;
     }
     DGEMV( "n", &lfb, &se, 
@@ -373,16 +398,18 @@ static void mult_leftsmall_accumsmall_preread(Tool* self, long long outOffset)
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from left at %lld\n", self->typeName,
 	      data->leftInbufSize, left_base_offset);
-    forceGetAllFloat64(LEFT_IN(self), data->leftInbufSize,
-		       left_base_offset, data->leftInbuf);
+    data->leftInbuf= (double*)
+      borrowAllFloat64(LEFT_IN(self), data->leftInbufSize,
+		       left_base_offset, &(data->leftBlock));
     data->leftPrevOffset= left_base_offset;
   }
   if (right_base_offset != data->rightPrevOffset) {
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from right at %lld\n", 
 	      self->typeName,data->rightInbufSize,right_base_offset);
-    forceGetAllFloat64(RIGHT_IN(self), data->rightInbufSize,
-		       right_base_offset, data->rightInbuf);
+    data->rightInbuf= (double*)
+      borrowAllFloat64(RIGHT_IN(self), data->rightInbufSize,
+		       right_base_offset, &(data->rightBlock));
     data->rightPrevOffset= right_base_offset;
   }
 
@@ -398,6 +425,50 @@ static void mult_leftsmall_accumsmall_preread(Tool* self, long long outOffset)
 	    self->typeName,outOffset, data->obufSize);
 }
 
+static void mult_batched(Tool* self, long long outOffset)
+{
+  MMData* data= (MMData*)self->hook;
+  long long left_base_offset;
+  long long right_base_offset;
+  long nslices= 
+    data->obufFill/(data->left_fast_blksize*data->right_slow_blksize);
+  long fast= (data->complexFlag ? 
+	      data->left_fast_blksize/2 : data->left_fast_blksize);
+
+  if (self->debug) 
+    fprintf(stderr,"%s: Batched method used.\n", self->typeName);
+  
+  decomposeOffset(self, outOffset, &left_base_offset, &right_base_offset);
+  if (left_base_offset != data->leftPrevOffset) {
+    long leftSize= nslices*data->left_fast_blksize*data->summed_extent;
+    if (self->debug)
+      fprintf(stderr,"%s: Reading %ld from left at %lld\n", self->typeName,
+	      leftSize, left_base_offset);
+    data->leftInbuf= (double*)
+      borrowAllFloat64(LEFT_IN(self), leftSize,
+		       left_base_offset, &(data->leftBlock));
+    data->leftPrevOffset= left_base_offset;
+  }
+  if (right_base_offset != data->rightPrevOffset) {
+    if (self->debug)
+      fprintf(stderr,"%s: Reading %d from right at %lld\n", 
+	      self->typeName,data->rightInbufSize,right_base_offset);
+    data->rightInbuf= (double*)
+      borrowAllFloat64(RIGHT_IN(self), data->rightInbufSize,
+		       right_base_offset, &(data->rightBlock));
+    data->rightPrevOffset= right_base_offset;
+  }
+
+  batch_matmult(data->leftInbuf, data->rightInbuf, data->obuf, nslices,
+		fast, data->summed_extent, data->right_slow_blksize,
+		nslices, data->complexFlag,
+		(self->owner->threads<0) ? 1 : self->owner->threads);
+  data->obufValid= 1;
+  if (self->debug) 
+    fprintf(stderr,"%s: Writing block to %lld (size %ld)\n",
+	    self->typeName,outOffset, data->obufFill);
+}
+
 static void mult_general_complex(Tool* self, long long outOffset)
 {
   MMData* data= (MMData*)self->hook;
@@ -415,8 +486,9 @@ static void mult_general_complex(Tool* self, long long outOffset)
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from right at %lld\n", 
 	      self->typeName,data->rightInbufSize,right_base_offset);
-    forceGetAllFloat64(RIGHT_IN(self), data->rightInbufSize, 
-		       right_base_offset, data->rightInbuf);
+    data->rightInbuf= (double*)
+      borrowAllFloat64(RIGHT_IN(self), data->rightInbufSize,
+		       right_base_offset, &(data->rightBlock));
     data->rightPrevOffset= right_base_offset;
   }
   for (left_fast=0; left_fast<data->left_fast_blksize; left_fast += 2) {
@@ -429,8 +501,9 @@ static void mult_general_complex(Tool* self, long long outOffset)
       if (self->debug)
 	fprintf(stderr,"%s: Reading %d from left at %lld\n",self->typeName,
 		data->leftInbufSize, left_offset);
-      forceGetAllFloat64(LEFT_IN(self), data->leftInbufSize, left_offset,
-			 data->leftInbuf);
+      data->leftInbuf= (double*)
+	borrowAllFloat64(LEFT_IN(self), data->leftInbufSize,
+			 left_offset, &(data->leftBlock));
       data->leftPrevOffset= left_offset;
     }
     for (left_fast=0; left_fast<data->left_fast_blksize; left_fast += 2) {
@@ -467,8 +540,9 @@ static void mult_general_preread_complex(Tool* self, long long outOffset)
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from right at %lld\n", 
 	      self->typeName,data->rightInbufSize,right_base_offset);
-    forceGetAllFloat64(RIGHT_IN(self), data->rightInbufSize, 
-		       right_base_offset, data->rightInbuf);
+    data->rightInbuf= (double*)
+      borrowAllFloat64(RIGHT_IN(self), data->rightInbufSize,
+		       right_base_offset, &(data->rightBlock));
     data->rightPrevOffset= right_base_offset;
   }
   left_offset= left_base_offset;
@@ -483,8 +557,9 @@ static void mult_general_preread_complex(Tool* self, long long outOffset)
       if (self->debug)
 	fprintf(stderr,"%s: Reading %d from left at %lld\n",self->typeName,
 		data->leftInbufSize, left_offset);
-      forceGetAllFloat64(LEFT_IN(self), data->leftInbufSize, left_offset,
-			 data->leftInbuf);
+      data->leftInbuf= (double*)
+	borrowAllFloat64(LEFT_IN(self), data->leftInbufSize,
+			 left_offset, &(data->leftBlock));
       data->leftPrevOffset= left_offset;
     }
     for (left_fast=0; left_fast<data->left_fast_blksize; left_fast += 2) {
@@ -517,16 +592,18 @@ static void mult_leftsmall_complex(Tool* self, long long outOffset)
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from left at %lld\n",self->typeName,
 	      data->leftInbufSize, left_base_offset);
-    forceGetAllFloat64(LEFT_IN(self), data->leftInbufSize, left_base_offset,
-		       data->leftInbuf);
+    data->leftInbuf= (double*)
+      borrowAllFloat64(LEFT_IN(self), data->leftInbufSize,
+		       left_base_offset, &(data->leftBlock));
     data->leftPrevOffset= left_base_offset;
   }
   if (right_base_offset != data->rightPrevOffset) {
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from right at %lld\n", 
 	      self->typeName,data->rightInbufSize,right_base_offset);
-    forceGetAllFloat64(RIGHT_IN(self), data->rightInbufSize, 
-		       right_base_offset, data->rightInbuf);
+    data->rightInbuf= (double*)
+      borrowAllFloat64(RIGHT_IN(self), data->rightInbufSize,
+		       right_base_offset, &(data->rightBlock));
     data->rightPrevOffset= right_base_offset;
   }
   for (left_fast=0; left_fast<data->left_fast_blksize; left_fast += 2) {
@@ -567,16 +644,18 @@ static void mult_leftsmall_preread_complex(Tool* self, long long outOffset)
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from left at %lld\n",self->typeName,
 	      data->leftInbufSize, left_base_offset);
-    forceGetAllFloat64(LEFT_IN(self), data->leftInbufSize, left_base_offset,
-		       data->leftInbuf);
+    data->leftInbuf= (double*)
+      borrowAllFloat64(LEFT_IN(self), data->leftInbufSize,
+		       left_base_offset, &(data->leftBlock));
     data->leftPrevOffset= left_base_offset;
   }
   if (right_base_offset != data->rightPrevOffset) {
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from right at %lld\n", 
 	      self->typeName,data->rightInbufSize,right_base_offset);
-    forceGetAllFloat64(RIGHT_IN(self), data->rightInbufSize, 
-		       right_base_offset, data->rightInbuf);
+    data->rightInbuf= (double*)
+      borrowAllFloat64(RIGHT_IN(self), data->rightInbufSize,
+		       right_base_offset, &(data->rightBlock));
     data->rightPrevOffset= right_base_offset;
   }
   for (left_fast=0; left_fast<data->left_fast_blksize; left_fast += 2) {
@@ -624,8 +703,9 @@ static void mult_leftsmall_accumsmall_complex(Tool* self, long long outOffset)
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from left at %lld\n",self->typeName,
 	      data->leftInbufSize, left_base_offset);
-    forceGetAllFloat64(LEFT_IN(self), data->leftInbufSize, left_base_offset,
-		       data->leftInbuf);
+    data->leftInbuf= (double*)
+      borrowAllFloat64(LEFT_IN(self), data->leftInbufSize,
+		       left_base_offset, &(data->leftBlock));
     data->leftPrevOffset= left_base_offset;
   }
   right_offset= right_base_offset;
@@ -635,8 +715,9 @@ static void mult_leftsmall_accumsmall_complex(Tool* self, long long outOffset)
       if (self->debug)
 	fprintf(stderr,"%s: Reading %d from right at %lld\n", 
 		self->typeName,data->rightInbufSize,right_offset);
-      forceGetAllFloat64(RIGHT_IN(self), data->rightInbufSize, 
-			 right_offset, data->rightInbuf);
+      data->rightInbuf= (double*)
+	borrowAllFloat64(RIGHT_IN(self), data->rightInbufSize,
+			 right_offset, &(data->rightBlock));
       data->rightPrevOffset= right_offset;
     }
     ZGEMV( "n", &hlfb, &se, 
@@ -676,16 +757,18 @@ static void mult_leftsmall_accumsmall_preread_complex(Tool* self,
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from left at %lld\n", self->typeName,
 	      data->leftInbufSize, left_base_offset);
-    forceGetAllFloat64(LEFT_IN(self), data->leftInbufSize,
-		       left_base_offset, data->leftInbuf);
+    data->leftInbuf= (double*)
+      borrowAllFloat64(LEFT_IN(self), data->leftInbufSize,
+		       left_base_offset, &(data->leftBlock));
     data->leftPrevOffset= left_base_offset;
   }
   if (right_base_offset != data->rightPrevOffset) {
     if (self->debug)
       fprintf(stderr,"%s: Reading %d from right at %lld\n", 
 	      self->typeName,data->rightInbufSize,right_base_offset);
-    forceGetAllFloat64(RIGHT_IN(self), data->rightInbufSize,
-		       right_base_offset, data->rightInbuf);
+    data->rightInbuf= (double*)
+      borrowAllFloat64(RIGHT_IN(self), data->rightInbufSize,
+		       right_base_offset, &(data->rightBlock));
     data->rightPrevOffset= right_base_offset;
   }
 
@@ -898,6 +981,29 @@ static int structureCheck( Tool* self, DataSource* Left, DataSource* Right,
   return 1;
 }
 
+static long batchSlices(Tool* self)
+{
+  /* How many left_slow slices to do at once in mult_batched */
+  MMData* data= (MMData*)self->hook;
+  long n= BATCH_AT_ONCE/(data->left_fast_blksize
+			 *(data->summed_extent+data->right_slow_blksize));
+  if (n<1) n= 1;
+  if (n>data->left_slow_blksize) n= data->left_slow_blksize;
+  return n;
+}
+
+static int batchPays(Tool* self)
+{
+  /* Is mult_batched worth it, or will one GEMM per slice do? */
+  MMData* data= (MMData*)self->hook;
+  long fast= (data->complexFlag ? 
+	      data->left_fast_blksize/2 : data->left_fast_blksize);
+  int nthreads= 
+    (self->owner->threads<0) ? 1 : fthr_count(self->typeName,
+					      self->owner->threads);
+  return (fast<BATCH_PACK_MAX_FAST || nthreads>1);
+}
+
 static int selectMultMethod(Tool* self)
 {
   MMData* data= (MMData*)self->hook;
@@ -918,7 +1024,14 @@ static int selectMultMethod(Tool* self)
 
       if (data->left_fast_blksize*data->right_slow_blksize <= MAX_AT_ONCE) {
 	accumSize= data->left_fast_blksize*data->right_slow_blksize;
-	if (preread) data->goMethod= mult_leftsmall_accumsmall_preread_complex;
+	if (preread && batchPays(self)) {
+	  long nslices= batchSlices(self);
+	  accumSize *= nslices;
+	  leftSize *= nslices;
+	  data->goMethod= mult_batched;
+	}
+	else if (preread) 
+	  data->goMethod= mult_leftsmall_accumsmall_preread_complex;
 	else data->goMethod= mult_leftsmall_accumsmall_complex;
       }
       else {
@@ -947,7 +1060,14 @@ static int selectMultMethod(Tool* self)
 
       if (data->left_fast_blksize*data->right_slow_blksize <= MAX_AT_ONCE) {
 	accumSize= data->left_fast_blksize*data->right_slow_blksize;
-	if (preread) data->goMethod= mult_leftsmall_accumsmall_preread;
+	if (preread && batchPays(self)) {
+	  long nslices= batchSlices(self);
+	  accumSize *= nslices;
+	  leftSize *= nslices;
+	  data->goMethod= mult_batched;
+	}
+	else if (preread) 
+	  data->goMethod= mult_leftsmall_accumsmall_preread;
 	else data->goMethod= mult_leftsmall_accumsmall;
       }
       else {
@@ -967,14 +1087,10 @@ static int selectMultMethod(Tool* self)
 
   if (!(data->obuf=(double*)malloc(accumSize*sizeof(double))))
     Abort("Unable to allocate %d bytes!\n",accumSize*sizeof(double));
-  data->obufSize= accumSize;
+  data->obufSize= data->obufFill= accumSize;
 
-  if (!(data->leftInbuf=(double*)malloc(leftSize*sizeof(double))))
-    Abort("Unable to allocate %d bytes!\n",leftSize*sizeof(double));
+  /* The input buffers are borrowed from the arena's block cache */
   data->leftInbufSize= leftSize;
-
-  if (!(data->rightInbuf=(double*)malloc(rightSize*sizeof(double))))
-    Abort("Unable to allocate %d bytes!\n",rightSize*sizeof(double));
   data->rightInbufSize= rightSize;
 
   return 1;
@@ -997,11 +1113,21 @@ static void fillBuffer(Tool* self, long long offset)
   MMData* data= (MMData*)self->hook;
   /* If data->obuf is invalid or contains non-applicable data, 
    * calculate the block base offset which is closest to the 
-   * requested offset and fill the obuf from that offset.
+   * requested offset and fill the obuf from that offset.  Blocks
+   * do not cross foreach entries, so the last one in an entry
+   * may be short.
    */
   if (!data->obufValid || offset<data->obufOffset 
-      || offset>=data->obufOffset+data->obufSize) {
-    long long blockBaseOffset= offset - (offset % data->obufSize);
+      || offset>=data->obufOffset+data->obufFill) {
+    long long entrySize= data->left_fast_blksize*data->right_slow_blksize
+      *data->left_slow_blksize;
+    long long entryBase= offset - (offset % entrySize);
+    long long entryEnd= entryBase + entrySize;
+    long long blockBaseOffset= 
+      offset - ((offset - entryBase) % data->obufSize);
+    if (entryEnd - blockBaseOffset < data->obufSize)
+      data->obufFill= (long)(entryEnd - blockBaseOffset);
+    else data->obufFill= data->obufSize;
     data->obufValid= 0;
     data->goMethod(self, blockBaseOffset);
     data->obufOffset= blockBaseOffset;
@@ -1022,7 +1148,7 @@ static long getFloat32Chunk(DataSource* self,
    * copy it to the output.
    */
   shift= (long)(offset - data->obufOffset);
-  if (size>data->obufSize-shift) n= data->obufSize-shift;
+  if (size>data->obufFill-shift) n= data->obufFill-shift;
   else n= size;
   for (i=0; i<n; i++) buf[i]= (float)data->obuf[i+shift];
   return n;
@@ -1042,7 +1168,7 @@ static long getFloat64Chunk(DataSource* self,
    * copy it to the output.
    */
   shift= (long)(offset - data->obufOffset);
-  if (size>data->obufSize-shift) n= data->obufSize-shift;
+  if (size>data->obufFill-shift) n= data->obufFill-shift;
   else n= size;
   for (i=0; i<n; i++) buf[i]= data->obuf[i+shift];
   return n;
@@ -1061,8 +1187,8 @@ static void destroySelf(Tool* self)
 {
   MMData* data= (MMData*)self->hook;
   if (data->foreachDims) free(data->foreachDims);
-  if (data->leftInbufSize) free(data->leftInbuf);
-  if (data->rightInbufSize) free(data->rightInbuf);
+  if (data->leftBlock) releaseBorrowedBlock(data->leftBlock);
+  if (data->rightBlock) releaseBorrowedBlock(data->rightBlock);
   if (data->obufSize) free(data->obuf);
   baseToolDestroySelf(self);
 }
@@ -1098,8 +1224,17 @@ static int init(Tool* self)
   else return 0;
   
   /* Choose buffer sizes and methods */
-  if (data->leftInbufSize) { free(data->leftInbuf); data->leftInbufSize= 0; }
-  if (data->rightInbufSize) { free(data->rightInbuf); data->rightInbufSize= 0;}
+  if (data->leftBlock) { 
+    releaseBorrowedBlock(data->leftBlock); 
+    data->leftBlock= NULL; 
+  }
+  if (data->rightBlock) { 
+    releaseBorrowedBlock(data->rightBlock); 
+    data->rightBlock= NULL; 
+  }
+  data->leftInbuf= data->rightInbuf= NULL;
+  data->leftInbufSize= data->rightInbufSize= 0;
+  data->leftPrevOffset= data->rightPrevOffset= -1;
   if (data->obufSize) { free(data->obuf); data->obufSize= 0; }
   if (!selectMultMethod(self)) return 0;
 
@@ -1120,13 +1255,16 @@ Tool* createMatmultTool(Arena* arena) {
     data->right_slow_blksize= data->foreach_blksize= 0;
   data->leftInbufSize= 0;
   data->leftInbuf= NULL;
+  data->leftBlock= NULL;
   data->rightInbufSize= 0;
   data->rightInbuf= NULL;
-  data->obufSize= 0;
+  data->rightBlock= NULL;
+  data->obufSize= data->obufFill= 0;
   data->obuf= NULL;
   data->obufValid= 0;
   data->goMethod= NULL;
   data->leftPrevOffset= data->rightPrevOffset= -1;
+  result->pDestroySelf= destroySelf;
   result->pInit= init;
   result->pAddSink( result, createMatmultLeftSink(result) );
   result->pAddSink( result, createMatmultRightSink(result) );
@@ -1149,9 +1287,11 @@ Tool* createComplexMatmultTool(Arena* arena) {
     data->right_slow_blksize= data->foreach_blksize= 0;
   data->leftInbufSize= 0;
   data->leftInbuf= NULL;
+  data->leftBlock= NULL;
   data->rightInbufSize= 0;
   data->rightInbuf= NULL;
-  data->obufSize= 0;
+  data->rightBlock= NULL;
+  data->obufSize= data->obufFill= 0;
   data->obuf= NULL;
   data->obufValid= 0;
   data->goMethod= NULL;
@@ -85,40 +85,50 @@ static long orphanGetFloat64Chunk(DataSource* self,
 static long getUInt8Chunk(DataSource* self, 
 			  long size, long long offset, char* buf )
 {
+  pipeLockLibmri();
   (void)mri_read_chunk(((FITdata*)(self->owner->hook))->ds,self->name,
 		       size, offset, MRI_UNSIGNED_CHAR, buf);
+  pipeUnlockLibmri();
   return size;
 }
 
 static long getInt16Chunk(DataSource* self, 
 			  long size, long long offset, short* buf )
 {
+  pipeLockLibmri();
   (void)mri_read_chunk(((FITdata*)(self->owner->hook))->ds,self->name,
 		       size, offset, MRI_SHORT, buf);
+  pipeUnlockLibmri();
   return size;
 }
 
 static long getInt32Chunk(DataSource* self, 
 			  long size, long long offset, int* buf )
 {
+  pipeLockLibmri();
   (void)mri_read_chunk(((FITdata*)(self->owner->hook))->ds,self->name,
 		       size, offset, MRI_INT, buf);
+  pipeUnlockLibmri();
   return size;
 }
 
 static long getInt64Chunk(DataSource* self, 
 			  long size, long long offset, long long* buf )
 {
+  pipeLockLibmri();
   (void)mri_read_chunk(((FITdata*)(self->owner->hook))->ds,self->name,
 		       size, offset, MRI_LONGLONG, buf);
+  pipeUnlockLibmri();
   return size;
 }
 
 static long getFloat32Chunk(DataSource* self, 
 			    long size, long long offset, float* buf )
 {
+  pipeLockLibmri();
   (void)mri_read_chunk(((FITdata*)(self->owner->hook))->ds,self->name,
 		       size, offset, MRI_FLOAT, buf);
+  pipeUnlockLibmri();
   return size;
 }
 
@@ -129,8 +139,10 @@ static long getFloat64Chunk(DataSource* self,
     fprintf(stderr,"read %ld MRI_DOUBLES from %lld, %s\n",
 	    size, offset, 
 	    ((FITdata*)(self->owner->hook))->fname);
+  pipeLockLibmri();
   (void)mri_read_chunk(((FITdata*)(self->owner->hook))->ds,self->name,
 		       size, offset, MRI_DOUBLE, buf);
+  pipeUnlockLibmri();
   return size;
 }
 
@@ -230,9 +230,11 @@ static int customExecute( Tool* self )
 					       (double*)data->obufArray[i]);
 	  break;
 	}
+	pipeLockLibmri();
 	mri_write_chunk(data->ds,sink->source->name,
 			nGot, data->offsetArray[i], 
 			data->typeArray[i], data->obufArray[i]);
+	pipeUnlockLibmri();
 	if (self->debug)
 	  fprintf(stderr,
 		  "MRIFileOutputTool: wrote %d at %lld, chunk %s type %s\n",
@@ -243,7 +245,9 @@ static int customExecute( Tool* self )
       }
     }
   }
+  pipeLockLibmri();
   mri_close_dataset(data->ds);
+  pipeUnlockLibmri();
   return 1;
 }
 
@@ -29,16 +29,156 @@
 #include <misc.h>
 #include <fexceptions.h>
 #include <mripipes.h>
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif
 
 static char rcsid[] = "$Id: mripipes.c,v 1.12 2007/06/21 23:26:51 welling Exp $";
 
 /*************
  * Notes-
+ * -When built with USE_PTHREAD and more than one thread is
+ *  available, arenaExecute() runs the network as a pipeline.  Each
+ *  connected source gets an edge which serializes calls into its
+ *  owning tool, so every tool still sees one caller at a time.  Up
+ *  to (threads-1) of those edges, nearest the drain first, also get
+ *  a worker thread which can read ahead into a short queue of
+ *  float32 or float64 blocks.  Requests are served by calling
+ *  upstream directly until PIPE_SEQUENTIAL_RUN of them in a row have
+ *  each continued the one before.  Only then does the worker start,
+ *  and its first fetch is the size of the last request, doubling up
+ *  to PIPE_BLOCKSIZE after that.  A request which does not continue
+ *  the stream stops the read-ahead and is again served directly, so
+ *  tools which jump around or re-read (subset and matmult, for
+ *  example) cost no more upstream work than they do serially.
+ * -Tools which may call back into Python ("block_map" and
+ *  "func2unblk") are only ever driven by the thread which called
+ *  execute, so no edge at or downstream of one gets a worker.
+ * -libmri is not reentrant; tools which call it bracket the calls
+ *  with pipeLockLibmri() and pipeUnlockLibmri().
+ * -Tools which read the same upstream range more than once (matmult
+ *  in particular) can use borrowAllFloat64() rather than
+ *  forceGetAllFloat64().  The borrowed block lives in an LRU cache
+ *  belonging to the Arena, so a repeated read is answered from
+ *  memory rather than by recalculating everything upstream, and
+ *  the tool needs no input buffer of its own.  The cache holds
+ *  cacheMB megabytes (64 unless MRIPIPES_CACHE_MB is set) and is
+ *  emptied at the start and end of each execute, since its contents
+ *  are only valid while the network stays the same.  A window too
+ *  big for the cache is read into a block belonging to the borrower
+ *  instead; that block is kept and grown as needed from one borrow
+ *  to the next, and freed by the final releaseBorrowedBlock().
  *************/
 
 #define SOURCE_ARRAY_LENGTH_INCR 10
 #define SINK_ARRAY_LENGTH_INCR 10
 
+#define DEFAULT_CACHE_MB 64
+#define CACHE_HASH_SIZE 1024
+#define CACHE_POOL_LENGTH 8
+
+struct cached_block_struct {
+  DataSource* src;
+  long long offset;
+  long size;
+  long capacity;
+  double* data;
+  int refCount;
+  int owned; /* one borrower's own block, too big for the cache */
+  struct block_cache_struct* cache; /* NULL if not in the cache */
+  struct cached_block_struct* hashNext;
+  struct cached_block_struct* lruPrev;
+  struct cached_block_struct* lruNext;
+};
+
+typedef struct block_cache_struct {
+  long long maxBytes;
+  long long nBytes;
+  CachedBlock* hash[CACHE_HASH_SIZE];
+  CachedBlock* lruHead; /* most recently used */
+  CachedBlock* lruTail;
+  int nPool;
+  CachedBlock* pool[CACHE_POOL_LENGTH]; /* evicted blocks kept for reuse */
+  long long nHits;
+  long long nMisses;
+#ifdef USE_PTHREAD
+  pthread_mutex_t mutex;
+#endif
+} BlockCache;
+
+#ifdef USE_PTHREAD
+#define CACHE_LOCK(c) pthread_mutex_lock(&((c)->mutex))
+#define CACHE_UNLOCK(c) pthread_mutex_unlock(&((c)->mutex))
+#else
+#define CACHE_LOCK(c)
+#define CACHE_UNLOCK(c)
+#endif
+
+#ifdef USE_PTHREAD
+
+#define PIPE_BLOCKSIZE (64*1024)
+#define PIPE_QUEUE_DEPTH 4
+#define PIPE_SEQUENTIAL_RUN 2 /* continuing requests before read-ahead */
+
+typedef struct tool_lock_struct {
+  Tool* tool;
+  pthread_mutex_t mutex;
+  int threadSafe; /* 0 if this tool or anything upstream calls Python */
+} ToolLock;
+
+typedef struct pipe_block_struct {
+  long long offset;
+  long n;
+  void* buf;
+} PipeBlock;
+
+typedef struct pipe_edge_struct {
+  DataSource* src;
+  ToolLock* lock;
+  long (*pGetUInt8Chunk)(DataSource* self, 
+			 long size, long long offset, char* buf );
+  long (*pGetInt16Chunk)(DataSource* self, 
+			 long size, long long offset, short* buf );
+  long (*pGetInt32Chunk)(DataSource* self, 
+			 long size, long long offset, int* buf );
+  long (*pGetInt64Chunk)(DataSource* self, 
+			 long size, long long offset, long long* buf );
+  long (*pGetFloat32Chunk)(DataSource* self, 
+			   long size, long long offset, float* buf );
+  long (*pGetFloat64Chunk)(DataSource* self, 
+			   long size, long long offset, double* buf );
+  int prefetch;
+  long long totalSize;
+  pthread_t thread;
+  int running;
+  int stop;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int active; /* the worker is reading ahead */
+  int type; /* MRI_FLOAT or MRI_DOUBLE */
+  long long nextOffset; /* where the worker reads next */
+  long fetchSize; /* how much the worker reads next */
+  int lastType; /* type of the last request served */
+  long long lastEnd; /* where the last request served ended */
+  int nSequential; /* requests in a row continuing the one before */
+  int generation; /* bumped when the read-ahead is restarted */
+  PipeBlock block[PIPE_QUEUE_DEPTH];
+  int head;
+  int count;
+  char* errorString;
+} PipeEdge;
+
+typedef struct pipe_threads_struct {
+  int nLocks;
+  ToolLock* locks;
+  int nEdges;
+  PipeEdge* edges;
+} PipeThreads;
+
+static pthread_mutex_t libmriMutex= PTHREAD_MUTEX_INITIALIZER;
+
+#endif
+
 static int baseSourceInit(DataSource* self)
 {
   self->initialized= 1;
@@ -320,9 +460,225 @@ static void arenaDestroyToolsInList(void* p)
   t->pDestroySelf(t);
 }
 
+static CachedBlock* createCachedBlock(long size)
+{
+  CachedBlock* b;
+  if (!(b=(CachedBlock*)malloc(sizeof(CachedBlock))))
+    Abort("Unable to allocate %d bytes!\n",sizeof(CachedBlock));
+  if (!(b->data=(double*)malloc(size*sizeof(double))))
+    Abort("Unable to allocate %d bytes!\n",size*sizeof(double));
+  b->capacity= size;
+  b->owned= 0;
+  b->cache= NULL;
+  b->hashNext= b->lruPrev= b->lruNext= NULL;
+  return b;
+}
+
+static void destroyCachedBlock(CachedBlock* b)
+{
+  free(b->data);
+  free(b);
+}
+
+static int cacheHash(DataSource* src, long long offset)
+{
+  unsigned long long h= 
+    (unsigned long long)(size_t)src ^ (offset*0x9E3779B97F4A7C15ULL);
+  return (int)((h ^ (h>>29)) % CACHE_HASH_SIZE);
+}
+
+static CachedBlock* cacheLookup(BlockCache* c, DataSource* src, long size,
+				long long offset)
+{
+  CachedBlock* b;
+  for (b=c->hash[cacheHash(src,offset)]; b; b=b->hashNext)
+    if (b->src==src && b->offset==offset && b->size>=size) return b;
+  return NULL;
+}
+
+static void cacheUnlinkLRU(BlockCache* c, CachedBlock* b)
+{
+  if (b->lruPrev) b->lruPrev->lruNext= b->lruNext;
+  else c->lruHead= b->lruNext;
+  if (b->lruNext) b->lruNext->lruPrev= b->lruPrev;
+  else c->lruTail= b->lruPrev;
+  b->lruPrev= b->lruNext= NULL;
+}
+
+static void cachePushLRU(BlockCache* c, CachedBlock* b)
+{
+  b->lruPrev= NULL;
+  b->lruNext= c->lruHead;
+  if (c->lruHead) c->lruHead->lruPrev= b;
+  else c->lruTail= b;
+  c->lruHead= b;
+}
+
+static void cacheRemove(BlockCache* c, CachedBlock* b)
+{
+  CachedBlock** here= &(c->hash[cacheHash(b->src,b->offset)]);
+  while (*here != b) here= &((*here)->hashNext);
+  *here= b->hashNext;
+  b->hashNext= NULL;
+  cacheUnlinkLRU(c,b);
+  c->nBytes -= b->capacity*sizeof(double);
+  b->cache= NULL;
+}
+
+/* Drop unreferenced blocks, oldest first, until the cache fits */
+static void cacheEvict(BlockCache* c)
+{
+  CachedBlock* b= c->lruTail;
+  while (b && c->nBytes>c->maxBytes) {
+    CachedBlock* prev= b->lruPrev;
+    if (!b->refCount) {
+      cacheRemove(c,b);
+      if (c->nPool<CACHE_POOL_LENGTH) c->pool[c->nPool++]= b;
+      else destroyCachedBlock(b);
+    }
+    b= prev;
+  }
+}
+
+/* Find a pooled block big enough to hold size values, if any */
+static CachedBlock* cacheTakeFromPool(BlockCache* c, long size)
+{
+  int i;
+  for (i=0; i<c->nPool; i++) {
+    if (c->pool[i]->capacity>=size) {
+      CachedBlock* b= c->pool[i];
+      c->pool[i]= c->pool[--(c->nPool)];
+      return b;
+    }
+  }
+  return NULL;
+}
+
+static void flushBlockCache(Arena* a)
+{
+  BlockCache* c= (BlockCache*)(a->blockCache);
+  int i;
+  if (!c) return;
+  CACHE_LOCK(c);
+  while (c->lruHead) {
+    CachedBlock* b= c->lruHead;
+    cacheRemove(c,b);
+    /* Blocks still on loan are freed when they are returned */
+    if (!b->refCount) destroyCachedBlock(b);
+  }
+  for (i=0; i<c->nPool; i++) destroyCachedBlock(c->pool[i]);
+  c->nPool= 0;
+  if (a->verbose && (c->nHits || c->nMisses))
+    Message("Block cache: %lld hits, %lld misses\n",c->nHits,c->nMisses);
+  c->nHits= c->nMisses= 0;
+  c->maxBytes= (long long)a->cacheMB*1024*1024;
+  CACHE_UNLOCK(c);
+}
+
+const double* borrowAllFloat64(DataSource* source, long size, 
+			       long long offset, CachedBlock** block)
+{
+  BlockCache* c= NULL;
+  CachedBlock* b= NULL;
+
+  if (source->owner && source->owner->owner)
+    c= (BlockCache*)(source->owner->owner->blockCache);
+  if (c && size*(long long)sizeof(double)>c->maxBytes) c= NULL;
+
+  if (!c) {
+    /* Too big to cache; read into the borrower's own block, growing it
+     * if need be, rather than allocating a fresh one every time.
+     */
+    if (*block && !(*block)->owned) {
+      releaseBorrowedBlock(*block);
+      *block= NULL;
+    }
+    if (!*block) {
+      *block= createCachedBlock(size);
+      (*block)->owned= 1;
+    }
+    b= *block;
+    if (b->capacity<size) {
+      free(b->data);
+      if (!(b->data=(double*)malloc(size*sizeof(double))))
+	Abort("Unable to allocate %d bytes!\n",size*sizeof(double));
+      b->capacity= size;
+    }
+    forceGetAllFloat64(source, size, offset, b->data);
+    b->src= source;
+    b->offset= offset;
+    b->size= size;
+    b->refCount= 1;
+    return b->data;
+  }
+
+  if (*block) {
+    releaseBorrowedBlock(*block);
+    *block= NULL;
+  }
+  CACHE_LOCK(c);
+  if ((b=cacheLookup(c,source,size,offset)) != NULL) {
+    b->refCount++;
+    cacheUnlinkLRU(c,b);
+    cachePushLRU(c,b);
+    c->nHits++;
+    CACHE_UNLOCK(c);
+    *block= b;
+    return b->data;
+  }
+  c->nMisses++;
+  b= cacheTakeFromPool(c,size);
+  CACHE_UNLOCK(c);
+  if (!b) b= createCachedBlock(size);
+  forceGetAllFloat64(source, size, offset, b->data);
+  b->src= source;
+  b->offset= offset;
+  b->size= size;
+  b->refCount= 1;
+
+  CACHE_LOCK(c);
+  /* Another thread may have read the same block meanwhile */
+  if (!cacheLookup(c,source,size,offset)) {
+    b->cache= c;
+    b->hashNext= c->hash[cacheHash(source,offset)];
+    c->hash[cacheHash(source,offset)]= b;
+    cachePushLRU(c,b);
+    c->nBytes += b->capacity*sizeof(double);
+    cacheEvict(c);
+  }
+  CACHE_UNLOCK(c);
+  *block= b;
+  return b->data;
+}
+
+void releaseBorrowedBlock(CachedBlock* block)
+{
+  BlockCache* c= block->cache;
+  if (c) {
+    CACHE_LOCK(c);
+    if (block->cache) {
+      block->refCount--;
+      cacheEvict(c);
+      CACHE_UNLOCK(c);
+      return;
+    }
+    CACHE_UNLOCK(c);
+  }
+  destroyCachedBlock(block);
+}
+
 static void arenaDestroySelf(Arena* a)
 {
   if (a->tools) slist_destroy(a->tools, NULL);
+  if (a->blockCache) {
+    BlockCache* c= (BlockCache*)(a->blockCache);
+    flushBlockCache(a);
+#ifdef USE_PTHREAD
+    pthread_mutex_destroy(&(c->mutex));
+#endif
+    free(c);
+    a->blockCache= NULL;
+  }
 }
 
 static void arenaAddTool(Arena* a, Tool* t)
@@ -377,11 +733,512 @@ static int arenaInit(Arena* self)
   return 1;
 }
 
+void pipeLockLibmri(void)
+{
+#ifdef USE_PTHREAD
+  pthread_mutex_lock(&libmriMutex);
+#endif
+}
+
+void pipeUnlockLibmri(void)
+{
+#ifdef USE_PTHREAD
+  pthread_mutex_unlock(&libmriMutex);
+#endif
+}
+
+#ifdef USE_PTHREAD
+
+static int arenaThreadCount(Arena* self)
+{
+  /* A negative count has always meant running serially here */
+  if (self->threads<0) return 1;
+  return fthr_count("mripipes", self->threads);
+}
+
+static PipeEdge* findEdge(DataSource* src)
+{
+  PipeThreads* pt= (PipeThreads*)(src->owner->owner->threadState);
+  int i;
+  for (i=0; i<pt->nEdges; i++)
+    if (pt->edges[i].src==src) return &(pt->edges[i]);
+  Abort("Output %s of %s has no pipeline edge!\n",
+	src->name,src->owner->typeName);
+  return NULL;
+}
+
+static long callUpstream(PipeEdge* e, int type, long size, long long offset,
+			 void* buf)
+{
+  DataSource* src= e->src;
+  switch (type) {
+  case MRI_UNSIGNED_CHAR: 
+    return e->pGetUInt8Chunk(src,size,offset,(char*)buf);
+  case MRI_SHORT: 
+    return e->pGetInt16Chunk(src,size,offset,(short*)buf);
+  case MRI_INT: 
+    return e->pGetInt32Chunk(src,size,offset,(int*)buf);
+  case MRI_LONGLONG: 
+    return e->pGetInt64Chunk(src,size,offset,(long long*)buf);
+  case MRI_FLOAT: 
+    return e->pGetFloat32Chunk(src,size,offset,(float*)buf);
+  case MRI_DOUBLE: 
+    return e->pGetFloat64Chunk(src,size,offset,(double*)buf);
+  }
+  Abort("mripipes internal error: unknown datatype %d!\n",type);
+  return 0;
+}
+
+/* Call the upstream tool with its lock held, releasing the lock
+ * if the call raises an exception.
+ */
+static long lockedCall(PipeEdge* e, int type, long size, long long offset,
+		       void* buf)
+{
+  ExceptionContext eCtx;
+  volatile long n= 0;
+  pthread_mutex_lock(&(e->lock->mutex));
+  __fex_windExceptionContext(&eCtx);
+  if (!sigsetjmp(eCtx.env,1)) {
+    n= callUpstream(e, type, size, offset, buf);
+    __fex_unwindExceptionContext();
+  }
+  else {
+    pthread_mutex_unlock(&(e->lock->mutex));
+    __fex_rethrowThisException();
+  }
+  pthread_mutex_unlock(&(e->lock->mutex));
+  return n;
+}
+
+static void fillBlock(PipeEdge* e, int type, long size, long long offset,
+		      void* buf)
+{
+  long typeSize= (type==MRI_FLOAT) ? sizeof(float) : sizeof(double);
+  char* here= (char*)buf;
+  while (size>0) {
+    long n= lockedCall(e, type, size, offset, here);
+    if (n<=0)
+      pipeAbort("Output %s of %s provided no data\n",
+		e->src->name,e->src->owner->typeName);
+    size -= n;
+    offset += n;
+    here += n*typeSize;
+  }
+}
+
+static void* edgeWorker(void* arg)
+{
+  PipeEdge* e= (PipeEdge*)arg;
+  pthread_mutex_lock(&(e->mutex));
+  while (!e->stop) {
+    ExceptionContext eCtx;
+    PipeBlock* b;
+    long long offset;
+    long n;
+    int type;
+    int generation;
+    char* volatile errorString= NULL;
+
+    if (!e->active || e->count==PIPE_QUEUE_DEPTH 
+	|| e->nextOffset>=e->totalSize || e->errorString) {
+      pthread_cond_wait(&(e->cond),&(e->mutex));
+      continue;
+    }
+    b= &(e->block[(e->head+e->count)%PIPE_QUEUE_DEPTH]);
+    offset= e->nextOffset;
+    n= (e->totalSize-offset > e->fetchSize) ? 
+      e->fetchSize : (long)(e->totalSize-offset);
+    e->fetchSize= (2*e->fetchSize > PIPE_BLOCKSIZE) ? 
+      PIPE_BLOCKSIZE : 2*e->fetchSize;
+    type= e->type;
+    generation= e->generation;
+    pthread_mutex_unlock(&(e->mutex));
+
+    __fex_windExceptionContext(&eCtx);
+    if (!sigsetjmp(eCtx.env,1)) {
+      fillBlock(e, type, n, offset, b->buf);
+      __fex_unwindExceptionContext();
+    }
+    else {
+      Exception* ex= __fex_getCurrentException();
+      __fex_unwindExceptionContext();
+      if (!(errorString= strdup(fex_getExceptionString(ex))))
+	Abort("Unable to allocate %d bytes!\n",
+	      strlen(fex_getExceptionString(ex))+1);
+      __fex_destroyException(ex);
+    }
+
+    pthread_mutex_lock(&(e->mutex));
+    if (generation==e->generation) {
+      if (errorString) e->errorString= errorString;
+      else {
+	b->offset= offset;
+	b->n= n;
+	e->count++;
+	e->nextOffset += n;
+      }
+      pthread_cond_broadcast(&(e->cond));
+    }
+    else if (errorString) free(errorString);
+  }
+  pthread_mutex_unlock(&(e->mutex));
+  return NULL;
+}
+
+/* Discard anything read ahead and leave the worker idle.
+ * Called with the edge mutex held.
+ */
+static void stopEdge(PipeEdge* e)
+{
+  e->active= 0;
+  e->head= 0;
+  e->count= 0;
+  e->generation++;
+  if (e->errorString) {
+    free(e->errorString);
+    e->errorString= NULL;
+  }
+}
+
+/* Start reading ahead at the given offset, the first fetch being
+ * firstSize long.  Called with the edge mutex held.
+ */
+static void restartEdge(PipeEdge* e, int type, long long offset, 
+			long firstSize)
+{
+  stopEdge(e);
+  e->active= 1;
+  e->type= type;
+  e->nextOffset= offset;
+  e->fetchSize= (firstSize > PIPE_BLOCKSIZE) ? PIPE_BLOCKSIZE : firstSize;
+  if (!e->running) {
+    int err;
+    if ((err=pthread_create(&(e->thread),NULL,edgeWorker,e)))
+      Abort("Unable to create a thread for output %s of %s: %s\n",
+	    e->src->name,e->src->owner->typeName,strerror(err));
+    e->running= 1;
+  }
+  pthread_cond_broadcast(&(e->cond));
+}
+
+static long edgeGet(PipeEdge* e, int type, long size, long long offset,
+		    void* buf)
+{
+  long typeSize= (type==MRI_FLOAT) ? sizeof(float) : sizeof(double);
+  long n;
+  PipeBlock* b;
+
+  if (offset<0 || offset>=e->totalSize) 
+    return lockedCall(e, type, size, offset, buf);
+
+  pthread_mutex_lock(&(e->mutex));
+  while (e->active && e->type==type) {
+    /* Drop blocks the caller has moved past */
+    while (e->count 
+	   && offset>=e->block[e->head].offset+e->block[e->head].n) {
+      e->head= (e->head+1)%PIPE_QUEUE_DEPTH;
+      e->count--;
+      pthread_cond_broadcast(&(e->cond));
+    }
+    if (e->count && offset>=e->block[e->head].offset) {
+      b= &(e->block[e->head]);
+      n= (long)(b->offset+b->n-offset);
+      if (n>size) n= size;
+      memcpy(buf,(char*)b->buf+(offset-b->offset)*typeSize,n*typeSize);
+      if (offset+n==b->offset+b->n) {
+	e->head= (e->head+1)%PIPE_QUEUE_DEPTH;
+	e->count--;
+	pthread_cond_broadcast(&(e->cond));
+      }
+      e->lastEnd= offset+n;
+      pthread_mutex_unlock(&(e->mutex));
+      return n;
+    }
+    if (e->count || offset!=e->nextOffset) break;
+    if (e->errorString) {
+      char buf[256];
+      strncpy(buf,e->errorString,sizeof(buf)-1);
+      buf[sizeof(buf)-1]= '\0';
+      pthread_mutex_unlock(&(e->mutex));
+      pipeAbort("%s",buf);
+    }
+    /* The worker is fetching exactly this data */
+    pthread_cond_wait(&(e->cond),&(e->mutex));
+  }
+
+  /* This request does not continue the read-ahead, so any read-ahead
+   * is wasted; serve the request directly, as a serial run would.
+   */
+  if (e->active) stopEdge(e);
+  if (type==e->lastType && offset==e->lastEnd) e->nSequential++;
+  else e->nSequential= 0;
+  pthread_mutex_unlock(&(e->mutex));
+
+  n= lockedCall(e, type, size, offset, buf);
+
+  pthread_mutex_lock(&(e->mutex));
+  e->lastType= type;
+  e->lastEnd= offset+n;
+  if (e->nSequential>=PIPE_SEQUENTIAL_RUN && n>0 
+      && offset+n<e->totalSize)
+    restartEdge(e, type, offset+n, n);
+  pthread_mutex_unlock(&(e->mutex));
+  return n;
+}
+
+static long edgeGetUInt8Chunk( DataSource* self, long size, long long offset,
+			       char* buf )
+{
+  return lockedCall(findEdge(self), MRI_UNSIGNED_CHAR, size, offset, buf);
+}
+
+static long edgeGetInt16Chunk( DataSource* self, long size, long long offset,
+			       short* buf )
+{
+  return lockedCall(findEdge(self), MRI_SHORT, size, offset, buf);
+}
+
+static long edgeGetInt32Chunk( DataSource* self, long size, long long offset,
+			       int* buf )
+{
+  return lockedCall(findEdge(self), MRI_INT, size, offset, buf);
+}
+
+static long edgeGetInt64Chunk( DataSource* self, long size, long long offset,
+			       long long* buf )
+{
+  return lockedCall(findEdge(self), MRI_LONGLONG, size, offset, buf);
+}
+
+static long edgeGetFloat32Chunk( DataSource* self, long size, 
+				 long long offset, float* buf )
+{
+  PipeEdge* e= findEdge(self);
+  if (e->prefetch) return edgeGet(e, MRI_FLOAT, size, offset, buf);
+  else return lockedCall(e, MRI_FLOAT, size, offset, buf);
+}
+
+static long edgeGetFloat64Chunk( DataSource* self, long size, 
+				 long long offset, double* buf )
+{
+  PipeEdge* e= findEdge(self);
+  if (e->prefetch) return edgeGet(e, MRI_DOUBLE, size, offset, buf);
+  else return lockedCall(e, MRI_DOUBLE, size, offset, buf);
+}
+
+static long long sourceTotalSize(DataSource* src)
+{
+  const char* here;
+  long long total= 1;
+  if (!kvLookup(src->attr,"dimensions")) return 0;
+  for (here=kvGetString(src->attr,"dimensions"); *here; here++) {
+    char buf[64];
+    sprintf(buf,"extent.%c",*here);
+    if (!kvLookup(src->attr,buf)) return 0;
+    total *= atoi(kvGetString(src->attr,buf));
+  }
+  return total;
+}
+
+static ToolLock* findToolLock(PipeThreads* pt, Tool* t)
+{
+  int i;
+  for (i=0; i<pt->nLocks; i++)
+    if (pt->locks[i].tool==t) return &(pt->locks[i]);
+  return NULL;
+}
+
+/* Give each tool upstream of t a lock and each connected source 
+ * an edge.
+ */
+static ToolLock* addToolLocks(PipeThreads* pt, Tool* t)
+{
+  ToolLock* lock;
+  int i;
+  if ((lock=findToolLock(pt,t)) != NULL) return lock;
+  lock= &(pt->locks[pt->nLocks++]);
+  lock->tool= t;
+  pthread_mutex_init(&(lock->mutex),NULL);
+  lock->threadSafe= (strcmp(t->typeName,"block_map") 
+		     && strcmp(t->typeName,"func2unblk"));
+  for (i=0; i<t->nSinks; i++) {
+    DataSource* src= t->sinkArray[i]->source;
+    if (src && src->owner) {
+      ToolLock* upLock= addToolLocks(pt,src->owner);
+      if (!upLock->threadSafe) lock->threadSafe= 0;
+    }
+  }
+  return lock;
+}
+
+static void addEdges(PipeThreads* pt, Tool* t, int* nWorkers)
+{
+  int i;
+  int j;
+  for (i=0; i<t->nSinks; i++) {
+    DataSource* src= t->sinkArray[i]->source;
+    PipeEdge* e;
+    if (!src || !src->owner) continue;
+    for (j=0; j<pt->nEdges; j++) if (pt->edges[j].src==src) break;
+    if (j<pt->nEdges) continue;
+    e= &(pt->edges[pt->nEdges++]);
+    e->src= src;
+    e->lock= findToolLock(pt,src->owner);
+    e->pGetUInt8Chunk= src->pGetUInt8Chunk;
+    e->pGetInt16Chunk= src->pGetInt16Chunk;
+    e->pGetInt32Chunk= src->pGetInt32Chunk;
+    e->pGetInt64Chunk= src->pGetInt64Chunk;
+    e->pGetFloat32Chunk= src->pGetFloat32Chunk;
+    e->pGetFloat64Chunk= src->pGetFloat64Chunk;
+    e->totalSize= sourceTotalSize(src);
+    e->prefetch= (*nWorkers>0 && e->lock->threadSafe && e->totalSize>0);
+    if (e->prefetch) (*nWorkers)--;
+    e->running= 0;
+    e->stop= 0;
+    pthread_mutex_init(&(e->mutex),NULL);
+    pthread_cond_init(&(e->cond),NULL);
+    e->active= 0;
+    e->type= MRI_DOUBLE;
+    e->nextOffset= 0;
+    e->fetchSize= PIPE_BLOCKSIZE;
+    e->lastType= MRI_DOUBLE;
+    e->lastEnd= -1;
+    e->nSequential= 0;
+    e->generation= 0;
+    e->head= 0;
+    e->count= 0;
+    e->errorString= NULL;
+    for (j=0; j<PIPE_QUEUE_DEPTH; j++) {
+      e->block[j].offset= 0;
+      e->block[j].n= 0;
+      e->block[j].buf= NULL;
+      if (e->prefetch 
+	  && !(e->block[j].buf= malloc(PIPE_BLOCKSIZE*sizeof(double))))
+	Abort("Unable to allocate %d bytes!\n",
+	      PIPE_BLOCKSIZE*sizeof(double));
+    }
+  }
+}
+
+static void startThreads(Arena* self, int nThreads)
+{
+  PipeThreads* pt;
+  int nTools= slist_count(self->tools);
+  int nSources= 0;
+  int nWorkers= nThreads-1;
+  int i;
+
+  if (!(pt=(PipeThreads*)malloc(sizeof(PipeThreads))))
+    Abort("Unable to allocate %d bytes!\n",sizeof(PipeThreads));
+  slist_totop(self->tools);
+  while (!slist_atend(self->tools)) {
+    Tool* t= (Tool*)slist_next(self->tools);
+    nSources += t->nSinks;
+  }
+  if (!(pt->locks=(ToolLock*)malloc((nTools+1)*sizeof(ToolLock))))
+    Abort("Unable to allocate %d bytes!\n",(nTools+1)*sizeof(ToolLock));
+  if (!(pt->edges=(PipeEdge*)malloc((nSources+1)*sizeof(PipeEdge))))
+    Abort("Unable to allocate %d bytes!\n",(nSources+1)*sizeof(PipeEdge));
+  pt->nLocks= 0;
+  pt->nEdges= 0;
+  (void)addToolLocks(pt,self->drain);
+
+  /* Tools were locked in depth-first order; visiting them in that
+   * order gives read-ahead to the edges nearest the drain first.
+   */
+  for (i=0; i<pt->nLocks; i++) addEdges(pt,pt->locks[i].tool,&nWorkers);
+
+  for (i=0; i<pt->nEdges; i++) {
+    PipeEdge* e= &(pt->edges[i]);
+    DataSource* src= e->src;
+    src->pGetUInt8Chunk= edgeGetUInt8Chunk;
+    src->pGetInt16Chunk= edgeGetInt16Chunk;
+    src->pGetInt32Chunk= edgeGetInt32Chunk;
+    src->pGetInt64Chunk= edgeGetInt64Chunk;
+    src->pGetFloat32Chunk= edgeGetFloat32Chunk;
+    src->pGetFloat64Chunk= edgeGetFloat64Chunk;
+    if (self->verbose && e->prefetch)
+      Message("Reading ahead from output %s of %s on its own thread\n",
+	      src->name, src->owner->typeName);
+  }
+  self->threadState= pt;
+}
+
+static void stopThreads(Arena* self)
+{
+  PipeThreads* pt= (PipeThreads*)(self->threadState);
+  int i;
+  int j;
+  if (!pt) return;
+
+  for (i=0; i<pt->nEdges; i++) {
+    PipeEdge* e= &(pt->edges[i]);
+    pthread_mutex_lock(&(e->mutex));
+    e->stop= 1;
+    pthread_cond_broadcast(&(e->cond));
+    pthread_mutex_unlock(&(e->mutex));
+  }
+  for (i=0; i<pt->nEdges; i++) {
+    PipeEdge* e= &(pt->edges[i]);
+    DataSource* src= e->src;
+    if (e->running) pthread_join(e->thread,NULL);
+    src->pGetUInt8Chunk= e->pGetUInt8Chunk;
+    src->pGetInt16Chunk= e->pGetInt16Chunk;
+    src->pGetInt32Chunk= e->pGetInt32Chunk;
+    src->pGetInt64Chunk= e->pGetInt64Chunk;
+    src->pGetFloat32Chunk= e->pGetFloat32Chunk;
+    src->pGetFloat64Chunk= e->pGetFloat64Chunk;
+    for (j=0; j<PIPE_QUEUE_DEPTH; j++) 
+      if (e->block[j].buf) free(e->block[j].buf);
+    if (e->errorString) free(e->errorString);
+    pthread_cond_destroy(&(e->cond));
+    pthread_mutex_destroy(&(e->mutex));
+  }
+  for (i=0; i<pt->nLocks; i++) pthread_mutex_destroy(&(pt->locks[i].mutex));
+  free(pt->edges);
+  free(pt->locks);
+  free(pt);
+  self->threadState= NULL;
+}
+
+static int threadedExecute(Arena* self, int nThreads)
+{
+  ExceptionContext eCtx;
+  volatile int result= 0;
+  startThreads(self, nThreads);
+  __fex_windExceptionContext(&eCtx);
+  if (!sigsetjmp(eCtx.env,1)) {
+    result= self->drain->pExecute(self->drain);
+    __fex_unwindExceptionContext();
+  }
+  else {
+    stopThreads(self);
+    __fex_rethrowThisException();
+  }
+  stopThreads(self);
+  return result;
+}
+
+#endif
+
 static int arenaExecute(Arena* self)
 {
+  int result;
   if (!self->drain)
     Abort("This network has not been initialized!\n");
-  return self->drain->pExecute(self->drain);
+  flushBlockCache(self);
+#ifdef USE_PTHREAD
+  {
+    int nThreads= arenaThreadCount(self);
+    if (nThreads>1) result= threadedExecute(self, nThreads);
+    else result= self->drain->pExecute(self->drain);
+  }
+#else
+  result= self->drain->pExecute(self->drain);
+#endif
+  flushBlockCache(self);
+  return result;
 }
 
 Arena* createArena() {
@@ -396,6 +1253,29 @@ Arena* createArena() {
   result->pExecute= arenaExecute;
   result->verbose= 0;
   result->debug= 0;
+  result->threads= 0;
+  if (getenv("MRIPIPES_THREADS")) 
+    result->threads= atoi(getenv("MRIPIPES_THREADS"));
+  result->threadState= NULL;
+  result->cacheMB= DEFAULT_CACHE_MB;
+  if (getenv("MRIPIPES_CACHE_MB")) 
+    result->cacheMB= atoi(getenv("MRIPIPES_CACHE_MB"));
+  {
+    BlockCache* c;
+    int i;
+    if (!(c=(BlockCache*)malloc(sizeof(BlockCache))))
+      Abort("Unable to allocate %d bytes!\n",sizeof(BlockCache));
+    c->maxBytes= (long long)result->cacheMB*1024*1024;
+    c->nBytes= 0;
+    for (i=0; i<CACHE_HASH_SIZE; i++) c->hash[i]= NULL;
+    c->lruHead= c->lruTail= NULL;
+    c->nPool= 0;
+    c->nHits= c->nMisses= 0;
+#ifdef USE_PTHREAD
+    pthread_mutex_init(&(c->mutex),NULL);
+#endif
+    result->blockCache= c;
+  }
   return result;
 }
 
@@ -40,6 +40,8 @@ struct arena_struct;
 struct tool_struct;
 struct data_sink_struct;
 
+typedef struct cached_block_struct CachedBlock; /* private to mripipes.c */
+
 typedef struct data_source_struct {
   int (*pInit)(struct data_source_struct* self);
   long (*pGetUInt8Chunk)(struct data_source_struct* self, 
@@ -113,9 +115,15 @@ typedef struct arena_struct {
   Tool* drain;
   int verbose;
   int debug;
+  int threads; /* 0 means one per processor, 1 means run serially */
+  void* threadState; /* private to mripipes.c */
+  int cacheMB; /* memory for re-read upstream blocks; 0 disables */
+  void* blockCache; /* private to mripipes.c */
 } Arena;
 
 extern void pipeAbort(char* fmt, ...);
+extern void pipeLockLibmri(void);
+extern void pipeUnlockLibmri(void);
 
 const char* getSourceDims( DataSource* source );
 void setSourceDims( DataSource* source, const char* dimstr );
@@ -124,6 +132,9 @@ void setSourceDimExtent( DataSource* source, const char dim, const int extent);
 int getSourceDataType(DataSource* source);
 void forceGetAllFloat64(DataSource* source, long size, long long offset,
 			double* buf);
+const double* borrowAllFloat64(DataSource* source, long size, 
+			       long long offset, CachedBlock** block);
+void releaseBorrowedBlock(CachedBlock* block);
 void calcSourceBlockSizes(DataSource* source, const char* dimstr,
 			  const char selected_dim,
 			  long* fast_blocksize_out, 
@@ -13,6 +13,14 @@
  *  tuple which is passed in in the constructor arg list.
  *  This should get DECREF'd when the tool is deleted, but
  *  I can't figure out how to cause SWIG to make this happen.
+ * -Arena.setThreads(n) sets the number of threads used by
+ *  execute(); 0 (the default, unless MRIPIPES_THREADS is set
+ *  in the environment) means one per processor and 1 means
+ *  run serially.  Tools which call back into Python always run
+ *  on the thread which called execute().
+ * -Arena.setCacheMB(n) sets the memory used to keep upstream
+ *  blocks which a tool may read again (64MB unless
+ *  MRIPIPES_CACHE_MB is set); 0 disables the cache.
  *******************************************************/
 
 %include "typemaps.i"
@@ -84,6 +92,10 @@ typedef struct arena_struct {
   Tool* drain;
   int verbose;
   int debug;
+  int threads;
+  void* threadState;
+  int cacheMB;
+  void* blockCache;
 } Arena;
 
 %makedefault;
@@ -288,6 +300,12 @@ static int PythonBLOCKMAPCBFUNC(long* size, long long* offset,
   void setVerbose(int i=1) {
     self->verbose= i;
   }
+  void setThreads(int i) {
+    self->threads= i;
+  }
+  void setCacheMB(int i) {
+    self->cacheMB= i;
+  }
 }
 
 const char* getSourceDims( DataSource* source );
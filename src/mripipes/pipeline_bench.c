@@ -0,0 +1,326 @@
+/************************************************************
+ *	pipeline_bench.c                                          *
+ *                                                          *
+ *	Copyright (c) 2004 Pittsburgh Supercomputing Center *
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ ************************************************************/
+/*
+ * pipeline_bench times a few pipelines serially and with read-ahead
+ * threads, and checks that both give the same output.  For each it
+ * also reports how many elements the first rpn_math stage was asked
+ * for, which is the upstream work the pipeline cost.  The subset
+ * pipelines make strided requests and matmult re-reads its inputs,
+ * so neither should cost more upstream work with threads than
+ * without; the plain stream should gain from the overlap.  Each
+ * time is the best of N_REPS runs.
+ *
+ * A second table times the matmult tool's two serial multiply
+ * methods for a range of fast block sizes.  The tool batches slices
+ * only below the size where batching stops winning, or when it has
+ * threads to share the work.
+ *
+ * usage: pipeline_bench [nthreads [scratchdir]]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include <mri.h>
+#include <fmri.h>
+#include <mripipes.h>
+#include "lapack.h"
+
+#define N_REPS 3 /* each run is timed this many times; the best counts */
+#define MM_ROWS 6000 /* fast times slow extent of the kernel cases */
+#define MM_SUMMED 40
+#define MM_RIGHT 500
+#define MM_BATCH (1024*1024) /* doubles per batch, as in matmult_tool */
+
+#define HEAVY "$x 0.01 * sin $y 0.02 * cos * $z 0.03 * sin + "\
+  "$x $y * 0.001 * cos + dup dup * 1 + sqrt *"
+
+typedef struct bench_case_struct {
+  const char* name;
+  Tool* (*build)(Arena* a, const struct bench_case_struct* c);
+  const char* arg1;
+  const char* arg2;
+} BenchCase;
+
+/* Calls into one source are serialized by its edge, so a plain
+ * counter will do.
+ */
+static long long nUpstream= 0;
+static long (*realGetFloat64)(DataSource*, long, long long, double*);
+
+static long countingGetFloat64( DataSource* self, long size,
+				long long offset, double* buf )
+{
+  long n= realGetFloat64(self, size, offset, buf);
+  nUpstream += n;
+  return n;
+}
+
+static void countUpstream( Tool* t )
+{
+  DataSource* src= t->sourceArray[0];
+  realGetFloat64= src->pGetFloat64Chunk;
+  src->pGetFloat64Chunk= countingGetFloat64;
+}
+
+static void connect( Tool* t, int i, Tool* upstream )
+{
+  t->sinkArray[i]->pConnect(t->sinkArray[i], upstream->sourceArray[0]);
+}
+
+static double now( void )
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6*tv.tv_usec;
+}
+
+/* An rpn_math stage over a zero source, whose output is counted */
+static Tool* heavySource( Arena* a, const char* dims, const char* extents,
+			  const char* script )
+{
+  Tool* z= createZeroSrcTool(a, dims, extents);
+  Tool* m= createRpnMathTool(a, script);
+  connect(m, 0, z);
+  countUpstream(m);
+  return m;
+}
+
+/* arg1 is the dimension to subset, arg2 the extent and offset */
+static Tool* buildSubset( Arena* a, const BenchCase* c )
+{
+  int extent;
+  int offset;
+  Tool* s;
+  sscanf(c->arg2, "%d:%d", &extent, &offset);
+  s= createSubsetTool(a, c->arg1, extent, offset);
+  connect(s, 0, heavySource(a, "xyz", "128:128:400", HEAVY));
+  return s;
+}
+
+/* arg1 and arg2 are the xqy and qz extents of the two factors */
+static Tool* buildMatmult( Arena* a, const BenchCase* c )
+{
+  Tool* left= heavySource(a, "xqy", c->arg1,
+			  "$q 0.1 * sin $x 0.02 * cos * $y +");
+  Tool* zr= createZeroSrcTool(a, "qz", c->arg2);
+  Tool* right= createRpnMathTool(a, "$q 0.05 * cos $z 0.01 * sin +");
+  Tool* mm= createMatmultTool(a);
+  connect(right, 0, zr);
+  connect(mm, 0, left);
+  connect(mm, 1, right);
+  return mm;
+}
+
+static Tool* buildStream( Arena* a, const BenchCase* c )
+{
+  Tool* s= createRpnMathTool(a, "$1 3 * sin $1 *");
+  connect(s, 0, heavySource(a, "xyz", "128:128:400", HEAVY));
+  return s;
+}
+
+static BenchCase cases[]= {
+  { "subset y", buildSubset, "y", "8:20" },
+  { "subset x", buildSubset, "x", "5:3" },
+  { "matmult 1", buildMatmult, "1:40:6000", "40:500" },
+  { "matmult 16", buildMatmult, "16:40:375", "40:500" },
+  { "matmult 300", buildMatmult, "300:40:20", "40:500" },
+  { "stream", buildStream, NULL, NULL }
+};
+#define N_CASES (sizeof(cases)/sizeof(BenchCase))
+
+/* Runs one case, returning the time taken and the upstream count */
+static double runOnce( const BenchCase* c, int nthreads, const char* fname,
+		       long long* upstream )
+{
+  Arena* a= createArena();
+  Tool* out;
+  double t0;
+
+  a->threads= nthreads;
+  out= createMRIFileOutputTool(a, fname);
+  connect(out, 0, c->build(a, c));
+  nUpstream= 0;
+  if (!a->pInit(a)) {
+    fprintf(stderr,"%s: initialization failed!\n", c->name);
+    exit(-1);
+  }
+  t0= now();
+  if (!a->pExecute(a)) {
+    fprintf(stderr,"%s: execution failed!\n", c->name);
+    exit(-1);
+  }
+  t0= now() - t0;
+  *upstream= nUpstream;
+  a->pDestroySelf(a);
+  return t0;
+}
+
+static double run( const BenchCase* c, int nthreads, const char* fname,
+		   long long* upstream )
+{
+  double best= runOnce(c, nthreads, fname, upstream);
+  int i;
+  for (i=1; i<N_REPS; i++) {
+    double t= runOnce(c, nthreads, fname, upstream);
+    if (t<best) best= t;
+  }
+  return best;
+}
+
+static int sameFile( const char* name1, const char* name2 )
+{
+  FILE* f1= fopen(name1, "r");
+  FILE* f2= fopen(name2, "r");
+  int c1, c2;
+  int same= (f1 != NULL && f2 != NULL);
+  while (same) {
+    c1= getc(f1);
+    c2= getc(f2);
+    if (c1 != c2) same= 0;
+    else if (c1 == EOF) break;
+  }
+  if (f1) fclose(f1);
+  if (f2) fclose(f2);
+  return same;
+}
+
+/* The matmult tool's two ways of doing a block of slices: one GEMM
+ * per slice into a small output block, or batch_matmult() into one
+ * big enough for a batch.  Either way the block is then copied out,
+ * as the tool's getFloat64Chunk does.
+ */
+static double timeMultiply( long fast, int batched )
+{
+  long nslices= MM_ROWS/fast;
+  long nbatch= (batched ? MM_BATCH/(fast*(MM_SUMMED+MM_RIGHT)) : 1);
+  long sliceOut= fast*MM_RIGHT;
+  double* left= (double*)malloc(nslices*fast*MM_SUMMED*sizeof(double));
+  double* right= (double*)malloc(MM_SUMMED*MM_RIGHT*sizeof(double));
+  double* out= (double*)malloc(nslices*sliceOut*sizeof(double));
+  double* obuf;
+  double best= 0.0;
+  long i;
+  int rep;
+
+  if (nbatch<1) nbatch= 1;
+  if (nbatch>nslices) nbatch= nslices;
+  obuf= (double*)malloc(nbatch*sliceOut*sizeof(double));
+  if (!left || !right || !out || !obuf) {
+    fprintf(stderr,"Unable to allocate multiply buffers!\n");
+    exit(-1);
+  }
+  for (i=0; i<nslices*fast*MM_SUMMED; i++) left[i]= sin(0.01*i);
+  for (i=0; i<MM_SUMMED*MM_RIGHT; i++) right[i]= cos(0.02*i);
+
+  for (rep=0; rep<N_REPS; rep++) {
+    double t0= now();
+    long s;
+    for (s=0; s<nslices; s += nbatch) {
+      long n= (nslices-s < nbatch) ? nslices-s : nbatch;
+      if (batched)
+	batch_matmult(left+s*fast*MM_SUMMED, right, obuf, n, fast,
+		      MM_SUMMED, MM_RIGHT, n, 0, 1);
+      else {
+	double one= 1.0;
+	double zero= 0.0;
+	int lfb= (int)fast;
+	int rsb= MM_RIGHT;
+	int se= MM_SUMMED;
+	DGEMM( "n", "n", &lfb, &rsb, &se, &one, left+s*fast*MM_SUMMED, &lfb,
+	       right, &se, &zero, obuf, &lfb );
+      }
+      memcpy(out+s*sliceOut, obuf, n*sliceOut*sizeof(double));
+    }
+    t0= now() - t0;
+    if (rep==0 || t0<best) best= t0;
+  }
+  free(left);
+  free(right);
+  free(out);
+  free(obuf);
+  return best;
+}
+
+static void multiplyTable( void )
+{
+  static long fasts[]= { 1, 4, 8, 16, 32, 64, 128, 300 };
+  int i;
+
+  printf("\n%-12s %10s %10s\n", "serial", "per-slice", "batched");
+  printf("%-12s %10s %10s\n", "multiply", "seconds", "seconds");
+  for (i=0; i<sizeof(fasts)/sizeof(long); i++) {
+    char name[64];
+    sprintf(name, "fast %ld", fasts[i]);
+    printf("%-12s %10.4f %10.4f\n", name, timeMultiply(fasts[i], 0),
+	   timeMultiply(fasts[i], 1));
+  }
+  printf("(about %d rows of %d, times %d by %d)\n", 
+	 MM_ROWS, MM_SUMMED, MM_SUMMED, MM_RIGHT);
+}
+
+int main( int argc, char* argv[] )
+{
+  int nthreads= 4;
+  const char* scratch= ".";
+  char serialName[512];
+  char threadedName[512];
+  char serialFile[520];
+  char threadedFile[520];
+  int failures= 0;
+  int i;
+
+  if (argc>1) nthreads= atoi(argv[1]);
+  if (argc>2) scratch= argv[2];
+  if (argc>3 || nthreads<1) {
+    fprintf(stderr,"usage: %s [nthreads [scratchdir]]\n", argv[0]);
+    exit(-1);
+  }
+  sprintf(serialName, "%s/bench_serial", scratch);
+  sprintf(threadedName, "%s/bench_threaded", scratch);
+  sprintf(serialFile, "%s.mri", serialName);
+  sprintf(threadedFile, "%s.mri", threadedName);
+
+  printf("%-12s %10s %10s %12s %12s  %s\n", "", "serial", "threads",
+	 "serial", "threads", "");
+  printf("%-12s %10s %10s %12s %12s  %s\n", "pipeline", "seconds", "seconds",
+	 "upstream", "upstream", "output");
+  for (i=0; i<N_CASES; i++) {
+    long long upSerial, upThreaded;
+    double tSerial= run(cases+i, 1, serialName, &upSerial);
+    double tThreaded= run(cases+i, nthreads, threadedName, &upThreaded);
+    int same= sameFile(serialFile, threadedFile);
+    printf("%-12s %10.3f %10.3f %12lld %12lld  %s\n", cases[i].name,
+	   tSerial, tThreaded, upSerial, upThreaded,
+	   same ? "identical" : "DIFFERS");
+    if (!same) failures++;
+    remove(serialFile);
+    remove(threadedFile);
+  }
+  printf("(%d threads)\n", nthreads);
+  multiplyTable();
+
+  if (failures) {
+    printf("%d pipelines FAILED\n", failures);
+    exit(1);
+  }
+  return 0;
+}
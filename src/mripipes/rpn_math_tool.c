@@ -44,6 +44,8 @@ typedef struct rpn_data_struct {
   long long obufOffset;
   long obufValidLength;
   double* obuf;
+  long tbufSize;
+  double* tbuf; /* interleaved complex input */
 } RPNData;
 
 static DataSink* createRPNSink(Tool* owner);
@@ -169,6 +171,7 @@ static void destroySelf(Tool* self)
   RPNData* data= (RPNData*)self->hook;
   if (data->re) rpnDestroyEngine(data->re);
   if (data->script) free(data->script);
+  if (data->tbuf) free(data->tbuf);
   baseToolDestroySelf(self);
 }
 
@@ -200,18 +203,20 @@ static void inputComplexCB( const int which, const long n,
 			    const long long offset, double* buf1, 
 			    double* buf2, void* hook )
 {
-  static double* tbuf= NULL;
-  static long tbufLength= 0;
   Tool* owner= (Tool*)hook;
+  RPNData* data= (RPNData*)owner->hook;
   DataSource* src= owner->sinkArray[which]->source;
+  double* tbuf;
   int i;
 
-  if (tbufLength<2*n) {
-    if (tbufLength) free(tbuf);
-    if (!(tbuf= (double*)malloc(2*n*sizeof(double))))
+  if (data->tbufSize<2*n) {
+    if (data->tbufSize) free(data->tbuf);
+    if (!(data->tbuf= (double*)malloc(2*n*sizeof(double))))
       Abort("rpn_math_tool: inputComplexCB: unable to allocate %d bytes!\n",
 	    2*n*sizeof(double));
+    data->tbufSize= 2*n;
   }
+  tbuf= data->tbuf;
   if (owner->debug) 
     fprintf(stderr,"rpn_math_tool: inputComplexCB: n= %ld, offset %lld\n",
 	    n,offset);
@@ -283,6 +288,8 @@ Tool* createRpnMathTool(Arena* arena, const char* script_in) {
   data->obufSize= 0;
   data->obuf= NULL;
   data->obufValidLength= 0;
+  data->tbufSize= 0;
+  data->tbuf= NULL;
   data->script= strdup(script_in);
   data->complexFlag= 0;
   result->pDestroySelf= destroySelf;
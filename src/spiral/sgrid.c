@@ -102,107 +102,7 @@
 #include "stdcrg.h"
 #include "rttraj.h"
 
-#define NWEIGHTS	1024	/* # of times kaiser function is sampled */
-#define PI	M_PI
-
-#define SWAP(a,b) {tempr=(a);(a)=(b);(b)=tempr;}
-
-
-typedef struct Context {
-  /* NOTE: any new fields added to this struct should
-     be also added to PackContext and UnpackContext */ 
-  Filename input_directory;	/* where to find input files */
-  int big_endian_input;		/* TRUE if input is big-endian */
-  Filename tmp_directory;	/* where to place scratch files */
-  Filename output_directory;	/* where to place output files */
-  int big_endian_output;	/* TRUE if output if big-endian */
-
-  int nfiles;			/* # of input files */
-  int ncoils;			/* # of coils */
-  int nslices;			/* # of slices per coil */
-  int nimages;			/* # of images in data set (per coil) */
-  int nph1;			/* # of baselines per slice */
-  int nphmult;			/* # of images (phases) per baseline */
-  int npr;			/* # of projections (spirals) */
-  int ndat;			/* # of data items per projection */
-
-  int chop;			/* may be either 1 or -1 */
-  int risetime;			/* ??? */
-  int densamp;			/* ??? */
-
-  double ts;			/* ??? */
-  double gts;			/* ??? */ 
-  double fsgcm;			/* ??? */
-  double opfov;			/* ??? field-of-view */
-
-  float pix_shifth;		/* horizontal pixel shift */
-  float pix_shiftv;		/* vertical pixel shift */
-
-  int coil_record_length;	/* # of bytes in one coil record */
-  int slice_record_length;	/* # of bytes in one slice record */
-  int baseline_length;		/* # of bytes in one baseline record */
-
-  int res;			/* # of pixels along the X and Y dimensions */
-  int os_res;			/* # of pixels in the (possibly oversampled)
-				   input image ( =res*over_samp) */
-
-  int slice;			/* slice number to work on (0 indicates all slices) */
-  int samp_delay;		/* input delay expressed as # of samples */
-  int samp_cor;			/* 1 if sample density correction is to be done,
-				   0 if no correction is to be done */
-  float ph_twist;		/* phase twist */
-  int lr_shift;			/* left-right shift in pixels */
-  int tb_shift;			/* top-bottom shift in pixels */
-  int loc_shift;		/* 1 if location shift should be done
-				     to align slice according to information
-				     contained in the file header
-				   0 if no shift should be done */
-  float zoom;			/* zoom factor */
-  float mag_factor;		/* magnitude correction factor */
-  float ph_factor;		/* phase correction factor */
-
-  int start_slice;		/* starting slice number */
-  int end_slice;		/* ending slice number */
-
-  int lin_cor;			/* linear correction */
-
-  Filename reg_file;		/* registration file */
-  int reg_2x;			/* double translation in registration file */
-
-  int write_mag;		/* 1 if we should write magnitude files out
-				     as well as raw files;
-				   0 if we should only write raw files */
-
-  int over_samp;		/* oversampling ratio */
-  float grid_len;		/* grid length (half width of convolution) */
-  float gridb;
-  float wind;			/* window */
-
-  float factxx;			/* image rotation & scaling factors */
-  float factxy;
-  float factyx;
-  float factyy;
-
-/* variably-sized context info */
-  float ***t2k;			/* dimensioned as [2][npr][ndat] */
-  float *kdens;			/* dimensioned as [ndat] */
-} Context;
-
-typedef struct Task {
-  /* NOTE: any new fields added to this struct should
-     be also added to PackTask and UnpackTask */ 
-  int file_index;	/* counts which input file we are
-			   currently working on (0 => first) */
-  Filename filename;	/* input filename */
-
-  int coil_num;		/* coil number (first is 0) */
-  int slice_num;	/* slice number (first is 0) */
-  int image_num;	/* image number within a slice (first is 0) (corresponds to phase number in gsp14.c) */
-
-  float reg_xs;		/* the registration x-shift for this image */
-  float reg_ys;		/* the registration y-shift for this image */
-  float reg_rot;	/* the registration rotation for this image */
-} Task;
+#include "sgrid.h"
 
 static char rcsid[] = "$Id: sgrid.c,v 1.17 2005/07/07 20:04:37 welling Exp $";
 
@@ -232,40 +132,10 @@ float weight[NWEIGHTS+1]; 	/* array which holds a sampled kaiser function -- it
 				   so we can do table-lookup instead of computing the kaiser
 				   function over and over */
 float maxk;			/* maximum magnitude in the t2k array */
+GridOp gop = { FALSE };	/* gridding operator kept between tasks */
 
 
 /* FORWARD DECLARATIONS */
-void MasterTask (const int argc, const char **argv, const char **envp);
-void ReadEnvironment ();
-void ProcessFile (const Filename input_file);
-void ReadFirstFileHeader (const Filename input_file);
-void CheckHeaderInfo (const Filename input_file);
-void ComputeCalibrationMap ();
-void LoadRegistrationData ();
-void CalculateLocation (float *p1, float *p2, float *p3, int rot, int trans);
-void CreateOutputDataset ();
-void SlaveFinalize();
-void SlaveContext ();
-void SlaveTask ();
-void LoadLinearReferenceData ();
-void LoadProjections ();
-void Refocus ();
-void FixViews ();
-void PerformGridding ();
-void FermiFilter1 ();
-void FermiFilter2 ();
-void WriteRaw ();
-void WriteSampleInfo (float **sampim);
-void WriteMagnitude ();
-void UncompressFile (Filename out, const Filename in);
-void RemoveFile (const Filename name);
-float kaiser (float l, float b, float u);
-float bessi0 (float x);
-int IntBRdFloat32 (unsigned char *addr);
-void PackContext();
-void UnpackContext();
-void PackTask();
-void UnpackTask();
 #ifdef AFS
 static int MySystem( const char* command );
 static int CheckForAFS( const char* fname );
@@ -915,6 +785,7 @@ SlaveFinalize()
   Free2DFloatArray(ws);
   if (in_buf != NULL)
     free(in_buf);
+  FreeGridOp();
 }
 
 void
@@ -941,6 +812,8 @@ SlaveContext ()
   Free2DFloatArray(ws);
   if (in_buf != NULL)
     free(in_buf);
+  /* the trajectory may have changed */
+  FreeGridOp();
 
   prd = Alloc3DFloatArray(2, c.npr, c.ndat);
   grim = Alloc3DFloatArray(2, c.os_res, c.os_res);
@@ -1215,6 +1088,23 @@ FixViews ()
 
 void
 PerformGridding ()
+{
+  /* Without registration the operator depends only on the trajectory
+     and the slice's linear reference data, so it serves every image
+     and coil of the slice.  Registration moves the samples of each
+     image differently, so those are still scattered one at a time. */
+  if (c.reg_file[0] != '\0')
+    GridDirectly();
+  else
+    {
+      if (!gop.valid || gop.refl1 != refl[1] || gop.refl2 != refl[2])
+	BuildGridOp();
+      ApplyGridOp();
+    }
+}
+
+void
+GridDirectly ()
 {
   int i, j;
   int lx, ly;
@@ -1329,6 +1219,225 @@ PerformGridding ()
     }
 }
 
+void
+FreeGridOp ()
+{
+  if (gop.rot != NULL)
+    free(gop.rot);
+  if (gop.start != NULL)
+    free(gop.start);
+  if (gop.samp != NULL)
+    free(gop.samp);
+  if (gop.w != NULL)
+    free(gop.w);
+  if (gop.wsum != NULL)
+    free(gop.wsum);
+  gop.rot = NULL;
+  gop.start = NULL;
+  gop.samp = NULL;
+  gop.w = NULL;
+  gop.wsum = NULL;
+  gop.valid = FALSE;
+}
+
+void
+BuildGridOp ()
+{
+  int i, j;
+  int s;
+  int e;
+  int lx, ly;
+  float kx, ky;
+  float w;
+  float mkr;
+  float dkx,dky;
+  float dwin;
+  float w2;
+  float wx;
+  float rotfact;
+  int maxj;
+  int shifted;
+  float *gx, *gy;	/* [nsamp] grid location of each sample */
+  int *next;		/* [ncells] next free entry of each cell */
+
+  FreeGridOp();
+  maxj = c.ndat - c.samp_delay - 2;
+  gop.nsamp = (maxj >= 0) ? c.npr*(maxj+1) : 0;
+  gop.ncells = c.os_res*c.os_res;
+  shifted = (c.lr_shift != 0 || c.tb_shift != 0 || c.loc_shift);
+  if ((gx = (float *) malloc((gop.nsamp+1)*sizeof(float))) == NULL ||
+      (gy = (float *) malloc((gop.nsamp+1)*sizeof(float))) == NULL ||
+      (next = (int *) malloc(gop.ncells*sizeof(int))) == NULL ||
+      (gop.start = (int *) calloc(gop.ncells+1, sizeof(int))) == NULL ||
+      (gop.wsum = (float *) calloc(gop.ncells, sizeof(float))) == NULL)
+    Abort("BuildGridOp: unable to allocate gridding operator\n");
+  if (shifted &&
+      (gop.rot = (float *) malloc(4*(gop.nsamp+1)*sizeof(float))) == NULL)
+    Abort("BuildGridOp: unable to allocate gridding operator\n");
+
+  /* place each sample on the grid and count the cells it reaches */
+  gop.maxk = 0.0;
+  dwin = c.wind;
+  rotfact = 2.0*PI / c.res / c.over_samp;
+  s = 0;
+  for (i = 0; i < c.npr; i++)
+    for (j=0; j <= maxj; j++, s++)
+      { 
+	kx = c.t2k[0][i][j];
+	ky = c.t2k[1][i][j];
+	if ( (mkr = hypot(kx,ky)) > gop.maxk)
+	  gop.maxk = mkr;
+	dkx = (c.factxx*kx + c.factxy*ky)*c.over_samp;
+	dky = (c.factyx*kx + c.factyy*ky)*c.over_samp;
+	if (shifted)
+	  {
+	    gop.rot[4*s] = cos(rotfact*dkx*(c.pix_shifth*c.res + c.lr_shift));
+	    gop.rot[4*s+1] = -sin(rotfact*dkx*(c.pix_shifth*c.res + c.lr_shift));
+	    gop.rot[4*s+2] = cos(rotfact*dky*(c.pix_shiftv*c.res + c.tb_shift));
+	    gop.rot[4*s+3] = -sin(rotfact*dky*(c.pix_shiftv*c.res + c.tb_shift));
+	  }
+	dkx += (c.res/2 - refl[2]*j)*c.over_samp; 
+	dky += (c.res/2 - refl[1]*j)*c.over_samp;
+	gx[s] = dkx;
+	gy[s] = dky;
+	for (lx = ceil(dkx-dwin); lx<=floor(dkx+dwin); lx++)
+	  {
+	    if ((lx<0) || (lx>=c.os_res))
+	      continue;
+	    for (ly = ceil(dky-dwin); ly<=floor(dky+dwin); ly++)
+	      {
+		if ((ly<0) || (ly>=c.os_res))
+		  continue;
+		gop.start[lx*c.os_res+ly+1]++;
+	      }
+	  }
+      }
+
+  for (e = 0; e < gop.ncells; e++)
+    {
+      gop.start[e+1] += gop.start[e];
+      next[e] = gop.start[e];
+    }
+  if ((gop.samp = (int *) malloc((gop.start[gop.ncells]+1)*sizeof(int)))
+      == NULL ||
+      (gop.w = (float *) malloc((gop.start[gop.ncells]+1)*sizeof(float)))
+      == NULL)
+    Abort("BuildGridOp: unable to allocate gridding operator\n");
+
+  /* fill in the weights; visiting the samples in order leaves the
+     entries of each cell in sample order */
+  s = 0;
+  for (i = 0; i < c.npr; i++)
+    for (j=0; j <= maxj; j++, s++)
+      {
+	w2 = c.kdens[j];
+	dkx = gx[s];
+	dky = gy[s];
+	for (lx = ceil(dkx-dwin); lx<=floor(dkx+dwin); lx++)
+	  {
+	    if ((lx<0) || (lx>=c.os_res))
+	      continue;
+	    wx = weight[ Round((((dkx-lx)/dwin)*NWEIGHTS/2 )) + NWEIGHTS/2] *w2;
+	    for (ly = ceil(dky-dwin); ly<=floor(dky+dwin); ly++)
+	      {
+		if ((ly<0) || (ly>=c.os_res))
+		  continue;
+		w = wx*weight[ Round((((dky-ly)/dwin)*NWEIGHTS/2 )) + NWEIGHTS/2];
+		e = next[lx*c.os_res+ly]++;
+		gop.samp[e] = s;
+		gop.w[e] = w;
+		gop.wsum[lx*c.os_res+ly] += w;
+	      }
+	  }
+      }
+
+  free(gx);
+  free(gy);
+  free(next);
+  gop.refl1 = refl[1];
+  gop.refl2 = refl[2];
+  gop.valid = TRUE;
+}
+
+void
+ApplyGridOp ()
+{
+  int i, j;
+  int s;
+  int e;
+  int cell;
+  int maxj;
+  float pr, pi;
+  float tmpd;
+  float gr, gi;
+  float *rot;
+  float *dr, *di;	/* [nsamp] phase-corrected samples */
+  float *sam;
+
+  maxj = c.ndat - c.samp_delay - 2;
+  if ((dr = (float *) malloc((gop.nsamp+1)*sizeof(float))) == NULL ||
+      (di = (float *) malloc((gop.nsamp+1)*sizeof(float))) == NULL)
+    Abort("ApplyGridOp: unable to allocate %d samples\n", gop.nsamp);
+
+  s = 0;
+  for (i = 0; i < c.npr; i++)
+    for (j=0; j <= maxj; j++, s++)
+      {
+	pr = prd[0][i][j+c.samp_delay];
+	pi = prd[1][i][j+c.samp_delay];
+	if (gop.rot != NULL)
+	  {
+	    rot = gop.rot + 4*s;
+	    tmpd = pr*rot[0] + pi*rot[1];
+	    pi = pi*rot[0] - pr*rot[1];
+	    pr = tmpd;
+
+	    tmpd = pr*rot[2] + pi*rot[3];
+	    pi = pi*rot[2] - pr*rot[3];
+	    pr = tmpd;
+	  }
+	dr[s] = pr;
+	di[s] = pi;
+      }
+
+  /* each cell gathers from its own samples, so no two cells touch
+     the same output */
+  for (cell = 0; cell < gop.ncells; cell++)
+    {
+      gr = 0.0;
+      gi = 0.0;
+      for (e = gop.start[cell]; e < gop.start[cell+1]; e++)
+	{
+	  gr += dr[gop.samp[e]] * gop.w[e];
+	  gi += di[gop.samp[e]] * gop.w[e];
+	}
+      grim[0][0][cell] = gr;
+      grim[1][0][cell] = gi;
+      ws[0][cell] = gop.wsum[cell];
+    }
+  maxk = gop.maxk;
+  free(dr);
+  free(di);
+
+  if (t.image_num == 0 && t.file_index == 0 && t.coil_num == 0)
+    {
+      float **sampim;	/* computation of this array may someday be
+			   moved into srecon */
+
+      sampim = Alloc2DFloatArray(c.os_res, c.os_res);
+      sam = sampim[0];
+      for (cell = 0; cell < gop.ncells; cell++)
+	{
+	  sam[cell] = 0.0;
+	  for (e = gop.start[cell]; e < gop.start[cell+1]; e++)
+	    sam[cell] += gop.w[e] * (gop.samp[e] % (maxj+1));
+	  sam[cell] /= (0.001+ws[0][cell]);
+	}
+      WriteSampleInfo(sampim);
+      Free2DFloatArray(sampim);
+    }
+}
+
 void
 FermiFilter1 ()
 {
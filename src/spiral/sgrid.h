@@ -0,0 +1,198 @@
+/*
+ *	sgrid.h
+ *
+ *    Header for "sgrid" program, q.v.
+ *
+ *    Copyright by Douglas C. Noll and the University of Pittsburgh and
+ *	  the Pittsburgh Supercomputing Center
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ *
+ *    HISTORY
+ *	split off from sgrid.c so that sgrid_tester can share it
+ */
+
+#include <math.h>
+#include "misc.h"
+
+#define NWEIGHTS	1024	/* # of times kaiser function is sampled */
+#define PI	M_PI
+
+#define SWAP(a,b) {tempr=(a);(a)=(b);(b)=tempr;}
+
+
+typedef struct Context {
+  /* NOTE: any new fields added to this struct should
+     be also added to PackContext and UnpackContext */ 
+  Filename input_directory;	/* where to find input files */
+  int big_endian_input;		/* TRUE if input is big-endian */
+  Filename tmp_directory;	/* where to place scratch files */
+  Filename output_directory;	/* where to place output files */
+  int big_endian_output;	/* TRUE if output if big-endian */
+
+  int nfiles;			/* # of input files */
+  int ncoils;			/* # of coils */
+  int nslices;			/* # of slices per coil */
+  int nimages;			/* # of images in data set (per coil) */
+  int nph1;			/* # of baselines per slice */
+  int nphmult;			/* # of images (phases) per baseline */
+  int npr;			/* # of projections (spirals) */
+  int ndat;			/* # of data items per projection */
+
+  int chop;			/* may be either 1 or -1 */
+  int risetime;			/* ??? */
+  int densamp;			/* ??? */
+
+  double ts;			/* ??? */
+  double gts;			/* ??? */ 
+  double fsgcm;			/* ??? */
+  double opfov;			/* ??? field-of-view */
+
+  float pix_shifth;		/* horizontal pixel shift */
+  float pix_shiftv;		/* vertical pixel shift */
+
+  int coil_record_length;	/* # of bytes in one coil record */
+  int slice_record_length;	/* # of bytes in one slice record */
+  int baseline_length;		/* # of bytes in one baseline record */
+
+  int res;			/* # of pixels along the X and Y dimensions */
+  int os_res;			/* # of pixels in the (possibly oversampled)
+				   input image ( =res*over_samp) */
+
+  int slice;			/* slice number to work on (0 indicates all slices) */
+  int samp_delay;		/* input delay expressed as # of samples */
+  int samp_cor;			/* 1 if sample density correction is to be done,
+				   0 if no correction is to be done */
+  float ph_twist;		/* phase twist */
+  int lr_shift;			/* left-right shift in pixels */
+  int tb_shift;			/* top-bottom shift in pixels */
+  int loc_shift;		/* 1 if location shift should be done
+				     to align slice according to information
+				     contained in the file header
+				   0 if no shift should be done */
+  float zoom;			/* zoom factor */
+  float mag_factor;		/* magnitude correction factor */
+  float ph_factor;		/* phase correction factor */
+
+  int start_slice;		/* starting slice number */
+  int end_slice;		/* ending slice number */
+
+  int lin_cor;			/* linear correction */
+
+  Filename reg_file;		/* registration file */
+  int reg_2x;			/* double translation in registration file */
+
+  int write_mag;		/* 1 if we should write magnitude files out
+				     as well as raw files;
+				   0 if we should only write raw files */
+
+  int over_samp;		/* oversampling ratio */
+  float grid_len;		/* grid length (half width of convolution) */
+  float gridb;
+  float wind;			/* window */
+
+  float factxx;			/* image rotation & scaling factors */
+  float factxy;
+  float factyx;
+  float factyy;
+
+/* variably-sized context info */
+  float ***t2k;			/* dimensioned as [2][npr][ndat] */
+  float *kdens;			/* dimensioned as [ndat] */
+} Context;
+
+typedef struct Task {
+  /* NOTE: any new fields added to this struct should
+     be also added to PackTask and UnpackTask */ 
+  int file_index;	/* counts which input file we are
+			   currently working on (0 => first) */
+  Filename filename;	/* input filename */
+
+  int coil_num;		/* coil number (first is 0) */
+  int slice_num;	/* slice number (first is 0) */
+  int image_num;	/* image number within a slice (first is 0) (corresponds to phase number in gsp14.c) */
+
+  float reg_xs;		/* the registration x-shift for this image */
+  float reg_ys;		/* the registration y-shift for this image */
+  float reg_rot;	/* the registration rotation for this image */
+} Task;
+
+typedef struct GridOp {
+  /* The gridding operator maps the samples of one image onto the
+     oversampled grid.  It is stored by grid cell (compressed sparse
+     rows), so each cell gathers from its samples in the order that
+     GridDirectly scatters them and the sums come out the same. */
+  int valid;		/* FALSE if the operator must be rebuilt */
+  float refl1;		/* linear reference data it was built for */
+  float refl2;
+  int nsamp;		/* # of samples gridded (npr*(maxj+1)) */
+  int ncells;		/* # of grid cells (os_res*os_res) */
+  float *rot;		/* [nsamp][4] phase rotations, or NULL */
+  int *start;		/* [ncells+1] first entry of each cell */
+  int *samp;		/* [nnz] sample which feeds each entry */
+  float *w;		/* [nnz] weight of each entry */
+  float *wsum;		/* [ncells] total weight of each cell */
+  float maxk;		/* maximum magnitude in the t2k array */
+} GridOp;
+
+/* GLOBAL VARIABLES FOR MASTER & SLAVE */
+extern Task t;
+extern Context c;
+
+/* GLOBAL VARIABLES FOR SLAVE */
+extern MRI_Dataset *rds;	/* the raw dataset to write into */
+extern float ***prd;		/* [2][npr][ndat]	projection data (input) */
+extern float ***grim;		/* [2][os_res][os_res]	gridded image data (output) */
+extern float **ws;		/* [os_res][os_res]	weighting array  */
+extern float refl[3];		/* reference location */
+extern float weight[NWEIGHTS+1]; /* sampled kaiser function */
+extern float maxk;		/* maximum magnitude in the t2k array */
+extern GridOp gop;		/* gridding operator kept between tasks */
+
+/* EXPORTED FUNCTIONS */
+void MasterTask (const int argc, const char **argv, const char **envp);
+void ReadEnvironment ();
+void ProcessFile (const Filename input_file);
+void ReadFirstFileHeader (const Filename input_file);
+void CheckHeaderInfo (const Filename input_file);
+void ComputeCalibrationMap ();
+void LoadRegistrationData ();
+void CalculateLocation (float *p1, float *p2, float *p3, int rot, int trans);
+void CreateOutputDataset ();
+void SlaveFinalize();
+void SlaveContext ();
+void SlaveTask ();
+void LoadLinearReferenceData ();
+void LoadProjections ();
+void Refocus ();
+void FixViews ();
+void PerformGridding ();
+void GridDirectly ();
+void BuildGridOp ();
+void ApplyGridOp ();
+void FreeGridOp ();
+void FermiFilter1 ();
+void FermiFilter2 ();
+void WriteRaw ();
+void WriteSampleInfo (float **sampim);
+void WriteMagnitude ();
+void UncompressFile (Filename out, const Filename in);
+void RemoveFile (const Filename name);
+float kaiser (float l, float b, float u);
+float bessi0 (float x);
+int IntBRdFloat32 (unsigned char *addr);
+void PackContext();
+void UnpackContext();
+void PackTask();
+void UnpackTask();
@@ -0,0 +1,218 @@
+/*
+ *	sgrid_tester.c
+ *
+ *    Consistency check for the gridding in sgrid.c
+ *
+ *    Copyright by Douglas C. Noll and the University of Pittsburgh and
+ *	  the Pittsburgh Supercomputing Center
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ *
+ *  sgrid_tester grids random data on a synthetic spiral trajectory
+ *  both directly and through the cached gridding operator, with and
+ *  without the phase shifts and the linear reference data, and
+ *  requires grim, ws, maxk and sampim to come out identical.  Each
+ *  case then grids a second data set through the operator it has
+ *  already built.  It is linked against a copy of sgrid.c whose main
+ *  has been renamed (see the Makefile).
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <unistd.h>
+#include <string.h>
+#include "array.h"
+#include "misc.h"
+#include "mri.h"
+#include "fmri.h"
+#include "sgrid.h"
+
+#define CHECK_NPR	8
+#define CHECK_NDAT	600
+#define CHECK_RES	32
+
+static void
+CheckTrajectory ()
+{
+  int i, j;
+  double f, th;
+
+  c.t2k = Alloc3DFloatArray(2, c.npr, c.ndat);
+  c.kdens = (float *) malloc(c.ndat*sizeof(float));
+  for (i = 0; i < c.npr; i++)
+    for (j = 0; j < c.ndat; j++)
+      {
+	f = (double) j / c.ndat;
+	th = 2.0*PI*(8.0*sqrt(f) + (double) i / c.npr);
+	c.t2k[0][i][j] = 0.5*c.res*sqrt(f)*cos(th);
+	c.t2k[1][i][j] = 0.5*c.res*sqrt(f)*sin(th);
+      }
+  for (j = 0; j < c.ndat; j++)
+    c.kdens[j] = 0.5 + drand48();
+}
+
+static void
+CheckProjections ()
+{
+  int i, j;
+
+  for (i = 0; i < c.npr; i++)
+    for (j = 0; j < c.ndat; j++)
+      {
+	prd[0][i][j] = drand48() - 0.5;
+	prd[1][i][j] = drand48() - 0.5;
+      }
+}
+
+static void
+ReadSampleInfo (float *sam)
+{
+  Filename dsn;
+  MRI_Dataset *ds;
+  long n;
+
+  /* the sample info is only visible once rds has been closed */
+  n = c.os_res*c.os_res;
+  mri_close_dataset(rds);
+  sprintf(dsn, "%s/raw.mri", c.output_directory);
+  ds = mri_open_dataset(dsn, MRI_READ);
+  memcpy(sam, mri_get_chunk(ds, "sampim", n, t.slice_num*n, MRI_FLOAT),
+	 n*sizeof(float));
+  mri_close_dataset(ds);
+  rds = mri_open_dataset(dsn, MRI_MODIFY_DATA);
+}
+
+static int
+CheckCase (const char *name, int shifted, float r1, float r2)
+{
+  long n, i;
+  long nbad;
+  int pass;
+  float *g, *w, *sam, *sam2;
+  float mk;
+
+  n = c.os_res*c.os_res;
+  g = (float *) malloc(2*n*sizeof(float));
+  w = (float *) malloc(n*sizeof(float));
+  sam = (float *) malloc(n*sizeof(float));
+  sam2 = (float *) malloc(n*sizeof(float));
+  if (g == NULL || w == NULL || sam == NULL || sam2 == NULL)
+    Abort("sgrid_tester: unable to allocate %ld cells\n", n);
+
+  c.lr_shift = shifted ? 1 : 0;
+  c.tb_shift = shifted ? -2 : 0;
+  c.pix_shifth = shifted ? 0.1 : 0.0;
+  c.pix_shiftv = shifted ? -0.05 : 0.0;
+  refl[1] = r1;
+  refl[2] = r2;
+  t.file_index = 0;
+  t.coil_num = 0;
+  t.slice_num = 0;
+  nbad = 0;
+  for (pass = 0; pass < 2; pass++)
+    {
+      /* the first pass builds the operator, the second reuses it */
+      t.image_num = pass;
+      CheckProjections();
+      GridDirectly();
+      memcpy(g, grim[0][0], n*sizeof(float));
+      memcpy(g+n, grim[1][0], n*sizeof(float));
+      memcpy(w, ws[0], n*sizeof(float));
+      mk = maxk;
+      if (pass == 0)
+	{
+	  ReadSampleInfo(sam);
+	  BuildGridOp();
+	}
+      ApplyGridOp();
+      if (pass == 0)
+	ReadSampleInfo(sam2);
+      for (i = 0; i < n; i++)
+	{
+	  if (g[i] != grim[0][0][i] || g[n+i] != grim[1][0][i] ||
+	      w[i] != ws[0][i])
+	    nbad++;
+	  if (pass == 0 && sam[i] != sam2[i])
+	    nbad++;
+	}
+      if (mk != maxk)
+	nbad++;
+    }
+  printf("%-24s %d nonzero weights, %ld mismatches   %s\n",
+	 name, gop.start[gop.ncells], nbad, (nbad == 0) ? "ok" : "FAILED");
+
+  free(g);
+  free(w);
+  free(sam);
+  free(sam2);
+  return (nbad != 0);
+}
+
+int
+main (int argc,
+      char **argv,
+      char **envp)
+{
+  char dir[] = "/tmp/sgrid_testerXXXXXX";
+  Filename fn;
+  int failures;
+
+  if (mkdtemp(dir) == NULL)
+    Abort("sgrid_tester: unable to create a scratch directory\n");
+  memset(&c, 0, sizeof(c));
+  strcpy(c.output_directory, dir);
+  c.nfiles = 1;
+  c.ncoils = 1;
+  c.nslices = 1;
+  c.nimages = 2;
+  c.npr = CHECK_NPR;
+  c.ndat = CHECK_NDAT;
+  c.samp_delay = 3;
+  c.res = CHECK_RES;
+  c.over_samp = 2;
+  c.os_res = c.over_samp*c.res;
+  c.grid_len = 1.5;
+  c.gridb = PI*c.grid_len;
+  c.wind = c.grid_len;
+  c.factxx = -1.0;
+  c.factyy = -1.0;
+  srand48(1234);
+  CheckTrajectory();
+  CreateOutputDataset();
+  SlaveContext();
+
+  failures = 0;
+  failures += CheckCase("plain", FALSE, 0.0, 0.0);
+  failures += CheckCase("shifted", TRUE, 0.0, 0.0);
+  failures += CheckCase("reference data", FALSE, 0.002, -0.0015);
+  failures += CheckCase("shifted, reference data", TRUE, -0.001, 0.0007);
+
+  SlaveFinalize();
+  sprintf(fn, "%s/raw.mri", dir);
+  RemoveFile(fn);
+  sprintf(fn, "%s/raw.dat", dir);
+  RemoveFile(fn);
+  sprintf(fn, "%s/raw.sam", dir);
+  RemoveFile(fn);
+  rmdir(dir);
+
+  if (failures)
+    {
+      printf("%d cases FAILED\n", failures);
+      exit(1);
+    }
+  printf("direct and operator gridding agree\n");
+  exit(0);
+}
@@ -37,6 +37,18 @@ extern int bio_error;		/* the bio package will set this variable to 1
 				   or writing; the user may reset this flag
 				   to 0 at any time */
 
+extern int bio_simd_level;	/* the instruction set used by the array
+				   byte-swapping and conversion routines;
+				   the bio package sets this to the best
+				   level the processor supports the first
+				   time it is needed (or to the smaller
+				   value given by the environment variable
+				   BIO_SIMD), and the user may lower it */
+#define BIO_SIMD_NONE		0
+#define BIO_SIMD_SSE2		1
+#define BIO_SIMD_SSSE3		2
+#define BIO_SIMD_AVX2		3
+
 /* Function to initialize endianness variables according to machine type */
 void InitBIO ();
 
@@ -103,3 +115,24 @@ void FRdFloat32Array (FILE *stream, float *a, long long n);
 void FWrFloat32Array (FILE *stream, float *a, long long n);
 void FRdFloat64Array (FILE *stream, double *a, long long n);
 void FWrFloat64Array (FILE *stream, double *a, long long n);
+
+/* Functions that convert arrays in memory between numeric types.  The
+   narrowing conversions clamp out-of-range values to the limits of the
+   destination type and return 1 if any value had to be clamped, 0
+   otherwise; NaNs are converted as a C cast would convert them.  If
+   keep_infinities is nonzero, BCvtFloat64ToFloat32Array passes
+   infinities through unchanged rather than clamping them to
+   +-FLT_MAX. */
+void BCvtInt16ToInt32Array (short *in, int *out, long long n);
+void BCvtInt16ToFloat32Array (short *in, float *out, long long n);
+void BCvtInt16ToFloat64Array (short *in, double *out, long long n);
+void BCvtInt32ToFloat32Array (int *in, float *out, long long n);
+void BCvtInt32ToFloat64Array (int *in, double *out, long long n);
+void BCvtFloat32ToFloat64Array (float *in, double *out, long long n);
+int BCvtInt32ToInt16Array (int *in, short *out, long long n);
+int BCvtFloat32ToInt16Array (float *in, short *out, long long n);
+int BCvtFloat32ToInt32Array (float *in, int *out, long long n);
+int BCvtFloat64ToInt16Array (double *in, short *out, long long n);
+int BCvtFloat64ToInt32Array (double *in, int *out, long long n);
+int BCvtFloat64ToFloat32Array (double *in, float *out, long long n,
+			       int keep_infinities);
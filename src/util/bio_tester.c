@@ -0,0 +1,294 @@
+/************************************************************
+ *                                                          *
+ *  Permission is hereby granted to any individual or       *
+ *  institution for use, copying, or redistribution of      *
+ *  this code and associated documentation, provided        *
+ *  that such code and documentation are not sold for       *
+ *  profit and the following copyright notice is retained   *
+ *  in the code and documentation:                          *
+ *                                                          *
+ *     Copyright (c) 1999 Carnegie Mellon University        *
+ *                                                          *
+ *  This program is distributed in the hope that it will    *
+ *  be useful, but WITHOUT ANY WARRANTY; without even the   *
+ *  implied warranty of MERCHANTABILITY or FITNESS FOR A    *
+ *  PARTICULAR PURPOSE.  Neither Carnegie Mellon University *
+ *  nor any of the authors assume any liability for         *
+ *  damages, incidental or otherwise, caused by the         *
+ *  installation or use of this software.                   *
+ *                                                          *
+ *  CLINICAL APPLICATIONS ARE NOT RECOMMENDED, AND THIS     *
+ *  SOFTWARE HAS NOT BEEN EVALUATED BY THE UNITED STATES    *
+ *  FDA FOR ANY CLINICAL USE.                               *
+ *                                                          *
+ ***********************************************************/
+/*
+ *	bio_tester.c - check and time the libbio array kernels
+ *
+ *	usage: bio_tester [nelements [reps]]
+ *
+ *	Each byte-swapping and conversion routine is run once with
+ *	bio_simd_level forced to BIO_SIMD_NONE and once at the best
+ *	level the processor supports, and the intermediate levels
+ *	are checked as well.  All outputs (and the out-of-range
+ *	flags) must agree bit for bit with the scalar ones; the input data
+ *	include values that saturate, NaNs and infinities.  The
+ *	throughput of each version is reported in MB/s of input.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <sys/time.h>
+#include "bio.h"
+
+typedef enum { T_INT16, T_INT32, T_FLOAT32, T_FLOAT64 } Type;
+
+static int type_size[] = { 2, 4, 4, 8 };
+
+static long long n = 1000003;	/* deliberately not a multiple of 32 */
+static int reps = 20;
+static int failures = 0;
+
+static double
+Now ()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return(tv.tv_sec + 1.0e-6*tv.tv_usec);
+}
+
+static void
+Fill (void *buf, Type t, long long count)
+{
+  long long i;
+  double v;
+
+  for (i = 0; i < count; ++i)
+    {
+      /* mostly in-range values, with occasional extreme ones */
+      v = (drand48() - 0.5) * 70000.0;
+      if (i % 97 == 0)
+	v *= 1.0e6;
+      if (i % 1009 == 0)
+	v *= 1.0e40;
+      switch (t)
+	{
+	case T_INT16:
+	  ((short *) buf)[i] = (short) (rand() & 0xffff);
+	  break;
+	case T_INT32:
+	  ((int *) buf)[i] = (i % 13 == 0) ? (int) (rand() - RAND_MAX/2)
+	    : (int) (v / 1.5);
+	  break;
+	case T_FLOAT32:
+	  ((float *) buf)[i] = (i % 1009 == 0) ? (float) HUGE_VAL
+	    : (float) (v / 1.0e3);
+	  if (i % 89 == 0) ((float *) buf)[i] *= 1.0e6;
+	  break;
+	case T_FLOAT64:
+	  ((double *) buf)[i] = v;
+	  break;
+	}
+    }
+  /* special values */
+  if (t == T_FLOAT32 && count > 40)
+    {
+      ((float *) buf)[3] = (float) nan("");
+      ((float *) buf)[17] = (float) -HUGE_VAL;
+      ((float *) buf)[18] = 2147483648.0f;
+      ((float *) buf)[19] = -2147483648.0f;
+      ((float *) buf)[20] = 32767.5f;
+      ((float *) buf)[21] = -32768.5f;
+      ((float *) buf)[22] = -32769.0f;
+    }
+  if (t == T_FLOAT64 && count > 40)
+    {
+      ((double *) buf)[3] = nan("");
+      ((double *) buf)[16] = HUGE_VAL;
+      ((double *) buf)[17] = -HUGE_VAL;
+      ((double *) buf)[18] = 2147483647.5;
+      ((double *) buf)[19] = -2147483648.5;
+      ((double *) buf)[20] = (double) FLT_MAX * 1.0000001;
+      ((double *) buf)[21] = -(double) FLT_MAX;
+    }
+}
+
+/* Runs conversion number op from in to out; returns the range flag */
+static int
+Convert (int op, void *in, void *out)
+{
+  switch (op)
+    {
+    case 0: BCvtInt16ToInt32Array(in, out, n); return(0);
+    case 1: BCvtInt16ToFloat32Array(in, out, n); return(0);
+    case 2: BCvtInt16ToFloat64Array(in, out, n); return(0);
+    case 3: BCvtInt32ToFloat32Array(in, out, n); return(0);
+    case 4: BCvtInt32ToFloat64Array(in, out, n); return(0);
+    case 5: BCvtFloat32ToFloat64Array(in, out, n); return(0);
+    case 6: return(BCvtInt32ToInt16Array(in, out, n));
+    case 7: return(BCvtFloat32ToInt16Array(in, out, n));
+    case 8: return(BCvtFloat32ToInt32Array(in, out, n));
+    case 9: return(BCvtFloat64ToInt16Array(in, out, n));
+    case 10: return(BCvtFloat64ToInt32Array(in, out, n));
+    case 11: return(BCvtFloat64ToFloat32Array(in, out, n, 0));
+    case 12: return(BCvtFloat64ToFloat32Array(in, out, n, 1));
+    }
+  return(0);
+}
+
+static struct {
+  char *name;
+  Type in;
+  Type out;
+} conversions[] = {
+  { "int16->int32", T_INT16, T_INT32 },
+  { "int16->float32", T_INT16, T_FLOAT32 },
+  { "int16->float64", T_INT16, T_FLOAT64 },
+  { "int32->float32", T_INT32, T_FLOAT32 },
+  { "int32->float64", T_INT32, T_FLOAT64 },
+  { "float32->float64", T_FLOAT32, T_FLOAT64 },
+  { "int32->int16", T_INT32, T_INT16 },
+  { "float32->int16", T_FLOAT32, T_INT16 },
+  { "float32->int32", T_FLOAT32, T_INT32 },
+  { "float64->int16", T_FLOAT64, T_INT16 },
+  { "float64->int32", T_FLOAT64, T_INT32 },
+  { "float64->float32", T_FLOAT64, T_FLOAT32 },
+  { "float64->float32 (keep inf)", T_FLOAT64, T_FLOAT32 }
+};
+
+/* Byte swaps through the BRd*Array routines */
+static void
+Swap (Type t, void *in, void *out)
+{
+  switch (t)
+    {
+    case T_INT16: BRdInt16Array(in, out, n); break;
+    case T_INT32: BRdInt32Array(in, out, n); break;
+    case T_FLOAT32: BRdFloat32Array(in, out, n); break;
+    case T_FLOAT64: BRdFloat64Array(in, out, n); break;
+    }
+}
+
+static void
+Report (char *name, long long nbytes, int best, double t_scalar,
+	double t_simd, int ok)
+{
+  printf("%-28s scalar %8.1f MB/s   level %d %8.1f MB/s   %s\n",
+	 name, nbytes/(1.0e6*t_scalar), best, nbytes/(1.0e6*t_simd),
+	 ok ? "ok" : "MISMATCH");
+  if (!ok)
+    ++failures;
+}
+
+int
+main (int argc, char **argv)
+{
+  unsigned char *in, *out_ref, *out_simd;
+  int best, level, op, r, ok;
+  int flag_ref = 0, flag_simd = 0;
+  Type t;
+  double t0, t_scalar, t_simd;
+  static char *swap_names[] = { "swap int16", "swap int32",
+				"swap float32", "swap float64" };
+
+  if (argc > 1)
+    n = atoll(argv[1]);
+  if (argc > 2)
+    reps = atoi(argv[2]);
+  if (n <= 0 || reps <= 0)
+    {
+      fprintf(stderr, "usage: %s [nelements [reps]]\n", argv[0]);
+      exit(-1);
+    }
+
+  InitBIO();
+  bio_simd_level = -1;
+  BCvtInt16ToInt32Array(NULL, NULL, 0);	/* forces level detection */
+  best = bio_simd_level;
+  printf("SIMD level %d, %lld elements, %d repetitions\n", best, n, reps);
+
+  in = (unsigned char *) malloc(8*n);
+  out_ref = (unsigned char *) malloc(8*n);
+  out_simd = (unsigned char *) malloc(8*n);
+  if (in == NULL || out_ref == NULL || out_simd == NULL)
+    {
+      fprintf(stderr, "%s: unable to allocate buffers\n", argv[0]);
+      exit(-1);
+    }
+
+  for (op = 0; op < sizeof(conversions)/sizeof(conversions[0]); ++op)
+    {
+      Fill(in, conversions[op].in, n);
+      memset(out_ref, 0, 8*n);
+      memset(out_simd, 0xff, 8*n);
+
+      bio_simd_level = BIO_SIMD_NONE;
+      t0 = Now();
+      for (r = 0; r < reps; ++r)
+	flag_ref = Convert(op, in, out_ref);
+      t_scalar = (Now() - t0)/reps;
+
+      bio_simd_level = best;
+      t0 = Now();
+      for (r = 0; r < reps; ++r)
+	flag_simd = Convert(op, in, out_simd);
+      t_simd = (Now() - t0)/reps;
+
+      ok = (flag_ref == flag_simd &&
+	    !memcmp(out_ref, out_simd, n*type_size[conversions[op].out]));
+      for (level = BIO_SIMD_SSE2; level < best; ++level)
+	{
+	  bio_simd_level = level;
+	  memset(out_simd, 0xff, 8*n);
+	  if (Convert(op, in, out_simd) != flag_ref ||
+	      memcmp(out_ref, out_simd, n*type_size[conversions[op].out]))
+	    ok = 0;
+	}
+      Report(conversions[op].name, n*type_size[conversions[op].in], best,
+	     t_scalar, t_simd, ok);
+    }
+
+  bio_big_endian_input = !bio_big_endian_machine;
+  for (t = T_INT16; t <= T_FLOAT64; ++t)
+    {
+      Fill(in, t, n);
+      memset(out_simd, 0, 8*n);
+
+      bio_simd_level = BIO_SIMD_NONE;
+      t0 = Now();
+      for (r = 0; r < reps; ++r)
+	Swap(t, in, out_ref);
+      t_scalar = (Now() - t0)/reps;
+
+      bio_simd_level = best;
+      t0 = Now();
+      for (r = 0; r < reps; ++r)
+	Swap(t, in, out_simd);
+      t_simd = (Now() - t0)/reps;
+
+      ok = !memcmp(out_ref, out_simd, n*type_size[t]);
+      for (level = BIO_SIMD_SSE2; level < best; ++level)
+	{
+	  bio_simd_level = level;
+	  memset(out_simd, 0, 8*n);
+	  Swap(t, in, out_simd);
+	  if (memcmp(out_ref, out_simd, n*type_size[t]))
+	    ok = 0;
+	}
+      Report(swap_names[t], n*type_size[t], best, t_scalar, t_simd, ok);
+    }
+  bio_big_endian_input = bio_big_endian_machine;
+
+  if (failures)
+    {
+      printf("%d kernels FAILED\n", failures);
+      exit(1);
+    }
+  printf("all kernels agree\n");
+  return(0);
+}
@@ -27,6 +27,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
 #include "bio.h"
 
 /* Unless otherwise specified, we do all I/O in native-endian format */
@@ -104,6 +107,1004 @@ InitBIO ()
   }
 }
 
+/*
+ * Vector kernels
+ *
+ * The byte-swapping and type conversion loops below are the innermost
+ * loops of nearly every libmri read or write, so on x86 processors we
+ * provide SSE2, SSSE3 and AVX2 versions of them.  The version actually
+ * used is chosen at run time according to bio_simd_level, which is
+ * set from the CPU's capabilities the first time any kernel is called.
+ * The environment variable BIO_SIMD may be set to a smaller level
+ * (0 = scalar code only) to force the use of the simpler routines.
+ *
+ * Every vector kernel must produce exactly the same bits as its scalar
+ * counterpart, including the treatment of NaNs and of values that
+ * saturate on narrowing conversions.
+ *
+ * The AVX2 kernels end with _mm256_zeroupper().  gcc only inserts it
+ * automatically when optimizing at -O2 or above, and returning with
+ * the upper halves of the ymm registers dirty makes every later
+ * legacy SSE instruction in the caller (libm included) pay an
+ * AVX-SSE transition penalty.
+ */
+
+#if defined(__GNUC__) && (__GNUC__ >= 5) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define BIO_X86_SIMD
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+int bio_simd_level = -1;
+
+static int
+SimdLevel ()
+{
+  int level;
+  char *s;
+
+  if (bio_simd_level >= 0)
+    return(bio_simd_level);
+  level = BIO_SIMD_NONE;
+#ifdef BIO_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    level = BIO_SIMD_AVX2;
+  else if (__builtin_cpu_supports("ssse3"))
+    level = BIO_SIMD_SSSE3;
+  else if (__builtin_cpu_supports("sse2"))
+    level = BIO_SIMD_SSE2;
+#endif
+  if ((s = getenv("BIO_SIMD")) != NULL && atoi(s) < level)
+    level = (atoi(s) > 0) ? atoi(s) : BIO_SIMD_NONE;
+  bio_simd_level = level;
+  return(level);
+}
+
+/* Byte reversal of n elements of the given size; dest may equal src */
+static void
+SwapScalar (unsigned char *dest,
+	    unsigned char *src,
+	    long long n,
+	    int size)
+{
+  long long i, len;
+  unsigned char t0, t1, t2, t3;
+
+  len = size*n;
+  switch (size)
+    {
+    case 2:
+      for (i = 0; i < len; i += 2)
+	{
+	  t0 = src[i];
+	  dest[i] = src[i+1];
+	  dest[i+1] = t0;
+	}
+      break;
+    case 4:
+      for (i = 0; i < len; i += 4)
+	{
+	  t0 = src[i];
+	  t1 = src[i+1];
+	  dest[i] = src[i+3];
+	  dest[i+1] = src[i+2];
+	  dest[i+2] = t1;
+	  dest[i+3] = t0;
+	}
+      break;
+    case 8:
+      for (i = 0; i < len; i += 8)
+	{
+	  t0 = src[i];
+	  t1 = src[i+1];
+	  t2 = src[i+2];
+	  t3 = src[i+3];
+	  dest[i] = src[i+7];
+	  dest[i+1] = src[i+6];
+	  dest[i+2] = src[i+5];
+	  dest[i+3] = src[i+4];
+	  dest[i+4] = t3;
+	  dest[i+5] = t2;
+	  dest[i+6] = t1;
+	  dest[i+7] = t0;
+	}
+      break;
+    }
+}
+
+#ifdef BIO_X86_SIMD
+static TARGET_SSE2 long long
+Swap2SSE2 (unsigned char *dest,
+	   unsigned char *src,
+	   long long n)
+{
+  long long i;
+  __m128i v;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      v = _mm_loadu_si128((__m128i *) (src + 2*i));
+      v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+      _mm_storeu_si128((__m128i *) (dest + 2*i), v);
+    }
+  return(i);
+}
+
+static TARGET_SSSE3 long long
+SwapSSSE3 (unsigned char *dest,
+	   unsigned char *src,
+	   long long n,
+	   int size)
+{
+  long long i, nbytes;
+  __m128i mask, v;
+
+  if (size == 2)
+    mask = _mm_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+  else if (size == 4)
+    mask = _mm_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+  else
+    mask = _mm_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8);
+  nbytes = (n*size) & ~15LL;
+  for (i = 0; i < nbytes; i += 16)
+    {
+      v = _mm_loadu_si128((__m128i *) (src + i));
+      _mm_storeu_si128((__m128i *) (dest + i), _mm_shuffle_epi8(v, mask));
+    }
+  return(nbytes/size);
+}
+
+static TARGET_AVX2 long long
+SwapAVX2 (unsigned char *dest,
+	  unsigned char *src,
+	  long long n,
+	  int size)
+{
+  long long i, nbytes;
+  __m256i mask, v;
+
+  if (size == 2)
+    mask = _mm256_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+			    1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+  else if (size == 4)
+    mask = _mm256_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+			    3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+  else
+    mask = _mm256_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8,
+			    7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8);
+  nbytes = (n*size) & ~31LL;
+  for (i = 0; i < nbytes; i += 32)
+    {
+      v = _mm256_loadu_si256((__m256i *) (src + i));
+      _mm256_storeu_si256((__m256i *) (dest + i),
+			  _mm256_shuffle_epi8(v, mask));
+    }
+  _mm256_zeroupper();
+  return(nbytes/size);
+}
+#endif
+
+/* Copies n elements of the given size (2, 4, or 8 bytes) from src to
+   dest, reversing the byte order of each; dest may equal src */
+static void
+SwapCopy (unsigned char *dest,
+	  unsigned char *src,
+	  long long n,
+	  int size)
+{
+  long long done = 0;
+
+#ifdef BIO_X86_SIMD
+  switch (SimdLevel())
+    {
+    case BIO_SIMD_AVX2:
+      done = SwapAVX2(dest, src, n, size);
+      break;
+    case BIO_SIMD_SSSE3:
+      done = SwapSSSE3(dest, src, n, size);
+      break;
+    case BIO_SIMD_SSE2:
+      if (size == 2)
+	done = Swap2SSE2(dest, src, n);
+      break;
+    }
+#endif
+  SwapScalar(dest + size*done, src + size*done, n - done, size);
+}
+
+/*
+ * Conversion kernels.  The scalar versions define the semantics; the
+ * narrowing conversions clamp out-of-range values to the limits of the
+ * destination type and return 1 if any clamping occurred.
+ */
+
+static void
+CvtInt16ToInt32Scalar (short *in, int *out, long long n)
+{
+  long long i;
+
+  for (i = 0; i < n; ++i) out[i] = in[i];
+}
+
+static void
+CvtInt16ToFloat32Scalar (short *in, float *out, long long n)
+{
+  long long i;
+
+  for (i = 0; i < n; ++i) out[i] = in[i];
+}
+
+static void
+CvtInt16ToFloat64Scalar (short *in, double *out, long long n)
+{
+  long long i;
+
+  for (i = 0; i < n; ++i) out[i] = in[i];
+}
+
+static void
+CvtInt32ToFloat32Scalar (int *in, float *out, long long n)
+{
+  long long i;
+
+  for (i = 0; i < n; ++i) out[i] = in[i];
+}
+
+static void
+CvtInt32ToFloat64Scalar (int *in, double *out, long long n)
+{
+  long long i;
+
+  for (i = 0; i < n; ++i) out[i] = in[i];
+}
+
+static void
+CvtFloat32ToFloat64Scalar (float *in, double *out, long long n)
+{
+  long long i;
+
+  for (i = 0; i < n; ++i) out[i] = in[i];
+}
+
+static int
+CvtInt32ToInt16Scalar (int *in, short *out, long long n)
+{
+  long long i;
+  int err = 0;
+
+  for (i = 0; i < n; ++i)
+    if (in[i] < SHRT_MIN)
+      {
+	out[i] = SHRT_MIN;
+	err = 1;
+      }
+    else if (in[i] > SHRT_MAX)
+      {
+	out[i] = SHRT_MAX;
+	err = 1;
+      }
+    else out[i] = in[i];
+  return(err);
+}
+
+static int
+CvtFloat32ToInt16Scalar (float *in, short *out, long long n)
+{
+  long long i;
+  int err = 0;
+
+  for (i = 0; i < n; ++i)
+    if (in[i] < (float) SHRT_MIN)
+      {
+	out[i] = SHRT_MIN;
+	err = 1;
+      }
+    else if (in[i] > (float) SHRT_MAX)
+      {
+	out[i] = SHRT_MAX;
+	err = 1;
+      }
+    else out[i] = (int) in[i];
+  return(err);
+}
+
+static int
+CvtFloat32ToInt32Scalar (float *in, int *out, long long n)
+{
+  long long i;
+  int err = 0;
+
+  for (i = 0; i < n; ++i)
+    if (in[i] < (float) INT_MIN)
+      {
+	out[i] = INT_MIN;
+	err = 1;
+      }
+    else if (in[i] > (float) INT_MAX)
+      {
+	out[i] = INT_MAX;
+	err = 1;
+      }
+    else out[i] = in[i];
+  return(err);
+}
+
+static int
+CvtFloat64ToInt16Scalar (double *in, short *out, long long n)
+{
+  long long i;
+  int err = 0;
+
+  for (i = 0; i < n; ++i)
+    if (in[i] < (double) SHRT_MIN)
+      {
+	out[i] = SHRT_MIN;
+	err = 1;
+      }
+    else if (in[i] > (double) SHRT_MAX)
+      {
+	out[i] = SHRT_MAX;
+	err = 1;
+      }
+    else out[i] = (int) in[i];
+  return(err);
+}
+
+static int
+CvtFloat64ToInt32Scalar (double *in, int *out, long long n)
+{
+  long long i;
+  int err = 0;
+
+  for (i = 0; i < n; ++i)
+    if (in[i] < (double) INT_MIN)
+      {
+	out[i] = INT_MIN;
+	err = 1;
+      }
+    else if (in[i] > (double) INT_MAX)
+      {
+	out[i] = INT_MAX;
+	err = 1;
+      }
+    else out[i] = in[i];
+  return(err);
+}
+
+static int
+CvtFloat64ToFloat32Scalar (double *in, float *out, long long n,
+			   int keep_infinities)
+{
+  long long i;
+  int err = 0;
+
+  for (i = 0; i < n; ++i)
+    if (keep_infinities && (in[i] == HUGE_VAL || in[i] == -HUGE_VAL))
+      out[i] = (float) in[i];
+    else if (in[i] < -FLT_MAX)
+      {
+	out[i] = -FLT_MAX;
+	err = 1;
+      }
+    else if (in[i] > FLT_MAX)
+      {
+	out[i] = FLT_MAX;
+	err = 1;
+      }
+    else out[i] = (float) in[i];
+  return(err);
+}
+
+#ifdef BIO_X86_SIMD
+
+/* select a where mask is set, b elsewhere */
+#define SEL_PS(m,a,b) _mm_or_ps(_mm_and_ps(m,a), _mm_andnot_ps(m,b))
+#define SEL_PD(m,a,b) _mm_or_pd(_mm_and_pd(m,a), _mm_andnot_pd(m,b))
+#define SEL_SI(m,a,b) \
+  _mm_or_si128(_mm_and_si128(m,a), _mm_andnot_si128(m,b))
+
+/* Truncation of int32 lanes to their low 16 bits, sign extended, so
+   that a following saturating pack behaves like a C cast to short;
+   this matters only for NaN lanes, which convert to INT_MIN */
+#define LOW16_EPI32(v) _mm_srai_epi32(_mm_slli_epi32(v, 16), 16)
+
+static TARGET_SSE2 long long
+CvtInt16ToInt32SSE2 (short *in, int *out, long long n)
+{
+  long long i;
+  __m128i v;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      v = _mm_loadu_si128((__m128i *) (in + i));
+      _mm_storeu_si128((__m128i *) (out + i),
+		       _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+      _mm_storeu_si128((__m128i *) (out + i + 4),
+		       _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+    }
+  return(i);
+}
+
+static TARGET_SSE2 long long
+CvtInt16ToFloat32SSE2 (short *in, float *out, long long n)
+{
+  long long i;
+  __m128i v;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      v = _mm_loadu_si128((__m128i *) (in + i));
+      _mm_storeu_ps(out + i,
+		    _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v),
+						   16)));
+      _mm_storeu_ps(out + i + 4,
+		    _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v),
+						   16)));
+    }
+  return(i);
+}
+
+static TARGET_SSE2 long long
+CvtInt16ToFloat64SSE2 (short *in, double *out, long long n)
+{
+  long long i;
+  __m128i v;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      v = _mm_loadl_epi64((__m128i *) (in + i));
+      v = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+      _mm_storeu_pd(out + i, _mm_cvtepi32_pd(v));
+      _mm_storeu_pd(out + i + 2, _mm_cvtepi32_pd(_mm_srli_si128(v, 8)));
+    }
+  return(i);
+}
+
+static TARGET_SSE2 long long
+CvtInt32ToFloat32SSE2 (int *in, float *out, long long n)
+{
+  long long i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    _mm_storeu_ps(out + i,
+		  _mm_cvtepi32_ps(_mm_loadu_si128((__m128i *) (in + i))));
+  return(i);
+}
+
+static TARGET_SSE2 long long
+CvtInt32ToFloat64SSE2 (int *in, double *out, long long n)
+{
+  long long i;
+
+  for (i = 0; i + 2 <= n; i += 2)
+    _mm_storeu_pd(out + i,
+		  _mm_cvtepi32_pd(_mm_loadl_epi64((__m128i *) (in + i))));
+  return(i);
+}
+
+static TARGET_SSE2 long long
+CvtFloat32ToFloat64SSE2 (float *in, double *out, long long n)
+{
+  long long i;
+
+  for (i = 0; i + 2 <= n; i += 2)
+    _mm_storeu_pd(out + i,
+		  _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((__m128i *)
+								(in + i)))));
+  return(i);
+}
+
+static TARGET_SSE2 long long
+CvtInt32ToInt16SSE2 (int *in, short *out, long long n, int *err)
+{
+  long long i;
+  __m128i a, b, lo, hi, bad;
+
+  lo = _mm_set1_epi32(SHRT_MIN);
+  hi = _mm_set1_epi32(SHRT_MAX);
+  bad = _mm_setzero_si128();
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      a = _mm_loadu_si128((__m128i *) (in + i));
+      b = _mm_loadu_si128((__m128i *) (in + i + 4));
+      bad = _mm_or_si128(bad, _mm_or_si128(_mm_cmplt_epi32(a, lo),
+					   _mm_cmpgt_epi32(a, hi)));
+      bad = _mm_or_si128(bad, _mm_or_si128(_mm_cmplt_epi32(b, lo),
+					   _mm_cmpgt_epi32(b, hi)));
+      _mm_storeu_si128((__m128i *) (out + i), _mm_packs_epi32(a, b));
+    }
+  if (_mm_movemask_epi8(bad))
+    *err = 1;
+  return(i);
+}
+
+static TARGET_SSE2 __m128i
+Float32ToInt16LanesSSE2 (__m128 x, __m128 *bad)
+{
+  __m128 lo, hi, mlo, mhi;
+
+  lo = _mm_set1_ps((float) SHRT_MIN);
+  hi = _mm_set1_ps((float) SHRT_MAX);
+  mlo = _mm_cmplt_ps(x, lo);
+  mhi = _mm_cmpgt_ps(x, hi);
+  *bad = _mm_or_ps(*bad, _mm_or_ps(mlo, mhi));
+  x = SEL_PS(mlo, lo, SEL_PS(mhi, hi, x));
+  return(LOW16_EPI32(_mm_cvttps_epi32(x)));
+}
+
+static TARGET_SSE2 long long
+CvtFloat32ToInt16SSE2 (float *in, short *out, long long n, int *err)
+{
+  long long i;
+  __m128i a, b;
+  __m128 bad;
+
+  bad = _mm_setzero_ps();
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      a = Float32ToInt16LanesSSE2(_mm_loadu_ps(in + i), &bad);
+      b = Float32ToInt16LanesSSE2(_mm_loadu_ps(in + i + 4), &bad);
+      _mm_storeu_si128((__m128i *) (out + i), _mm_packs_epi32(a, b));
+    }
+  if (_mm_movemask_ps(bad))
+    *err = 1;
+  return(i);
+}
+
+static TARGET_SSE2 long long
+CvtFloat32ToInt32SSE2 (float *in, int *out, long long n, int *err)
+{
+  long long i;
+  __m128 x, mlo, mhi, bad;
+  __m128i v;
+
+  bad = _mm_setzero_ps();
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      x = _mm_loadu_ps(in + i);
+      mlo = _mm_cmplt_ps(x, _mm_set1_ps((float) INT_MIN));
+      mhi = _mm_cmpgt_ps(x, _mm_set1_ps((float) INT_MAX));
+      bad = _mm_or_ps(bad, _mm_or_ps(mlo, mhi));
+      /* cvttps already yields INT_MIN for the low out-of-range lanes */
+      v = SEL_SI(_mm_castps_si128(mhi), _mm_set1_epi32(INT_MAX),
+		 _mm_cvttps_epi32(x));
+      _mm_storeu_si128((__m128i *) (out + i), v);
+    }
+  if (_mm_movemask_ps(bad))
+    *err = 1;
+  return(i);
+}
+
+static TARGET_SSE2 __m128i
+Float64ToInt32LanesSSE2 (__m128d x, double low, double high, __m128d *bad)
+{
+  __m128d lo, hi, mlo, mhi;
+
+  lo = _mm_set1_pd(low);
+  hi = _mm_set1_pd(high);
+  mlo = _mm_cmplt_pd(x, lo);
+  mhi = _mm_cmpgt_pd(x, hi);
+  *bad = _mm_or_pd(*bad, _mm_or_pd(mlo, mhi));
+  x = SEL_PD(mlo, lo, SEL_PD(mhi, hi, x));
+  return(_mm_cvttpd_epi32(x));
+}
+
+static TARGET_SSE2 long long
+CvtFloat64ToInt16SSE2 (double *in, short *out, long long n, int *err)
+{
+  long long i;
+  __m128i a, b;
+  __m128d bad;
+
+  bad = _mm_setzero_pd();
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      a = Float64ToInt32LanesSSE2(_mm_loadu_pd(in + i),
+				  SHRT_MIN, SHRT_MAX, &bad);
+      b = Float64ToInt32LanesSSE2(_mm_loadu_pd(in + i + 2),
+				  SHRT_MIN, SHRT_MAX, &bad);
+      a = LOW16_EPI32(_mm_unpacklo_epi64(a, b));
+      _mm_storel_epi64((__m128i *) (out + i), _mm_packs_epi32(a, a));
+    }
+  if (_mm_movemask_pd(bad))
+    *err = 1;
+  return(i);
+}
+
+static TARGET_SSE2 long long
+CvtFloat64ToInt32SSE2 (double *in, int *out, long long n, int *err)
+{
+  long long i;
+  __m128i a, b;
+  __m128d bad;
+
+  bad = _mm_setzero_pd();
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      a = Float64ToInt32LanesSSE2(_mm_loadu_pd(in + i),
+				  INT_MIN, INT_MAX, &bad);
+      b = Float64ToInt32LanesSSE2(_mm_loadu_pd(in + i + 2),
+				  INT_MIN, INT_MAX, &bad);
+      _mm_storeu_si128((__m128i *) (out + i), _mm_unpacklo_epi64(a, b));
+    }
+  if (_mm_movemask_pd(bad))
+    *err = 1;
+  return(i);
+}
+
+static TARGET_SSE2 long long
+CvtFloat64ToFloat32SSE2 (double *in, float *out, long long n,
+			 int keep_infinities, int *err)
+{
+  long long i;
+  __m128d x, lo, hi, mlo, mhi, bad;
+  __m128 a;
+
+  lo = _mm_set1_pd(-FLT_MAX);
+  hi = _mm_set1_pd(FLT_MAX);
+  bad = _mm_setzero_pd();
+  for (i = 0; i + 2 <= n; i += 2)
+    {
+      x = _mm_loadu_pd(in + i);
+      mlo = _mm_cmplt_pd(x, lo);
+      mhi = _mm_cmpgt_pd(x, hi);
+      if (keep_infinities)
+	{
+	  mlo = _mm_and_pd(mlo, _mm_cmpneq_pd(x, _mm_set1_pd(-HUGE_VAL)));
+	  mhi = _mm_and_pd(mhi, _mm_cmpneq_pd(x, _mm_set1_pd(HUGE_VAL)));
+	}
+      bad = _mm_or_pd(bad, _mm_or_pd(mlo, mhi));
+      x = SEL_PD(mlo, lo, SEL_PD(mhi, hi, x));
+      a = _mm_cvtpd_ps(x);
+      _mm_storel_epi64((__m128i *) (out + i), _mm_castps_si128(a));
+    }
+  if (_mm_movemask_pd(bad))
+    *err = 1;
+  return(i);
+}
+
+static TARGET_AVX2 long long
+CvtInt16ToInt32AVX2 (short *in, int *out, long long n)
+{
+  long long i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    _mm256_storeu_si256((__m256i *) (out + i),
+			_mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *)
+							      (in + i))));
+  _mm256_zeroupper();
+  return(i);
+}
+
+static TARGET_AVX2 long long
+CvtInt16ToFloat32AVX2 (short *in, float *out, long long n)
+{
+  long long i;
+  __m256i v;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      v = _mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *) (in + i)));
+      _mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(v));
+    }
+  _mm256_zeroupper();
+  return(i);
+}
+
+static TARGET_AVX2 long long
+CvtInt16ToFloat64AVX2 (short *in, double *out, long long n)
+{
+  long long i;
+  __m128i v;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      v = _mm_cvtepi16_epi32(_mm_loadl_epi64((__m128i *) (in + i)));
+      _mm256_storeu_pd(out + i, _mm256_cvtepi32_pd(v));
+    }
+  _mm256_zeroupper();
+  return(i);
+}
+
+static TARGET_AVX2 long long
+CvtInt32ToFloat32AVX2 (int *in, float *out, long long n)
+{
+  long long i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i,
+		     _mm256_cvtepi32_ps(_mm256_loadu_si256((__m256i *)
+							   (in + i))));
+  _mm256_zeroupper();
+  return(i);
+}
+
+static TARGET_AVX2 long long
+CvtInt32ToFloat64AVX2 (int *in, double *out, long long n)
+{
+  long long i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    _mm256_storeu_pd(out + i,
+		     _mm256_cvtepi32_pd(_mm_loadu_si128((__m128i *)
+							(in + i))));
+  _mm256_zeroupper();
+  return(i);
+}
+
+static TARGET_AVX2 long long
+CvtFloat32ToFloat64AVX2 (float *in, double *out, long long n)
+{
+  long long i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    _mm256_storeu_pd(out + i, _mm256_cvtps_pd(_mm_loadu_ps(in + i)));
+  _mm256_zeroupper();
+  return(i);
+}
+
+static TARGET_AVX2 long long
+CvtInt32ToInt16AVX2 (int *in, short *out, long long n, int *err)
+{
+  long long i;
+  __m256i a, b, lo, hi, bad;
+
+  lo = _mm256_set1_epi32(SHRT_MIN);
+  hi = _mm256_set1_epi32(SHRT_MAX);
+  bad = _mm256_setzero_si256();
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      a = _mm256_loadu_si256((__m256i *) (in + i));
+      b = _mm256_loadu_si256((__m256i *) (in + i + 8));
+      bad = _mm256_or_si256(bad, _mm256_or_si256(_mm256_cmpgt_epi32(lo, a),
+						 _mm256_cmpgt_epi32(a, hi)));
+      bad = _mm256_or_si256(bad, _mm256_or_si256(_mm256_cmpgt_epi32(lo, b),
+						 _mm256_cmpgt_epi32(b, hi)));
+      /* packs works within 128-bit lanes, so restore the element order */
+      a = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+      _mm256_storeu_si256((__m256i *) (out + i), a);
+    }
+  if (_mm256_movemask_epi8(bad))
+    *err = 1;
+  _mm256_zeroupper();
+  return(i);
+}
+
+static TARGET_AVX2 __m256i
+Float32ToInt16LanesAVX2 (__m256 x, __m256 *bad)
+{
+  __m256 lo, hi, mlo, mhi;
+  __m256i v;
+
+  lo = _mm256_set1_ps((float) SHRT_MIN);
+  hi = _mm256_set1_ps((float) SHRT_MAX);
+  mlo = _mm256_cmp_ps(x, lo, _CMP_LT_OQ);
+  mhi = _mm256_cmp_ps(x, hi, _CMP_GT_OQ);
+  *bad = _mm256_or_ps(*bad, _mm256_or_ps(mlo, mhi));
+  x = _mm256_blendv_ps(_mm256_blendv_ps(x, hi, mhi), lo, mlo);
+  v = _mm256_cvttps_epi32(x);
+  return(_mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16));
+}
+
+static TARGET_AVX2 long long
+CvtFloat32ToInt16AVX2 (float *in, short *out, long long n, int *err)
+{
+  long long i;
+  __m256i a, b;
+  __m256 bad;
+
+  bad = _mm256_setzero_ps();
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      a = Float32ToInt16LanesAVX2(_mm256_loadu_ps(in + i), &bad);
+      b = Float32ToInt16LanesAVX2(_mm256_loadu_ps(in + i + 8), &bad);
+      a = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+      _mm256_storeu_si256((__m256i *) (out + i), a);
+    }
+  if (_mm256_movemask_ps(bad))
+    *err = 1;
+  _mm256_zeroupper();
+  return(i);
+}
+
+static TARGET_AVX2 long long
+CvtFloat32ToInt32AVX2 (float *in, int *out, long long n, int *err)
+{
+  long long i;
+  __m256 x, mlo, mhi, bad;
+  __m256i v;
+
+  bad = _mm256_setzero_ps();
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      x = _mm256_loadu_ps(in + i);
+      mlo = _mm256_cmp_ps(x, _mm256_set1_ps((float) INT_MIN), _CMP_LT_OQ);
+      mhi = _mm256_cmp_ps(x, _mm256_set1_ps((float) INT_MAX), _CMP_GT_OQ);
+      bad = _mm256_or_ps(bad, _mm256_or_ps(mlo, mhi));
+      v = _mm256_blendv_epi8(_mm256_cvttps_epi32(x), _mm256_set1_epi32(INT_MAX),
+			     _mm256_castps_si256(mhi));
+      _mm256_storeu_si256((__m256i *) (out + i), v);
+    }
+  if (_mm256_movemask_ps(bad))
+    *err = 1;
+  _mm256_zeroupper();
+  return(i);
+}
+
+static TARGET_AVX2 __m128i
+Float64ToInt32LanesAVX2 (__m256d x, double low, double high, __m256d *bad)
+{
+  __m256d lo, hi, mlo, mhi;
+
+  lo = _mm256_set1_pd(low);
+  hi = _mm256_set1_pd(high);
+  mlo = _mm256_cmp_pd(x, lo, _CMP_LT_OQ);
+  mhi = _mm256_cmp_pd(x, hi, _CMP_GT_OQ);
+  *bad = _mm256_or_pd(*bad, _mm256_or_pd(mlo, mhi));
+  x = _mm256_blendv_pd(_mm256_blendv_pd(x, hi, mhi), lo, mlo);
+  return(_mm256_cvttpd_epi32(x));
+}
+
+static TARGET_AVX2 long long
+CvtFloat64ToInt16AVX2 (double *in, short *out, long long n, int *err)
+{
+  long long i;
+  __m128i a, b;
+  __m256d bad;
+
+  bad = _mm256_setzero_pd();
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      a = Float64ToInt32LanesAVX2(_mm256_loadu_pd(in + i),
+				  SHRT_MIN, SHRT_MAX, &bad);
+      b = Float64ToInt32LanesAVX2(_mm256_loadu_pd(in + i + 4),
+				  SHRT_MIN, SHRT_MAX, &bad);
+      _mm_storeu_si128((__m128i *) (out + i),
+		       _mm_packs_epi32(LOW16_EPI32(a), LOW16_EPI32(b)));
+    }
+  if (_mm256_movemask_pd(bad))
+    *err = 1;
+  _mm256_zeroupper();
+  return(i);
+}
+
+static TARGET_AVX2 long long
+CvtFloat64ToInt32AVX2 (double *in, int *out, long long n, int *err)
+{
+  long long i;
+  __m256d bad;
+
+  bad = _mm256_setzero_pd();
+  for (i = 0; i + 4 <= n; i += 4)
+    _mm_storeu_si128((__m128i *) (out + i),
+		     Float64ToInt32LanesAVX2(_mm256_loadu_pd(in + i),
+					     INT_MIN, INT_MAX, &bad));
+  if (_mm256_movemask_pd(bad))
+    *err = 1;
+  _mm256_zeroupper();
+  return(i);
+}
+
+static TARGET_AVX2 long long
+CvtFloat64ToFloat32AVX2 (double *in, float *out, long long n,
+			 int keep_infinities, int *err)
+{
+  long long i;
+  __m256d x, lo, hi, mlo, mhi, bad;
+
+  lo = _mm256_set1_pd(-FLT_MAX);
+  hi = _mm256_set1_pd(FLT_MAX);
+  bad = _mm256_setzero_pd();
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      x = _mm256_loadu_pd(in + i);
+      mlo = _mm256_cmp_pd(x, lo, _CMP_LT_OQ);
+      mhi = _mm256_cmp_pd(x, hi, _CMP_GT_OQ);
+      if (keep_infinities)
+	{
+	  mlo = _mm256_and_pd(mlo, _mm256_cmp_pd(x, _mm256_set1_pd(-HUGE_VAL),
+						 _CMP_NEQ_UQ));
+	  mhi = _mm256_and_pd(mhi, _mm256_cmp_pd(x, _mm256_set1_pd(HUGE_VAL),
+						 _CMP_NEQ_UQ));
+	}
+      bad = _mm256_or_pd(bad, _mm256_or_pd(mlo, mhi));
+      x = _mm256_blendv_pd(_mm256_blendv_pd(x, hi, mhi), lo, mlo);
+      _mm_storeu_ps(out + i, _mm256_cvtpd_ps(x));
+    }
+  if (_mm256_movemask_pd(bad))
+    *err = 1;
+  _mm256_zeroupper();
+  return(i);
+}
+
+#endif /* BIO_X86_SIMD */
+
+/*
+ * The exported conversion routines.  Each one hands as much of the
+ * array as it can to the best available vector kernel and finishes the
+ * remainder with the scalar loop.
+ */
+
+#ifdef BIO_X86_SIMD
+#define WIDEN(name, intype, outtype)					\
+void									\
+BCvt##name##Array (intype *in, outtype *out, long long n)		\
+{									\
+  long long done = 0;							\
+									\
+  if (SimdLevel() >= BIO_SIMD_AVX2)					\
+    done = Cvt##name##AVX2(in, out, n);					\
+  else if (SimdLevel() >= BIO_SIMD_SSE2)				\
+    done = Cvt##name##SSE2(in, out, n);					\
+  Cvt##name##Scalar(in + done, out + done, n - done);			\
+}
+#define NARROW(name, intype, outtype)					\
+int									\
+BCvt##name##Array (intype *in, outtype *out, long long n)		\
+{									\
+  long long done = 0;							\
+  int err = 0;								\
+									\
+  if (SimdLevel() >= BIO_SIMD_AVX2)					\
+    done = Cvt##name##AVX2(in, out, n, &err);				\
+  else if (SimdLevel() >= BIO_SIMD_SSE2)				\
+    done = Cvt##name##SSE2(in, out, n, &err);				\
+  if (Cvt##name##Scalar(in + done, out + done, n - done))		\
+    err = 1;								\
+  return(err);								\
+}
+#else
+#define WIDEN(name, intype, outtype)					\
+void									\
+BCvt##name##Array (intype *in, outtype *out, long long n)		\
+{									\
+  Cvt##name##Scalar(in, out, n);					\
+}
+#define NARROW(name, intype, outtype)					\
+int									\
+BCvt##name##Array (intype *in, outtype *out, long long n)		\
+{									\
+  return(Cvt##name##Scalar(in, out, n));				\
+}
+#endif
+
+WIDEN(Int16ToInt32, short, int)
+WIDEN(Int16ToFloat32, short, float)
+WIDEN(Int16ToFloat64, short, double)
+WIDEN(Int32ToFloat32, int, float)
+WIDEN(Int32ToFloat64, int, double)
+WIDEN(Float32ToFloat64, float, double)
+NARROW(Int32ToInt16, int, short)
+NARROW(Float32ToInt16, float, short)
+NARROW(Float32ToInt32, float, int)
+NARROW(Float64ToInt16, double, short)
+NARROW(Float64ToInt32, double, int)
+
+int
+BCvtFloat64ToFloat32Array (double *in,
+			   float *out,
+			   long long n,
+			   int keep_infinities)
+{
+  long long done = 0;
+  int err = 0;
+
+#ifdef BIO_X86_SIMD
+  if (SimdLevel() >= BIO_SIMD_AVX2)
+    done = CvtFloat64ToFloat32AVX2(in, out, n, keep_infinities, &err);
+  else if (SimdLevel() >= BIO_SIMD_SSE2)
+    done = CvtFloat64ToFloat32SSE2(in, out, n, keep_infinities, &err);
+#endif
+  if (CvtFloat64ToFloat32Scalar(in + done, out + done, n - done,
+				keep_infinities))
+    err = 1;
+  return(err);
+}
+
 int
 BRdUInt8 (unsigned char *addr)
 {
@@ -374,25 +1375,14 @@ BRdInt16Array (unsigned char *buf,
 	       short *a,
 	       long long n)
 {
-  long long i, len;
-  unsigned char *dest, temp;
+  long long i;
 
   if (sizeof(short) == 2)
     {
-      /* copy directly into the destination */
-      memcpy(a, buf, 2*n);
       if (bio_big_endian_machine ^ bio_big_endian_input)
-	{
-	  /* swap bytes */
-	  dest = (unsigned char *) a;
-	  len = 2*n;
-	  for (i = 0; i < len; i+=2)
-	    {
-	      temp = dest[i];
-	      dest[i] = dest[i+1];
-	      dest[i+1] = temp;
-	    }
-	}
+	SwapCopy((unsigned char *) a, buf, n, 2);
+      else
+	memcpy(a, buf, 2*n);
     }
   else
     for (i = 0; i < n; ++i)
@@ -404,24 +1394,14 @@ BWrInt16Array (unsigned char *buf,
 	       short *a,
 	       long long n)
 {
-  long long i, len;
-  unsigned char temp;
+  long long i;
 
   if (sizeof(short) == 2)
     {
-      /* copy directly into the destination */
-      memcpy(buf, a, 2*n);
       if (bio_big_endian_machine ^ bio_big_endian_output)
-	{
-	  /* swap bytes */
-	  len = 2*n;
-	  for (i = 0; i < len; i += 2)
-	    {
-	      temp = buf[i];
-	      buf[i] = buf[i+1];
-	      buf[i+1] = temp;
-	    }
-	}
+	SwapCopy(buf, (unsigned char *) a, n, 2);
+      else
+	memcpy(buf, a, 2*n);
     }
   else
     for (i = 0; i < n; ++i)
@@ -433,28 +1413,14 @@ BRdInt32Array (unsigned char *buf,
 	       int *a,
 	       long long n)
 {
-  long long i, len;
-  unsigned char *dest, temp;
+  long long i;
 
   if (sizeof(int) == 4)
     {
-      /* copy directly into the destination */
-      memcpy(a, buf, 4*n);
       if (bio_big_endian_machine ^ bio_big_endian_input)
-	{
-	  /* reverse byte order */
-	  dest = (unsigned char *) a;
-	  len = 4*n;
-	  for (i = 0; i < len; i+=4)
-	    {
-	      temp = dest[i];
-	      dest[i] = dest[i+3];
-	      dest[i+3] = temp;
-	      temp = dest[i+2];
-	      dest[i+2] = dest[i+1];
-	      dest[i+1] = temp;
-	    }
-	}
+	SwapCopy((unsigned char *) a, buf, n, 4);
+      else
+	memcpy(a, buf, 4*n);
     }
   else
     for (i = 0; i < n; ++i)
@@ -466,27 +1432,14 @@ BWrInt32Array (unsigned char *buf,
 	       int *a,
 	       long long n)
 {
-  long long i, len;
-  unsigned char temp;
+  long long i;
 
   if (sizeof(int) == 4)
     {
-      /* copy directly into the destination */
-      memcpy(buf, a, 4*n);
       if (bio_big_endian_machine ^ bio_big_endian_output)
-	{
-	  /* reverse byte order */
-	  len = 4*n;
-	  for (i = 0; i < len; i += 4)
-	    {
-	      temp = buf[i];
-	      buf[i] = buf[i+3];
-	      buf[i+3] = temp;
-	      temp = buf[i+2];
-	      buf[i+2] = buf[i+1];
-	      buf[i+1] = temp;
-	    }
-	}
+	SwapCopy(buf, (unsigned char *) a, n, 4);
+      else
+	memcpy(buf, a, 4*n);
     }
   else
     for (i = 0; i < n; ++i)
@@ -498,34 +1451,14 @@ BRdInt64Array (unsigned char *buf,
 	       long long *a,
 	       long long n)
 {
-  long long i, len;
-  unsigned char *dest, temp;
+  long long i;
 
   if (sizeof(long long) == 8)
     {
-      /* copy directly into the destination */
-      memcpy(a, buf, 8*n);
       if (bio_big_endian_machine ^ bio_big_endian_input)
-	{
-	  /* reverse byte order */
-	  dest = (unsigned char *) a;
-	  len = 8*n;
-	  for (i = 0; i < len; i+=8)
-	    {
-	      temp = dest[i];
-	      dest[i] = dest[i+7];
-	      dest[i+7] = temp;
-	      temp = dest[i+1];
-	      dest[i+1] = dest[i+6];
-	      dest[i+6] = temp;
-	      temp = dest[i+2];
-	      dest[i+2] = dest[i+5];
-	      dest[i+5] = temp;
-	      temp = dest[i+3];
-	      dest[i+3] = dest[i+4];
-	      dest[i+4] = temp;
-	    }
-	}
+	SwapCopy((unsigned char *) a, buf, n, 8);
+      else
+	memcpy(a, buf, 8*n);
     }
   else
     for (i = 0; i < n; ++i)
@@ -537,33 +1470,14 @@ BWrInt64Array (unsigned char *buf,
 	       long long *a,
 	       long long n)
 {
-  long long i, len;
-  unsigned char temp;
+  long long i;
 
   if (sizeof(long long) == 8)
     {
-      /* copy directly into the destination */
-      memcpy(buf, a, 8*n);
       if (bio_big_endian_machine ^ bio_big_endian_output)
-	{
-	  /* reverse byte order */
-	  len = 8*n;
-	  for (i = 0; i < len; i += 8)
-	    {
-	      temp = buf[i];
-	      buf[i] = buf[i+7];
-	      buf[i+7] = temp;
-	      temp = buf[i+1];
-	      buf[i+1] = buf[i+6];
-	      buf[i+6] = temp;
-	      temp = buf[i+2];
-	      buf[i+2] = buf[i+5];
-	      buf[i+5] = temp;
-	      temp = buf[i+3];
-	      buf[i+3] = buf[i+4];
-	      buf[i+4] = temp;
-	    }
-	}
+	SwapCopy(buf, (unsigned char *) a, n, 8);
+      else
+	memcpy(buf, a, 8*n);
     }
   else
     for (i = 0; i < n; ++i)
@@ -575,28 +1489,14 @@ BRdFloat32Array (unsigned char *buf,
 		 float *a,
 		 long long n)
 {
-  long long i, len;
-  unsigned char *dest, temp;
+  long long i;
 
   if (sizeof(float) == 4)
     {
-      /* copy directly into the destination */
-      memcpy(a, buf, 4*n);
       if (bio_big_endian_machine ^ bio_big_endian_input)
-	{
-	  /* reverse byte order */
-	  dest = (unsigned char *) a;
-	  len = 4*n;
-	  for (i = 0; i < len; i+=4)
-	    {
-	      temp = dest[i];
-	      dest[i] = dest[i+3];
-	      dest[i+3] = temp;
-	      temp = dest[i+2];
-	      dest[i+2] = dest[i+1];
-	      dest[i+1] = temp;
-	    }
-	}
+	SwapCopy((unsigned char *) a, buf, n, 4);
+      else
+	memcpy(a, buf, 4*n);
     }
   else
     for (i = 0; i < n; ++i)
@@ -608,27 +1508,14 @@ BWrFloat32Array (unsigned char *buf,
 		 float *a,
 		 long long n)
 {
-  long long i, len;
-  unsigned char temp;
+  long long i;
 
   if (sizeof(int) == 4)
     {
-      /* copy directly into the destination */
-      memcpy(buf, a, 4*n);
       if (bio_big_endian_machine ^ bio_big_endian_output)
-	{
-	  /* reverse byte order */
-	  len = 4*n;
-	  for (i = 0; i < len; i += 4)
-	    {
-	      temp = buf[i];
-	      buf[i] = buf[i+3];
-	      buf[i+3] = temp;
-	      temp = buf[i+2];
-	      buf[i+2] = buf[i+1];
-	      buf[i+1] = temp;
-	    }
-	}
+	SwapCopy(buf, (unsigned char *) a, n, 4);
+      else
+	memcpy(buf, a, 4*n);
     }
   else
     for (i = 0; i < n; ++i)
@@ -640,34 +1527,14 @@ BRdFloat64Array (unsigned char *buf,
 		 double *a,
 		 long long n)
 {
-  long long i, len;
-  unsigned char *dest, temp;
+  long long i;
 
   if (sizeof(double) == 8)
     {
-      /* copy directly into the destination */
-      memcpy(a, buf, 8*n);
       if (bio_big_endian_machine ^ bio_big_endian_input)
-	{
-	  /* reverse byte order */
-	  dest = (unsigned char *) a;
-	  len = 8*n;
-	  for (i = 0; i < len; i+=8)
-	    {
-	      temp = dest[i];
-	      dest[i] = dest[i+7];
-	      dest[i+7] = temp;
-	      temp = dest[i+1];
-	      dest[i+1] = dest[i+6];
-	      dest[i+6] = temp;
-	      temp = dest[i+2];
-	      dest[i+2] = dest[i+5];
-	      dest[i+5] = temp;
-	      temp = dest[i+3];
-	      dest[i+3] = dest[i+4];
-	      dest[i+4] = temp;
-	    }
-	}
+	SwapCopy((unsigned char *) a, buf, n, 8);
+      else
+	memcpy(a, buf, 8*n);
     }
   else
     for (i = 0; i < n; ++i)
@@ -679,33 +1546,14 @@ BWrFloat64Array (unsigned char *buf,
 		 double *a,
 		 long long n)
 {
-  long long i, len;
-  unsigned char temp;
+  long long i;
 
   if (sizeof(double) == 8)
     {
-      /* copy directly into the destination */
-      memcpy(buf, a, 8*n);
       if (bio_big_endian_machine ^ bio_big_endian_output)
-	{
-	  /* reverse byte order */
-	  len = 8*n;
-	  for (i = 0; i < len; i += 8)
-	    {
-	      temp = buf[i];
-	      buf[i] = buf[i+7];
-	      buf[i+7] = temp;
-	      temp = buf[i+1];
-	      buf[i+1] = buf[i+6];
-	      buf[i+6] = temp;
-	      temp = buf[i+2];
-	      buf[i+2] = buf[i+5];
-	      buf[i+5] = temp;
-	      temp = buf[i+3];
-	      buf[i+3] = buf[i+4];
-	      buf[i+4] = temp;
-	    }
-	}
+	SwapCopy(buf, (unsigned char *) a, n, 8);
+      else
+	memcpy(buf, a, 8*n);
     }
   else
     for (i = 0; i < n; ++i)
@@ -915,8 +1763,7 @@ FRdInt16Array (FILE *stream,
 	       short *a,
 	       long long n)
 {
-  long long i, len;
-  unsigned char *buf, temp;
+  unsigned char *buf;
 
   if (sizeof(short) == 2)
     {
@@ -924,16 +1771,7 @@ FRdInt16Array (FILE *stream,
       if (fread(buf, 2, n, stream) != n)
 	bio_error = 1;
       if (bio_big_endian_machine ^ bio_big_endian_input)
-	{
-	  /* swap bytes */
-	  len = 2*n;
-	  for (i = 0; i < len; i+=2)
-	    {
-	      temp = buf[i];
-	      buf[i] = buf[i+1];
-	      buf[i+1] = temp;
-	    }
-	}
+	SwapCopy(buf, buf, n, 2);
     }
   else
     {
@@ -974,8 +1812,7 @@ FRdInt32Array (FILE *stream,
 	       int *a,
 	       long long n)
 {
-  long long i, len;
-  unsigned char *buf, temp;
+  unsigned char *buf;
 
   if (sizeof(int) == 4)
     {
@@ -983,19 +1820,7 @@ FRdInt32Array (FILE *stream,
       if (fread(buf, 4, n, stream) != n)
 	bio_error = 1;
       if (bio_big_endian_machine ^ bio_big_endian_input)
-	{
-	  /* reverse byte order */
-	  len = 4*n;
-	  for (i = 0; i < len; i+=4)
-	    {
-	      temp = buf[i];
-	      buf[i] = buf[i+3];
-	      buf[i+3] = temp;
-	      temp = buf[i+1];
-	      buf[i+1] = buf[i+2];
-	      buf[i+2] = temp;
-	    }
-	}
+	SwapCopy(buf, buf, n, 4);
     }
   else
     {
@@ -1036,8 +1861,7 @@ FRdInt64Array (FILE *stream,
 	       long long *a,
 	       long long n)
 {
-  long long i, len;
-  unsigned char *buf, temp;
+  unsigned char *buf;
 
   if (sizeof(long long) == 8)
     {
@@ -1045,25 +1869,7 @@ FRdInt64Array (FILE *stream,
       if (fread(buf, 8, n, stream) != n)
 	bio_error = 1;
       if (bio_big_endian_machine ^ bio_big_endian_input)
-	{
-	  /* reverse byte order */
-	  len = 8*n;
-	  for (i = 0; i < len; i+=8)
-	    {
-	      temp = buf[i];
-	      buf[i] = buf[i+7];
-	      buf[i+7] = temp;
-	      temp = buf[i+1];
-	      buf[i+1] = buf[i+6];
-	      buf[i+6] = temp;
-	      temp = buf[i+2];
-	      buf[i+2] = buf[i+5];
-	      buf[i+5] = temp;
-	      temp = buf[i+3];
-	      buf[i+3] = buf[i+4];
-	      buf[i+4] = temp;
-	    }
-	}
+	SwapCopy(buf, buf, n, 8);
     }
   else
     {
@@ -1104,8 +1910,7 @@ FRdFloat32Array (FILE *stream,
 		 float *a,
 		 long long n)
 {
-  long long i, len;
-  unsigned char *buf, temp;
+  unsigned char *buf;
 
   if (sizeof(float) == 4)
     {
@@ -1113,19 +1918,7 @@ FRdFloat32Array (FILE *stream,
       if (fread(buf, 4, n, stream) != n)
 	bio_error = 1;
       if (bio_big_endian_machine ^ bio_big_endian_input)
-	{
-	  /* reverse byte order */
-	  len = 4*n;
-	  for (i = 0; i < len; i+=4)
-	    {
-	      temp = buf[i];
-	      buf[i] = buf[i+3];
-	      buf[i+3] = temp;
-	      temp = buf[i+1];
-	      buf[i+1] = buf[i+2];
-	      buf[i+2] = temp;
-	    }
-	}
+	SwapCopy(buf, buf, n, 4);
     }
   else
     {
@@ -1166,8 +1959,7 @@ FRdFloat64Array (FILE *stream,
 		 double *a,
 		 long long n)
 {
-  long long i, len;
-  unsigned char *buf, temp;
+  unsigned char *buf;
 
   if (sizeof(double) == 8)
     {
@@ -1175,25 +1967,7 @@ FRdFloat64Array (FILE *stream,
       if (fread(buf, 8, n, stream) != n)
 	bio_error = 1;
       if (bio_big_endian_machine ^ bio_big_endian_input)
-	{
-	  /* reverse byte order */
-	  len = 8*n;
-	  for (i = 0; i < len; i+=8)
-	    {
-	      temp = buf[i];
-	      buf[i] = buf[i+7];
-	      buf[i+7] = temp;
-	      temp = buf[i+1];
-	      buf[i+1] = buf[i+6];
-	      buf[i+6] = temp;
-	      temp = buf[i+2];
-	      buf[i+2] = buf[i+5];
-	      buf[i+5] = temp;
-	      temp = buf[i+3];
-	      buf[i+3] = buf[i+4];
-	      buf[i+4] = temp;
-	    }
-	}
+	SwapCopy(buf, buf, n, 8);
     }
   else
     {
@@ -43,9 +43,36 @@
  *      2/04  - Fixed bug that caused ready/idle list corruption upon
  *              worker termination (SWang@psych.uic.edu, ghood@psc.edu,
  *              welling@stat.cmu.edu)
+ *      10/26 - Added local workers forked from the master, selected by
+ *              PAR_LOCAL, for running on one multiprocessor host
  *
  */
 
+/*
+ * LOCAL WORKERS:
+ *	If PAR_LOCAL is set (or PAR_ENABLE is set in a build without PVM
+ *	    or MPI), the workers are child processes forked by the master
+ *	    rather than PVM or MPI tasks.  The workers are processes rather
+ *	    than threads because applications keep their context, task and
+ *	    result records in globals, which threads would share.
+ *	The workers are forked at the first par_delegate_task after each
+ *	    par_set_context, so each inherits the master's memory as it
+ *	    stands then.  The context is thus shared copy-on-write rather
+ *	    than packed; (*pack_context) and (*unpack_context) are not used,
+ *	    and (*worker_context) runs in each worker just after the fork.
+ *	    The previous workers finish their tasks, call (*worker_finalize)
+ *	    and exit first.
+ *	A child gets only the forking thread, so the master must have no
+ *	    other threads running then (see par.h).  libmri drains and
+ *	    pauses its stream engine threads across the fork with
+ *	    pthread_atfork handlers; nothing here needs to know of them.
+ *	Tasks and results are packed into memory buffers and passed over
+ *	    pipes.  A task goes to whichever worker becomes idle first.
+ *	Results may arrive in any order, but (*master_result) is called in
+ *	    the order the tasks were delegated, as it is when running
+ *	    serially.
+ */
+
 /*
  * POSSIBLE FUTURE OPTIMIZATIONS:
  *	The scheduling could be made more sophisticated so that tasks having
@@ -59,9 +86,13 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -262,6 +293,46 @@ static int n_hosts_pending = 0;	/* number of hosts in the host table which
 static struct timeval longest_task= {0,0}; 
                                 /* run time of longest task so far */
 
+/* the following are only used for local workers */
+typedef struct LocalBuffer {
+  unsigned char *buffer;	/* actual data in the buffer */
+  int size;			/* size of the buffer in bytes */
+  int length;			/* # of bytes of data in the buffer */
+  int position;			/* reading or writing position */
+} LocalBuffer;
+
+typedef struct LocalWorker {
+  pid_t pid;			/* process ID of the worker */
+  int task_fd;			/* the master writes tasks to this pipe */
+  int result_fd;		/* the master reads results from this pipe */
+  Boolean busy;			/* TRUE if the worker has been sent a task
+				   and has not yet returned its result */
+} LocalWorker;
+
+typedef struct LocalResult {
+  struct LocalResult *next;	/* next on the list of received results */
+  int number;			/* number of the task */
+  LocalBuffer buffer;		/* the result buffer */
+} LocalResult;
+
+static Boolean local = FALSE;	/* TRUE if the workers are local processes
+				   forked by the master */
+static int local_worker_count = -1; /* # of local workers to fork; 0 means
+				       one per processor, and -1 that local
+				       workers were not requested */
+static int n_local_workers = 0;	/* # of local workers currently running */
+static LocalWorker local_workers[PAR_MAX_WORKERS];
+static Boolean local_has_context = FALSE; /* TRUE once par_set_context has
+					     been called */
+static LocalBuffer local_out = {NULL, 0, 0, 0}; /* buffer being packed */
+static LocalBuffer local_in = {NULL, 0, 0, 0};  /* buffer being unpacked */
+static LocalResult *local_results = NULL;
+                                /* results received but not yet passed to
+				   (*master_result), in order of task number */
+static Par_Task local_next_result = 0;
+                                /* the number of the task whose result is
+				   to be passed to (*master_result) next */
+
 #if defined(PVM)
 typedef struct HostState {
   Hostname name;		/* official name of the host */
@@ -344,6 +415,20 @@ static int  WorkerReceiveMessage();
 static void PrepareToSend();
 static void Send();
 static void GetHostNameFromTID();
+static void RunLocal();
+static void StartLocalWorkers();
+static void StopLocalWorkers();
+static void LocalWorkerLoop();
+static int  LocalReceive(float timeout);
+static void DeliverLocalResults();
+static void LocalSend();
+static Boolean LocalReceiveMessage();
+static Boolean LocalRead();
+static void LocalWrite();
+static void LocalPack();
+static void LocalUnpack();
+static void LocalPackString();
+static void LocalUnpackString();
 
 #if defined(PVM)
 static void StartPVM();
@@ -410,13 +495,19 @@ par_process (int argc,
   /* check the relevant environment variables */
   ScanEnvironment(argc, argv);
 
-  if (par)
-    /* and the parallelism flag is on, so start running in a PVM mode */
-    StartPVM(argc, argv, envp);
+  if (local_worker_count >= 0)
+    /* local workers were requested, so PVM is not needed */
+    RunLocal(envp);
+  else
+    {
+      if (par)
+	/* and the parallelism flag is on, so start running in a PVM mode */
+	StartPVM(argc, argv, envp);
 
-  if (!par) /* may just have been turned off by StartPVM */
-    /* and the parallelism flag is off, so just run the master task */
-    (*master_task)(prog_argc, prog_argv, envp);
+      if (!par) /* may just have been turned off by StartPVM */
+	/* and the parallelism flag is off, so just run the master task */
+	(*master_task)(prog_argc, prog_argv, envp);
+    }
 
 #elif defined(MPI)   /* this has been compiled for MPI */
   spawn = FALSE;
@@ -436,18 +527,26 @@ par_process (int argc,
       spawn = FALSE;
     }
 
-  if (par) 
+  if (local_worker_count >= 0)
     {
-      /* the parallelism flag is on, so start running in an MPI mode */
-      StartMPI(argc, argv, envp);
+      /* local workers were requested, so run without the other ranks */
+      RunLocal(envp);
     }
-
-  if (!par) /* par may possibly have been turned off by StartMPI */
+  else
     {
-      /* the parallelism flag is off, so just run the master task */
-      (*master_task)(prog_argc, prog_argv, envp);
-      if (worker_finalize != NULL)
-	(*worker_finalize)();
+      if (par) 
+	{
+	  /* the parallelism flag is on, so start running in an MPI mode */
+	  StartMPI(argc, argv, envp);
+	}
+
+      if (!par) /* par may possibly have been turned off by StartMPI */
+	{
+	  /* the parallelism flag is off, so just run the master task */
+	  (*master_task)(prog_argc, prog_argv, envp);
+	  if (worker_finalize != NULL)
+	    (*worker_finalize)();
+	}
     }
 
   if (par_verbose) Report("Tid %d at MPI_Finalize\n",my_tid);
@@ -462,17 +561,20 @@ par_process (int argc,
   /* check the relevant environment variables */
   ScanEnvironment(argc, argv);
 
-  if (par)
+  /* without PVM or MPI, parallelism means local workers, by default one
+     per processor */
+  if (par && local_worker_count < 0)
+    local_worker_count = 0;
+
+  if (local_worker_count >= 0)
+    RunLocal(envp);
+  else
     {
-      Error("Sorry, this has not been compiled to use PVM or MPI\n");
-      /* turn parallelism off */
-      par = FALSE;
+      /* just run the master task */
+      (*master_task)(prog_argc, prog_argv, envp);
+      if (worker_finalize != NULL)
+	(*worker_finalize)();
     }
-
-  /* just run the master task */
-  (*master_task)(prog_argc, prog_argv, envp);
-  if (worker_finalize != NULL)
-    (*worker_finalize)();
 #endif
 }
 
@@ -552,6 +654,9 @@ ScanEnvironment (int argc, char **argv)
   if ((p = getenv("PAR_VERBOSE")) != NULL &&
       sscanf(p, "%d", &v) == 1)
     par_verbose = (v != 0);
+  if ((p = getenv("PAR_LOCAL")) != NULL &&
+      sscanf(p, "%d", &v) == 1)
+    local_worker_count = MAX(v, 0);
 
   prog_argc = 0;
   prog_argv = (char **) malloc(argc * sizeof(char *));
@@ -599,6 +704,11 @@ ScanEnvironment (int argc, char **argv)
 	    if (sscanf(&argv[i][13], "%d", &v) == 1)
 	      par_verbose = (v != 0);
 	  }
+	else if (strncmp(argv[i], "-PAR_LOCAL=", 11) == 0)
+	  {
+	    if (sscanf(&argv[i][11], "%d", &v) == 1)
+	      local_worker_count = MAX(v, 0);
+	  }
       }
       else {
 	prog_argv[prog_argc++]= argv[i];
@@ -626,6 +736,34 @@ par_delegate_task ()
       return(task_number++);
     }
 
+  if (local)
+    {
+      /* fork new workers if the context has changed */
+      if (context_changed || n_local_workers == 0)
+	{
+	  StopLocalWorkers();
+	  StartLocalWorkers();
+	  context_changed = FALSE;
+	}
+      for (;;)
+	{
+	  for (i = 0; i < n_local_workers; ++i)
+	    if (!local_workers[i].busy)
+	      break;
+	  if (i < n_local_workers)
+	    break;
+	  (void) LocalReceive(PAR_FOREVER);
+	}
+      if (par_verbose)
+	Report("Delegating task %d to local worker %d\n", task_number, i+1);
+      local_out.position = 0;
+      if (par_pack_task != NULL)
+	(*par_pack_task)();
+      LocalSend(local_workers[i].task_fd, task_number, &local_out);
+      local_workers[i].busy = TRUE;
+      return(task_number++);
+    }
+
   if (task_number - task_completed_first >= 8*task_completed_size)
     {
       /* double the size of the task_completed table */
@@ -727,6 +865,15 @@ par_set_context ()
       return;
     }
 
+  /* local workers are forked with the new context at the next
+     par_delegate_task */
+  if (local)
+    {
+      local_has_context = TRUE;
+      context_changed = TRUE;
+      return;
+    }
+
   if (current_context != NULL)
     DisuseContext(&current_context);
   context_changed = TRUE;
@@ -749,6 +896,13 @@ par_broadcast_context ()
       return;
     }
 
+  /* local workers share the context without any broadcast */
+  if (local)
+    {
+      par_set_context();
+      return;
+    }
+
   if (par_verbose)
     Report("Master going to broadcast context %d\n", broadcast_count);
 
@@ -851,6 +1005,8 @@ par_broadcast_context ()
 int
 par_wait (float timeout)
 {
+  if (local)
+    return(LocalReceive(timeout));
 #if defined(PVM) || defined(MPI)
   /* if we are not running in parallel, there is nothing to do */
   if (!par)
@@ -871,6 +1027,12 @@ par_finish ()
   if (!par)
     return;
 
+  if (local)
+    {
+      StopLocalWorkers();
+      return;
+    }
+
   while (tasks_outstanding > 0)
     (void) MasterReceiveMessage(PAR_FOREVER);
 
@@ -927,6 +1089,8 @@ par_finished (Par_Task id)
 
   if (!par)
     return(id < task_number);
+  if (local)
+    return(id < local_next_result);
 
   if (id < task_completed_first)
     return(TRUE);
@@ -945,6 +1109,8 @@ par_finished_up_to (Par_Task id)
 
   if (!par)
     return(id < task_number);
+  if (local)
+    return(id < local_next_result);
 
   if (id < task_completed_first)
     return(TRUE);
@@ -963,6 +1129,8 @@ par_tasks_outstanding ()
 {
   if (!par)
     return(0);
+  if (local)
+    return(task_number - local_next_result);
   return(tasks_outstanding);
 }
 
@@ -982,6 +1150,8 @@ par_workers ()
 {
   if (!par)
     return(1);
+  if (local)
+    return(local_worker_count);
   return(n_workers);
 }
 
@@ -2119,6 +2289,11 @@ Send (int tid, int tag)
 void
 par_pkbyte(unsigned char v)
 {
+  if (local)
+    {
+      LocalPack(&v, sizeof(v));
+      return;
+    }
 #if defined(PVM)
   if (pvm_pkbyte((char*)&v, 1, 1) < 0)
     Abort("Could not pack byte into PVM buffer\n");
@@ -2134,6 +2309,11 @@ par_pkbyte(unsigned char v)
 void
 par_pkshort(short v)
 {
+  if (local)
+    {
+      LocalPack(&v, sizeof(v));
+      return;
+    }
 #if defined(PVM)
   if (pvm_pkshort(&v, 1, 1) < 0)
     Abort("Could not pack short into PVM buffer\n");
@@ -2149,6 +2329,11 @@ par_pkshort(short v)
 void
 par_pkint(int v)
 {
+  if (local)
+    {
+      LocalPack(&v, sizeof(v));
+      return;
+    }
 #if defined(PVM)
   if (pvm_pkint(&v, 1, 1) < 0)
     Abort("Could not pack int into PVM buffer\n");
@@ -2164,6 +2349,11 @@ par_pkint(int v)
 void
 par_pklong (long v)
 {
+  if (local)
+    {
+      LocalPack(&v, sizeof(v));
+      return;
+    }
 #if defined(PVM)
   if (pvm_pklong(&v, 1, 1) < 0)
     Abort("Could not pack long into PVM buffer\n");
@@ -2179,6 +2369,11 @@ par_pklong (long v)
 void
 par_pkfloat (float v)
 {
+  if (local)
+    {
+      LocalPack(&v, sizeof(v));
+      return;
+    }
 #if defined(PVM)
   if (pvm_pkfloat(&v, 1, 1) < 0)
     Abort("Could not pack float into PVM buffer\n");
@@ -2194,6 +2389,11 @@ par_pkfloat (float v)
 void
 par_pkdouble (double v)
 {
+  if (local)
+    {
+      LocalPack(&v, sizeof(v));
+      return;
+    }
 #if defined(PVM)
   if (pvm_pkdouble(&v, 1, 1) < 0)
     Abort("Could not pack double into PVM buffer\n");
@@ -2209,13 +2409,21 @@ par_pkdouble (double v)
 void
 par_pkstr (char *v)
 {
+#if defined(MPI)
+  int size;
+  int string_len;
+#endif
+
+  if (local)
+    {
+      LocalPackString(v);
+      return;
+    }
 #if defined(PVM)
   if (pvm_pkstr(v) < 0)
     Abort("Could not pack string into PVM buffer\n");
 #elif defined(MPI)
-  int size;
-  int string_len = strlen(v);
-
+  string_len = strlen(v);
   if (MPI_Pack_size(string_len, MPI_CHAR, MPI_COMM_WORLD,
 		    &size) != MPI_SUCCESS)
     Abort("Could not determine packing size of string\n");
@@ -2232,11 +2440,19 @@ par_pkstr (char *v)
 void
 par_pkbytearray (unsigned char *p, int n)
 {
+#if defined(MPI)
+  int size;
+#endif
+
+  if (local)
+    {
+      LocalPack(p, n*sizeof(*p));
+      return;
+    }
 #if defined(PVM)
   if (pvm_pkbyte((char*)p, n, 1) < 0)
     Abort("Could not pack byte array into PVM buffer\n");
 #elif defined(MPI)
-  int size;
   if (MPI_Pack_size(n, MPI_BYTE, MPI_COMM_WORLD,
 		    &size) != MPI_SUCCESS)
     Abort("Could not determine packing size of byte array\n");
@@ -2251,11 +2467,19 @@ par_pkbytearray (unsigned char *p, int n)
 void
 par_pkshortarray (short *p, int n)
 {
+#if defined(MPI)
+  int size;
+#endif
+
+  if (local)
+    {
+      LocalPack(p, n*sizeof(*p));
+      return;
+    }
 #if defined(PVM)
   if (pvm_pkshort(p, n, 1) < 0)
     Abort("Could not pack short array into PVM buffer\n");
 #elif defined(MPI)
-  int size;
   if (MPI_Pack_size(n, MPI_SHORT, MPI_COMM_WORLD,
 		    &size) != MPI_SUCCESS)
     Abort("Could not determine packing size of short array\n");
@@ -2270,11 +2494,19 @@ par_pkshortarray (short *p, int n)
 void
 par_pkintarray (int *p, int n)
 {
+#if defined(MPI)
+  int size;
+#endif
+
+  if (local)
+    {
+      LocalPack(p, n*sizeof(*p));
+      return;
+    }
 #if defined(PVM)
   if (pvm_pkint(p, n, 1) < 0)
     Abort("Could not pack int array into PVM buffer\n");
 #elif defined(MPI)
-  int size;
   if (MPI_Pack_size(n, MPI_INT, MPI_COMM_WORLD,
 		    &size) != MPI_SUCCESS)
     Abort("Could not determine packing size of int array\n");
@@ -2289,11 +2521,19 @@ par_pkintarray (int *p, int n)
 void
 par_pklongarray (long *p, int n)
 {
+#if defined(MPI)
+  int size;
+#endif
+
+  if (local)
+    {
+      LocalPack(p, n*sizeof(*p));
+      return;
+    }
 #if defined(PVM)
   if (pvm_pklong(p, n, 1) < 0)
     Abort("Could not pack long array into PVM buffer\n");
 #elif defined(MPI)
-  int size;
   if (MPI_Pack_size(n, MPI_LONG, MPI_COMM_WORLD,
 		    &size) != MPI_SUCCESS)
     Abort("Could not determine packing size of long array\n");
@@ -2308,11 +2548,19 @@ par_pklongarray (long *p, int n)
 void
 par_pkfloatarray (float *p, int n)
 {
+#if defined(MPI)
+  int size;
+#endif
+
+  if (local)
+    {
+      LocalPack(p, n*sizeof(*p));
+      return;
+    }
 #if defined(PVM)
   if (pvm_pkfloat(p, n, 1) < 0)
     Abort("Could not pack float array into PVM buffer\n");
 #elif defined(MPI)
-  int size;
   if (MPI_Pack_size(n, MPI_FLOAT, MPI_COMM_WORLD,
 		    &size) != MPI_SUCCESS)
     Abort("Could not determine packing size of float array\n");
@@ -2327,11 +2575,19 @@ par_pkfloatarray (float *p, int n)
 void
 par_pkdoublearray (double *p, int n)
 {
+#if defined(MPI)
+  int size;
+#endif
+
+  if (local)
+    {
+      LocalPack(p, n*sizeof(*p));
+      return;
+    }
 #if defined(PVM)
   if (pvm_pkdouble(p, n, 1) < 0)
     Abort("Could not pack double array into PVM buffer\n");
 #elif defined(MPI)
-  int size;
   if (MPI_Pack_size(n, MPI_DOUBLE, MPI_COMM_WORLD,
 		    &size) != MPI_SUCCESS)
     Abort("Could not determine packing size of double array\n");
@@ -2347,6 +2603,11 @@ unsigned char
 par_upkbyte ()
 {
   unsigned char v;
+  if (local)
+    {
+      LocalUnpack(&v, sizeof(v));
+      return(v);
+    }
 #if defined(PVM)
   if (pvm_upkbyte((char*)&v, 1, 1) < 0)
     Abort("Could not unpack byte from PVM buffer\n");
@@ -2362,6 +2623,11 @@ short
 par_upkshort ()
 {
   short v;
+  if (local)
+    {
+      LocalUnpack(&v, sizeof(v));
+      return(v);
+    }
 #if defined(PVM)
   if (pvm_upkshort(&v, 1, 1) < 0)
     Abort("Could not unpack short from PVM buffer\n");
@@ -2377,6 +2643,11 @@ int
 par_upkint ()
 {
   int v;
+  if (local)
+    {
+      LocalUnpack(&v, sizeof(v));
+      return(v);
+    }
 #if defined(PVM)
   if (pvm_upkint(&v, 1, 1) < 0)
     Abort("Could not unpack int from PVM buffer\n");
@@ -2392,6 +2663,11 @@ long
 par_upklong ()
 {
   long v;
+  if (local)
+    {
+      LocalUnpack(&v, sizeof(v));
+      return(v);
+    }
 #if defined(PVM)
   if (pvm_upklong(&v, 1, 1) < 0)
     Abort("Could not unpack long from PVM buffer\n");
@@ -2407,6 +2683,11 @@ float
 par_upkfloat ()
 {
   float v;
+  if (local)
+    {
+      LocalUnpack(&v, sizeof(v));
+      return(v);
+    }
 #if defined(PVM)
   if (pvm_upkfloat(&v, 1, 1) < 0)
     Abort("Could not unpack float from PVM buffer\n");
@@ -2422,6 +2703,11 @@ double
 par_upkdouble ()
 {
   double v;
+  if (local)
+    {
+      LocalUnpack(&v, sizeof(v));
+      return(v);
+    }
 #if defined(PVM)
   if (pvm_upkdouble(&v, 1, 1) < 0)
     Abort("Could not unpack double from PVM buffer\n");
@@ -2436,11 +2722,19 @@ par_upkdouble ()
 void
 par_upkstr (char *s)
 {
+#if defined(MPI)
+  int string_len;
+#endif
+
+  if (local)
+    {
+      LocalUnpackString(s);
+      return;
+    }
 #if defined(PVM)
   if (pvm_upkstr(s) < 0)
     Abort("Could not unpack string from PVM buffer\n");
 #elif defined(MPI)
-  int string_len;
   if (MPI_Unpack(in_buffer, in_size, &in_position,
 		 &string_len, 1, MPI_INT, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Unpack(in_buffer, in_size, &in_position,
@@ -2453,6 +2747,11 @@ par_upkstr (char *s)
 void
 par_upkbytearray (unsigned char *p, int n)
 {
+  if (local)
+    {
+      LocalUnpack(p, n*sizeof(*p));
+      return;
+    }
 #if defined(PVM)
   if (pvm_upkbyte((char*)p, n, 1) < 0)
     Abort("Could not unpack byte array from PVM buffer\n");
@@ -2466,6 +2765,11 @@ par_upkbytearray (unsigned char *p, int n)
 void
 par_upkshortarray (short *p, int n)
 {
+  if (local)
+    {
+      LocalUnpack(p, n*sizeof(*p));
+      return;
+    }
 #if defined(PVM)
   if (pvm_upkshort(p, n, 1) < 0)
     Abort("Could not unpack short array from PVM buffer\n");
@@ -2479,6 +2783,11 @@ par_upkshortarray (short *p, int n)
 void
 par_upkintarray (int *p, int n)
 {
+  if (local)
+    {
+      LocalUnpack(p, n*sizeof(*p));
+      return;
+    }
 #if defined(PVM)
   if (pvm_upkint(p, n, 1) < 0)
     Abort("Could not unpack int array from PVM buffer\n");
@@ -2492,6 +2801,11 @@ par_upkintarray (int *p, int n)
 void
 par_upklongarray (long *p, int n)
 {
+  if (local)
+    {
+      LocalUnpack(p, n*sizeof(*p));
+      return;
+    }
 #if defined(PVM)
   if (pvm_upklong(p, n, 1) < 0)
     Abort("Could not unpack long array from PVM buffer\n");
@@ -2505,6 +2819,11 @@ par_upklongarray (long *p, int n)
 void
 par_upkfloatarray (float *p, int n)
 {
+  if (local)
+    {
+      LocalUnpack(p, n*sizeof(*p));
+      return;
+    }
 #if defined(PVM)
   if (pvm_upkfloat(p, n, 1) < 0)
     Abort("Could not unpack float array from PVM buffer\n");
@@ -2518,6 +2837,11 @@ par_upkfloatarray (float *p, int n)
 void
 par_upkdoublearray (double *p, int n)
 {
+  if (local)
+    {
+      LocalUnpack(p, n*sizeof(*p));
+      return;
+    }
 #if defined(PVM)
   if (pvm_upkdouble(p, n, 1) < 0)
     Abort("Could not unpack double array from PVM buffer\n");
@@ -2529,6 +2853,335 @@ par_upkdoublearray (double *p, int n)
 }
 
 
+/*-------------the following functions are all for local workers-----------*/
+
+static void
+RunLocal (char **envp)
+{
+  local = TRUE;
+  par = TRUE;
+  rank = 0;
+  if (local_worker_count == 0)
+    local_worker_count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  local_worker_count = MAX(1, MIN(local_worker_count, PAR_MAX_WORKERS));
+  if (par_verbose)
+    Report("Running with %d local workers\n", local_worker_count);
+
+  /* a worker that dies should make writes to its pipe fail, rather than
+     killing the master */
+  signal(SIGPIPE, SIG_IGN);
+
+  (*par_master_task)(prog_argc, prog_argv, envp);
+
+  /* make sure everything is finished in case par_master_task does not
+     call par_finish itself */
+  par_finish();
+}
+
+static void
+StartLocalWorkers ()
+{
+  int task_pipe[2];
+  int result_pipe[2];
+  pid_t pid;
+  int i, j;
+
+  /* anything still buffered would otherwise be written by every worker */
+  fflush(NULL);
+
+  for (i = 0; i < local_worker_count; ++i)
+    {
+      if (pipe(task_pipe) != 0 || pipe(result_pipe) != 0)
+	Abort("Could not create pipes for local worker %d\n", i+1);
+      if ((pid = fork()) < 0)
+	Abort("Could not fork local worker %d\n", i+1);
+      if (pid == 0)
+	{
+	  /* keep only this worker's ends of its own pipes; the master's
+	     ends must be closed here for the workers to see end-of-file
+	     when the master closes them */
+	  for (j = 0; j < i; ++j)
+	    {
+	      close(local_workers[j].task_fd);
+	      close(local_workers[j].result_fd);
+	    }
+	  close(task_pipe[1]);
+	  close(result_pipe[0]);
+	  LocalWorkerLoop(i, task_pipe[0], result_pipe[1]);
+	}
+      close(task_pipe[0]);
+      close(result_pipe[1]);
+      local_workers[i].pid = pid;
+      local_workers[i].task_fd = task_pipe[1];
+      local_workers[i].result_fd = result_pipe[0];
+      local_workers[i].busy = FALSE;
+      n_local_workers = i + 1;
+    }
+  if (par_verbose)
+    Report("Started %d local workers\n", n_local_workers);
+}
+
+static void
+StopLocalWorkers ()
+{
+  int i;
+  int status;
+
+  while (local_next_result < task_number)
+    (void) LocalReceive(PAR_FOREVER);
+
+  /* closing the task pipes tells the workers to finish */
+  for (i = 0; i < n_local_workers; ++i)
+    close(local_workers[i].task_fd);
+  for (i = 0; i < n_local_workers; ++i)
+    {
+      if (waitpid(local_workers[i].pid, &status, 0) < 0 ||
+	  !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	Error("Local worker %d did not exit cleanly\n", i+1);
+      close(local_workers[i].result_fd);
+    }
+  n_local_workers = 0;
+}
+
+static void
+LocalWorkerLoop (int n, int task_fd, int result_fd)
+{
+  int number;
+
+  rank = n + 1;
+  if (local_has_context && par_worker_context != NULL)
+    (*par_worker_context)();
+
+  while (LocalReceiveMessage(task_fd, &number, &local_in))
+    {
+      if (par_unpack_task != NULL)
+	(*par_unpack_task)();
+      (*par_worker_task)();
+      local_out.position = 0;
+      if (par_pack_result != NULL)
+	(*par_pack_result)();
+      LocalSend(result_fd, number, &local_out);
+    }
+
+  if (par_worker_finalize != NULL)
+    (*par_worker_finalize)();
+  fflush(NULL);
+  _exit(0);
+}
+
+/* LocalReceive waits for at most timeout seconds for results from the
+   busy local workers, and returns 1 if any arrived or 0 if none did */
+static int
+LocalReceive (float timeout)
+{
+  struct pollfd fds[PAR_MAX_WORKERS];
+  int fd_worker[PAR_MAX_WORKERS];
+  int n_fds = 0;
+  int i, n;
+  int ready;
+  LocalResult *r;
+  LocalResult **p;
+
+  for (n = 0; n < n_local_workers; ++n)
+    if (local_workers[n].busy)
+      {
+	fds[n_fds].fd = local_workers[n].result_fd;
+	fds[n_fds].events = POLLIN;
+	fds[n_fds].revents = 0;
+	fd_worker[n_fds++] = n;
+      }
+  if (n_fds == 0)
+    return(0);
+
+  do {
+    ready = poll(fds, n_fds, (timeout < 0.0) ? -1 : (int) (1000.0*timeout));
+  } while (ready < 0 && errno == EINTR);
+  if (ready < 0)
+    Abort("Master could not poll local workers\n");
+  if (ready == 0)
+    return(0);
+
+  for (i = 0; i < n_fds; ++i)
+    if (fds[i].revents != 0)
+      {
+	n = fd_worker[i];
+	if ((r = (LocalResult *) malloc(sizeof(LocalResult))) == NULL)
+	  Abort("Could not allocate a local result record\n");
+	r->buffer.buffer = NULL;
+	r->buffer.size = 0;
+	if (!LocalReceiveMessage(local_workers[n].result_fd, &r->number,
+				 &r->buffer))
+	  Abort("Local worker %d exited unexpectedly\n", n+1);
+	local_workers[n].busy = FALSE;
+	if (par_verbose)
+	  Report("Master received result of task %d from local worker %d\n",
+		 r->number, n+1);
+
+	/* keep the list in order of task number */
+	for (p = &local_results; *p != NULL && (*p)->number < r->number;
+	     p = &(*p)->next) ;
+	r->next = *p;
+	*p = r;
+      }
+
+  DeliverLocalResults();
+  return(1);
+}
+
+/* DeliverLocalResults passes each result which is next in order of task
+   number to (*master_result) */
+static void
+DeliverLocalResults ()
+{
+  LocalResult *r;
+
+  while (local_results != NULL && local_results->number == local_next_result)
+    {
+      r = local_results;
+      local_results = r->next;
+      ++local_next_result;
+      if (par_master_result != NULL)
+	{
+	  /* the result buffer becomes the one being unpacked */
+	  if (local_in.buffer != NULL)
+	    free(local_in.buffer);
+	  local_in = r->buffer;
+	  if (par_unpack_result != NULL)
+	    (*par_unpack_result)();
+	  (*par_master_result)(r->number);
+	}
+      else if (r->buffer.buffer != NULL)
+	free(r->buffer.buffer);
+      free(r);
+    }
+}
+
+static void
+LocalSend (int fd, int number, LocalBuffer *b)
+{
+  int header[2];
+
+  header[0] = number;
+  header[1] = b->position;
+  LocalWrite(fd, header, sizeof(header));
+  LocalWrite(fd, b->buffer, b->position);
+}
+
+/* LocalReceiveMessage reads a task or result into b, and returns FALSE
+   if the other end of the pipe has been closed */
+static Boolean
+LocalReceiveMessage (int fd, int *number, LocalBuffer *b)
+{
+  int header[2];
+
+  if (!LocalRead(fd, header, sizeof(header)))
+    return(FALSE);
+  if (header[1] > b->size)
+    {
+      b->size = header[1];
+      if ((b->buffer = realloc(b->buffer, b->size)) == NULL)
+	Abort("Could not expand local buffer to %d bytes\n", b->size);
+    }
+  if (!LocalRead(fd, b->buffer, header[1]))
+    Abort("Local message was cut short\n");
+  *number = header[0];
+  b->length = header[1];
+  b->position = 0;
+  return(TRUE);
+}
+
+static Boolean
+LocalRead (int fd, void *p, int n)
+{
+  unsigned char *c = (unsigned char *) p;
+  int done = 0;
+  int len;
+
+  while (done < n)
+    {
+      len = read(fd, c + done, n - done);
+      if (len == 0 && done == 0)
+	return(FALSE);
+      if (len == 0)
+	Abort("Local message was cut short\n");
+      if (len < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  Abort("Could not read from local pipe\n");
+	}
+      done += len;
+    }
+  return(TRUE);
+}
+
+static void
+LocalWrite (int fd, const void *p, int n)
+{
+  const unsigned char *c = (const unsigned char *) p;
+  int done = 0;
+  int len;
+
+  while (done < n)
+    {
+      len = write(fd, c + done, n - done);
+      if (len < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  Abort("Could not write to local pipe\n");
+	}
+      done += len;
+    }
+}
+
+static void
+LocalPack (const void *p, int n)
+{
+  if (local_out.position + n > local_out.size)
+    {
+      while (local_out.position + n > local_out.size)
+	if (local_out.size == 0)
+	  local_out.size = 1024;
+	else
+	  local_out.size *= 2;
+      local_out.buffer = realloc(local_out.buffer, local_out.size);
+      if (local_out.buffer == NULL)
+	Abort("Could not expand local buffer to %d bytes\n", local_out.size);
+    }
+  memcpy(local_out.buffer + local_out.position, p, n);
+  local_out.position += n;
+}
+
+static void
+LocalUnpack (void *p, int n)
+{
+  if (local_in.position + n > local_in.length)
+    Abort("Tried to unpack past the end of a local message\n");
+  memcpy(p, local_in.buffer + local_in.position, n);
+  local_in.position += n;
+}
+
+static void
+LocalPackString (char *v)
+{
+  int string_len = strlen(v);
+
+  LocalPack(&string_len, sizeof(string_len));
+  LocalPack(v, string_len);
+}
+
+static void
+LocalUnpackString (char *s)
+{
+  int string_len;
+
+  LocalUnpack(&string_len, sizeof(string_len));
+  LocalUnpack(s, string_len);
+  s[string_len] = '\0';
+}
+
+
 #if defined(PVM)
 /*-------------the following functions are all PVM-specific--------------*/
 
@@ -26,6 +26,7 @@
  *			variables rather than by arguments (ghood@psc.edu)
  *		11/99 - added broadcast feature for sending large contexts
  *              3/01  - Converted to use either PVM or MPI (ghood@psc.edu)
+ *		10/26 - Added local workers forked from the master
  *
  *	This library implements a single-master/multiple-worker style
  *	of parallel processing.  Both the master and worker programs
@@ -40,6 +41,23 @@
  *	(*master_result) is then automatically called on the master
  *	to process the values in the Result record.
  *
+ *	Setting PAR_LOCAL=n in the environment runs n workers on the
+ *	local host (0 means one per processor) as processes forked from
+ *	the master, instead of using PVM or MPI.  The workers inherit the
+ *	context from the master's memory rather than having it packed,
+ *	and (*master_result) is called in the order the tasks were
+ *	delegated.  Without PVM or MPI, PAR_ENABLE=1 alone does the same
+ *	with one worker per processor.
+ *
+ *	The local workers are forked at par_delegate_task, and only the
+ *	calling thread survives into a child.  So par_delegate_task must
+ *	be called from the thread running (*master_task) while no other
+ *	thread of the master holds a lock the workers could need.  libmri's
+ *	stream engines see to this themselves (they are drained and paused
+ *	across the fork), and the fthreads routines join their threads
+ *	before returning; any other threads the application starts must
+ *	be stopped before it delegates tasks.
+ *
  */
 
 /* the following constants may be modified if necessary,
@@ -25,55 +25,84 @@
 /*
  *	ptest.c - test libpar.c
  *
+ *	Delegates two contexts' worth of tasks and checks that every
+ *	result comes back computed under the right context, and that
+ *	(*master_result) sees the tasks in the order they were delegated.
+ *	Every fourth task sleeps, so with more than one worker the
+ *	others finish ahead of it; in that case the test also requires
+ *	that some results really did complete out of order.  Run it as
+ *	"ptest" for a serial run or "PAR_LOCAL=4 ptest" for local workers.
+ *	It exits with status 1 if any check fails.
  */
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include "par.h"
 #include "bio.h"
 #include "array.h"
 #include "misc.h"
 #include "acct.h"
 
+#define N_CONTEXTS	2
+#define N_TASKS		24	/* per context */
+#define SLOW_TASK_USEC	100000	/* how long every fourth task sleeps */
+
 typedef struct Context {
   /* NOTE: any new fields added to this struct should
      be also added to PackContext and UnpackContext */ 
-  char context_name[80];
+  int context_num;
+  int scale;
 } Context;
 
 typedef struct Task {
   /* NOTE: any new fields added to this struct should
      be also added to PackTask and UnpackTask */ 
-  char task_name[80];
+  int task_num;
 } Task;
 
+typedef struct Result {
+  /* NOTE: any new fields added to this struct should
+     be also added to PackResult and UnpackResult */ 
+  int task_num;
+  int context_num;	/* context seen by (*worker_context) */
+  int value;
+  double finish_time;	/* when the worker finished the task */
+} Result;
+
 static char rcsid[] = "$Id: ptest.c,v 1.5 2000/10/06 00:32:22 welling Exp $";
 
 /* GLOBAL VARIABLE FOR MASTER & SLAVE */
 Task t;
 Context c;
+Result res;
 
 /* GLOBAL VARIABLES FOR MASTER */
-FILE *f;
+int delegated_context[N_CONTEXTS*N_TASKS]; /* context of each task */
+int delegated_task[N_CONTEXTS*N_TASKS];	/* task_num of each task */
+int n_delegated = 0;
+int n_results = 0;
+int n_out_of_order = 0;
+int n_failures = 0;
+double latest_finish = 0.0;
 
 /* GLOBAL VARIABLES FOR SLAVE */
-FILE *sf;
+int slave_context_num = -1;
 
 /* FORWARD DECLARATIONS */
 void MasterTask (int argc, const char **argv);
-void ReadEnvironment ();
-int ReadArguments ();
+void MasterResult (Par_Task id);
 void SlaveContext ();
 void SlaveTask ();
-
-#ifdef PVM
 void PackContext();
 void UnpackContext();
 void PackTask();
 void UnpackTask();
-#endif
+void PackResult();
+void UnpackResult();
+static double Now ();
 
 
 int
@@ -81,21 +110,15 @@ main (int argc,
       char **argv,
       char **envp)
 {
-#ifdef PVM
   par_process(argc, argv, envp,
-	      MasterTask, NULL,
+	      MasterTask, MasterResult,
 	      SlaveContext, SlaveTask,
+	      NULL,
 	      PackContext, UnpackContext,
 	      PackTask, UnpackTask,
-	      NULL, NULL);
-#else
-  par_process(argc, argv, envp,
-	      MasterTask, NULL,
-	      SlaveContext, SlaveTask,
-	      NULL, NULL,
-	      NULL, NULL,
-	      NULL, NULL);
-#endif
+	      PackResult, UnpackResult);
+  if (n_failures > 0)
+    exit(1);
   exit(0);
 }
 
@@ -107,26 +130,69 @@ MasterTask (int argc,
 {
   int i;
   int n;
-  char name[80];
-
-  sprintf(name, "master%d", getpid());
-  f = fopen(name, "w");
-  fprintf(f, "Master started.\n");
-  fflush(f);
-  Report("Master starting...\n");
-  sprintf(c.context_name, "context0");
-  par_set_context();
-  for (n = 0; n < 20; ++n)
+
+  for (i = 0; i < N_CONTEXTS; ++i)
     {
-      sprintf(t.task_name, "task%d", n);
-      par_delegate_task();
+      c.context_num = i;
+      c.scale = 1000*(i+1);
+      par_set_context();
+      for (n = 0; n < N_TASKS; ++n)
+	{
+	  t.task_num = n;
+	  delegated_context[n_delegated] = i;
+	  delegated_task[n_delegated] = n;
+	  if (par_delegate_task() != n_delegated)
+	    {
+	      printf("task %d was given the wrong id   FAILED\n", n_delegated);
+	      ++n_failures;
+	    }
+	  ++n_delegated;
+	}
     }
-
   par_finish();
-  fprintf(f, "Master finished.\n");
-  fflush(f);
-  fclose(f);
-  Report("Done!!\n");
+
+  if (n_results != n_delegated)
+    {
+      printf("%d of %d results were delivered   FAILED\n",
+	     n_results, n_delegated);
+      ++n_failures;
+    }
+  if (par_enabled() && par_workers() > 1 && n_out_of_order == 0)
+    {
+      printf("no task completed out of order with %d workers   FAILED\n",
+	     par_workers());
+      ++n_failures;
+    }
+  printf("%d workers, %d tasks, %d completed out of order\n",
+	 par_workers(), n_results, n_out_of_order);
+  if (n_failures > 0)
+    printf("%d checks FAILED\n", n_failures);
+  else
+    printf("results were correct and delivered in order\n");
+}
+
+void
+MasterResult (Par_Task id)
+{
+  if (id != n_results)
+    {
+      printf("result %d was delivered in place of %d   FAILED\n",
+	     id, n_results);
+      ++n_failures;
+    }
+  else if (res.task_num != delegated_task[id] ||
+	   res.context_num != delegated_context[id] ||
+	   res.value != 1000*(delegated_context[id]+1) + res.task_num)
+    {
+      printf("result %d is for task %d of context %d, value %d   FAILED\n",
+	     id, res.task_num, res.context_num, res.value);
+      ++n_failures;
+    }
+  if (res.finish_time < latest_finish)
+    ++n_out_of_order;
+  else
+    latest_finish = res.finish_time;
+  ++n_results;
 }
 
 /* SLAVE PROCEDURES */
@@ -134,55 +200,73 @@ MasterTask (int argc,
 void
 SlaveContext ()
 {
-  char name[80];
-
-  sprintf(name, "slave%d", getpid());
-  sf = fopen(name, "w");
-  fprintf(sf, "Got new context: %s\n", c.context_name);
-  fflush(f);
+  slave_context_num = c.context_num;
 }
 
 void
 SlaveTask ()
 {
-  fprintf(sf, "Got a task: %s\n", t.task_name);
-  fflush(f);
-  sleep(4);
-  fprintf(sf, "Finished task: %s\n", t.task_name);
-  fflush(f);
+  if (t.task_num % 4 == 0)
+    usleep(SLOW_TASK_USEC);
+  res.task_num = t.task_num;
+  res.context_num = slave_context_num;
+  res.value = c.scale + t.task_num;
+  res.finish_time = Now();
 }
 
 /* UTILITY FUNCTIONS */
 
-/* PVM-RELATED FUNCTIONS */
+static double
+Now ()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return(tv.tv_sec + 1.0e-6*tv.tv_usec);
+}
+
+/* PACKING FUNCTIONS */
 
-#ifdef PVM
 void
 PackContext ()
 {
-  if (pvm_pkstr(c.context_name) < 0)
-    Abort("Could not pack context.\n");
+  par_pkint(c.context_num);
+  par_pkint(c.scale);
 }
 
 void
 UnpackContext ()
 {
-  if (pvm_upkstr(c.context_name) < 0)
-    Abort("Could not unpack context.\n");
+  c.context_num = par_upkint();
+  c.scale = par_upkint();
 }
 
 void
 PackTask ()
 {
-  if (pvm_pkstr(t.task_name) < 0)
-    Abort("Could not pack task\n");
+  par_pkint(t.task_num);
 }
 
 void
 UnpackTask ()
 {
-  if (pvm_upkstr(t.task_name) < 0)
-    Abort("Could not unpack task\n");
+  t.task_num = par_upkint();
+}
+
+void
+PackResult ()
+{
+  par_pkint(res.task_num);
+  par_pkint(res.context_num);
+  par_pkint(res.value);
+  par_pkdouble(res.finish_time);
 }
-#endif
 
+void
+UnpackResult ()
+{
+  res.task_num = par_upkint();
+  res.context_num = par_upkint();
+  res.value = par_upkint();
+  res.finish_time = par_upkdouble();
+}